@@ -0,0 +1,330 @@
+/*
+* eos - A 3D Morphable Model fitting library written in modern C++11/14.
+*
+* File: benchmarks/eos-benchmarks.cpp
+*
+* Copyright 2017 Patrik Huber
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+#include "eos/core/Landmark.hpp"
+#include "eos/core/LandmarkMapper.hpp"
+#include "eos/core/ThreadPool.hpp"
+#include "eos/morphablemodel/MorphableModel.hpp"
+#include "eos/morphablemodel/Blendshape.hpp"
+#include "eos/morphablemodel/EdgeTopology.hpp"
+#include "eos/fitting/fitting.hpp"
+#include "eos/fitting/orthographic_camera_estimation_linear.hpp"
+#include "eos/fitting/linear_shape_fitting.hpp"
+#include "eos/fitting/blendshape_fitting.hpp"
+#include "eos/fitting/closest_edge_fitting.hpp"
+#include "eos/fitting/contour_correspondence.hpp"
+#include "eos/fitting/RenderingParameters.hpp"
+#include "eos/render/render.hpp"
+#include "eos/render/render_affine.hpp"
+#include "eos/render/texture_extraction.hpp"
+#include "eos/render/transform_vertices.hpp"
+#include "eos/render/utils.hpp"
+
+#include "benchmark/benchmark.h"
+
+#include "glm/gtc/quaternion.hpp"
+
+#include "Eigen/Core"
+
+#include "opencv2/core/core.hpp"
+#include "opencv2/highgui/highgui.hpp"
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <random>
+#include <limits>
+#include <tuple>
+#include <stdexcept>
+
+using namespace eos;
+using eos::core::Landmark;
+using eos::core::LandmarkCollection;
+using cv::Mat;
+using cv::Vec2f;
+using cv::Vec4f;
+using std::vector;
+using std::string;
+
+/**
+ * Reads an ibug .pts landmark file and returns an ordered vector with
+ * the 68 2D landmark coordinates.
+ *
+ * @param[in] filename Path to a .pts file.
+ * @return An ordered vector with the 68 ibug landmarks.
+ */
+LandmarkCollection<Vec2f> read_pts_landmarks(string filename)
+{
+	using std::getline;
+	LandmarkCollection<Vec2f> landmarks;
+	landmarks.reserve(68);
+
+	std::ifstream file(filename);
+	if (!file.is_open()) {
+		throw std::runtime_error(string("Could not open landmark file: " + filename));
+	}
+
+	string line;
+	// Skip the first 3 lines, they're header lines:
+	getline(file, line); // 'version: 1'
+	getline(file, line); // 'n_points : 68'
+	getline(file, line); // '{'
+
+	int ibugId = 1;
+	while (getline(file, line))
+	{
+		if (line == "}") { // end of the file
+			break;
+		}
+		std::stringstream lineStream(line);
+
+		Landmark<Vec2f> landmark;
+		landmark.name = std::to_string(ibugId);
+		if (!(lineStream >> landmark.coordinates[0] >> landmark.coordinates[1])) {
+			throw std::runtime_error(string("Landmark format error while parsing the line: " + line));
+		}
+		// The .pts files are 1-based (Matlab convention), so shift every point by 1:
+		landmark.coordinates[0] -= 1.0f;
+		landmark.coordinates[1] -= 1.0f;
+		landmarks.emplace_back(landmark);
+		++ibugId;
+	}
+	return landmarks;
+};
+
+/**
+ * The model, the example image with its landmarks, and a fitting result that the
+ * benchmarks of the individual steps start from. Loaded once, on first use.
+ */
+struct BenchmarkData
+{
+	morphablemodel::MorphableModel morphable_model;
+	vector<morphablemodel::Blendshape> blendshapes;
+	core::LandmarkMapper landmark_mapper;
+	fitting::ModelContour model_contour;
+	fitting::ContourLandmarks contour_landmarks;
+	morphablemodel::EdgeTopology edge_topology;
+	Mat image;
+	LandmarkCollection<Vec2f> landmarks;
+
+	// The landmarks that have a mapping, and their vertices:
+	vector<Vec2f> image_points;
+	vector<int> vertex_indices;
+
+	// The result of a fit_shape_and_pose() with a few iterations:
+	core::Mesh mesh;
+	fitting::RenderingParameters rendering_params;
+	Mat affine_camera_matrix;
+	vector<float> shape_coefficients;
+	render::Texture texture;
+	vector<Eigen::Vector2f> image_edges; ///< The outline of the rendered mesh, as stand-in for an edge detector.
+
+	static const BenchmarkData& get()
+	{
+		static const BenchmarkData data;
+		return data;
+	};
+
+private:
+	BenchmarkData()
+	{
+		const string share_dir = EOS_BENCHMARK_SHARE_DIR;
+		const string data_dir = EOS_BENCHMARK_DATA_DIR;
+		morphable_model = morphablemodel::load_model(share_dir + "/sfm_shape_3448.bin");
+		blendshapes = morphablemodel::load_blendshapes(share_dir + "/expression_blendshapes_3448.bin");
+		landmark_mapper = core::LandmarkMapper(share_dir + "/ibug_to_sfm.txt");
+		model_contour = fitting::ModelContour::load(share_dir + "/model_contours.json");
+		contour_landmarks = fitting::ContourLandmarks::load(share_dir + "/ibug_to_sfm.txt");
+		edge_topology = morphablemodel::load_edge_topology(share_dir + "/sfm_3448_edge_topology.json");
+		image = cv::imread(data_dir + "/image_0010.png");
+		if (image.empty()) {
+			throw std::runtime_error("Could not load the image " + data_dir + "/image_0010.png.");
+		}
+		landmarks = read_pts_landmarks(data_dir + "/image_0010.pts");
+
+		for (const auto& landmark : landmarks)
+		{
+			const auto converted_name = landmark_mapper.convert(landmark.name);
+			if (!converted_name) { // no mapping defined for the current landmark
+				continue;
+			}
+			vertex_indices.push_back(std::stoi(converted_name.get()));
+			image_points.push_back(landmark.coordinates);
+		}
+
+		vector<float> blendshape_coefficients;
+		vector<Vec2f> fitted_image_points;
+		std::tie(mesh, rendering_params) = fitting::fit_shape_and_pose(morphable_model, blendshapes, landmarks, landmark_mapper, image.cols, image.rows, edge_topology, contour_landmarks, model_contour, 5, boost::none, 30.0f, boost::none, shape_coefficients, blendshape_coefficients, fitted_image_points);
+		affine_camera_matrix = fitting::get_3x4_affine_camera_matrix(rendering_params, image.cols, image.rows);
+		texture = render::create_mipmapped_texture(render::extract_texture(mesh, affine_camera_matrix, image));
+
+		const Mat depthbuffer = render::render_affine(mesh, affine_camera_matrix, image.cols, image.rows).second;
+		const auto is_face = [&depthbuffer](int x, int y) { return depthbuffer.at<float>(y, x) != std::numeric_limits<float>::max(); };
+		for (int y = 1; y < depthbuffer.rows - 1; ++y) {
+			for (int x = 1; x < depthbuffer.cols - 1; ++x) {
+				if (is_face(x, y) && !(is_face(x - 1, y) && is_face(x + 1, y) && is_face(x, y - 1) && is_face(x, y + 1))) {
+					image_edges.emplace_back(static_cast<float>(x), static_cast<float>(y));
+				}
+			}
+		}
+	};
+};
+
+static void BM_draw_sample(benchmark::State& state)
+{
+	const auto& data = BenchmarkData::get();
+	std::mt19937 engine;
+	std::normal_distribution<float> distribution;
+	vector<float> coefficients(data.morphable_model.get_shape_model().get_num_principal_components());
+	for (auto& coefficient : coefficients) {
+		coefficient = distribution(engine);
+	}
+	while (state.KeepRunning()) {
+		benchmark::DoNotOptimize(data.morphable_model.draw_sample(coefficients, vector<float>()));
+	}
+}
+BENCHMARK(BM_draw_sample);
+
+static void BM_fit_shape_to_landmarks_linear(benchmark::State& state)
+{
+	const auto& data = BenchmarkData::get();
+	while (state.KeepRunning()) {
+		benchmark::DoNotOptimize(fitting::fit_shape_to_landmarks_linear(data.morphable_model, data.affine_camera_matrix, data.image_points, data.vertex_indices));
+	}
+}
+BENCHMARK(BM_fit_shape_to_landmarks_linear);
+
+static void BM_fit_blendshapes_to_landmarks_nnls(benchmark::State& state)
+{
+	const auto& data = BenchmarkData::get();
+	const Eigen::VectorXf face_instance = data.morphable_model.get_shape_model().draw_sample(data.shape_coefficients);
+	while (state.KeepRunning()) {
+		benchmark::DoNotOptimize(fitting::fit_blendshapes_to_landmarks_nnls(data.blendshapes, face_instance, data.affine_camera_matrix, data.image_points, data.vertex_indices));
+	}
+}
+BENCHMARK(BM_fit_blendshapes_to_landmarks_nnls);
+
+static void BM_transform_vertices(benchmark::State& state)
+{
+	const auto& data = BenchmarkData::get();
+	const glm::mat4x4 rotation = glm::mat4_cast(data.rendering_params.get_rotation());
+	vector<glm::vec4> rotated_vertices;
+	while (state.KeepRunning()) {
+		render::transform_vertices(core::VertexView(data.mesh.vertices), rotation, rotated_vertices);
+		benchmark::DoNotOptimize(rotated_vertices.data());
+	}
+}
+BENCHMARK(BM_transform_vertices);
+
+// Argument: The render::VisibilityMethod.
+static void BM_occluding_boundary_vertices(benchmark::State& state)
+{
+	const auto& data = BenchmarkData::get();
+	const glm::mat4x4 rotation = glm::mat4_cast(data.rendering_params.get_rotation());
+	const auto visibility_method = static_cast<render::VisibilityMethod>(state.range(0));
+	while (state.KeepRunning()) {
+		benchmark::DoNotOptimize(fitting::occluding_boundary_vertices(data.mesh, data.edge_topology, rotation, visibility_method));
+	}
+}
+BENCHMARK(BM_occluding_boundary_vertices)->Arg(static_cast<int>(render::VisibilityMethod::RayCasting))->Arg(static_cast<int>(render::VisibilityMethod::DepthBuffer));
+
+static void BM_find_occluding_edge_correspondences(benchmark::State& state)
+{
+	const auto& data = BenchmarkData::get();
+	while (state.KeepRunning()) {
+		benchmark::DoNotOptimize(fitting::find_occluding_edge_correspondences(data.mesh, data.edge_topology, data.rendering_params, data.image_edges));
+	}
+}
+BENCHMARK(BM_find_occluding_edge_correspondences);
+
+// Argument: The number of iterations of the fitting.
+static void BM_fit_shape_and_pose(benchmark::State& state)
+{
+	const auto& data = BenchmarkData::get();
+	while (state.KeepRunning()) {
+		benchmark::DoNotOptimize(fitting::fit_shape_and_pose(data.morphable_model, data.blendshapes, data.landmarks, data.landmark_mapper, data.image.cols, data.image.rows, data.edge_topology, data.contour_landmarks, data.model_contour, static_cast<int>(state.range(0)), boost::none, 30.0f));
+	}
+}
+BENCHMARK(BM_fit_shape_and_pose)->Arg(1)->Arg(5)->Arg(50)->Unit(benchmark::kMillisecond);
+
+static void BM_render(benchmark::State& state)
+{
+	const auto& data = BenchmarkData::get();
+	while (state.KeepRunning()) {
+		benchmark::DoNotOptimize(render::render(data.mesh, data.rendering_params.get_modelview(), data.rendering_params.get_projection(), data.image.cols, data.image.rows, data.texture, true));
+	}
+}
+BENCHMARK(BM_render)->Unit(benchmark::kMillisecond);
+
+static void BM_render_affine(benchmark::State& state)
+{
+	const auto& data = BenchmarkData::get();
+	while (state.KeepRunning()) {
+		benchmark::DoNotOptimize(render::render_affine(data.mesh, data.affine_camera_matrix, data.image.cols, data.image.rows));
+	}
+}
+BENCHMARK(BM_render_affine)->Unit(benchmark::kMillisecond);
+
+// Argument: The resolution of the isomap.
+static void BM_extract_texture_affine(benchmark::State& state)
+{
+	const auto& data = BenchmarkData::get();
+	while (state.KeepRunning()) {
+		benchmark::DoNotOptimize(render::extract_texture(data.mesh, data.affine_camera_matrix, data.image, false, render::TextureInterpolation::NearestNeighbour, static_cast<int>(state.range(0))));
+	}
+}
+BENCHMARK(BM_extract_texture_affine)->Arg(256)->Arg(512)->Arg(1024)->Unit(benchmark::kMillisecond);
+
+// Argument: The render::TextureInterpolation. Before timing, checks that the tiled extraction on a
+// thread pool gives exactly the same isomap as the serial one.
+static void BM_extract_texture_affine_threaded(benchmark::State& state)
+{
+	const auto& data = BenchmarkData::get();
+	const auto mapping_type = static_cast<render::TextureInterpolation>(state.range(0));
+	core::ThreadPool thread_pool(4);
+	const Mat serial_isomap = render::extract_texture(data.mesh, data.affine_camera_matrix, data.image, false, mapping_type, 512);
+	const Mat tiled_isomap = render::extract_texture(data.mesh, data.affine_camera_matrix, data.image, false, mapping_type, 512, &thread_pool);
+	if (cv::norm(serial_isomap, tiled_isomap, cv::NORM_INF) != 0.0) {
+		state.SkipWithError("The isomap extracted on the thread pool differs from the serial one.");
+		return;
+	}
+	while (state.KeepRunning()) {
+		benchmark::DoNotOptimize(render::extract_texture(data.mesh, data.affine_camera_matrix, data.image, false, mapping_type, 512, &thread_pool));
+	}
+}
+BENCHMARK(BM_extract_texture_affine_threaded)->Arg(static_cast<int>(render::TextureInterpolation::NearestNeighbour))->Arg(static_cast<int>(render::TextureInterpolation::Bilinear))->Arg(static_cast<int>(render::TextureInterpolation::Area))->Unit(benchmark::kMillisecond);
+
+// Argument: The resolution of the isomap.
+static void BM_extract_texture_perspective(benchmark::State& state)
+{
+	const auto& data = BenchmarkData::get();
+	const glm::vec4 viewport = fitting::get_opencv_viewport(data.image.cols, data.image.rows);
+	while (state.KeepRunning()) {
+		benchmark::DoNotOptimize(render::extract_texture(data.mesh, data.rendering_params.get_modelview(), data.rendering_params.get_projection(), viewport, data.image, false, static_cast<int>(state.range(0))));
+	}
+}
+BENCHMARK(BM_extract_texture_perspective)->Arg(256)->Arg(512)->Arg(1024)->Unit(benchmark::kMillisecond);
+
+/**
+ * Runs the benchmarks of eos. All of Google Benchmark's options are supported, e.g.
+ * --benchmark_filter=<regex> to run only some of them, and
+ * --benchmark_out=<file> --benchmark_out_format=json to write machine-readable results.
+ */
+BENCHMARK_MAIN();
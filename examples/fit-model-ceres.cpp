@@ -23,6 +23,7 @@
 #include "eos/morphablemodel/Blendshape.hpp"
 #include "eos/fitting/contour_correspondence.hpp"
 #include "eos/fitting/ceres_nonlinear.hpp"
+#include "eos/fitting/ceres_fitting.hpp"
 #include "eos/fitting/fitting.hpp"
 
 #include "glm/glm.hpp"
@@ -39,6 +40,8 @@
 #include "boost/filesystem.hpp"
 
 #include <vector>
+#include <algorithm>
+#include <cmath>
 #include <chrono>
 #include <iostream>
 #include <fstream>
@@ -121,6 +124,42 @@ LandmarkCollection<cv::Vec2f> read_pts_landmarks(std::string filename)
 	return landmarks;
 };
 
+/**
+ * Evaluates two cost functions with the same parameter blocks at the given
+ * parameters, and returns the largest absolute difference of their residuals
+ * and Jacobians. Used to validate the analytic cost functions against the
+ * autodiff ones.
+ */
+double max_difference(const CostFunction& cost_function, const CostFunction& reference, const vector<double*>& parameters)
+{
+	const int num_residuals = cost_function.num_residuals();
+	const auto& block_sizes = cost_function.parameter_block_sizes();
+	vector<double> residuals(num_residuals), reference_residuals(num_residuals);
+	vector<vector<double>> jacobians, reference_jacobians;
+	vector<double*> jacobian_ptrs, reference_jacobian_ptrs;
+	for (auto&& block_size : block_sizes) {
+		jacobians.emplace_back(num_residuals * block_size);
+		reference_jacobians.emplace_back(num_residuals * block_size);
+	}
+	for (std::size_t i = 0; i < block_sizes.size(); ++i) {
+		jacobian_ptrs.push_back(jacobians[i].data());
+		reference_jacobian_ptrs.push_back(reference_jacobians[i].data());
+	}
+	cost_function.Evaluate(parameters.data(), residuals.data(), jacobian_ptrs.data());
+	reference.Evaluate(parameters.data(), reference_residuals.data(), reference_jacobian_ptrs.data());
+
+	double difference = 0.0;
+	for (int i = 0; i < num_residuals; ++i) {
+		difference = std::max(difference, std::abs(residuals[i] - reference_residuals[i]));
+	}
+	for (std::size_t i = 0; i < jacobians.size(); ++i) {
+		for (std::size_t j = 0; j < jacobians[i].size(); ++j) {
+			difference = std::max(difference, std::abs(jacobians[i][j] - reference_jacobians[i][j]));
+		}
+	}
+	return difference;
+};
+
 /**
  * Single and multi-image non-linear model fitting with Ceres example.
  *
@@ -128,10 +167,14 @@ LandmarkCollection<cv::Vec2f> read_pts_landmarks(std::string filename)
  * albedo model. It can be acquired from CVSSP - see the GitHub main page.
  * If you don't currently have it, and still want to try the Ceres fitting,
  * the ImageCost can just be removed.
+ *
+ * The cost functions with analytic Jacobians are used. With --check-jacobians,
+ * they are compared to the autodiff cost functions before the full fitting.
  */
 int main(int argc, char *argv[])
 {
 	fs::path modelfile, isomapfile, imagefile, landmarksfile, mappingsfile, contourfile, blendshapesfile, outputfile;
+	bool check_jacobians = false;
 	try {
 		po::options_description desc("Allowed options");
 		desc.add_options()
@@ -151,6 +194,8 @@ int main(int argc, char *argv[])
 				"file with model contour indices")
 			("output,o", po::value<fs::path>(&outputfile)->required()->default_value("out"),
 				"basename for the output obj file")
+			("check-jacobians", po::bool_switch(&check_jacobians),
+				"compare the analytic cost functions to the autodiff ones and print the largest difference")
 			;
 		po::variables_map vm;
 		po::store(po::command_line_parser(argc, argv).options(desc).run(), vm);
@@ -211,6 +256,8 @@ int main(int argc, char *argv[])
 	}
 
 	constexpr bool use_perspective = false;
+	constexpr int num_shape_coefficients = 10; // The number of shape and colour coefficients that are fitted
+	constexpr int num_color_coefficients = 10;
 
 	// These will be the 2D image points and their corresponding 3D vertex id's used for the fitting:
 	vector<Vec2f> image_points; // the 2D landmark points
@@ -227,63 +274,32 @@ int main(int argc, char *argv[])
 		image_points.emplace_back(landmarks[i].coordinates);
 	}
 
+	// Colour model fitting needs a Morphable Model with colour (albedo) model, see the note above main():
+	if (!morphable_model.has_color_model())
+	{
+		cout << "Error: The MorphableModel used does not contain a colour (albedo) model. ImageCost requires a model that contains a colour PCA model. You may want to use the full Surrey Face Model or set num_color_coefficients to 0.";
+		return EXIT_FAILURE;
+	}
+	fitting::CeresFittingSettings fitting_settings;
+	fitting_settings.num_shape_coefficients = num_shape_coefficients;
+	fitting_settings.num_color_coefficients = num_color_coefficients;
+	fitting_settings.minimizer_progress_to_stdout = true;
+	// The fitter keeps the parameters and the Ceres problems, so for a video, it would be created once and fit() called for every frame.
+	fitting::CeresFitter fitter(morphable_model, blendshapes, image.cols, image.rows, use_perspective, fitting_settings);
+
 	// Estimate the camera (pose) from the 2D - 3D point correspondences
 	std::stringstream fitting_log;
 	auto start = std::chrono::steady_clock::now();
-
-	std::vector<double> camera_rotation; // Quaternion, [w x y z]. Todo: Actually, use std::array for all of these.
-	camera_rotation.resize(4); // initialises with zeros
-	camera_rotation[0] = 1.0;
-	std::vector<double> camera_translation_and_intrinsics;
-	constexpr int num_cam_trans_intr_params = use_perspective ? 4 : 3;
+	Solver::Summary solver_summary = fitter.fit_camera(image_points, vertex_indices);
+	std::cout << solver_summary.BriefReport() << "\n";
+	auto end = std::chrono::steady_clock::now();
 	// Parameters for the orthographic projection: [t_x, t_y, frustum_scale]
 	// And perspective projection: [t_x, t_y, t_z, fov].
 	// Origin is assumed at center of image, and no lens distortions.
 	// Note: Actually, we estimate the model-view matrix and not the camera position. But one defines the other.
-	camera_translation_and_intrinsics.resize(num_cam_trans_intr_params); // initialises with zeros
-	if (use_perspective)
-	{
-		camera_translation_and_intrinsics[2] = -400.0; // Move the model back (along the -z axis)
-		camera_translation_and_intrinsics[3] = glm::radians(45.0f); // fov
-	}
-	else {
-		camera_translation_and_intrinsics[2] = 110.0; // frustum_scale
-	}
-
-	std::vector<double> shape_coefficients;
-	shape_coefficients.resize(10); // Todo: Currently, the value '10' is hard-coded everywhere. Make it dynamic.
-	std::vector<double> blendshape_coefficients;
-	blendshape_coefficients.resize(6);
-
-	Problem camera_costfunction;
-	for (int i = 0; i < image_points.size(); ++i)
-	{
-		CostFunction* cost_function = new AutoDiffCostFunction<fitting::LandmarkCost, 2 /* num residuals */, 4 /* camera rotation (quaternion) */, num_cam_trans_intr_params /* camera translation & fov/frustum_scale */, 10 /* shape-coeffs */, 6 /* bs-coeffs */>(new fitting::LandmarkCost(morphable_model.get_shape_model(), blendshapes, image_points[i], vertex_indices[i], image.cols, image.rows, use_perspective));
-		camera_costfunction.AddResidualBlock(cost_function, NULL, &camera_rotation[0], &camera_translation_and_intrinsics[0], &shape_coefficients[0], &blendshape_coefficients[0]);
-	}
-	camera_costfunction.SetParameterBlockConstant(&shape_coefficients[0]); // keep the shape constant
-	camera_costfunction.SetParameterBlockConstant(&blendshape_coefficients[0]);
-	if (use_perspective)
-	{
-		camera_costfunction.SetParameterUpperBound(&camera_translation_and_intrinsics[0], 2, -std::numeric_limits<double>::epsilon()); // t_z has to be negative
-		camera_costfunction.SetParameterLowerBound(&camera_translation_and_intrinsics[0], 3, 0.01); // fov in radians, must be > 0
-	}
-	else {
-		camera_costfunction.SetParameterLowerBound(&camera_translation_and_intrinsics[0], 2, 1.0); // frustum_scale must be > 0
-	}
-	QuaternionParameterization* camera_fit_quaternion_parameterisation = new QuaternionParameterization;
-	camera_costfunction.SetParameterization(&camera_rotation[0], camera_fit_quaternion_parameterisation);
-	
-	Solver::Options solver_options;
-	solver_options.linear_solver_type = ITERATIVE_SCHUR;
-	solver_options.num_threads = 8;
-	solver_options.num_linear_solver_threads = 8; // only SPARSE_SCHUR can use this
-	solver_options.minimizer_progress_to_stdout = true;
-	//solver_options.max_num_iterations = 100;
-	Solver::Summary solver_summary;
-	Solve(solver_options, &camera_costfunction, &solver_summary);
-	std::cout << solver_summary.BriefReport() << "\n";
-	auto end = std::chrono::steady_clock::now();
+	auto camera_rotation = fitter.get_camera_rotation(); // Quaternion, [w x y z]
+	auto camera_translation_and_intrinsics = fitter.get_camera_translation_and_intrinsics();
+	constexpr int num_cam_trans_intr_params = use_perspective ? 4 : 3;
 
 	// Draw the mean-face landmarks projected using the estimated camera:
 	// Construct the rotation & translation (model-view) matrices, projection matrix, and viewport:
@@ -339,80 +355,38 @@ int main(int argc, char *argv[])
 	image_points = concat(image_points, image_points_contour);
 
 	// Full fitting - Estimate shape and pose, given the previous pose estimate:
-	start = std::chrono::steady_clock::now();
-	Problem fitting_costfunction;
-	// Landmark constraint:
-	for (int i = 0; i < image_points.size(); ++i)
-	{
-		CostFunction* cost_function = new AutoDiffCostFunction<fitting::LandmarkCost, 2 /* num residuals */, 4 /* camera rotation (quaternion) */, num_cam_trans_intr_params /* camera translation & focal length */, 10 /* shape-coeffs */, 6 /* bs-coeffs */>(new fitting::LandmarkCost(morphable_model.get_shape_model(), blendshapes, image_points[i], vertex_indices[i], image.cols, image.rows, use_perspective));
-		fitting_costfunction.AddResidualBlock(cost_function, NULL, &camera_rotation[0], &camera_translation_and_intrinsics[0], &shape_coefficients[0], &blendshape_coefficients[0]);
-	}
-	// Shape prior:
-	CostFunction* shape_prior_cost = new AutoDiffCostFunction<fitting::PriorCost, 10 /* num residuals */, 10 /* shape-coeffs */>(new fitting::PriorCost(10, 35.0));
-	fitting_costfunction.AddResidualBlock(shape_prior_cost, NULL, &shape_coefficients[0]);
-	for (int i=0; i < 10; ++i)
-	{
-		fitting_costfunction.SetParameterLowerBound(&shape_coefficients[0], i, -3.0);
-		fitting_costfunction.SetParameterUpperBound(&shape_coefficients[0], i,  3.0);
-	}
-	// Prior and constraints on blendshapes:
-	CostFunction* blendshapes_prior_cost = new AutoDiffCostFunction<fitting::PriorCost, 6 /* num residuals */, 6 /* bs-coeffs */>(new fitting::PriorCost(6, 10.0));
-	fitting_costfunction.AddResidualBlock(blendshapes_prior_cost, NULL, &blendshape_coefficients[0]);
-	fitting_costfunction.SetParameterLowerBound(&blendshape_coefficients[0], 0, 0.0);
-	fitting_costfunction.SetParameterLowerBound(&blendshape_coefficients[0], 1, 0.0);
-	fitting_costfunction.SetParameterLowerBound(&blendshape_coefficients[0], 2, 0.0);
-	fitting_costfunction.SetParameterLowerBound(&blendshape_coefficients[0], 3, 0.0);
-	fitting_costfunction.SetParameterLowerBound(&blendshape_coefficients[0], 4, 0.0);
-	fitting_costfunction.SetParameterLowerBound(&blendshape_coefficients[0], 5, 0.0);
-	// Some constraints on the camera translation and fov/scale:
-	if (use_perspective)
-	{
-		fitting_costfunction.SetParameterUpperBound(&camera_translation_and_intrinsics[0], 2, -std::numeric_limits<double>::epsilon()); // t_z has to be negative
-		fitting_costfunction.SetParameterLowerBound(&camera_translation_and_intrinsics[0], 3, 0.01); // fov in radians, must be > 0
-	}
-	else {
-		fitting_costfunction.SetParameterLowerBound(&camera_translation_and_intrinsics[0], 2, 1.0); // frustum_scale must be > 0
-	}
-
-	QuaternionParameterization* full_fit_quaternion_parameterisation = new QuaternionParameterization;
-	fitting_costfunction.SetParameterization(&camera_rotation[0], full_fit_quaternion_parameterisation);
-
-	// Colour model fitting (this needs a Morphable Model with colour (albedo) model, see note above main()):
-	if (!morphable_model.has_color_model())
-	{
-		cout << "Error: The MorphableModel used does not contain a colour (albedo) model. ImageCost requires a model that contains a colour PCA model. You may want to use the full Surrey Face Model or remove this section.";
-		return EXIT_FAILURE;
-	}
-	std::vector<double> colour_coefficients;
-	colour_coefficients.resize(10);
-	// Add a residual for each vertex:
-	for (int i = 0; i < morphable_model.get_shape_model().get_data_dimension() / 3; ++i)
-	{
-		CostFunction* cost_function = new AutoDiffCostFunction<fitting::ImageCost, 3 /* Residuals: [R, G, B] */, 4 /* camera rotation (quaternion) */, num_cam_trans_intr_params /* camera translation & focal length */, 10 /* shape-coeffs */, 6 /* bs-coeffs */, 10 /* colour coeffs */>(new fitting::ImageCost(morphable_model, blendshapes, image, i, use_perspective));
-		fitting_costfunction.AddResidualBlock(cost_function, NULL, &camera_rotation[0], &camera_translation_and_intrinsics[0], &shape_coefficients[0], &blendshape_coefficients[0], &colour_coefficients[0]);
-	}
-	// Prior for the colour coefficients:
-	CostFunction* colour_prior_cost = new AutoDiffCostFunction<fitting::PriorCost, 10 /* num residuals */, 10 /* colour-coeffs */>(new fitting::PriorCost(10, 35.0));
-	fitting_costfunction.AddResidualBlock(colour_prior_cost, NULL, &colour_coefficients[0]);
-	for (int i = 0; i < 10; ++i)
+	if (check_jacobians)
 	{
-		fitting_costfunction.SetParameterLowerBound(&colour_coefficients[0], i, -3.0);
-		fitting_costfunction.SetParameterUpperBound(&colour_coefficients[0], i, 3.0);
+		// The cost functions are evaluated at the current parameters of the fitter:
+		auto shape_coefficients = fitter.get_shape_coefficients();
+		auto blendshape_coefficients = fitter.get_blendshape_coefficients();
+		auto colour_coefficients = fitter.get_color_coefficients();
+		const vector<double*> landmark_parameters{ &camera_rotation[0], &camera_translation_and_intrinsics[0], &shape_coefficients[0], &blendshape_coefficients[0] };
+		const vector<double*> image_parameters{ &camera_rotation[0], &camera_translation_and_intrinsics[0], &shape_coefficients[0], &blendshape_coefficients[0], &colour_coefficients[0] };
+		double max_jacobian_difference = 0.0;
+		for (int i = 0; i < image_points.size(); ++i)
+		{
+			fitting::LandmarkCostFunction cost_function(morphable_model.get_shape_model(), blendshapes, image_points[i], vertex_indices[i], image.cols, image.rows, use_perspective, num_shape_coefficients);
+			AutoDiffCostFunction<fitting::LandmarkCost, 2 /* num residuals */, 4 /* camera rotation (quaternion) */, num_cam_trans_intr_params /* camera translation & focal length */, num_shape_coefficients, 6 /* bs-coeffs */> reference(new fitting::LandmarkCost(morphable_model.get_shape_model(), blendshapes, image_points[i], vertex_indices[i], image.cols, image.rows, use_perspective, num_shape_coefficients));
+			max_jacobian_difference = std::max(max_jacobian_difference, max_difference(cost_function, reference, landmark_parameters));
+		}
+		for (int i = 0; i < morphable_model.get_shape_model().get_data_dimension() / 3; ++i)
+		{
+			fitting::ImageCostFunction cost_function(morphable_model, blendshapes, image, i, use_perspective, num_shape_coefficients, num_color_coefficients);
+			AutoDiffCostFunction<fitting::ImageCost, 3 /* Residuals: [R, G, B] */, 4 /* camera rotation (quaternion) */, num_cam_trans_intr_params /* camera translation & focal length */, num_shape_coefficients, 6 /* bs-coeffs */, num_color_coefficients> reference(new fitting::ImageCost(morphable_model, blendshapes, image, i, use_perspective, num_shape_coefficients, num_color_coefficients));
+			max_jacobian_difference = std::max(max_jacobian_difference, max_difference(cost_function, reference, image_parameters));
+		}
+		cout << "Largest difference between the analytic and autodiff cost functions: " << max_jacobian_difference << endl;
 	}
-
-	// Set different options for the full fitting:
-/*	solver_options.linear_solver_type = ceres::ITERATIVE_SCHUR;
-	//solver_options.linear_solver_type = ceres::DENSE_QR;
-	//solver_options.minimizer_type = ceres::TRUST_REGION; // default I think
-	//solver_options.minimizer_type = ceres::LINE_SEARCH;
-	solver_options.num_threads = 8;
-	solver_options.num_linear_solver_threads = 8; // only SPARSE_SCHUR can use this
-	solver_options.minimizer_progress_to_stdout = true;
-	solver_options.max_num_iterations = 100;
-	*/
-	Solve(solver_options, &fitting_costfunction, &solver_summary);
+	start = std::chrono::steady_clock::now();
+	solver_summary = fitter.fit(image_points, vertex_indices, image);
 	std::cout << solver_summary.BriefReport() << "\n";
 	end = std::chrono::steady_clock::now();
+	camera_rotation = fitter.get_camera_rotation();
+	camera_translation_and_intrinsics = fitter.get_camera_translation_and_intrinsics();
+	const auto& shape_coefficients = fitter.get_shape_coefficients();
+	const auto& blendshape_coefficients = fitter.get_blendshape_coefficients();
+	const auto& colour_coefficients = fitter.get_color_coefficients();
 	
 	// Draw the landmarks projected using all estimated parameters:
 	// Construct the rotation & translation (model-view) matrices, projection matrix, and viewport:
@@ -0,0 +1,323 @@
+/*
+ * eos - A 3D Morphable Model fitting library written in modern C++11/14.
+ *
+ * File: examples/generate-faces.cpp
+ *
+ * Copyright 2017 Patrik Huber
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "eos/core/Mesh.hpp"
+#include "eos/core/BoundedQueue.hpp"
+#include "eos/morphablemodel/MorphableModel.hpp"
+#include "eos/morphablemodel/Blendshape.hpp"
+#include "eos/render/render.hpp"
+#include "glm/gtc/matrix_transform.hpp"
+
+#include "Eigen/Core"
+
+#include "opencv2/core/core.hpp"
+#include "opencv2/highgui/highgui.hpp"
+
+#include "boost/program_options.hpp"
+#include "boost/filesystem.hpp"
+
+#include <vector>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <random>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <iostream>
+#include <algorithm>
+
+using namespace eos;
+namespace po = boost::program_options;
+namespace fs = boost::filesystem;
+using std::vector;
+using std::string;
+using std::cout;
+using std::endl;
+
+namespace {
+
+// The parameters of one generated face, i.e. its labels:
+struct FaceParameters
+{
+	int index;
+	vector<float> shape_coefficients;
+	vector<float> colour_coefficients;
+	vector<float> blendshape_coefficients;
+	float yaw, pitch, roll; // in degrees
+};
+
+// A sampled face, output of the sampling stage:
+struct SampledFace
+{
+	FaceParameters parameters;
+	Eigen::VectorXf shape;
+	Eigen::VectorXf colour;
+};
+
+// A rendered face, output of the rendering stage:
+struct RenderedFace
+{
+	FaceParameters parameters;
+	core::Mesh mesh;
+	cv::Mat image;
+	cv::Mat depth;
+};
+
+// Converts the depth buffer of render::render() to 16 bit: The depth in [-1, 1] is mapped to
+// [1, 65535], and pixels without a face (infinite depth) are 0.
+cv::Mat depth_to_16bit(const cv::Mat& depthbuffer)
+{
+	cv::Mat depth(depthbuffer.size(), CV_16UC1);
+	for (int y = 0; y < depthbuffer.rows; ++y) {
+		for (int x = 0; x < depthbuffer.cols; ++x) {
+			const float z = depthbuffer.at<float>(y, x);
+			depth.at<ushort>(y, x) = (z > 1.0) ? 0 : cv::saturate_cast<ushort>(1.0 + (z + 1.0) / 2.0 * 65534.0);
+		}
+	}
+	return depth;
+};
+
+std::string write_labels(const FaceParameters& parameters)
+{
+	std::stringstream line;
+	line << parameters.index << "," << parameters.yaw << "," << parameters.pitch << "," << parameters.roll;
+	for (const auto& coefficients : { &parameters.shape_coefficients, &parameters.colour_coefficients, &parameters.blendshape_coefficients }) {
+		line << ",";
+		for (std::size_t i = 0; i < coefficients->size(); ++i) {
+			line << (i > 0 ? " " : "") << (*coefficients)[i];
+		}
+	}
+	return line.str();
+};
+
+} /* unnamed namespace */
+
+/**
+ * This app generates many random faces from the model, e.g. as training data, and
+ * stores a rendering, a depth map, optionally the mesh, and the parameters of each.
+ *
+ * It runs as a pipeline of three stages, connected by bounded queues: One thread
+ * draws the model parameters and computes the shapes in batches (one matrix-matrix
+ * product per batch), several threads render the faces, and several threads write
+ * the results to disk. The queues keep the memory bounded if one stage is slower.
+ *
+ * The parameters of all faces are written to labels.csv in the output directory,
+ * one line per face: index, yaw, pitch, roll (degrees), and the shape, colour and
+ * blendshape coefficients, each as a space-separated list.
+ */
+int main(int argc, char *argv[])
+{
+	fs::path model_file, blendshapes_file, output_directory;
+	int num_faces, batch_size, image_size, num_render_threads, num_write_threads, queue_size;
+	unsigned int seed;
+	float shape_sigma, colour_sigma, blendshape_min, blendshape_max, yaw_range, pitch_range, roll_range;
+	bool write_meshes;
+
+	try {
+		po::options_description desc("Allowed options");
+		desc.add_options()
+			("help",
+				"produce help message")
+			("model", po::value<fs::path>(&model_file)->required(),
+				"an eos .bin Morphable Model file")
+			("blendshapes", po::value<fs::path>(&blendshapes_file),
+				"optional file with blendshapes that are added with random coefficients")
+			("output-dir", po::value<fs::path>(&output_directory)->default_value("generated"),
+				"directory to write the generated faces to. Will be created if it doesn't exist.")
+			("num-faces", po::value<int>(&num_faces)->default_value(1000),
+				"number of faces to generate")
+			("batch-size", po::value<int>(&batch_size)->default_value(64),
+				"number of faces whose shapes are computed together")
+			("shape-sigma", po::value<float>(&shape_sigma)->default_value(1.0f),
+				"standard deviation of the shape coefficients")
+			("colour-sigma", po::value<float>(&colour_sigma)->default_value(1.0f),
+				"standard deviation of the colour coefficients")
+			("blendshape-min", po::value<float>(&blendshape_min)->default_value(0.0f),
+				"minimum of the uniformly drawn blendshape coefficients")
+			("blendshape-max", po::value<float>(&blendshape_max)->default_value(1.0f),
+				"maximum of the uniformly drawn blendshape coefficients")
+			("yaw-range", po::value<float>(&yaw_range)->default_value(40.0f),
+				"the yaw is drawn uniformly from [-yaw-range, yaw-range] degrees")
+			("pitch-range", po::value<float>(&pitch_range)->default_value(20.0f),
+				"the pitch is drawn uniformly from [-pitch-range, pitch-range] degrees")
+			("roll-range", po::value<float>(&roll_range)->default_value(10.0f),
+				"the roll is drawn uniformly from [-roll-range, roll-range] degrees")
+			("image-size", po::value<int>(&image_size)->default_value(256),
+				"width and height of the rendered images")
+			("render-threads", po::value<int>(&num_render_threads)->default_value(0),
+				"number of threads that render the faces, 0 to use the number of hardware threads")
+			("write-threads", po::value<int>(&num_write_threads)->default_value(2),
+				"number of threads that write the results to disk")
+			("queue-size", po::value<int>(&queue_size)->default_value(256),
+				"maximum number of faces waiting between two stages of the pipeline")
+			("write-meshes", po::bool_switch(&write_meshes),
+				"write the mesh of every face as obj file too")
+			("seed", po::value<unsigned int>(&seed)->default_value(0),
+				"seed of the random number generator")
+			;
+
+		po::variables_map vm;
+		po::store(po::parse_command_line(argc, argv, desc), vm);
+		if (vm.count("help")) {
+			cout << "Usage: generate-faces [options]" << endl;
+			cout << desc;
+			return EXIT_SUCCESS;
+		}
+		po::notify(vm);
+	}
+	catch (const po::error& e) {
+		cout << "Error while parsing command-line arguments: " << e.what() << endl;
+		cout << "Use --help to display a list of options." << endl;
+		return EXIT_FAILURE;
+	}
+	if (num_render_threads <= 0) {
+		num_render_threads = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+	}
+	num_write_threads = std::max(1, num_write_threads);
+	batch_size = std::max(1, batch_size);
+
+	morphablemodel::MorphableModel morphable_model;
+	vector<morphablemodel::Blendshape> blendshapes;
+	try {
+		morphable_model = morphablemodel::load_model(model_file.string(), morphablemodel::PcaBasisStorage::RescaledOnly);
+		if (!blendshapes_file.empty()) {
+			blendshapes = morphablemodel::load_blendshapes(blendshapes_file.string());
+		}
+	}
+	catch (const std::runtime_error& e) {
+		cout << "Error loading the Morphable Model or blendshapes: " << e.what() << endl;
+		return EXIT_FAILURE;
+	}
+	fs::create_directories(output_directory);
+
+	core::BoundedQueue<SampledFace> sampled_faces(queue_size);
+	core::BoundedQueue<RenderedFace> rendered_faces(queue_size);
+
+	// Stage 1: Draw the parameters and compute the shapes and colours, a batch at a time:
+	std::thread sampler([&]() {
+		std::mt19937 engine(seed);
+		std::normal_distribution<float> shape_distribution(0.0f, shape_sigma);
+		std::normal_distribution<float> colour_distribution(0.0f, colour_sigma);
+		std::uniform_real_distribution<float> blendshape_distribution(blendshape_min, blendshape_max);
+		std::uniform_real_distribution<float> unit_distribution(-1.0f, 1.0f);
+		const auto& shape_model = morphable_model.get_shape_model();
+		const auto& colour_model = morphable_model.get_color_model();
+		Eigen::MatrixXf shapes, colours;
+		for (int first_face = 0; first_face < num_faces; first_face += batch_size)
+		{
+			const int num_batch_faces = std::min(batch_size, num_faces - first_face);
+			Eigen::MatrixXf shape_coefficients = Eigen::MatrixXf::NullaryExpr(shape_model.get_num_principal_components(), num_batch_faces, [&]() { return shape_distribution(engine); });
+			Eigen::MatrixXf colour_coefficients = Eigen::MatrixXf::NullaryExpr(colour_model.get_num_principal_components(), num_batch_faces, [&]() { return colour_distribution(engine); });
+			Eigen::MatrixXf blendshape_coefficients = Eigen::MatrixXf::NullaryExpr(blendshapes.size(), num_batch_faces, [&]() { return blendshape_distribution(engine); });
+			morphable_model.draw_shape_samples(shape_coefficients, blendshapes, blendshape_coefficients, shapes);
+			if (morphable_model.has_color_model()) {
+				colour_model.draw_samples(colour_coefficients, colours);
+			}
+
+			for (int i = 0; i < num_batch_faces; ++i)
+			{
+				SampledFace face;
+				face.parameters.index = first_face + i;
+				face.parameters.shape_coefficients.assign(shape_coefficients.col(i).data(), shape_coefficients.col(i).data() + shape_coefficients.rows());
+				face.parameters.colour_coefficients.assign(colour_coefficients.col(i).data(), colour_coefficients.col(i).data() + colour_coefficients.rows());
+				face.parameters.blendshape_coefficients.assign(blendshape_coefficients.col(i).data(), blendshape_coefficients.col(i).data() + blendshape_coefficients.rows());
+				face.parameters.yaw = yaw_range * unit_distribution(engine);
+				face.parameters.pitch = pitch_range * unit_distribution(engine);
+				face.parameters.roll = roll_range * unit_distribution(engine);
+				face.shape = shapes.col(i);
+				if (morphable_model.has_color_model()) {
+					face.colour = colours.col(i);
+				}
+				if (!sampled_faces.push(std::move(face))) {
+					return;
+				}
+			}
+		}
+		sampled_faces.close();
+	});
+
+	// Stage 2: Render the faces:
+	vector<std::thread> renderers;
+	std::mutex renderers_mutex;
+	int num_running_renderers = num_render_threads;
+	for (int t = 0; t < num_render_threads; ++t)
+	{
+		renderers.emplace_back([&]() {
+			render::Framebuffer framebuffer(image_size, image_size); // reused for all faces of this thread
+			while (auto face = sampled_faces.pop())
+			{
+				RenderedFace rendered;
+				rendered.parameters = std::move(face->parameters);
+				rendered.mesh = morphablemodel::sample_to_mesh(face->shape, face->colour, morphable_model.get_shape_model().get_triangle_list(), morphable_model.get_color_model().get_triangle_list(), morphable_model.get_texture_coordinates());
+				glm::mat4x4 model_view(1.0f);
+				model_view = glm::rotate(model_view, glm::radians(rendered.parameters.roll), glm::vec3(0.0f, 0.0f, 1.0f));
+				model_view = glm::rotate(model_view, glm::radians(rendered.parameters.pitch), glm::vec3(1.0f, 0.0f, 0.0f));
+				model_view = glm::rotate(model_view, glm::radians(rendered.parameters.yaw), glm::vec3(0.0f, 1.0f, 0.0f));
+				render::render(rendered.mesh, model_view, glm::ortho(-130.0f, 130.0f, -130.0f, 130.0f, -200.0f, 200.0f), framebuffer, boost::none, true, false, false);
+				rendered.image = framebuffer.get_colourbuffer().clone(); // the framebuffer is overwritten by the next face
+				rendered.depth = depth_to_16bit(framebuffer.get_depthbuffer());
+				if (!rendered_faces.push(std::move(rendered))) {
+					return;
+				}
+			}
+			std::lock_guard<std::mutex> lock(renderers_mutex);
+			if (--num_running_renderers == 0) {
+				rendered_faces.close(); // the last renderer tells the writers to finish
+			}
+		});
+	}
+
+	// Stage 3: Write the results:
+	std::ofstream labels_file((output_directory / "labels.csv").string());
+	labels_file << "index,yaw,pitch,roll,shape_coefficients,colour_coefficients,blendshape_coefficients" << endl;
+	std::mutex labels_mutex;
+	vector<std::thread> writers;
+	for (int t = 0; t < num_write_threads; ++t)
+	{
+		writers.emplace_back([&]() {
+			while (auto face = rendered_faces.pop())
+			{
+				std::stringstream basename;
+				basename << std::setw(8) << std::setfill('0') << face->parameters.index;
+				const fs::path base = output_directory / basename.str();
+				cv::imwrite(base.string() + ".png", face->image);
+				cv::imwrite(base.string() + "_depth.png", face->depth);
+				if (write_meshes) {
+					core::write_obj(face->mesh, base.string() + ".obj");
+				}
+				const auto labels = write_labels(face->parameters);
+				std::lock_guard<std::mutex> lock(labels_mutex);
+				labels_file << labels << "\n";
+			}
+		});
+	}
+
+	sampler.join();
+	for (auto&& renderer : renderers) {
+		renderer.join();
+	}
+	for (auto&& writer : writers) {
+		writer.join();
+	}
+
+	cout << "Wrote " << num_faces << " faces to " << output_directory << "." << endl;
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,127 @@
+/*
+ * eos - A 3D Morphable Model fitting library written in modern C++11/14.
+ *
+ * File: include/eos/core/BoundedQueue.hpp
+ *
+ * Copyright 2017 Patrik Huber
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#ifndef BOUNDEDQUEUE_HPP_
+#define BOUNDEDQUEUE_HPP_
+
+#include "boost/optional.hpp"
+
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <cstddef>
+#include <cassert>
+
+namespace eos {
+	namespace core {
+
+/**
+ * @brief A thread-safe first-in first-out queue with a maximum size, to connect
+ * the stages of a producer/consumer pipeline.
+ *
+ * push() blocks while the queue is full, so a fast producer waits for its consumers
+ * instead of filling up the memory. pop() blocks while the queue is empty. After
+ * close(), push() fails, and pop() returns the remaining items and then boost::none,
+ * which tells the consumers to finish.
+ */
+template <typename T>
+class BoundedQueue
+{
+public:
+	/**
+	 * @brief Creates an empty queue.
+	 *
+	 * @param[in] capacity The maximum number of items in the queue. Must be at least 1.
+	 */
+	explicit BoundedQueue(std::size_t capacity) : capacity(capacity)
+	{
+		assert(capacity > 0);
+	};
+
+	BoundedQueue(const BoundedQueue&) = delete;
+	BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+	/**
+	 * @brief Adds an item at the end, waiting while the queue is full.
+	 *
+	 * @param[in] item The item to add.
+	 * @return False if the queue has been closed, in which case the item is dropped.
+	 */
+	bool push(T item)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		not_full.wait(lock, [this]() { return closed || items.size() < capacity; });
+		if (closed) {
+			return false;
+		}
+		items.push_back(std::move(item));
+		lock.unlock();
+		not_empty.notify_one();
+		return true;
+	};
+
+	/**
+	 * @brief Removes the first item, waiting while the queue is empty.
+	 *
+	 * @return The item, or boost::none if the queue is closed and empty.
+	 */
+	boost::optional<T> pop()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		not_empty.wait(lock, [this]() { return closed || !items.empty(); });
+		if (items.empty()) {
+			return boost::none;
+		}
+		boost::optional<T> item(std::move(items.front()));
+		items.pop_front();
+		lock.unlock();
+		not_full.notify_one();
+		return item;
+	};
+
+	/**
+	 * @brief Closes the queue: No more items can be added, and waiting calls return.
+	 *
+	 * Items that are already in the queue can still be popped.
+	 */
+	void close()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			closed = true;
+		}
+		not_full.notify_all();
+		not_empty.notify_all();
+	};
+
+private:
+	const std::size_t capacity;
+	std::deque<T> items;
+	bool closed = false;
+	std::mutex mutex;
+	std::condition_variable not_full;
+	std::condition_variable not_empty;
+};
+
+	} /* namespace core */
+} /* namespace eos */
+
+#endif /* BOUNDEDQUEUE_HPP_ */
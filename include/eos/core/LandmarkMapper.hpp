@@ -29,6 +29,7 @@
 
 #include <string>
 #include <map>
+#include <utility>
 
 namespace eos {
 	namespace core {
@@ -93,6 +94,15 @@ public:
 		}
 	};
 
+	/**
+	 * @brief Constructs a new landmark mapper from the given mappings.
+	 *
+	 * @param[in] landmark_mappings Mappings from one set of landmark identifiers to another. If empty, the mapper performs an identity mapping.
+	 */
+	LandmarkMapper(std::map<std::string, std::string> landmark_mappings) : landmark_mappings(std::move(landmark_mappings))
+	{
+	};
+
 	/**
 	 * @brief Converts the given landmark name to the mapped name.
 	 *
@@ -129,6 +139,16 @@ public:
 		return landmark_mappings.size();
 	};
 
+	/**
+	 * @brief Returns all loaded landmark mappings.
+	 *
+	 * @return The landmark mappings, from the original to the mapped name.
+	 */
+	const std::map<std::string, std::string>& get_mappings() const
+	{
+		return landmark_mappings;
+	};
+
 private:
 	std::map<std::string, std::string> landmark_mappings; ///< Mapping from one landmark name to a name in a different format.
 };
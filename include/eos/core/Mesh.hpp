@@ -31,8 +31,14 @@
 #include <vector>
 #include <array>
 #include <string>
+#include <memory>
 #include <cassert>
 #include <fstream>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
 
 namespace eos {
 	namespace core {
@@ -55,42 +61,245 @@ struct Mesh
 };
 
 /**
- * @brief Writes the given Mesh to an obj file that for example can be read by MeshLab.
+ * @brief The parts of a mesh that are the same for all instances of a model:
+ * The triangle lists and the texture coordinates.
  *
- * If the mesh contains vertex colour information, it will be written to the obj as well.
+ * It is meant to be created once (e.g. by MorphableModel::get_topology()) and
+ * shared between many mesh instances, via a std::shared_ptr<const MeshTopology>.
+ */
+struct MeshTopology
+{
+	std::vector<glm::vec2> texcoords; ///< Texture coordinates for each vertex.
+
+	std::vector<std::array<int, 3>> tvi; ///< Triangle vertex indices
+	std::vector<std::array<int, 3>> tci; ///< Triangle color indices
+};
+
+/**
+ * @brief A mesh that references a shared, immutable topology instead of owning
+ * a copy of the triangle lists and texture coordinates.
  *
- * @param[in] mesh The mesh to save as obj.
- * @param[in] filename Output filename (including ".obj").
+ * Only the vertex positions and colours are stored per instance, which makes it
+ * much smaller than a Mesh when many instances of the same model are kept around,
+ * e.g. in a keyframe store. Use to_mesh() to get a Mesh that can be rendered or saved.
  */
-inline void write_obj(Mesh mesh, std::string filename)
+struct SharedTopologyMesh
 {
-	assert(mesh.vertices.size() == mesh.colors.size() || mesh.colors.empty());
+	std::vector<glm::vec4> vertices; ///< 3D vertex positions.
+	std::vector<glm::vec3> colors; ///< Colour information for each vertex. Expected to be in RGB order.
+
+	std::shared_ptr<const MeshTopology> topology; ///< The triangle lists and texture coordinates, shared with other instances.
+};
+
+/**
+ * @brief Creates a Mesh (with its own copy of the topology) from a SharedTopologyMesh.
+ *
+ * @param[in] mesh The mesh with a shared topology.
+ * @return A Mesh with the same vertices, colours and topology.
+ */
+inline Mesh to_mesh(const SharedTopologyMesh& mesh)
+{
+	Mesh result;
+	result.vertices = mesh.vertices;
+	result.colors = mesh.colors;
+	if (mesh.topology) {
+		result.texcoords = mesh.topology->texcoords;
+		result.tvi = mesh.topology->tvi;
+		result.tci = mesh.topology->tci;
+	}
+	return result;
+};
+
+	namespace detail {
+
+/**
+ * @brief Formats text into a large buffer and writes it to a file in big blocks.
+ *
+ * Much faster than formatting with operator<< of an std::ofstream and flushing
+ * every line with std::endl. Numbers are formatted like a default std::ostream
+ * would format them.
+ */
+class BufferedTextWriter
+{
+public:
+	explicit BufferedTextWriter(const std::string& filename) : filename(filename), file(filename)
+	{
+		if (file.fail()) {
+			throw std::runtime_error("Error opening given file for writing: " + filename);
+		}
+		buffer.reserve(capacity);
+	};
+
+	// Writes what is left, but can't report errors. Call flush() before, to make sure the file is complete.
+	~BufferedTextWriter()
+	{
+		if (!buffer.empty() && file.good()) {
+			file.write(buffer.data(), buffer.size());
+		}
+	};
+
+	BufferedTextWriter& operator<<(const std::string& text)
+	{
+		buffer.append(text);
+		flush_if_full();
+		return *this;
+	};
+
+	BufferedTextWriter& operator<<(const char* text)
+	{
+		buffer.append(text);
+		flush_if_full();
+		return *this;
+	};
+
+	BufferedTextWriter& operator<<(char c)
+	{
+		buffer.push_back(c);
+		flush_if_full();
+		return *this;
+	};
 
-	std::ofstream obj_file(filename);
+	BufferedTextWriter& operator<<(float value)
+	{
+		char text[32];
+		const int length = std::snprintf(text, sizeof(text), "%g", value); // same as std::ostream with the default precision of 6
+		buffer.append(text, length);
+		flush_if_full();
+		return *this;
+	};
+
+	BufferedTextWriter& operator<<(int value)
+	{
+		char text[16];
+		const int length = std::snprintf(text, sizeof(text), "%d", value);
+		buffer.append(text, length);
+		flush_if_full();
+		return *this;
+	};
 
+	/**
+	 * Writes the buffered text to the file.
+	 *
+	 * @throw std::runtime_error When writing to the file fails, e.g. because the disk is full.
+	 */
+	void flush()
+	{
+		file.write(buffer.data(), buffer.size());
+		file.flush();
+		buffer.clear();
+		if (file.fail()) {
+			throw std::runtime_error("Error writing to the file: " + filename);
+		}
+	};
+
+private:
+	static const std::size_t capacity = 1 << 20;
+	std::string filename; // for the error messages
+	std::ofstream file;
+	std::string buffer;
+
+	void flush_if_full()
+	{
+		if (buffer.size() >= capacity) {
+			flush();
+		}
+	};
+};
+
+inline void write_obj_vertices(const Mesh& mesh, BufferedTextWriter& obj_file)
+{
 	if (mesh.colors.empty()) {
 		for (std::size_t i = 0; i < mesh.vertices.size(); ++i) {
-			obj_file << "v " << mesh.vertices[i][0] << " " << mesh.vertices[i][1] << " " << mesh.vertices[i][2] << std::endl;
+			obj_file << "v " << mesh.vertices[i][0] << ' ' << mesh.vertices[i][1] << ' ' << mesh.vertices[i][2] << '\n';
 		}
 	}
 	else {
 		for (std::size_t i = 0; i < mesh.vertices.size(); ++i) {
-			obj_file << "v " << mesh.vertices[i][0] << " " << mesh.vertices[i][1] << " " << mesh.vertices[i][2] << " " << mesh.colors[i][0] << " " << mesh.colors[i][1] << " " << mesh.colors[i][2] << std::endl;
+			obj_file << "v " << mesh.vertices[i][0] << ' ' << mesh.vertices[i][1] << ' ' << mesh.vertices[i][2] << ' ' << mesh.colors[i][0] << ' ' << mesh.colors[i][1] << ' ' << mesh.colors[i][2] << '\n';
 		}
 	}
+};
 
-	if (!mesh.texcoords.empty())
-	{
-		for (auto&& tc : mesh.texcoords)
-		{
-			obj_file << "vt " << tc[0] << " " << tc[1] << std::endl;
-		}
+// FNV-1a, over the raw bytes of the given data:
+inline std::uint64_t hash_bytes(const void* data, std::size_t num_bytes, std::uint64_t hash = 14695981039346656037ull)
+{
+	const auto* bytes = static_cast<const unsigned char*>(data);
+	for (std::size_t i = 0; i < num_bytes; ++i) {
+		hash = (hash ^ bytes[i]) * 1099511628211ull;
+	}
+	return hash;
+};
+
+inline std::uint64_t hash_topology(const std::vector<glm::vec2>& texcoords, const std::vector<std::array<int, 3>>& tvi, const std::vector<std::array<int, 3>>& tci)
+{
+	std::uint64_t hash = hash_bytes(tvi.data(), tvi.size() * sizeof(tvi[0]));
+	hash = hash_bytes(tci.data(), tci.size() * sizeof(tci[0]), hash);
+	return hash_bytes(texcoords.data(), texcoords.size() * sizeof(texcoords[0]), hash);
+};
+
+// The header of the files written by write_binary_vertices():
+struct BinaryVerticesHeader
+{
+	char magic[8];
+	std::uint32_t version;
+	std::uint32_t has_colors;
+	std::uint64_t num_vertices;
+	std::uint64_t topology_hash;
+};
+
+inline void write_binary_vertices(const std::vector<glm::vec4>& vertices, const std::vector<glm::vec3>& colors, std::uint64_t topology_hash, const std::string& filename)
+{
+	assert(vertices.size() == colors.size() || colors.empty());
+	BinaryVerticesHeader header = { { 'E', 'O', 'S', 'V', 'E', 'R', 'T', '\0' }, 1, colors.empty() ? 0u : 1u, vertices.size(), topology_hash };
+	// Positions only, without the w coordinate:
+	std::vector<float> data;
+	data.reserve(vertices.size() * (colors.empty() ? 3 : 6));
+	for (const auto& v : vertices) {
+		data.insert(end(data), { v[0], v[1], v[2] });
+	}
+	for (const auto& c : colors) {
+		data.insert(end(data), { c[0], c[1], c[2] });
+	}
+	std::ofstream file(filename, std::ios::binary);
+	if (file.fail()) {
+		throw std::runtime_error("Error opening given file for writing: " + filename);
+	}
+	file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	file.write(reinterpret_cast<const char*>(data.data()), data.size() * sizeof(float));
+	file.close();
+	if (file.fail()) {
+		throw std::runtime_error("Error writing to the file: " + filename);
+	}
+};
+
+	} /* namespace detail */
+
+/**
+ * @brief Writes the given Mesh to an obj file that for example can be read by MeshLab.
+ *
+ * If the mesh contains vertex colour information, it will be written to the obj as well.
+ *
+ * @param[in] mesh The mesh to save as obj.
+ * @param[in] filename Output filename (including ".obj").
+ * @throw std::runtime_error When the file can't be opened for writing, or writing to it fails.
+ */
+inline void write_obj(const Mesh& mesh, std::string filename)
+{
+	assert(mesh.vertices.size() == mesh.colors.size() || mesh.colors.empty());
+
+	detail::BufferedTextWriter obj_file(filename);
+
+	detail::write_obj_vertices(mesh, obj_file);
+
+	for (auto&& tc : mesh.texcoords) {
+		obj_file << "vt " << tc[0] << ' ' << tc[1] << '\n';
 	}
 
 	for (auto&& v : mesh.tvi) {
 		// Add one because obj starts counting triangle indices at 1
-		obj_file << "f " << v[0] + 1 << " " << v[1] + 1 << " " << v[2] + 1 << std::endl;
+		obj_file << "f " << v[0] + 1 << ' ' << v[1] + 1 << ' ' << v[2] + 1 << '\n';
 	}
+	obj_file.flush();
 
 	return;
 }
@@ -105,54 +314,200 @@ inline void write_obj(Mesh mesh, std::string filename)
  *
  * @param[in] mesh The mesh to save as obj.
  * @param[in] filename Output filename, including .obj.
+ * @throw std::runtime_error When the files can't be opened for writing, or writing to them fails.
  */
-inline void write_textured_obj(Mesh mesh, std::string filename)
+inline void write_textured_obj(const Mesh& mesh, std::string filename)
 {
 	assert((mesh.vertices.size() == mesh.colors.size() || mesh.colors.empty()) && !mesh.texcoords.empty());
 
-	std::ofstream obj_file(filename);
+	detail::BufferedTextWriter obj_file(filename);
 
 	boost::filesystem::path mtl_filename(filename);
 	mtl_filename.replace_extension(".mtl");
 
-	obj_file << "mtllib " << mtl_filename.filename().string() << std::endl; // first line of the obj file
+	obj_file << "mtllib " << mtl_filename.filename().string() << '\n'; // first line of the obj file
 
-	// same as in write_obj():
-	if (mesh.colors.empty()) {
-		for (std::size_t i = 0; i < mesh.vertices.size(); ++i) {
-			obj_file << "v " << mesh.vertices[i][0] << " " << mesh.vertices[i][1] << " " << mesh.vertices[i][2] << " " << std::endl;
-		}
-	}
-	else {
-		for (std::size_t i = 0; i < mesh.vertices.size(); ++i) {
-			obj_file << "v " << mesh.vertices[i][0] << " " << mesh.vertices[i][1] << " " << mesh.vertices[i][2] << " " << mesh.colors[i][0] << " " << mesh.colors[i][1] << " " << mesh.colors[i][2] << " " << std::endl;
-		}
-	}
-	// end
+	detail::write_obj_vertices(mesh, obj_file);
 
 	for (std::size_t i = 0; i < mesh.texcoords.size(); ++i) {
-		obj_file << "vt " << mesh.texcoords[i][0] << " " << 1.0f - mesh.texcoords[i][1] << std::endl;
+		obj_file << "vt " << mesh.texcoords[i][0] << ' ' << 1.0f - mesh.texcoords[i][1] << '\n';
 		// We invert y because Meshlab's uv origin (0, 0) is on the bottom-left
 	}
 
-	obj_file << "usemtl FaceTexture" << std::endl; // the name of our texture (material) will be 'FaceTexture'
+	obj_file << "usemtl FaceTexture\n"; // the name of our texture (material) will be 'FaceTexture'
 
 	for (auto&& v : mesh.tvi) {
 		// This assumes mesh.texcoords.size() == mesh.vertices.size(). The texture indices could theoretically be different (for example in the cube-mapped 3D scan)
 		// Add one because obj starts counting triangle indices at 1
-		obj_file << "f " << v[0] + 1 << "/" << v[0] + 1 << " " << v[1] + 1 << "/" << v[1] + 1 << " " << v[2] + 1 << "/" << v[2] + 1 << std::endl;
+		obj_file << "f " << v[0] + 1 << '/' << v[0] + 1 << ' ' << v[1] + 1 << '/' << v[1] + 1 << ' ' << v[2] + 1 << '/' << v[2] + 1 << '\n';
 	}
+	obj_file.flush();
 
 	std::ofstream mtl_file(mtl_filename.string());
 	boost::filesystem::path texture_filename(filename);
 	texture_filename.replace_extension(".isomap.png");
 
-	mtl_file << "newmtl FaceTexture" << std::endl;
-	mtl_file << "map_Kd " << texture_filename.filename().string() << std::endl;
+	mtl_file << "newmtl FaceTexture\n";
+	mtl_file << "map_Kd " << texture_filename.filename().string() << '\n';
+	mtl_file.close();
+	if (mtl_file.fail()) {
+		throw std::runtime_error("Error writing to the file: " + mtl_filename.string());
+	}
 
 	return;
 };
 
+/**
+ * @brief Writes the given Mesh to a binary ply file, which is much smaller and faster
+ * to write and read than an obj file.
+ *
+ * Vertex colours are expected to be in [0, 1] and are stored as 8 bit per channel.
+ * Texture coordinates are stored as the "s" and "t" vertex properties, which MeshLab
+ * reads.
+ *
+ * @param[in] mesh The mesh to save as ply.
+ * @param[in] filename Output filename (including ".ply").
+ * @throw std::runtime_error When the file can't be opened for writing, or writing to it fails.
+ */
+inline void write_ply(const Mesh& mesh, std::string filename)
+{
+	assert(mesh.vertices.size() == mesh.colors.size() || mesh.colors.empty());
+	assert(mesh.vertices.size() == mesh.texcoords.size() || mesh.texcoords.empty());
+
+	const std::uint16_t byte_order_test = 1;
+	const bool little_endian = *reinterpret_cast<const unsigned char*>(&byte_order_test) == 1;
+
+	std::string header = "ply\nformat " + std::string(little_endian ? "binary_little_endian" : "binary_big_endian") + " 1.0\ncomment written by eos\n";
+	header += "element vertex " + std::to_string(mesh.vertices.size()) + "\nproperty float x\nproperty float y\nproperty float z\n";
+	if (!mesh.colors.empty()) {
+		header += "property uchar red\nproperty uchar green\nproperty uchar blue\n";
+	}
+	if (!mesh.texcoords.empty()) {
+		header += "property float s\nproperty float t\n";
+	}
+	header += "element face " + std::to_string(mesh.tvi.size()) + "\nproperty list uchar int vertex_indices\nend_header\n";
+
+	// Assemble the whole body in memory, then write it at once:
+	const std::size_t vertex_size = 3 * sizeof(float) + (mesh.colors.empty() ? 0 : 3) + (mesh.texcoords.empty() ? 0 : 2 * sizeof(float));
+	const std::size_t face_size = 1 + 3 * sizeof(int);
+	std::vector<char> body(mesh.vertices.size() * vertex_size + mesh.tvi.size() * face_size);
+	char* out = body.data();
+	const auto append = [&out](const void* data, std::size_t num_bytes) {
+		std::memcpy(out, data, num_bytes);
+		out += num_bytes;
+	};
+	for (std::size_t i = 0; i < mesh.vertices.size(); ++i)
+	{
+		append(&mesh.vertices[i][0], 3 * sizeof(float));
+		if (!mesh.colors.empty()) {
+			for (int c = 0; c < 3; ++c) {
+				*out++ = static_cast<char>(static_cast<unsigned char>(std::min(std::max(mesh.colors[i][c], 0.0f), 1.0f) * 255.0f + 0.5f));
+			}
+		}
+		if (!mesh.texcoords.empty()) {
+			append(&mesh.texcoords[i][0], 2 * sizeof(float));
+		}
+	}
+	for (const auto& triangle : mesh.tvi)
+	{
+		*out++ = 3;
+		append(triangle.data(), 3 * sizeof(int));
+	}
+
+	std::ofstream ply_file(filename, std::ios::binary);
+	if (ply_file.fail()) {
+		throw std::runtime_error("Error opening given file for writing: " + filename);
+	}
+	ply_file.write(header.data(), header.size());
+	ply_file.write(body.data(), body.size());
+	ply_file.close();
+	if (ply_file.fail()) {
+		throw std::runtime_error("Error writing to the file: " + filename);
+	}
+};
+
+/**
+ * @brief Writes only the vertex positions (and colours, if any) of a mesh, in a
+ * compact binary format, for example to store the fitting results of many images.
+ *
+ * The topology is not stored, only a hash of it, so that read_binary_vertices()
+ * can check that the topology given to it is the right one. Store the topology once,
+ * e.g. as obj of the model's mean.
+ *
+ * @param[in] mesh The mesh whose vertices to write.
+ * @param[in] filename Output filename.
+ * @throw std::runtime_error When the file can't be opened for writing, or writing to it fails.
+ */
+inline void write_binary_vertices(const SharedTopologyMesh& mesh, std::string filename)
+{
+	const std::uint64_t topology_hash = mesh.topology ? detail::hash_topology(mesh.topology->texcoords, mesh.topology->tvi, mesh.topology->tci) : 0;
+	detail::write_binary_vertices(mesh.vertices, mesh.colors, topology_hash, filename);
+};
+
+/**
+ * @copydoc write_binary_vertices(const SharedTopologyMesh&, std::string)
+ */
+inline void write_binary_vertices(const Mesh& mesh, std::string filename)
+{
+	detail::write_binary_vertices(mesh.vertices, mesh.colors, detail::hash_topology(mesh.texcoords, mesh.tvi, mesh.tci), filename);
+};
+
+/**
+ * @brief Reads a file written by write_binary_vertices(), and combines it with
+ * the given topology into a mesh.
+ *
+ * @param[in] filename The file to read.
+ * @param[in] topology The topology of the mesh that was written, e.g. MorphableModel::get_topology().
+ * @return The mesh.
+ * @throw std::runtime_error When the file can't be read, or \p topology isn't the topology of the mesh that was written.
+ */
+inline SharedTopologyMesh read_binary_vertices(std::string filename, std::shared_ptr<const MeshTopology> topology)
+{
+	std::ifstream file(filename, std::ios::binary);
+	if (file.fail()) {
+		throw std::runtime_error("Error opening given file: " + filename);
+	}
+	detail::BinaryVerticesHeader header;
+	file.read(reinterpret_cast<char*>(&header), sizeof(header));
+	if (!file || std::memcmp(header.magic, "EOSVERT", 8) != 0 || header.version != 1) {
+		throw std::runtime_error("The given file is not a binary vertices file of a supported version: " + filename);
+	}
+	const std::uint64_t topology_hash = topology ? detail::hash_topology(topology->texcoords, topology->tvi, topology->tci) : 0;
+	if (header.topology_hash != topology_hash) {
+		throw std::runtime_error("The given topology is not the topology of the mesh in the file: " + filename);
+	}
+
+	// Don't trust num_vertices before checking it against the size of the data in the file:
+	const auto data_begin = file.tellg();
+	file.seekg(0, std::ios::end);
+	const auto data_end = file.tellg();
+	file.seekg(data_begin);
+	const std::uint64_t floats_per_vertex = header.has_colors ? 6 : 3;
+	if (!file || data_end < data_begin || header.num_vertices > static_cast<std::uint64_t>(data_end - data_begin) / sizeof(float) / floats_per_vertex) {
+		throw std::runtime_error("The binary vertices file is truncated: " + filename);
+	}
+	std::vector<float> data(header.num_vertices * floats_per_vertex);
+	file.read(reinterpret_cast<char*>(data.data()), data.size() * sizeof(float));
+	if (!file) {
+		throw std::runtime_error("The binary vertices file is truncated: " + filename);
+	}
+	SharedTopologyMesh mesh;
+	mesh.vertices.resize(header.num_vertices);
+	for (std::size_t i = 0; i < mesh.vertices.size(); ++i) {
+		mesh.vertices[i] = glm::vec4(data[3 * i], data[3 * i + 1], data[3 * i + 2], 1.0f);
+	}
+	if (header.has_colors)
+	{
+		const float* colors = data.data() + 3 * header.num_vertices;
+		mesh.colors.resize(header.num_vertices);
+		for (std::size_t i = 0; i < mesh.colors.size(); ++i) {
+			mesh.colors[i] = glm::vec3(colors[3 * i], colors[3 * i + 1], colors[3 * i + 2]);
+		}
+	}
+	mesh.topology = std::move(topology);
+	return mesh;
+};
+
 	} /* namespace core */
 } /* namespace eos */
 
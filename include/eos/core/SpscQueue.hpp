@@ -0,0 +1,133 @@
+/*
+ * eos - A 3D Morphable Model fitting library written in modern C++11/14.
+ *
+ * File: include/eos/core/SpscQueue.hpp
+ *
+ * Copyright 2017 Patrik Huber
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#ifndef SPSCQUEUE_HPP_
+#define SPSCQUEUE_HPP_
+
+#include "boost/optional.hpp"
+
+#include <vector>
+#include <atomic>
+#include <cstddef>
+#include <cassert>
+
+namespace eos {
+	namespace core {
+
+/**
+ * @brief A lock-free first-in first-out queue with a fixed capacity, for one
+ * producer and one consumer.
+ *
+ * try_push() and try_pop() never block and never allocate: The items are stored
+ * in a ring buffer that is allocated in the constructor. If the queue is full or
+ * empty, they return immediately, and the caller decides whether to retry, to
+ * drop the item, or to do something else in the meantime - unlike BoundedQueue,
+ * which blocks.
+ *
+ * At any time, only one thread may push and only one thread may pop. The
+ * producer and consumer threads can change, as long as the hand-over is
+ * synchronised (e.g. by a mutex or an atomic flag, as in video::VideoPipeline).
+ * empty() and full() can be called from any thread, but their result may be
+ * outdated by the time it's used.
+ */
+template <typename T>
+class SpscQueue
+{
+public:
+	/**
+	 * @brief Creates an empty queue.
+	 *
+	 * @param[in] capacity The maximum number of items in the queue. Must be at least 1.
+	 */
+	explicit SpscQueue(std::size_t capacity) : slots(capacity + 1) // one slot stays empty, to tell a full from an empty queue
+	{
+		assert(capacity > 0);
+	};
+
+	SpscQueue(const SpscQueue&) = delete;
+	SpscQueue& operator=(const SpscQueue&) = delete;
+
+	/**
+	 * @brief Adds an item at the end, if the queue is not full. Producer only.
+	 *
+	 * @param[in] item The item to add.
+	 * @return False if the queue is full, in which case the item is dropped.
+	 */
+	bool try_push(T item)
+	{
+		const std::size_t current_tail = tail.load(std::memory_order_relaxed);
+		const std::size_t next_tail = increment(current_tail);
+		if (next_tail == head.load(std::memory_order_acquire)) {
+			return false;
+		}
+		slots[current_tail] = std::move(item);
+		tail.store(next_tail, std::memory_order_release);
+		return true;
+	};
+
+	/**
+	 * @brief Removes the first item, if there is one. Consumer only.
+	 *
+	 * @return The item, or boost::none if the queue is empty.
+	 */
+	boost::optional<T> try_pop()
+	{
+		const std::size_t current_head = head.load(std::memory_order_relaxed);
+		if (current_head == tail.load(std::memory_order_acquire)) {
+			return boost::none;
+		}
+		boost::optional<T> item(std::move(slots[current_head]));
+		slots[current_head] = T(); // don't keep the moved-from item's resources alive
+		head.store(increment(current_head), std::memory_order_release);
+		return item;
+	};
+
+	bool empty() const
+	{
+		return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+	};
+
+	bool full() const
+	{
+		return increment(tail.load(std::memory_order_acquire)) == head.load(std::memory_order_acquire);
+	};
+
+	std::size_t capacity() const
+	{
+		return slots.size() - 1;
+	};
+
+private:
+	std::size_t increment(std::size_t index) const
+	{
+		return index + 1 == slots.size() ? 0 : index + 1;
+	};
+
+	std::vector<T> slots;
+	// On separate cache lines, so that the producer and consumer don't invalidate each other's cache:
+	alignas(64) std::atomic<std::size_t> head{ 0 }; // the next item to pop
+	alignas(64) std::atomic<std::size_t> tail{ 0 }; // the next slot to push to
+};
+
+	} /* namespace core */
+} /* namespace eos */
+
+#endif /* SPSCQUEUE_HPP_ */
@@ -0,0 +1,203 @@
+/*
+ * eos - A 3D Morphable Model fitting library written in modern C++11/14.
+ *
+ * File: include/eos/core/ThreadPool.hpp
+ *
+ * Copyright 2016 Patrik Huber
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#ifndef THREADPOOL_HPP_
+#define THREADPOOL_HPP_
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <exception>
+#include <algorithm>
+
+namespace eos {
+	namespace core {
+
+/**
+ * @brief A fixed-size pool of worker threads that runs parallel for-loops.
+ *
+ * parallel_for() distributes the indices of a loop dynamically over the worker
+ * threads and the calling thread, and returns when all indices are processed.
+ * Each call of the loop body also gets the index of the thread it runs on, in
+ * [0, get_num_threads()), which can be used to select per-thread scratch data
+ * (e.g. a fitting::FittingWorkspace).
+ *
+ * The results don't depend on the scheduling as long as the loop body writes
+ * only to data belonging to its loop index (or to its thread's scratch data).
+ *
+ * parallel_for() may be called from several threads, the calls are then run one
+ * after another. It must not be called from inside a loop body of the same pool.
+ */
+class ThreadPool
+{
+public:
+	/**
+	 * @brief Creates a pool that runs loops on \p num_threads threads, including
+	 * the thread that calls parallel_for().
+	 *
+	 * @param[in] num_threads The number of threads to use, or 0 to use the number of hardware threads.
+	 */
+	explicit ThreadPool(int num_threads = 0)
+	{
+		if (num_threads <= 0) {
+			num_threads = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+		}
+		// The calling thread works too, so we only need num_threads - 1 workers:
+		for (int i = 1; i < num_threads; ++i)
+		{
+			workers.emplace_back([this, i]() { worker_loop(i); });
+		}
+	};
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	~ThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		job_available.notify_all();
+		for (auto&& worker : workers) {
+			worker.join();
+		}
+	};
+
+	/**
+	 * Returns the number of threads that loops are run on, including the calling thread.
+	 *
+	 * @return The number of threads.
+	 */
+	int get_num_threads() const
+	{
+		return static_cast<int>(workers.size()) + 1;
+	};
+
+	/**
+	 * @brief Calls \p body(i, thread_index) for every i in [begin, end), in parallel.
+	 *
+	 * Blocks until all calls have returned. If a call throws, the remaining indices
+	 * are skipped and the first exception is rethrown here.
+	 *
+	 * @param[in] begin The first loop index.
+	 * @param[in] end One past the last loop index.
+	 * @param[in] body A function void(int index, int thread_index).
+	 */
+	void parallel_for(int begin, int end, const std::function<void(int, int)>& body)
+	{
+		if (begin >= end) {
+			return;
+		}
+		std::lock_guard<std::mutex> call_lock(call_mutex); // one loop at a time
+		if (workers.empty() || end - begin == 1) { // Nothing to distribute
+			for (int i = begin; i < end; ++i) {
+				body(i, 0);
+			}
+			return;
+		}
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			job = &body;
+			next_index = begin;
+			end_index = end;
+			first_exception = nullptr;
+			num_busy_workers = static_cast<int>(workers.size());
+			++generation;
+		}
+		job_available.notify_all();
+
+		run_job(body, 0);
+
+		std::unique_lock<std::mutex> lock(mutex);
+		job_done.wait(lock, [this]() { return num_busy_workers == 0; });
+		job = nullptr;
+		if (first_exception) {
+			std::rethrow_exception(first_exception);
+		}
+	};
+
+private:
+	// Processes loop indices until there are none left.
+	void run_job(const std::function<void(int, int)>& body, int thread_index)
+	{
+		int i;
+		while ((i = next_index++) < end_index)
+		{
+			try {
+				body(i, thread_index);
+			}
+			catch (...) {
+				std::lock_guard<std::mutex> lock(mutex);
+				if (!first_exception) {
+					first_exception = std::current_exception();
+				}
+				next_index = end_index.load(); // skip the rest
+			}
+		}
+	};
+
+	void worker_loop(int thread_index)
+	{
+		unsigned long long seen_generation = 0;
+		while (true)
+		{
+			const std::function<void(int, int)>* current_job;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				job_available.wait(lock, [&]() { return stopping || generation != seen_generation; });
+				if (stopping) {
+					return;
+				}
+				seen_generation = generation;
+				current_job = job;
+			}
+			run_job(*current_job, thread_index);
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				--num_busy_workers;
+			}
+			job_done.notify_one();
+		}
+	};
+
+	std::vector<std::thread> workers;
+	std::mutex call_mutex; // serialises calls to parallel_for()
+
+	std::mutex mutex; // protects everything below, apart from the atomics
+	std::condition_variable job_available;
+	std::condition_variable job_done;
+	const std::function<void(int, int)>* job = nullptr;
+	std::atomic<int> next_index{ 0 };
+	std::atomic<int> end_index{ 0 };
+	int num_busy_workers = 0;
+	unsigned long long generation = 0;
+	std::exception_ptr first_exception;
+	bool stopping = false;
+};
+
+	} /* namespace core */
+} /* namespace eos */
+
+#endif /* THREADPOOL_HPP_ */
@@ -0,0 +1,264 @@
+/*
+ * eos - A 3D Morphable Model fitting library written in modern C++11/14.
+ *
+ * File: include/eos/core/Trace.hpp
+ *
+ * Copyright 2016 Patrik Huber
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#ifndef TRACE_HPP_
+#define TRACE_HPP_
+
+#include <vector>
+#include <string>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <map>
+#include <ostream>
+#include <fstream>
+#include <cstdint>
+#include <stdexcept>
+
+namespace eos {
+	namespace core {
+
+/**
+ * @brief Receives the timings of the stages of the fitting, rendering and texture
+ * extraction functions, and counters like the number of correspondences found.
+ *
+ * The functions that take a TraceSink* report to it if it isn't nullptr. Otherwise,
+ * the tracing costs a null pointer check per stage, and nothing else.
+ *
+ * Stage and counter names are string literals, so implementations can keep the
+ * pointers. Stages may be reported from several threads at the same time (e.g. the
+ * per-image steps of fitting::fit_shape_and_pose_multi() on a thread pool), so
+ * implementations have to be thread-safe.
+ */
+class TraceSink
+{
+public:
+	using Clock = std::chrono::steady_clock;
+
+	virtual ~TraceSink() = default;
+
+	/**
+	 * Called at the end of each stage, from the thread that ran the stage.
+	 *
+	 * @param[in] name The name of the stage.
+	 * @param[in] begin When the stage started.
+	 * @param[in] end When the stage ended.
+	 */
+	virtual void stage(const char* name, Clock::time_point begin, Clock::time_point end) = 0;
+
+	/**
+	 * Called with the value of a counter, e.g. the number of triangles rasterised.
+	 *
+	 * @param[in] name The name of the counter.
+	 * @param[in] value Its current value.
+	 */
+	virtual void counter(const char* name, std::int64_t value) = 0;
+};
+
+/**
+ * @brief Reports the time from its construction to its destruction (or to end()) as
+ * a stage to a TraceSink, if one is given.
+ */
+class ScopedTrace
+{
+public:
+	/**
+	 * @param[in] sink The sink to report to, or nullptr to do nothing.
+	 * @param[in] name The name of the stage, a string literal.
+	 */
+	ScopedTrace(TraceSink* sink, const char* name) : sink(sink), name(name)
+	{
+		if (sink) {
+			begin = TraceSink::Clock::now();
+		}
+	};
+
+	~ScopedTrace()
+	{
+		end();
+	};
+
+	/**
+	 * Ends the stage before the end of the scope.
+	 */
+	void end()
+	{
+		if (sink) {
+			sink->stage(name, begin, TraceSink::Clock::now());
+			sink = nullptr;
+		}
+	};
+
+	ScopedTrace(const ScopedTrace&) = delete;
+	ScopedTrace& operator=(const ScopedTrace&) = delete;
+
+private:
+	TraceSink* sink;
+	const char* name;
+	TraceSink::Clock::time_point begin;
+};
+
+/**
+ * Reports the value of a counter to \p sink, if it isn't nullptr.
+ *
+ * @param[in] sink The sink to report to, or nullptr to do nothing.
+ * @param[in] name The name of the counter, a string literal.
+ * @param[in] value Its current value.
+ */
+inline void trace_counter(TraceSink* sink, const char* name, std::int64_t value)
+{
+	if (sink) {
+		sink->counter(name, value);
+	}
+};
+
+/**
+ * @brief A TraceSink that records all events, and writes them in the Chrome trace
+ * event format (JSON).
+ *
+ * The files can be opened in chrome://tracing or https://ui.perfetto.dev. The
+ * stages are shown per thread, the counters as graphs over time. Times are in
+ * microseconds since the construction of the writer (or the last clear()).
+ */
+class ChromeTraceWriter : public TraceSink
+{
+public:
+	ChromeTraceWriter() : start(Clock::now())
+	{
+	};
+
+	void stage(const char* name, Clock::time_point begin, Clock::time_point end) override
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		events.push_back({ name, 'X', to_microseconds(begin), to_microseconds(end) - to_microseconds(begin), get_thread_index(), 0 });
+	};
+
+	void counter(const char* name, std::int64_t value) override
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		events.push_back({ name, 'C', to_microseconds(Clock::now()), 0, get_thread_index(), value });
+	};
+
+	/**
+	 * Removes all recorded events, and restarts the time at 0.
+	 */
+	void clear()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		events.clear();
+		start = Clock::now();
+	};
+
+	/**
+	 * Returns the number of recorded events.
+	 */
+	std::size_t get_num_events() const
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return events.size();
+	};
+
+	/**
+	 * Writes all recorded events as JSON object in the Chrome trace event format.
+	 *
+	 * @param[in] stream The stream to write to.
+	 */
+	void write(std::ostream& stream) const
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stream << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+		for (std::size_t i = 0; i < events.size(); ++i)
+		{
+			const auto& event = events[i];
+			stream << (i == 0 ? "\n" : ",\n") << "{\"name\":\"" << escape(event.name) << "\",\"ph\":\"" << event.phase << "\",\"ts\":" << event.timestamp << ",\"pid\":0,\"tid\":" << event.thread;
+			if (event.phase == 'X') {
+				stream << ",\"dur\":" << event.duration << "}";
+			} else {
+				stream << ",\"args\":{\"value\":" << event.value << "}}";
+			}
+		}
+		stream << "\n]}\n";
+	};
+
+	/**
+	 * Writes all recorded events to a file, see write().
+	 *
+	 * Throws a std::runtime_error if the file can't be written.
+	 *
+	 * @param[in] filename The file to write, e.g. "trace.json".
+	 */
+	void save(std::string filename) const
+	{
+		std::ofstream file(filename);
+		if (!file) {
+			throw std::runtime_error("ChromeTraceWriter: Could not open the file " + filename + " for writing.");
+		}
+		write(file);
+		if (!file) {
+			throw std::runtime_error("ChromeTraceWriter: Error while writing the file " + filename + ".");
+		}
+	};
+
+private:
+	struct Event
+	{
+		const char* name;
+		char phase; ///< 'X' for a stage ("complete event"), 'C' for a counter.
+		std::int64_t timestamp; ///< In microseconds.
+		std::int64_t duration; ///< In microseconds.
+		int thread;
+		std::int64_t value;
+	};
+
+	std::int64_t to_microseconds(Clock::time_point time) const
+	{
+		return std::chrono::duration_cast<std::chrono::microseconds>(time - start).count();
+	};
+
+	// Numbers the threads in the order they first report something. Called with the mutex locked.
+	int get_thread_index()
+	{
+		return thread_indices.emplace(std::this_thread::get_id(), static_cast<int>(thread_indices.size())).first->second;
+	};
+
+	static std::string escape(const char* name)
+	{
+		std::string escaped;
+		for (const char* c = name; *c != '\0'; ++c)
+		{
+			if (*c == '"' || *c == '\\') {
+				escaped += '\\';
+			}
+			escaped += *c;
+		}
+		return escaped;
+	};
+
+	mutable std::mutex mutex;
+	std::vector<Event> events;
+	std::map<std::thread::id, int> thread_indices;
+	Clock::time_point start;
+};
+
+	} /* namespace core */
+} /* namespace eos */
+
+#endif /* TRACE_HPP_ */
@@ -0,0 +1,101 @@
+/*
+ * eos - A 3D Morphable Model fitting library written in modern C++11/14.
+ *
+ * File: include/eos/core/VertexView.hpp
+ *
+ * Copyright 2016 Patrik Huber
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#ifndef VERTEXVIEW_HPP_
+#define VERTEXVIEW_HPP_
+
+#include "glm/vec4.hpp"
+
+#include <vector>
+#include <cstddef>
+#include <cassert>
+
+namespace eos {
+	namespace core {
+
+/**
+ * @brief A lightweight, non-owning view of the vertex positions of a mesh.
+ *
+ * Views a contiguous array of floats with a stride between the vertices.
+ * It can view the shape vector of a model instance directly, stored as
+ * [x_1 y_1 z_1 x_2 ...] (stride 3), or the vertices of a Mesh (stride 4),
+ * without copying anything. This lets the correspondence functions run on
+ * the shape vector that a fitting iterates on, without building a Mesh.
+ *
+ * The viewed data must outlive the view.
+ */
+class VertexView
+{
+public:
+	/**
+	 * @brief Views \p num_vertices vertices, starting at \p data, each \p stride floats apart.
+	 *
+	 * @param[in] data Pointer to the x coordinate of the first vertex, followed by y and z.
+	 * @param[in] num_vertices The number of vertices.
+	 * @param[in] stride The number of floats from one vertex to the next (3 for a shape vector).
+	 */
+	VertexView(const float* data, int num_vertices, int stride = 3) : data(data), num_vertices(num_vertices), stride(stride)
+	{
+		assert(stride >= 3);
+	};
+
+	/**
+	 * @brief Views the vertices of a Mesh (or any other vector of glm::vec4).
+	 *
+	 * @param[in] vertices The vertices to view.
+	 */
+	VertexView(const std::vector<glm::vec4>& vertices) : data(vertices.empty() ? nullptr : &vertices[0][0]), num_vertices(static_cast<int>(vertices.size())), stride(4)
+	{
+	};
+
+	/**
+	 * Returns the position of vertex \p i, in homogeneous coordinates (w = 1).
+	 *
+	 * @param[in] i The vertex index.
+	 * @return The vertex position.
+	 */
+	glm::vec4 operator[](int i) const
+	{
+		assert(i >= 0 && i < num_vertices);
+		const float* v = data + static_cast<std::ptrdiff_t>(i) * stride;
+		return glm::vec4(v[0], v[1], v[2], 1.0f);
+	};
+
+	/**
+	 * Returns the number of vertices.
+	 *
+	 * @return The number of vertices.
+	 */
+	int size() const
+	{
+		return num_vertices;
+	};
+
+private:
+	const float* data;
+	int num_vertices;
+	int stride;
+};
+
+	} /* namespace core */
+} /* namespace eos */
+
+#endif /* VERTEXVIEW_HPP_ */
@@ -0,0 +1,144 @@
+/*
+ * eos - A 3D Morphable Model fitting library written in modern C++11/14.
+ *
+ * File: include/eos/core/WorkerPool.hpp
+ *
+ * Copyright 2017 Patrik Huber
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#ifndef WORKERPOOL_HPP_
+#define WORKERPOOL_HPP_
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <algorithm>
+
+namespace eos {
+	namespace core {
+
+/**
+ * @brief A fixed-size pool of worker threads that runs tasks asynchronously.
+ *
+ * Unlike ThreadPool, which runs one parallel for-loop at a time and blocks until
+ * it's done, post() only queues a task and returns. The tasks are run in the
+ * order they were posted, by whichever worker is free. This is meant to be a
+ * process-wide pool, shared by many independent jobs (e.g. the streams of a
+ * video::VideoPipeline), so that the number of threads doesn't grow with the
+ * number of jobs.
+ *
+ * Tasks that are posted from several threads, or from within other tasks, are
+ * fine. Tasks should handle their errors themselves: Exceptions that escape a
+ * task are caught and discarded, so that they don't terminate the worker.
+ */
+class WorkerPool
+{
+public:
+	/**
+	 * @brief Creates a pool with \p num_threads worker threads.
+	 *
+	 * @param[in] num_threads The number of workers, or 0 to use the number of hardware threads.
+	 */
+	explicit WorkerPool(int num_threads = 0)
+	{
+		if (num_threads <= 0) {
+			num_threads = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+		}
+		for (int i = 0; i < num_threads; ++i)
+		{
+			workers.emplace_back([this]() { worker_loop(); });
+		}
+	};
+
+	WorkerPool(const WorkerPool&) = delete;
+	WorkerPool& operator=(const WorkerPool&) = delete;
+
+	/**
+	 * @brief Runs all tasks that are still queued, and then stops the workers.
+	 */
+	~WorkerPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		task_available.notify_all();
+		for (auto&& worker : workers) {
+			worker.join();
+		}
+	};
+
+	/**
+	 * @brief Queues a task, to be run on one of the workers.
+	 *
+	 * @param[in] task The function to run.
+	 */
+	void post(std::function<void()> task)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			tasks.push_back(std::move(task));
+		}
+		task_available.notify_one();
+	};
+
+	/**
+	 * Returns the number of worker threads.
+	 *
+	 * @return The number of threads.
+	 */
+	int get_num_threads() const
+	{
+		return static_cast<int>(workers.size());
+	};
+
+private:
+	void worker_loop()
+	{
+		while (true)
+		{
+			std::function<void()> task;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				task_available.wait(lock, [this]() { return stopping || !tasks.empty(); });
+				if (tasks.empty()) { // stopping, and nothing left to do
+					return;
+				}
+				task = std::move(tasks.front());
+				tasks.pop_front();
+			}
+			try {
+				task();
+			}
+			catch (...) {
+			}
+		}
+	};
+
+	std::vector<std::thread> workers;
+	std::mutex mutex; // protects everything below
+	std::condition_variable task_available;
+	std::deque<std::function<void()>> tasks;
+	bool stopping = false;
+};
+
+	} /* namespace core */
+} /* namespace eos */
+
+#endif /* WORKERPOOL_HPP_ */
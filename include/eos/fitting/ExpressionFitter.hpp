@@ -0,0 +1,290 @@
+/*
+ * eos - A 3D Morphable Model fitting library written in modern C++11/14.
+ *
+ * File: include/eos/fitting/ExpressionFitter.hpp
+ *
+ * Copyright 2017 Patrik Huber
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#ifndef EXPRESSIONFITTER_HPP_
+#define EXPRESSIONFITTER_HPP_
+
+#include "eos/morphablemodel/Blendshape.hpp"
+
+#include "Eigen/Core"
+#include "Eigen/Cholesky"
+
+#include "opencv2/core/core.hpp"
+
+#include <vector>
+#include <algorithm>
+#include <cstddef>
+#include <cassert>
+
+namespace eos {
+	namespace fitting {
+		namespace detail {
+
+/**
+ * Solves min ||A x + b||^2 subject to x >= 0, given the normal equations
+ * G = A^t A and g = -A^t b, with the active-set method of Lawson and Hanson.
+ *
+ * The solver starts from the given \p x and its passive set (the coefficients
+ * that are allowed to be non-zero, i.e. the ones that are > 0 in \p x), instead
+ * of from x = 0. When the active set of the previous frame is still the right one,
+ * this only needs a single solve of the passive subsystem.
+ *
+ * @param[in] G The B x B matrix A^t A.
+ * @param[in] g The B x 1 vector -A^t b.
+ * @param[in,out] x A feasible (non-negative) starting point. Will contain the solution.
+ * @param[in] max_iterations Maximum number of coefficients that are added to the passive set.
+ * @param[in] tolerance A coefficient is added to the passive set if its gradient is larger than this.
+ * @return The number of iterations (outer loops) that were run.
+ */
+inline int solve_nnls_normal_equations(const Eigen::MatrixXf& G, const Eigen::VectorXf& g, Eigen::VectorXf& x, int max_iterations = 100, float tolerance = 1e-6f)
+{
+	using Eigen::MatrixXf;
+	using Eigen::VectorXf;
+	const int num_coefficients = static_cast<int>(g.size());
+	assert(G.rows() == num_coefficients && G.cols() == num_coefficients && x.size() == num_coefficients);
+
+	std::vector<int> passive_set;
+	for (int j = 0; j < num_coefficients; ++j) {
+		if (x(j) > 0.0f) {
+			passive_set.push_back(j);
+		} else {
+			x(j) = 0.0f;
+		}
+	}
+	// Scale the tolerance with G, so that it's independent of the units of the problem:
+	const float scaled_tolerance = tolerance * std::max(G.diagonal().maxCoeff(), 1.0f);
+
+	MatrixXf G_passive;
+	VectorXf g_passive;
+	VectorXf z(num_coefficients);
+	int iteration = 0;
+	for (; iteration <= max_iterations; ++iteration)
+	{
+		// Solve the unconstrained problem on the passive set. If that leaves the feasible region,
+		// move towards its solution as far as possible, drop the coefficients that hit zero, and repeat:
+		while (!passive_set.empty())
+		{
+			const int num_passive = static_cast<int>(passive_set.size());
+			G_passive.resize(num_passive, num_passive);
+			g_passive.resize(num_passive);
+			for (int r = 0; r < num_passive; ++r) {
+				g_passive(r) = g(passive_set[r]);
+				for (int c = 0; c < num_passive; ++c) {
+					G_passive(r, c) = G(passive_set[r], passive_set[c]);
+				}
+			}
+			const VectorXf z_passive = G_passive.ldlt().solve(g_passive);
+			z.setZero();
+			bool feasible = true;
+			for (int r = 0; r < num_passive; ++r) {
+				z(passive_set[r]) = z_passive(r);
+				feasible = feasible && z_passive(r) > 0.0f;
+			}
+			if (feasible)
+			{
+				x = z;
+				break;
+			}
+			float step = 1.0f;
+			for (int j : passive_set) {
+				if (z(j) <= 0.0f) {
+					step = std::min(step, x(j) / (x(j) - z(j)));
+				}
+			}
+			x += step * (z - x);
+			std::vector<int> remaining;
+			for (int j : passive_set) {
+				if (x(j) > 0.0f && z(j) > 0.0f) {
+					remaining.push_back(j);
+				} else {
+					x(j) = 0.0f;
+				}
+			}
+			passive_set.swap(remaining);
+		}
+
+		// Optimal if no coefficient of the active set could decrease the cost by becoming positive:
+		const VectorXf gradient = g - G * x;
+		int best = -1;
+		float best_gradient = scaled_tolerance;
+		for (int j = 0; j < num_coefficients; ++j) {
+			if (x(j) == 0.0f && gradient(j) > best_gradient && std::find(begin(passive_set), end(passive_set), j) == end(passive_set))
+			{
+				best = j;
+				best_gradient = gradient(j);
+			}
+		}
+		if (best < 0) {
+			break;
+		}
+		passive_set.push_back(best);
+	}
+	return iteration;
+};
+
+		} /* namespace detail */
+
+/**
+ * @brief Fits the expression blendshape coefficients of a face with a known
+ * identity, for a fixed set of landmarks, in a few microseconds per frame.
+ *
+ * The same problem as fit_blendshapes_to_landmarks_nnls() is solved, but
+ * everything that doesn't change from frame to frame is precomputed: The rows
+ * of the blendshapes and of the identity shape at the landmarks are gathered in
+ * the constructor. The blendshapes projected with the camera, and their Gram
+ * matrix, are cached, and only recomputed when the camera matrix changes. Per
+ * frame, only the right-hand side of the normal equations is computed from the
+ * landmarks, and solved with an active-set NNLS that starts from the previous
+ * frame's coefficients and active set - usually, it's the same, and a single
+ * B x B solve is all that's needed.
+ *
+ * The result is the same as with fit_blendshapes_to_landmarks_nnls(), up to the
+ * precision of the solvers.
+ *
+ * This is meant for the inner-face landmarks, which are the same in every frame,
+ * e.g. for avatar animation once the identity has been fitted. If the landmarks
+ * change (e.g. the contour correspondences), a new ExpressionFitter is needed.
+ */
+class ExpressionFitter
+{
+public:
+	ExpressionFitter() = default;
+
+	/**
+	 * @brief Gathers the blendshapes and the identity shape at the given vertices.
+	 *
+	 * @param[in] blendshapes The blendshapes to estimate the coefficients for.
+	 * @param[in] identity_shape The shape without expression, e.g. the PCA shape instance of the fitted identity. A 3m x 1 vector.
+	 * @param[in] vertex_ids The vertex ids in the model that correspond to the 2D landmarks, in the order they will be given to fit().
+	 */
+	ExpressionFitter(const std::vector<morphablemodel::Blendshape>& blendshapes, const Eigen::VectorXf& identity_shape, const std::vector<int>& vertex_ids) : vertex_ids(vertex_ids)
+	{
+		const int num_blendshapes = static_cast<int>(blendshapes.size());
+		const int num_landmarks = static_cast<int>(vertex_ids.size());
+		blendshapes_at_landmarks.resize(3 * num_landmarks, num_blendshapes);
+		for (int i = 0; i < num_landmarks; ++i) {
+			for (int j = 0; j < num_blendshapes; ++j) {
+				blendshapes_at_landmarks.block<3, 1>(3 * i, j) = blendshapes[j].deformation.segment<3>(3 * vertex_ids[i]);
+			}
+		}
+		coefficients_eigen = Eigen::VectorXf::Zero(num_blendshapes);
+		coefficients.resize(num_blendshapes);
+		set_identity(identity_shape);
+	};
+
+	/**
+	 * @brief Replaces the identity shape, e.g. when it has been updated.
+	 * The warm start from the previous frame is kept.
+	 *
+	 * @param[in] identity_shape The shape without expression. A 3m x 1 vector.
+	 */
+	void set_identity(const Eigen::VectorXf& identity_shape)
+	{
+		identity_at_landmarks.resize(3 * vertex_ids.size());
+		for (std::size_t i = 0; i < vertex_ids.size(); ++i) {
+			identity_at_landmarks.segment<3>(3 * i) = identity_shape.segment<3>(3 * vertex_ids[i]);
+		}
+		camera_cached = false;
+	};
+
+	/**
+	 * @brief Estimates the blendshape coefficients for the given landmarks.
+	 *
+	 * @param[in] affine_camera_matrix A 3x4 affine camera matrix from model to screen-space (CV_32FC1).
+	 * @param[in] landmarks 2D landmarks, one for each vertex given to the constructor.
+	 * @return The estimated blendshape coefficients.
+	 */
+	const std::vector<float>& fit(cv::Mat affine_camera_matrix, const std::vector<cv::Vec2f>& landmarks)
+	{
+		using RowMajorMatrix34f = Eigen::Matrix<float, 3, 4, Eigen::RowMajor>;
+		assert(landmarks.size() == vertex_ids.size());
+		assert(affine_camera_matrix.rows == 3 && affine_camera_matrix.cols == 4 && affine_camera_matrix.type() == CV_32FC1 && affine_camera_matrix.isContinuous());
+		const Eigen::Map<const RowMajorMatrix34f> C(affine_camera_matrix.ptr<float>());
+		if (!camera_cached || C.topRows<2>() != camera.topRows<2>())
+		{
+			update_camera(C);
+		}
+		// b = C * identity - y, and we only need g = -A^t b:
+		const int num_landmarks = static_cast<int>(vertex_ids.size());
+		for (int i = 0; i < num_landmarks; ++i) {
+			residual_at_identity.segment<2>(2 * i) = Eigen::Vector2f(landmarks[i][0], landmarks[i][1]) - projected_identity.segment<2>(2 * i);
+		}
+		g.noalias() = projected_blendshapes.transpose() * residual_at_identity;
+		detail::solve_nnls_normal_equations(gram, g, coefficients_eigen);
+		for (int j = 0; j < coefficients_eigen.size(); ++j) {
+			coefficients[j] = coefficients_eigen(j);
+		}
+		return coefficients;
+	};
+
+	/**
+	 * @brief Forgets the previous frame's coefficients, the next fit() starts from zero.
+	 */
+	void reset()
+	{
+		coefficients_eigen.setZero();
+	};
+
+	const std::vector<float>& get_coefficients() const
+	{
+		return coefficients;
+	};
+
+private:
+	// Projects the blendshapes and the identity with the camera, and computes the Gram matrix.
+	void update_camera(const Eigen::Matrix<float, 3, 4, Eigen::RowMajor>& C)
+	{
+		camera = C;
+		camera_cached = true;
+		const Eigen::Matrix<float, 2, 3> C_rs = C.topLeftCorner<2, 3>();
+		const Eigen::Vector2f C_t = C.block<2, 1>(0, 3);
+		const int num_landmarks = static_cast<int>(vertex_ids.size());
+		projected_blendshapes.resize(2 * num_landmarks, blendshapes_at_landmarks.cols());
+		projected_identity.resize(2 * num_landmarks);
+		residual_at_identity.resize(2 * num_landmarks);
+		for (int i = 0; i < num_landmarks; ++i) {
+			projected_blendshapes.middleRows<2>(2 * i).noalias() = C_rs * blendshapes_at_landmarks.middleRows<3>(3 * i);
+			projected_identity.segment<2>(2 * i) = C_rs * identity_at_landmarks.segment<3>(3 * i) + C_t;
+		}
+		gram.noalias() = projected_blendshapes.transpose() * projected_blendshapes;
+	};
+
+	std::vector<int> vertex_ids;
+	Eigen::MatrixXf blendshapes_at_landmarks; // 3N x B
+	Eigen::VectorXf identity_at_landmarks; // 3N x 1
+
+	// Cached for the current camera:
+	bool camera_cached = false;
+	Eigen::Matrix<float, 3, 4, Eigen::RowMajor> camera;
+	Eigen::MatrixXf projected_blendshapes; // 2N x B, A
+	Eigen::VectorXf projected_identity; // 2N x 1
+	Eigen::MatrixXf gram; // B x B, A^t A
+
+	Eigen::VectorXf residual_at_identity; // 2N x 1, -b
+	Eigen::VectorXf g; // B x 1, -A^t b
+	Eigen::VectorXf coefficients_eigen; // the previous frame's solution, for the warm start
+	std::vector<float> coefficients;
+};
+
+	} /* namespace fitting */
+} /* namespace eos */
+
+#endif /* EXPRESSIONFITTER_HPP_ */
@@ -0,0 +1,357 @@
+/*
+ * eos - A 3D Morphable Model fitting library written in modern C++11/14.
+ *
+ * File: include/eos/fitting/FaceTracker.hpp
+ *
+ * Copyright 2017 Patrik Huber
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#ifndef FACETRACKER_HPP_
+#define FACETRACKER_HPP_
+
+#include "eos/core/Landmark.hpp"
+#include "eos/core/LandmarkMapper.hpp"
+#include "eos/core/Mesh.hpp"
+#include "eos/core/VertexView.hpp"
+#include "eos/morphablemodel/MorphableModel.hpp"
+#include "eos/morphablemodel/Blendshape.hpp"
+#include "eos/morphablemodel/EdgeTopology.hpp"
+#include "eos/fitting/fitting.hpp"
+#include "eos/fitting/FittingResult.hpp"
+#include "eos/fitting/FittingWorkspace.hpp"
+#include "eos/fitting/LandmarkIndexPlan.hpp"
+#include "eos/fitting/NearestContourSearch.hpp"
+#include "eos/fitting/RenderingParameters.hpp"
+#include "eos/fitting/convergence.hpp"
+
+#include "glm/gtc/quaternion.hpp"
+#include "glm/trigonometric.hpp"
+
+#include "Eigen/Core"
+
+#include "opencv2/core/core.hpp"
+
+#include "boost/optional.hpp"
+
+#include <vector>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <cmath>
+#include <cstddef>
+#include <cassert>
+
+namespace eos {
+	namespace fitting {
+
+/**
+ * Settings for FaceTracker.
+ */
+struct TrackingSettings
+{
+	int identity_iterations = 5; ///< Iterations of fit_shape_and_pose() per frame, as long as the identity is not locked.
+	int tracking_iterations = 2; ///< Pose and expression iterations per frame, once the identity is locked. 1 to 3 are enough when starting from the previous frame.
+	boost::optional<int> num_shape_coefficients_to_fit = boost::none; ///< How many shape coefficients to fit, or boost::none for all.
+	float lambda = 30.0f; ///< Regularisation parameter of the PCA shape fitting.
+	float identity_update_rate = 0.0f; ///< Once locked, the shape is blended towards each frame's estimate with this rate, in [0, 1]. 0 freezes the shape.
+	float identity_convergence_threshold = 0.05f; ///< L2 norm of the change of the shape coefficients from one frame to the next, below which a frame counts as converged.
+	int frames_until_lock = 10; ///< The identity is locked after that many consecutive converged frames. 0 to only lock with lock_identity().
+	int contour_search_window = 0; ///< Once locked, each contour landmark is only matched to the model contour vertices this close to its previous match. 0 to always search the whole contour.
+};
+
+/**
+ * @brief Tracks the pose, shape and expression of a face over the frames of a
+ * video, carrying all of them over from one frame to the next.
+ *
+ * At first, each frame is fitted with fit_shape_and_pose_multi(), warm-started with
+ * the shape and expression of the previous frame, and with TrackingSettings::identity_iterations
+ * iterations. Once the shape coefficients have stopped changing for
+ * TrackingSettings::frames_until_lock frames, or once lock_identity() is called, e.g.
+ * with the shape fitted to the keyframes of a video::PoseBinningKeyframeSelector with
+ * fit_shape_and_pose_multi(), the identity is locked: From then on, each frame only
+ * estimates the pose and the expression blendshapes, with TrackingSettings::tracking_iterations
+ * iterations that start from the pose of the previous frame, and the shape is kept
+ * fixed, or slowly updated with TrackingSettings::identity_update_rate. That skips the
+ * shape fitting, the most costly part of an iteration, and needs far fewer iterations.
+ *
+ * All the buffers are kept in a FittingWorkspace, so after the first frames, tracking
+ * runs (mostly) without allocating.
+ *
+ * Warning: Don't put in temporaries for the model, blendshapes, mapper, topology and
+ * contours! We don't make a copy, we store a reference to what is given to the constructor.
+ */
+class FaceTracker
+{
+public:
+	/**
+	 * @brief Creates a tracker.
+	 *
+	 * @param[in] morphable_model The 3D Morphable Model used for the shape fitting.
+	 * @param[in] blendshapes A vector of blendshapes that are being fit to the landmarks in addition to the PCA model.
+	 * @param[in] landmark_mapper Mapping info from the 2D landmark points to 3D vertex indices.
+	 * @param[in] edge_topology Precomputed edge topology of the 3D model, needed for fast edge-lookup.
+	 * @param[in] contour_landmarks 2D image contour ids of left or right side (for example for ibug landmarks).
+	 * @param[in] model_contour The model contour indices that should be considered to find the closest corresponding 3D vertex.
+	 * @param[in] settings Iteration counts and when to lock the identity.
+	 */
+	FaceTracker(const morphablemodel::MorphableModel& morphable_model, const std::vector<morphablemodel::Blendshape>& blendshapes, const core::LandmarkMapper& landmark_mapper, const morphablemodel::EdgeTopology& edge_topology, const ContourLandmarks& contour_landmarks, const ModelContour& model_contour, TrackingSettings settings = TrackingSettings()) : morphable_model(morphable_model), blendshapes(blendshapes), landmark_mapper(landmark_mapper), edge_topology(edge_topology), contour_landmarks(contour_landmarks), model_contour(model_contour), settings(settings), contour_search(settings.contour_search_window)
+	{
+		assert(blendshapes.size() > 0);
+	};
+
+	/**
+	 * @brief Fits the given frame, starting from the result of the previous frame.
+	 *
+	 * @param[in] landmarks 2D landmarks of the frame.
+	 * @param[in] image_width Width of the frame.
+	 * @param[in] image_height Height of the frame.
+	 * @return The pose, shape and expression of the frame. The mesh is available with get_mesh().
+	 */
+	FittingResult track(const core::LandmarkCollection<cv::Vec2f>& landmarks, int image_width, int image_height)
+	{
+		if (identity_locked)
+		{
+			fit_pose_and_expression(landmarks, image_width, image_height);
+		}
+		else {
+			fit_identity(landmarks, image_width, image_height);
+		}
+		FittingResult result;
+		result.rendering_parameters = rendering_parameters.get();
+		result.pca_shape_coefficients = pca_shape_coefficients;
+		result.blendshape_coefficients = blendshape_coefficients;
+		result.fitted_image_points = workspace.image_points[0];
+		result.statistics = statistics;
+		return result;
+	};
+
+	/**
+	 * @brief Locks the identity with the given shape coefficients, e.g. from a
+	 * fit_shape_and_pose_multi() over the keyframes of the video so far.
+	 *
+	 * @param[in] pca_shape_coefficients The shape coefficients of the identity.
+	 */
+	void lock_identity(std::vector<float> pca_shape_coefficients)
+	{
+		assert(pca_shape_coefficients.size() <= morphable_model.get_shape_model().get_num_principal_components());
+		this->pca_shape_coefficients = std::move(pca_shape_coefficients);
+		identity_locked = true;
+	};
+
+	/**
+	 * @brief Locks the identity with the current shape coefficients.
+	 */
+	void lock_identity()
+	{
+		identity_locked = true;
+	};
+
+	/**
+	 * @brief Goes back to fitting the shape in every frame. The shape coefficients
+	 * are kept as the starting point.
+	 */
+	void unlock_identity()
+	{
+		identity_locked = false;
+		num_converged_frames = 0;
+	};
+
+	bool is_identity_locked() const
+	{
+		return identity_locked;
+	};
+
+	/**
+	 * @brief Forgets the pose and expression, e.g. when the face was lost. The
+	 * identity, and whether it's locked, are kept.
+	 */
+	void reset()
+	{
+		rendering_parameters = boost::none;
+		blendshape_coefficients.clear();
+		for (auto&& contour_tracker : workspace.contour_trackers) {
+			contour_tracker.reset();
+		}
+		contour_search.reset();
+	};
+
+	/**
+	 * @brief Returns the mesh of the last frame given to track().
+	 */
+	const core::Mesh& get_mesh() const
+	{
+		assert(!workspace.meshes.empty());
+		return workspace.meshes[0];
+	};
+
+private:
+	// Fits the shape, pose and expression, and locks the identity once the shape has converged.
+	void fit_identity(const core::LandmarkCollection<cv::Vec2f>& landmarks, int image_width, int image_height)
+	{
+		const std::vector<float> previous_pca_shape_coefficients = pca_shape_coefficients;
+		std::vector<std::vector<float>> all_blendshape_coefficients;
+		if (!blendshape_coefficients.empty()) {
+			all_blendshape_coefficients = { blendshape_coefficients };
+		}
+		std::vector<std::vector<cv::Vec2f>> fitted_image_points;
+		const auto meshes_and_params = fit_shape_and_pose_multi(morphable_model, blendshapes, { landmarks }, landmark_mapper, { image_width }, { image_height }, edge_topology, contour_landmarks, model_contour, settings.identity_iterations, settings.num_shape_coefficients_to_fit, settings.lambda, rendering_parameters, pca_shape_coefficients, all_blendshape_coefficients, fitted_image_points, workspace, boost::none, statistics, nullptr);
+		blendshape_coefficients = all_blendshape_coefficients[0];
+		rendering_parameters = meshes_and_params.second[0];
+
+		if (previous_pca_shape_coefficients.size() != pca_shape_coefficients.size())
+		{
+			num_converged_frames = 0;
+			return;
+		}
+		float change_sq = 0.0f;
+		for (std::size_t i = 0; i < pca_shape_coefficients.size(); ++i) {
+			change_sq += (pca_shape_coefficients[i] - previous_pca_shape_coefficients[i]) * (pca_shape_coefficients[i] - previous_pca_shape_coefficients[i]);
+		}
+		num_converged_frames = std::sqrt(change_sq) < settings.identity_convergence_threshold ? num_converged_frames + 1 : 0;
+		if (settings.frames_until_lock > 0 && num_converged_frames >= settings.frames_until_lock) {
+			identity_locked = true;
+		}
+	};
+
+	// Fits the pose and expression with the locked shape, starting from the previous frame's pose.
+	// The same steps as one iteration of fit_shape_and_pose_multi(), without the shape fitting.
+	void fit_pose_and_expression(const core::LandmarkCollection<cv::Vec2f>& landmarks, int image_width, int image_height)
+	{
+		using std::vector;
+		using cv::Vec2f;
+		using cv::Vec4f;
+		using Eigen::VectorXf;
+
+		workspace.prepare(morphable_model, blendshapes, edge_topology, 1);
+		if (blendshape_coefficients.size() != blendshapes.size()) {
+			blendshape_coefficients.assign(blendshapes.size(), 0.0f);
+		}
+		const auto& shape_model = morphable_model.get_shape_model();
+		const auto update_pca_shape = [&]() {
+			workspace.pca_shape = shape_model.get_mean();
+			workspace.pca_shape.noalias() += shape_model.get_rescaled_pca_basis().leftCols(pca_shape_coefficients.size()) * Eigen::Map<const VectorXf>(pca_shape_coefficients.data(), pca_shape_coefficients.size());
+		};
+		const auto update_combined_shape = [&]() {
+			workspace.combined_shapes[0] = workspace.pca_shape;
+			workspace.combined_shapes[0].noalias() += workspace.blendshapes_as_basis * Eigen::Map<const VectorXf>(blendshape_coefficients.data(), blendshape_coefficients.size());
+		};
+		update_pca_shape();
+		update_combined_shape();
+		const core::VertexView current_shape(workspace.combined_shapes[0].data(), static_cast<int>(workspace.combined_shapes[0].size() / 3));
+
+		vector<Vec4f>& model_points = workspace.model_points[0];
+		vector<int>& vertex_indices = workspace.vertex_indices[0];
+		vector<Vec2f>& image_points = workspace.image_points[0];
+		vector<int>& fixed_vertex_indices = workspace.fixed_vertex_indices[0];
+		vector<Vec2f>& fixed_image_points = workspace.fixed_image_points[0];
+		// The landmark names are only mapped once, all further frames are just indexed:
+		LandmarkIndexPlan& landmark_plan = workspace.landmark_plans[0];
+		if (!landmark_plan.is_compiled_for(landmarks, landmark_mapper, contour_landmarks)) {
+			landmark_plan = LandmarkIndexPlan(landmarks, landmark_mapper, contour_landmarks);
+		}
+		get_corresponding_pointset(landmarks, landmark_plan, current_shape, fixed_image_points, model_points, fixed_vertex_indices);
+		assert(fixed_vertex_indices.size() >= 4);
+		const auto update_model_points = [&]() {
+			model_points.clear();
+			for (const auto& v : vertex_indices)
+			{
+				const auto vertex = current_shape[v];
+				model_points.push_back({ vertex.x, vertex.y, vertex.z, vertex.w });
+			}
+		};
+		if (!rendering_parameters)
+		{
+			// No previous frame, start with a pose from the fixed landmarks only:
+			vertex_indices = fixed_vertex_indices;
+			update_model_points();
+			rendering_parameters = RenderingParameters(estimate_orthographic_projection_linear(fixed_image_points, model_points, true, image_height), image_width, image_height);
+		}
+
+		workspace.left_contour_edges.emplace_back(get_landmark_points(landmarks, landmark_plan.get_left_contour()));
+		workspace.right_contour_edges.emplace_back(get_landmark_points(landmarks, landmark_plan.get_right_contour()));
+
+		for (int i = 0; i < settings.tracking_iterations; ++i)
+		{
+			image_points = fixed_image_points;
+			vertex_indices = fixed_vertex_indices;
+
+			// The contour correspondences of the first iteration come from the previous frame's pose:
+			const auto yaw_angle = glm::degrees(glm::eulerAngles(rendering_parameters->get_rotation())[1]);
+			contour_search.find(landmarks, landmark_plan, model_contour, yaw_angle, current_shape, rendering_parameters->get_modelview(), rendering_parameters->get_projection(), get_opencv_viewport(image_width, image_height), image_points, vertex_indices);
+
+			const auto& occluding_contour_edges = yaw_angle >= 0.0f ? workspace.left_contour_edges[0] : workspace.right_contour_edges[0];
+			auto edge_correspondences = find_occluding_edge_correspondences(workspace.contour_trackers[0], current_shape, workspace.meshes[0].tvi, rendering_parameters.get(), occluding_contour_edges, 180.0f);
+			image_points.insert(std::end(image_points), std::begin(edge_correspondences.first), std::end(edge_correspondences.first));
+			vertex_indices.insert(std::end(vertex_indices), std::begin(edge_correspondences.second), std::end(edge_correspondences.second));
+
+			update_model_points();
+			rendering_parameters = RenderingParameters(estimate_orthographic_projection_linear(image_points, model_points, true, image_height), image_width, image_height);
+			get_3x4_affine_camera_matrix(rendering_parameters.get(), image_width, image_height).copyTo(workspace.affine_from_orthos[0]);
+
+			workspace.landmark_subspaces[0].update(shape_model, blendshapes, vertex_indices);
+			const auto& subspace = workspace.landmark_subspaces[0];
+			workspace.pca_shape_at_landmarks[0] = subspace.get_mean();
+			workspace.pca_shape_at_landmarks[0].noalias() += subspace.get_rescaled_pca_basis().leftCols(pca_shape_coefficients.size()) * Eigen::Map<const VectorXf>(pca_shape_coefficients.data(), pca_shape_coefficients.size());
+			blendshape_coefficients = fit_blendshapes_to_landmarks_nnls(subspace, workspace.pca_shape_at_landmarks[0], workspace.affine_from_orthos[0], image_points);
+			update_combined_shape();
+		}
+
+		if (settings.identity_update_rate > 0.0f && settings.tracking_iterations > 0)
+		{
+			// Estimate the shape of this frame, and move the identity a little towards it:
+			const auto& subspace = workspace.landmark_subspaces[0];
+			workspace.mean_plus_blendshapes[0] = subspace.get_mean();
+			workspace.mean_plus_blendshapes[0].noalias() += subspace.get_blendshapes() * Eigen::Map<const VectorXf>(blendshape_coefficients.data(), blendshape_coefficients.size());
+			const vector<float> frame_pca_shape_coefficients = fit_shape_to_landmarks_linear_multi(workspace.landmark_subspaces, workspace.affine_from_orthos, workspace.image_points, workspace.mean_plus_blendshapes, settings.lambda, static_cast<int>(pca_shape_coefficients.size()));
+			for (std::size_t k = 0; k < pca_shape_coefficients.size(); ++k) {
+				pca_shape_coefficients[k] += settings.identity_update_rate * (frame_pca_shape_coefficients[k] - pca_shape_coefficients[k]);
+			}
+			update_pca_shape();
+			update_combined_shape();
+		}
+
+		statistics = FittingStatistics();
+		statistics.num_iterations = settings.tracking_iterations;
+		if (settings.tracking_iterations > 0) {
+			statistics.reprojection_error = compute_reprojection_error(workspace.affine_from_orthos, { current_shape }, workspace.image_points, workspace.vertex_indices);
+		}
+		morphablemodel::update_mesh_vertices(workspace.combined_shapes[0], workspace.meshes[0]);
+	};
+
+	const morphablemodel::MorphableModel& morphable_model;
+	const std::vector<morphablemodel::Blendshape>& blendshapes;
+	const core::LandmarkMapper& landmark_mapper;
+	const morphablemodel::EdgeTopology& edge_topology;
+	const ContourLandmarks& contour_landmarks;
+	const ModelContour& model_contour;
+	TrackingSettings settings;
+
+	// The state that is carried over from one frame to the next:
+	boost::optional<RenderingParameters> rendering_parameters; // none before the first frame, and after reset()
+	std::vector<float> pca_shape_coefficients;
+	std::vector<float> blendshape_coefficients;
+	bool identity_locked = false;
+	int num_converged_frames = 0;
+
+	FittingStatistics statistics;
+	FittingWorkspace workspace;
+	NearestContourSearch contour_search; // used once the identity is locked
+};
+
+	} /* namespace fitting */
+} /* namespace eos */
+
+#endif /* FACETRACKER_HPP_ */
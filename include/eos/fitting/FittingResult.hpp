@@ -0,0 +1,54 @@
+/*
+ * eos - A 3D Morphable Model fitting library written in modern C++11/14.
+ *
+ * File: include/eos/fitting/FittingResult.hpp
+ *
+ * Copyright 2016 Patrik Huber
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#ifndef FITTINGRESULT_HPP_
+#define FITTINGRESULT_HPP_
+
+#include "eos/fitting/RenderingParameters.hpp"
+#include "eos/fitting/convergence.hpp"
+
+#include "opencv2/core/core.hpp"
+
+#include <vector>
+
+namespace eos {
+	namespace fitting {
+
+/**
+ * @brief A struct holding the result from a fitting.
+ *
+ * Holds the parameters to store and reproduce a fitting result: The estimated
+ * pose, the PCA shape coefficients and the blendshape coefficients. The mesh can
+ * be re-created from these with the Morphable Model and blendshapes that were used.
+ */
+struct FittingResult
+{
+	RenderingParameters rendering_parameters; ///< The estimated pose.
+	std::vector<float> pca_shape_coefficients; ///< The estimated PCA shape coefficients.
+	std::vector<float> blendshape_coefficients; ///< The estimated expression blendshape coefficients.
+	std::vector<cv::Vec2f> fitted_image_points; ///< All the 2D points that have been used in the last iteration of the fitting.
+	FittingStatistics statistics; ///< How the fitting went (iterations, convergence, reprojection error).
+};
+
+	} /* namespace fitting */
+} /* namespace eos */
+
+#endif /* FITTINGRESULT_HPP_ */
@@ -0,0 +1,167 @@
+/*
+ * eos - A 3D Morphable Model fitting library written in modern C++11/14.
+ *
+ * File: include/eos/fitting/FittingWorkspace.hpp
+ *
+ * Copyright 2016 Patrik Huber
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#ifndef FITTINGWORKSPACE_HPP_
+#define FITTINGWORKSPACE_HPP_
+
+#include "eos/core/Mesh.hpp"
+#include "eos/core/VertexView.hpp"
+#include "eos/morphablemodel/MorphableModel.hpp"
+#include "eos/morphablemodel/Blendshape.hpp"
+#include "eos/morphablemodel/EdgeTopology.hpp"
+#include "eos/fitting/closest_edge_fitting.hpp"
+#include "eos/fitting/LandmarkIndexPlan.hpp"
+#include "eos/fitting/LandmarkSubspace.hpp"
+#include "eos/fitting/NearestContourSearch.hpp"
+#include "eos/fitting/RenderingParameters.hpp"
+
+#include "Eigen/Core"
+
+#include "opencv2/core/core.hpp"
+
+#include <vector>
+#include <cassert>
+
+namespace eos {
+	namespace fitting {
+
+/**
+ * @brief Holds all the intermediate buffers of fit_shape_and_pose_multi(), so
+ * that they can be reused across iterations, calls and video frames.
+ *
+ * After the first call (the "warm-up"), the buffers have their final sizes and
+ * the fitting loop mostly runs without allocating: The iterations work on the
+ * shape vectors directly, and the meshes are only updated in place at the end
+ * instead of being re-created with sample_to_mesh(), so the triangle lists,
+ * colours and texture coordinates are only copied once.
+ *
+ * A workspace must not be used by more than one fitting at a time. Use one
+ * workspace per thread (or per video stream).
+ *
+ * All members are public so that they can be inspected after a fitting, but
+ * they are overwritten by every call to fit_shape_and_pose_multi().
+ */
+struct FittingWorkspace
+{
+	/**
+	 * @brief Prepares the workspace for a fitting of \p num_images images.
+	 *
+	 * Resizes all per-image buffers, (re-)creates the meshes and contour trackers
+	 * if the model or the number of images changed, and copies the blendshapes
+	 * into the blendshapes_as_basis matrix (re-using its storage).
+	 *
+	 * The contour trackers and contour searches keep their state from the
+	 * previous call, which is what we want when fitting consecutive video frames.
+	 *
+	 * @param[in] morphable_model The 3D Morphable Model used for the fitting.
+	 * @param[in] blendshapes The blendshapes used for the fitting.
+	 * @param[in] edge_topology Edge topology of the model.
+	 * @param[in] num_images The number of images that are fitted jointly.
+	 */
+	void prepare(const morphablemodel::MorphableModel& morphable_model, const std::vector<morphablemodel::Blendshape>& blendshapes, const morphablemodel::EdgeTopology& edge_topology, int num_images)
+	{
+		assert(num_images > 0);
+		const auto& shape_model = morphable_model.get_shape_model();
+		const auto num_vertices = shape_model.get_data_dimension() / 3;
+
+		const bool model_changed = (&morphable_model != prepared_model || meshes.empty() || meshes[0].vertices.size() != num_vertices);
+		if (model_changed || meshes.size() != num_images)
+		{
+			// Only the vertices are updated in the iterations, the rest of the mesh stays the same:
+			meshes.assign(num_images, morphablemodel::sample_to_mesh(shape_model.get_mean(), morphable_model.get_color_model().get_mean(), shape_model.get_triangle_list(), morphable_model.get_color_model().get_triangle_list(), morphable_model.get_texture_coordinates()));
+		}
+		if (&edge_topology != prepared_edge_topology || contour_trackers.size() != num_images)
+		{
+			contour_trackers.assign(num_images, OccludingContourTracker(edge_topology));
+		}
+		contour_searches.resize(num_images);
+		prepared_model = &morphable_model;
+		prepared_edge_topology = &edge_topology;
+
+		// Copy all blendshapes into a "basis" matrix with each blendshape being a column.
+		// This is the same as morphablemodel::to_matrix(), but writes into the existing matrix:
+		blendshapes_as_basis.resize(shape_model.get_data_dimension(), blendshapes.size());
+		for (int i = 0; i < blendshapes.size(); ++i)
+		{
+			blendshapes_as_basis.col(i) = blendshapes[i].deformation;
+		}
+
+		landmark_plans.resize(num_images);
+		model_points.resize(num_images);
+		vertex_indices.resize(num_images);
+		image_points.resize(num_images);
+		fixed_vertex_indices.resize(num_images);
+		fixed_image_points.resize(num_images);
+		affine_from_orthos.resize(num_images);
+		mean_plus_blendshapes.resize(num_images);
+		pca_shape_at_landmarks.resize(num_images);
+		landmark_subspaces.resize(num_images);
+		combined_shapes.resize(num_images);
+		rendering_params.resize(num_images);
+		previous_rendering_params.resize(num_images);
+		left_contour_edges.clear();
+		right_contour_edges.clear();
+	};
+
+	std::vector<LandmarkIndexPlan> landmark_plans; ///< The compiled landmark mappings of each image. Only re-compiled when the landmark scheme changes.
+	std::vector<std::vector<cv::Vec4f>> model_points; ///< The points in the 3D shape model of all images.
+	std::vector<std::vector<int>> vertex_indices; ///< Their vertex indices, for all images.
+	std::vector<std::vector<cv::Vec2f>> image_points; ///< The corresponding 2D landmark points of all images.
+	std::vector<std::vector<int>> fixed_vertex_indices; ///< The vertex indices of the inner face landmarks, which stay the same throughout the fitting.
+	std::vector<std::vector<cv::Vec2f>> fixed_image_points; ///< The inner face landmarks, which stay the same throughout the fitting.
+
+	std::vector<cv::Mat> affine_from_orthos; ///< The current 3x4 affine camera matrix of each image.
+	std::vector<LandmarkSubspace> landmark_subspaces; ///< The model's rows at the current correspondences of each image.
+	std::vector<Eigen::VectorXf> mean_plus_blendshapes; ///< The mean plus the current blendshapes of each image, at the correspondences only.
+	std::vector<Eigen::VectorXf> pca_shape_at_landmarks; ///< The current PCA shape instance, at the correspondences of each image.
+	std::vector<Eigen::VectorXf> combined_shapes; ///< The current PCA shape plus the blendshapes of each image.
+	std::vector<core::VertexView> shape_views; ///< Views of the combined_shapes, which the correspondence search runs on.
+	Eigen::VectorXf pca_shape; ///< The current PCA shape instance (identical for all images).
+	Eigen::MatrixXf blendshapes_as_basis; ///< All blendshapes, with each blendshape being a column.
+
+	std::vector<core::Mesh> meshes; ///< The mesh of each image. Its vertices are only updated at the end of a fitting.
+	std::vector<fitting::RenderingParameters> rendering_params; ///< The current pose of each image.
+	std::vector<fitting::RenderingParameters> previous_rendering_params; ///< The pose of each image in the previous iteration (for the convergence check).
+	std::vector<float> previous_pca_shape_coefficients; ///< The PCA shape coefficients of the previous iteration (for the convergence check).
+
+	std::vector<OccludingContourTracker> contour_trackers; ///< Incremental occluding contour of each image.
+	/**
+	 * Whether fit_shape_and_pose_multi() updates the occluding contours incrementally
+	 * with the contour_trackers, instead of computing them on the whole mesh in each
+	 * iteration. This is faster, but the incremental updates can miss silhouettes that
+	 * newly appear, so the result can differ from that of a full computation. Off by
+	 * default. Not changed by prepare().
+	 */
+	bool incremental_contours = false;
+	std::vector<NearestContourSearch> contour_searches; ///< Buffers of the front-facing contour search of each image.
+	std::vector<ImageEdgeIndex> left_contour_edges; ///< kd-trees over the left contour landmarks of each image.
+	std::vector<ImageEdgeIndex> right_contour_edges; ///< kd-trees over the right contour landmarks of each image.
+
+private:
+	// Used to detect whether the meshes and trackers have to be re-created:
+	const morphablemodel::MorphableModel* prepared_model = nullptr;
+	const morphablemodel::EdgeTopology* prepared_edge_topology = nullptr;
+};
+
+	} /* namespace fitting */
+} /* namespace eos */
+
+#endif /* FITTINGWORKSPACE_HPP_ */
@@ -0,0 +1,519 @@
+/*
+ * eos - A 3D Morphable Model fitting library written in modern C++11/14.
+ *
+ * File: include/eos/fitting/FrameLog.hpp
+ *
+ * Copyright 2017 Patrik Huber
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#ifndef FRAMELOG_HPP_
+#define FRAMELOG_HPP_
+
+#include "eos/fitting/FittingResult.hpp"
+#include "eos/fitting/RenderingParameters.hpp"
+#include "eos/fitting/convergence.hpp"
+
+#include "glm/gtc/quaternion.hpp"
+
+#include "Eigen/Core"
+
+#include "opencv2/core/core.hpp"
+
+#include "boost/optional.hpp"
+#include "boost/interprocess/file_mapping.hpp"
+#include "boost/interprocess/mapped_region.hpp"
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <fstream>
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <cstring>
+#include <stdexcept>
+#include <cassert>
+
+namespace eos {
+	namespace fitting {
+
+/**
+ * @brief Layout of the binary frame log files written by FrameLogWriter.
+ *
+ * A file consists of a 64 byte header and an array of records, one per frame, that
+ * all have the same size. Each record is a RecordHeader followed by the PCA shape
+ * coefficients, the blendshape coefficients and the fitted image points (x, y), all
+ * float, with room for the number of values given in the file header. The records
+ * are sorted by frame index, so record i is at header size + i * record size, and a
+ * frame can be found with a binary search.
+ *
+ * Values are stored in the byte order of the machine that wrote the file, like in
+ * the mapped model format. A record that is cut off at the end of the file (e.g.
+ * after a crash) is ignored.
+ */
+		namespace frame_log_format {
+
+const char magic[8] = { 'E', 'O', 'S', 'F', 'L', 'O', 'G', '\0' };
+const std::uint32_t version = 2; // 2: RecordHeader::stopped
+const std::uint32_t byte_order_mark = 0x01020304;
+
+struct Header
+{
+	char magic[8];
+	std::uint32_t version;
+	std::uint32_t byte_order_mark;
+	std::uint32_t num_shape_coefficients;
+	std::uint32_t num_blendshape_coefficients;
+	std::uint32_t max_image_points;
+	std::uint32_t record_size;
+	char reserved[32];
+};
+static_assert(sizeof(Header) == 64, "frame_log_format::Header must be 64 bytes.");
+
+struct RecordHeader
+{
+	std::int64_t frame_index;
+	std::uint32_t camera_type; ///< A CameraType.
+	std::int32_t screen_width;
+	std::int32_t screen_height;
+	float frustum[4]; ///< l, r, b, t.
+	float rotation[4]; ///< The quaternion, as w, x, y, z.
+	float translation[2]; ///< t_x, t_y.
+	std::int32_t num_iterations;
+	std::uint32_t converged;
+	float reprojection_error;
+	std::uint32_t num_image_points; ///< The number of fitted image points stored in this record.
+	std::uint32_t stopped; ///< Whether the fitting was stopped early, see FittingStatistics::stopped.
+};
+static_assert(sizeof(RecordHeader) == 80, "frame_log_format::RecordHeader must be 80 bytes.");
+
+// The size of the records, padded to keep the frame indices 8-byte aligned. Computed in
+// 64 bit so that it can't overflow; only sizes that fit Header::record_size are valid:
+inline std::uint64_t get_record_size(std::uint32_t num_shape_coefficients, std::uint32_t num_blendshape_coefficients, std::uint32_t max_image_points)
+{
+	const std::uint64_t size = sizeof(RecordHeader) + sizeof(float) * (std::uint64_t(num_shape_coefficients) + num_blendshape_coefficients + 2 * std::uint64_t(max_image_points));
+	return (size + 7) / 8 * 8;
+};
+
+		} /* namespace frame_log_format */
+
+/**
+ * @brief Writes the fitting results of many frames (e.g. of a video) into one
+ * append-only binary file, see frame_log_format.
+ *
+ * The records have a fixed size, which is set by the number of coefficients and
+ * image points given to the constructor. The records are collected in a buffer and
+ * written in blocks. They're written when the buffer is full, on flush(), and when
+ * the writer is destroyed.
+ *
+ * If the file exists, the new records are appended to it. Its header then has to
+ * match the given sizes. Use a FrameLogReader to read the file.
+ */
+class FrameLogWriter
+{
+public:
+	/**
+	 * @brief Opens a frame log for appending, and creates it if it doesn't exist.
+	 *
+	 * @param[in] filename The file to write.
+	 * @param[in] num_shape_coefficients The number of PCA shape coefficients in each record.
+	 * @param[in] num_blendshape_coefficients The number of blendshape coefficients in each record.
+	 * @param[in] max_image_points The maximum number of fitted image points stored per record, 0 to not store them.
+	 * @param[in] buffer_size The number of records that are collected before they are written to the file.
+	 * @throw std::runtime_error When the sizes are negative or too large, or the file can't be opened, or exists with different sizes.
+	 */
+	FrameLogWriter(std::string filename, int num_shape_coefficients, int num_blendshape_coefficients, int max_image_points = 0, int buffer_size = 64) : filename(filename), buffer_size(std::max(buffer_size, 1))
+	{
+		using namespace frame_log_format;
+		std::memset(&header, 0, sizeof(header));
+		std::memcpy(header.magic, magic, sizeof(header.magic));
+		header.version = version;
+		header.byte_order_mark = byte_order_mark;
+		header.num_shape_coefficients = static_cast<std::uint32_t>(num_shape_coefficients);
+		header.num_blendshape_coefficients = static_cast<std::uint32_t>(num_blendshape_coefficients);
+		header.max_image_points = static_cast<std::uint32_t>(max_image_points);
+		const std::uint64_t record_size = get_record_size(header.num_shape_coefficients, header.num_blendshape_coefficients, header.max_image_points);
+		if (num_shape_coefficients < 0 || num_blendshape_coefficients < 0 || max_image_points < 0 || record_size > std::numeric_limits<std::uint32_t>::max()) {
+			throw std::runtime_error("FrameLogWriter: The number of coefficients or image points is negative or too large: " + filename);
+		}
+		header.record_size = static_cast<std::uint32_t>(record_size);
+
+		file.open(filename, std::ios::binary | std::ios::in | std::ios::out);
+		if (file.is_open())
+		{
+			// Append to the existing log. A record that was cut off is overwritten by the next one:
+			Header existing_header;
+			file.seekg(0, std::ios::end);
+			const std::uint64_t file_size = static_cast<std::uint64_t>(file.tellg());
+			file.seekg(0);
+			if (file_size < sizeof(Header) || !file.read(reinterpret_cast<char*>(&existing_header), sizeof(Header)) || std::memcmp(existing_header.magic, magic, sizeof(magic)) != 0) {
+				throw std::runtime_error("FrameLogWriter: The existing file is not a frame log: " + filename);
+			}
+			if (existing_header.version != version || existing_header.byte_order_mark != byte_order_mark || existing_header.num_shape_coefficients != header.num_shape_coefficients || existing_header.num_blendshape_coefficients != header.num_blendshape_coefficients || existing_header.max_image_points != header.max_image_points) {
+				throw std::runtime_error("FrameLogWriter: The existing frame log has a different version, byte order or record layout: " + filename);
+			}
+			num_records = (file_size - sizeof(Header)) / header.record_size;
+			if (num_records > 0)
+			{
+				RecordHeader last_record;
+				file.seekg(sizeof(Header) + (num_records - 1) * header.record_size);
+				file.read(reinterpret_cast<char*>(&last_record), sizeof(RecordHeader));
+				last_frame_index = last_record.frame_index;
+			}
+			file.seekp(sizeof(Header) + num_records * header.record_size);
+		}
+		else
+		{
+			file.clear();
+			file.open(filename, std::ios::binary | std::ios::out | std::ios::trunc);
+			if (!file.is_open()) {
+				throw std::runtime_error("FrameLogWriter: Error opening the file for writing: " + filename);
+			}
+			file.write(reinterpret_cast<const char*>(&header), sizeof(Header));
+		}
+		if (file.fail()) {
+			throw std::runtime_error("FrameLogWriter: Error opening the frame log: " + filename);
+		}
+		buffer.reserve(static_cast<std::size_t>(this->buffer_size) * header.record_size);
+	};
+
+	/**
+	 * Writes the buffered records. Errors are ignored - call flush() before to get them.
+	 */
+	~FrameLogWriter()
+	{
+		try {
+			flush();
+		} catch (const std::runtime_error&) {
+		}
+	};
+
+	FrameLogWriter(const FrameLogWriter&) = delete;
+	FrameLogWriter& operator=(const FrameLogWriter&) = delete;
+
+	/**
+	 * @brief Adds the fitting result of a frame to the log.
+	 *
+	 * Coefficient vectors shorter than the ones of the log are padded with zeros. Only
+	 * the first max_image_points of the fitted image points are stored.
+	 *
+	 * @param[in] frame_index The index (or number) of the frame. Must be larger than the one of the previous record.
+	 * @param[in] result The fitting result of the frame.
+	 * @throw std::runtime_error When the frame index isn't increasing, a coefficient vector is too long, or writing fails.
+	 */
+	void append(std::int64_t frame_index, const FittingResult& result)
+	{
+		using namespace frame_log_format;
+		if (num_records + buffered_records() > 0 && frame_index <= last_frame_index) {
+			throw std::runtime_error("FrameLogWriter: The frame indices must be increasing, but frame " + std::to_string(frame_index) + " comes after frame " + std::to_string(last_frame_index) + ".");
+		}
+		if (result.pca_shape_coefficients.size() > header.num_shape_coefficients || result.blendshape_coefficients.size() > header.num_blendshape_coefficients) {
+			throw std::runtime_error("FrameLogWriter: The fitting result has more coefficients than the records of the frame log.");
+		}
+
+		const auto& rendering_parameters = result.rendering_parameters;
+		const auto frustum = rendering_parameters.get_frustum();
+		const auto rotation = rendering_parameters.get_rotation();
+		RecordHeader record;
+		std::memset(&record, 0, sizeof(record));
+		record.frame_index = frame_index;
+		record.camera_type = static_cast<std::uint32_t>(rendering_parameters.get_camera_type());
+		record.screen_width = rendering_parameters.get_screen_width();
+		record.screen_height = rendering_parameters.get_screen_height();
+		record.frustum[0] = frustum.l;
+		record.frustum[1] = frustum.r;
+		record.frustum[2] = frustum.b;
+		record.frustum[3] = frustum.t;
+		record.rotation[0] = rotation.w;
+		record.rotation[1] = rotation.x;
+		record.rotation[2] = rotation.y;
+		record.rotation[3] = rotation.z;
+		record.translation[0] = rendering_parameters.get_t_x();
+		record.translation[1] = rendering_parameters.get_t_y();
+		record.num_iterations = result.statistics.num_iterations;
+		record.converged = result.statistics.converged ? 1 : 0;
+		record.stopped = result.statistics.stopped ? 1 : 0;
+		record.reprojection_error = result.statistics.reprojection_error;
+		record.num_image_points = static_cast<std::uint32_t>(std::min<std::size_t>(result.fitted_image_points.size(), header.max_image_points));
+
+		const std::size_t offset = buffer.size();
+		buffer.resize(offset + header.record_size, 0);
+		char* data = buffer.data() + offset;
+		std::memcpy(data, &record, sizeof(record));
+		float* values = reinterpret_cast<float*>(data + sizeof(record));
+		std::copy(std::begin(result.pca_shape_coefficients), std::end(result.pca_shape_coefficients), values);
+		values += header.num_shape_coefficients;
+		std::copy(std::begin(result.blendshape_coefficients), std::end(result.blendshape_coefficients), values);
+		values += header.num_blendshape_coefficients;
+		for (std::uint32_t i = 0; i < record.num_image_points; ++i) {
+			values[2 * i] = result.fitted_image_points[i][0];
+			values[2 * i + 1] = result.fitted_image_points[i][1];
+		}
+		last_frame_index = frame_index;
+
+		if (buffered_records() >= static_cast<std::size_t>(buffer_size)) {
+			flush();
+		}
+	};
+
+	/**
+	 * Writes the buffered records to the file.
+	 *
+	 * @throw std::runtime_error When writing fails.
+	 */
+	void flush()
+	{
+		if (!buffer.empty())
+		{
+			const std::size_t num_buffered_records = buffered_records();
+			file.write(buffer.data(), buffer.size());
+			buffer.clear();
+			num_records += num_buffered_records;
+		}
+		file.flush();
+		if (file.fail()) {
+			throw std::runtime_error("FrameLogWriter: Error writing the frame log: " + filename);
+		}
+	};
+
+	/**
+	 * Returns the number of records in the log, including the buffered ones.
+	 */
+	std::size_t get_num_records() const
+	{
+		return static_cast<std::size_t>(num_records) + buffered_records();
+	};
+
+private:
+	std::size_t buffered_records() const
+	{
+		return buffer.size() / header.record_size;
+	};
+
+	std::string filename;
+	std::fstream file;
+	frame_log_format::Header header;
+	int buffer_size;
+	std::vector<char> buffer;
+	std::uint64_t num_records = 0; ///< The number of records in the file.
+	std::int64_t last_frame_index = 0;
+};
+
+/**
+ * @brief Reads a frame log written by FrameLogWriter, by memory-mapping it.
+ *
+ * Records are accessed by their position in the file, or by frame index with
+ * find_record(). The coefficients are returned as Eigen::Map that point into the
+ * mapped file, nothing is copied. The mapping is released when the reader and all
+ * copies of it have been destroyed.
+ *
+ * The reader sees the records that had been written when it was created. Records
+ * that a FrameLogWriter writes later need a new reader.
+ */
+class FrameLogReader
+{
+public:
+	/**
+	 * @brief Maps the given frame log.
+	 *
+	 * @param[in] filename A file written by FrameLogWriter.
+	 * @throw std::runtime_error When the file can't be mapped or is not a valid frame log.
+	 */
+	FrameLogReader(std::string filename)
+	{
+		using namespace boost::interprocess;
+		using namespace frame_log_format;
+		try {
+			const file_mapping file(filename.c_str(), read_only);
+			region = std::make_shared<const mapped_region>(file, read_only); // The mapping stays valid after the file_mapping is closed.
+		}
+		catch (const interprocess_exception& e) {
+			throw std::runtime_error("Error memory-mapping the given file: " + filename + " (" + e.what() + ")");
+		}
+		if (region->get_size() < sizeof(Header)) {
+			throw std::runtime_error("The given file is too small to be a frame log: " + filename);
+		}
+		std::memcpy(&header, region->get_address(), sizeof(Header));
+		if (std::memcmp(header.magic, magic, sizeof(header.magic)) != 0) {
+			throw std::runtime_error("The given file is not a frame log: " + filename);
+		}
+		if (header.byte_order_mark != byte_order_mark) {
+			throw std::runtime_error("The given frame log was written on a machine with a different byte order: " + filename);
+		}
+		if (header.version != version) {
+			throw std::runtime_error("The given frame log has version " + std::to_string(header.version) + ", but only version " + std::to_string(version) + " is supported: " + filename);
+		}
+		// A record size that overflowed Header::record_size can't match the 64-bit one. A log
+		// without records is valid, but otherwise the file must hold at least one record:
+		const std::uint64_t records_size = region->get_size() - sizeof(Header);
+		if (header.record_size != get_record_size(header.num_shape_coefficients, header.num_blendshape_coefficients, header.max_image_points) || (records_size > 0 && header.record_size > records_size)) {
+			throw std::runtime_error("The given frame log has an invalid record size: " + filename);
+		}
+		num_records = records_size / header.record_size;
+	};
+
+	/**
+	 * Returns the number of (complete) records in the log.
+	 */
+	std::size_t get_num_records() const
+	{
+		return num_records;
+	};
+
+	int get_num_shape_coefficients() const
+	{
+		return static_cast<int>(header.num_shape_coefficients);
+	};
+
+	int get_num_blendshape_coefficients() const
+	{
+		return static_cast<int>(header.num_blendshape_coefficients);
+	};
+
+	/**
+	 * Returns the frame index of the given record.
+	 */
+	std::int64_t get_frame_index(std::size_t record) const
+	{
+		return get_record_header(record).frame_index;
+	};
+
+	/**
+	 * @brief Finds the record of a frame, with a binary search over the records.
+	 *
+	 * @param[in] frame_index The index of the frame, as given to FrameLogWriter::append().
+	 * @return The position of the record, or boost::none if the log has no record for this frame.
+	 */
+	boost::optional<std::size_t> find_record(std::int64_t frame_index) const
+	{
+		std::size_t first = 0;
+		std::size_t last = num_records;
+		while (first < last)
+		{
+			const std::size_t middle = first + (last - first) / 2;
+			if (get_frame_index(middle) < frame_index) {
+				first = middle + 1;
+			} else {
+				last = middle;
+			}
+		}
+		if (first < num_records && get_frame_index(first) == frame_index) {
+			return first;
+		}
+		return boost::none;
+	};
+
+	/**
+	 * Returns the pose (and camera) of the given record.
+	 */
+	RenderingParameters get_rendering_parameters(std::size_t record) const
+	{
+		const auto record_header = get_record_header(record);
+		const Frustum frustum(record_header.frustum[0], record_header.frustum[1], record_header.frustum[2], record_header.frustum[3]);
+		const glm::quat rotation(record_header.rotation[0], record_header.rotation[1], record_header.rotation[2], record_header.rotation[3]);
+		return RenderingParameters(static_cast<CameraType>(record_header.camera_type), frustum, rotation, record_header.translation[0], record_header.translation[1], record_header.screen_width, record_header.screen_height);
+	};
+
+	/**
+	 * Returns the PCA shape coefficients of the given record, pointing into the mapped file.
+	 */
+	Eigen::Map<const Eigen::VectorXf> get_pca_shape_coefficients(std::size_t record) const
+	{
+		return Eigen::Map<const Eigen::VectorXf>(get_values(record), header.num_shape_coefficients);
+	};
+
+	/**
+	 * Returns the blendshape coefficients of the given record, pointing into the mapped file.
+	 */
+	Eigen::Map<const Eigen::VectorXf> get_blendshape_coefficients(std::size_t record) const
+	{
+		return Eigen::Map<const Eigen::VectorXf>(get_values(record) + header.num_shape_coefficients, header.num_blendshape_coefficients);
+	};
+
+	/**
+	 * Returns the fitted image points stored in the given record.
+	 */
+	std::vector<cv::Vec2f> get_fitted_image_points(std::size_t record) const
+	{
+		const auto record_header = get_record_header(record);
+		const float* values = get_values(record) + header.num_shape_coefficients + header.num_blendshape_coefficients;
+		// Clamped, so that a corrupt record can't make us read past it:
+		const std::uint32_t num_image_points = std::min(record_header.num_image_points, header.max_image_points);
+		std::vector<cv::Vec2f> image_points(num_image_points);
+		for (std::uint32_t i = 0; i < num_image_points; ++i) {
+			image_points[i] = cv::Vec2f(values[2 * i], values[2 * i + 1]);
+		}
+		return image_points;
+	};
+
+	/**
+	 * Returns the fitting statistics of the given record.
+	 */
+	FittingStatistics get_statistics(std::size_t record) const
+	{
+		const auto record_header = get_record_header(record);
+		FittingStatistics statistics;
+		statistics.num_iterations = record_header.num_iterations;
+		statistics.converged = record_header.converged != 0;
+		statistics.stopped = record_header.stopped != 0;
+		statistics.reprojection_error = record_header.reprojection_error;
+		return statistics;
+	};
+
+	/**
+	 * Returns a copy of everything stored in the given record.
+	 */
+	FittingResult get_fitting_result(std::size_t record) const
+	{
+		FittingResult result;
+		result.rendering_parameters = get_rendering_parameters(record);
+		const auto pca_shape_coefficients = get_pca_shape_coefficients(record);
+		result.pca_shape_coefficients.assign(pca_shape_coefficients.data(), pca_shape_coefficients.data() + pca_shape_coefficients.size());
+		const auto blendshape_coefficients = get_blendshape_coefficients(record);
+		result.blendshape_coefficients.assign(blendshape_coefficients.data(), blendshape_coefficients.data() + blendshape_coefficients.size());
+		result.fitted_image_points = get_fitted_image_points(record);
+		result.statistics = get_statistics(record);
+		return result;
+	};
+
+private:
+	const char* get_record_data(std::size_t record) const
+	{
+		assert(record < num_records);
+		return static_cast<const char*>(region->get_address()) + sizeof(frame_log_format::Header) + record * header.record_size;
+	};
+
+	frame_log_format::RecordHeader get_record_header(std::size_t record) const
+	{
+		frame_log_format::RecordHeader record_header;
+		std::memcpy(&record_header, get_record_data(record), sizeof(record_header));
+		return record_header;
+	};
+
+	const float* get_values(std::size_t record) const
+	{
+		return reinterpret_cast<const float*>(get_record_data(record) + sizeof(frame_log_format::RecordHeader));
+	};
+
+	std::shared_ptr<const boost::interprocess::mapped_region> region;
+	frame_log_format::Header header;
+	std::size_t num_records = 0;
+};
+
+	} /* namespace fitting */
+} /* namespace eos */
+
+#endif /* FRAMELOG_HPP_ */
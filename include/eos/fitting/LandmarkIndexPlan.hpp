@@ -0,0 +1,317 @@
+/*
+ * eos - A 3D Morphable Model fitting library written in modern C++11/14.
+ *
+ * File: include/eos/fitting/LandmarkIndexPlan.hpp
+ *
+ * Copyright 2017 Patrik Huber
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#ifndef LANDMARKINDEXPLAN_HPP_
+#define LANDMARKINDEXPLAN_HPP_
+
+#include "eos/core/Landmark.hpp"
+#include "eos/core/LandmarkMapper.hpp"
+#include "eos/core/VertexView.hpp"
+#include "eos/fitting/contour_correspondence.hpp"
+
+#include "glm/gtc/matrix_transform.hpp"
+
+#include "Eigen/Core"
+
+#include "opencv2/core/core.hpp"
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstddef>
+#include <cassert>
+
+namespace eos {
+	namespace fitting {
+
+/**
+ * @brief Returns the names of the 68 ibug landmarks, "1" to "68", in the order
+ * they are stored in a .pts file.
+ *
+ * @return The ibug landmark names.
+ */
+inline std::vector<std::string> get_ibug_landmark_names()
+{
+	std::vector<std::string> names;
+	for (int i = 1; i <= 68; ++i) {
+		names.push_back(std::to_string(i));
+	}
+	return names;
+};
+
+/**
+ * @brief The landmark mappings and contour landmarks of one landmark scheme
+ * (e.g. ibug-68), resolved to integer indices.
+ *
+ * A LandmarkMapper and the ContourLandmarks work with landmark names, so
+ * building the correspondences of one image costs a std::map lookup, a
+ * std::stoi and a few string copies per landmark, and finding the contour
+ * landmarks compares all names. When the landmarks always come in the same
+ * order (as they do from a landmark detector), all of that can be done once:
+ * The plan stores, for each landmark position in a collection, the vertex it
+ * maps to, and the positions of the right and left contour landmarks. Building
+ * the correspondences is then just indexing into the landmark collection.
+ *
+ * The plan is only valid for landmark collections with the names (and order)
+ * it was compiled for, see is_compiled_for().
+ */
+class LandmarkIndexPlan
+{
+public:
+	LandmarkIndexPlan() = default;
+
+	/**
+	 * @brief Compiles the plan for landmark collections with the given names,
+	 * in the given order.
+	 *
+	 * Landmarks that the mapper has no mapping for are skipped, as in
+	 * get_corresponding_pointset(). Contour landmarks that are not among
+	 * \p landmark_names are skipped too.
+	 *
+	 * @param[in] landmark_names The names of the landmarks, in the order they are stored in a LandmarkCollection.
+	 * @param[in] landmark_mapper A mapper which maps the 2D landmark identifiers to 3D model vertex indices.
+	 * @param[in] contour_landmarks 2D image contour ids of the left and right side.
+	 * @throws std::invalid_argument if a mapped name is not a vertex index.
+	 */
+	LandmarkIndexPlan(std::vector<std::string> landmark_names, const core::LandmarkMapper& landmark_mapper, const ContourLandmarks& contour_landmarks) : landmark_names(std::move(landmark_names)), compiled_mapper(&landmark_mapper), compiled_contour_landmarks(&contour_landmarks)
+	{
+		const int num_landmarks = static_cast<int>(this->landmark_names.size());
+		for (int i = 0; i < num_landmarks; ++i)
+		{
+			auto converted_name = landmark_mapper.convert(this->landmark_names[i]);
+			if (!converted_name) { // no mapping defined for the current landmark
+				continue;
+			}
+			mapped_landmarks.push_back(i);
+			vertex_indices.push_back(std::stoi(converted_name.get()));
+		}
+		const auto find_positions = [this](const std::vector<std::string>& contour) {
+			std::vector<int> positions;
+			for (const auto& name : contour)
+			{
+				const auto position = std::find(begin(this->landmark_names), end(this->landmark_names), name);
+				if (position != end(this->landmark_names)) {
+					positions.push_back(static_cast<int>(std::distance(begin(this->landmark_names), position)));
+				}
+			}
+			return positions;
+		};
+		right_contour = find_positions(contour_landmarks.right_contour);
+		left_contour = find_positions(contour_landmarks.left_contour);
+	};
+
+	/**
+	 * @brief Compiles the plan for landmark collections with the same names
+	 * (and order) as \p landmarks.
+	 *
+	 * @param[in] landmarks A landmark collection of the scheme to compile the plan for.
+	 * @param[in] landmark_mapper A mapper which maps the 2D landmark identifiers to 3D model vertex indices.
+	 * @param[in] contour_landmarks 2D image contour ids of the left and right side.
+	 */
+	LandmarkIndexPlan(const core::LandmarkCollection<cv::Vec2f>& landmarks, const core::LandmarkMapper& landmark_mapper, const ContourLandmarks& contour_landmarks) : LandmarkIndexPlan(get_names(landmarks), landmark_mapper, contour_landmarks)
+	{
+	};
+
+	/**
+	 * @brief Returns whether this plan can be used for \p landmarks.
+	 *
+	 * That is the case if it was compiled with this \p landmark_mapper and these
+	 * \p contour_landmarks (the same objects), and \p landmarks has the same
+	 * names in the same order. Comparing the names is a lot cheaper than mapping
+	 * them, but it's not free - when the scheme is known to be fixed, the check
+	 * can be left out.
+	 *
+	 * @param[in] landmarks The landmarks to check.
+	 * @param[in] landmark_mapper The mapper that would be used without the plan.
+	 * @param[in] contour_landmarks The contour landmarks that would be used without the plan.
+	 * @return Whether the plan is valid for \p landmarks.
+	 */
+	bool is_compiled_for(const core::LandmarkCollection<cv::Vec2f>& landmarks, const core::LandmarkMapper& landmark_mapper, const ContourLandmarks& contour_landmarks) const
+	{
+		if (&landmark_mapper != compiled_mapper || &contour_landmarks != compiled_contour_landmarks || landmarks.size() != landmark_names.size()) {
+			return false;
+		}
+		for (std::size_t i = 0; i < landmarks.size(); ++i) {
+			if (landmarks[i].name != landmark_names[i]) {
+				return false;
+			}
+		}
+		return true;
+	};
+
+	/**
+	 * Returns the number of landmarks in the scheme.
+	 */
+	int get_num_landmarks() const
+	{
+		return static_cast<int>(landmark_names.size());
+	};
+
+	/**
+	 * Returns the positions (in a landmark collection) of the landmarks that have a mapping.
+	 */
+	const std::vector<int>& get_mapped_landmarks() const
+	{
+		return mapped_landmarks;
+	};
+
+	/**
+	 * Returns the vertex index of each of the get_mapped_landmarks().
+	 */
+	const std::vector<int>& get_vertex_indices() const
+	{
+		return vertex_indices;
+	};
+
+	/**
+	 * Returns the positions of the right contour landmarks, in the order of the ContourLandmarks.
+	 */
+	const std::vector<int>& get_right_contour() const
+	{
+		return right_contour;
+	};
+
+	/**
+	 * Returns the positions of the left contour landmarks, in the order of the ContourLandmarks.
+	 */
+	const std::vector<int>& get_left_contour() const
+	{
+		return left_contour;
+	};
+
+private:
+	static std::vector<std::string> get_names(const core::LandmarkCollection<cv::Vec2f>& landmarks)
+	{
+		std::vector<std::string> names;
+		names.reserve(landmarks.size());
+		for (const auto& landmark : landmarks) {
+			names.push_back(landmark.name);
+		}
+		return names;
+	};
+
+	std::vector<std::string> landmark_names; ///< The scheme the plan was compiled for.
+	std::vector<int> mapped_landmarks; ///< Positions of the landmarks that have a mapping.
+	std::vector<int> vertex_indices; ///< The vertex index of each mapped landmark.
+	std::vector<int> right_contour; ///< Positions of the right contour landmarks.
+	std::vector<int> left_contour; ///< Positions of the left contour landmarks.
+
+	// Used to detect whether the plan has to be re-compiled:
+	const core::LandmarkMapper* compiled_mapper = nullptr;
+	const ContourLandmarks* compiled_contour_landmarks = nullptr;
+};
+
+/**
+ * @brief Gets the 2D-3D correspondences of the mapped landmarks, like
+ * get_corresponding_pointset(), but with a compiled plan and into the given
+ * buffers (which are cleared first, but keep their capacity).
+ *
+ * @param[in] landmarks The landmarks, of the scheme that \p plan was compiled for.
+ * @param[in] plan The compiled landmark plan.
+ * @param[in] vertices The vertices to take the model points from (e.g. the current shape).
+ * @param[out] image_points The 2D landmark points that have a mapping.
+ * @param[out] model_points The corresponding vertices.
+ * @param[out] vertex_indices Their vertex indices.
+ */
+inline void get_corresponding_pointset(const core::LandmarkCollection<cv::Vec2f>& landmarks, const LandmarkIndexPlan& plan, const core::VertexView& vertices, std::vector<cv::Vec2f>& image_points, std::vector<cv::Vec4f>& model_points, std::vector<int>& vertex_indices)
+{
+	assert(static_cast<int>(landmarks.size()) == plan.get_num_landmarks());
+	const auto& mapped_landmarks = plan.get_mapped_landmarks();
+	image_points.clear();
+	model_points.clear();
+	vertex_indices = plan.get_vertex_indices();
+	for (std::size_t i = 0; i < mapped_landmarks.size(); ++i)
+	{
+		image_points.push_back(landmarks[mapped_landmarks[i]].coordinates);
+		const auto vertex = vertices[vertex_indices[i]];
+		model_points.push_back({ vertex.x, vertex.y, vertex.z, vertex.w });
+	}
+};
+
+/**
+ * @brief Returns the coordinates of the landmarks at the given positions,
+ * e.g. of LandmarkIndexPlan::get_left_contour(). This is core::filter() with
+ * a compiled plan.
+ *
+ * @param[in] landmarks The landmarks, of the scheme the positions were compiled for.
+ * @param[in] positions The positions of the landmarks to return.
+ * @return The coordinates of the selected landmarks.
+ */
+inline std::vector<Eigen::Vector2f> get_landmark_points(const core::LandmarkCollection<cv::Vec2f>& landmarks, const std::vector<int>& positions)
+{
+	std::vector<Eigen::Vector2f> points;
+	points.reserve(positions.size());
+	for (int position : positions) {
+		points.push_back({ landmarks[position].coordinates[0], landmarks[position].coordinates[1] });
+	}
+	return points;
+};
+
+/**
+ * @brief Finds the 2D-3D correspondences of the front-facing contour, like
+ * get_contour_correspondences(), but with a compiled plan. The correspondences
+ * are appended to \p image_points and \p vertex_indices.
+ *
+ * NearestContourSearch does the same, but keeps its buffers, and can restrict
+ * the search to the neighbourhood of the previous matches.
+ *
+ * @param[in] landmarks All image landmarks, of the scheme that \p plan was compiled for.
+ * @param[in] plan The compiled landmark plan.
+ * @param[in] model_contour The model contour indices that should be considered to find the closest corresponding 3D vertex.
+ * @param[in] yaw_angle Yaw angle of the current fitting, in degrees. The front-facing contour will be chosen depending on this yaw angle.
+ * @param[in] vertices The vertices of the mesh that's used to find the nearest contour points.
+ * @param[in] view_model Model-view matrix of the current fitting to project the 3D model vertices to 2D.
+ * @param[in] ortho_projection Projection matrix to project the 3D model vertices to 2D.
+ * @param[in] viewport Current viewport to use.
+ * @param[in,out] image_points The 2D contour landmark points are appended to this.
+ * @param[in,out] vertex_indices The vertex indices of their nearest model contour vertices are appended to this.
+ */
+inline void get_contour_correspondences(const core::LandmarkCollection<cv::Vec2f>& landmarks, const LandmarkIndexPlan& plan, const ModelContour& model_contour, float yaw_angle, const core::VertexView& vertices, const glm::mat4x4& view_model, const glm::mat4x4& ortho_projection, const glm::vec4& viewport, std::vector<cv::Vec2f>& image_points, std::vector<int>& vertex_indices)
+{
+	assert(static_cast<int>(landmarks.size()) == plan.get_num_landmarks());
+	Eigen::ArrayXf projected_x, projected_y;
+	const auto add_nearest = [&](const std::vector<int>& landmark_positions, const std::vector<int>& model_contour_indices) {
+		if (model_contour_indices.empty()) {
+			return;
+		}
+		// Project the candidates once, not for each landmark:
+		detail::project_vertices(model_contour_indices, vertices, view_model, ortho_projection, viewport, projected_x, projected_y);
+		for (int position : landmark_positions)
+		{
+			const cv::Vec2f& landmark = landmarks[position].coordinates;
+			const int nearest = detail::find_nearest_projected_vertex(projected_x, projected_y, landmark, 0, static_cast<int>(model_contour_indices.size()));
+			image_points.push_back(landmark);
+			vertex_indices.push_back(model_contour_indices[nearest]);
+		}
+	};
+	// The same selection as in select_contour(), including the overlap between +-7.5 degrees:
+	if (yaw_angle >= -7.5f) {
+		add_nearest(plan.get_right_contour(), model_contour.right_contour);
+	}
+	if (yaw_angle <= 7.5f) {
+		add_nearest(plan.get_left_contour(), model_contour.left_contour);
+	}
+};
+
+	} /* namespace fitting */
+} /* namespace eos */
+
+#endif /* LANDMARKINDEXPLAN_HPP_ */
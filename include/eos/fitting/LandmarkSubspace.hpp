@@ -0,0 +1,211 @@
+/*
+ * eos - A 3D Morphable Model fitting library written in modern C++11/14.
+ *
+ * File: include/eos/fitting/LandmarkSubspace.hpp
+ *
+ * Copyright 2016 Patrik Huber
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#ifndef LANDMARKSUBSPACE_HPP_
+#define LANDMARKSUBSPACE_HPP_
+
+#include "eos/morphablemodel/PcaModel.hpp"
+#include "eos/morphablemodel/Blendshape.hpp"
+
+#include "Eigen/Core"
+
+#include <vector>
+#include <algorithm>
+#include <cassert>
+
+namespace eos {
+	namespace fitting {
+
+/**
+ * @brief The rows of the shape model's mean, its rescaled PCA basis and
+ * the blendshapes that belong to a set of vertices, stored contiguously.
+ *
+ * The linear shape and blendshape fittings only need the model at the vertices
+ * that correspond to landmarks. Instead of copying these 3-row blocks out of the
+ * full model in every call, they can be gathered once into a LandmarkSubspace,
+ * which the solvers take directly.
+ *
+ * update() only re-copies the rows of vertices that changed: In the iterative
+ * fitting, the fixed inner-face landmarks come first and never change, so only
+ * the rows of the contour and edge correspondences at the end are refreshed.
+ *
+ * The rows are stored in the same format as the model, i.e. [x_1 y_1 z_1 x_2 ...].
+ */
+class LandmarkSubspace
+{
+public:
+	LandmarkSubspace() = default;
+
+	/**
+	 * @brief Gathers the rows of the given vertices from the shape model and blendshapes.
+	 *
+	 * @param[in] shape_model The PCA shape model.
+	 * @param[in] blendshapes The blendshapes. Can be empty.
+	 * @param[in] vertex_ids The vertex ids whose rows to gather.
+	 */
+	LandmarkSubspace(const morphablemodel::PcaModel& shape_model, const std::vector<morphablemodel::Blendshape>& blendshapes, const std::vector<int>& vertex_ids)
+	{
+		update(shape_model, blendshapes, vertex_ids);
+	};
+
+	/**
+	 * @brief Updates the subspace to the given vertices.
+	 *
+	 * Rows are only copied for the positions i where \p vertex_ids[i] differs from
+	 * the current vertex id at that position. If the model or the blendshapes are
+	 * different objects than in the previous call, all rows are gathered again.
+	 * The storage is only reallocated when the number of vertices grows.
+	 *
+	 * @param[in] shape_model The PCA shape model.
+	 * @param[in] blendshapes The blendshapes. Can be empty.
+	 * @param[in] vertex_ids The vertex ids whose rows to gather.
+	 */
+	void update(const morphablemodel::PcaModel& shape_model, const std::vector<morphablemodel::Blendshape>& blendshapes, const std::vector<int>& vertex_ids)
+	{
+		const auto& basis = shape_model.get_rescaled_pca_basis();
+		const int num_blendshapes = static_cast<int>(blendshapes.size());
+		if (&shape_model != cached_shape_model || &blendshapes != cached_blendshapes || basis.cols() != pca_basis.cols() || num_blendshapes != blendshape_basis.cols())
+		{
+			this->vertex_ids.clear(); // gather all rows again
+			cached_shape_model = &shape_model;
+			cached_blendshapes = &blendshapes;
+			mean.resize(0);
+			pca_basis.resize(0, basis.cols());
+			blendshape_basis.resize(0, num_blendshapes);
+		}
+
+		const int num_rows = 3 * static_cast<int>(vertex_ids.size());
+		if (num_rows > mean.rows())
+		{
+			// Grow, keeping the rows that we already have:
+			const int capacity = std::max(num_rows, 2 * static_cast<int>(mean.rows()));
+			mean.conservativeResize(capacity);
+			pca_basis.conservativeResize(capacity, Eigen::NoChange);
+			blendshape_basis.conservativeResize(capacity, Eigen::NoChange);
+		}
+
+		for (std::size_t i = 0; i < vertex_ids.size(); ++i)
+		{
+			if (i < this->vertex_ids.size() && this->vertex_ids[i] == vertex_ids[i]) {
+				continue;
+			}
+			const int vertex_row = 3 * vertex_ids[i]; // the model is stored in the format [x y z x y z ...]
+			assert(vertex_row < shape_model.get_data_dimension());
+			mean.segment<3>(3 * i) = shape_model.get_mean().segment<3>(vertex_row);
+			pca_basis.middleRows<3>(3 * i) = basis.middleRows<3>(vertex_row);
+			for (int b = 0; b < num_blendshapes; ++b) {
+				blendshape_basis.block<3, 1>(3 * i, b) = blendshapes[b].deformation.segment<3>(vertex_row);
+			}
+		}
+		this->vertex_ids = vertex_ids;
+	};
+
+	/**
+	 * Returns the vertex ids that this subspace consists of.
+	 *
+	 * @return The vertex ids.
+	 */
+	const std::vector<int>& get_vertex_ids() const
+	{
+		return vertex_ids;
+	};
+
+	/**
+	 * Returns the number of vertices in this subspace.
+	 *
+	 * @return The number of vertices.
+	 */
+	int get_num_vertices() const
+	{
+		return static_cast<int>(vertex_ids.size());
+	};
+
+	/**
+	 * Returns the rows of the shape model's mean, a 3N x 1 vector.
+	 *
+	 * @return The mean at the vertices.
+	 */
+	auto get_mean() const
+	{
+		return mean.head(3 * get_num_vertices());
+	};
+
+	/**
+	 * Returns the rows of the rescaled PCA shape basis, a 3N x m matrix.
+	 *
+	 * @return The rescaled PCA basis at the vertices.
+	 */
+	auto get_rescaled_pca_basis() const
+	{
+		return pca_basis.topRows(3 * get_num_vertices());
+	};
+
+	/**
+	 * @brief Computes the shape at the vertices of this subspace, with the given PCA
+	 * shape and blendshape coefficients, into \p result.
+	 *
+	 * This is the fastest way to reconstruct the same few vertices many times, since
+	 * the rows are stored contiguously.
+	 *
+	 * @param[in] shape_coefficients The PCA shape coefficients. Missing ones are assumed to be zero.
+	 * @param[in] blendshape_coefficients The blendshape coefficients. Can be empty, to not add any blendshapes.
+	 * @param[out] result A vector of size 3N for the result, in the format [x_1 y_1 z_1 x_2 ...].
+	 */
+	void draw_sample(const std::vector<float>& shape_coefficients, const std::vector<float>& blendshape_coefficients, Eigen::Ref<Eigen::VectorXf> result) const
+	{
+		assert(result.size() == 3 * get_num_vertices());
+		const auto num_shape_coefficients = std::min(static_cast<Eigen::Index>(shape_coefficients.size()), pca_basis.cols());
+		const int num_rows = 3 * get_num_vertices();
+		result = mean.head(num_rows);
+		result.noalias() += pca_basis.topLeftCorner(num_rows, num_shape_coefficients) * Eigen::Map<const Eigen::VectorXf>(shape_coefficients.data(), num_shape_coefficients);
+		if (!blendshape_coefficients.empty())
+		{
+			assert(static_cast<Eigen::Index>(blendshape_coefficients.size()) == blendshape_basis.cols());
+			result.noalias() += blendshape_basis.topRows(num_rows) * Eigen::Map<const Eigen::VectorXf>(blendshape_coefficients.data(), blendshape_coefficients.size());
+		}
+	};
+
+	/**
+	 * Returns the rows of the blendshapes, a 3N x B matrix with each blendshape being a column.
+	 *
+	 * @return The blendshapes at the vertices.
+	 */
+	auto get_blendshapes() const
+	{
+		return blendshape_basis.topRows(3 * get_num_vertices());
+	};
+
+private:
+	std::vector<int> vertex_ids;
+	// The storage can have more rows than needed (its capacity). Only the first 3N rows are valid:
+	Eigen::VectorXf mean;
+	Eigen::MatrixXf pca_basis;
+	Eigen::MatrixXf blendshape_basis;
+
+	// Used to detect whether the rows have to be gathered again:
+	const morphablemodel::PcaModel* cached_shape_model = nullptr;
+	const std::vector<morphablemodel::Blendshape>* cached_blendshapes = nullptr;
+};
+
+	} /* namespace fitting */
+} /* namespace eos */
+
+#endif /* LANDMARKSUBSPACE_HPP_ */
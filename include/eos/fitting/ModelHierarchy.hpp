@@ -0,0 +1,481 @@
+/*
+ * eos - A 3D Morphable Model fitting library written in modern C++11/14.
+ *
+ * File: include/eos/fitting/ModelHierarchy.hpp
+ *
+ * Copyright 2017 Patrik Huber
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#ifndef MODELHIERARCHY_HPP_
+#define MODELHIERARCHY_HPP_
+
+#include "eos/core/Landmark.hpp"
+#include "eos/core/LandmarkMapper.hpp"
+#include "eos/core/Mesh.hpp"
+#include "eos/morphablemodel/MorphableModel.hpp"
+#include "eos/morphablemodel/PcaModel.hpp"
+#include "eos/morphablemodel/Blendshape.hpp"
+#include "eos/morphablemodel/EdgeTopology.hpp"
+#include "eos/fitting/contour_correspondence.hpp"
+#include "eos/fitting/fitting.hpp"
+#include "eos/fitting/RenderingParameters.hpp"
+
+#include "Eigen/Core"
+
+#include "opencv2/core/core.hpp"
+
+#include "boost/optional.hpp"
+
+#include <vector>
+#include <array>
+#include <string>
+#include <map>
+#include <unordered_map>
+#include <algorithm>
+#include <limits>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <stdexcept>
+#include <cassert>
+
+namespace eos {
+	namespace fitting {
+
+/**
+ * @brief A decimated version of a Morphable Model, with everything the fitting
+ * needs to run on it instead of on the full model.
+ *
+ * The vertices of a level are a subset of the full model's vertices, so the mean,
+ * the PCA bases and the blendshapes of the level are just the rows of the full
+ * model's ones at these vertices. The PCA and blendshape coefficients therefore mean
+ * the same on all levels, and can be passed from a coarse level to the full model
+ * unchanged. (Note that the "orthonormal" basis of a level is the rows of the full
+ * orthonormal basis, so it isn't orthonormal anymore.)
+ *
+ * The landmark mapper, model contour and edge topology are converted to the level's
+ * vertex indices.
+ */
+struct ModelLevel
+{
+	morphablemodel::MorphableModel morphable_model;
+	std::vector<morphablemodel::Blendshape> blendshapes;
+	core::LandmarkMapper landmark_mapper; ///< Maps the landmarks to the vertex indices of this level.
+	ModelContour model_contour; ///< The model contour, in vertex indices of this level.
+	morphablemodel::EdgeTopology edge_topology;
+	std::vector<int> full_vertex_indices; ///< For each vertex of this level, its index in the full model.
+	std::vector<int> level_vertex_indices; ///< For each vertex of the full model, the vertex of this level that represents it.
+
+	/**
+	 * Converts vertex indices of the full model to the ones of this level, e.g.
+	 * for the CeresFitter of a level. Vertices that aren't in this level are
+	 * replaced by the level's vertex that represents them.
+	 *
+	 * @param[in] vertex_indices Vertex indices in the full model.
+	 * @return The corresponding vertex indices in this level.
+	 */
+	std::vector<int> to_level(const std::vector<int>& vertex_indices) const
+	{
+		std::vector<int> converted(vertex_indices.size());
+		for (std::size_t i = 0; i < vertex_indices.size(); ++i) {
+			converted[i] = level_vertex_indices[vertex_indices[i]];
+		}
+		return converted;
+	};
+};
+
+		namespace detail {
+
+// Returns the vertex indices that the given mapper maps any landmark to (if it maps them to vertex indices).
+inline std::vector<int> get_mapped_vertex_indices(const core::LandmarkMapper& landmark_mapper, int num_vertices)
+{
+	std::vector<int> vertex_indices;
+	for (const auto& mapping : landmark_mapper.get_mappings())
+	{
+		char* end = nullptr;
+		const long vertex_index = std::strtol(mapping.second.c_str(), &end, 10);
+		if (!mapping.second.empty() && *end == '\0' && vertex_index >= 0 && vertex_index < num_vertices) {
+			vertex_indices.push_back(static_cast<int>(vertex_index));
+		}
+	}
+	return vertex_indices;
+};
+
+/**
+ * Clusters the vertices of a shape on a regular grid with the given cell size.
+ *
+ * Each cell is represented by the vertex closest to the cell's centroid, except for
+ * cells with vertices that have to be kept: These are all kept, and the cell's other
+ * vertices are represented by the closest one of them.
+ *
+ * @param[in] shape The shape, as 3N x 1 vector.
+ * @param[in] cell_size Size of the grid cells.
+ * @param[in] is_kept For each vertex, whether it has to be kept.
+ * @return For each vertex, the index of the vertex that represents it.
+ */
+inline std::vector<int> cluster_vertices(const Eigen::Map<const Eigen::VectorXf>& shape, float cell_size, const std::vector<bool>& is_kept)
+{
+	const int num_vertices = static_cast<int>(shape.size() / 3);
+	Eigen::Vector3f min_corner = Eigen::Vector3f::Constant(std::numeric_limits<float>::max());
+	for (int i = 0; i < num_vertices; ++i) {
+		min_corner = min_corner.cwiseMin(shape.segment<3>(3 * i));
+	}
+	// Assign the vertices to cells, with 21 bits per coordinate:
+	std::unordered_map<std::uint64_t, int> cell_of_key;
+	std::vector<int> cell_of_vertex(num_vertices);
+	for (int i = 0; i < num_vertices; ++i)
+	{
+		const Eigen::Vector3f position = (shape.segment<3>(3 * i) - min_corner) / cell_size;
+		const auto coordinate = [&position](int axis) { return static_cast<std::uint64_t>(std::min(position(axis), 2097151.0f)); };
+		const std::uint64_t key = coordinate(0) | (coordinate(1) << 21) | (coordinate(2) << 42);
+		cell_of_vertex[i] = cell_of_key.emplace(key, static_cast<int>(cell_of_key.size())).first->second;
+	}
+	const int num_cells = static_cast<int>(cell_of_key.size());
+	std::vector<Eigen::Vector3f> centroids(num_cells, Eigen::Vector3f::Zero());
+	std::vector<int> counts(num_cells, 0);
+	std::vector<std::vector<int>> kept_vertices(num_cells);
+	for (int i = 0; i < num_vertices; ++i)
+	{
+		centroids[cell_of_vertex[i]] += shape.segment<3>(3 * i);
+		++counts[cell_of_vertex[i]];
+		if (is_kept[i]) {
+			kept_vertices[cell_of_vertex[i]].push_back(i);
+		}
+	}
+	for (int c = 0; c < num_cells; ++c) {
+		centroids[c] /= static_cast<float>(counts[c]);
+	}
+
+	std::vector<int> representatives(num_vertices, -1);
+	std::vector<float> best_distance(num_cells, std::numeric_limits<float>::max());
+	std::vector<int> best_vertex(num_cells, -1);
+	for (int i = 0; i < num_vertices; ++i)
+	{
+		const int c = cell_of_vertex[i];
+		if (is_kept[i]) {
+			representatives[i] = i;
+		}
+		else if (!kept_vertices[c].empty()) {
+			// Represented by the closest kept vertex:
+			float min_distance = std::numeric_limits<float>::max();
+			for (int k : kept_vertices[c])
+			{
+				const float distance = (shape.segment<3>(3 * i) - shape.segment<3>(3 * k)).squaredNorm();
+				if (distance < min_distance) {
+					min_distance = distance;
+					representatives[i] = k;
+				}
+			}
+		}
+		else {
+			const float distance = (shape.segment<3>(3 * i) - centroids[c]).squaredNorm();
+			if (distance < best_distance[c]) {
+				best_distance[c] = distance;
+				best_vertex[c] = i;
+			}
+		}
+	}
+	for (int i = 0; i < num_vertices; ++i) {
+		if (representatives[i] == -1) {
+			representatives[i] = best_vertex[cell_of_vertex[i]];
+		}
+	}
+	return representatives;
+};
+
+// Creates the PCA model that consists of the given rows (vertices) of the given model.
+inline morphablemodel::PcaModel select_vertices(const morphablemodel::PcaModel& model, const std::vector<int>& vertex_indices, std::vector<std::array<int, 3>> triangle_list)
+{
+	const auto mean = model.get_mean();
+	const auto basis = model.get_orthonormal_pca_basis();
+	const int num_vertices = static_cast<int>(vertex_indices.size());
+	Eigen::VectorXf level_mean(3 * num_vertices);
+	Eigen::MatrixXf level_basis(3 * num_vertices, basis.cols());
+	for (int i = 0; i < num_vertices; ++i)
+	{
+		level_mean.segment<3>(3 * i) = mean.segment<3>(3 * vertex_indices[i]);
+		level_basis.middleRows<3>(3 * i) = basis.middleRows<3>(3 * vertex_indices[i]);
+	}
+	return morphablemodel::PcaModel(level_mean, level_basis, model.get_eigenvalues(), triangle_list);
+};
+
+		} /* namespace detail */
+
+/**
+ * @brief Decimates a Morphable Model (and the data the fitting needs with it) to a
+ * given number of vertices.
+ *
+ * The vertices are clustered on a regular grid (fitted to the mean shape), and each
+ * cluster is replaced by one of its vertices. The vertices that the landmark mapper
+ * and the model contour refer to are always kept. Triangles that collapse are removed.
+ * The cell size is searched so that the level gets about \p num_vertices vertices.
+ *
+ * @param[in] morphable_model The full model.
+ * @param[in] blendshapes The blendshapes of the full model.
+ * @param[in] landmark_mapper Mapping from the 2D landmarks to vertex indices of the full model.
+ * @param[in] model_contour The model contour of the full model.
+ * @param[in] num_vertices The number of vertices the level should have, approximately.
+ * @return The decimated model level.
+ */
+inline ModelLevel create_model_level(const morphablemodel::MorphableModel& morphable_model, const std::vector<morphablemodel::Blendshape>& blendshapes, const core::LandmarkMapper& landmark_mapper, const ModelContour& model_contour, int num_vertices)
+{
+	const auto& shape_model = morphable_model.get_shape_model();
+	const auto mean = shape_model.get_mean();
+	const int num_full_vertices = shape_model.get_data_dimension() / 3;
+
+	std::vector<bool> is_kept(num_full_vertices, false);
+	for (int v : detail::get_mapped_vertex_indices(landmark_mapper, num_full_vertices)) {
+		is_kept[v] = true;
+	}
+	for (const auto* contour : { &model_contour.right_contour, &model_contour.left_contour }) {
+		for (int v : *contour) {
+			is_kept[v] = true;
+		}
+	}
+
+	// Search the cell size (on a log scale) that gives the requested number of vertices:
+	Eigen::Vector3f min_corner = Eigen::Vector3f::Constant(std::numeric_limits<float>::max());
+	Eigen::Vector3f max_corner = -min_corner;
+	for (int i = 0; i < num_full_vertices; ++i) {
+		min_corner = min_corner.cwiseMin(mean.segment<3>(3 * i));
+		max_corner = max_corner.cwiseMax(mean.segment<3>(3 * i));
+	}
+	const auto count_representatives = [&](const std::vector<int>& representatives) {
+		int count = 0;
+		for (int i = 0; i < num_full_vertices; ++i) {
+			count += (representatives[i] == i);
+		}
+		return count;
+	};
+	float min_cell_size = 1e-6f * (max_corner - min_corner).maxCoeff();
+	float max_cell_size = (max_corner - min_corner).maxCoeff();
+	std::vector<int> representatives;
+	for (int step = 0; step < 20; ++step)
+	{
+		const float cell_size = std::sqrt(min_cell_size * max_cell_size);
+		representatives = detail::cluster_vertices(mean, cell_size, is_kept);
+		const int count = count_representatives(representatives);
+		if (std::abs(count - num_vertices) <= num_vertices / 20) {
+			break;
+		}
+		(count > num_vertices ? min_cell_size : max_cell_size) = cell_size;
+	}
+
+	ModelLevel level;
+	level.level_vertex_indices.assign(num_full_vertices, -1);
+	for (int i = 0; i < num_full_vertices; ++i)
+	{
+		if (representatives[i] == i) {
+			level.level_vertex_indices[i] = static_cast<int>(level.full_vertex_indices.size());
+			level.full_vertex_indices.push_back(i);
+		}
+	}
+	for (int i = 0; i < num_full_vertices; ++i) {
+		level.level_vertex_indices[i] = level.level_vertex_indices[representatives[i]];
+	}
+
+	// Keep the triangles that don't collapse, and only one of the ones that become the same:
+	std::vector<std::array<int, 3>> triangle_list;
+	std::vector<std::array<int, 3>> sorted_triangles;
+	for (const auto& triangle : shape_model.get_triangle_list())
+	{
+		const std::array<int, 3> level_triangle = { level.level_vertex_indices[triangle[0]], level.level_vertex_indices[triangle[1]], level.level_vertex_indices[triangle[2]] };
+		if (level_triangle[0] == level_triangle[1] || level_triangle[1] == level_triangle[2] || level_triangle[0] == level_triangle[2]) {
+			continue;
+		}
+		auto sorted_triangle = level_triangle;
+		std::sort(std::begin(sorted_triangle), std::end(sorted_triangle));
+		triangle_list.push_back(level_triangle);
+		sorted_triangles.push_back(sorted_triangle);
+	}
+	std::vector<int> order(triangle_list.size());
+	for (std::size_t i = 0; i < order.size(); ++i) {
+		order[i] = static_cast<int>(i);
+	}
+	std::stable_sort(std::begin(order), std::end(order), [&sorted_triangles](int lhs, int rhs) { return sorted_triangles[lhs] < sorted_triangles[rhs]; });
+	std::vector<bool> is_duplicate(triangle_list.size(), false);
+	for (std::size_t i = 1; i < order.size(); ++i) {
+		is_duplicate[order[i]] = sorted_triangles[order[i]] == sorted_triangles[order[i - 1]];
+	}
+	std::vector<std::array<int, 3>> unique_triangles;
+	for (std::size_t i = 0; i < triangle_list.size(); ++i) {
+		if (!is_duplicate[i]) {
+			unique_triangles.push_back(triangle_list[i]);
+		}
+	}
+
+	const auto level_shape_model = detail::select_vertices(shape_model, level.full_vertex_indices, unique_triangles);
+	const auto level_color_model = morphable_model.has_color_model() ? detail::select_vertices(morphable_model.get_color_model(), level.full_vertex_indices, unique_triangles) : morphablemodel::PcaModel();
+	std::vector<std::array<double, 2>> texture_coordinates;
+	if (!morphable_model.get_texture_coordinates().empty()) {
+		for (int v : level.full_vertex_indices) {
+			texture_coordinates.push_back(morphable_model.get_texture_coordinates()[v]);
+		}
+	}
+	level.morphable_model = morphablemodel::MorphableModel(level_shape_model, level_color_model, texture_coordinates);
+
+	for (const auto& blendshape : blendshapes)
+	{
+		morphablemodel::Blendshape level_blendshape;
+		level_blendshape.name = blendshape.name;
+		level_blendshape.deformation.resize(3 * level.full_vertex_indices.size());
+		for (std::size_t i = 0; i < level.full_vertex_indices.size(); ++i) {
+			level_blendshape.deformation.segment<3>(3 * i) = blendshape.deformation.segment<3>(3 * level.full_vertex_indices[i]);
+		}
+		level.blendshapes.push_back(level_blendshape);
+	}
+
+	// Convert the vertex indices that the landmarks are mapped to. Mappings to something else are kept as they are:
+	std::map<std::string, std::string> landmark_mappings;
+	for (const auto& mapping : landmark_mapper.get_mappings())
+	{
+		char* end = nullptr;
+		const long vertex_index = std::strtol(mapping.second.c_str(), &end, 10);
+		const bool is_vertex_index = !mapping.second.empty() && *end == '\0' && vertex_index >= 0 && vertex_index < num_full_vertices;
+		landmark_mappings.emplace(mapping.first, is_vertex_index ? std::to_string(level.level_vertex_indices[vertex_index]) : mapping.second);
+	}
+	level.landmark_mapper = core::LandmarkMapper(landmark_mappings);
+	level.model_contour.right_contour = level.to_level(model_contour.right_contour);
+	level.model_contour.left_contour = level.to_level(model_contour.left_contour);
+	level.edge_topology = morphablemodel::create_edge_topology(unique_triangles);
+	return level;
+};
+
+/**
+ * @brief A hierarchy of decimated versions (levels of detail) of a Morphable Model,
+ * for coarse-to-fine fitting.
+ *
+ * Each level has about \c decimation_factor times fewer vertices than the previous
+ * one. The levels only contain the coarse models; the full model itself isn't copied.
+ * All levels refer to the full model's vertices (see ModelLevel), so that results
+ * from any level can be passed to the full model.
+ *
+ * The hierarchy is built for one landmark mapper (e.g. ibug_to_sfm.txt) and model
+ * contour, whose vertices every level keeps.
+ *
+ * See fit_shape_and_pose_coarse_to_fine(). The levels can also be used with a
+ * CeresFitter, to run the first non-linear iterations on a coarse level: The
+ * coefficients transfer directly, and ModelLevel::to_level() converts the vertex
+ * indices of the landmarks.
+ */
+class ModelHierarchy
+{
+public:
+	ModelHierarchy() = default;
+
+	/**
+	 * @brief Builds the levels of the hierarchy.
+	 *
+	 * @param[in] morphable_model The full model.
+	 * @param[in] blendshapes The blendshapes of the full model.
+	 * @param[in] landmark_mapper Mapping from the 2D landmarks to vertex indices of the full model.
+	 * @param[in] model_contour The model contour of the full model.
+	 * @param[in] num_levels The number of coarse levels.
+	 * @param[in] decimation_factor The ratio of the number of vertices of two successive levels.
+	 * @param[in] min_num_vertices No level gets fewer vertices than this (or the number of kept vertices, if more).
+	 */
+	ModelHierarchy(const morphablemodel::MorphableModel& morphable_model, const std::vector<morphablemodel::Blendshape>& blendshapes, const core::LandmarkMapper& landmark_mapper, const ModelContour& model_contour, int num_levels = 1, float decimation_factor = 4.0f, int min_num_vertices = 500) : num_full_vertices(morphable_model.get_shape_model().get_data_dimension() / 3)
+	{
+		if (decimation_factor <= 1.0f) {
+			throw std::runtime_error("ModelHierarchy: The decimation factor must be larger than 1.");
+		}
+		float num_vertices = static_cast<float>(num_full_vertices);
+		for (int l = 0; l < num_levels; ++l)
+		{
+			num_vertices /= decimation_factor;
+			if (num_vertices < min_num_vertices) {
+				break;
+			}
+			levels.push_back(create_model_level(morphable_model, blendshapes, landmark_mapper, model_contour, static_cast<int>(num_vertices)));
+		}
+	};
+
+	/**
+	 * Returns the number of coarse levels.
+	 */
+	int get_num_levels() const
+	{
+		return static_cast<int>(levels.size());
+	};
+
+	/**
+	 * Returns a coarse level, 0 being the finest one (the one after the full model).
+	 */
+	const ModelLevel& get_level(int level) const
+	{
+		return levels[level];
+	};
+
+	/**
+	 * Returns the number of vertices of the full model the hierarchy was built for.
+	 */
+	int get_num_full_vertices() const
+	{
+		return num_full_vertices;
+	};
+
+private:
+	std::vector<ModelLevel> levels;
+	int num_full_vertices = 0;
+};
+
+/**
+ * @brief Like fit_shape_and_pose(), but runs the first iterations on the coarse levels
+ * of a ModelHierarchy, and only the last ones on the full model.
+ *
+ * The fitting starts on the coarsest level with \p num_iterations_per_level iterations,
+ * and goes up one level at a time. Each level starts from the shape and blendshape
+ * coefficients of the previous one. The full model runs the remaining iterations (at
+ * least one). The occluding boundary search, visibility test and contour search of the
+ * coarse iterations only touch the coarse meshes.
+ *
+ * @param[in] hierarchy The levels of \p morphable_model.
+ * @param[in] morphable_model The full 3D Morphable Model.
+ * @param[in] blendshapes The blendshapes of the full model.
+ * @param[in] landmarks 2D landmarks from an image to fit the model to.
+ * @param[in] landmark_mapper Mapping info from the 2D landmark points to vertex indices of the full model. The hierarchy must have been built with the same.
+ * @param[in] image_width Width of the input image (needed for the camera model).
+ * @param[in] image_height Height of the input image (needed for the camera model).
+ * @param[in] edge_topology Precomputed edge topology of the full model.
+ * @param[in] contour_landmarks 2D image contour ids of left or right side (for example for ibug landmarks).
+ * @param[in] model_contour The model contour of the full model.
+ * @param[in] num_iterations Total number of iterations, over all levels.
+ * @param[in] num_iterations_per_level Number of iterations on each coarse level.
+ * @param[in] num_shape_coefficients_to_fit How many shape-coefficients to fit (all others will stay 0). Should be bigger than zero, or boost::none to fit all coefficients.
+ * @param[in] lambda Regularisation parameter of the PCA shape fitting.
+ * @param[in,out] pca_shape_coefficients If given, will be used as initial PCA shape coefficients to start the fitting. Will contain the final estimated coefficients.
+ * @param[in,out] blendshape_coefficients If given, will be used as initial expression blendshape coefficients to start the fitting. Will contain the final estimated coefficients.
+ * @param[out] fitted_image_points Debug parameter: Returns all the 2D points that have been used for the fitting on the full model.
+ * @return The fitted model shape instance of the full model and the final pose.
+ */
+inline std::pair<core::Mesh, fitting::RenderingParameters> fit_shape_and_pose_coarse_to_fine(const ModelHierarchy& hierarchy, const morphablemodel::MorphableModel& morphable_model, const std::vector<morphablemodel::Blendshape>& blendshapes, const core::LandmarkCollection<cv::Vec2f>& landmarks, const core::LandmarkMapper& landmark_mapper, int image_width, int image_height, const morphablemodel::EdgeTopology& edge_topology, const fitting::ContourLandmarks& contour_landmarks, const fitting::ModelContour& model_contour, int num_iterations, int num_iterations_per_level, boost::optional<int> num_shape_coefficients_to_fit, float lambda, std::vector<float>& pca_shape_coefficients, std::vector<float>& blendshape_coefficients, std::vector<cv::Vec2f>& fitted_image_points)
+{
+	assert(hierarchy.get_num_full_vertices() == morphable_model.get_shape_model().get_data_dimension() / 3);
+	int remaining_iterations = num_iterations;
+	for (int l = hierarchy.get_num_levels() - 1; l >= 0 && remaining_iterations > num_iterations_per_level; --l)
+	{
+		const ModelLevel& level = hierarchy.get_level(l);
+		std::vector<cv::Vec2f> level_fitted_image_points;
+		fit_shape_and_pose(level.morphable_model, level.blendshapes, landmarks, level.landmark_mapper, image_width, image_height, level.edge_topology, contour_landmarks, level.model_contour, num_iterations_per_level, num_shape_coefficients_to_fit, lambda, boost::none, pca_shape_coefficients, blendshape_coefficients, level_fitted_image_points);
+		remaining_iterations -= num_iterations_per_level;
+	}
+	return fit_shape_and_pose(morphable_model, blendshapes, landmarks, landmark_mapper, image_width, image_height, edge_topology, contour_landmarks, model_contour, remaining_iterations, num_shape_coefficients_to_fit, lambda, boost::none, pca_shape_coefficients, blendshape_coefficients, fitted_image_points);
+};
+
+	} /* namespace fitting */
+} /* namespace eos */
+
+#endif /* MODELHIERARCHY_HPP_ */
@@ -0,0 +1,160 @@
+/*
+ * eos - A 3D Morphable Model fitting library written in modern C++11/14.
+ *
+ * File: include/eos/fitting/NearestContourSearch.hpp
+ *
+ * Copyright 2017 Patrik Huber
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#ifndef NEARESTCONTOURSEARCH_HPP_
+#define NEARESTCONTOURSEARCH_HPP_
+
+#include "eos/core/Landmark.hpp"
+#include "eos/core/VertexView.hpp"
+#include "eos/fitting/contour_correspondence.hpp"
+#include "eos/fitting/LandmarkIndexPlan.hpp"
+
+#include "glm/mat4x4.hpp"
+#include "glm/vec4.hpp"
+
+#include "Eigen/Core"
+
+#include "opencv2/core/core.hpp"
+
+#include <vector>
+#include <algorithm>
+#include <cassert>
+
+namespace eos {
+	namespace fitting {
+
+/**
+ * @brief Finds the front-facing contour correspondences, like
+ * get_contour_correspondences(), reusing its buffers from call to call, and
+ * optionally only searching near the previous matches.
+ *
+ * The model contour candidates are projected once per call (i.e. once per
+ * pose) into a structure-of-arrays buffer, and the distances of each contour
+ * landmark to all candidates are computed with a vectorised kernel (see
+ * detail::find_nearest_projected_vertex()).
+ *
+ * With a \p search_window > 0, each landmark is only compared to the
+ * candidates within \p search_window positions (along the model contour) of
+ * the candidate it matched in the previous call. When tracking, the pose
+ * changes only a little from frame to frame, so the match can't move far.
+ * A side of the contour that was not used in the previous call (because of
+ * the yaw angle) is searched fully again.
+ *
+ * One instance should be used per face (e.g. per video stream), and not by
+ * more than one thread at a time.
+ */
+class NearestContourSearch
+{
+public:
+	/**
+	 * @brief Creates a search over the whole model contour, or with a window
+	 * around the previous matches.
+	 *
+	 * @param[in] search_window The number of candidates on each side of the previous match to search, or 0 to always search all candidates.
+	 */
+	explicit NearestContourSearch(int search_window = 0) : search_window(search_window)
+	{
+		assert(search_window >= 0);
+	};
+
+	/**
+	 * @brief Finds the 2D-3D correspondences of the front-facing contour. The
+	 * correspondences are appended to \p image_points and \p vertex_indices.
+	 *
+	 * @param[in] landmarks All image landmarks, of the scheme that \p plan was compiled for.
+	 * @param[in] plan The compiled landmark plan.
+	 * @param[in] model_contour The model contour indices that should be considered to find the closest corresponding 3D vertex.
+	 * @param[in] yaw_angle Yaw angle of the current fitting, in degrees. The front-facing contour will be chosen depending on this yaw angle.
+	 * @param[in] vertices The vertices of the mesh that's used to find the nearest contour points.
+	 * @param[in] view_model Model-view matrix of the current fitting to project the 3D model vertices to 2D.
+	 * @param[in] projection Projection matrix to project the 3D model vertices to 2D.
+	 * @param[in] viewport Current viewport to use.
+	 * @param[in,out] image_points The 2D contour landmark points are appended to this.
+	 * @param[in,out] vertex_indices The vertex indices of their nearest model contour vertices are appended to this.
+	 */
+	void find(const core::LandmarkCollection<cv::Vec2f>& landmarks, const LandmarkIndexPlan& plan, const ModelContour& model_contour, float yaw_angle, const core::VertexView& vertices, const glm::mat4x4& view_model, const glm::mat4x4& projection, const glm::vec4& viewport, std::vector<cv::Vec2f>& image_points, std::vector<int>& vertex_indices)
+	{
+		// The same selection as in select_contour(), including the overlap between +-7.5 degrees:
+		if (yaw_angle >= -7.5f) {
+			right.find(landmarks, plan.get_right_contour(), model_contour.right_contour, search_window, vertices, view_model, projection, viewport, image_points, vertex_indices);
+		} else {
+			right.previous_matches.clear();
+		}
+		if (yaw_angle <= 7.5f) {
+			left.find(landmarks, plan.get_left_contour(), model_contour.left_contour, search_window, vertices, view_model, projection, viewport, image_points, vertex_indices);
+		} else {
+			left.previous_matches.clear();
+		}
+	};
+
+	/**
+	 * @brief Forgets the previous matches, e.g. after a tracking failure.
+	 * The next call searches all candidates.
+	 */
+	void reset()
+	{
+		right.previous_matches.clear();
+		left.previous_matches.clear();
+	};
+
+private:
+	// The buffers and previous matches of one side of the contour:
+	struct Side
+	{
+		Eigen::ArrayXf projected_x;
+		Eigen::ArrayXf projected_y;
+		std::vector<int> previous_matches; // position along the model contour of each landmark's match, or empty
+
+		void find(const core::LandmarkCollection<cv::Vec2f>& landmarks, const std::vector<int>& landmark_positions, const std::vector<int>& model_contour_indices, int search_window, const core::VertexView& vertices, const glm::mat4x4& view_model, const glm::mat4x4& projection, const glm::vec4& viewport, std::vector<cv::Vec2f>& image_points, std::vector<int>& vertex_indices)
+		{
+			const int num_candidates = static_cast<int>(model_contour_indices.size());
+			if (num_candidates == 0) {
+				return;
+			}
+			detail::project_vertices(model_contour_indices, vertices, view_model, projection, viewport, projected_x, projected_y);
+			const bool use_window = search_window > 0 && previous_matches.size() == landmark_positions.size();
+			previous_matches.resize(landmark_positions.size());
+			for (std::size_t i = 0; i < landmark_positions.size(); ++i)
+			{
+				const cv::Vec2f& landmark = landmarks[landmark_positions[i]].coordinates;
+				int first = 0;
+				int count = num_candidates;
+				if (use_window && previous_matches[i] < num_candidates)
+				{
+					first = std::max(previous_matches[i] - search_window, 0);
+					count = std::min(previous_matches[i] + search_window + 1, num_candidates) - first;
+				}
+				previous_matches[i] = detail::find_nearest_projected_vertex(projected_x, projected_y, landmark, first, count);
+				image_points.push_back(landmark);
+				vertex_indices.push_back(model_contour_indices[previous_matches[i]]);
+			}
+		};
+	};
+
+	int search_window;
+	Side right;
+	Side left;
+};
+
+	} /* namespace fitting */
+} /* namespace eos */
+
+#endif /* NEARESTCONTOURSEARCH_HPP_ */
@@ -0,0 +1,266 @@
+/*
+ * eos - A 3D Morphable Model fitting library written in modern C++11/14.
+ *
+ * File: include/eos/fitting/ShapeFittingAccumulator.hpp
+ *
+ * Copyright 2016 Patrik Huber
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#ifndef SHAPEFITTINGACCUMULATOR_HPP_
+#define SHAPEFITTINGACCUMULATOR_HPP_
+
+#include "eos/core/ThreadPool.hpp"
+#include "eos/fitting/LandmarkSubspace.hpp"
+
+#include "Eigen/Core"
+#include "Eigen/Cholesky"
+#include "Eigen/QR"
+
+#include "opencv2/core/core.hpp"
+
+#include "boost/optional.hpp"
+
+#include <vector>
+#include <cmath>
+#include <cassert>
+
+namespace eos {
+	namespace fitting {
+
+/**
+ * @brief Accumulates the normal equations of the linear shape fitting over many
+ * images, so that the shape can be fitted to any number of images in constant memory.
+ *
+ * The linear shape fitting (see fit_shape_to_landmarks_linear_multi()) solves
+ * (A^t * Omega * A + lambda * I) * c = -A^t * Omega * b, where A and b have two rows
+ * per landmark of all images. But A^t * Omega * A and A^t * Omega * b are sums over
+ * the images, so each image can be added on its own, at any time. Only the K x K
+ * matrix and the K-vector are kept (K being the number of coefficients). Images can
+ * also be removed again, by giving the same data as when they were added.
+ *
+ * The sums are kept in double precision, so that adding and removing many images
+ * doesn't lose accuracy.
+ */
+class ShapeFittingAccumulator
+{
+public:
+	ShapeFittingAccumulator() = default;
+
+	/**
+	 * @brief Creates an empty accumulator.
+	 *
+	 * @param[in] num_coefficients How many shape coefficients to fit.
+	 * @param[in] detector_standard_deviation The standard deviation of the 2D landmarks given (e.g. of the detector used), in pixels. If not given, sqrt(3) is used, following [1].
+	 * @param[in] model_standard_deviation The standard deviation of the 3D vertex points in the 3D model, projected to 2D (so the value is in pixels). If not given, 0 is used.
+	 */
+	ShapeFittingAccumulator(int num_coefficients, boost::optional<float> detector_standard_deviation = boost::none, boost::optional<float> model_standard_deviation = boost::none) : num_coefficients(num_coefficients), AtOmegaA(Eigen::MatrixXd::Zero(num_coefficients, num_coefficients)), AtOmegab(Eigen::VectorXd::Zero(num_coefficients))
+	{
+		// The variances: Add the 2D and 3D standard deviations. Omega is a diagonal matrix with the same
+		// value everywhere, so we just use this scalar:
+		const float sigma_squared_2D = std::pow(detector_standard_deviation.get_value_or(std::sqrt(3.0f)), 2) + std::pow(model_standard_deviation.get_value_or(0.0f), 2);
+		omega = 1.0f / sigma_squared_2D;
+	};
+
+	/**
+	 * @brief Adds the equations of one image.
+	 *
+	 * @param[in] landmark_subspace The model's rows at the vertices that correspond to the 2D points.
+	 * @param[in] affine_camera_matrix A 3x4 affine camera matrix from model to screen-space (CV_32FC1), with [0 0 0 1] as its third row.
+	 * @param[in] landmarks 2D landmarks of the image.
+	 * @param[in] base_face_at_landmarks The base face at the landmarks (3N x 1). If empty, the mean of the subspace is used.
+	 */
+	void add_image(const LandmarkSubspace& landmark_subspace, const cv::Mat& affine_camera_matrix, const std::vector<cv::Vec2f>& landmarks, const Eigen::VectorXf& base_face_at_landmarks = Eigen::VectorXf())
+	{
+		accumulate(landmark_subspace, affine_camera_matrix, landmarks, base_face_at_landmarks, 1.0);
+		++num_images;
+	};
+
+	/**
+	 * @brief Removes the equations of an image that has been added with add_image().
+	 *
+	 * The arguments have to be the same as the ones given to add_image().
+	 */
+	void remove_image(const LandmarkSubspace& landmark_subspace, const cv::Mat& affine_camera_matrix, const std::vector<cv::Vec2f>& landmarks, const Eigen::VectorXf& base_face_at_landmarks = Eigen::VectorXf())
+	{
+		assert(num_images > 0);
+		accumulate(landmark_subspace, affine_camera_matrix, landmarks, base_face_at_landmarks, -1.0);
+		--num_images;
+	};
+
+	/**
+	 * @brief Adds the equations of many images, optionally in parallel.
+	 *
+	 * Each thread sums up its own part of the images, and these are added at the end.
+	 * The result is the same as with add_image() up to rounding.
+	 *
+	 * @param[in] landmark_subspaces The model's rows at the correspondences, for each image.
+	 * @param[in] affine_camera_matrices A 3x4 affine camera matrix for each image.
+	 * @param[in] landmarks 2D landmarks of each image.
+	 * @param[in] base_face_at_landmarks The base face at the landmarks, for each image. If empty (or an element is empty), the mean of the subspace is used.
+	 * @param[in] thread_pool If given, the images are distributed over the threads of this pool.
+	 */
+	void add_images(const std::vector<LandmarkSubspace>& landmark_subspaces, const std::vector<cv::Mat>& affine_camera_matrices, const std::vector<std::vector<cv::Vec2f>>& landmarks, const std::vector<Eigen::VectorXf>& base_face_at_landmarks = std::vector<Eigen::VectorXf>(), core::ThreadPool* thread_pool = nullptr)
+	{
+		assert(affine_camera_matrices.size() == landmarks.size() && landmarks.size() == landmark_subspaces.size());
+		const int num_new_images = static_cast<int>(landmark_subspaces.size());
+		const Eigen::VectorXf no_base_face;
+		const auto get_base_face = [&](int k) -> const Eigen::VectorXf& {
+			return k < static_cast<int>(base_face_at_landmarks.size()) ? base_face_at_landmarks[k] : no_base_face;
+		};
+		if (thread_pool && thread_pool->get_num_threads() > 1 && num_new_images > 1)
+		{
+			ShapeFittingAccumulator empty = *this;
+			empty.clear();
+			std::vector<ShapeFittingAccumulator> partial_sums(thread_pool->get_num_threads(), empty);
+			thread_pool->parallel_for(0, num_new_images, [&](int k, int thread_index) {
+				partial_sums[thread_index].add_image(landmark_subspaces[k], affine_camera_matrices[k], landmarks[k], get_base_face(k));
+			});
+			for (const auto& partial_sum : partial_sums) {
+				add(partial_sum);
+			}
+		}
+		else
+		{
+			for (int k = 0; k < num_new_images; ++k) {
+				add_image(landmark_subspaces[k], affine_camera_matrices[k], landmarks[k], get_base_face(k));
+			}
+		}
+	};
+
+	/**
+	 * @brief Adds all images of another accumulator to this one, e.g. one that was
+	 * filled on another thread or machine.
+	 *
+	 * @param[in] other An accumulator with the same number of coefficients and standard deviations.
+	 */
+	void add(const ShapeFittingAccumulator& other)
+	{
+		assert(other.num_coefficients == num_coefficients);
+		AtOmegaA.triangularView<Eigen::Lower>() += other.AtOmegaA;
+		AtOmegab += other.AtOmegab;
+		num_images += other.num_images;
+	};
+
+	/**
+	 * @brief Solves for the shape coefficients, using all the images added so far.
+	 *
+	 * @param[in] lambda The regularisation parameter (weight of the prior towards the mean). Gets multiplied by the number of images, like in fit_shape_to_landmarks_linear_multi().
+	 * @return The estimated shape-coefficients (alphas), or zeros (the mean) if no image has been added.
+	 */
+	std::vector<float> solve(float lambda) const
+	{
+		using Eigen::MatrixXd;
+		using Eigen::VectorXd;
+		if (num_images == 0) {
+			return std::vector<float>(num_coefficients, 0.0f);
+		}
+		MatrixXd AtOmegaAReg = AtOmegaA;
+		AtOmegaAReg.diagonal().array() += static_cast<double>(lambda) * num_images;
+		// c_s: The 'x' that we solve for. (The variance-normalised shape parameter vector, $c_s = [a_1/sigma_{s,1} , ..., a_m-1/sigma_{s,m-1}]^t$.)
+		// With lambda > 0, the matrix is positive definite, and a Cholesky decomposition is the fastest way to solve it.
+		// With lambda = 0, it can be (numerically) singular, e.g. with fewer constraints than coefficients, and the
+		// Cholesky decomposition might still succeed and return garbage, so we use the rank-revealing QR, like before:
+		VectorXd c_s;
+		bool solved = false;
+		if (lambda > 0.0f) {
+			const Eigen::LLT<MatrixXd, Eigen::Lower> llt(AtOmegaAReg);
+			if (llt.info() == Eigen::Success) {
+				c_s = llt.solve(AtOmegab);
+				solved = true;
+			}
+		}
+		if (!solved) {
+			const MatrixXd AtOmegaAReg_full = AtOmegaAReg.selfadjointView<Eigen::Lower>();
+			c_s = AtOmegaAReg_full.colPivHouseholderQr().solve(AtOmegab);
+		}
+		std::vector<float> coefficients(num_coefficients);
+		for (int i = 0; i < num_coefficients; ++i) {
+			coefficients[i] = static_cast<float>(c_s(i));
+		}
+		return coefficients;
+	};
+
+	/**
+	 * Removes all images.
+	 */
+	void clear()
+	{
+		AtOmegaA.setZero();
+		AtOmegab.setZero();
+		num_images = 0;
+	};
+
+	int get_num_images() const
+	{
+		return num_images;
+	};
+
+	int get_num_coefficients() const
+	{
+		return num_coefficients;
+	};
+
+private:
+	// Adds sign * the equations of one image to the sums.
+	void accumulate(const LandmarkSubspace& landmark_subspace, const cv::Mat& affine_camera_matrix, const std::vector<cv::Vec2f>& landmarks, const Eigen::VectorXf& base_face_at_landmarks, double sign)
+	{
+		using Eigen::VectorXf;
+		using Eigen::MatrixXf;
+		assert(static_cast<int>(landmarks.size()) == landmark_subspace.get_num_vertices());
+		assert(affine_camera_matrix.rows == 3 && affine_camera_matrix.cols == 4 && affine_camera_matrix.type() == CV_32FC1 && affine_camera_matrix.isContinuous());
+		assert(landmark_subspace.get_rescaled_pca_basis().cols() >= num_coefficients);
+
+		const int num_landmarks = static_cast<int>(landmarks.size());
+		const auto basis_rows = landmark_subspace.get_rescaled_pca_basis();
+		const bool has_base_face = base_face_at_landmarks.size() > 0;
+		assert(!has_base_face || base_face_at_landmarks.size() == 3 * num_landmarks);
+		const Eigen::Ref<const VectorXf> base_face = has_base_face ? Eigen::Ref<const VectorXf>(base_face_at_landmarks) : Eigen::Ref<const VectorXf>(landmark_subspace.get_mean());
+
+		// In the paper's notation, the system is set up with the block diagonal matrix $P \in R^{3N\times 4N}$,
+		// which contains the camera matrix C for each landmark. We apply the top 2x3 part of the camera matrix
+		// (rotation & scale) and the translation directly to each landmark's basis rows and mean instead. The
+		// third row of C is [0 0 0 1], so the third rows of A and b are always zero.
+		using RowMajorMatrix34f = Eigen::Matrix<float, 3, 4, Eigen::RowMajor>;
+		const Eigen::Map<const RowMajorMatrix34f> C(affine_camera_matrix.ptr<float>());
+		const Eigen::Matrix<float, 2, 3> C_rs = C.topLeftCorner<2, 3>();
+		const Eigen::Vector2f C_t = C.block<2, 1>(0, 3);
+
+		MatrixXf A(2 * num_landmarks, num_coefficients); // camera matrix times the basis
+		VectorXf b(2 * num_landmarks); // camera matrix times the mean, minus the landmarks
+		for (int i = 0; i < num_landmarks; ++i) {
+			A.middleRows<2>(2 * i).noalias() = C_rs * basis_rows.block(3 * i, 0, 3, num_coefficients);
+			b.segment<2>(2 * i) = C_rs * base_face.segment<3>(3 * i) + C_t - Eigen::Vector2f(landmarks[i][0], landmarks[i][1]);
+		}
+
+		// A^t * Omega * A is symmetric, so we only compute its lower triangle, with a rank update:
+		MatrixXf AtOmegaA_image = MatrixXf::Zero(num_coefficients, num_coefficients);
+		AtOmegaA_image.selfadjointView<Eigen::Lower>().rankUpdate(A.transpose(), omega);
+		const VectorXf AtOmegab_image = -omega * (A.transpose() * b); // It's -A^t*Omega^t*b, but we don't need to transpose Omega, since it's a diagonal matrix, and Omega^t = Omega.
+		AtOmegaA.triangularView<Eigen::Lower>() += sign * AtOmegaA_image.cast<double>();
+		AtOmegab += sign * AtOmegab_image.cast<double>();
+	};
+
+	int num_coefficients = 0;
+	float omega = 1.0f / 3.0f;
+	Eigen::MatrixXd AtOmegaA; ///< Only the lower triangle is used.
+	Eigen::VectorXd AtOmegab; ///< -A^t * Omega * b.
+	int num_images = 0;
+};
+
+	} /* namespace fitting */
+} /* namespace eos */
+
+#endif /* SHAPEFITTINGACCUMULATOR_HPP_ */
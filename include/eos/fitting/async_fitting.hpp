@@ -0,0 +1,189 @@
+/*
+ * eos - A 3D Morphable Model fitting library written in modern C++11/14.
+ *
+ * File: include/eos/fitting/async_fitting.hpp
+ *
+ * Copyright 2016 Patrik Huber
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#ifndef ASYNC_FITTING_HPP_
+#define ASYNC_FITTING_HPP_
+
+#include "eos/core/Landmark.hpp"
+#include "eos/core/LandmarkMapper.hpp"
+#include "eos/core/Mesh.hpp"
+#include "eos/core/WorkerPool.hpp"
+#include "eos/morphablemodel/MorphableModel.hpp"
+#include "eos/morphablemodel/Blendshape.hpp"
+#include "eos/morphablemodel/EdgeTopology.hpp"
+#include "eos/fitting/contour_correspondence.hpp"
+#include "eos/fitting/convergence.hpp"
+#include "eos/fitting/fitting.hpp"
+#include "eos/fitting/FittingResult.hpp"
+
+#include "opencv2/core/core.hpp"
+
+#include "boost/optional.hpp"
+
+#include <vector>
+#include <memory>
+#include <future>
+#include <chrono>
+#include <utility>
+#include <tuple>
+#include <exception>
+
+namespace eos {
+	namespace fitting {
+
+/**
+ * @brief A handle to a fitting that runs asynchronously, returned by
+ * fit_shape_and_pose_async().
+ *
+ * The result can be waited for with get(), or polled with is_ready(). cancel()
+ * makes the fitting stop at its next check and return the estimate it has got
+ * so far - it is then still available from get(). A fitting that is cancelled
+ * before it has started only runs the initial pose and expression fit.
+ */
+class AsyncFitting
+{
+public:
+	AsyncFitting(std::future<std::pair<core::Mesh, FittingResult>> result, std::shared_ptr<StopToken> stop_token) : result(std::move(result)), stop_token(std::move(stop_token))
+	{
+	};
+
+	/**
+	 * Requests the fitting to stop as soon as possible. Can be called from any thread.
+	 */
+	void cancel()
+	{
+		stop_token->cancel();
+	};
+
+	/**
+	 * Returns whether the result is available, i.e. whether get() would not block.
+	 */
+	bool is_ready() const
+	{
+		return result.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+	};
+
+	/**
+	 * Waits for the fitting to finish and returns its result. Can only be called once.
+	 * Rethrows any exception that the fitting threw.
+	 *
+	 * The FittingResult's statistics contain the number of iterations that were run,
+	 * and whether the fitting was stopped early.
+	 *
+	 * @return The fitted mesh and the fitting result.
+	 */
+	std::pair<core::Mesh, FittingResult> get()
+	{
+		return result.get();
+	};
+
+	/**
+	 * Returns whether get() can (still) be called.
+	 */
+	bool valid() const
+	{
+		return result.valid();
+	};
+
+	const std::shared_ptr<StopToken>& get_stop_token() const
+	{
+		return stop_token;
+	};
+
+private:
+	std::future<std::pair<core::Mesh, FittingResult>> result;
+	std::shared_ptr<StopToken> stop_token;
+};
+
+/**
+ * @brief Runs fit_shape_and_pose() on a worker of the given pool and returns a
+ * handle to its result immediately.
+ *
+ * The fitting stops after \p num_iterations, when the \p convergence_criterion
+ * is met, at the \p deadline, or when it is cancelled through the handle -
+ * whichever comes first. The stop is checked between the stages of every
+ * iteration, and the fitting always returns its best estimate so far (see
+ * fit_shape_and_pose_multi()). The deadline also counts the time the task waits
+ * in the pool's queue, so a stale frame that only starts after its deadline is
+ * returned with the initial pose and expression fit and zero iterations.
+ *
+ * The landmarks, image size and initial coefficients are copied into the task.
+ * The model, blendshapes, mapper, edge topology and contours are used by
+ * reference and have to outlive the fitting.
+ *
+ * @param[in] pool The pool to run the fitting on.
+ * @param[in] morphable_model The 3D Morphable Model used for the shape fitting.
+ * @param[in] blendshapes A vector of blendshapes that are being fit to the landmarks in addition to the PCA model.
+ * @param[in] landmarks 2D landmarks from an image to fit the model to.
+ * @param[in] landmark_mapper Mapping info from the 2D landmark points to 3D vertex indices.
+ * @param[in] image_width Width of the input image (needed for the camera model).
+ * @param[in] image_height Height of the input image (needed for the camera model).
+ * @param[in] edge_topology Precomputed edge topology of the 3D model, needed for fast edge-lookup.
+ * @param[in] contour_landmarks 2D image contour ids of left or right side (for example for ibug landmarks).
+ * @param[in] model_contour The model contour indices that should be considered to find the closest corresponding 3D vertex.
+ * @param[in] num_iterations The maximum number of iterations performed in the fitting.
+ * @param[in] deadline If given, the time at which the fitting stops, regardless of how many iterations it has run.
+ * @param[in] convergence_criterion If given, the fitting stops as soon as it is met.
+ * @param[in] num_shape_coefficients_to_fit How many shape-coefficients to fit (all others will stay 0). Should be bigger than zero, or boost::none to fit all coefficients.
+ * @param[in] lambda Regularisation parameter of the PCA shape fitting.
+ * @param[in] initial_rendering_params Currently ignored (not used).
+ * @param[in] pca_shape_coefficients If given, the coefficients to start from (e.g. those of the previous frame).
+ * @param[in] blendshape_coefficients If given, the coefficients to start from.
+ * @return A handle to the running fitting.
+ */
+inline AsyncFitting fit_shape_and_pose_async(core::WorkerPool& pool, const morphablemodel::MorphableModel& morphable_model, const std::vector<morphablemodel::Blendshape>& blendshapes, core::LandmarkCollection<cv::Vec2f> landmarks, const core::LandmarkMapper& landmark_mapper, int image_width, int image_height, const morphablemodel::EdgeTopology& edge_topology, const fitting::ContourLandmarks& contour_landmarks, const fitting::ModelContour& model_contour, int num_iterations, boost::optional<StopToken::Clock::time_point> deadline = boost::none, boost::optional<ConvergenceCriterion> convergence_criterion = boost::none, boost::optional<int> num_shape_coefficients_to_fit = boost::none, float lambda = 50.0f, boost::optional<fitting::RenderingParameters> initial_rendering_params = boost::none, std::vector<float> pca_shape_coefficients = std::vector<float>(), std::vector<float> blendshape_coefficients = std::vector<float>())
+{
+	auto stop_token = std::make_shared<StopToken>();
+	if (deadline) {
+		stop_token->set_deadline(deadline.get());
+	}
+	// WorkerPool takes copyable tasks, so the promise and the inputs are shared with the task:
+	auto promise = std::make_shared<std::promise<std::pair<core::Mesh, FittingResult>>>();
+	auto future = promise->get_future();
+	struct Inputs {
+		core::LandmarkCollection<cv::Vec2f> landmarks;
+		boost::optional<ConvergenceCriterion> convergence_criterion;
+		boost::optional<fitting::RenderingParameters> initial_rendering_params;
+		std::vector<float> pca_shape_coefficients;
+		std::vector<float> blendshape_coefficients;
+	};
+	auto inputs = std::make_shared<Inputs>(Inputs{ std::move(landmarks), std::move(convergence_criterion), std::move(initial_rendering_params), std::move(pca_shape_coefficients), std::move(blendshape_coefficients) });
+
+	pool.post([=, &morphable_model, &blendshapes, &landmark_mapper, &edge_topology, &contour_landmarks, &model_contour]() {
+		try {
+			FittingResult result;
+			result.pca_shape_coefficients = std::move(inputs->pca_shape_coefficients);
+			result.blendshape_coefficients = std::move(inputs->blendshape_coefficients);
+			core::Mesh mesh;
+			std::tie(mesh, result.rendering_parameters) = fit_shape_and_pose(morphable_model, blendshapes, inputs->landmarks, landmark_mapper, image_width, image_height, edge_topology, contour_landmarks, model_contour, num_iterations, num_shape_coefficients_to_fit, lambda, inputs->initial_rendering_params, result.pca_shape_coefficients, result.blendshape_coefficients, result.fitted_image_points, inputs->convergence_criterion, result.statistics, nullptr, stop_token.get());
+			promise->set_value(std::make_pair(std::move(mesh), std::move(result)));
+		}
+		catch (...) {
+			promise->set_exception(std::current_exception());
+		}
+	});
+	return AsyncFitting(std::move(future), std::move(stop_token));
+};
+
+	} /* namespace fitting */
+} /* namespace eos */
+
+#endif /* ASYNC_FITTING_HPP_ */
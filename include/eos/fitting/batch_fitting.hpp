@@ -0,0 +1,131 @@
+/*
+ * eos - A 3D Morphable Model fitting library written in modern C++11/14.
+ *
+ * File: include/eos/fitting/batch_fitting.hpp
+ *
+ * Copyright 2016 Patrik Huber
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#ifndef BATCH_FITTING_HPP_
+#define BATCH_FITTING_HPP_
+
+#include "eos/core/Landmark.hpp"
+#include "eos/core/LandmarkMapper.hpp"
+#include "eos/core/Mesh.hpp"
+#include "eos/core/ThreadPool.hpp"
+#include "eos/morphablemodel/MorphableModel.hpp"
+#include "eos/morphablemodel/Blendshape.hpp"
+#include "eos/morphablemodel/EdgeTopology.hpp"
+#include "eos/fitting/fitting.hpp"
+#include "eos/fitting/FittingWorkspace.hpp"
+#include "eos/fitting/FittingResult.hpp"
+#include "eos/fitting/convergence.hpp"
+
+#include "boost/optional.hpp"
+
+#include "opencv2/core/core.hpp"
+
+#include <vector>
+#include <utility>
+#include <stdexcept>
+
+namespace eos {
+	namespace fitting {
+
+/**
+ * @brief Fits the pose, shape and expression of many independent faces, in parallel.
+ *
+ * Each element of \p landmarks is a different face (e.g. all the faces in a crowd
+ * image, or one face per photo of a batch), and is fitted on its own, with the same
+ * algorithm as fit_shape_and_pose(). This is different from fit_shape_and_pose_multi(),
+ * which fits one shape to several images of the same person.
+ *
+ * The faces are distributed over the threads of \p thread_pool. The Morphable Model,
+ * blendshapes, edge topology and contour definitions are shared read-only between
+ * the threads, and each thread reuses one FittingWorkspace for all faces it fits, so
+ * after the first face per thread, the fitting mostly runs without allocating.
+ *
+ * The results are independent of the number of threads and the scheduling: No state
+ * is carried over from one face to the next (the contour trackers of the workspaces
+ * are reset for each face).
+ *
+ * @param[in] morphable_model The 3D Morphable Model used for the shape fitting.
+ * @param[in] blendshapes A vector of blendshapes that are being fit to the landmarks in addition to the PCA model.
+ * @param[in] landmarks The 2D landmarks of each face.
+ * @param[in] landmark_mapper Mapping info from the 2D landmark points to 3D vertex indices.
+ * @param[in] image_width Width of the image of each face (needed for the camera model).
+ * @param[in] image_height Height of the image of each face (needed for the camera model).
+ * @param[in] edge_topology Precomputed edge topology of the 3D model, needed for fast edge-lookup.
+ * @param[in] contour_landmarks 2D image contour ids of left or right side (for example for ibug landmarks).
+ * @param[in] model_contour The model contour indices that should be considered to find the closest corresponding 3D vertex.
+ * @param[in] num_iterations Number of iterations that the different fitting parts will be alternated for. The maximum number of iterations, if a convergence criterion is given.
+ * @param[in] num_shape_coefficients_to_fit How many shape-coefficients to fit (all others will stay 0). Should be bigger than zero, or boost::none to fit all coefficients.
+ * @param[in] lambda Regularisation parameter of the PCA shape fitting.
+ * @param[in] convergence_criterion When to stop the fitting of a face before \p num_iterations are reached, or boost::none to always run all iterations.
+ * @param[in] thread_pool The threads to run the fittings on.
+ * @return The fitted mesh and the fitting result of each face, in the order of \p landmarks.
+ * @throws std::runtime_error if the number of landmark sets and image sizes differ.
+ */
+inline std::vector<std::pair<core::Mesh, fitting::FittingResult>> fit_shape_and_pose_batch(const morphablemodel::MorphableModel& morphable_model, const std::vector<morphablemodel::Blendshape>& blendshapes, const std::vector<core::LandmarkCollection<cv::Vec2f>>& landmarks, const core::LandmarkMapper& landmark_mapper, const std::vector<int>& image_width, const std::vector<int>& image_height, const morphablemodel::EdgeTopology& edge_topology, const fitting::ContourLandmarks& contour_landmarks, const fitting::ModelContour& model_contour, int num_iterations, boost::optional<int> num_shape_coefficients_to_fit, float lambda, const boost::optional<ConvergenceCriterion>& convergence_criterion, core::ThreadPool& thread_pool)
+{
+	if (landmarks.size() != image_width.size() || landmarks.size() != image_height.size()) {
+		throw std::runtime_error("fit_shape_and_pose_batch: The number of landmark sets, image widths and image heights must be the same.");
+	}
+
+	std::vector<std::pair<core::Mesh, fitting::FittingResult>> results(landmarks.size());
+	std::vector<FittingWorkspace> workspaces(thread_pool.get_num_threads());
+
+	thread_pool.parallel_for(0, static_cast<int>(landmarks.size()), [&](int i, int thread_index) {
+		auto& workspace = workspaces[thread_index];
+		for (auto&& tracker : workspace.contour_trackers) {
+			tracker.reset(); // don't let the previous face of this thread influence this one
+		}
+
+		fitting::FittingResult& result = results[i].second;
+		std::vector<std::vector<float>> blendshape_coefficients;
+		std::vector<std::vector<cv::Vec2f>> fitted_image_points;
+		auto meshes_and_poses = fit_shape_and_pose_multi(morphable_model, blendshapes, { landmarks[i] }, landmark_mapper, { image_width[i] }, { image_height[i] }, edge_topology, contour_landmarks, model_contour, num_iterations, num_shape_coefficients_to_fit, lambda, boost::none, result.pca_shape_coefficients, blendshape_coefficients, fitted_image_points, workspace, convergence_criterion, result.statistics, nullptr); // the faces are already run in parallel
+
+		results[i].first = std::move(meshes_and_poses.first[0]);
+		result.rendering_parameters = meshes_and_poses.second[0];
+		result.blendshape_coefficients = std::move(blendshape_coefficients[0]);
+		result.fitted_image_points = std::move(fitted_image_points[0]);
+	});
+
+	return results;
+};
+
+/**
+ * @brief Fits the pose, shape and expression of many independent faces, in parallel,
+ * on an internal thread pool.
+ *
+ * Creates a core::ThreadPool with \p num_threads threads for this call. To fit many
+ * batches (e.g. the frames of a video), create one pool and use the overload taking
+ * a core::ThreadPool, to avoid starting the threads for every batch.
+ *
+ * @copydetails fit_shape_and_pose_batch(const morphablemodel::MorphableModel&, const std::vector<morphablemodel::Blendshape>&, const std::vector<core::LandmarkCollection<cv::Vec2f>>&, const core::LandmarkMapper&, const std::vector<int>&, const std::vector<int>&, const morphablemodel::EdgeTopology&, const fitting::ContourLandmarks&, const fitting::ModelContour&, int, boost::optional<int>, float, const boost::optional<ConvergenceCriterion>&, core::ThreadPool&)
+ * @param[in] num_threads The number of threads to use, or 0 to use the number of hardware threads.
+ */
+inline std::vector<std::pair<core::Mesh, fitting::FittingResult>> fit_shape_and_pose_batch(const morphablemodel::MorphableModel& morphable_model, const std::vector<morphablemodel::Blendshape>& blendshapes, const std::vector<core::LandmarkCollection<cv::Vec2f>>& landmarks, const core::LandmarkMapper& landmark_mapper, const std::vector<int>& image_width, const std::vector<int>& image_height, const morphablemodel::EdgeTopology& edge_topology, const fitting::ContourLandmarks& contour_landmarks, const fitting::ModelContour& model_contour, int num_iterations = 5, boost::optional<int> num_shape_coefficients_to_fit = boost::none, float lambda = 30.0f, const boost::optional<ConvergenceCriterion>& convergence_criterion = boost::none, int num_threads = 0)
+{
+	core::ThreadPool thread_pool(num_threads);
+	return fit_shape_and_pose_batch(morphable_model, blendshapes, landmarks, landmark_mapper, image_width, image_height, edge_topology, contour_landmarks, model_contour, num_iterations, num_shape_coefficients_to_fit, lambda, convergence_criterion, thread_pool);
+};
+
+	} /* namespace fitting */
+} /* namespace eos */
+
+#endif /* BATCH_FITTING_HPP_ */
@@ -23,6 +23,7 @@
 #define BLENDSHAPEFITTING_HPP_
 
 #include "eos/morphablemodel/Blendshape.hpp"
+#include "eos/fitting/LandmarkSubspace.hpp"
 
 #include "Eigen/Core"
 #include "Eigen/QR"
@@ -31,6 +32,7 @@
 #include "opencv2/core/core.hpp"
 
 #include <vector>
+#include <cstddef>
 #include <cassert>
 
 namespace eos {
@@ -113,6 +115,50 @@ inline std::vector<float> fit_blendshapes_to_landmarks_linear(const std::vector<
 	return std::vector<float>(coefficients.data(), coefficients.data() + coefficients.size());
 };
 
+		namespace detail {
+
+/**
+ * Fits blendshape coefficients with NNLS, given the blendshapes and the face instance at
+ * the landmarks only (i.e. 3N x B and 3N x 1, in the order of \p landmarks).
+ * See fit_blendshapes_to_landmarks_nnls().
+ */
+inline std::vector<float> fit_blendshapes_to_landmarks_nnls(const Eigen::Ref<const Eigen::MatrixXf>& blendshapes_at_landmarks, const Eigen::Ref<const Eigen::VectorXf>& face_instance_at_landmarks, cv::Mat affine_camera_matrix, const std::vector<cv::Vec2f>& landmarks)
+{
+	using Eigen::VectorXf;
+	using Eigen::MatrixXf;
+
+	const int num_blendshapes = blendshapes_at_landmarks.cols();
+	const int num_landmarks = static_cast<int>(landmarks.size());
+	assert(blendshapes_at_landmarks.rows() == 3 * num_landmarks && face_instance_at_landmarks.rows() == 3 * num_landmarks);
+
+	// Bring into standard least squares form. In the notation of the shape fitting, we'd set up the block
+	// diagonal matrix P with the camera matrix for each landmark and the basis rows $\hat{V}_h$ with inserted
+	// zero rows, and then A = P * V_hat_h and b = P * v_bar - y. Instead, we apply the camera matrix to the
+	// rows of each landmark directly. The third row of the (affine) camera is [0 0 0 1], so the third rows
+	// of A and b are always zero and we only need the first two rows of each landmark:
+	using RowMajorMatrix34f = Eigen::Matrix<float, 3, 4, Eigen::RowMajor>;
+	assert(affine_camera_matrix.rows == 3 && affine_camera_matrix.cols == 4 && affine_camera_matrix.type() == CV_32FC1 && affine_camera_matrix.isContinuous());
+	const Eigen::Map<const RowMajorMatrix34f> C(affine_camera_matrix.ptr<float>());
+	const Eigen::Matrix<float, 2, 3> C_rs = C.topLeftCorner<2, 3>();
+	const Eigen::Vector2f C_t = C.block<2, 1>(0, 3);
+	MatrixXf A(2 * num_landmarks, num_blendshapes); // camera matrix times the basis
+	VectorXf b(2 * num_landmarks); // camera matrix times the mean, minus the landmarks
+	for (int i = 0; i < num_landmarks; ++i) {
+		A.middleRows<2>(2 * i).noalias() = C_rs * blendshapes_at_landmarks.middleRows<3>(3 * i);
+		b.segment<2>(2 * i) = C_rs * face_instance_at_landmarks.segment<3>(3 * i) + C_t - Eigen::Vector2f(landmarks[i][0], landmarks[i][1]);
+	}
+	// Solve using NNLS:
+	VectorXf coefficients;
+
+    Eigen::NNLS<MatrixXf> nnls(A, 100); //it normaly converges within <10 iterations
+    bool non_singular = nnls.solve(-b);
+    coefficients.noalias() = nnls.x();
+
+	return std::vector<float>(coefficients.data(), coefficients.data() + coefficients.size());
+};
+
+		} /* namespace detail */
+
 /**
  * Fits blendshape coefficients to given 2D landmarks, given a current face shape instance.
  * Uses non-negative least-squares (NNLS) to solve for the coefficients. The NNLS algorithm
@@ -139,50 +185,36 @@ inline std::vector<float> fit_blendshapes_to_landmarks_nnls(const std::vector<eo
 	const int num_blendshapes = blendshapes.size();
 	const int num_landmarks = static_cast<int>(landmarks.size());
 
-	// Copy all blendshapes into a "basis" matrix with each blendshape being a column:
-	MatrixXf blendshapes_as_basis = morphablemodel::to_matrix(blendshapes);
-
-	// $\hat{V} \in R^{3N\times m-1}$, subselect the rows of the eigenvector matrix $V$ associated with the $N$ feature points
-	// And we insert a row of zeros after every third row, resulting in matrix $\hat{V}_h \in R^{4N\times m-1}$:
-	MatrixXf V_hat_h = MatrixXf::Zero(4 * num_landmarks, num_blendshapes);
-	int row_index = 0;
-	for (int i = 0; i < num_landmarks; ++i) {
-		V_hat_h.block(row_index, 0, 3, V_hat_h.cols()) = blendshapes_as_basis.block(vertex_ids[i] * 3, 0, 3, blendshapes_as_basis.cols());
-		row_index += 4; // replace 3 rows and skip the 4th one, it has all zeros
-	}
-	// Form a block diagonal matrix $P \in R^{3N\times 4N}$ in which the camera matrix C (P_Affine, affine_camera_matrix) is placed on the diagonal:
-	MatrixXf P = MatrixXf::Zero(3 * num_landmarks, 4 * num_landmarks);
+	// Copy the rows of the blendshapes and the face instance at the landmarks. There's no need to
+	// copy all blendshapes into a full "basis" matrix first:
+	MatrixXf blendshapes_at_landmarks(3 * num_landmarks, num_blendshapes);
+	VectorXf face_instance_at_landmarks(3 * num_landmarks);
 	for (int i = 0; i < num_landmarks; ++i) {
-		using RowMajorMatrixXf = Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>;
-		P.block(3 * i, 4 * i, 3, 4) = Eigen::Map<RowMajorMatrixXf>(affine_camera_matrix.ptr<float>(), affine_camera_matrix.rows, affine_camera_matrix.cols);
+		for (int j = 0; j < num_blendshapes; ++j) {
+			blendshapes_at_landmarks.block<3, 1>(3 * i, j) = blendshapes[j].deformation.segment<3>(3 * vertex_ids[i]);
+		}
+		face_instance_at_landmarks.segment<3>(3 * i) = face_instance.segment<3>(3 * vertex_ids[i]);
 	}
-	// The landmarks in matrix notation (in homogeneous coordinates), $3N\times 1$
-	VectorXf y = VectorXf::Ones(3 * num_landmarks);
-	for (int i = 0; i < num_landmarks; ++i) {
-		y(3 * i) = landmarks[i][0];
-		y((3 * i) + 1) = landmarks[i][1];
-		//y_((3 * i) + 2) = 1; // already 1, stays (homogeneous coordinate)
-	}
-	// The mean, with an added homogeneous coordinate (x_1, y_1, z_1, 1, x_2, ...)^t
-	VectorXf v_bar = VectorXf::Ones(4 * num_landmarks);
-	for (int i = 0; i < num_landmarks; ++i) {
-		v_bar(4 * i) = face_instance(vertex_ids[i] * 3);
-		v_bar((4 * i) + 1) = face_instance(vertex_ids[i] * 3 + 1);
-		v_bar((4 * i) + 2) = face_instance(vertex_ids[i] * 3 + 2);
-		//v_bar((4 * i) + 3) = 1; // already 1, stays (homogeneous coordinate)
-	}
-
-	// Bring into standard least squares form:
-	const MatrixXf A = P * V_hat_h; // camera matrix times the basis
-	const MatrixXf b = P * v_bar - y; // camera matrix times the mean, minus the landmarks
-	// Solve using NNLS:
-	VectorXf coefficients;
-
-    Eigen::NNLS<MatrixXf> nnls(A, 100); //it normaly converges within <10 iterations
-    bool non_singular = nnls.solve(-b);
-    coefficients.noalias() = nnls.x();
+	return detail::fit_blendshapes_to_landmarks_nnls(blendshapes_at_landmarks, face_instance_at_landmarks, affine_camera_matrix, landmarks);
+};
 
-	return std::vector<float>(coefficients.data(), coefficients.data() + coefficients.size());
+/**
+ * Fits blendshape coefficients to given 2D landmarks, given a current face shape instance,
+ * using the blendshape rows of a LandmarkSubspace.
+ *
+ * Same as fit_blendshapes_to_landmarks_nnls(const std::vector<eos::morphablemodel::Blendshape>&, const Eigen::VectorXf&, cv::Mat, const std::vector<cv::Vec2f>&, const std::vector<int>&),
+ * but doesn't need to gather the blendshapes at the landmarks in every call.
+ *
+ * @param[in] landmark_subspace The model's rows at the vertices that correspond to the 2D points. Must contain the blendshapes.
+ * @param[in] face_instance_at_landmarks The face instance at the vertices of the subspace (a 3N x 1 vector, e.g. the subspace mean plus its PCA basis times the current coefficients).
+ * @param[in] affine_camera_matrix A 3x4 affine camera matrix from model to screen-space (CV_32FC1).
+ * @param[in] landmarks 2D landmarks from an image to fit the blendshapes to.
+ * @return The estimated blendshape-coefficients.
+ */
+inline std::vector<float> fit_blendshapes_to_landmarks_nnls(const LandmarkSubspace& landmark_subspace, const Eigen::VectorXf& face_instance_at_landmarks, cv::Mat affine_camera_matrix, const std::vector<cv::Vec2f>& landmarks)
+{
+	assert(landmarks.size() == static_cast<std::size_t>(landmark_subspace.get_num_vertices()));
+	return detail::fit_blendshapes_to_landmarks_nnls(landmark_subspace.get_blendshapes(), face_instance_at_landmarks, affine_camera_matrix, landmarks);
 };
 
 	} /* namespace fitting */
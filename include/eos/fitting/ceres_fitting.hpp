@@ -0,0 +1,414 @@
+/*
+ * eos - A 3D Morphable Model fitting library written in modern C++11/14.
+ *
+ * File: include/eos/fitting/ceres_fitting.hpp
+ *
+ * Copyright 2017 Patrik Huber
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#ifndef CERESFITTING_HPP_
+#define CERESFITTING_HPP_
+
+#include "eos/morphablemodel/MorphableModel.hpp"
+#include "eos/morphablemodel/Blendshape.hpp"
+#include "eos/fitting/ceres_nonlinear.hpp"
+#include "eos/fitting/photometric_cost.hpp"
+#include "eos/fitting/RenderingParameters.hpp"
+
+#include "glm/gtc/quaternion.hpp"
+
+#include "ceres/ceres.h"
+
+#include "opencv2/core/core.hpp"
+
+#include <array>
+#include <vector>
+#include <limits>
+#include <cmath>
+#include <cstddef>
+#include <stdexcept>
+#include <cassert>
+
+namespace eos {
+	namespace fitting {
+
+/**
+ * Selects the Ceres linear solver that the fitting uses.
+ *
+ * Our problems have only a handful of parameter blocks (the camera, the shape,
+ * blendshape and colour coefficients), all of them small and shared by every
+ * residual, so the dense solvers are the fastest.
+ */
+enum class CeresSolverPreset {
+	DenseSchur, ///< Eliminates the camera parameters first. Fast for the landmark and the colour fitting. The default.
+	DenseNormalCholesky, ///< Fastest for the landmark-only problems with few coefficients.
+	IterativeSchur ///< The solver fit-model-ceres used to use. Only worth it for much larger problems.
+};
+
+/**
+ * Settings for CeresFitter.
+ */
+struct CeresFittingSettings
+{
+	CeresSolverPreset solver_preset = CeresSolverPreset::DenseSchur;
+	int num_threads = 1; ///< Threads for the evaluation of the residuals and Jacobians.
+	int max_num_iterations = 50;
+	int num_shape_coefficients = 10; ///< The number of shape coefficients that are fitted.
+	int num_color_coefficients = 0; ///< The number of colour coefficients that are fitted. If 0, fit() does no colour (photometric) fitting.
+	PhotometricSamplingSettings photometric_sampling; ///< Which vertices the photometric term evaluates.
+	double shape_prior_weight = 35.0;
+	double blendshapes_prior_weight = 10.0;
+	double color_prior_weight = 35.0;
+	double coefficients_bound = 3.0; ///< The shape and colour coefficients are kept within [-bound, bound].
+	bool minimizer_progress_to_stdout = false;
+};
+
+/**
+ * Returns the Ceres solver options for the given settings.
+ *
+ * @param[in] settings The fitting settings.
+ * @return The solver options.
+ */
+inline ceres::Solver::Options get_solver_options(const CeresFittingSettings& settings)
+{
+	ceres::Solver::Options solver_options;
+	switch (settings.solver_preset)
+	{
+	case CeresSolverPreset::DenseSchur:
+		solver_options.linear_solver_type = ceres::DENSE_SCHUR;
+		break;
+	case CeresSolverPreset::DenseNormalCholesky:
+		solver_options.linear_solver_type = ceres::DENSE_NORMAL_CHOLESKY;
+		break;
+	case CeresSolverPreset::IterativeSchur:
+		solver_options.linear_solver_type = ceres::ITERATIVE_SCHUR;
+		break;
+	}
+	solver_options.num_threads = settings.num_threads;
+	solver_options.max_num_iterations = settings.max_num_iterations;
+	solver_options.minimizer_progress_to_stdout = settings.minimizer_progress_to_stdout;
+	return solver_options;
+};
+
+/**
+ * @brief Non-linear fitting of the camera, shape, blendshape and (optionally)
+ * colour coefficients with Ceres, that is built once and reused for every frame.
+ *
+ * The parameters and the Ceres problems are kept between the calls: fit_camera()
+ * and fit() only replace the observations (the 2D landmarks and the image) in the
+ * existing residual blocks, and start from the parameters of the previous call,
+ * i.e. the previous frame. The residual blocks are only re-created for the
+ * landmarks whose vertex changed, e.g. the contour landmarks. The initial values
+ * can also be set from the linear fitting, with set_parameters().
+ *
+ * The cost functions are the ones with analytic Jacobians, LandmarkCostFunction,
+ * PriorCostFunction and PhotometricCostFunction. The vertices of the photometric
+ * term are chosen anew for every image, from the parameters the fitting starts
+ * from: Only visible vertices are used, subsampled according to
+ * CeresFittingSettings::photometric_sampling.
+ *
+ * Warning: Don't put in temporaries for \c morphable_model and \c blendshapes! We don't make a copy, we store a reference to what is given to the constructor.
+ */
+class CeresFitter
+{
+public:
+	/**
+	 * Creates a fitter for images of the given size.
+	 *
+	 * The camera is initialised looking at the model from the front, like in
+	 * fit-model-ceres, and all coefficients with zero.
+	 *
+	 * @param[in] morphable_model A 3D Morphable Model. Do not use a temporary.
+	 * @param[in] blendshapes A set of 3D blendshapes. Do not use a temporary.
+	 * @param[in] image_width Width of the images that are fitted.
+	 * @param[in] image_height Height of the images.
+	 * @param[in] use_perspective Whether a perspective or an orthographic projection is estimated.
+	 * @param[in] settings The solver and prior settings.
+	 * @throws std::runtime_error if there are no blendshapes, or colour fitting is requested and the model has no colour model.
+	 */
+	CeresFitter(const morphablemodel::MorphableModel& morphable_model, const std::vector<morphablemodel::Blendshape>& blendshapes, int image_width, int image_height, bool use_perspective = false, CeresFittingSettings settings = CeresFittingSettings()) : morphable_model(morphable_model), blendshapes(blendshapes), image_width(image_width), image_height(image_height), use_perspective(use_perspective), settings(settings), solver_options(get_solver_options(settings)), camera_problem(get_problem_options()), fitting_problem(get_problem_options())
+	{
+		if (blendshapes.empty())
+		{
+			throw std::runtime_error("CeresFitter needs at least one blendshape.");
+		}
+		if (settings.num_color_coefficients > 0 && !morphable_model.has_color_model())
+		{
+			throw std::runtime_error("The MorphableModel used does not contain a colour (albedo) model, but CeresFittingSettings::num_color_coefficients is not 0.");
+		}
+		camera_rotation = { 1.0, 0.0, 0.0, 0.0 };
+		// Ortho: [t_x, t_y, frustum_scale]. Perspective: [t_x, t_y, t_z, fov].
+		if (use_perspective)
+		{
+			camera_translation_and_intrinsics = { 0.0, 0.0, -400.0, glm::radians(45.0) }; // Move the model back (along the -z axis)
+		}
+		else {
+			camera_translation_and_intrinsics = { 0.0, 0.0, 110.0 };
+		}
+		shape_coefficients.resize(settings.num_shape_coefficients);
+		blendshape_coefficients.resize(blendshapes.size());
+		color_coefficients.resize(settings.num_color_coefficients);
+
+		// The camera-only problem: Only the landmarks, with the shape kept constant.
+		add_camera_parameters(camera_problem);
+		camera_problem.AddParameterBlock(shape_coefficients.data(), static_cast<int>(shape_coefficients.size()));
+		camera_problem.AddParameterBlock(blendshape_coefficients.data(), static_cast<int>(blendshape_coefficients.size()));
+		camera_problem.SetParameterBlockConstant(shape_coefficients.data());
+		camera_problem.SetParameterBlockConstant(blendshape_coefficients.data());
+
+		// The full problem: Landmarks, priors and optionally the image.
+		add_camera_parameters(fitting_problem);
+		fitting_problem.AddResidualBlock(new PriorCostFunction(settings.num_shape_coefficients, settings.shape_prior_weight), nullptr, shape_coefficients.data());
+		for (int i = 0; i < settings.num_shape_coefficients; ++i)
+		{
+			fitting_problem.SetParameterLowerBound(shape_coefficients.data(), i, -settings.coefficients_bound);
+			fitting_problem.SetParameterUpperBound(shape_coefficients.data(), i, settings.coefficients_bound);
+		}
+		fitting_problem.AddResidualBlock(new PriorCostFunction(static_cast<int>(blendshapes.size()), settings.blendshapes_prior_weight), nullptr, blendshape_coefficients.data());
+		for (std::size_t i = 0; i < blendshapes.size(); ++i)
+		{
+			fitting_problem.SetParameterLowerBound(blendshape_coefficients.data(), static_cast<int>(i), 0.0);
+		}
+		if (settings.num_color_coefficients > 0)
+		{
+			// The photometric residual blocks are created for every image given to fit().
+			fitting_problem.AddResidualBlock(new PriorCostFunction(settings.num_color_coefficients, settings.color_prior_weight), nullptr, color_coefficients.data());
+			for (int i = 0; i < settings.num_color_coefficients; ++i)
+			{
+				fitting_problem.SetParameterLowerBound(color_coefficients.data(), i, -settings.coefficients_bound);
+				fitting_problem.SetParameterUpperBound(color_coefficients.data(), i, settings.coefficients_bound);
+			}
+		}
+	};
+
+	CeresFitter(const CeresFitter&) = delete;
+	CeresFitter& operator=(const CeresFitter&) = delete;
+
+	/**
+	 * Sets the parameters that the next fitting starts from, e.g. from the
+	 * result of the linear fit_shape_and_pose(). Only for orthographic fitters.
+	 *
+	 * The frustum of the rendering parameters is converted to the symmetric
+	 * frustum of the Ceres cost functions, with the translation adjusted.
+	 *
+	 * @param[in] rendering_parameters Orthographic rendering parameters, e.g. from fit_shape_and_pose().
+	 * @param[in] shape_coefficients The shape coefficients. Missing ones are set to zero, and additional ones are ignored.
+	 * @param[in] blendshape_coefficients The blendshape coefficients. Missing ones are set to zero, and additional ones are ignored.
+	 * @throws std::runtime_error if this is a perspective fitter, or the rendering parameters are not orthographic.
+	 */
+	void set_parameters(const RenderingParameters& rendering_parameters, const std::vector<float>& shape_coefficients, const std::vector<float>& blendshape_coefficients)
+	{
+		if (use_perspective || rendering_parameters.get_camera_type() != CameraType::Orthographic)
+		{
+			throw std::runtime_error("CeresFitter::set_parameters() is only implemented for orthographic cameras.");
+		}
+		const glm::quat rotation = rendering_parameters.get_rotation();
+		camera_rotation = { rotation.w, rotation.x, rotation.y, rotation.z };
+		// Both map the eye coordinates linearly to the screen. Equating them gives:
+		const Frustum frustum = rendering_parameters.get_frustum();
+		camera_translation_and_intrinsics[0] = rendering_parameters.get_t_x() - (frustum.r + frustum.l) / 2.0;
+		camera_translation_and_intrinsics[1] = rendering_parameters.get_t_y() - (frustum.t + frustum.b) / 2.0;
+		camera_translation_and_intrinsics[2] = (frustum.t - frustum.b) / 2.0;
+		for (std::size_t i = 0; i < this->shape_coefficients.size(); ++i)
+		{
+			this->shape_coefficients[i] = i < shape_coefficients.size() ? shape_coefficients[i] : 0.0;
+		}
+		for (std::size_t i = 0; i < this->blendshape_coefficients.size(); ++i)
+		{
+			this->blendshape_coefficients[i] = i < blendshape_coefficients.size() ? blendshape_coefficients[i] : 0.0;
+		}
+	};
+
+	/**
+	 * Estimates the camera from the given 2D-3D correspondences, with the shape
+	 * and blendshape coefficients kept constant.
+	 *
+	 * @param[in] image_points The 2D landmarks in the image.
+	 * @param[in] vertex_indices The model vertex of each landmark.
+	 * @return The Ceres solver summary.
+	 */
+	ceres::Solver::Summary fit_camera(const std::vector<cv::Vec2f>& image_points, const std::vector<int>& vertex_indices)
+	{
+		update_landmarks(camera_problem, camera_landmarks, image_points, vertex_indices);
+		ceres::Solver::Summary solver_summary;
+		ceres::Solve(solver_options, &camera_problem, &solver_summary);
+		return solver_summary;
+	};
+
+	/**
+	 * Estimates the camera, shape and blendshape coefficients from the given
+	 * 2D-3D correspondences, and the colour coefficients from the image if
+	 * colour fitting is enabled in the settings.
+	 *
+	 * @param[in] image_points The 2D landmarks in the image.
+	 * @param[in] vertex_indices The model vertex of each landmark.
+	 * @param[in] image The image, CV_8UC3. Only needed, and only used, if CeresFittingSettings::num_color_coefficients is not 0.
+	 * @return The Ceres solver summary.
+	 * @throws std::runtime_error if colour fitting is enabled and no CV_8UC3 image is given.
+	 */
+	ceres::Solver::Summary fit(const std::vector<cv::Vec2f>& image_points, const std::vector<int>& vertex_indices, cv::Mat image = cv::Mat())
+	{
+		update_landmarks(fitting_problem, fitting_landmarks, image_points, vertex_indices);
+		if (settings.num_color_coefficients > 0)
+		{
+			update_image(image);
+		}
+		ceres::Solver::Summary solver_summary;
+		ceres::Solve(solver_options, &fitting_problem, &solver_summary);
+		return solver_summary;
+	};
+
+	/**
+	 * Returns the estimated orthographic camera as rendering parameters, for
+	 * rendering and texture extraction. Only for orthographic fitters.
+	 *
+	 * @return The rendering parameters.
+	 * @throws std::runtime_error if this is a perspective fitter.
+	 */
+	RenderingParameters get_rendering_parameters() const
+	{
+		if (use_perspective)
+		{
+			throw std::runtime_error("CeresFitter::get_rendering_parameters() is only implemented for orthographic cameras.");
+		}
+		const double aspect = static_cast<double>(image_width) / image_height;
+		const double frustum_scale = camera_translation_and_intrinsics[2];
+		const Frustum frustum(-aspect * frustum_scale, aspect * frustum_scale, -frustum_scale, frustum_scale);
+		const glm::quat rotation(camera_rotation[0], camera_rotation[1], camera_rotation[2], camera_rotation[3]);
+		return RenderingParameters(CameraType::Orthographic, frustum, rotation, camera_translation_and_intrinsics[0], camera_translation_and_intrinsics[1], image_width, image_height);
+	};
+
+	const std::array<double, 4>& get_camera_rotation() const { return camera_rotation; }; ///< As quaternion [w x y z].
+	const std::vector<double>& get_camera_translation_and_intrinsics() const { return camera_translation_and_intrinsics; }; ///< Ortho: [t_x t_y frustum_scale]. Perspective: [t_x t_y t_z fov].
+	const std::vector<double>& get_shape_coefficients() const { return shape_coefficients; };
+	const std::vector<double>& get_blendshape_coefficients() const { return blendshape_coefficients; };
+	const std::vector<double>& get_color_coefficients() const { return color_coefficients; };
+
+private:
+	// A landmark residual block in one of the problems, and its cost function, whose observation is replaced every frame.
+	struct LandmarkResidual
+	{
+		int vertex_index;
+		LandmarkCostFunction* cost_function; // owned by the problem
+		ceres::ResidualBlockId residual_block;
+	};
+
+	static ceres::Problem::Options get_problem_options()
+	{
+		ceres::Problem::Options problem_options;
+		problem_options.enable_fast_removal = true; // for the landmarks whose vertex changes
+		return problem_options;
+	};
+
+	void add_camera_parameters(ceres::Problem& problem)
+	{
+		problem.AddParameterBlock(camera_rotation.data(), 4, new ceres::QuaternionParameterization);
+		problem.AddParameterBlock(camera_translation_and_intrinsics.data(), static_cast<int>(camera_translation_and_intrinsics.size()));
+		if (use_perspective)
+		{
+			problem.SetParameterUpperBound(camera_translation_and_intrinsics.data(), 2, -std::numeric_limits<double>::epsilon()); // t_z has to be negative
+			problem.SetParameterLowerBound(camera_translation_and_intrinsics.data(), 3, 0.01); // fov in radians, must be > 0
+		}
+		else {
+			problem.SetParameterLowerBound(camera_translation_and_intrinsics.data(), 2, 1.0); // frustum_scale must be > 0
+		}
+	};
+
+	// Replaces the observations of the landmark residuals. Residuals are only re-created where the vertex changed.
+	void update_landmarks(ceres::Problem& problem, std::vector<LandmarkResidual>& landmarks, const std::vector<cv::Vec2f>& image_points, const std::vector<int>& vertex_indices)
+	{
+		assert(image_points.size() == vertex_indices.size());
+		while (landmarks.size() > image_points.size())
+		{
+			problem.RemoveResidualBlock(landmarks.back().residual_block);
+			landmarks.pop_back();
+		}
+		for (std::size_t i = 0; i < image_points.size(); ++i)
+		{
+			if (i < landmarks.size() && landmarks[i].vertex_index == vertex_indices[i])
+			{
+				landmarks[i].cost_function->set_observed_landmark(image_points[i]);
+				continue;
+			}
+			if (i < landmarks.size())
+			{
+				problem.RemoveResidualBlock(landmarks[i].residual_block);
+			}
+			LandmarkResidual landmark;
+			landmark.vertex_index = vertex_indices[i];
+			landmark.cost_function = new LandmarkCostFunction(morphable_model.get_shape_model(), blendshapes, image_points[i], vertex_indices[i], image_width, image_height, use_perspective, settings.num_shape_coefficients);
+			landmark.residual_block = problem.AddResidualBlock(landmark.cost_function, nullptr, camera_rotation.data(), camera_translation_and_intrinsics.data(), shape_coefficients.data(), blendshape_coefficients.data());
+			if (i < landmarks.size())
+			{
+				landmarks[i] = landmark;
+			}
+			else {
+				landmarks.push_back(landmark);
+			}
+		}
+	};
+
+	// Replaces the image, and the photometric residuals with ones for the vertices that are visible with the current parameters.
+	void update_image(cv::Mat image)
+	{
+		if (image.empty() || image.type() != CV_8UC3 || image.cols != image_width || image.rows != image_height)
+		{
+			throw std::runtime_error("CeresFitter::fit() needs a CV_8UC3 image of the fitter's size for the colour fitting.");
+		}
+		photometric_image.set_image(image);
+		for (auto&& residual_block : photometric_residuals)
+		{
+			fitting_problem.RemoveResidualBlock(residual_block);
+		}
+		photometric_residuals.clear();
+		project_model_vertices(morphable_model.get_shape_model(), blendshapes, camera_rotation.data(), camera_translation_and_intrinsics, shape_coefficients, blendshape_coefficients, image_width, image_height, use_perspective, posed_vertices, projected_vertices);
+		const auto samples = select_photometric_vertices(posed_vertices, projected_vertices, morphable_model.get_shape_model().get_triangle_list(), photometric_image, settings.photometric_sampling);
+		for (const auto& sample : samples)
+		{
+			PhotometricCostFunction* cost_function = new PhotometricCostFunction(morphable_model, blendshapes, photometric_image, sample.vertex_id, use_perspective, sample.weight, settings.num_shape_coefficients, settings.num_color_coefficients);
+			photometric_residuals.push_back(fitting_problem.AddResidualBlock(cost_function, nullptr, camera_rotation.data(), camera_translation_and_intrinsics.data(), shape_coefficients.data(), blendshape_coefficients.data(), color_coefficients.data()));
+		}
+	};
+
+	const morphablemodel::MorphableModel& morphable_model;
+	const std::vector<morphablemodel::Blendshape>& blendshapes;
+	int image_width;
+	int image_height;
+	bool use_perspective;
+	CeresFittingSettings settings;
+	ceres::Solver::Options solver_options;
+
+	// The parameter blocks. Their sizes never change, so the problems can keep pointers to them.
+	std::array<double, 4> camera_rotation; // Quaternion, [w x y z]
+	std::vector<double> camera_translation_and_intrinsics;
+	std::vector<double> shape_coefficients;
+	std::vector<double> blendshape_coefficients;
+	std::vector<double> color_coefficients;
+
+	ceres::Problem camera_problem;
+	ceres::Problem fitting_problem;
+	std::vector<LandmarkResidual> camera_landmarks;
+	std::vector<LandmarkResidual> fitting_landmarks;
+	PhotometricImage photometric_image; // referenced by the photometric cost functions
+	std::vector<ceres::ResidualBlockId> photometric_residuals;
+	std::vector<glm::vec4> posed_vertices; // buffers for the vertex selection
+	std::vector<cv::Vec2d> projected_vertices;
+};
+
+	} /* namespace fitting */
+} /* namespace eos */
+
+#endif /* CERESFITTING_HPP_ */
@@ -24,26 +24,33 @@
 
 #include "eos/morphablemodel/MorphableModel.hpp"
 #include "eos/morphablemodel/Blendshape.hpp"
+#include "eos/fitting/detail/ceres_nonlinear_detail.hpp"
 
 #include "glm/gtc/quaternion.hpp"
 #include "glm/gtx/transform.hpp"
 
+#include "ceres/cost_function.h"
 #include "ceres/cubic_interpolation.h"
 
+#include "Eigen/Core"
+
 #include "opencv2/core/core.hpp" // for Vec2f
 
 #include <array>
 #include <vector>
+#include <algorithm>
+#include <cstddef>
+#include <stdexcept>
 
 namespace eos {
 	namespace fitting {
 
 // Forward declarations:
 template <typename T>
-std::array<T, 3> get_shape_point(const morphablemodel::PcaModel& shape_model, const std::vector<morphablemodel::Blendshape>& blendshapes, int vertex_id, const T* const shape_coeffs, const T* const blendshape_coeffs);
+std::array<T, 3> get_shape_point(const morphablemodel::PcaModel& shape_model, const std::vector<morphablemodel::Blendshape>& blendshapes, int vertex_id, const T* const shape_coeffs, const T* const blendshape_coeffs, int num_coeffs_fitting = 10);
 
 template <typename T>
-std::array<T, 3> get_vertex_colour(const morphablemodel::PcaModel& colour_model, int vertex_id, const T* const colour_coeffs);
+std::array<T, 3> get_vertex_colour(const morphablemodel::PcaModel& colour_model, int vertex_id, const T* const colour_coeffs, int num_coeffs_fitting = 10);
 
 /**
  * Cost function for a prior on the parameters.
@@ -97,17 +104,19 @@ struct LandmarkCost {
 	/**
 	 * Constructs a new landmark cost function object with for a particular landmark/vertex id.
 	 *
-	 * Warning: Don't put in temporaries for \c shape_model and \c blendshapes! We don't make a copy, we store a reference to what is given to the function!
+	 * The rows of the model for the vertex are copied, so \c shape_model and \c blendshapes may be temporaries.
 	 *
-	 * @param[in] shape_model A PCA 3D shape model. Do not use a temporary.
-	 * @param[in] blendshapes A set of 3D blendshapes. Do not use a temporary.
+	 * @param[in] shape_model A PCA 3D shape model.
+	 * @param[in] blendshapes A set of 3D blendshapes.
 	 * @param[in] observed_landmark An observed 2D landmark in an image.
 	 * @param[in] vertex_id The vertex id that the given observed landmark corresponds to.
 	 * @param[in] image_width Width of the image that the 2D landmark is from (needed for the model projection).
 	 * @param[in] image_height Height of the image.
 	 * @param[in] use_perspective Whether a perspective or an orthographic projection should be used.
+	 * @param[in] num_shape_coefficients The number of shape coefficients that are fitted, i.e. the size of their parameter block.
+	 * @throws std::runtime_error if the model has fewer than \c num_shape_coefficients principal components.
 	 */
-	LandmarkCost(const morphablemodel::PcaModel& shape_model, const std::vector<morphablemodel::Blendshape>& blendshapes, cv::Vec2f observed_landmark, int vertex_id, int image_width, int image_height, bool use_perspective) : shape_model(shape_model), blendshapes(blendshapes), observed_landmark(observed_landmark), vertex_id(vertex_id), image_width(image_width), image_height(image_height), aspect_ratio(static_cast<double>(image_width) / image_height), use_perspective(use_perspective) {};
+	LandmarkCost(const morphablemodel::PcaModel& shape_model, const std::vector<morphablemodel::Blendshape>& blendshapes, cv::Vec2f observed_landmark, int vertex_id, int image_width, int image_height, bool use_perspective, int num_shape_coefficients = 10) : vertex_basis(detail::get_vertex_basis(shape_model, blendshapes, vertex_id, num_shape_coefficients)), observed_landmark(observed_landmark), image_width(image_width), image_height(image_height), aspect_ratio(static_cast<double>(image_width) / image_height), use_perspective(use_perspective) {};
 
 	/**
 	 * Landmark cost function implementation.
@@ -126,9 +135,9 @@ struct LandmarkCost {
 	bool operator()(const T* const camera_rotation, const T* const camera_translation_and_intrinsics, const T* const shape_coeffs, const T* const blendshape_coeffs, T* residual) const
 	{
 		using namespace glm;
-		// Generate shape instance (of only one vertex id!) using current parameters and 10 shape coefficients:
+		// Generate shape instance (of only one vertex id!) using current parameters:
 		// Note: Why are we not returning a glm::tvec3<T>?
-		const auto point_arr = get_shape_point<T>(shape_model, blendshapes, vertex_id, shape_coeffs, blendshape_coeffs);
+		const auto point_arr = vertex_basis.evaluate(shape_coeffs, blendshape_coeffs);
 
 		// Project the point to 2D:
 		const tvec3<T> point_3d(point_arr[0], point_arr[1], point_arr[2]);
@@ -161,10 +170,8 @@ struct LandmarkCost {
 	};
 
 private:
-	const morphablemodel::PcaModel& shape_model; // Or store as pointer (non-owning) or std::reference_wrapper?
-	const std::vector<morphablemodel::Blendshape>& blendshapes;
+	const detail::VertexBasis vertex_basis; // the shape model and blendshape rows of the vertex
 	const cv::Vec2f observed_landmark;
-	const int vertex_id;
 	const int image_width;
 	const int image_height;
 	const double aspect_ratio;
@@ -185,16 +192,18 @@ struct ImageCost {
 	/**
 	 * Constructs a new cost function object for a particular vertex id that measures the RGB image error between the estimated model point and the observed input image.
 	 *
-	 * Warning: Don't put in temporaries for \c morphable_model and \c blendshapes! We don't make a copy, we store a reference to what is given to the function!
+	 * The rows of the model for the vertex are copied, so \c morphable_model and \c blendshapes may be temporaries.
 	 *
-	 * @param[in] morphable_model A 3D Morphable Model. Do not use a temporary.
-	 * @param[in] blendshapes A set of 3D blendshapes. Do not use a temporary.
+	 * @param[in] morphable_model A 3D Morphable Model.
+	 * @param[in] blendshapes A set of 3D blendshapes.
 	 * @param[in] image The observed image. TODO: We should assert that the image we get is 8UC3!
 	 * @param[in] vertex_id Vertex id of the 3D model that should be projected and measured.
 	 * @param[in] use_perspective Whether a perspective or an orthographic projection should be used.
-	 * @throws std::runtime_error if the given \c image is not of type CV_8UC3.
+	 * @param[in] num_shape_coefficients The number of shape coefficients that are fitted.
+	 * @param[in] num_color_coefficients The number of colour coefficients that are fitted.
+	 * @throws std::runtime_error if the given \c image is not of type CV_8UC3, or the model has too few principal components.
 	 */
-	ImageCost(const morphablemodel::MorphableModel& morphable_model, const std::vector<morphablemodel::Blendshape>& blendshapes, cv::Mat image, int vertex_id, bool use_perspective) : morphable_model(morphable_model), blendshapes(blendshapes), image(image), aspect_ratio(static_cast<double>(image.cols) / image.rows), vertex_id(vertex_id), use_perspective(use_perspective)
+	ImageCost(const morphablemodel::MorphableModel& morphable_model, const std::vector<morphablemodel::Blendshape>& blendshapes, cv::Mat image, int vertex_id, bool use_perspective, int num_shape_coefficients = 10, int num_color_coefficients = 10) : image(image), aspect_ratio(static_cast<double>(image.cols) / image.rows), use_perspective(use_perspective)
 	{
 		if (image.type() != CV_8UC3)
 		{
@@ -204,6 +213,8 @@ struct ImageCost {
 		{
 			throw std::runtime_error("The MorphableModel used does not contain a colour (albedo) model. ImageCost requires a model that contains a colour PCA model. You may want to use the full Surrey Face Model.");
 		}
+		vertex_basis = detail::get_vertex_basis(morphable_model.get_shape_model(), blendshapes, vertex_id, num_shape_coefficients);
+		color_basis = detail::get_vertex_basis(morphable_model.get_color_model(), {}, vertex_id, num_color_coefficients);
 	};
 
 	/**
@@ -227,7 +238,7 @@ struct ImageCost {
 		using namespace glm;
 		// Note: The following is all duplicated code with LandmarkCost. Fix if possible performance-wise.
 		// Generate 3D shape point using the current parameters:
-		const auto point_arr = get_shape_point<T>(morphable_model.get_shape_model(), blendshapes, vertex_id, shape_coeffs, blendshape_coeffs);
+		const auto point_arr = vertex_basis.evaluate(shape_coeffs, blendshape_coeffs);
 
 		// Project the point to 2D:
 		const tvec3<T> point_3d(point_arr[0], point_arr[1], point_arr[2]);
@@ -282,7 +293,7 @@ struct ImageCost {
 			interpolator.Evaluate(projected_point.y, projected_point.x, &observed_colour[0]);
 
 			// This probably needs to be modified if we add a light model.
-			auto model_colour = get_vertex_colour(morphable_model.get_color_model(), vertex_id, color_coeffs);
+			const auto model_colour = color_basis.evaluate(color_coeffs, static_cast<const T*>(nullptr));
 			// I think this returns RGB, and between [0, 1].
 
 			// Residual: Vertex colour of model point minus the observed colour in the 2D image
@@ -295,14 +306,284 @@ struct ImageCost {
 	};
 
 private:
-	const morphablemodel::MorphableModel& morphable_model; // Or store as pointer (non-owning) or std::reference_wrapper?
-	const std::vector<morphablemodel::Blendshape>& blendshapes;
+	detail::VertexBasis vertex_basis; // the shape model and blendshape rows of the vertex
+	detail::VertexBasis color_basis; // the colour model rows of the vertex
 	const cv::Mat image; // the observed image
 	const double aspect_ratio;
-	const int vertex_id;
 	const bool use_perspective;
 };
 
+/**
+ * Cost function for a prior on the parameters, with an analytic Jacobian.
+ *
+ * Computes the same residuals as PriorCost, and is a drop-in replacement for
+ * an AutoDiffCostFunction<PriorCost, N, N>.
+ */
+class PriorCostFunction : public ceres::CostFunction
+{
+public:
+	/**
+	 * Creates a new prior cost function with set number of variables and a weight.
+	 *
+	 * @param[in] num_variables Number of variables that the parameter vector contains.
+	 * @param[in] weight A weight that the parameters are multiplied with.
+	 */
+	PriorCostFunction(int num_variables, double weight = 1.0) : num_variables(num_variables), weight(weight)
+	{
+		set_num_residuals(num_variables);
+		mutable_parameter_block_sizes()->push_back(num_variables);
+	};
+
+	bool Evaluate(double const* const* parameters, double* residuals, double** jacobians) const override
+	{
+		for (int i = 0; i < num_variables; ++i)
+		{
+			residuals[i] = weight * parameters[0][i];
+		}
+		if (jacobians && jacobians[0])
+		{
+			Eigen::Map<Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>>(jacobians[0], num_variables, num_variables) = weight * Eigen::MatrixXd::Identity(num_variables, num_variables);
+		}
+		return true;
+	};
+
+private:
+	int num_variables;
+	double weight;
+};
+
+/**
+ * 2D landmark error cost function, with an analytic Jacobian.
+ *
+ * Computes the same residuals as LandmarkCost, but evaluates them and their
+ * derivatives in closed form, instead of with Jets. It is a drop-in replacement
+ * for an AutoDiffCostFunction<LandmarkCost, 2, 4, 3 or 4, num_shape_coefficients, num_blendshapes>,
+ * with the same parameter blocks: The camera rotation (quaternion [w x y z]), the
+ * camera translation and intrinsics, the shape and the blendshape coefficients.
+ *
+ * The rows of the model for the landmark's vertex are copied on construction,
+ * so the model and blendshapes may be temporaries.
+ */
+class LandmarkCostFunction : public ceres::CostFunction
+{
+public:
+	/**
+	 * Constructs a new landmark cost function for a particular landmark/vertex id.
+	 *
+	 * @param[in] shape_model A PCA 3D shape model.
+	 * @param[in] blendshapes A set of 3D blendshapes.
+	 * @param[in] observed_landmark An observed 2D landmark in an image.
+	 * @param[in] vertex_id The vertex id that the given observed landmark corresponds to.
+	 * @param[in] image_width Width of the image that the 2D landmark is from (needed for the model projection).
+	 * @param[in] image_height Height of the image.
+	 * @param[in] use_perspective Whether a perspective or an orthographic projection should be used.
+	 * @param[in] num_shape_coefficients The number of shape coefficients that are fitted, i.e. the size of their parameter block.
+	 * @throws std::runtime_error if the model has fewer than \c num_shape_coefficients principal components.
+	 */
+	LandmarkCostFunction(const morphablemodel::PcaModel& shape_model, const std::vector<morphablemodel::Blendshape>& blendshapes, cv::Vec2f observed_landmark, int vertex_id, int image_width, int image_height, bool use_perspective, int num_shape_coefficients = 10) : vertex_basis(detail::get_vertex_basis(shape_model, blendshapes, vertex_id, num_shape_coefficients)), observed_landmark(observed_landmark[0], observed_landmark[1]), image_width(image_width), image_height(image_height), use_perspective(use_perspective)
+	{
+		set_num_residuals(2);
+		*mutable_parameter_block_sizes() = { 4, use_perspective ? 4 : 3, num_shape_coefficients, static_cast<int>(blendshapes.size()) };
+	};
+
+	/**
+	 * Replaces the observed 2D landmark, e.g. with the one of the next video frame.
+	 * The cost function can stay in its ceres::Problem.
+	 *
+	 * @param[in] observed_landmark The new observed 2D landmark.
+	 */
+	void set_observed_landmark(cv::Vec2f observed_landmark)
+	{
+		this->observed_landmark = Eigen::Vector2d(observed_landmark[0], observed_landmark[1]);
+	};
+
+	bool Evaluate(double const* const* parameters, double* residuals, double** jacobians) const override
+	{
+		using Eigen::Map;
+		using Eigen::Matrix;
+		using RowMajorMatrix = Matrix<double, 2, Eigen::Dynamic, Eigen::RowMajor>;
+		const int num_shape_coeffs = vertex_basis.num_coefficients;
+		const int num_blendshapes = vertex_basis.num_blendshapes();
+		const int num_camera_params = use_perspective ? 4 : 3;
+
+		const auto point_arr = vertex_basis.evaluate(parameters[2], parameters[3]);
+		const Eigen::Vector3d point(point_arr[0], point_arr[1], point_arr[2]);
+		Eigen::Matrix3d rotation;
+		Matrix<double, 3, 4> d_rotated_d_quaternion;
+		const Eigen::Vector3d rotated_point = detail::rotate_point(parameters[0], point, rotation, d_rotated_d_quaternion);
+		Matrix<double, 2, 3> d_projected_d_rotated;
+		Matrix<double, 2, 4> d_projected_d_camera;
+		const Eigen::Vector2d projected_point = detail::project_point(parameters[1], rotated_point, image_width, image_height, use_perspective, d_projected_d_rotated, d_projected_d_camera);
+
+		// Residual: Projected point minus the observed 2D landmark point
+		Map<Eigen::Vector2d>(residuals) = projected_point - observed_landmark;
+
+		if (jacobians)
+		{
+			const Matrix<double, 2, 3> d_projected_d_point = d_projected_d_rotated * rotation;
+			if (jacobians[0]) {
+				Map<Matrix<double, 2, 4, Eigen::RowMajor>>(jacobians[0]) = d_projected_d_rotated * d_rotated_d_quaternion;
+			}
+			if (jacobians[1]) {
+				Map<RowMajorMatrix>(jacobians[1], 2, num_camera_params) = d_projected_d_camera.leftCols(num_camera_params);
+			}
+			if (jacobians[2]) {
+				Map<RowMajorMatrix>(jacobians[2], 2, num_shape_coeffs) = d_projected_d_point * vertex_basis.basis.leftCols(num_shape_coeffs);
+			}
+			if (jacobians[3] && num_blendshapes > 0) {
+				Map<RowMajorMatrix>(jacobians[3], 2, num_blendshapes) = d_projected_d_point * vertex_basis.basis.rightCols(num_blendshapes);
+			}
+		}
+		return true;
+	};
+
+private:
+	detail::VertexBasis vertex_basis; // the shape model and blendshape rows of the vertex
+	Eigen::Vector2d observed_landmark;
+	int image_width;
+	int image_height;
+	bool use_perspective;
+};
+
+/**
+ * Image error cost function (at vertex locations), with an analytic Jacobian.
+ *
+ * Computes the same residuals as ImageCost, and is a drop-in replacement for an
+ * AutoDiffCostFunction<ImageCost, 3, 4, 3 or 4, num_shape_coefficients, num_blendshapes, num_color_coefficients>, with
+ * the same parameter blocks. The derivative of the observed colour is the one of
+ * the bicubic interpolation, like with the Jets.
+ */
+class ImageCostFunction : public ceres::CostFunction
+{
+public:
+	/**
+	 * Constructs a new cost function for a particular vertex id that measures the RGB image error between the estimated model point and the observed input image.
+	 *
+	 * @param[in] morphable_model A 3D Morphable Model.
+	 * @param[in] blendshapes A set of 3D blendshapes.
+	 * @param[in] image The observed image, CV_8UC3.
+	 * @param[in] vertex_id Vertex id of the 3D model that should be projected and measured.
+	 * @param[in] use_perspective Whether a perspective or an orthographic projection should be used.
+	 * @param[in] num_shape_coefficients The number of shape coefficients that are fitted.
+	 * @param[in] num_color_coefficients The number of colour coefficients that are fitted.
+	 * @throws std::runtime_error if the given \c image is not of type CV_8UC3, or the model has no colour model or too few principal components.
+	 */
+	ImageCostFunction(const morphablemodel::MorphableModel& morphable_model, const std::vector<morphablemodel::Blendshape>& blendshapes, cv::Mat image, int vertex_id, bool use_perspective, int num_shape_coefficients = 10, int num_color_coefficients = 10) : image(image), use_perspective(use_perspective)
+	{
+		if (image.type() != CV_8UC3)
+		{
+			throw std::runtime_error("The image given to ImageCostFunction must be of type CV_8UC3.");
+		}
+		if (!morphable_model.has_color_model())
+		{
+			throw std::runtime_error("The MorphableModel used does not contain a colour (albedo) model. ImageCostFunction requires a model that contains a colour PCA model. You may want to use the full Surrey Face Model.");
+		}
+		vertex_basis = detail::get_vertex_basis(morphable_model.get_shape_model(), blendshapes, vertex_id, num_shape_coefficients);
+		color_basis = detail::get_vertex_basis(morphable_model.get_color_model(), {}, vertex_id, num_color_coefficients);
+		set_num_residuals(3);
+		*mutable_parameter_block_sizes() = { 4, use_perspective ? 4 : 3, num_shape_coefficients, static_cast<int>(blendshapes.size()), num_color_coefficients };
+	};
+
+	/**
+	 * Replaces the observed image, e.g. with the next video frame.
+	 * The cost function can stay in its ceres::Problem.
+	 *
+	 * @param[in] image The new observed image, CV_8UC3.
+	 * @throws std::runtime_error if the given \c image is not of type CV_8UC3.
+	 */
+	void set_image(cv::Mat image)
+	{
+		if (image.type() != CV_8UC3)
+		{
+			throw std::runtime_error("The image given to ImageCostFunction must be of type CV_8UC3.");
+		}
+		this->image = image;
+	};
+
+	bool Evaluate(double const* const* parameters, double* residuals, double** jacobians) const override
+	{
+		using Eigen::Map;
+		using Eigen::Matrix;
+		using RowMajorMatrix = Matrix<double, 3, Eigen::Dynamic, Eigen::RowMajor>;
+		const int num_shape_coeffs = vertex_basis.num_coefficients;
+		const int num_blendshapes = vertex_basis.num_blendshapes();
+		const int num_color_coeffs = color_basis.num_coefficients;
+		const int num_camera_params = use_perspective ? 4 : 3;
+
+		const auto point_arr = vertex_basis.evaluate(parameters[2], parameters[3]);
+		const Eigen::Vector3d point(point_arr[0], point_arr[1], point_arr[2]);
+		Eigen::Matrix3d rotation;
+		Matrix<double, 3, 4> d_rotated_d_quaternion;
+		const Eigen::Vector3d rotated_point = detail::rotate_point(parameters[0], point, rotation, d_rotated_d_quaternion);
+		Matrix<double, 2, 3> d_projected_d_rotated;
+		Matrix<double, 2, 4> d_projected_d_camera;
+		const Eigen::Vector2d projected_point = detail::project_point(parameters[1], rotated_point, image.cols, image.rows, use_perspective, d_projected_d_rotated, d_projected_d_camera);
+
+		// The derivative of the residual w.r.t. the projected point [u v]:
+		Matrix<double, 3, 2> d_residual_d_projected;
+		if (projected_point.y() < 0.0 || projected_point.y() >= image.rows || projected_point.x() < 0.0 || projected_point.x() >= image.cols)
+		{
+			// The point is outside the image. Like ImageCost, the residual is constant then.
+			residuals[0] = 127.0;
+			residuals[1] = 127.0;
+			residuals[2] = 127.0;
+			if (jacobians)
+			{
+				const int block_sizes[5] = { 4, num_camera_params, num_shape_coeffs, num_blendshapes, num_color_coeffs };
+				for (int i = 0; i < 5; ++i)
+				{
+					if (jacobians[i]) {
+						std::fill(jacobians[i], jacobians[i] + 3 * block_sizes[i], 0.0);
+					}
+				}
+			}
+			return true;
+		}
+		ceres::Grid2D<uchar, 3> grid(image.ptr(0), 0, image.rows, 0, image.cols);
+		ceres::BiCubicInterpolator<ceres::Grid2D<uchar, 3>> interpolator(grid);
+		double observed_colour[3], d_observed_d_row[3], d_observed_d_col[3];
+		interpolator.Evaluate(projected_point.y(), projected_point.x(), &observed_colour[0], &d_observed_d_row[0], &d_observed_d_col[0]);
+
+		const auto model_colour = color_basis.evaluate(parameters[4], static_cast<const double*>(nullptr));
+		// Residual: Vertex colour of model point minus the observed colour in the 2D image
+		// observed_colour is BGR, model_colour is RGB. Residual will be RGB.
+		for (int c = 0; c < 3; ++c)
+		{
+			residuals[c] = model_colour[c] * 255.0 - observed_colour[2 - c];
+			d_residual_d_projected(c, 0) = -d_observed_d_col[2 - c];
+			d_residual_d_projected(c, 1) = -d_observed_d_row[2 - c];
+		}
+
+		if (jacobians)
+		{
+			const Matrix<double, 3, 3> d_residual_d_rotated = d_residual_d_projected * d_projected_d_rotated;
+			const Matrix<double, 3, 3> d_residual_d_point = d_residual_d_rotated * rotation;
+			if (jacobians[0]) {
+				Map<Matrix<double, 3, 4, Eigen::RowMajor>>(jacobians[0]) = d_residual_d_rotated * d_rotated_d_quaternion;
+			}
+			if (jacobians[1]) {
+				Map<RowMajorMatrix>(jacobians[1], 3, num_camera_params) = d_residual_d_projected * d_projected_d_camera.leftCols(num_camera_params);
+			}
+			if (jacobians[2]) {
+				Map<RowMajorMatrix>(jacobians[2], 3, num_shape_coeffs) = d_residual_d_point * vertex_basis.basis.leftCols(num_shape_coeffs);
+			}
+			if (jacobians[3] && num_blendshapes > 0) {
+				Map<RowMajorMatrix>(jacobians[3], 3, num_blendshapes) = d_residual_d_point * vertex_basis.basis.rightCols(num_blendshapes);
+			}
+			if (jacobians[4]) {
+				Map<RowMajorMatrix>(jacobians[4], 3, num_color_coeffs) = 255.0 * color_basis.basis;
+			}
+		}
+		return true;
+	};
+
+private:
+	cv::Mat image; // the observed image
+	detail::VertexBasis vertex_basis; // the shape model and blendshape rows of the vertex
+	detail::VertexBasis color_basis; // the colour model rows of the vertex
+	bool use_perspective;
+};
+
 /**
  * Returns the 3D position of a single point of the 3D shape generated by the parameters given.
  *
@@ -311,25 +592,26 @@ private:
  * @param[in] vertex_id Vertex id of the 3D model that should be projected.
  * @param[in] shape_coeffs A set of PCA shape coefficients used to generate the point.
  * @param[in] blendshape_coeffs A set of blendshape coefficients used to generate the point.
+ * @param[in] num_coeffs_fitting The number of shape coefficients in \c shape_coeffs.
  * @return The 3D point.
  */
 template <typename T>
-std::array<T, 3> get_shape_point(const morphablemodel::PcaModel& shape_model, const std::vector<morphablemodel::Blendshape>& blendshapes, int vertex_id, const T* const shape_coeffs, const T* const blendshape_coeffs)
+std::array<T, 3> get_shape_point(const morphablemodel::PcaModel& shape_model, const std::vector<morphablemodel::Blendshape>& blendshapes, int vertex_id, const T* const shape_coeffs, const T* const blendshape_coeffs, int num_coeffs_fitting)
 {
-	int num_coeffs_fitting = 10; // Todo: Should be inferred or a function parameter!
-	auto mean = shape_model.get_mean_at_point(vertex_id);
-	auto basis = shape_model.get_rescaled_pca_basis_at_point(vertex_id);
+	const int row = 3 * vertex_id;
+	const auto mean = shape_model.get_mean();
+	const auto basis = shape_model.get_rescaled_pca_basis(); // a map, this doesn't copy the rows of the vertex
 	// Computing Shape = mean + basis * coeffs:
 	// Note: Could use an Eigen matrix with type T to see if it gives a speedup.
-	std::array<T, 3> point{ T(mean[0]), T(mean[1]), T(mean[2]) };
+	std::array<T, 3> point{ T(mean(row)), T(mean(row + 1)), T(mean(row + 2)) };
 	for (int i = 0; i < num_coeffs_fitting; ++i) {
-		point[0] += T(basis.row(0).col(i)(0)) * shape_coeffs[i]; // it seems to be ~15% faster when these are static_cast<double>() instead of T()?
+		point[0] += T(basis(row, i)) * shape_coeffs[i]; // it seems to be ~15% faster when these are static_cast<double>() instead of T()?
 	}
 	for (int i = 0; i < num_coeffs_fitting; ++i) {
-		point[1] += T(basis.row(1).col(i)(0)) * shape_coeffs[i];
+		point[1] += T(basis(row + 1, i)) * shape_coeffs[i];
 	}
 	for (int i = 0; i < num_coeffs_fitting; ++i) {
-		point[2] += T(basis.row(2).col(i)(0)) * shape_coeffs[i];
+		point[2] += T(basis(row + 2, i)) * shape_coeffs[i];
 	}
 	// Adding the blendshape offsets: 
 	// Shape = mean + basis * coeffs + blendshapes * bs_coeffs:
@@ -352,25 +634,26 @@ std::array<T, 3> get_shape_point(const morphablemodel::PcaModel& shape_model, co
  * @param[in] color_model A PCA 3D colour (albedo) model.
  * @param[in] vertex_id Vertex id of the 3D model whose colour is to be returned.
  * @param[in] color_coeffs A set of PCA colour coefficients.
+ * @param[in] num_coeffs_fitting The number of colour coefficients in \c color_coeffs.
  * @return The colour. As RGB? In [0, 1]?
  */
 template <typename T>
-std::array<T, 3> get_vertex_colour(const morphablemodel::PcaModel& color_model, int vertex_id, const T* const color_coeffs)
+std::array<T, 3> get_vertex_colour(const morphablemodel::PcaModel& color_model, int vertex_id, const T* const color_coeffs, int num_coeffs_fitting)
 {
-	int num_coeffs_fitting = 10; // Todo: Should be inferred or a function parameter!
-	auto mean = color_model.get_mean_at_point(vertex_id);
-	auto basis = color_model.get_rescaled_pca_basis_at_point(vertex_id);
+	const int row = 3 * vertex_id;
+	const auto mean = color_model.get_mean();
+	const auto basis = color_model.get_rescaled_pca_basis(); // a map, this doesn't copy the rows of the vertex
 	// Computing Colour = mean + basis * coeffs
 	// Note: Could use an Eigen matrix with type T to see if it gives a speedup.
-	std::array<T, 3> point{ T(mean[0]), T(mean[1]), T(mean[2]) };
+	std::array<T, 3> point{ T(mean(row)), T(mean(row + 1)), T(mean(row + 2)) };
 	for (int i = 0; i < num_coeffs_fitting; ++i) {
-		point[0] += T(basis.row(0).col(i)(0)) * color_coeffs[i]; // it seems to be ~15% faster when these are static_cast<double>() instead of T()?
+		point[0] += T(basis(row, i)) * color_coeffs[i]; // it seems to be ~15% faster when these are static_cast<double>() instead of T()?
 	}
 	for (int i = 0; i < num_coeffs_fitting; ++i) {
-		point[1] += T(basis.row(1).col(i)(0)) * color_coeffs[i];
+		point[1] += T(basis(row + 1, i)) * color_coeffs[i];
 	}
 	for (int i = 0; i < num_coeffs_fitting; ++i) {
-		point[2] += T(basis.row(2).col(i)(0)) * color_coeffs[i];
+		point[2] += T(basis(row + 2, i)) * color_coeffs[i];
 	}
 	return point;
 };
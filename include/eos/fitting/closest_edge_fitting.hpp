@@ -23,16 +23,21 @@
 #define CLOSESTEDGEFITTING_HPP_
 
 #include "eos/core/Mesh.hpp"
+#include "eos/core/VertexView.hpp"
 #include "eos/morphablemodel/EdgeTopology.hpp"
 #include "eos/fitting/RenderingParameters.hpp"
 #include "eos/render/utils.hpp"
+#include "eos/render/transform_vertices.hpp"
+#include "eos/render/vertex_visibility.hpp"
 
 #include "nanoflann.hpp"
 
 #include "glm/common.hpp"
 #include "glm/vec3.hpp"
 #include "glm/vec4.hpp"
+#include "glm/mat3x3.hpp"
 #include "glm/mat4x4.hpp"
+#include "glm/trigonometric.hpp"
 
 #include "Eigen/Dense" // Need only Vector2f actually.
 
@@ -44,70 +49,15 @@
 #include <algorithm>
 #include <utility>
 #include <cstddef>
+#include <cmath>
+#include <memory>
+#include <cassert>
 
 namespace eos {
 	namespace fitting {
 
-/**
- * @brief Computes the intersection of the given ray with the given triangle.
- *
- * Uses the Mller-Trumbore algorithm algorithm "Fast Minimum Storage
- * Ray/Triangle Intersection". Independent implementation, inspired by:
- * http://www.scratchapixel.com/lessons/3d-basic-rendering/ray-tracing-rendering-a-triangle/moller-trumbore-ray-triangle-intersection
- * The default eps (1e-6f) is from the paper.
- * When culling is on, rays intersecting triangles from the back will be discarded -
- * otherwise, the triangles normal direction w.r.t. the ray direction is just ignored.
- *
- * Note: The use of optional might turn out as a performance problem, as this
- * function is called loads of time - how costly is it to construct a boost::none optional?
- *
- * @param[in] ray_origin Ray origin.
- * @param[in] ray_direction Ray direction.
- * @param[in] v0 First vertex of a triangle.
- * @param[in] v1 Second vertex of a triangle.
- * @param[in] v2 Third vertex of a triangle.
- * @param[in] enable_backculling When culling is on, rays intersecting triangles from the back will be discarded.
- * @return Whether the ray intersects the triangle, and if yes, including the distance.
- */
-inline std::pair<bool, boost::optional<float>> ray_triangle_intersect(const glm::vec3& ray_origin, const glm::vec3& ray_direction, const glm::vec3& v0, const glm::vec3& v1, const glm::vec3& v2, bool enable_backculling)
-{
-	using glm::vec3;
-	const float epsilon = 1e-6f;
-
-	const vec3 v0v1 = v1 - v0;
-	const vec3 v0v2 = v2 - v0;
-
-	const vec3 pvec = glm::cross(ray_direction, v0v2);
-
-	const float det = glm::dot(v0v1, pvec);
-	if (enable_backculling)
-	{
-		// If det is negative, the triangle is back-facing.
-		// If det is close to 0, the ray misses the triangle.
-		if (det < epsilon)
-			return { false, boost::none };
-	}
-	else {
-		// If det is close to 0, the ray and triangle are parallel.
-		if (std::abs(det) < epsilon)
-			return { false, boost::none };
-	}
-	const float inv_det = 1 / det;
-
-	const vec3 tvec = ray_origin - v0;
-	const auto u = glm::dot(tvec, pvec) * inv_det;
-	if (u < 0 || u > 1)
-		return { false, boost::none };
-
-	const vec3 qvec = glm::cross(tvec, v0v1);
-	const auto v = glm::dot(ray_direction, qvec) * inv_det;
-	if (v < 0 || u + v > 1)
-		return { false, boost::none };
-
-	const auto t = glm::dot(v0v2, qvec) * inv_det;
-
-	return { true, t };
-};
+// ray_triangle_intersect() used to live here, it has been moved to render/vertex_visibility.hpp:
+using render::ray_triangle_intersect;
 
 /**
  * @brief Computes the vertices that lie on occluding boundaries, given a particular pose.
@@ -120,13 +70,14 @@ inline std::pair<bool, boost::optional<float>> ray_triangle_intersect(const glm:
  * @param[in] mesh The mesh to use.
  * @param[in] edge_topology The edge topology of the given mesh.
  * @param[in] R The rotation (pose) under which the occluding boundaries should be computed.
+ * @param[in] visibility_method Whether the self-occlusion test uses exact ray casting or a depth buffer approximation.
  * @return A vector with unique vertex id's making up the edges.
  */
-inline std::vector<int> occluding_boundary_vertices(const core::Mesh& mesh, const morphablemodel::EdgeTopology& edge_topology, glm::mat4x4 R)
+inline std::vector<int> occluding_boundary_vertices(const core::Mesh& mesh, const morphablemodel::EdgeTopology& edge_topology, glm::mat4x4 R, render::VisibilityMethod visibility_method = render::VisibilityMethod::RayCasting)
 {
 	// Rotate the mesh:
 	std::vector<glm::vec4> rotated_vertices;
-	std::for_each(begin(mesh.vertices), end(mesh.vertices), [&rotated_vertices, &R](auto&& v) { rotated_vertices.push_back(R * v); });
+	render::transform_vertices(core::VertexView(mesh.vertices), R, rotated_vertices);
 
 	// Compute the face normals of the rotated mesh:
 	std::vector<glm::vec3> facenormals;
@@ -168,37 +119,8 @@ inline std::vector<int> occluding_boundary_vertices(const core::Mesh& mesh, cons
 	std::sort(begin(occluding_vertices), end(occluding_vertices));
 	occluding_vertices.erase(std::unique(begin(occluding_vertices), end(occluding_vertices)), end(occluding_vertices));
 
-	// Perform ray-casting to find out which vertices are not visible (i.e. self-occluded):
-	std::vector<bool> visibility;
-	for (const auto& vertex_idx : occluding_vertices)
-	{
-		bool visible = true;
-		// For every tri of the rotated mesh:
-		for (auto&& tri : mesh.tvi)
-		{
-			auto& v0 = rotated_vertices[tri[0]];
-			auto& v1 = rotated_vertices[tri[1]];
-			auto& v2 = rotated_vertices[tri[2]];
-
-			glm::vec3 ray_origin(rotated_vertices[vertex_idx]);
-			glm::vec3 ray_direction(0.0f, 0.0f, 1.0f); // we shoot the ray from the vertex towards the camera
-			auto intersect = ray_triangle_intersect(ray_origin, ray_direction, glm::vec3(v0), glm::vec3(v1), glm::vec3(v2), false);
-			// first is bool intersect, second is the distance t
-			if (intersect.first == true)
-			{
-				// We've hit a triangle. Ray hit its own triangle. If it's behind the ray origin, ignore the intersection:
-				// Check if in front or behind?
-				if (intersect.second.get() <= 1e-4)
-				{
-					continue; // the intersection is behind the vertex, we don't care about it
-				}
-				// Otherwise, we've hit a genuine triangle, and the vertex is not visible:
-				visible = false;
-				break;
-			}
-		}
-		visibility.push_back(visible);
-	}
+	// Perform ray-casting (or a depth-buffer test) to find out which vertices are not visible (i.e. self-occluded):
+	const std::vector<bool> visibility = render::compute_vertex_visibility(rotated_vertices, mesh.tvi, occluding_vertices, visibility_method);
 
 	// Remove vertices from occluding boundary list that are not visible:
 	std::vector<int> final_vertex_ids;
@@ -212,6 +134,271 @@ inline std::vector<int> occluding_boundary_vertices(const core::Mesh& mesh, cons
 	return final_vertex_ids;
 };
 
+/**
+ * @brief Computes the occluding boundary vertices of a mesh incrementally, over a
+ * sequence of (slowly) changing poses.
+ *
+ * A full update (the first call, and every call after reset()) gives the same result
+ * as occluding_boundary_vertices(). The tracker is meant to be called repeatedly,
+ * e.g. for each frame of a video with a fixed shape. It keeps the rotated vertices and the face normals in preallocated buffers, and
+ * remembers the occluding edges found in the previous call. If the rotation changed
+ * by less than \c max_incremental_rotation degrees since the previous call, only the
+ * edges in a neighbourhood of \c neighbourhood_size faces around the previous
+ * silhouette are re-tested, and only the face normals required for these are computed.
+ *
+ * An incremental update is an approximation: Silhouettes that appear far away from
+ * the previous ones (e.g. when the nose starts occluding the cheek) are missed, and
+ * the tracker does not notice when the shape changes, only when the rotation does.
+ * A full update is done every \c full_update_interval calls. Call reset() to force a
+ * full update on the next call, e.g. when the shape changed or when tracking was lost.
+ * fit_shape_and_pose_multi() only uses incremental updates if
+ * FittingWorkspace::incremental_contours is set.
+ *
+ * The visibility test of the boundary vertices is always done on the whole mesh.
+ */
+class OccludingContourTracker
+{
+public:
+	/**
+	 * @brief Creates a tracker for meshes with the given edge topology.
+	 *
+	 * @param[in] edge_topology The edge topology of the meshes that will be given to update().
+	 * @param[in] max_incremental_rotation Largest change in rotation, in degrees, for which an incremental update is done.
+	 * @param[in] neighbourhood_size Number of rings of faces around the previous silhouette that are re-tested in an incremental update.
+	 * @param[in] full_update_interval A full update is done at least every that many calls.
+	 */
+	OccludingContourTracker(const morphablemodel::EdgeTopology& edge_topology, float max_incremental_rotation = 5.0f, int neighbourhood_size = 3, int full_update_interval = 10) : max_incremental_rotation(max_incremental_rotation), neighbourhood_size(neighbourhood_size), full_update_interval(full_update_interval)
+	{
+		// Convert the topology to 0-based indices and store which edges belong to each face:
+		const auto num_edges = edge_topology.adjacent_faces.size();
+		edge_faces.resize(num_edges);
+		edge_vertices.resize(num_edges);
+		int num_faces = 0;
+		for (std::size_t e = 0; e < num_edges; ++e)
+		{
+			edge_faces[e] = { edge_topology.adjacent_faces[e][0] - 1, edge_topology.adjacent_faces[e][1] - 1 }; // -1 for boundary edges
+			edge_vertices[e] = { edge_topology.adjacent_vertices[e][0] - 1, edge_topology.adjacent_vertices[e][1] - 1 };
+			num_faces = std::max(num_faces, std::max(edge_faces[e][0], edge_faces[e][1]) + 1);
+		}
+		face_edges.assign(num_faces, { -1, -1, -1 });
+		for (std::size_t e = 0; e < num_edges; ++e)
+		{
+			for (auto f : edge_faces[e])
+			{
+				if (f < 0) {
+					continue;
+				}
+				for (auto&& slot : face_edges[f])
+				{
+					if (slot == -1) {
+						slot = static_cast<int>(e);
+						break;
+					}
+				}
+			}
+		}
+		face_stamp.assign(num_faces, 0);
+		normal_stamp.assign(num_faces, 0);
+		face_normal_z.assign(num_faces, 0.0f);
+		edge_stamp.assign(num_edges, 0);
+	};
+
+	/**
+	 * @brief Forces a full update on the next call to update().
+	 */
+	void reset()
+	{
+		has_previous = false;
+	};
+
+	/**
+	 * @brief Computes the vertices that lie on occluding boundaries, given a particular pose.
+	 *
+	 * @param[in] mesh The mesh to use. Must have the edge topology the tracker was created with.
+	 * @param[in] R The rotation (pose) under which the occluding boundaries should be computed.
+	 * @param[in] visibility_method Whether the self-occlusion test uses exact ray casting or a depth buffer approximation.
+	 * @return A vector with unique vertex id's making up the edges.
+	 */
+	std::vector<int> update(const core::Mesh& mesh, const glm::mat4x4& R, render::VisibilityMethod visibility_method = render::VisibilityMethod::RayCasting)
+	{
+		return update(core::VertexView(mesh.vertices), mesh.tvi, R, visibility_method);
+	};
+
+	/**
+	 * @brief Computes the vertices that lie on occluding boundaries, given a particular pose.
+	 *
+	 * Same as the overload taking a core::Mesh, but only needs the vertex positions
+	 * (e.g. a view of a model instance's shape vector) and the triangle list.
+	 *
+	 * @param[in] vertices The vertex positions of the mesh.
+	 * @param[in] triangles The triangle list of the mesh. Must have the edge topology the tracker was created with.
+	 * @param[in] R The rotation (pose) under which the occluding boundaries should be computed.
+	 * @param[in] visibility_method Whether the self-occlusion test uses exact ray casting or a depth buffer approximation.
+	 * @return A vector with unique vertex id's making up the edges.
+	 */
+	std::vector<int> update(const core::VertexView& vertices, const std::vector<std::array<int, 3>>& triangles, const glm::mat4x4& R, render::VisibilityMethod visibility_method = render::VisibilityMethod::RayCasting)
+	{
+		assert(triangles.size() == face_edges.size());
+		// Rotate the mesh, into the existing buffer:
+		render::transform_vertices(vertices, R, rotated_vertices);
+
+		const glm::mat3x3 rotation(R);
+		const bool incremental = has_previous && updates_since_full_update < full_update_interval && rotation_angle(previous_rotation, rotation) <= max_incremental_rotation;
+		previous_rotation = rotation;
+		has_previous = true;
+		++current_stamp;
+
+		// Collect the edges that need to be tested:
+		candidate_edges.clear();
+		if (incremental)
+		{
+			++updates_since_full_update;
+			// Grow a neighbourhood of faces around the previous silhouette, ring by ring:
+			frontier.clear();
+			for (auto edge_idx : silhouette_edges) {
+				for (auto f : edge_faces[edge_idx]) {
+					add_face(f, frontier);
+				}
+			}
+			for (int ring = 0; ring < neighbourhood_size; ++ring)
+			{
+				next_frontier.clear();
+				for (auto f : frontier) {
+					for (auto edge_idx : face_edges[f]) {
+						if (edge_idx < 0) {
+							continue;
+						}
+						for (auto neighbour : edge_faces[edge_idx]) {
+							add_face(neighbour, next_frontier);
+						}
+					}
+				}
+				frontier.swap(next_frontier);
+			}
+		}
+		else {
+			updates_since_full_update = 0;
+			for (std::size_t e = 0; e < edge_faces.size(); ++e) {
+				candidate_edges.push_back(static_cast<int>(e));
+			}
+		}
+
+		// Find occluding edges, as those where the two adjacent face normals differ in the sign of their z-component:
+		silhouette_edges.clear();
+		for (auto edge_idx : candidate_edges)
+		{
+			const auto& faces = edge_faces[edge_idx];
+			if (faces[0] < 0) {
+				continue; // Edges on the mesh boundary are only adjacent to one face.
+			}
+			if (glm::sign(face_z(triangles, faces[0])) != glm::sign(face_z(triangles, faces[1]))) {
+				silhouette_edges.push_back(edge_idx);
+			}
+		}
+
+		// Select the vertices lying at the two ends of the occluding edges and remove duplicates:
+		std::vector<int> occluding_vertices;
+		occluding_vertices.reserve(2 * silhouette_edges.size());
+		for (auto edge_idx : silhouette_edges)
+		{
+			occluding_vertices.push_back(edge_vertices[edge_idx][0]);
+			occluding_vertices.push_back(edge_vertices[edge_idx][1]);
+		}
+		std::sort(begin(occluding_vertices), end(occluding_vertices));
+		occluding_vertices.erase(std::unique(begin(occluding_vertices), end(occluding_vertices)), end(occluding_vertices));
+
+		// Remove the vertices that are not visible (i.e. self-occluded):
+		std::vector<bool> visibility;
+		if (visibility_method == render::VisibilityMethod::DepthBuffer)
+		{
+			visibility_depthbuffer.build(rotated_vertices, triangles);
+			visibility = visibility_depthbuffer.compute_visibility(occluding_vertices);
+		}
+		else {
+			visibility_grid.build(rotated_vertices, triangles);
+			visibility = visibility_grid.compute_visibility(occluding_vertices);
+		}
+		std::vector<int> final_vertex_ids;
+		for (std::size_t i = 0; i < occluding_vertices.size(); ++i)
+		{
+			if (visibility[i] == true)
+			{
+				final_vertex_ids.push_back(occluding_vertices[i]);
+			}
+		}
+		return final_vertex_ids;
+	};
+
+private:
+	float max_incremental_rotation; // in degrees
+	int neighbourhood_size;
+	int full_update_interval;
+
+	// The mesh topology, 0-based. Face indices are -1 for the non-existing face of boundary edges.
+	std::vector<std::array<int, 2>> edge_faces;
+	std::vector<std::array<int, 2>> edge_vertices;
+	std::vector<std::array<int, 3>> face_edges;
+
+	// State of the previous call, and buffers that we keep around:
+	bool has_previous = false;
+	glm::mat3x3 previous_rotation;
+	int updates_since_full_update = 0;
+	std::vector<int> silhouette_edges;
+	std::vector<glm::vec4> rotated_vertices;
+	std::vector<float> face_normal_z; // z-component of the (unnormalised) face normal, only its sign is used
+	std::vector<int> candidate_edges;
+	std::vector<int> frontier;
+	std::vector<int> next_frontier;
+	// face_stamp[f] == current_stamp means f is already part of the neighbourhood (likewise for
+	// edges and computed normals). Saves us clearing the flags on every call.
+	unsigned int current_stamp = 0;
+	std::vector<unsigned int> face_stamp;
+	std::vector<unsigned int> normal_stamp;
+	std::vector<unsigned int> edge_stamp;
+	render::VertexVisibilityGrid visibility_grid;
+	render::VertexVisibilityDepthBuffer visibility_depthbuffer;
+
+	// Adds the face to the neighbourhood (and its edges to the candidates), if it isn't yet.
+	void add_face(int face, std::vector<int>& added_faces)
+	{
+		if (face < 0 || face_stamp[face] == current_stamp) {
+			return;
+		}
+		face_stamp[face] = current_stamp;
+		added_faces.push_back(face);
+		for (auto edge_idx : face_edges[face])
+		{
+			if (edge_idx >= 0 && edge_stamp[edge_idx] != current_stamp) {
+				edge_stamp[edge_idx] = current_stamp;
+				candidate_edges.push_back(edge_idx);
+			}
+		}
+	};
+
+	// Returns the z-component of the face normal of the rotated mesh, computing it on first use.
+	float face_z(const std::vector<std::array<int, 3>>& triangles, int face)
+	{
+		if (normal_stamp[face] != current_stamp)
+		{
+			const auto& f = triangles[face];
+			const glm::vec3 v0(rotated_vertices[f[0]]);
+			const glm::vec3 v0v1 = glm::vec3(rotated_vertices[f[1]]) - v0;
+			const glm::vec3 v0v2 = glm::vec3(rotated_vertices[f[2]]) - v0;
+			face_normal_z[face] = v0v1.x * v0v2.y - v0v1.y * v0v2.x; // z of cross(v0v1, v0v2), see render::compute_face_normal()
+			normal_stamp[face] = current_stamp;
+		}
+		return face_normal_z[face];
+	};
+
+	// Angle of the rotation between a and b, in degrees.
+	static float rotation_angle(const glm::mat3x3& a, const glm::mat3x3& b)
+	{
+		const glm::mat3x3 relative = glm::transpose(a) * b;
+		const float cos_angle = (relative[0][0] + relative[1][1] + relative[2][2] - 1.0f) / 2.0f;
+		return glm::degrees(std::acos(glm::clamp(cos_angle, -1.0f, 1.0f)));
+	};
+};
+
 /** A simple vector-of-vectors adaptor for nanoflann, without duplicating the storage.
  *  The i'th vector represents a point in the state space.
  *
@@ -312,78 +499,170 @@ struct KDTreeVectorOfVectorsAdaptor
 };
 
 /**
- * @brief For a given list of 2D edge points, find corresponding 3D vertex IDs.
+ * @brief A kd-tree over a set of 2D image edge points that can be built once
+ * and then queried many times.
  *
- * This algorithm first computes the 3D mesh's occluding boundary vertices under
- * the given pose. Then, for each 2D image edge point given, it searches for the
- * closest 3D edge vertex (projected to 2D). Correspondences lying further away
- * than \c distance_threshold (times a scale-factor) are discarded.
- * It returns a list of the remaining image edge points and their corresponding
- * 3D vertex ID.
+ * The image edges (e.g. the contour landmarks) usually stay the same over all
+ * iterations of a fitting, so building the index once per image and reusing it
+ * saves rebuilding the kd-tree in every iteration.
  *
- * The given \c rendering_parameters camery_type must be CameraType::Orthographic.
+ * The class owns a copy of the edge points. It is cheap to copy - copies share
+ * the same (immutable) index. An index with no points can be constructed, and
+ * all queries on it return no neighbours.
+ */
+class ImageEdgeIndex
+{
+public:
+	/**
+	 * Builds the kd-tree over the given image edge points.
+	 *
+	 * @param[in] image_edges A list of points that are edges.
+	 * @param[in] leaf_max_size Maximum number of points in a leaf of the kd-tree.
+	 */
+	explicit ImageEdgeIndex(std::vector<Eigen::Vector2f> image_edges, int leaf_max_size = 10) : data(std::make_shared<const Data>(std::move(image_edges), leaf_max_size))
+	{
+	};
+
+	/**
+	 * Returns the image edge points that the index was built from.
+	 *
+	 * @return The image edge points.
+	 */
+	const std::vector<Eigen::Vector2f>& get_points() const
+	{
+		return data->points;
+	};
+
+	/**
+	 * Returns the number of image edge points in the index.
+	 *
+	 * @return The number of points.
+	 */
+	std::size_t size() const
+	{
+		return data->points.size();
+	};
+
+	/**
+	 * Returns whether the index doesn't contain any points.
+	 *
+	 * @return True if the index is empty.
+	 */
+	bool empty() const
+	{
+		return data->points.empty();
+	};
+
+	/**
+	 * @brief Finds the \p num_neighbours nearest image edge points for all
+	 * the given query points in one go.
+	 *
+	 * The results are stored row-wise: The neighbours of query point i are at
+	 * [i * k, (i + 1) * k), sorted by increasing distance, where
+	 * k = min(num_neighbours, size()) is the returned value.
+	 *
+	 * @param[in] query_points The 2D points to find the nearest neighbours for.
+	 * @param[in] num_neighbours The number of neighbours to find for each query point.
+	 * @param[out] indices Indices into get_points() of the found neighbours.
+	 * @param[out] distances_sq The squared L2 distances to the found neighbours.
+	 * @return The number of neighbours that were found for each query point.
+	 */
+	std::size_t query(const std::vector<Eigen::Vector2f>& query_points, std::size_t num_neighbours, std::vector<std::size_t>& indices, std::vector<float>& distances_sq) const
+	{
+		const auto k = std::min(num_neighbours, size());
+		indices.resize(query_points.size() * k);
+		distances_sq.resize(query_points.size() * k);
+		if (k == 0)
+		{
+			return 0;
+		}
+		for (std::size_t i = 0; i < query_points.size(); ++i)
+		{
+			nanoflann::KNNResultSet<float> result_set(k);
+			result_set.init(&indices[i * k], &distances_sq[i * k]);
+			data->tree->index->findNeighbors(result_set, query_points[i].data(), nanoflann::SearchParams(10));
+		}
+		return k;
+	};
+
+private:
+	using kd_tree_t = KDTreeVectorOfVectorsAdaptor<std::vector<Eigen::Vector2f>, float, 2>;
+
+	// The kd-tree adaptor keeps a reference to the points and owns a raw
+	// pointer, so both are kept together on the heap and never copied.
+	struct Data
+	{
+		Data(std::vector<Eigen::Vector2f> image_edges, int leaf_max_size) : points(std::move(image_edges))
+		{
+			if (!points.empty())
+			{
+				tree = std::make_unique<kd_tree_t>(2, points, leaf_max_size); // dim, samples, max_leaf. Builds the index.
+			}
+		};
+		std::vector<Eigen::Vector2f> points;
+		std::unique_ptr<kd_tree_t> tree;
+	};
+	std::shared_ptr<const Data> data;
+};
+
+/**
+ * @brief For a given index of 2D edge points, find the corresponding vertices
+ * out of the given occluding boundary vertices.
  *
- * The units of \c distance_threshold are somewhat complicated. The function
- * uses squared distances, and the \c distance_threshold is further multiplied
- * with a face-size and image resolution dependent scale factor.
- * It's reasonable to use correspondences that are 10 to 15 pixels away on a
- * 1280x720 image with s=0.93. This would be a distance_threshold of around 200.
- * 64 might be a conservative default.
+ * This is the second half of find_occluding_edge_correspondences(): It projects
+ * the given vertices to 2D and runs a batched nearest neighbour search between
+ * them and the image edge points. See find_occluding_edge_correspondences() for
+ * a description of \c distance_threshold.
  *
- * @param[in] mesh The 3D mesh.
- * @param[in] edge_topology The mesh's edge topology (used for fast computation).
+ * @param[in] vertices The vertex positions of the 3D mesh.
+ * @param[in] occluding_vertices The vertex indices of the occluding boundary, e.g. from occluding_boundary_vertices().
  * @param[in] rendering_parameters Rendering (pose) parameters of the mesh.
- * @param[in] image_edges A list of points that are edges.
+ * @param[in] image_edge_index A prebuilt index over the image edge points.
  * @param[in] distance_threshold All correspondences below this threshold.
  * @return A pair consisting of the used image edge points and their associated 3D vertex index.
  */
-inline std::pair<std::vector<cv::Vec2f>, std::vector<int>> find_occluding_edge_correspondences(const core::Mesh& mesh, const morphablemodel::EdgeTopology& edge_topology, const fitting::RenderingParameters& rendering_parameters, const std::vector<Eigen::Vector2f>& image_edges, float distance_threshold = 64.0f)
+inline std::pair<std::vector<cv::Vec2f>, std::vector<int>> find_edge_correspondences(const core::VertexView& vertices, const std::vector<int>& occluding_vertices, const fitting::RenderingParameters& rendering_parameters, const ImageEdgeIndex& image_edge_index, float distance_threshold = 64.0f)
 {
 	assert(rendering_parameters.get_camera_type() == fitting::CameraType::Orthographic);
 	using std::vector;
 	using Eigen::Vector2f;
 
-	// Compute vertices that lye on occluding boundaries:
-	auto occluding_vertices = occluding_boundary_vertices(mesh, edge_topology, glm::mat4x4(rendering_parameters.get_rotation()));
+	if (image_edge_index.empty())
+	{
+		return {};
+	}
 
 	// Project these occluding boundary vertices from 3D to 2D:
+	const auto modelview = rendering_parameters.get_modelview();
+	const auto projection = rendering_parameters.get_projection();
+	const auto viewport = fitting::get_opencv_viewport(rendering_parameters.get_screen_width(), rendering_parameters.get_screen_height());
 	vector<Vector2f> model_edges_projected;
+	model_edges_projected.reserve(occluding_vertices.size());
 	for (const auto& v : occluding_vertices)
 	{
-		auto p = glm::project({ mesh.vertices[v][0], mesh.vertices[v][1], mesh.vertices[v][2] }, rendering_parameters.get_modelview(), rendering_parameters.get_projection(), fitting::get_opencv_viewport(rendering_parameters.get_screen_width(), rendering_parameters.get_screen_height()));
+		auto p = glm::project(glm::vec3(vertices[v]), modelview, projection, viewport);
 		model_edges_projected.push_back({ p.x, p.y });
 	}
 
-	// Find edge correspondences:
-	// Build a kd-tree and use nearest neighbour search:
-	using kd_tree_t = KDTreeVectorOfVectorsAdaptor<vector<Vector2f>, float, 2>;
-	kd_tree_t tree(2, image_edges); // dim, samples, max_leaf
-	tree.index->buildIndex();
-
-	vector<std::pair<std::size_t, double>> idx_d; // will contain [ index to the 2D edge in 'image_edges', distance (L2^2) ]
-	for (const auto& e : model_edges_projected)
-	{
-		std::size_t idx; // contains the indices into the original 'image_edges' vector
-		double dist_sq; // squared distances
-		nanoflann::KNNResultSet<double> resultSet(1);
-		resultSet.init(&idx, &dist_sq);
-		tree.index->findNeighbors(resultSet, e.data(), nanoflann::SearchParams(10));
-		idx_d.push_back({ idx, dist_sq });
-	}
+	// Find edge correspondences, with one batched nearest neighbour query:
+	vector<std::size_t> indices; // indices into the original image edges
+	vector<float> distances_sq; // squared distances
+	image_edge_index.query(model_edges_projected, 1, indices, distances_sq);
 	// Filter edge matches:
 	// We filter below by discarding all correspondence that are a certain distance apart.
 	// We could also (or in addition to) discard the worst 5% of the distances or something like that.
 
 	// Filter and store the image (edge) points with their corresponding vertex id:
+	const auto& image_edges = image_edge_index.get_points();
+	const auto ortho_scale = rendering_parameters.get_screen_width() / rendering_parameters.get_frustum().r; // This might be a bit of a hack - we recover the "real" scaling from the SOP estimate
 	vector<int> vertex_indices;
 	vector<cv::Vec2f> image_points;
-	assert(occluding_vertices.size() == idx_d.size());
+	assert(occluding_vertices.size() == indices.size());
 	for (int i = 0; i < occluding_vertices.size(); ++i)
 	{
-		auto ortho_scale = rendering_parameters.get_screen_width() / rendering_parameters.get_frustum().r; // This might be a bit of a hack - we recover the "real" scaling from the SOP estimate
-		if (idx_d[i].second <= distance_threshold * ortho_scale) // I think multiplying by the scale is good here and gives us invariance w.r.t. the image resolution and face size.
+		if (distances_sq[i] <= distance_threshold * ortho_scale) // I think multiplying by the scale is good here and gives us invariance w.r.t. the image resolution and face size.
 		{
-			auto edge_point = image_edges[idx_d[i].first];
+			const auto& edge_point = image_edges[indices[i]];
 			// Store the found 2D edge point, and the associated vertex id:
 			vertex_indices.push_back(occluding_vertices[i]);
 			image_points.push_back(cv::Vec2f(edge_point[0], edge_point[1]));
@@ -392,6 +671,158 @@ inline std::pair<std::vector<cv::Vec2f>, std::vector<int>> find_occluding_edge_c
 	return { image_points, vertex_indices };
 };
 
+/**
+ * @brief For a prebuilt index of 2D edge points, find the corresponding vertices
+ * out of the given occluding boundary vertices.
+ *
+ * Same as the overload taking a core::VertexView, for a core::Mesh.
+ */
+inline std::pair<std::vector<cv::Vec2f>, std::vector<int>> find_edge_correspondences(const core::Mesh& mesh, const std::vector<int>& occluding_vertices, const fitting::RenderingParameters& rendering_parameters, const ImageEdgeIndex& image_edge_index, float distance_threshold = 64.0f)
+{
+	return find_edge_correspondences(core::VertexView(mesh.vertices), occluding_vertices, rendering_parameters, image_edge_index, distance_threshold);
+};
+
+/**
+ * @brief For a given list of 2D edge points, find the corresponding vertices
+ * out of the given occluding boundary vertices.
+ *
+ * Builds an ImageEdgeIndex over \p image_edges and calls the overload above.
+ * When calling this repeatedly with the same image edges, build the index
+ * once and use the other overload instead.
+ *
+ * @param[in] mesh The 3D mesh.
+ * @param[in] occluding_vertices The vertex indices of the occluding boundary, e.g. from occluding_boundary_vertices().
+ * @param[in] rendering_parameters Rendering (pose) parameters of the mesh.
+ * @param[in] image_edges A list of points that are edges.
+ * @param[in] distance_threshold All correspondences below this threshold.
+ * @return A pair consisting of the used image edge points and their associated 3D vertex index.
+ */
+inline std::pair<std::vector<cv::Vec2f>, std::vector<int>> find_edge_correspondences(const core::Mesh& mesh, const std::vector<int>& occluding_vertices, const fitting::RenderingParameters& rendering_parameters, const std::vector<Eigen::Vector2f>& image_edges, float distance_threshold = 64.0f)
+{
+	return find_edge_correspondences(mesh, occluding_vertices, rendering_parameters, ImageEdgeIndex(image_edges), distance_threshold);
+};
+
+/**
+ * @brief For a given list of 2D edge points, find corresponding 3D vertex IDs.
+ *
+ * This algorithm first computes the 3D mesh's occluding boundary vertices under
+ * the given pose. Then, for each 2D image edge point given, it searches for the
+ * closest 3D edge vertex (projected to 2D). Correspondences lying further away
+ * than \c distance_threshold (times a scale-factor) are discarded.
+ * It returns a list of the remaining image edge points and their corresponding
+ * 3D vertex ID.
+ *
+ * The given \c rendering_parameters camery_type must be CameraType::Orthographic.
+ *
+ * The units of \c distance_threshold are somewhat complicated. The function
+ * uses squared distances, and the \c distance_threshold is further multiplied
+ * with a face-size and image resolution dependent scale factor.
+ * It's reasonable to use correspondences that are 10 to 15 pixels away on a
+ * 1280x720 image with s=0.93. This would be a distance_threshold of around 200.
+ * 64 might be a conservative default.
+ *
+ * @param[in] mesh The 3D mesh.
+ * @param[in] edge_topology The mesh's edge topology (used for fast computation).
+ * @param[in] rendering_parameters Rendering (pose) parameters of the mesh.
+ * @param[in] image_edges A list of points that are edges.
+ * @param[in] distance_threshold All correspondences below this threshold.
+ * @param[in] visibility_method Whether the self-occlusion test uses exact ray casting or a depth buffer approximation.
+ * @return A pair consisting of the used image edge points and their associated 3D vertex index.
+ */
+inline std::pair<std::vector<cv::Vec2f>, std::vector<int>> find_occluding_edge_correspondences(const core::Mesh& mesh, const morphablemodel::EdgeTopology& edge_topology, const fitting::RenderingParameters& rendering_parameters, const std::vector<Eigen::Vector2f>& image_edges, float distance_threshold = 64.0f, render::VisibilityMethod visibility_method = render::VisibilityMethod::RayCasting)
+{
+	// Compute vertices that lye on occluding boundaries:
+	auto occluding_vertices = occluding_boundary_vertices(mesh, edge_topology, glm::mat4x4(rendering_parameters.get_rotation()), visibility_method);
+
+	return find_edge_correspondences(mesh, occluding_vertices, rendering_parameters, image_edges, distance_threshold);
+};
+
+/**
+ * @brief For a given list of 2D edge points, find corresponding 3D vertex IDs,
+ * computing the occluding boundary incrementally with the given tracker.
+ *
+ * Same as find_occluding_edge_correspondences(const core::Mesh&, const morphablemodel::EdgeTopology&, const fitting::RenderingParameters&, const std::vector<Eigen::Vector2f>&, float, render::VisibilityMethod),
+ * but uses (and updates) \p contour_tracker, which is much faster when called
+ * repeatedly with similar poses, e.g. in the iterations of a fitting or in video.
+ *
+ * @param[in,out] contour_tracker A tracker created with the mesh's edge topology.
+ * @param[in] mesh The 3D mesh.
+ * @param[in] rendering_parameters Rendering (pose) parameters of the mesh.
+ * @param[in] image_edges A list of points that are edges.
+ * @param[in] distance_threshold All correspondences below this threshold.
+ * @param[in] visibility_method Whether the self-occlusion test uses exact ray casting or a depth buffer approximation.
+ * @return A pair consisting of the used image edge points and their associated 3D vertex index.
+ */
+inline std::pair<std::vector<cv::Vec2f>, std::vector<int>> find_occluding_edge_correspondences(OccludingContourTracker& contour_tracker, const core::Mesh& mesh, const fitting::RenderingParameters& rendering_parameters, const std::vector<Eigen::Vector2f>& image_edges, float distance_threshold = 64.0f, render::VisibilityMethod visibility_method = render::VisibilityMethod::RayCasting)
+{
+	const auto occluding_vertices = contour_tracker.update(mesh, glm::mat4x4(rendering_parameters.get_rotation()), visibility_method);
+	return find_edge_correspondences(mesh, occluding_vertices, rendering_parameters, image_edges, distance_threshold);
+};
+
+/**
+ * @brief For a prebuilt index of 2D edge points, find corresponding 3D vertex IDs.
+ *
+ * Same as find_occluding_edge_correspondences(const core::Mesh&, const morphablemodel::EdgeTopology&, const fitting::RenderingParameters&, const std::vector<Eigen::Vector2f>&, float, render::VisibilityMethod),
+ * but reuses the given kd-tree over the image edges instead of building a new one.
+ *
+ * @param[in] mesh The 3D mesh.
+ * @param[in] edge_topology The mesh's edge topology (used for fast computation).
+ * @param[in] rendering_parameters Rendering (pose) parameters of the mesh.
+ * @param[in] image_edge_index A prebuilt index over the image edge points.
+ * @param[in] distance_threshold All correspondences below this threshold.
+ * @param[in] visibility_method Whether the self-occlusion test uses exact ray casting or a depth buffer approximation.
+ * @return A pair consisting of the used image edge points and their associated 3D vertex index.
+ */
+inline std::pair<std::vector<cv::Vec2f>, std::vector<int>> find_occluding_edge_correspondences(const core::Mesh& mesh, const morphablemodel::EdgeTopology& edge_topology, const fitting::RenderingParameters& rendering_parameters, const ImageEdgeIndex& image_edge_index, float distance_threshold = 64.0f, render::VisibilityMethod visibility_method = render::VisibilityMethod::RayCasting)
+{
+	const auto occluding_vertices = occluding_boundary_vertices(mesh, edge_topology, glm::mat4x4(rendering_parameters.get_rotation()), visibility_method);
+	return find_edge_correspondences(mesh, occluding_vertices, rendering_parameters, image_edge_index, distance_threshold);
+};
+
+/**
+ * @brief For a prebuilt index of 2D edge points, find corresponding 3D vertex IDs,
+ * computing the occluding boundary incrementally with the given tracker.
+ *
+ * This is the fastest variant for repeated calls, e.g. in the iterations of a
+ * fitting: Neither the kd-tree nor the full occluding boundary are recomputed.
+ *
+ * @param[in,out] contour_tracker A tracker created with the mesh's edge topology.
+ * @param[in] mesh The 3D mesh.
+ * @param[in] rendering_parameters Rendering (pose) parameters of the mesh.
+ * @param[in] image_edge_index A prebuilt index over the image edge points.
+ * @param[in] distance_threshold All correspondences below this threshold.
+ * @param[in] visibility_method Whether the self-occlusion test uses exact ray casting or a depth buffer approximation.
+ * @return A pair consisting of the used image edge points and their associated 3D vertex index.
+ */
+inline std::pair<std::vector<cv::Vec2f>, std::vector<int>> find_occluding_edge_correspondences(OccludingContourTracker& contour_tracker, const core::Mesh& mesh, const fitting::RenderingParameters& rendering_parameters, const ImageEdgeIndex& image_edge_index, float distance_threshold = 64.0f, render::VisibilityMethod visibility_method = render::VisibilityMethod::RayCasting)
+{
+	const auto occluding_vertices = contour_tracker.update(mesh, glm::mat4x4(rendering_parameters.get_rotation()), visibility_method);
+	return find_edge_correspondences(mesh, occluding_vertices, rendering_parameters, image_edge_index, distance_threshold);
+};
+
+/**
+ * @brief For a prebuilt index of 2D edge points, find corresponding 3D vertex IDs,
+ * computing the occluding boundary incrementally with the given tracker.
+ *
+ * Same as the overload above, but only needs the vertex positions and the triangle
+ * list instead of a whole core::Mesh. With a core::VertexView of the shape vector of
+ * a model instance, no mesh has to be built at all.
+ *
+ * @param[in,out] contour_tracker A tracker created with the mesh's edge topology.
+ * @param[in] vertices The vertex positions of the 3D mesh.
+ * @param[in] triangles The triangle list of the 3D mesh.
+ * @param[in] rendering_parameters Rendering (pose) parameters of the mesh.
+ * @param[in] image_edge_index A prebuilt index over the image edge points.
+ * @param[in] distance_threshold All correspondences below this threshold.
+ * @param[in] visibility_method Whether the self-occlusion test uses exact ray casting or a depth buffer approximation.
+ * @return A pair consisting of the used image edge points and their associated 3D vertex index.
+ */
+inline std::pair<std::vector<cv::Vec2f>, std::vector<int>> find_occluding_edge_correspondences(OccludingContourTracker& contour_tracker, const core::VertexView& vertices, const std::vector<std::array<int, 3>>& triangles, const fitting::RenderingParameters& rendering_parameters, const ImageEdgeIndex& image_edge_index, float distance_threshold = 64.0f, render::VisibilityMethod visibility_method = render::VisibilityMethod::RayCasting)
+{
+	const auto occluding_vertices = contour_tracker.update(vertices, triangles, glm::mat4x4(rendering_parameters.get_rotation()), visibility_method);
+	return find_edge_correspondences(vertices, occluding_vertices, rendering_parameters, image_edge_index, distance_threshold);
+};
+
 	} /* namespace fitting */
 } /* namespace eos */
 
@@ -24,12 +24,16 @@
 
 #include "eos/core/Landmark.hpp"
 #include "eos/core/Mesh.hpp"
+#include "eos/core/VertexView.hpp"
 #include "eos/morphablemodel/MorphableModel.hpp"
+#include "eos/render/transform_vertices.hpp"
 
 #include "cereal/archives/json.hpp"
 
 #include "glm/gtc/matrix_transform.hpp"
 
+#include "Eigen/Core"
+
 #include "opencv2/core/core.hpp"
 
 #include "boost/property_tree/ptree.hpp"
@@ -39,15 +43,65 @@
 #include <string>
 #include <algorithm>
 #include <fstream>
+#include <cassert>
 
 namespace eos {
 	namespace fitting {
 
+		namespace detail {
+
+/**
+ * Projects the given vertices to screen space, like glm::project, into a
+ * structure-of-arrays buffer, so that the distances to all of them can be
+ * computed at once with find_nearest_projected_vertex().
+ *
+ * The model-view and projection matrices are combined once, and the vertices
+ * are transformed in blocks by render::project_vertices(). \p x and \p y are
+ * only re-allocated if their size changes.
+ *
+ * @param[in] vertex_indices The vertices to project.
+ * @param[in] vertices The vertices of the mesh.
+ * @param[in] view_model Model-view matrix of the current fitting.
+ * @param[in] projection Projection matrix.
+ * @param[in] viewport Current viewport to use.
+ * @param[out] x The screen-space x coordinate of each vertex.
+ * @param[out] y The screen-space y coordinate of each vertex.
+ */
+inline void project_vertices(const std::vector<int>& vertex_indices, const core::VertexView& vertices, const glm::mat4x4& view_model, const glm::mat4x4& projection, const glm::vec4& viewport, Eigen::ArrayXf& x, Eigen::ArrayXf& y)
+{
+	const int num_vertices = static_cast<int>(vertex_indices.size());
+	x.resize(num_vertices);
+	y.resize(num_vertices);
+	render::project_vertices(vertices, vertex_indices, projection * view_model, viewport, x.data(), y.data());
+};
+
+/**
+ * Returns the index (into \p x and \p y) of the projected vertex in
+ * [first, first + count) that is closest to the given point. The squared
+ * distances are computed with Eigen's vectorised array expressions.
+ *
+ * @param[in] x The screen-space x coordinates, from project_vertices().
+ * @param[in] y The screen-space y coordinates, from project_vertices().
+ * @param[in] point The 2D point to find the closest vertex to.
+ * @param[in] first The first vertex to consider.
+ * @param[in] count The number of vertices to consider. Must be > 0.
+ * @return The index of the closest vertex.
+ */
+inline int find_nearest_projected_vertex(const Eigen::ArrayXf& x, const Eigen::ArrayXf& y, const cv::Vec2f& point, int first, int count)
+{
+	assert(count > 0 && first >= 0 && first + count <= x.size());
+	Eigen::Index nearest;
+	((x.segment(first, count) - point[0]).square() + (y.segment(first, count) - point[1]).square()).minCoeff(&nearest);
+	return first + static_cast<int>(nearest);
+};
+
+		} /* namespace detail */
+
 // Forward declarations of later used functions and types:
 struct ModelContour;
 struct ContourLandmarks;
 std::pair<std::vector<std::string>, std::vector<int>> select_contour(float yaw_angle, const ContourLandmarks& contour_landmarks, const ModelContour& model_contour);
-std::tuple<std::vector<cv::Vec2f>, std::vector<cv::Vec4f>, std::vector<int>> get_nearest_contour_correspondences(const core::LandmarkCollection<cv::Vec2f>& landmarks, const std::vector<std::string>& landmark_contour_identifiers, const std::vector<int>& model_contour_indices, const core::Mesh& mesh, const glm::mat4x4& view_model, const glm::mat4x4& ortho_projection, const glm::vec4& viewport);
+std::tuple<std::vector<cv::Vec2f>, std::vector<cv::Vec4f>, std::vector<int>> get_nearest_contour_correspondences(const core::LandmarkCollection<cv::Vec2f>& landmarks, const std::vector<std::string>& landmark_contour_identifiers, const std::vector<int>& model_contour_indices, const core::VertexView& vertices, const glm::mat4x4& view_model, const glm::mat4x4& ortho_projection, const glm::vec4& viewport);
 
 
 /**
@@ -195,13 +249,13 @@ struct ContourLandmarks
  * @param[in] contour_landmarks 2D image contour ids of left or right side (for example for ibug landmarks).
  * @param[in] model_contour The model contour indices that should be considered to find the closest corresponding 3D vertex.
  * @param[in] yaw_angle Yaw angle of the current fitting, in degrees. The front-facing contour will be chosen depending on this yaw angle.
- * @param[in] mesh The mesh that's used to find the nearest contour points.
+ * @param[in] vertices The vertices of the mesh that's used to find the nearest contour points.
  * @param[in] view_model Model-view matrix of the current fitting to project the 3D model vertices to 2D.
  * @param[in] ortho_projection Projection matrix to project the 3D model vertices to 2D.
  * @param[in] viewport Current viewport to use.
  * @return A tuple with the 2D contour landmark points, the corresponding points in the 3D shape model and their vertex indices.
  */
-inline std::tuple<std::vector<cv::Vec2f>, std::vector<cv::Vec4f>, std::vector<int>> get_contour_correspondences(const core::LandmarkCollection<cv::Vec2f>& landmarks, const ContourLandmarks& contour_landmarks, const ModelContour& model_contour, float yaw_angle, const core::Mesh& mesh, const glm::mat4x4& view_model, const glm::mat4x4& ortho_projection, const glm::vec4& viewport)
+inline std::tuple<std::vector<cv::Vec2f>, std::vector<cv::Vec4f>, std::vector<int>> get_contour_correspondences(const core::LandmarkCollection<cv::Vec2f>& landmarks, const ContourLandmarks& contour_landmarks, const ModelContour& model_contour, float yaw_angle, const core::VertexView& vertices, const glm::mat4x4& view_model, const glm::mat4x4& ortho_projection, const glm::vec4& viewport)
 {
 	// Select which side of the contour we'll use:
 	std::vector<int> model_contour_indices;
@@ -215,7 +269,18 @@ inline std::tuple<std::vector<cv::Vec2f>, std::vector<cv::Vec4f>, std::vector<in
 	
 	// For each 2D contour landmark, get the corresponding 3D vertex point and vertex id:
 	// Note/Todo: Loop here instead of calling this function where we have no idea what it's doing? What does its documentation say?
-	return get_nearest_contour_correspondences(landmarks, landmark_contour_identifiers, model_contour_indices, mesh, view_model, ortho_projection, viewport);
+	return get_nearest_contour_correspondences(landmarks, landmark_contour_identifiers, model_contour_indices, vertices, view_model, ortho_projection, viewport);
+};
+
+/**
+ * @brief Given a set of 2D image landmarks, finds the closest (in a L2 sense) 3D vertex
+ * from a list of vertices pre-defined in \p model_contour.
+ *
+ * Same as the overload taking a core::VertexView, for a core::Mesh.
+ */
+inline std::tuple<std::vector<cv::Vec2f>, std::vector<cv::Vec4f>, std::vector<int>> get_contour_correspondences(const core::LandmarkCollection<cv::Vec2f>& landmarks, const ContourLandmarks& contour_landmarks, const ModelContour& model_contour, float yaw_angle, const core::Mesh& mesh, const glm::mat4x4& view_model, const glm::mat4x4& ortho_projection, const glm::vec4& viewport)
+{
+	return get_contour_correspondences(landmarks, contour_landmarks, model_contour, yaw_angle, core::VertexView(mesh.vertices), view_model, ortho_projection, viewport);
 };
 
 /**
@@ -267,18 +332,25 @@ std::pair<std::vector<std::string>, std::vector<int>> select_contour(float yaw_a
  * @param[in] landmarks All image landmarks.
  * @param[in] landmark_contour_identifiers 2D image contour ids of left or right side (for example for ibug landmarks).
  * @param[in] model_contour_indices The model contour indices that should be considered to find the closest corresponding 3D vertex.
- * @param[in] mesh The mesh that's projected to find the nearest contour vertex.
+ * @param[in] vertices The vertices of the mesh that's projected to find the nearest contour vertex.
  * @param[in] view_model Model-view matrix of the current fitting to project the 3D model vertices to 2D.
  * @param[in] ortho_projection Projection matrix to project the 3D model vertices to 2D.
  * @param[in] viewport Current viewport to use.
  * @return A tuple with the 2D contour landmark points, the corresponding points in the 3D shape model and their vertex indices.
  */
-inline std::tuple<std::vector<cv::Vec2f>, std::vector<cv::Vec4f>, std::vector<int>> get_nearest_contour_correspondences(const core::LandmarkCollection<cv::Vec2f>& landmarks, const std::vector<std::string>& landmark_contour_identifiers, const std::vector<int>& model_contour_indices, const core::Mesh& mesh, const glm::mat4x4& view_model, const glm::mat4x4& ortho_projection, const glm::vec4& viewport)
+inline std::tuple<std::vector<cv::Vec2f>, std::vector<cv::Vec4f>, std::vector<int>> get_nearest_contour_correspondences(const core::LandmarkCollection<cv::Vec2f>& landmarks, const std::vector<std::string>& landmark_contour_identifiers, const std::vector<int>& model_contour_indices, const core::VertexView& vertices, const glm::mat4x4& view_model, const glm::mat4x4& ortho_projection, const glm::vec4& viewport)
 {
 	// These are the additional contour-correspondences we're going to find and then use!
 	std::vector<cv::Vec4f> model_points_cnt; // the points in the 3D shape model
 	std::vector<int> vertex_indices_cnt; // their vertex indices
 	std::vector<cv::Vec2f> image_points_cnt; // the corresponding 2D landmark points
+	if (model_contour_indices.empty()) {
+		return std::make_tuple(image_points_cnt, model_points_cnt, vertex_indices_cnt);
+	}
+
+	// The model contour vertices are only projected once, not for each landmark:
+	Eigen::ArrayXf projected_x, projected_y;
+	detail::project_vertices(model_contour_indices, vertices, view_model, ortho_projection, viewport, projected_x, projected_y);
 
 	// For each 2D-CNT-LM, find the closest 3DMM-CNT-LM and add to correspondences:
 	// Note: If we were to do this for all 3DMM vertices, then ray-casting (i.e. glm::unproject) would be quicker to find the closest vertex)
@@ -287,25 +359,16 @@ inline std::tuple<std::vector<cv::Vec2f>, std::vector<cv::Vec4f>, std::vector<in
 		// Check if the contour landmark is amongst the landmarks given to us (from detector or ground truth):
 		// (Note: Alternatively, we could filter landmarks beforehand and then just loop over landmarks => means one less function param here. Separate filtering from actual algorithm.)
 		auto result = std::find_if(begin(landmarks), end(landmarks), [&ibug_idx](auto&& e) { return e.name == ibug_idx; }); // => this can go outside the loop
-		// TODO Check for ::end!!! if it's not found!
+		if (result == end(landmarks)) {
+			continue;
+		}
 		cv::Vec2f screen_point_2d_contour_landmark = result->coordinates;
 
-		std::vector<float> distances_2d;
-		for (auto&& model_contour_vertex_idx : model_contour_indices) // we could actually pre-project them, i.e. only project them once, not for each landmark newly...
-		{
-			auto vertex = mesh.vertices[model_contour_vertex_idx];
-			glm::vec3 proj = glm::project(glm::vec3(vertex), view_model, ortho_projection, viewport);
-			cv::Vec2f screen_point_model_contour(proj.x, proj.y);
-
-			double dist = cv::norm(screen_point_model_contour, screen_point_2d_contour_landmark, cv::NORM_L2);
-			distances_2d.emplace_back(dist);
-		}
-		auto min_ele = std::min_element(begin(distances_2d), end(distances_2d));
-		// Todo: Cover the case when cnt_indices_to_use.size() is 0.
-		auto min_ele_idx = std::distance(begin(distances_2d), min_ele);
+		const auto min_ele_idx = detail::find_nearest_projected_vertex(projected_x, projected_y, screen_point_2d_contour_landmark, 0, static_cast<int>(model_contour_indices.size()));
 		auto the_3dmm_vertex_id_that_is_closest = model_contour_indices[min_ele_idx];
 
-		cv::Vec4f vertex(mesh.vertices[the_3dmm_vertex_id_that_is_closest].x, mesh.vertices[the_3dmm_vertex_id_that_is_closest].y, mesh.vertices[the_3dmm_vertex_id_that_is_closest].z, mesh.vertices[the_3dmm_vertex_id_that_is_closest].w);
+		const auto closest_vertex = vertices[the_3dmm_vertex_id_that_is_closest];
+		cv::Vec4f vertex(closest_vertex.x, closest_vertex.y, closest_vertex.z, closest_vertex.w);
 		model_points_cnt.emplace_back(vertex);
 		vertex_indices_cnt.emplace_back(the_3dmm_vertex_id_that_is_closest);
 		image_points_cnt.emplace_back(screen_point_2d_contour_landmark);
@@ -314,6 +377,17 @@ inline std::tuple<std::vector<cv::Vec2f>, std::vector<cv::Vec4f>, std::vector<in
 	return std::make_tuple(image_points_cnt, model_points_cnt, vertex_indices_cnt);
 };
 
+/**
+ * Given a set of 2D image landmarks, finds the closest (in a L2 sense) 3D vertex
+ * from a list of vertices pre-defined in \p model_contour_indices.
+ *
+ * Same as the overload taking a core::VertexView, for a core::Mesh.
+ */
+inline std::tuple<std::vector<cv::Vec2f>, std::vector<cv::Vec4f>, std::vector<int>> get_nearest_contour_correspondences(const core::LandmarkCollection<cv::Vec2f>& landmarks, const std::vector<std::string>& landmark_contour_identifiers, const std::vector<int>& model_contour_indices, const core::Mesh& mesh, const glm::mat4x4& view_model, const glm::mat4x4& ortho_projection, const glm::vec4& viewport)
+{
+	return get_nearest_contour_correspondences(landmarks, landmark_contour_identifiers, model_contour_indices, core::VertexView(mesh.vertices), view_model, ortho_projection, viewport);
+};
+
 	} /* namespace fitting */
 } /* namespace eos */
 
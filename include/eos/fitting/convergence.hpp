@@ -0,0 +1,234 @@
+/*
+ * eos - A 3D Morphable Model fitting library written in modern C++11/14.
+ *
+ * File: include/eos/fitting/convergence.hpp
+ *
+ * Copyright 2016 Patrik Huber
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#ifndef CONVERGENCE_HPP_
+#define CONVERGENCE_HPP_
+
+#include "eos/core/Mesh.hpp"
+#include "eos/core/VertexView.hpp"
+#include "eos/fitting/RenderingParameters.hpp"
+
+#include "glm/gtc/quaternion.hpp"
+#include "glm/trigonometric.hpp"
+
+#include "opencv2/core/core.hpp"
+
+#include "boost/optional.hpp"
+
+#include <vector>
+#include <chrono>
+#include <atomic>
+#include <cmath>
+#include <algorithm>
+#include <cassert>
+
+namespace eos {
+	namespace fitting {
+
+/**
+ * @brief A stopping policy for the iterative (alternating) shape and pose fitting.
+ *
+ * The fitting is stopped early when, from one iteration to the next, all of the
+ * following changes are below their threshold: The change of the RMS landmark
+ * reprojection error, the change of the PCA shape coefficients, and the change of
+ * the pose of every image. Set a threshold to a negative value to never consider
+ * that part converged.
+ *
+ * The defaults are conservative - they stop when further iterations don't change
+ * the result visibly.
+ */
+struct ConvergenceCriterion
+{
+	float reprojection_error_change = 0.01f; ///< Change of the RMS landmark reprojection error, in pixels.
+	float shape_coefficients_change = 0.01f; ///< L2 norm of the change of the PCA shape coefficients (which are ~N(0, 1)).
+	float rotation_change = 0.1f; ///< Largest rotation change over all images, in degrees.
+	float translation_change = 0.1f; ///< Largest translation change over all images, in pixels.
+	int min_iterations = 2; ///< Run at least this many iterations before checking for convergence.
+};
+
+/**
+ * @brief Information about how an iterative fitting went.
+ */
+struct FittingStatistics
+{
+	int num_iterations = 0; ///< The number of iterations that were actually run.
+	bool converged = false; ///< Whether the fitting was stopped by the ConvergenceCriterion, instead of running all iterations.
+	float reprojection_error = 0.0f; ///< The final RMS reprojection error of all landmark correspondences, in pixels.
+	bool stopped = false; ///< Whether the fitting was stopped by a StopToken (deadline or cancellation), before num_iterations or convergence were reached.
+};
+
+/**
+ * @brief Stops an iterative fitting at a deadline, or when it is cancelled from
+ * another thread.
+ *
+ * The fitting checks the token between its stages, and then returns the estimate
+ * it has got so far. The token can be shared between the caller and the fitting,
+ * and cancel() can be called from any thread. The deadline has to be set before
+ * the fitting starts.
+ */
+class StopToken
+{
+public:
+	using Clock = std::chrono::steady_clock;
+
+	StopToken() = default;
+
+	/**
+	 * @param[in] deadline The time after which the fitting should stop.
+	 */
+	explicit StopToken(Clock::time_point deadline) : deadline(deadline)
+	{
+	};
+
+	StopToken(const StopToken&) = delete;
+	StopToken& operator=(const StopToken&) = delete;
+
+	/**
+	 * Requests the fitting to stop as soon as possible. Thread-safe.
+	 */
+	void cancel()
+	{
+		cancelled.store(true, std::memory_order_relaxed);
+	};
+
+	bool is_cancelled() const
+	{
+		return cancelled.load(std::memory_order_relaxed);
+	};
+
+	void set_deadline(Clock::time_point deadline)
+	{
+		this->deadline = deadline;
+	};
+
+	boost::optional<Clock::time_point> get_deadline() const
+	{
+		return deadline;
+	};
+
+	/**
+	 * Returns whether the fitting should stop, because it was cancelled or the deadline has passed.
+	 */
+	bool should_stop() const
+	{
+		return is_cancelled() || (deadline && Clock::now() >= deadline.get());
+	};
+
+private:
+	std::atomic<bool> cancelled{ false };
+	boost::optional<Clock::time_point> deadline;
+};
+
+/**
+ * @brief Computes the root-mean-square reprojection error over all given 2D-3D
+ * correspondences of one or more images.
+ *
+ * The vertices \p vertex_indices[j] of \p meshes[j] are projected with the
+ * 3x4 affine camera matrix \p affine_camera_matrices[j] (CV_32FC1, e.g. from
+ * get_3x4_affine_camera_matrix()) and compared to \p image_points[j].
+ *
+ * @param[in] affine_camera_matrices A 3x4 affine camera matrix for each image.
+ * @param[in] meshes The vertices of the mesh of each image.
+ * @param[in] image_points The 2D landmarks of each image.
+ * @param[in] vertex_indices The vertex indices corresponding to the 2D landmarks, for each image.
+ * @return The RMS reprojection error in pixels, or 0 if there are no correspondences.
+ */
+inline float compute_reprojection_error(const std::vector<cv::Mat>& affine_camera_matrices, const std::vector<core::VertexView>& meshes, const std::vector<std::vector<cv::Vec2f>>& image_points, const std::vector<std::vector<int>>& vertex_indices)
+{
+	assert(affine_camera_matrices.size() == meshes.size() && meshes.size() == image_points.size() && image_points.size() == vertex_indices.size());
+	double sum_of_squares = 0.0;
+	std::size_t num_points = 0;
+	for (std::size_t j = 0; j < meshes.size(); ++j)
+	{
+		assert(image_points[j].size() == vertex_indices[j].size());
+		const cv::Mat& P = affine_camera_matrices[j];
+		for (std::size_t i = 0; i < vertex_indices[j].size(); ++i)
+		{
+			const auto v = meshes[j][vertex_indices[j][i]];
+			const float x = P.at<float>(0, 0) * v.x + P.at<float>(0, 1) * v.y + P.at<float>(0, 2) * v.z + P.at<float>(0, 3);
+			const float y = P.at<float>(1, 0) * v.x + P.at<float>(1, 1) * v.y + P.at<float>(1, 2) * v.z + P.at<float>(1, 3);
+			const float dx = x - image_points[j][i][0];
+			const float dy = y - image_points[j][i][1];
+			sum_of_squares += dx * dx + dy * dy;
+		}
+		num_points += vertex_indices[j].size();
+	}
+	if (num_points == 0) {
+		return 0.0f;
+	}
+	return static_cast<float>(std::sqrt(sum_of_squares / num_points));
+};
+
+/**
+ * @brief Computes the root-mean-square reprojection error over all given 2D-3D
+ * correspondences of one or more images.
+ *
+ * Same as the overload taking a core::VertexView for each image, for core::Mesh's.
+ */
+inline float compute_reprojection_error(const std::vector<cv::Mat>& affine_camera_matrices, const std::vector<core::Mesh>& meshes, const std::vector<std::vector<cv::Vec2f>>& image_points, const std::vector<std::vector<int>>& vertex_indices)
+{
+	std::vector<core::VertexView> vertices;
+	vertices.reserve(meshes.size());
+	for (const auto& mesh : meshes) {
+		vertices.emplace_back(mesh.vertices);
+	}
+	return compute_reprojection_error(affine_camera_matrices, vertices, image_points, vertex_indices);
+};
+
+/**
+ * @brief Returns the angle, in degrees, of the rotation between two poses.
+ *
+ * @param[in] from The first pose.
+ * @param[in] to The second pose.
+ * @return The rotation angle between the two poses, in degrees.
+ */
+inline float rotation_difference(const fitting::RenderingParameters& from, const fitting::RenderingParameters& to)
+{
+	const glm::quat difference = glm::inverse(from.get_rotation()) * to.get_rotation();
+	const float w = std::min(1.0f, std::abs(difference.w)); // q and -q are the same rotation
+	return glm::degrees(2.0f * std::acos(w));
+};
+
+/**
+ * @brief Returns the change of the translation, in pixels, between two
+ * orthographic poses.
+ *
+ * The translation of an orthographic RenderingParameters is in model units.
+ * It is converted to pixels with the scale of each pose.
+ *
+ * @param[in] from The first pose.
+ * @param[in] to The second pose.
+ * @return The length of the translation change, in pixels.
+ */
+inline float translation_difference(const fitting::RenderingParameters& from, const fitting::RenderingParameters& to)
+{
+	assert(from.get_camera_type() == fitting::CameraType::Orthographic && to.get_camera_type() == fitting::CameraType::Orthographic);
+	const float from_scale = from.get_screen_width() / from.get_frustum().r;
+	const float to_scale = to.get_screen_width() / to.get_frustum().r;
+	const float dx = to.get_t_x() * to_scale - from.get_t_x() * from_scale;
+	const float dy = to.get_t_y() * to_scale - from.get_t_y() * from_scale;
+	return std::sqrt(dx * dx + dy * dy);
+};
+
+	} /* namespace fitting */
+} /* namespace eos */
+
+#endif /* CONVERGENCE_HPP_ */
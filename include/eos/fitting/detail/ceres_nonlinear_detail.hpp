@@ -0,0 +1,218 @@
+/*
+ * eos - A 3D Morphable Model fitting library written in modern C++11/14.
+ *
+ * File: include/eos/fitting/detail/ceres_nonlinear_detail.hpp
+ *
+ * Copyright 2017 Patrik Huber
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#ifndef CERESNONLINEAR_DETAIL_HPP_
+#define CERESNONLINEAR_DETAIL_HPP_
+
+#include "eos/morphablemodel/PcaModel.hpp"
+#include "eos/morphablemodel/Blendshape.hpp"
+
+#include "Eigen/Core"
+
+#include <array>
+#include <vector>
+#include <cmath>
+#include <cstddef>
+#include <string>
+#include <stdexcept>
+
+/**
+ * Implementations of internal functions, not part of the
+ * API we expose and not meant to be used by a user.
+ *
+ * This file contains the per-vertex model data of the Ceres cost functions,
+ * and the projection and its derivatives, for the cost functions with
+ * analytic Jacobians.
+ */
+namespace eos {
+	namespace fitting {
+		namespace detail {
+
+/**
+ * The part of a PCA model and a set of blendshapes that belongs to one vertex:
+ * Its mean, and its three rows of the rescaled PCA basis, followed by the three
+ * rows of the blendshapes, as one contiguous 3 x (K + B) block.
+ *
+ * The cost functions copy this once on construction, so that evaluating the
+ * vertex is three small dense dot products, instead of reads from the columns
+ * of the whole basis and from every blendshape.
+ */
+struct VertexBasis
+{
+	Eigen::Vector3d mean;
+	Eigen::Matrix<double, 3, Eigen::Dynamic, Eigen::RowMajor> basis; ///< K PCA basis columns, followed by B blendshape columns.
+	int num_coefficients; ///< K, the number of PCA coefficients.
+
+	int num_blendshapes() const
+	{
+		return static_cast<int>(basis.cols()) - num_coefficients;
+	};
+
+	/**
+	 * Computes mean + basis * [coefficients blendshape_coefficients].
+	 *
+	 * @param[in] coefficients The K PCA coefficients.
+	 * @param[in] blendshape_coefficients The B blendshape coefficients. Not accessed if B = 0.
+	 * @return The 3D point (or colour) of the vertex.
+	 */
+	template <typename T>
+	std::array<T, 3> evaluate(const T* const coefficients, const T* const blendshape_coefficients) const
+	{
+		const int num_blendshapes = this->num_blendshapes();
+		std::array<T, 3> point;
+		for (int r = 0; r < 3; ++r)
+		{
+			const double* const row = basis.data() + r * basis.cols(); // row-major, so the row is contiguous
+			T value = T(mean[r]);
+			for (int i = 0; i < num_coefficients; ++i) {
+				value += row[i] * coefficients[i];
+			}
+			for (int i = 0; i < num_blendshapes; ++i) {
+				value += row[num_coefficients + i] * blendshape_coefficients[i];
+			}
+			point[r] = value;
+		}
+		return point;
+	};
+};
+
+/**
+ * Copies the mean and basis rows of one vertex of a model and of the blendshapes.
+ *
+ * @param[in] model A PCA model.
+ * @param[in] blendshapes A set of blendshapes. Can be empty.
+ * @param[in] vertex_id The vertex.
+ * @param[in] num_coefficients The number of PCA coefficients that are fitted.
+ * @return The rows of the vertex.
+ * @throws std::runtime_error if the model has fewer than \c num_coefficients principal components.
+ */
+inline VertexBasis get_vertex_basis(const morphablemodel::PcaModel& model, const std::vector<morphablemodel::Blendshape>& blendshapes, int vertex_id, int num_coefficients)
+{
+	if (num_coefficients < 0 || num_coefficients > model.get_num_principal_components())
+	{
+		throw std::runtime_error("Cannot fit " + std::to_string(num_coefficients) + " coefficients, the model has " + std::to_string(model.get_num_principal_components()) + " principal components.");
+	}
+	const int row = 3 * vertex_id;
+	VertexBasis vertex_basis;
+	vertex_basis.num_coefficients = num_coefficients;
+	vertex_basis.mean = model.get_mean().segment<3>(row).cast<double>();
+	vertex_basis.basis.resize(3, num_coefficients + static_cast<int>(blendshapes.size()));
+	vertex_basis.basis.leftCols(num_coefficients) = model.get_rescaled_pca_basis().block(row, 0, 3, num_coefficients).cast<double>();
+	for (std::size_t i = 0; i < blendshapes.size(); ++i)
+	{
+		vertex_basis.basis.col(num_coefficients + i) = blendshapes[i].deformation.segment<3>(row).cast<double>();
+	}
+	return vertex_basis;
+};
+
+/**
+ * Rotates a point with the rotation matrix of a quaternion, exactly like
+ * glm::mat4_cast() does, and computes the derivatives.
+ *
+ * The derivatives are those of glm's matrix formula, i.e. the quaternion is
+ * not normalised, which matches the autodiff cost functions.
+ *
+ * @param[in] quaternion The rotation, as quaternion [w x y z].
+ * @param[in] point The point to rotate.
+ * @param[out] rotation The 3x3 rotation matrix, i.e. the derivative of the rotated point w.r.t. the point.
+ * @param[out] d_rotated_point_d_quaternion The derivative of the rotated point w.r.t. [w x y z].
+ * @return The rotated point.
+ */
+inline Eigen::Vector3d rotate_point(const double* const quaternion, const Eigen::Vector3d& point, Eigen::Matrix3d& rotation, Eigen::Matrix<double, 3, 4>& d_rotated_point_d_quaternion)
+{
+	const double w = quaternion[0];
+	const double x = quaternion[1];
+	const double y = quaternion[2];
+	const double z = quaternion[3];
+	rotation << 1.0 - 2.0 * (y * y + z * z), 2.0 * (x * y - w * z), 2.0 * (x * z + w * y),
+		2.0 * (x * y + w * z), 1.0 - 2.0 * (x * x + z * z), 2.0 * (y * z - w * x),
+		2.0 * (x * z - w * y), 2.0 * (y * z + w * x), 1.0 - 2.0 * (x * x + y * y);
+
+	const double p0 = point[0];
+	const double p1 = point[1];
+	const double p2 = point[2];
+	d_rotated_point_d_quaternion <<
+		2.0 * (-z * p1 + y * p2), 2.0 * (y * p1 + z * p2), 2.0 * (-2.0 * y * p0 + x * p1 + w * p2), 2.0 * (-2.0 * z * p0 - w * p1 + x * p2),
+		2.0 * (z * p0 - x * p2), 2.0 * (y * p0 - 2.0 * x * p1 - w * p2), 2.0 * (x * p0 + z * p2), 2.0 * (w * p0 - 2.0 * z * p1 + y * p2),
+		2.0 * (-y * p0 + x * p1), 2.0 * (z * p0 + w * p1 - 2.0 * x * p2), 2.0 * (-w * p0 + z * p1 - 2.0 * y * p2), 2.0 * (x * p0 + y * p1);
+
+	return rotation * point;
+};
+
+/**
+ * Projects a rotated point to the image, exactly like the autodiff cost functions
+ * do with glm::translate(), glm::ortho() or glm::perspective() and glm::project()
+ * (with an OpenCV viewport, origin top-left), and computes the derivatives.
+ *
+ * Ortho: u = w/2 + h/2 * e_x / s, v = h/2 - h/2 * e_y / s, with the frustum scale s.
+ * Perspective: u = w/2 + h/2 * f * e_x / -e_z, v = h/2 - h/2 * f * e_y / -e_z, with f = 1 / tan(fov/2).
+ * e is the rotated point plus the translation.
+ *
+ * @param[in] camera_translation_and_intrinsics Ortho: [t_x t_y frustum_scale]. Perspective: [t_x t_y t_z fov].
+ * @param[in] rotated_point The point, rotated with the camera rotation.
+ * @param[in] image_width Width of the image.
+ * @param[in] image_height Height of the image.
+ * @param[in] use_perspective Whether a perspective or an orthographic projection is used.
+ * @param[out] d_projected_d_point The derivative of the projected point w.r.t. the rotated point.
+ * @param[out] d_projected_d_camera The derivative of the projected point w.r.t. the camera parameters. The last column is unused for ortho.
+ * @return The projected point [u v], in pixels.
+ */
+inline Eigen::Vector2d project_point(const double* const camera_translation_and_intrinsics, const Eigen::Vector3d& rotated_point, int image_width, int image_height, bool use_perspective, Eigen::Matrix<double, 2, 3>& d_projected_d_point, Eigen::Matrix<double, 2, 4>& d_projected_d_camera)
+{
+	const double half_width = image_width / 2.0;
+	const double half_height = image_height / 2.0;
+	d_projected_d_camera.setZero();
+	if (use_perspective)
+	{
+		const Eigen::Vector3d eye = rotated_point + Eigen::Vector3d(camera_translation_and_intrinsics[0], camera_translation_and_intrinsics[1], camera_translation_and_intrinsics[2]);
+		const double fov = camera_translation_and_intrinsics[3];
+		const double tan_half_fov = std::tan(fov / 2.0);
+		const double focal = 1.0 / tan_half_fov;
+		const double d_focal_d_fov = -0.5 * (1.0 + tan_half_fov * tan_half_fov) / (tan_half_fov * tan_half_fov);
+		const double one_over_depth = 1.0 / -eye[2];
+		const double g = half_height * focal * one_over_depth;
+		d_projected_d_point << g, 0.0, g * eye[0] * one_over_depth,
+			0.0, -g, -g * eye[1] * one_over_depth;
+		d_projected_d_camera.leftCols<3>() = d_projected_d_point;
+		d_projected_d_camera(0, 3) = half_height * eye[0] * one_over_depth * d_focal_d_fov;
+		d_projected_d_camera(1, 3) = -half_height * eye[1] * one_over_depth * d_focal_d_fov;
+		return Eigen::Vector2d(half_width + g * eye[0], half_height - g * eye[1]);
+	}
+	else {
+		const double eye_x = rotated_point[0] + camera_translation_and_intrinsics[0];
+		const double eye_y = rotated_point[1] + camera_translation_and_intrinsics[1];
+		const double one_over_scale = 1.0 / camera_translation_and_intrinsics[2];
+		const double g = half_height * one_over_scale;
+		d_projected_d_point << g, 0.0, 0.0,
+			0.0, -g, 0.0;
+		d_projected_d_camera(0, 0) = g;
+		d_projected_d_camera(1, 1) = -g;
+		d_projected_d_camera(0, 2) = -g * eye_x * one_over_scale;
+		d_projected_d_camera(1, 2) = g * eye_y * one_over_scale;
+		return Eigen::Vector2d(half_width + g * eye_x, half_height - g * eye_y);
+	}
+};
+
+		} /* namespace detail */
+	} /* namespace fitting */
+} /* namespace eos */
+
+#endif /* CERESNONLINEAR_DETAIL_HPP_ */
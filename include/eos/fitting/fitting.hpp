@@ -25,6 +25,9 @@
 #include "eos/core/Landmark.hpp"
 #include "eos/core/LandmarkMapper.hpp"
 #include "eos/core/Mesh.hpp"
+#include "eos/core/ThreadPool.hpp"
+#include "eos/core/Trace.hpp"
+#include "eos/core/VertexView.hpp"
 #include "eos/morphablemodel/MorphableModel.hpp"
 #include "eos/morphablemodel/Blendshape.hpp"
 #include "eos/morphablemodel/EdgeTopology.hpp"
@@ -34,6 +37,9 @@
 #include "eos/fitting/contour_correspondence.hpp"
 #include "eos/fitting/closest_edge_fitting.hpp"
 #include "eos/fitting/RenderingParameters.hpp"
+#include "eos/fitting/FittingWorkspace.hpp"
+#include "eos/fitting/LandmarkIndexPlan.hpp"
+#include "eos/fitting/convergence.hpp"
 
 #include "opencv2/core/core.hpp"
 
@@ -269,7 +275,23 @@ inline auto concat(const std::vector<T>& vec_a, const std::vector<T>& vec_b)
  * \p edge_topology is used for the occluding-edge face contour fitting.
  * \p contour_landmarks and \p model_contour are used to fit the front-facing contour.
  *
- * Todo: Add a convergence criterion.
+ * If a \p convergence_criterion is given, the fitting stops as soon as the reprojection error,
+ * the shape coefficients and the poses don't change anymore, so \p num_iterations can be set to
+ * a high maximum without paying for it on easy images.
+ *
+ * The steps that are independent for each image (the contour and occluding-edge correspondences,
+ * the pose estimation and the blendshape fitting) can be run in parallel on a \p thread_pool. Only
+ * the shape fitting is joint over all images. The result is the same as when run serially.
+ *
+ * If a \p stop_token is given, the fitting checks it before each iteration, and again before the
+ * shape fitting. When it has been cancelled or its deadline has passed, the fitting stops and
+ * returns the estimate so far, i.e. the poses of the current iteration with the shapes of the
+ * previous one (or of the initial pose and expression fit). statistics.num_iterations is then the
+ * number of completed iterations, and statistics.stopped is set.
+ *
+ * If a \p trace_sink is given, it receives the time of each stage (the correspondence search,
+ * the contour and occluding-edge fitting, the pose estimation, the shape and the blendshape
+ * fitting) and the number of correspondences found in each iteration.
  *
  * @param[in] morphable_model The 3D Morphable Model used for the shape fitting.
  * @param[in] blendshapes A vector of blendshapes that are being fit to the landmarks in addition to the PCA model.
@@ -280,16 +302,22 @@ inline auto concat(const std::vector<T>& vec_a, const std::vector<T>& vec_b)
  * @param[in] edge_topology Precomputed edge topology of the 3D model, needed for fast edge-lookup.
  * @param[in] contour_landmarks 2D image contour ids of left or right side (for example for ibug landmarks).
  * @param[in] model_contour The model contour indices that should be considered to find the closest corresponding 3D vertex.
- * @param[in] num_iterations Number of iterations that the different fitting parts will be alternated for.
+ * @param[in] num_iterations Number of iterations that the different fitting parts will be alternated for. The maximum number of iterations, if a convergence criterion is given.
  * @param[in] num_shape_coefficients_to_fit How many shape-coefficients to fit (all others will stay 0). Should be bigger than zero, or boost::none to fit all coefficients.
  * @param[in] lambda Regularisation parameter of the PCA shape fitting.
  * @param[in] initial_rendering_params Currently ignored (not used).
  * @param[in,out] pca_shape_coefficients If given, will be used as initial PCA shape coefficients to start the fitting. Will contain the final estimated coefficients.
  * @param[in,out] blendshape_coefficients If given, will be used as initial expression blendshape coefficients to start the fitting. Will contain the final estimated coefficients.
  * @param[out] fitted_image_points Debug parameter: Returns all the 2D points that have been used for the fitting.
+ * @param[in,out] workspace Buffers for all intermediate results, which can be reused across calls (see FittingWorkspace).
+ * @param[in] convergence_criterion When to stop the fitting before \p num_iterations are reached, or boost::none to always run all iterations.
+ * @param[out] statistics Returns the number of iterations run and the final reprojection error.
+ * @param[in] thread_pool If given, the per-image steps of each iteration are run in parallel on this pool. nullptr to run them serially.
+ * @param[in] trace_sink If given, receives the timings of the stages and a few counters (see core::TraceSink).
+ * @param[in] stop_token If given, the fitting stops early when it is cancelled or at its deadline.
  * @return The fitted model shape instance and the final pose.
  */
-inline std::pair<std::vector<core::Mesh>, std::vector<fitting::RenderingParameters>> fit_shape_and_pose_multi(const morphablemodel::MorphableModel& morphable_model, const std::vector<morphablemodel::Blendshape>& blendshapes, const std::vector<core::LandmarkCollection<cv::Vec2f>>& landmarks, const core::LandmarkMapper& landmark_mapper, std::vector<int> image_width, std::vector<int> image_height, const morphablemodel::EdgeTopology& edge_topology, const fitting::ContourLandmarks& contour_landmarks, const fitting::ModelContour& model_contour, int num_iterations, boost::optional<int> num_shape_coefficients_to_fit, float lambda, boost::optional<fitting::RenderingParameters> initial_rendering_params, std::vector<float>& pca_shape_coefficients, std::vector<std::vector<float>>& blendshape_coefficients, std::vector<std::vector<cv::Vec2f>>& fitted_image_points)
+inline std::pair<std::vector<core::Mesh>, std::vector<fitting::RenderingParameters>> fit_shape_and_pose_multi(const morphablemodel::MorphableModel& morphable_model, const std::vector<morphablemodel::Blendshape>& blendshapes, const std::vector<core::LandmarkCollection<cv::Vec2f>>& landmarks, const core::LandmarkMapper& landmark_mapper, std::vector<int> image_width, std::vector<int> image_height, const morphablemodel::EdgeTopology& edge_topology, const fitting::ContourLandmarks& contour_landmarks, const fitting::ModelContour& model_contour, int num_iterations, boost::optional<int> num_shape_coefficients_to_fit, float lambda, boost::optional<fitting::RenderingParameters> initial_rendering_params, std::vector<float>& pca_shape_coefficients, std::vector<std::vector<float>>& blendshape_coefficients, std::vector<std::vector<cv::Vec2f>>& fitted_image_points, FittingWorkspace& workspace, const boost::optional<ConvergenceCriterion>& convergence_criterion, FittingStatistics& statistics, core::ThreadPool* thread_pool, core::TraceSink* trace_sink = nullptr, const StopToken* stop_token = nullptr)
 {
     assert(blendshapes.size() > 0);
     assert(landmarks.size() > 0 && landmarks.size() == image_width.size() && image_width.size() == image_height.size());
@@ -309,6 +337,7 @@ inline std::pair<std::vector<core::Mesh>, std::vector<fitting::RenderingParamete
 	using Eigen::VectorXf;
 	using Eigen::MatrixXf;
 
+    core::ScopedTrace trace_fitting(trace_sink, "fit_shape_and_pose_multi");
 
 	if (!num_shape_coefficients_to_fit)
 	{
@@ -331,140 +360,272 @@ inline std::pair<std::vector<core::Mesh>, std::vector<fitting::RenderingParamete
         }
     }
 
-    MatrixXf blendshapes_as_basis = morphablemodel::to_matrix(blendshapes);
-
-    // Current mesh - either from the given coefficients, or the mean:
-    VectorXf current_pca_shape = morphable_model.get_shape_model().draw_sample(pca_shape_coefficients);
-    vector<VectorXf> current_combined_shapes;
-    vector<eos::core::Mesh> current_meshs;
+    workspace.prepare(morphable_model, blendshapes, edge_topology, num_images);
+    const MatrixXf& blendshapes_as_basis = workspace.blendshapes_as_basis;
+    const auto shape_mean = morphable_model.get_shape_model().get_mean();
+
+    // Computes the PCA shape of the current coefficients into the workspace, without allocating:
+    const auto update_pca_shape = [&]() {
+        const auto& basis = morphable_model.get_shape_model().get_rescaled_pca_basis();
+        workspace.pca_shape = shape_mean;
+        workspace.pca_shape.noalias() += basis.leftCols(pca_shape_coefficients.size()) * Eigen::Map<const VectorXf>(pca_shape_coefficients.data(), pca_shape_coefficients.size());
+    };
+    // Adds the blendshapes of image j to the current PCA shape. The iterations work on these shape
+    // vectors directly (through a VertexView), the meshes are only updated once at the end:
+    const auto update_combined_shape = [&](int j) {
+        workspace.combined_shapes[j] = workspace.pca_shape;
+        workspace.combined_shapes[j].noalias() += blendshapes_as_basis * Eigen::Map<const VectorXf>(blendshape_coefficients[j].data(), blendshape_coefficients[j].size());
+    };
+    // Computes the PCA shape at the current correspondences of image j, which is all the blendshape fitting needs:
+    const auto update_pca_shape_at_landmarks = [&](int j) {
+        const auto& subspace = workspace.landmark_subspaces[j];
+        workspace.pca_shape_at_landmarks[j] = subspace.get_mean();
+        workspace.pca_shape_at_landmarks[j].noalias() += subspace.get_rescaled_pca_basis().leftCols(pca_shape_coefficients.size()) * Eigen::Map<const VectorXf>(pca_shape_coefficients.data(), pca_shape_coefficients.size());
+    };
+
+    // Runs body(j) for every image, in parallel if we've been given a thread pool. Each body
+    // only writes to the buffers of its own image, so the result doesn't depend on the scheduling:
+    const auto for_each_image = [&](const auto& body) {
+        if (thread_pool) {
+            thread_pool->parallel_for(0, num_images, [&](int j, int) { body(j); });
+        } else {
+            for (int j = 0; j < num_images; ++j) {
+                body(j);
+            }
+        }
+    };
+
+    // Current shape - either from the given coefficients, or the mean:
+    update_pca_shape();
+    for_each_image(update_combined_shape);
+    // The shapes keep their size from now on, so the views of them stay valid:
+    vector<core::VertexView>& current_shapes = workspace.shape_views;
+    current_shapes.clear();
     for (int j = 0; j < num_images; ++j) {
-        VectorXf current_combined_shape = current_pca_shape + blendshapes_as_basis * Eigen::Map<const Eigen::VectorXf>(blendshape_coefficients[j].data(), blendshape_coefficients[j].size());
-        current_combined_shapes.push_back(current_combined_shape);
-
-        eos::core::Mesh current_mesh = morphablemodel::sample_to_mesh(current_combined_shape, morphable_model.get_color_model().get_mean(), morphable_model.get_shape_model().get_triangle_list(), morphable_model.get_color_model().get_triangle_list(), morphable_model.get_texture_coordinates());
-        current_meshs.push_back(current_mesh);
+        current_shapes.emplace_back(workspace.combined_shapes[j].data(), static_cast<int>(workspace.combined_shapes[j].size() / 3));
     }
 
     // The 2D and 3D point correspondences used for the fitting:
-    vector<vector<Vec4f>> model_points; // the points in the 3D shape model of all frames
-    vector<vector<int>> vertex_indices; // their vertex indices of all frames
-    vector<vector<Vec2f>> image_points; // the corresponding 2D landmark points of all frames
-
-    for (int j = 0; j < num_images; ++j) {
-        vector<Vec4f> current_model_points;
-        vector<int> current_vertex_indices;
-        vector<Vec2f> current_image_points;
-
+    vector<vector<Vec4f>>& model_points = workspace.model_points; // the points in the 3D shape model of all frames
+    vector<vector<int>>& vertex_indices = workspace.vertex_indices; // their vertex indices of all frames
+    vector<vector<Vec2f>>& image_points = workspace.image_points; // the corresponding 2D landmark points of all frames
+    vector<core::Mesh>& current_meshs = workspace.meshes;
+    vector<fitting::RenderingParameters>& rendering_params = workspace.rendering_params;
+
+    // The landmark names are only mapped to vertex indices when the landmark scheme changes (i.e.
+    // usually once, for a reused workspace). From then on, the correspondences are built by indexing:
+    vector<fitting::LandmarkIndexPlan>& landmark_plans = workspace.landmark_plans;
+    for_each_image([&](int j) {
+        core::ScopedTrace trace(trace_sink, "landmark_correspondences");
+        if (!landmark_plans[j].is_compiled_for(landmarks[j], landmark_mapper, contour_landmarks)) {
+            landmark_plans[j] = fitting::LandmarkIndexPlan(landmarks[j], landmark_mapper, contour_landmarks);
+        }
         // Sub-select all the landmarks which we have a mapping for (i.e. that are defined in the 3DMM),
         // and get the corresponding model points (mean if given no initial coeffs, from the computed shape otherwise):
-        for (int i = 0; i < landmarks[j].size(); ++i) {
-            auto converted_name = landmark_mapper.convert(landmarks[j][i].name);
-            if (!converted_name) { // no mapping defined for the current landmark
-                continue;
-            }
-            int vertex_idx = std::stoi(converted_name.get());
-            Vec4f vertex(current_meshs[j].vertices[vertex_idx].x, current_meshs[j].vertices[vertex_idx].y, current_meshs[j].vertices[vertex_idx].z, current_meshs[j].vertices[vertex_idx].w);
-            current_model_points.emplace_back(vertex);
-            current_vertex_indices.emplace_back(vertex_idx);
-            current_image_points.emplace_back(landmarks[j][i].coordinates);
-        }
-
-        model_points.push_back(current_model_points);
-        vertex_indices.push_back(current_vertex_indices);
-        image_points.push_back(current_image_points);
-    }
+        fitting::get_corresponding_pointset(landmarks[j], landmark_plans[j], current_shapes[j], image_points[j], model_points[j], vertex_indices[j]);
+    });
 
     // Need to do an initial pose fit to do the contour fitting inside the loop.
     // We'll do an expression fit too, since face shapes vary quite a lot, depending on expressions.
-    vector<fitting::RenderingParameters> rendering_params;
-    for (int j = 0; j < num_images; ++j) {
+    for_each_image([&](int j) {
+        core::ScopedTrace trace(trace_sink, "initial_pose_and_expression");
         fitting::ScaledOrthoProjectionParameters current_pose = fitting::estimate_orthographic_projection_linear(image_points[j], model_points[j], true, image_height[j]);
-        fitting::RenderingParameters current_rendering_params(current_pose, image_width[j], image_height[j]);
-        rendering_params.push_back(current_rendering_params);
+        rendering_params[j] = fitting::RenderingParameters(current_pose, image_width[j], image_height[j]);
 
-        cv::Mat affine_from_ortho = fitting::get_3x4_affine_camera_matrix(current_rendering_params, image_width[j], image_height[j]);
-        blendshape_coefficients[j] = fitting::fit_blendshapes_to_landmarks_nnls(blendshapes, current_pca_shape, affine_from_ortho, image_points[j], vertex_indices[j]);
+        fitting::get_3x4_affine_camera_matrix(rendering_params[j], image_width[j], image_height[j]).copyTo(workspace.affine_from_orthos[j]);
+        workspace.landmark_subspaces[j].update(morphable_model.get_shape_model(), blendshapes, vertex_indices[j]);
+        update_pca_shape_at_landmarks(j);
+        blendshape_coefficients[j] = fitting::fit_blendshapes_to_landmarks_nnls(workspace.landmark_subspaces[j], workspace.pca_shape_at_landmarks[j], workspace.affine_from_orthos[j], image_points[j]);
 
         // Mesh with same PCA coeffs as before, but new expression fit (this is relevant if no initial blendshape coeffs have been given):
-        current_combined_shapes[j] = current_pca_shape + morphablemodel::to_matrix(blendshapes) * Eigen::Map<const Eigen::VectorXf>(blendshape_coefficients[j].data(),blendshape_coefficients[j].size());
-        current_meshs[j] = morphablemodel::sample_to_mesh(current_combined_shapes[j], morphable_model.get_color_model().get_mean(), morphable_model.get_shape_model().get_triangle_list(), morphable_model.get_color_model().get_triangle_list(), morphable_model.get_texture_coordinates());
-    }
+        update_combined_shape(j);
+    });
 
     // The static (fixed) landmark correspondences which will stay the same throughout
     // the fitting (the inner face landmarks):
-    vector<vector<int>> fixed_vertex_indices (vertex_indices);
-    vector<vector<Vec2f>> fixed_image_points (image_points);
+    vector<vector<int>>& fixed_vertex_indices = workspace.fixed_vertex_indices;
+    vector<vector<Vec2f>>& fixed_image_points = workspace.fixed_image_points;
+    for (int j = 0; j < num_images; ++j) {
+        fixed_vertex_indices[j] = vertex_indices[j];
+        fixed_image_points[j] = image_points[j];
+    }
 
-    for (int i = 0; i < num_iterations; ++i)
-    {
-        std::vector<cv::Mat> affine_from_orthos;
-        std::vector<VectorXf> mean_plus_blendshapes;
+    // The trackers keep their buffers between iterations. They only update the occluding contour
+    // incrementally if the caller opted in with workspace.incremental_contours, since the shape
+    // changes in every iteration, which an incremental update doesn't notice:
+    vector<fitting::OccludingContourTracker>& contour_trackers = workspace.contour_trackers;
 
-        image_points = fixed_image_points;
-        vertex_indices = fixed_vertex_indices;
+    // The detected contour landmarks are constant throughout the fitting, so we build the kd-trees
+    // over the left and right contour of each image only once, and reuse them in every iteration:
+    vector<fitting::ImageEdgeIndex>& left_contour_edges = workspace.left_contour_edges;
+    vector<fitting::ImageEdgeIndex>& right_contour_edges = workspace.right_contour_edges;
+    for (int j = 0; j < num_images; ++j) {
+        left_contour_edges.emplace_back(fitting::get_landmark_points(landmarks[j], landmark_plans[j].get_left_contour()));
+        right_contour_edges.emplace_back(fitting::get_landmark_points(landmarks[j], landmark_plans[j].get_right_contour()));
+    }
 
+    statistics = FittingStatistics();
+    // Stops the fitting with the current estimate, if the stop token says so. The poses, shapes and
+    // correspondences are consistent at the points where this is checked:
+    const auto stop_requested = [&]() {
+        if (!stop_token || !stop_token->should_stop()) {
+            return false;
+        }
+        statistics.stopped = true;
+        statistics.reprojection_error = fitting::compute_reprojection_error(workspace.affine_from_orthos, current_shapes, image_points, vertex_indices);
+        return true;
+    };
+    float previous_reprojection_error = 0.0f;
+    for (int i = 0; i < num_iterations; ++i)
+    {
+        if (stop_requested()) {
+            break;
+        }
+        core::ScopedTrace trace_iteration(trace_sink, "iteration");
+        // Remember the previous estimates, to check for convergence at the end of the iteration:
+        workspace.previous_pca_shape_coefficients = pca_shape_coefficients;
         for (int j = 0; j < num_images; ++j) {
+            workspace.previous_rendering_params[j] = rendering_params[j];
+        }
 
-            // Given the current pose, find 2D-3D contour correspondences of the front-facing face contour:
-            vector<Vec2f> image_points_contour;
-            vector<int> vertex_indices_contour;
+        for_each_image([&](int j) {
+            // Copy-assigning keeps the capacity of the buffers from the previous iteration:
+            image_points[j] = fixed_image_points[j];
+            vertex_indices[j] = fixed_vertex_indices[j];
+
+            // Given the current pose, find 2D-3D contour correspondences of the front-facing face contour,
+            // and add them to the set of landmarks that we use for the fitting:
             auto yaw_angle = glm::degrees(glm::eulerAngles(rendering_params[j].get_rotation())[1]);
-            // For each 2D contour landmark, get the corresponding 3D vertex point and vertex id:
-            std::tie(image_points_contour, std::ignore, vertex_indices_contour) = fitting::get_contour_correspondences(landmarks[j], contour_landmarks, model_contour, yaw_angle, current_meshs[j], rendering_params[j].get_modelview(), rendering_params[j].get_projection(), fitting::get_opencv_viewport(image_width[j], image_height[j]));
-            // Add the contour correspondences to the set of landmarks that we use for the fitting:
-            vertex_indices[j] = fitting::concat(vertex_indices[j], vertex_indices_contour);
-            image_points[j] = fitting::concat(image_points[j], image_points_contour);
+            {
+                core::ScopedTrace trace(trace_sink, "contour_search");
+                workspace.contour_searches[j].find(landmarks[j], landmark_plans[j], model_contour, yaw_angle, current_shapes[j], rendering_params[j].get_modelview(), rendering_params[j].get_projection(), fitting::get_opencv_viewport(image_width[j], image_height[j]), image_points[j], vertex_indices[j]);
+                core::trace_counter(trace_sink, "contour_correspondences", static_cast<std::int64_t>(image_points[j].size() - fixed_image_points[j].size()));
+            }
 
             // Fit the occluding (away-facing) contour using the detected contour LMs:
-            vector<Eigen::Vector2f> occluding_contour_landmarks;
-            if (yaw_angle >= 0.0f) // positive yaw = subject looking to the left
-            { // the left contour is the occluding one we want to use ("away-facing")
-                auto contour_landmarks_ = core::filter(landmarks[j], contour_landmarks.left_contour); // Can do this outside of the loop
-                std::for_each(begin(contour_landmarks_), end(contour_landmarks_), [&occluding_contour_landmarks](auto&& lm) { occluding_contour_landmarks.push_back({ lm.coordinates[0], lm.coordinates[1] }); });
-            }
-            else {
-                auto contour_landmarks_ = core::filter(landmarks[j], contour_landmarks.right_contour);
-                std::for_each(begin(contour_landmarks_), end(contour_landmarks_), [&occluding_contour_landmarks](auto&& lm) { occluding_contour_landmarks.push_back({ lm.coordinates[0], lm.coordinates[1] }); });
+            // Positive yaw = subject looking to the left, so the left contour is the occluding one we want to use ("away-facing"):
+            {
+                core::ScopedTrace trace(trace_sink, "edge_fitting");
+                const auto& occluding_contour_edges = yaw_angle >= 0.0f ? left_contour_edges[j] : right_contour_edges[j];
+                if (!workspace.incremental_contours) {
+                    contour_trackers[j].reset(); // a full update, the same as occluding_boundary_vertices()
+                }
+                const auto occluding_vertices = contour_trackers[j].update(current_shapes[j], current_meshs[j].tvi, glm::mat4x4(rendering_params[j].get_rotation()));
+                auto edge_correspondences = fitting::find_edge_correspondences(current_shapes[j], occluding_vertices, rendering_params[j], occluding_contour_edges, 180.0f);
+                image_points[j].insert(std::end(image_points[j]), std::begin(edge_correspondences.first), std::end(edge_correspondences.first));
+                vertex_indices[j].insert(std::end(vertex_indices[j]), std::begin(edge_correspondences.second), std::end(edge_correspondences.second));
+                core::trace_counter(trace_sink, "occluding_vertices", static_cast<std::int64_t>(occluding_vertices.size()));
+                core::trace_counter(trace_sink, "edge_correspondences", static_cast<std::int64_t>(edge_correspondences.second.size()));
             }
-            auto edge_correspondences = fitting::find_occluding_edge_correspondences(current_meshs[j], edge_topology, rendering_params[j], occluding_contour_landmarks, 180.0f);
-            image_points[j] = fitting::concat(image_points[j], edge_correspondences.first);
-            vertex_indices[j] = fitting::concat(vertex_indices[j], edge_correspondences.second);
+            core::ScopedTrace trace(trace_sink, "pose_estimation");
 
             // Get the model points of the current mesh, for all correspondences that we've got:
             model_points[j].clear();
             for (const auto& v : vertex_indices[j])
             {
-                model_points[j].push_back({ current_meshs[j].vertices[v][0], current_meshs[j].vertices[v][1], current_meshs[j].vertices[v][2], current_meshs[j].vertices[v][3] });
+                const auto vertex = current_shapes[j][v];
+                model_points[j].push_back({ vertex.x, vertex.y, vertex.z, vertex.w });
             }
 
             // Re-estimate the pose, using all correspondences:
             fitting::ScaledOrthoProjectionParameters current_pose = fitting::estimate_orthographic_projection_linear(image_points[j], model_points[j], true, image_height[j]);
             rendering_params[j] = fitting::RenderingParameters(current_pose, image_width[j], image_height[j]);
 
-            cv::Mat affine_from_ortho = fitting::get_3x4_affine_camera_matrix(rendering_params[j], image_width[j], image_height[j]);
-            affine_from_orthos.push_back(affine_from_ortho);
+            fitting::get_3x4_affine_camera_matrix(rendering_params[j], image_width[j], image_height[j]).copyTo(workspace.affine_from_orthos[j]);
 
-            // Estimate the PCA shape coefficients with the current blendshape coefficients:
-            VectorXf current_mean_plus_blendshapes = morphable_model.get_shape_model().get_mean() + blendshapes_as_basis * Eigen::Map<const Eigen::VectorXf>(blendshape_coefficients[j].data(),blendshape_coefficients[j].size());
-            mean_plus_blendshapes.push_back(current_mean_plus_blendshapes);
-        }
-        pca_shape_coefficients = fitting::fit_shape_to_landmarks_linear_multi(morphable_model, affine_from_orthos, image_points, vertex_indices, mean_plus_blendshapes, lambda, num_shape_coefficients_to_fit);
+            // Only the rows of the contour and edge correspondences change, the fixed landmarks' rows stay cached:
+            workspace.landmark_subspaces[j].update(morphable_model.get_shape_model(), blendshapes, vertex_indices[j]);
 
-        // Estimate the blendshape coefficients with the current PCA model estimate:
-        current_pca_shape = morphable_model.get_shape_model().draw_sample(pca_shape_coefficients);
+            // Estimate the PCA shape coefficients with the current blendshape coefficients (we only need them at the correspondences):
+            const auto& subspace = workspace.landmark_subspaces[j];
+            workspace.mean_plus_blendshapes[j] = subspace.get_mean();
+            workspace.mean_plus_blendshapes[j].noalias() += subspace.get_blendshapes() * Eigen::Map<const VectorXf>(blendshape_coefficients[j].data(), blendshape_coefficients[j].size());
+        });
+        if (stop_requested()) {
+            break;
+        }
+        {
+            core::ScopedTrace trace(trace_sink, "shape_fitting");
+            pca_shape_coefficients = fitting::fit_shape_to_landmarks_linear_multi(workspace.landmark_subspaces, workspace.affine_from_orthos, image_points, workspace.mean_plus_blendshapes, lambda, num_shape_coefficients_to_fit);
 
-        for (int j = 0; j < num_images; ++j) {
-            blendshape_coefficients[j] = fitting::fit_blendshapes_to_landmarks_nnls(blendshapes, current_pca_shape, affine_from_orthos[j], image_points[j], vertex_indices[j]);
+            // Estimate the blendshape coefficients with the current PCA model estimate:
+            update_pca_shape();
+        }
 
-            current_combined_shapes[j] = current_pca_shape + blendshapes_as_basis * Eigen::Map<const Eigen::VectorXf>(blendshape_coefficients[j].data(),blendshape_coefficients[j].size());
-            current_meshs[j] = morphablemodel::sample_to_mesh(current_combined_shapes[j], morphable_model.get_color_model().get_mean(), morphable_model.get_shape_model().get_triangle_list(), morphable_model.get_color_model().get_triangle_list(), morphable_model.get_texture_coordinates());
+        for_each_image([&](int j) {
+            core::ScopedTrace trace(trace_sink, "blendshape_fitting");
+            update_pca_shape_at_landmarks(j);
+            blendshape_coefficients[j] = fitting::fit_blendshapes_to_landmarks_nnls(workspace.landmark_subspaces[j], workspace.pca_shape_at_landmarks[j], workspace.affine_from_orthos[j], image_points[j]);
+            update_combined_shape(j);
+        });
+
+        statistics.num_iterations = i + 1;
+        statistics.reprojection_error = fitting::compute_reprojection_error(workspace.affine_from_orthos, current_shapes, image_points, vertex_indices);
+
+        // Stop if nothing changes anymore. The first iteration compares against the initial pose fit, which
+        // didn't use the contour, so we only start checking once min_iterations have been run:
+        if (convergence_criterion && statistics.num_iterations >= std::max(convergence_criterion->min_iterations, 2))
+        {
+            float shape_coefficients_change_sq = 0.0f;
+            for (std::size_t k = 0; k < pca_shape_coefficients.size(); ++k) {
+                const float previous_coefficient = k < workspace.previous_pca_shape_coefficients.size() ? workspace.previous_pca_shape_coefficients[k] : 0.0f;
+                shape_coefficients_change_sq += (pca_shape_coefficients[k] - previous_coefficient) * (pca_shape_coefficients[k] - previous_coefficient);
+            }
+            float max_rotation_change = 0.0f;
+            float max_translation_change = 0.0f;
+            for (int j = 0; j < num_images; ++j) {
+                max_rotation_change = std::max(max_rotation_change, fitting::rotation_difference(workspace.previous_rendering_params[j], rendering_params[j]));
+                max_translation_change = std::max(max_translation_change, fitting::translation_difference(workspace.previous_rendering_params[j], rendering_params[j]));
+            }
+            if (std::abs(statistics.reprojection_error - previous_reprojection_error) < convergence_criterion->reprojection_error_change &&
+                std::sqrt(shape_coefficients_change_sq) < convergence_criterion->shape_coefficients_change &&
+                max_rotation_change < convergence_criterion->rotation_change &&
+                max_translation_change < convergence_criterion->translation_change)
+            {
+                statistics.converged = true;
+                break;
+            }
         }
+        previous_reprojection_error = statistics.reprojection_error;
     }
 
+    // Only now copy the final shapes into the meshes:
+    for_each_image([&](int j) {
+        morphablemodel::update_mesh_vertices(workspace.combined_shapes[j], current_meshs[j]);
+    });
+
     fitted_image_points = image_points;
     return { current_meshs, rendering_params }; // I think we could also work with a Mat face_instance in this function instead of a Mesh, but it would convolute the code more (i.e. more complicated to access vertices).
 };
 
+/**
+ * @brief Fit the pose (camera), shape model, and expression blendshapes to landmarks,
+ * in an iterative way. Can fit to more than one set of landmarks, thus multiple images.
+ *
+ * Same as the overload above, but always runs all \p num_iterations.
+ */
+inline std::pair<std::vector<core::Mesh>, std::vector<fitting::RenderingParameters>> fit_shape_and_pose_multi(const morphablemodel::MorphableModel& morphable_model, const std::vector<morphablemodel::Blendshape>& blendshapes, const std::vector<core::LandmarkCollection<cv::Vec2f>>& landmarks, const core::LandmarkMapper& landmark_mapper, std::vector<int> image_width, std::vector<int> image_height, const morphablemodel::EdgeTopology& edge_topology, const fitting::ContourLandmarks& contour_landmarks, const fitting::ModelContour& model_contour, int num_iterations, boost::optional<int> num_shape_coefficients_to_fit, float lambda, boost::optional<fitting::RenderingParameters> initial_rendering_params, std::vector<float>& pca_shape_coefficients, std::vector<std::vector<float>>& blendshape_coefficients, std::vector<std::vector<cv::Vec2f>>& fitted_image_points, FittingWorkspace& workspace)
+{
+    FittingStatistics statistics;
+    return fit_shape_and_pose_multi(morphable_model, blendshapes, landmarks, landmark_mapper, image_width, image_height, edge_topology, contour_landmarks, model_contour, num_iterations, num_shape_coefficients_to_fit, lambda, initial_rendering_params, pca_shape_coefficients, blendshape_coefficients, fitted_image_points, workspace, boost::none, statistics, nullptr);
+};
+
+/**
+ * @brief Fit the pose (camera), shape model, and expression blendshapes to landmarks,
+ * in an iterative way. Can fit to more than one set of landmarks, thus multiple images.
+ *
+ * Same as the overload above, but uses a temporary FittingWorkspace. When fitting
+ * many frames (e.g. in video), keep a FittingWorkspace around and use the overload
+ * above to avoid re-allocating all intermediate buffers for each frame.
+ *
+ * @copydetails fit_shape_and_pose_multi(const morphablemodel::MorphableModel&, const std::vector<morphablemodel::Blendshape>&, const std::vector<core::LandmarkCollection<cv::Vec2f>>&, const core::LandmarkMapper&, std::vector<int>, std::vector<int>, const morphablemodel::EdgeTopology&, const fitting::ContourLandmarks&, const fitting::ModelContour&, int, boost::optional<int>, float, boost::optional<fitting::RenderingParameters>, std::vector<float>&, std::vector<std::vector<float>>&, std::vector<std::vector<cv::Vec2f>>&, FittingWorkspace&, const boost::optional<ConvergenceCriterion>&, FittingStatistics&, core::ThreadPool*, core::TraceSink*, const StopToken*)
+ */
+inline std::pair<std::vector<core::Mesh>, std::vector<fitting::RenderingParameters>> fit_shape_and_pose_multi(const morphablemodel::MorphableModel& morphable_model, const std::vector<morphablemodel::Blendshape>& blendshapes, const std::vector<core::LandmarkCollection<cv::Vec2f>>& landmarks, const core::LandmarkMapper& landmark_mapper, std::vector<int> image_width, std::vector<int> image_height, const morphablemodel::EdgeTopology& edge_topology, const fitting::ContourLandmarks& contour_landmarks, const fitting::ModelContour& model_contour, int num_iterations, boost::optional<int> num_shape_coefficients_to_fit, float lambda, boost::optional<fitting::RenderingParameters> initial_rendering_params, std::vector<float>& pca_shape_coefficients, std::vector<std::vector<float>>& blendshape_coefficients, std::vector<std::vector<cv::Vec2f>>& fitted_image_points)
+{
+    FittingWorkspace workspace;
+    return fit_shape_and_pose_multi(morphable_model, blendshapes, landmarks, landmark_mapper, image_width, image_height, edge_topology, contour_landmarks, model_contour, num_iterations, num_shape_coefficients_to_fit, lambda, initial_rendering_params, pca_shape_coefficients, blendshape_coefficients, fitted_image_points, workspace);
+};
+
 /**
  * @brief Fit the pose (camera), shape model, and expression blendshapes to landmarks,
  * in an iterative way.  Can fit to more than one set of landmarks, thus multiple images.
@@ -476,7 +637,7 @@ inline std::pair<std::vector<core::Mesh>, std::vector<fitting::RenderingParamete
  * values for them, use the following overload to this function:
  * std::pair<render::Mesh, fitting::RenderingParameters> fit_shape_and_pose(const morphablemodel::MorphableModel&, const std::vector<morphablemodel::Blendshape>&, const core::LandmarkCollection<cv::Vec2f>&, const core::LandmarkMapper&, int, int, const morphablemodel::EdgeTopology&, const fitting::ContourLandmarks&, const fitting::ModelContour&, int, boost::optional<int>, float, boost::optional<fitting::RenderingParameters>, std::vector<float>&, std::vector<float>&, std::vector<cv::Vec2f>&)
  *
- * Todo: Add a convergence criterion.
+ * See the overloads taking a ConvergenceCriterion to stop the fitting early.
  *
  * \p num_iterations: Results are good for even a single iteration. For single-image fitting and
  * for full convergence of all parameters, it can take up to 300 iterations. In tracking,
@@ -530,7 +691,9 @@ inline std::pair<std::vector<core::Mesh>, std::vector<fitting::RenderingParamete
  * \p edge_topology is used for the occluding-edge face contour fitting.
  * \p contour_landmarks and \p model_contour are used to fit the front-facing contour.
  *
- * Todo: Add a convergence criterion.
+ * If a \p convergence_criterion is given, the fitting stops as soon as the reprojection error,
+ * the shape coefficients and the pose don't change anymore, so \p num_iterations can be set to
+ * a high maximum without paying for it on easy images.
  *
  * @param[in] morphable_model The 3D Morphable Model used for the shape fitting.
  * @param[in] blendshapes A vector of blendshapes that are being fit to the landmarks in addition to the PCA model.
@@ -548,9 +711,13 @@ inline std::pair<std::vector<core::Mesh>, std::vector<fitting::RenderingParamete
  * @param[in,out] pca_shape_coefficients If given, will be used as initial PCA shape coefficients to start the fitting. Will contain the final estimated coefficients.
  * @param[in,out] blendshape_coefficients If given, will be used as initial expression blendshape coefficients to start the fitting. Will contain the final estimated coefficients.
  * @param[out] fitted_image_points Debug parameter: Returns all the 2D points that have been used for the fitting.
+ * @param[in] convergence_criterion When to stop the fitting before \p num_iterations are reached, or boost::none to always run all iterations.
+ * @param[out] statistics Returns the number of iterations run and the final reprojection error.
+ * @param[in] trace_sink If given, receives the timings of the stages and a few counters (see core::TraceSink).
+ * @param[in] stop_token If given, the fitting stops early when it is cancelled or at its deadline, see fit_shape_and_pose_multi().
  * @return The fitted model shape instance and the final pose.
  */
-inline std::pair<core::Mesh, fitting::RenderingParameters> fit_shape_and_pose(const morphablemodel::MorphableModel& morphable_model, const std::vector<morphablemodel::Blendshape>& blendshapes, const core::LandmarkCollection<cv::Vec2f>& landmarks, const core::LandmarkMapper& landmark_mapper, int image_width, int image_height, const morphablemodel::EdgeTopology& edge_topology, const fitting::ContourLandmarks& contour_landmarks, const fitting::ModelContour& model_contour, int num_iterations, boost::optional<int> num_shape_coefficients_to_fit, float lambda, boost::optional<fitting::RenderingParameters> initial_rendering_params, std::vector<float>& pca_shape_coefficients, std::vector<float>& blendshape_coefficients, std::vector<cv::Vec2f>& fitted_image_points)
+inline std::pair<core::Mesh, fitting::RenderingParameters> fit_shape_and_pose(const morphablemodel::MorphableModel& morphable_model, const std::vector<morphablemodel::Blendshape>& blendshapes, const core::LandmarkCollection<cv::Vec2f>& landmarks, const core::LandmarkMapper& landmark_mapper, int image_width, int image_height, const morphablemodel::EdgeTopology& edge_topology, const fitting::ContourLandmarks& contour_landmarks, const fitting::ModelContour& model_contour, int num_iterations, boost::optional<int> num_shape_coefficients_to_fit, float lambda, boost::optional<fitting::RenderingParameters> initial_rendering_params, std::vector<float>& pca_shape_coefficients, std::vector<float>& blendshape_coefficients, std::vector<cv::Vec2f>& fitted_image_points, const boost::optional<ConvergenceCriterion>& convergence_criterion, FittingStatistics& statistics, core::TraceSink* trace_sink = nullptr, const StopToken* stop_token = nullptr)
 {
     //we have to create a new vector here if the blendshape_coefficients are empty, as otherwise the new vector is not empty anymore and contains one element
     std::vector<std::vector<float>> all_blendshape_coefficients;
@@ -563,13 +730,26 @@ inline std::pair<core::Mesh, fitting::RenderingParameters> fit_shape_and_pose(co
     {
         all_fitted_image_points = {fitted_image_points};
     }
-    std::pair<std::vector<core::Mesh>, std::vector<fitting::RenderingParameters>>  all_meshs_and_params = fit_shape_and_pose_multi( morphable_model, blendshapes, { landmarks }, landmark_mapper, { image_width }, { image_height }, edge_topology, contour_landmarks, model_contour, num_iterations, num_shape_coefficients_to_fit, lambda, initial_rendering_params, pca_shape_coefficients, all_blendshape_coefficients, all_fitted_image_points);
+    FittingWorkspace workspace;
+    std::pair<std::vector<core::Mesh>, std::vector<fitting::RenderingParameters>>  all_meshs_and_params = fit_shape_and_pose_multi( morphable_model, blendshapes, { landmarks }, landmark_mapper, { image_width }, { image_height }, edge_topology, contour_landmarks, model_contour, num_iterations, num_shape_coefficients_to_fit, lambda, initial_rendering_params, pca_shape_coefficients, all_blendshape_coefficients, all_fitted_image_points, workspace, convergence_criterion, statistics, nullptr, trace_sink, stop_token);
     blendshape_coefficients = all_blendshape_coefficients[0];
     fitted_image_points = all_fitted_image_points[0];
 
     return {all_meshs_and_params.first[0], all_meshs_and_params.second[0] };
 }
 
+/**
+ * @brief Fit the pose (camera), shape model, and expression blendshapes to landmarks,
+ * in an iterative way.
+ *
+ * Same as the overload above, but always runs all \p num_iterations.
+ */
+inline std::pair<core::Mesh, fitting::RenderingParameters> fit_shape_and_pose(const morphablemodel::MorphableModel& morphable_model, const std::vector<morphablemodel::Blendshape>& blendshapes, const core::LandmarkCollection<cv::Vec2f>& landmarks, const core::LandmarkMapper& landmark_mapper, int image_width, int image_height, const morphablemodel::EdgeTopology& edge_topology, const fitting::ContourLandmarks& contour_landmarks, const fitting::ModelContour& model_contour, int num_iterations, boost::optional<int> num_shape_coefficients_to_fit, float lambda, boost::optional<fitting::RenderingParameters> initial_rendering_params, std::vector<float>& pca_shape_coefficients, std::vector<float>& blendshape_coefficients, std::vector<cv::Vec2f>& fitted_image_points)
+{
+    FittingStatistics statistics;
+    return fit_shape_and_pose(morphable_model, blendshapes, landmarks, landmark_mapper, image_width, image_height, edge_topology, contour_landmarks, model_contour, num_iterations, num_shape_coefficients_to_fit, lambda, initial_rendering_params, pca_shape_coefficients, blendshape_coefficients, fitted_image_points, boost::none, statistics);
+};
+
 /**
  * @brief Fit the pose (camera), shape model, and expression blendshapes to landmarks,
  * in an iterative way.
@@ -581,7 +761,7 @@ inline std::pair<core::Mesh, fitting::RenderingParameters> fit_shape_and_pose(co
  * values for them, use the following overload to this function:
  * std::pair<render::Mesh, fitting::RenderingParameters> fit_shape_and_pose(const morphablemodel::MorphableModel&, const std::vector<morphablemodel::Blendshape>&, const core::LandmarkCollection<cv::Vec2f>&, const core::LandmarkMapper&, int, int, const morphablemodel::EdgeTopology&, const fitting::ContourLandmarks&, const fitting::ModelContour&, int, boost::optional<int>, float, boost::optional<fitting::RenderingParameters>, std::vector<float>&, std::vector<float>&, std::vector<cv::Vec2f>&)
  *
- * Todo: Add a convergence criterion.
+ * See the overloads taking a ConvergenceCriterion to stop the fitting early.
  *
  * \p num_iterations: Results are good for even a single iteration. For single-image fitting and
  * for full convergence of all parameters, it can take up to 300 iterations. In tracking,
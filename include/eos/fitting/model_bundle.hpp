@@ -0,0 +1,302 @@
+/*
+ * eos - A 3D Morphable Model fitting library written in modern C++11/14.
+ *
+ * File: include/eos/fitting/model_bundle.hpp
+ *
+ * Copyright 2017 Patrik Huber
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#ifndef MODEL_BUNDLE_HPP_
+#define MODEL_BUNDLE_HPP_
+
+#include "eos/core/LandmarkMapper.hpp"
+#include "eos/morphablemodel/MorphableModel.hpp"
+#include "eos/morphablemodel/Blendshape.hpp"
+#include "eos/morphablemodel/EdgeTopology.hpp"
+#include "eos/morphablemodel/io/mapped_model.hpp"
+#include "eos/fitting/contour_correspondence.hpp"
+#include "eos/render/IsomapPlan.hpp"
+
+#include "Eigen/Core"
+
+#include "boost/optional.hpp"
+
+#include <string>
+#include <vector>
+#include <array>
+#include <map>
+#include <memory>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+namespace eos {
+	namespace fitting {
+
+/**
+ * @brief Everything that the fitting needs from disk, in one object: The model,
+ * blendshapes, landmark mappings, edge topology and contour definitions, and some
+ * data derived from them.
+ *
+ * A bundle is compiled once with save_model_bundle() (e.g. with the
+ * compile-model-bundle utility), and then loaded with a single call to
+ * load_model_bundle(), which memory-maps the file instead of parsing several
+ * cereal, json and info files.
+ */
+struct ModelBundle
+{
+	morphablemodel::MorphableModel morphable_model;
+	std::vector<morphablemodel::Blendshape> blendshapes;
+	core::LandmarkMapper landmark_mapper;
+	morphablemodel::EdgeTopology edge_topology;
+	ContourLandmarks contour_landmarks;
+	ModelContour model_contour;
+
+	// Derived data, filled in by load_model_bundle():
+	std::vector<std::string> landmark_names; ///< The landmarks that the mapper maps, in the order of its mappings.
+	std::vector<int> landmark_vertex_indices; ///< The vertex index of each of the landmark_names, or -1 if it isn't mapped to a vertex.
+	std::vector<std::array<int, 2>> edge_faces; ///< The edge topology's adjacent faces, 0-based, with -1 for boundary edges.
+	std::vector<std::array<int, 2>> edge_vertices; ///< The edge topology's adjacent vertices, 0-based.
+
+	boost::optional<render::IsomapPlan> isomap_plan; ///< An optional isomap plan for the model's texture coordinates.
+};
+
+		namespace detail {
+
+// Joins names into one buffer of zero-terminated strings.
+inline std::string join_names(const std::vector<std::string>& names)
+{
+	std::string joined;
+	for (const auto& name : names) {
+		joined += name + '\0';
+	}
+	return joined;
+};
+
+// Splits a buffer of zero-terminated strings. Throws if the last one isn't terminated.
+inline std::vector<std::string> split_names(const char* base, const morphablemodel::mapped_format::ArrayEntry& entry)
+{
+	std::vector<std::string> names;
+	const char* name = base + entry.offset;
+	const char* end = name + entry.rows;
+	while (name < end)
+	{
+		const std::size_t name_length = strnlen(name, end - name);
+		if (name_length == static_cast<std::size_t>(end - name)) {
+			throw std::runtime_error("A name in the model bundle is not terminated. The file is probably corrupt.");
+		}
+		names.push_back(std::string(name, name_length));
+		name += name_length + 1;
+	}
+	return names;
+};
+
+// Throws if any of the indices is not in [min_index, end_index) - e.g. [-1, number of vertices) for
+// indices where -1 means "none". The name is only used in the error message.
+template <class Indices>
+void check_indices(const Indices& indices, int min_index, std::size_t end_index, const std::string& name)
+{
+	for (const auto& index : indices)
+	{
+		if (index < min_index || (index >= 0 && static_cast<std::size_t>(index) >= end_index)) {
+			throw std::runtime_error("The " + name + " in the model bundle contain the index " + std::to_string(index) + ", which is out of range for the model.");
+		}
+	}
+};
+
+// Copies an array of num_rows elements of type T (e.g. std::array<int, 2> for a rows x 2 array) out of the mapped file.
+template <class T>
+std::vector<T> copy_mapped_array(const char* base, const morphablemodel::mapped_format::ArrayEntry& entry)
+{
+	const auto* data = reinterpret_cast<const T*>(base + entry.offset);
+	return std::vector<T>(data, data + entry.rows);
+};
+
+// Converts a 1-based edge list (with 0 for "none") to a 0-based one (with -1), or the other way round.
+inline std::vector<std::array<int, 2>> offset_edges(const std::vector<std::array<int, 2>>& edges, int offset)
+{
+	std::vector<std::array<int, 2>> offset_edges(edges.size());
+	for (std::size_t i = 0; i < edges.size(); ++i) {
+		offset_edges[i] = { edges[i][0] + offset, edges[i][1] + offset };
+	}
+	return offset_edges;
+};
+
+		} /* namespace detail */
+
+/**
+ * @brief Saves a model bundle in the memory-mappable format of save_mapped_model().
+ *
+ * The derived data (the landmark index table and 0-based edge topology) is computed
+ * from the bundle's mapper and edge topology, the derived members of \p bundle are
+ * ignored. The isomap plan is stored if set.
+ *
+ * A model bundle file can also be loaded with load_mapped_model() and
+ * load_mapped_blendshapes().
+ *
+ * @param[in] bundle The bundle to save.
+ * @param[in] filename Filename for the bundle.
+ * @throw std::runtime_error When the file can't be written.
+ */
+inline void save_model_bundle(const ModelBundle& bundle, std::string filename)
+{
+	using morphablemodel::mapped_format::ElementType;
+	std::vector<morphablemodel::detail::MappedArrayToWrite> arrays;
+	Eigen::MatrixXf blendshapes_as_basis;
+	std::string blendshape_names;
+	morphablemodel::detail::add_morphable_model_arrays(bundle.morphable_model, bundle.blendshapes, blendshapes_as_basis, blendshape_names, arrays);
+
+	// The landmark mappings, and the vertex index of each mapped landmark:
+	std::vector<std::string> mapped_from, mapped_to;
+	std::vector<std::int32_t> landmark_vertex_indices;
+	for (const auto& mapping : bundle.landmark_mapper.get_mappings())
+	{
+		mapped_from.push_back(mapping.first);
+		mapped_to.push_back(mapping.second);
+		char* end = nullptr;
+		const long vertex_index = std::strtol(mapping.second.c_str(), &end, 10);
+		const bool is_vertex_index = !mapping.second.empty() && *end == '\0' && vertex_index >= 0 && vertex_index < bundle.morphable_model.get_shape_model().get_data_dimension() / 3;
+		landmark_vertex_indices.push_back(is_vertex_index ? static_cast<std::int32_t>(vertex_index) : -1);
+	}
+	const std::string mapped_from_names = detail::join_names(mapped_from);
+	const std::string mapped_to_names = detail::join_names(mapped_to);
+	arrays.push_back({ "landmark_mapper.from", ElementType::Char, mapped_from_names.size(), 1, mapped_from_names.data(), 1 });
+	arrays.push_back({ "landmark_mapper.to", ElementType::Char, mapped_to_names.size(), 1, mapped_to_names.data(), 1 });
+	arrays.push_back({ "landmark_vertex_indices", ElementType::Int32, landmark_vertex_indices.size(), 1, landmark_vertex_indices.data(), sizeof(std::int32_t) });
+
+	// The edge topology is stored 0-based, as the fitting uses it:
+	const auto edge_faces = detail::offset_edges(bundle.edge_topology.adjacent_faces, -1);
+	const auto edge_vertices = detail::offset_edges(bundle.edge_topology.adjacent_vertices, -1);
+	arrays.push_back({ "edge_topology.faces", ElementType::Int32, edge_faces.size(), 2, edge_faces.data(), sizeof(int) });
+	arrays.push_back({ "edge_topology.vertices", ElementType::Int32, edge_vertices.size(), 2, edge_vertices.data(), sizeof(int) });
+
+	const std::string right_contour_landmarks = detail::join_names(bundle.contour_landmarks.right_contour);
+	const std::string left_contour_landmarks = detail::join_names(bundle.contour_landmarks.left_contour);
+	arrays.push_back({ "contour_landmarks.right", ElementType::Char, right_contour_landmarks.size(), 1, right_contour_landmarks.data(), 1 });
+	arrays.push_back({ "contour_landmarks.left", ElementType::Char, left_contour_landmarks.size(), 1, left_contour_landmarks.data(), 1 });
+	arrays.push_back({ "model_contour.right", ElementType::Int32, bundle.model_contour.right_contour.size(), 1, bundle.model_contour.right_contour.data(), sizeof(int) });
+	arrays.push_back({ "model_contour.left", ElementType::Int32, bundle.model_contour.left_contour.size(), 1, bundle.model_contour.left_contour.data(), sizeof(int) });
+
+	std::int32_t isomap_plan_info[3] = {}; // resolution, number of vertices and triangles
+	if (bundle.isomap_plan)
+	{
+		const auto& plan = *bundle.isomap_plan;
+		isomap_plan_info[0] = plan.resolution;
+		isomap_plan_info[1] = static_cast<std::int32_t>(plan.num_vertices);
+		isomap_plan_info[2] = static_cast<std::int32_t>(plan.num_triangles);
+		arrays.push_back({ "isomap_plan.info", ElementType::Int32, 3, 1, isomap_plan_info, sizeof(std::int32_t) });
+		arrays.push_back({ "isomap_plan.texels", ElementType::Int32, plan.texels.size(), 1, plan.texels.data(), sizeof(std::int32_t) });
+		arrays.push_back({ "isomap_plan.triangles", ElementType::Int32, plan.triangles.size(), 1, plan.triangles.data(), sizeof(std::int32_t) });
+		arrays.push_back({ "isomap_plan.barycentrics", ElementType::Float32, plan.barycentrics.size() / 2, 2, plan.barycentrics.data(), sizeof(float) });
+	}
+	morphablemodel::detail::write_mapped_file(filename, arrays);
+};
+
+/**
+ * @brief Loads a model bundle written by save_model_bundle(), by memory-mapping it.
+ *
+ * As with load_mapped_model(), the model's PCA data points into the mapped file, and
+ * only the small parts (blendshapes, triangle lists, landmark and contour definitions)
+ * are copied out of it. Nothing is parsed.
+ *
+ * @param[in] filename Filename to a model bundle file.
+ * @return The loaded model bundle.
+ * @throw std::runtime_error When the file can't be mapped or is not a valid model bundle, e.g. if it contains indices that are out of range for the model.
+ */
+inline ModelBundle load_model_bundle(std::string filename)
+{
+	using morphablemodel::mapped_format::ElementType;
+	using morphablemodel::detail::get_mapped_array;
+	const auto region = morphablemodel::detail::map_model_file(filename);
+	const char* base = static_cast<const char*>(region->get_address());
+	const std::size_t file_size = region->get_size();
+	if (!morphablemodel::detail::find_mapped_array(base, file_size, "landmark_mapper.from", ElementType::Char, 1)) {
+		throw std::runtime_error("The given file is a mapped model file, but not a model bundle: " + filename);
+	}
+
+	ModelBundle bundle;
+	bundle.morphable_model = morphablemodel::detail::map_morphable_model(region);
+	bundle.blendshapes = morphablemodel::detail::map_blendshapes(region, filename);
+
+	const auto mapped_from = detail::split_names(base, get_mapped_array(base, file_size, "landmark_mapper.from", ElementType::Char, 1));
+	const auto mapped_to = detail::split_names(base, get_mapped_array(base, file_size, "landmark_mapper.to", ElementType::Char, 1));
+	const auto& vertex_indices = get_mapped_array(base, file_size, "landmark_vertex_indices", ElementType::Int32, 1);
+	if (mapped_to.size() != mapped_from.size() || vertex_indices.rows != mapped_from.size()) {
+		throw std::runtime_error("The landmark mappings in the model bundle have inconsistent sizes: " + filename);
+	}
+	std::map<std::string, std::string> landmark_mappings;
+	for (std::size_t i = 0; i < mapped_from.size(); ++i) {
+		landmark_mappings.emplace(mapped_from[i], mapped_to[i]);
+	}
+	bundle.landmark_mapper = core::LandmarkMapper(landmark_mappings);
+	bundle.landmark_names = mapped_from;
+	bundle.landmark_vertex_indices = detail::copy_mapped_array<int>(base, vertex_indices);
+
+	// The fitting indexes the model with the indices below, so they are checked against its size:
+	const std::size_t num_vertices = bundle.morphable_model.get_shape_model().get_data_dimension() / 3;
+	const std::size_t num_triangles = bundle.morphable_model.get_shape_model().get_triangle_list().size();
+	detail::check_indices(bundle.landmark_vertex_indices, -1, num_vertices, "landmark vertex indices");
+
+	const auto& edge_faces = get_mapped_array(base, file_size, "edge_topology.faces", ElementType::Int32, 2);
+	const auto& edge_vertices = get_mapped_array(base, file_size, "edge_topology.vertices", ElementType::Int32, 2);
+	if (edge_faces.cols != 2 || edge_vertices.cols != 2 || edge_faces.rows != edge_vertices.rows) {
+		throw std::runtime_error("The edge topology in the model bundle has inconsistent sizes: " + filename);
+	}
+	bundle.edge_faces = detail::copy_mapped_array<std::array<int, 2>>(base, edge_faces);
+	bundle.edge_vertices = detail::copy_mapped_array<std::array<int, 2>>(base, edge_vertices);
+	for (std::size_t e = 0; e < bundle.edge_faces.size(); ++e) {
+		detail::check_indices(bundle.edge_faces[e], -1, num_triangles, "edge topology's faces");
+		detail::check_indices(bundle.edge_vertices[e], 0, num_vertices, "edge topology's vertices");
+	}
+	bundle.edge_topology.adjacent_faces = detail::offset_edges(bundle.edge_faces, 1);
+	bundle.edge_topology.adjacent_vertices = detail::offset_edges(bundle.edge_vertices, 1);
+
+	bundle.contour_landmarks.right_contour = detail::split_names(base, get_mapped_array(base, file_size, "contour_landmarks.right", ElementType::Char, 1));
+	bundle.contour_landmarks.left_contour = detail::split_names(base, get_mapped_array(base, file_size, "contour_landmarks.left", ElementType::Char, 1));
+	bundle.model_contour.right_contour = detail::copy_mapped_array<int>(base, get_mapped_array(base, file_size, "model_contour.right", ElementType::Int32, 1));
+	bundle.model_contour.left_contour = detail::copy_mapped_array<int>(base, get_mapped_array(base, file_size, "model_contour.left", ElementType::Int32, 1));
+	detail::check_indices(bundle.model_contour.right_contour, 0, num_vertices, "model contour's vertex indices");
+	detail::check_indices(bundle.model_contour.left_contour, 0, num_vertices, "model contour's vertex indices");
+
+	if (const auto* plan_info = morphablemodel::detail::find_mapped_array(base, file_size, "isomap_plan.info", ElementType::Int32, 1))
+	{
+		if (plan_info->rows != 3) {
+			throw std::runtime_error("The isomap plan in the model bundle has inconsistent sizes: " + filename);
+		}
+		const auto info = detail::copy_mapped_array<std::int32_t>(base, *plan_info);
+		const auto& barycentrics = get_mapped_array(base, file_size, "isomap_plan.barycentrics", ElementType::Float32, 2);
+		render::IsomapPlan plan;
+		plan.resolution = info.at(0);
+		plan.num_vertices = static_cast<std::size_t>(info.at(1));
+		plan.num_triangles = static_cast<std::size_t>(info.at(2));
+		plan.texels = detail::copy_mapped_array<std::int32_t>(base, get_mapped_array(base, file_size, "isomap_plan.texels", ElementType::Int32, 1));
+		plan.triangles = detail::copy_mapped_array<std::int32_t>(base, get_mapped_array(base, file_size, "isomap_plan.triangles", ElementType::Int32, 1));
+		const auto* barycentric_data = reinterpret_cast<const float*>(base + barycentrics.offset);
+		plan.barycentrics.assign(barycentric_data, barycentric_data + barycentrics.rows * barycentrics.cols);
+		if (plan.triangles.size() != plan.texels.size() || plan.barycentrics.size() != 2 * plan.texels.size()) {
+			throw std::runtime_error("The isomap plan in the model bundle has inconsistent sizes: " + filename);
+		}
+		render::detail::check_isomap_plan(plan, plan.num_triangles);
+		bundle.isomap_plan = plan;
+	}
+	return bundle;
+};
+
+	} /* namespace fitting */
+} /* namespace eos */
+
+#endif /* MODEL_BUNDLE_HPP_ */
@@ -22,13 +22,26 @@
 #ifndef ORTHOGRAPHICCAMERAESTIMATIONLINEAR_HPP_
 #define ORTHOGRAPHICCAMERAESTIMATIONLINEAR_HPP_
 
+#include "eos/core/ThreadPool.hpp"
+
 #include "glm/mat3x3.hpp"
 
+#include "Eigen/Core"
+#include "Eigen/SVD"
+#include "Eigen/Geometry"
+
 #include "opencv2/core/core.hpp"
 
 #include "boost/optional.hpp"
 
+#include <array>
 #include <vector>
+#include <random>
+#include <limits>
+#include <numeric>
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
 #include <cassert>
 
 namespace eos {
@@ -43,6 +56,101 @@ struct ScaledOrthoProjectionParameters {
 	double s;
 };
 
+		namespace detail {
+
+/**
+ * The closed-form estimation of estimate_orthographic_projection_linear(), on the
+ * correspondences \p indices[0..num_indices), or on the first \p num_indices ones
+ * if \p indices is nullptr.
+ *
+ * The affine camera is the least-squares solution of u = R1 . X + sTx and
+ * v = R2 . X + sTy. With the points centred, this is one 3x3 system with two
+ * right-hand sides, accumulated directly from the points, so nothing is copied
+ * and nothing is allocated. The image points are flipped with \p flip_height if
+ * it is given.
+ */
+inline ScaledOrthoProjectionParameters estimate_orthographic_projection_linear(const cv::Vec2f* image_points, const cv::Vec4f* model_points, const int* indices, int num_indices, boost::optional<float> flip_height)
+{
+	using Eigen::Matrix3d;
+	using Eigen::Vector3d;
+	using Eigen::Vector2d;
+	const auto index = [&](int i) { return indices ? indices[i] : i; };
+	const auto image_point = [&](int i) {
+		const cv::Vec2f& ip = image_points[index(i)];
+		return Vector2d(ip[0], flip_height ? flip_height.get() - ip[1] : ip[1]);
+	};
+	const auto model_point = [&](int i) {
+		const cv::Vec4f& mp = model_points[index(i)];
+		return Vector3d(mp[0], mp[1], mp[2]); // the homogeneous coordinate is 1
+	};
+
+	Vector3d model_mean = Vector3d::Zero();
+	Vector2d image_mean = Vector2d::Zero();
+	for (int i = 0; i < num_indices; ++i)
+	{
+		model_mean += model_point(i);
+		image_mean += image_point(i);
+	}
+	model_mean /= num_indices;
+	image_mean /= num_indices;
+	Matrix3d XtX = Matrix3d::Zero();
+	Eigen::Matrix<double, 3, 2> Xtx = Eigen::Matrix<double, 3, 2>::Zero();
+	for (int i = 0; i < num_indices; ++i)
+	{
+		const Vector3d X = model_point(i) - model_mean;
+		XtX.noalias() += X * X.transpose();
+		Xtx.noalias() += X * (image_point(i) - image_mean).transpose();
+	}
+	// The SVD gives the minimum-norm solution if the points are degenerate (e.g. coplanar), like cv::solve(DECOMP_SVD) did:
+	const Eigen::Matrix<double, 3, 2> K = Eigen::JacobiSVD<Matrix3d>(XtX, Eigen::ComputeFullU | Eigen::ComputeFullV).solve(Xtx);
+	const Vector3d R1 = K.col(0);
+	const Vector3d R2 = K.col(1);
+	const double sTx = image_mean[0] - R1.dot(model_mean);
+	const double sTy = image_mean[1] - R2.dot(model_mean);
+
+	const double s = (R1.norm() + R2.norm()) / 2.0;
+	Matrix3d R;
+	R.row(0) = R1.normalized();
+	R.row(1) = R2.normalized();
+	R.row(2) = R.row(0).cross(R.row(1));
+	// Set R to the closest orthonormal matrix to the estimated affine transform:
+	Eigen::JacobiSVD<Matrix3d> svd(R, Eigen::ComputeFullU | Eigen::ComputeFullV);
+	Matrix3d U = svd.matrixU();
+	Matrix3d R_ortho = U * svd.matrixV().transpose();
+	// The determinant of R must be 1 for it to be a valid rotation matrix
+	if (R_ortho.determinant() < 0)
+	{
+		U.col(2) = -U.col(2);
+		R_ortho = U * svd.matrixV().transpose();
+	}
+
+	// Convert to a glm::mat3x3, and remove the scale from the translations:
+	glm::mat3x3 R_glm;
+	for (int r = 0; r < 3; ++r) {
+		for (int c = 0; c < 3; ++c) {
+			R_glm[c][r] = static_cast<float>(R_ortho(r, c));
+		}
+	}
+	return ScaledOrthoProjectionParameters{ R_glm, sTx / s, sTy / s, s };
+};
+
+/**
+ * Returns the squared distance, in pixels, between an image point and the model
+ * point projected with the given parameters. Both in the (possibly flipped)
+ * coordinates the parameters were estimated in.
+ */
+inline float squared_reprojection_error(const ScaledOrthoProjectionParameters& parameters, const cv::Vec2f& image_point, const cv::Vec4f& model_point, boost::optional<float> flip_height)
+{
+	const glm::mat3x3& R = parameters.R;
+	const double u = parameters.s * (R[0][0] * model_point[0] + R[1][0] * model_point[1] + R[2][0] * model_point[2] + parameters.tx);
+	const double v = parameters.s * (R[0][1] * model_point[0] + R[1][1] * model_point[1] + R[2][1] * model_point[2] + parameters.ty);
+	const double du = u - image_point[0];
+	const double dv = v - (flip_height ? flip_height.get() - image_point[1] : image_point[1]);
+	return static_cast<float>(du * du + dv * dv);
+};
+
+		} /* namespace detail */
+
 /**
  * Estimates the parameters of a scaled orthographic projection.
  *
@@ -61,90 +169,235 @@ struct ScaledOrthoProjectionParameters {
  * Hartley & Zisserman, 2nd Edition, 2003.
  * [2]: https://github.com/waps101/3DMM_edges/blob/master/utils/POS.m
  *
+ * This overload works directly on contiguous arrays of points (e.g. the data()
+ * of a std::vector, or of a workspace buffer), without copying them.
+ *
+ * @param[in] image_points An array of \p num_points 2D image points.
+ * @param[in] model_points Corresponding points of a 3D model, with the homogeneous coordinate 1.
+ * @param[in] num_points The number of correspondences.
+ * @param[in] is_viewport_upsidedown Flag to set whether the viewport of the image points is upside-down (e.g. as in OpenCV).
+ * @param[in] viewport_height Height of the viewport of the image points (needs to be given if is_viewport_upsidedown == true).
+ * @return Rotation, translation and scaling of the estimated scaled orthographic projection.
+ */
+inline ScaledOrthoProjectionParameters estimate_orthographic_projection_linear(const cv::Vec2f* image_points, const cv::Vec4f* model_points, int num_points, bool is_viewport_upsidedown, boost::optional<int> viewport_height = boost::none)
+{
+	assert(num_points >= 4); // Number of correspondence points given needs to be equal to or larger than 4
+	if (is_viewport_upsidedown && viewport_height == boost::none)
+	{
+		throw std::runtime_error("Error: If is_viewport_upsidedown is set to true, viewport_height needs to be given.");
+	}
+	const boost::optional<float> flip_height = is_viewport_upsidedown ? boost::optional<float>(static_cast<float>(viewport_height.get())) : boost::none;
+	return detail::estimate_orthographic_projection_linear(image_points, model_points, nullptr, num_points, flip_height);
+};
+
+/**
+ * Estimates the parameters of a scaled orthographic projection.
+ *
+ * See the overload above, which this one calls with the data of the vectors.
+ *
  * @param[in] image_points A list of 2D image points.
  * @param[in] model_points Corresponding points of a 3D model.
  * @param[in] is_viewport_upsidedown Flag to set whether the viewport of the image points is upside-down (e.g. as in OpenCV).
  * @param[in] viewport_height Height of the viewport of the image points (needs to be given if is_viewport_upsidedown == true).
  * @return Rotation, translation and scaling of the estimated scaled orthographic projection.
  */
-inline ScaledOrthoProjectionParameters estimate_orthographic_projection_linear(std::vector<cv::Vec2f> image_points, std::vector<cv::Vec4f> model_points, bool is_viewport_upsidedown, boost::optional<int> viewport_height = boost::none)
+inline ScaledOrthoProjectionParameters estimate_orthographic_projection_linear(const std::vector<cv::Vec2f>& image_points, const std::vector<cv::Vec4f>& model_points, bool is_viewport_upsidedown, boost::optional<int> viewport_height = boost::none)
 {
-	using cv::Mat;
 	assert(image_points.size() == model_points.size());
-	assert(image_points.size() >= 4); // Number of correspondence points given needs to be equal to or larger than 4
+	return estimate_orthographic_projection_linear(image_points.data(), model_points.data(), static_cast<int>(image_points.size()), is_viewport_upsidedown, viewport_height);
+};
+
+/**
+ * Estimates the scaled orthographic projection of each of many faces (e.g. all
+ * faces in a frame, or all images of a multi-image fitting) in one call,
+ * optionally in parallel.
+ *
+ * @param[in] image_points The 2D image points of each face.
+ * @param[in] model_points The corresponding 3D model points of each face.
+ * @param[in] viewport_heights The height of the (OpenCV, upside-down) viewport of each face's image.
+ * @param[in] thread_pool If given, the faces are distributed over this pool. nullptr to run serially.
+ * @return The estimated projection of each face.
+ */
+inline std::vector<ScaledOrthoProjectionParameters> estimate_orthographic_projections_linear(const std::vector<std::vector<cv::Vec2f>>& image_points, const std::vector<std::vector<cv::Vec4f>>& model_points, const std::vector<int>& viewport_heights, core::ThreadPool* thread_pool = nullptr)
+{
+	assert(image_points.size() == model_points.size() && model_points.size() == viewport_heights.size());
+	std::vector<ScaledOrthoProjectionParameters> projections(image_points.size());
+	const auto estimate = [&](int j, int) {
+		projections[j] = estimate_orthographic_projection_linear(image_points[j], model_points[j], true, viewport_heights[j]);
+	};
+	if (thread_pool) {
+		thread_pool->parallel_for(0, static_cast<int>(image_points.size()), estimate);
+	} else {
+		for (int j = 0; j < static_cast<int>(image_points.size()); ++j) {
+			estimate(j, 0);
+		}
+	}
+	return projections;
+};
+
+/**
+ * The robust estimators of RobustOrthographicCameraEstimator.
+ */
+enum class RobustEstimationMethod {
+	Ransac, ///< Maximises the number of correspondences with an error below a threshold.
+	LMedS ///< Minimises the median of the squared errors. Needs no threshold, but at most 50% outliers.
+};
 
-	const int num_correspondences = static_cast<int>(image_points.size());
+/**
+ * Settings for RobustOrthographicCameraEstimator.
+ */
+struct RobustEstimationSettings
+{
+	RobustEstimationMethod method = RobustEstimationMethod::Ransac;
+	float inlier_threshold = 5.0f; ///< Ransac: Largest reprojection error of an inlier, in pixels.
+	int max_iterations = 200; ///< Maximum number of random minimal samples.
+	float confidence = 0.99f; ///< Ransac stops once it has found an all-inlier sample with this probability.
+	unsigned int seed = 0; ///< The seed of the random sampling, so that the results are reproducible.
+};
 
-	if (is_viewport_upsidedown)
+/**
+ * @brief Estimates a scaled orthographic projection that is robust to outlier
+ * landmarks, e.g. from detector failures.
+ *
+ * Minimal samples of 4 correspondences are drawn at random, a camera is estimated
+ * from each with the closed-form estimate_orthographic_projection_linear(), and the
+ * one that fits most correspondences (Ransac) or has the smallest median error
+ * (LMedS) is kept. The camera is then re-estimated from all of its inliers.
+ *
+ * The estimator keeps its random number generator and its buffers, so reusing one
+ * estimator per image (or per thread) avoids the allocations.
+ */
+class RobustOrthographicCameraEstimator
+{
+public:
+	explicit RobustOrthographicCameraEstimator(RobustEstimationSettings settings = RobustEstimationSettings()) : settings(settings), random_engine(settings.seed)
 	{
-		if (viewport_height == boost::none)
+	};
+
+	/**
+	 * Estimates the projection from the given correspondences.
+	 *
+	 * If there are no more than 4 correspondences, all of them are used.
+	 *
+	 * @param[in] image_points An array of \p num_points 2D image points.
+	 * @param[in] model_points Corresponding points of a 3D model, with the homogeneous coordinate 1.
+	 * @param[in] num_points The number of correspondences, at least 4.
+	 * @param[in] is_viewport_upsidedown Flag to set whether the viewport of the image points is upside-down (e.g. as in OpenCV).
+	 * @param[in] viewport_height Height of the viewport of the image points (needs to be given if is_viewport_upsidedown == true).
+	 * @return Rotation, translation and scaling of the estimated scaled orthographic projection.
+	 */
+	ScaledOrthoProjectionParameters estimate(const cv::Vec2f* image_points, const cv::Vec4f* model_points, int num_points, bool is_viewport_upsidedown, boost::optional<int> viewport_height = boost::none)
+	{
+		assert(num_points >= 4);
+		if (is_viewport_upsidedown && viewport_height == boost::none)
 		{
 			throw std::runtime_error("Error: If is_viewport_upsidedown is set to true, viewport_height needs to be given.");
 		}
-		for (auto&& ip : image_points)
+		const boost::optional<float> flip_height = is_viewport_upsidedown ? boost::optional<float>(static_cast<float>(viewport_height.get())) : boost::none;
+		constexpr int sample_size = 4;
+		inliers.resize(num_points);
+		std::iota(begin(inliers), end(inliers), 0);
+		if (num_points <= sample_size) {
+			return detail::estimate_orthographic_projection_linear(image_points, model_points, nullptr, num_points, flip_height);
+		}
+
+		const auto compute_errors = [&](const ScaledOrthoProjectionParameters& parameters) {
+			squared_errors.resize(num_points);
+			for (int i = 0; i < num_points; ++i) {
+				squared_errors[i] = detail::squared_reprojection_error(parameters, image_points[i], model_points[i], flip_height);
+			}
+		};
+		const float squared_threshold = settings.inlier_threshold * settings.inlier_threshold;
+		float best_score = std::numeric_limits<float>::max(); // Ransac: minus the number of inliers. LMedS: the median squared error.
+		ScaledOrthoProjectionParameters best_parameters = detail::estimate_orthographic_projection_linear(image_points, model_points, nullptr, num_points, flip_height);
+		int num_iterations = settings.max_iterations;
+		std::array<int, sample_size> sample;
+		std::uniform_int_distribution<int> distribution(0, num_points - 1);
+		for (int iteration = 0; iteration < num_iterations; ++iteration)
 		{
-			ip[1] = viewport_height.get() - ip[1];
+			for (int k = 0; k < sample_size; ++k)
+			{
+				do {
+					sample[k] = distribution(random_engine);
+				} while (std::find(begin(sample), begin(sample) + k, sample[k]) != begin(sample) + k);
+			}
+			const auto parameters = detail::estimate_orthographic_projection_linear(image_points, model_points, sample.data(), sample_size, flip_height);
+			compute_errors(parameters);
+			float score;
+			if (settings.method == RobustEstimationMethod::Ransac)
+			{
+				score = -static_cast<float>(std::count_if(begin(squared_errors), end(squared_errors), [&](float e) { return e < squared_threshold; }));
+			}
+			else {
+				std::nth_element(begin(squared_errors), begin(squared_errors) + num_points / 2, end(squared_errors));
+				score = squared_errors[num_points / 2];
+			}
+			if (score < best_score)
+			{
+				best_score = score;
+				best_parameters = parameters;
+				if (settings.method == RobustEstimationMethod::Ransac)
+				{
+					// Adapt the number of iterations to the inlier ratio found so far:
+					const double inlier_ratio = -score / num_points;
+					const double p_all_inliers = std::pow(inlier_ratio, sample_size);
+					if (p_all_inliers >= 1.0) {
+						break;
+					}
+					if (p_all_inliers > 0.0) {
+						const double needed = std::log(1.0 - settings.confidence) / std::log(1.0 - p_all_inliers);
+						num_iterations = std::min(settings.max_iterations, static_cast<int>(std::ceil(needed)));
+					}
+				}
+			}
 		}
-	}
 
-	Mat A = Mat::zeros(2 * num_correspondences, 8, CV_32FC1);
-	int row_index = 0;
-	for (int i = 0; i < model_points.size(); ++i)
-	{
-		Mat p = Mat(model_points[i]).t();
-		p.copyTo(A.row(row_index++).colRange(0, 4)); // even row - copy to left side (first row is row 0)
-		p.copyTo(A.row(row_index++).colRange(4, 8)); // odd row - copy to right side
-	} // 4th coord (homogeneous) is already 1
-
-	Mat b(2 * num_correspondences, 1, CV_32FC1);
-	row_index = 0;
-	for (int i = 0; i < image_points.size(); ++i)
-	{
-		b.at<float>(row_index++) = image_points[i][0];
-		b.at<float>(row_index++) = image_points[i][1];
-	}
+		// Re-estimate from all inliers of the best camera:
+		compute_errors(best_parameters);
+		float inlier_squared_threshold = squared_threshold;
+		if (settings.method == RobustEstimationMethod::LMedS)
+		{
+			// The robust standard deviation from the median, see Rousseeuw & Leroy, "Robust Regression and Outlier Detection":
+			const double sigma = 1.4826 * (1.0 + 5.0 / (num_points - sample_size)) * std::sqrt(best_score);
+			inlier_squared_threshold = static_cast<float>(2.5 * 2.5 * sigma * sigma);
+		}
+		inliers.clear();
+		for (int i = 0; i < num_points; ++i) {
+			if (squared_errors[i] <= inlier_squared_threshold) {
+				inliers.push_back(i);
+			}
+		}
+		if (inliers.size() < sample_size)
+		{
+			inliers.resize(num_points);
+			std::iota(begin(inliers), end(inliers), 0);
+			return best_parameters;
+		}
+		return detail::estimate_orthographic_projection_linear(image_points, model_points, inliers.data(), static_cast<int>(inliers.size()), flip_height);
+	};
 
-	Mat k; // resulting affine matrix (8x1)
-	bool solved = cv::solve(A, b, k, cv::DECOMP_SVD);
-
-	const Mat R1 = k.rowRange(0, 3);
-	const Mat R2 = k.rowRange(4, 7);
-	const float sTx = k.at<float>(3);
-	const float sTy = k.at<float>(7);
-	const auto s = (cv::norm(R1) + cv::norm(R2)) / 2.0;
-	Mat r1 = R1 / cv::norm(R1);
-	Mat r2 = R2 / cv::norm(R2);
-	Mat r3 = r1.cross(r2);
-	Mat R;
-	r1 = r1.t();
-	r2 = r2.t();
-	r3 = r3.t();
-	R.push_back(r1);
-	R.push_back(r2);
-	R.push_back(r3);
-	// Set R to the closest orthonormal matrix to the estimated affine transform:
-	Mat S, U, Vt;
-	cv::SVDecomp(R, S, U, Vt);
-	Mat R_ortho = U * Vt;
-	// The determinant of R must be 1 for it to be a valid rotation matrix
-	if (cv::determinant(R_ortho) < 0)
+	/**
+	 * See the overload above, which this one calls with the data of the vectors.
+	 */
+	ScaledOrthoProjectionParameters estimate(const std::vector<cv::Vec2f>& image_points, const std::vector<cv::Vec4f>& model_points, bool is_viewport_upsidedown, boost::optional<int> viewport_height = boost::none)
 	{
-		U.row(2) = -U.row(2); // not sure this works...
-		R_ortho = U * Vt;
-	}
+		assert(image_points.size() == model_points.size());
+		return estimate(image_points.data(), model_points.data(), static_cast<int>(image_points.size()), is_viewport_upsidedown, viewport_height);
+	};
 
-	// Remove the scale from the translations:
-	const auto t1 = sTx / s;
-	const auto t2 = sTy / s;
+	/**
+	 * Returns the indices of the correspondences that the last estimate() used as inliers.
+	 */
+	const std::vector<int>& get_inliers() const
+	{
+		return inliers;
+	};
 
-	// Convert to a glm::mat4x4:
-	glm::mat3x3 R_glm; // identity
-	for (int r = 0; r < 3; ++r) {
-		for (int c = 0; c < 3; ++c) {
-			R_glm[c][r] = R_ortho.at<float>(r, c);
-		}
-	}
-	return ScaledOrthoProjectionParameters{ R_glm, t1, t2, s };
+private:
+	RobustEstimationSettings settings;
+	std::mt19937 random_engine;
+	std::vector<float> squared_errors;
+	std::vector<int> inliers;
 };
 
 	} /* namespace fitting */
@@ -0,0 +1,438 @@
+/*
+ * eos - A 3D Morphable Model fitting library written in modern C++11/14.
+ *
+ * File: include/eos/fitting/photometric_cost.hpp
+ *
+ * Copyright 2017 Patrik Huber
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#ifndef PHOTOMETRICCOST_HPP_
+#define PHOTOMETRICCOST_HPP_
+
+#include "eos/morphablemodel/MorphableModel.hpp"
+#include "eos/morphablemodel/Blendshape.hpp"
+#include "eos/render/vertex_visibility.hpp"
+#include "eos/fitting/detail/ceres_nonlinear_detail.hpp"
+
+#include "glm/vec4.hpp"
+
+#include "ceres/cost_function.h"
+
+#include "Eigen/Core"
+
+#include "opencv2/core/core.hpp"
+#include "opencv2/imgproc/imgproc.hpp"
+
+#include <array>
+#include <vector>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <cstddef>
+#include <stdexcept>
+
+namespace eos {
+	namespace fitting {
+
+/**
+ * @brief An image prepared for the photometric cost: the colours and their
+ * x and y derivatives, as float images, so that all three can be sampled
+ * bilinearly at sub-pixel positions.
+ *
+ * The derivatives are computed once per image, with a 3x3 Sobel filter (i.e. a
+ * slightly smoothed central difference), instead of differentiating the
+ * interpolation at every evaluation. They are smooth across pixel borders,
+ * unlike the derivative of the bilinear interpolation, which makes the
+ * residuals better conditioned, and it's cheaper than bicubic interpolation.
+ */
+class PhotometricImage
+{
+public:
+	PhotometricImage() = default;
+
+	/**
+	 * Prepares the given image.
+	 *
+	 * @param[in] image The observed image, CV_8UC3 (BGR).
+	 * @throws std::runtime_error if the given \c image is not of type CV_8UC3.
+	 */
+	explicit PhotometricImage(cv::Mat image)
+	{
+		set_image(image);
+	};
+
+	/**
+	 * Replaces the image, e.g. with the next video frame. The buffers are
+	 * reused if the size stays the same.
+	 *
+	 * @param[in] image The observed image, CV_8UC3 (BGR).
+	 * @throws std::runtime_error if the given \c image is not of type CV_8UC3.
+	 */
+	void set_image(cv::Mat image)
+	{
+		if (image.type() != CV_8UC3)
+		{
+			throw std::runtime_error("The image given to PhotometricImage must be of type CV_8UC3.");
+		}
+		image.convertTo(colour, CV_32FC3);
+		cv::Sobel(colour, d_colour_dx, CV_32F, 1, 0, 3, 1.0 / 8.0, 0.0, cv::BORDER_REPLICATE);
+		cv::Sobel(colour, d_colour_dy, CV_32F, 0, 1, 3, 1.0 / 8.0, 0.0, cv::BORDER_REPLICATE);
+	};
+
+	int cols() const { return colour.cols; };
+	int rows() const { return colour.rows; };
+
+	/**
+	 * Whether the given position can be sampled, i.e. whether all four pixels of
+	 * the bilinear interpolation are inside the image.
+	 */
+	bool contains(double x, double y) const
+	{
+		return x >= 0.0 && y >= 0.0 && x < colour.cols - 1 && y < colour.rows - 1;
+	};
+
+	/**
+	 * Samples the colour and its derivatives at the given position, with bilinear
+	 * interpolation. The position has to be inside the image, see contains().
+	 *
+	 * @param[in] x The x (column) coordinate, in pixels.
+	 * @param[in] y The y (row) coordinate, in pixels.
+	 * @param[out] colour_bgr The colour, in BGR order.
+	 * @param[out] d_colour_dx The derivative of the colour w.r.t. x, in BGR order.
+	 * @param[out] d_colour_dy The derivative of the colour w.r.t. y, in BGR order.
+	 */
+	void sample(double x, double y, double* colour_bgr, double* d_colour_dx, double* d_colour_dy) const
+	{
+		const int x0 = static_cast<int>(x);
+		const int y0 = static_cast<int>(y);
+		const double a = x - x0;
+		const double b = y - y0;
+		const double weights[4] = { (1.0 - a) * (1.0 - b), a * (1.0 - b), (1.0 - a) * b, a * b };
+		const auto interpolate = [&](const cv::Mat& image, double* result) {
+			const float* row0 = image.ptr<float>(y0) + 3 * x0;
+			const float* row1 = image.ptr<float>(y0 + 1) + 3 * x0;
+			for (int c = 0; c < 3; ++c) {
+				result[c] = weights[0] * row0[c] + weights[1] * row0[3 + c] + weights[2] * row1[c] + weights[3] * row1[3 + c];
+			}
+		};
+		interpolate(colour, colour_bgr);
+		interpolate(this->d_colour_dx, d_colour_dx);
+		interpolate(this->d_colour_dy, d_colour_dy);
+	};
+
+	/**
+	 * Returns the squared magnitude of the image gradient at the given pixel,
+	 * summed over the channels.
+	 */
+	float squared_gradient_magnitude(int x, int y) const
+	{
+		const float* dx = d_colour_dx.ptr<float>(y) + 3 * x;
+		const float* dy = d_colour_dy.ptr<float>(y) + 3 * x;
+		float magnitude = 0.0f;
+		for (int c = 0; c < 3; ++c) {
+			magnitude += dx[c] * dx[c] + dy[c] * dy[c];
+		}
+		return magnitude;
+	};
+
+private:
+	cv::Mat colour; // CV_32FC3, BGR
+	cv::Mat d_colour_dx; // CV_32FC3
+	cv::Mat d_colour_dy; // CV_32FC3
+};
+
+/**
+ * Photometric (image) error cost function at a vertex, with an analytic Jacobian.
+ *
+ * Same parameter blocks and residuals as ImageCost and ImageCostFunction (the RGB
+ * difference of the model colour and the observed colour), but the image is
+ * sampled bilinearly from a PhotometricImage, and the derivative of the observed
+ * colour is the precomputed image gradient. The residuals are multiplied by a
+ * weight, e.g. to account for the vertices a subsampled one stands for, see
+ * select_photometric_vertices().
+ *
+ * If the vertex projects outside the image, the residual and Jacobian are zero.
+ * The cost functions are meant to be used for visible vertices only though.
+ */
+class PhotometricCostFunction : public ceres::CostFunction
+{
+public:
+	/**
+	 * Constructs a new cost function for a particular vertex id.
+	 *
+	 * The PhotometricImage is not copied, so it can be replaced for every frame,
+	 * without touching the cost functions. It has to outlive the cost function.
+	 *
+	 * @param[in] morphable_model A 3D Morphable Model.
+	 * @param[in] blendshapes A set of 3D blendshapes.
+	 * @param[in] image The observed image.
+	 * @param[in] vertex_id Vertex id of the 3D model that should be projected and measured.
+	 * @param[in] use_perspective Whether a perspective or an orthographic projection should be used.
+	 * @param[in] weight The weight of the residuals.
+	 * @param[in] num_shape_coefficients The number of shape coefficients that are fitted.
+	 * @param[in] num_color_coefficients The number of colour coefficients that are fitted.
+	 * @throws std::runtime_error if the model has no colour model or too few principal components.
+	 */
+	PhotometricCostFunction(const morphablemodel::MorphableModel& morphable_model, const std::vector<morphablemodel::Blendshape>& blendshapes, const PhotometricImage& image, int vertex_id, bool use_perspective, double weight = 1.0, int num_shape_coefficients = 10, int num_color_coefficients = 10) : image(image), use_perspective(use_perspective), weight(weight)
+	{
+		if (!morphable_model.has_color_model())
+		{
+			throw std::runtime_error("The MorphableModel used does not contain a colour (albedo) model. PhotometricCostFunction requires a model that contains a colour PCA model. You may want to use the full Surrey Face Model.");
+		}
+		vertex_basis = detail::get_vertex_basis(morphable_model.get_shape_model(), blendshapes, vertex_id, num_shape_coefficients);
+		color_basis = detail::get_vertex_basis(morphable_model.get_color_model(), {}, vertex_id, num_color_coefficients);
+		set_num_residuals(3);
+		*mutable_parameter_block_sizes() = { 4, use_perspective ? 4 : 3, num_shape_coefficients, static_cast<int>(blendshapes.size()), num_color_coefficients };
+	};
+
+	bool Evaluate(double const* const* parameters, double* residuals, double** jacobians) const override
+	{
+		using Eigen::Map;
+		using Eigen::Matrix;
+		using RowMajorMatrix = Matrix<double, 3, Eigen::Dynamic, Eigen::RowMajor>;
+		const int num_shape_coeffs = vertex_basis.num_coefficients;
+		const int num_blendshapes = vertex_basis.num_blendshapes();
+		const int num_color_coeffs = color_basis.num_coefficients;
+		const int num_camera_params = use_perspective ? 4 : 3;
+
+		const auto point_arr = vertex_basis.evaluate(parameters[2], parameters[3]);
+		const Eigen::Vector3d point(point_arr[0], point_arr[1], point_arr[2]);
+		Eigen::Matrix3d rotation;
+		Matrix<double, 3, 4> d_rotated_d_quaternion;
+		const Eigen::Vector3d rotated_point = detail::rotate_point(parameters[0], point, rotation, d_rotated_d_quaternion);
+		Matrix<double, 2, 3> d_projected_d_rotated;
+		Matrix<double, 2, 4> d_projected_d_camera;
+		const Eigen::Vector2d projected_point = detail::project_point(parameters[1], rotated_point, image.cols(), image.rows(), use_perspective, d_projected_d_rotated, d_projected_d_camera);
+
+		if (!image.contains(projected_point.x(), projected_point.y()))
+		{
+			std::fill(residuals, residuals + 3, 0.0);
+			if (jacobians)
+			{
+				const int block_sizes[5] = { 4, num_camera_params, num_shape_coeffs, num_blendshapes, num_color_coeffs };
+				for (int i = 0; i < 5; ++i)
+				{
+					if (jacobians[i]) {
+						std::fill(jacobians[i], jacobians[i] + 3 * block_sizes[i], 0.0);
+					}
+				}
+			}
+			return true;
+		}
+		double observed_colour[3], d_observed_dx[3], d_observed_dy[3];
+		image.sample(projected_point.x(), projected_point.y(), &observed_colour[0], &d_observed_dx[0], &d_observed_dy[0]);
+
+		const auto model_colour = color_basis.evaluate(parameters[4], static_cast<const double*>(nullptr));
+		// observed_colour is BGR, model_colour is RGB. Residual will be RGB.
+		Matrix<double, 3, 2> d_residual_d_projected;
+		for (int c = 0; c < 3; ++c)
+		{
+			residuals[c] = weight * (model_colour[c] * 255.0 - observed_colour[2 - c]);
+			d_residual_d_projected(c, 0) = -weight * d_observed_dx[2 - c];
+			d_residual_d_projected(c, 1) = -weight * d_observed_dy[2 - c];
+		}
+
+		if (jacobians)
+		{
+			const Matrix<double, 3, 3> d_residual_d_rotated = d_residual_d_projected * d_projected_d_rotated;
+			const Matrix<double, 3, 3> d_residual_d_point = d_residual_d_rotated * rotation;
+			if (jacobians[0]) {
+				Map<Matrix<double, 3, 4, Eigen::RowMajor>>(jacobians[0]) = d_residual_d_rotated * d_rotated_d_quaternion;
+			}
+			if (jacobians[1]) {
+				Map<RowMajorMatrix>(jacobians[1], 3, num_camera_params) = d_residual_d_projected * d_projected_d_camera.leftCols(num_camera_params);
+			}
+			if (jacobians[2]) {
+				Map<RowMajorMatrix>(jacobians[2], 3, num_shape_coeffs) = d_residual_d_point * vertex_basis.basis.leftCols(num_shape_coeffs);
+			}
+			if (jacobians[3] && num_blendshapes > 0) {
+				Map<RowMajorMatrix>(jacobians[3], 3, num_blendshapes) = d_residual_d_point * vertex_basis.basis.rightCols(num_blendshapes);
+			}
+			if (jacobians[4]) {
+				Map<RowMajorMatrix>(jacobians[4], 3, num_color_coeffs) = (255.0 * weight) * color_basis.basis;
+			}
+		}
+		return true;
+	};
+
+private:
+	const PhotometricImage& image;
+	detail::VertexBasis vertex_basis; // the shape model and blendshape rows of the vertex
+	detail::VertexBasis color_basis; // the colour model rows of the vertex
+	bool use_perspective;
+	double weight;
+};
+
+/**
+ * How the vertices of the photometric term are chosen among the visible ones.
+ */
+enum class PhotometricSampling {
+	All, ///< Every visible vertex.
+	Stratified, ///< One vertex per image cell, the one that projects closest to its centre.
+	GradientAdaptive ///< One vertex per image cell, the one with the largest image gradient.
+};
+
+/**
+ * Settings for select_photometric_vertices().
+ */
+struct PhotometricSamplingSettings
+{
+	PhotometricSampling sampling = PhotometricSampling::Stratified;
+	int cell_size = 8; ///< Size of the cells of Stratified and GradientAdaptive, in pixels.
+	render::VisibilityMethod visibility_method = render::VisibilityMethod::DepthBuffer;
+};
+
+/**
+ * A vertex of the photometric term, and the weight of its residuals.
+ */
+struct PhotometricSample
+{
+	int vertex_id;
+	double weight;
+};
+
+/**
+ * Chooses the vertices that are evaluated in the photometric term: The ones that
+ * are visible (not self-occluded, and inside the image), subsampled according to
+ * the settings.
+ *
+ * With the subsampling, each chosen vertex gets the weight sqrt(n), where n is the
+ * number of visible vertices in its cell, so that its squared residual stands for
+ * the ones of all of them, and the photometric term has about the same scale as
+ * with all vertices, relative to the landmarks and the priors.
+ *
+ * The visibility is tested along the z axis of the camera space, which is exact for
+ * orthographic projections, and an approximation for perspective ones.
+ *
+ * @param[in] posed_vertices The vertices, rotated and translated into the camera space, where the camera looks along -z.
+ * @param[in] projected_vertices The vertices projected to the image, in pixels.
+ * @param[in] triangles The triangle list, e.g. from PcaModel::get_triangle_list().
+ * @param[in] image The image, for its size and the image gradients of GradientAdaptive.
+ * @param[in] settings How the vertices are chosen.
+ * @return The chosen vertices, in ascending order of their index.
+ */
+inline std::vector<PhotometricSample> select_photometric_vertices(const std::vector<glm::vec4>& posed_vertices, const std::vector<cv::Vec2d>& projected_vertices, const std::vector<std::array<int, 3>>& triangles, const PhotometricImage& image, PhotometricSamplingSettings settings = PhotometricSamplingSettings())
+{
+	const std::vector<bool> visibility = settings.visibility_method == render::VisibilityMethod::DepthBuffer ? render::VertexVisibilityDepthBuffer(posed_vertices, triangles).compute_visibility() : render::VertexVisibilityGrid(posed_vertices, triangles).compute_visibility();
+	const auto is_candidate = [&](std::size_t i) {
+		return visibility[i] && image.contains(projected_vertices[i][0], projected_vertices[i][1]);
+	};
+
+	std::vector<PhotometricSample> samples;
+	if (settings.sampling == PhotometricSampling::All)
+	{
+		for (std::size_t i = 0; i < projected_vertices.size(); ++i)
+		{
+			if (is_candidate(i)) {
+				samples.push_back({ static_cast<int>(i), 1.0 });
+			}
+		}
+		return samples;
+	}
+
+	// One entry per cell: the chosen vertex, its score (lower is better), and the number of candidates.
+	struct Cell
+	{
+		int vertex_id = -1;
+		float score = std::numeric_limits<float>::max();
+		int num_candidates = 0;
+	};
+	const int cell_size = std::max(settings.cell_size, 1);
+	const int num_cells_x = (image.cols() + cell_size - 1) / cell_size;
+	const int num_cells_y = (image.rows() + cell_size - 1) / cell_size;
+	std::vector<Cell> cells(num_cells_x * num_cells_y);
+	for (std::size_t i = 0; i < projected_vertices.size(); ++i)
+	{
+		if (!is_candidate(i)) {
+			continue;
+		}
+		const double x = projected_vertices[i][0];
+		const double y = projected_vertices[i][1];
+		const int cell_x = static_cast<int>(x) / cell_size;
+		const int cell_y = static_cast<int>(y) / cell_size;
+		float score;
+		if (settings.sampling == PhotometricSampling::GradientAdaptive)
+		{
+			score = -image.squared_gradient_magnitude(static_cast<int>(x + 0.5), static_cast<int>(y + 0.5));
+		}
+		else {
+			const double dx = x - (cell_x + 0.5) * cell_size;
+			const double dy = y - (cell_y + 0.5) * cell_size;
+			score = static_cast<float>(dx * dx + dy * dy);
+		}
+		Cell& cell = cells[cell_y * num_cells_x + cell_x];
+		++cell.num_candidates;
+		if (score < cell.score)
+		{
+			cell.score = score;
+			cell.vertex_id = static_cast<int>(i);
+		}
+	}
+	for (const auto& cell : cells)
+	{
+		if (cell.vertex_id >= 0) {
+			samples.push_back({ cell.vertex_id, std::sqrt(static_cast<double>(cell.num_candidates)) });
+		}
+	}
+	std::sort(begin(samples), end(samples), [](const PhotometricSample& lhs, const PhotometricSample& rhs) { return lhs.vertex_id < rhs.vertex_id; });
+	return samples;
+};
+
+/**
+ * Computes the vertices of the shape given by the parameters, in the camera space
+ * and projected to the image, in the same way as the cost functions do.
+ *
+ * @param[in] shape_model A PCA 3D shape model.
+ * @param[in] blendshapes A set of 3D blendshapes.
+ * @param[in] camera_rotation The rotation, as quaternion [w x y z].
+ * @param[in] camera_translation_and_intrinsics Ortho: [t_x t_y frustum_scale]. Perspective: [t_x t_y t_z fov].
+ * @param[in] shape_coefficients The shape coefficients. Only the ones given are used.
+ * @param[in] blendshape_coefficients The blendshape coefficients, one for each blendshape.
+ * @param[in] image_width Width of the image.
+ * @param[in] image_height Height of the image.
+ * @param[in] use_perspective Whether a perspective or an orthographic projection is used.
+ * @param[out] posed_vertices The vertices in the camera space, i.e. rotated and translated.
+ * @param[out] projected_vertices The vertices projected to the image, in pixels.
+ */
+inline void project_model_vertices(const morphablemodel::PcaModel& shape_model, const std::vector<morphablemodel::Blendshape>& blendshapes, const double* const camera_rotation, const std::vector<double>& camera_translation_and_intrinsics, const std::vector<double>& shape_coefficients, const std::vector<double>& blendshape_coefficients, int image_width, int image_height, bool use_perspective, std::vector<glm::vec4>& posed_vertices, std::vector<cv::Vec2d>& projected_vertices)
+{
+	const int num_coefficients = static_cast<int>(shape_coefficients.size());
+	Eigen::VectorXd shape = shape_model.get_mean().cast<double>() + shape_model.get_rescaled_pca_basis().leftCols(num_coefficients).cast<double>() * Eigen::Map<const Eigen::VectorXd>(shape_coefficients.data(), num_coefficients);
+	for (std::size_t i = 0; i < blendshapes.size(); ++i)
+	{
+		shape += blendshapes[i].deformation.cast<double>() * blendshape_coefficients[i];
+	}
+	const int num_vertices = shape_model.get_data_dimension() / 3;
+	posed_vertices.resize(num_vertices);
+	projected_vertices.resize(num_vertices);
+	Eigen::Matrix3d rotation;
+	Eigen::Matrix<double, 3, 4> d_rotated_d_quaternion;
+	Eigen::Matrix<double, 2, 3> d_projected_d_rotated;
+	Eigen::Matrix<double, 2, 4> d_projected_d_camera;
+	for (int i = 0; i < num_vertices; ++i)
+	{
+		const Eigen::Vector3d rotated_point = detail::rotate_point(camera_rotation, shape.segment<3>(3 * i), rotation, d_rotated_d_quaternion);
+		const Eigen::Vector2d projected_point = detail::project_point(camera_translation_and_intrinsics.data(), rotated_point, image_width, image_height, use_perspective, d_projected_d_rotated, d_projected_d_camera);
+		projected_vertices[i] = cv::Vec2d(projected_point.x(), projected_point.y());
+		const double t_z = use_perspective ? camera_translation_and_intrinsics[2] : 0.0;
+		posed_vertices[i] = glm::vec4(rotated_point[0] + camera_translation_and_intrinsics[0], rotated_point[1] + camera_translation_and_intrinsics[1], rotated_point[2] + t_z, 1.0f);
+	}
+};
+
+	} /* namespace fitting */
+} /* namespace eos */
+
+#endif /* PHOTOMETRICCOST_HPP_ */
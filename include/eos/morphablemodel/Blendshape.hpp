@@ -102,6 +102,33 @@ inline Eigen::MatrixXf to_matrix(const std::vector<Blendshape>& blendshapes)
 	return blendshapes_as_basis;
 };
 
+/**
+ * @brief Adds the offsets of the given blendshapes, weighted with \p coefficients,
+ * at the given vertices to \p shape.
+ *
+ * \p shape contains only the given vertices, in the format [x_1 y_1 z_1 x_2 ...],
+ * for example the result of PcaModel::draw_sample_at_points().
+ *
+ * @param[in] blendshapes The blendshapes.
+ * @param[in] coefficients One coefficient per blendshape.
+ * @param[in] vertex_ids The vertices that \p shape contains.
+ * @param[in,out] shape The vertices to add the offsets to, of size 3 * vertex_ids.size().
+ */
+inline void add_blendshapes_at_points(const std::vector<Blendshape>& blendshapes, const std::vector<float>& coefficients, const std::vector<int>& vertex_ids, Eigen::Ref<Eigen::VectorXf> shape)
+{
+	assert(blendshapes.size() == coefficients.size());
+	assert(shape.size() == 3 * static_cast<Eigen::Index>(vertex_ids.size()));
+	for (std::size_t b = 0; b < blendshapes.size(); ++b)
+	{
+		if (coefficients[b] == 0.0f) {
+			continue;
+		}
+		for (std::size_t i = 0; i < vertex_ids.size(); ++i) {
+			shape.segment<3>(3 * i) += coefficients[b] * blendshapes[b].deformation.segment<3>(3 * vertex_ids[i]);
+		}
+	}
+};
+
 /**
  * @brief Maps an std::vector of coefficients with Eigen::Map, so it can be multiplied
  * with a blendshapes matrix.
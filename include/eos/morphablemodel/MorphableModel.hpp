@@ -23,6 +23,7 @@
 #define MORPHABLEMODEL_HPP_
 
 #include "eos/morphablemodel/PcaModel.hpp"
+#include "eos/morphablemodel/Blendshape.hpp"
 
 #include "eos/core/Mesh.hpp"
 
@@ -41,6 +42,9 @@
 
 #include <vector>
 #include <array>
+#include <algorithm>
+#include <memory>
+#include <atomic>
 #include <cstdint>
 #include <fstream>
 
@@ -94,6 +98,18 @@ public:
 		return color_model;
 	};
 
+	/**
+	 * Sets which of the two PCA bases the shape and colour models keep in memory.
+	 * See PcaModel::set_basis_storage().
+	 *
+	 * @param[in] storage Which basis to keep.
+	 */
+	void set_basis_storage(PcaBasisStorage storage)
+	{
+		shape_model.set_basis_storage(storage);
+		color_model.set_basis_storage(storage);
+	};
+
 	/**
 	 * Returns the mean of the shape- and colour model as a Mesh.
 	 *
@@ -191,6 +207,62 @@ public:
 		return mesh;
 	};
 
+	/**
+	 * Computes the shapes of many model instances at once, with blendshapes.
+	 *
+	 * Column i of \p samples is the shape with PCA coefficients
+	 * \p shape_coefficients.col(i) and blendshape coefficients
+	 * \p blendshape_coefficients.col(i). Both are computed with one matrix-matrix
+	 * product each, see PcaModel::draw_samples().
+	 *
+	 * @param[in] shape_coefficients A K x M matrix with the PCA shape coefficients of M samples.
+	 * @param[in] blendshapes The blendshapes to add. Can be empty.
+	 * @param[in] blendshape_coefficients A B x M matrix with the blendshape coefficients, B being the number of blendshapes. Ignored when there are no blendshapes.
+	 * @param[out] samples A 3V x M matrix with the shapes.
+	 * @param[in] thread_pool An optional pool to compute the samples in parallel.
+	 */
+	void draw_shape_samples(const Eigen::Ref<const Eigen::MatrixXf>& shape_coefficients, const std::vector<Blendshape>& blendshapes, const Eigen::Ref<const Eigen::MatrixXf>& blendshape_coefficients, Eigen::MatrixXf& samples, core::ThreadPool* thread_pool = nullptr) const
+	{
+		shape_model.draw_samples(shape_coefficients, samples, thread_pool);
+		if (blendshapes.empty()) {
+			return;
+		}
+		assert(blendshape_coefficients.rows() == static_cast<Eigen::Index>(blendshapes.size()) && blendshape_coefficients.cols() == samples.cols());
+		const Eigen::MatrixXf blendshapes_as_basis = to_matrix(blendshapes); // small compared to the samples of a batch
+		const auto num_samples = samples.cols();
+		const int num_blocks = thread_pool ? static_cast<int>(std::min<Eigen::Index>(thread_pool->get_num_threads(), num_samples)) : 1;
+		const auto add_block = [&](int b, int /* thread_index */) {
+			const Eigen::Index first_sample = num_samples * b / num_blocks;
+			const Eigen::Index num_block_samples = num_samples * (b + 1) / num_blocks - first_sample;
+			samples.middleCols(first_sample, num_block_samples).noalias() += blendshapes_as_basis * blendshape_coefficients.middleCols(first_sample, num_block_samples);
+		};
+		if (num_blocks > 1) {
+			thread_pool->parallel_for(0, num_blocks, add_block);
+		}
+		else {
+			add_block(0, 0);
+		}
+	};
+
+	/**
+	 * Computes the shape of a model instance only at the given vertices, and writes
+	 * it into \p result, in the format [x_1 y_1 z_1 x_2 ...].
+	 *
+	 * This is much cheaper than draw_sample() when only a few vertices are needed,
+	 * e.g. the landmark or contour vertices. See PcaModel::draw_sample_at_points().
+	 *
+	 * @param[in] vertex_ids The vertices to compute.
+	 * @param[in] shape_coefficients The PCA shape coefficients. Missing ones are assumed to be zero.
+	 * @param[in] blendshapes Blendshapes to add to the shape. Can be empty.
+	 * @param[in] blendshape_coefficients One coefficient per blendshape.
+	 * @param[out] result A vector of size 3 * vertex_ids.size() for the result.
+	 */
+	void draw_shape_sample_at_points(const std::vector<int>& vertex_ids, const std::vector<float>& shape_coefficients, const std::vector<Blendshape>& blendshapes, const std::vector<float>& blendshape_coefficients, Eigen::Ref<Eigen::VectorXf> result) const
+	{
+		shape_model.draw_sample_at_points(vertex_ids, shape_coefficients, result);
+		add_blendshapes_at_points(blendshapes, blendshape_coefficients, vertex_ids, result);
+	};
+
 	/**
 	 * Returns true if this Morphable Model contains a colour
 	 * model. Returns false if it is a shape-only model.
@@ -207,15 +279,47 @@ public:
 	 *
 	 * @return The texture coordinates for the model vertices.
 	 */
-	std::vector<std::array<double, 2>> get_texture_coordinates() const
+	const std::vector<std::array<double, 2>>& get_texture_coordinates() const
 	{
 		return texture_coordinates;
 	};
 
+	/**
+	 * Returns the triangle lists and texture coordinates of the model, which are
+	 * the same for every model instance, as a topology that can be shared between
+	 * meshes (see core::SharedTopologyMesh and sample_to_mesh()).
+	 *
+	 * The topology is created on the first call, and the same object is returned
+	 * by all later calls (also from different threads).
+	 *
+	 * @return The shared topology of the model.
+	 */
+	std::shared_ptr<const core::MeshTopology> get_topology() const
+	{
+		auto current = std::atomic_load(&topology);
+		if (current) {
+			return current;
+		}
+		auto new_topology = std::make_shared<core::MeshTopology>();
+		new_topology->tvi = shape_model.get_triangle_list();
+		new_topology->tci = color_model.get_triangle_list(); // empty in case of a shape-only model
+		new_topology->texcoords.reserve(texture_coordinates.size());
+		for (const auto& uv : texture_coordinates) {
+			new_topology->texcoords.emplace_back(uv[0], uv[1]);
+		}
+		current = std::move(new_topology);
+		std::shared_ptr<const core::MeshTopology> expected;
+		if (!std::atomic_compare_exchange_strong(&topology, &expected, current)) {
+			current = expected; // Another thread was faster, use its topology.
+		}
+		return current;
+	};
+
 private:
 	PcaModel shape_model; ///< A PCA model of the shape
 	PcaModel color_model; ///< A PCA model of vertex colour information
 	std::vector<std::array<double, 2>> texture_coordinates; ///< uv-coordinates for every vertex
+	mutable std::shared_ptr<const core::MeshTopology> topology; ///< Created from the above on first use, see get_topology()
 
 	/**
 	 * Returns whether the model has texture mapping coordinates, i.e.
@@ -243,6 +347,7 @@ private:
 			throw std::runtime_error("The model file you are trying to load is in an old format. Please download the most recent model files.");
 		}
 		archive(CEREAL_NVP(shape_model), CEREAL_NVP(color_model), CEREAL_NVP(texture_coordinates));
+		topology.reset(); // in case we just loaded into an existing model
 	};
 };
 
@@ -251,12 +356,14 @@ private:
  * a cereal::BinaryInputArchive from the harddisk.
  *
  * @param[in] filename Filename to a model.
+ * @param[in] basis_storage Which of the PCA bases to keep in memory. Use PcaBasisStorage::RescaledOnly to halve the memory if only the fitting is needed.
  * @return The loaded Morphable Model.
  * @throw std::runtime_error When the file given in \c filename fails to be opened (most likely because the file doesn't exist).
  */
-inline MorphableModel load_model(std::string filename)
+inline MorphableModel load_model(std::string filename, PcaBasisStorage basis_storage = PcaBasisStorage::Both)
 {
 	MorphableModel model;
+	model.set_basis_storage(basis_storage); // applied while loading, to avoid holding both bases
 
 	std::ifstream file(filename, std::ios::binary);
 	if (file.fail()) {
@@ -333,6 +440,58 @@ inline core::Mesh sample_to_mesh(const Eigen::VectorXf& shape_instance, const Ei
 	return mesh;
 };
 
+/**
+ * Helper function that creates a mesh with a shared topology from given shape and
+ * colour PCA instances. Only the vertices and colours are copied, the triangle
+ * lists and texture coordinates are referenced from \p topology.
+ *
+ * If \c color is empty, it will create a mesh without vertex colouring.
+ *
+ * @param[in] shape_instance PCA shape model instance.
+ * @param[in] color_instance PCA colour model instance.
+ * @param[in] topology The topology of the model, e.g. from MorphableModel::get_topology().
+ * @return A mesh created from given parameters.
+ */
+inline core::SharedTopologyMesh sample_to_mesh(const Eigen::VectorXf& shape_instance, const Eigen::VectorXf& color_instance, std::shared_ptr<const core::MeshTopology> topology)
+{
+	assert(shape_instance.rows() == color_instance.rows() || color_instance.size() == 0); // The number of vertices (= model.getDataDimension() / 3) has to be equal for both models, or, alternatively, it has to be a shape-only model.
+
+	const auto num_vertices = shape_instance.rows() / 3;
+
+	core::SharedTopologyMesh mesh;
+	mesh.vertices.resize(num_vertices);
+	for (auto i = 0; i < num_vertices; ++i) {
+		mesh.vertices[i] = glm::tvec4<float>(shape_instance(i * 3 + 0), shape_instance(i * 3 + 1), shape_instance(i * 3 + 2), 1.0f);
+	}
+	if (color_instance.size() > 0) {
+		mesh.colors.resize(num_vertices);
+		for (auto i = 0; i < num_vertices; ++i) {
+			mesh.colors[i] = glm::tvec3<float>(color_instance(i * 3 + 0), color_instance(i * 3 + 1), color_instance(i * 3 + 2)); // We use RGB order everywhere
+		}
+	}
+	mesh.topology = std::move(topology);
+	return mesh;
+};
+
+/**
+ * Updates the vertex positions of an existing mesh with a new shape instance.
+ *
+ * Leaves the colours, texture coordinates and triangle lists of the mesh untouched,
+ * and doesn't allocate if the mesh already has the right number of vertices. This
+ * is useful in iterative fittings, where only the shape changes.
+ *
+ * @param[in] shape_instance PCA shape model instance.
+ * @param[in,out] mesh The mesh whose vertices are updated, e.g. created by sample_to_mesh().
+ */
+inline void update_mesh_vertices(const Eigen::VectorXf& shape_instance, core::Mesh& mesh)
+{
+	const auto num_vertices = shape_instance.rows() / 3;
+	mesh.vertices.resize(num_vertices);
+	for (auto i = 0; i < num_vertices; ++i) {
+		mesh.vertices[i] = glm::tvec4<float>(shape_instance(i * 3 + 0), shape_instance(i * 3 + 1), shape_instance(i * 3 + 2), 1.0f);
+	}
+};
+
 	} /* namespace morphablemodel */
 } /* namespace eos */
 
@@ -22,6 +22,8 @@
 #ifndef PCAMODEL_HPP_
 #define PCAMODEL_HPP_
 
+#include "eos/core/ThreadPool.hpp"
+
 #include "eos/morphablemodel/io/eigen_cerealisation.hpp"
 #include "cereal/access.hpp"
 #include "cereal/types/array.hpp"
@@ -33,8 +35,11 @@
 #include <string>
 #include <vector>
 #include <array>
+#include <memory>
 #include <random>
 #include <cassert>
+#include <cmath>
+#include <algorithm>
 #include <fstream>
 
 namespace eos {
@@ -44,6 +49,22 @@ namespace eos {
 Eigen::MatrixXf rescale_pca_basis(const Eigen::MatrixXf& orthonormal_basis, const Eigen::VectorXf& eigenvalues);
 Eigen::MatrixXf normalise_pca_basis(const Eigen::MatrixXf& rescaled_basis, const Eigen::VectorXf& eigenvalues);
 
+/**
+ * @brief Which of the two PCA bases a PcaModel keeps in memory.
+ *
+ * The orthonormal and the rescaled basis only differ by a scale factor per
+ * column, so one of them and the eigenvalues suffice to get the other one.
+ * For large models, keeping only one of them halves the memory of the model.
+ *
+ * The fitting only uses the rescaled basis, so RescaledOnly is usually the
+ * policy to use when memory matters.
+ */
+enum class PcaBasisStorage {
+	Both, ///< Keep both bases (the default).
+	RescaledOnly, ///< Keep only the rescaled basis. The orthonormal basis is derived when requested.
+	OrthonormalOnly ///< Keep only the orthonormal basis. The rescaled basis is derived when requested.
+};
+
 /**
  * @brief This class represents a PCA-model that consists of:
  *   - a mean vector (y x z)
@@ -75,6 +96,91 @@ public:
 		rescaled_pca_basis = rescale_pca_basis(orthonormal_pca_basis, eigenvalues);
 	};
 
+	/**
+	 * Construct a PCA model that references data that is stored elsewhere, for
+	 * example in a memory-mapped file (see load_mapped_model()), without copying it.
+	 *
+	 * \p storage is the owner of the data. The model keeps it alive for as long as
+	 * the model, or any copy of it, exists. Copies of the model share the data.
+	 *
+	 * @param[in] mean The mean used to build the PCA model.
+	 * @param[in] orthonormal_pca_basis An orthonormal PCA basis (eigenvectors).
+	 * @param[in] rescaled_pca_basis The same basis, rescaled with the square root of the eigenvalues.
+	 * @param[in] eigenvalues The eigenvalues used to build the PCA model.
+	 * @param[in] triangle_list An index list of how to assemble the mesh.
+	 * @param[in] storage The owner of the data that the maps point to.
+	 */
+	PcaModel(Eigen::Map<const Eigen::VectorXf> mean, Eigen::Map<const Eigen::MatrixXf> orthonormal_pca_basis, Eigen::Map<const Eigen::MatrixXf> rescaled_pca_basis, Eigen::Map<const Eigen::VectorXf> eigenvalues, std::vector<std::array<int, 3>> triangle_list, std::shared_ptr<const void> storage) : triangle_list(triangle_list), external_storage(storage), external_mean(mean.data()), external_orthonormal_pca_basis(orthonormal_pca_basis.data()), external_rescaled_pca_basis(rescaled_pca_basis.data()), external_eigenvalues(eigenvalues.data()), external_data_dimension(static_cast<int>(rescaled_pca_basis.rows())), external_num_principal_components(static_cast<int>(rescaled_pca_basis.cols()))
+	{
+		assert(storage);
+		assert(mean.size() == rescaled_pca_basis.rows() && orthonormal_pca_basis.rows() == rescaled_pca_basis.rows());
+		assert(orthonormal_pca_basis.cols() == rescaled_pca_basis.cols() && eigenvalues.size() == rescaled_pca_basis.cols());
+	};
+
+	/**
+	 * Returns whether the model's data is stored outside of the model, e.g. in a
+	 * memory-mapped file, instead of in its own matrices.
+	 *
+	 * @return True if the model references external data.
+	 */
+	bool has_external_storage() const
+	{
+		return external_storage != nullptr;
+	};
+
+	/**
+	 * Sets which of the two PCA bases the model keeps in memory, and frees the
+	 * other one.
+	 *
+	 * Requesting the basis that isn't kept with get_orthonormal_pca_basis() or
+	 * get_rescaled_pca_basis() computes it once and caches it, until the storage
+	 * policy is set again. The functions that only need a part of it, like
+	 * draw_sample() and the *_at_point() functions, derive that part on the fly
+	 * without caching anything.
+	 *
+	 * Models with external storage always provide both bases and ignore this.
+	 *
+	 * This invalidates the matrices returned by earlier calls to get_rescaled_pca_basis()
+	 * and get_orthonormal_pca_basis(). Unlike the getters, it must not be called while
+	 * other threads use the model.
+	 *
+	 * @param[in] storage Which basis to keep.
+	 */
+	void set_basis_storage(PcaBasisStorage storage)
+	{
+		if (has_external_storage()) {
+			return;
+		}
+		std::atomic_store(&derived_basis, std::shared_ptr<const Eigen::MatrixXf>());
+		if (storage == basis_storage) {
+			return;
+		}
+		// Restore the basis that is missing (if any), then drop the one that isn't wanted:
+		if (basis_storage == PcaBasisStorage::RescaledOnly) {
+			orthonormal_pca_basis = normalise_pca_basis(rescaled_pca_basis, eigenvalues);
+		}
+		else if (basis_storage == PcaBasisStorage::OrthonormalOnly) {
+			rescaled_pca_basis = rescale_pca_basis(orthonormal_pca_basis, eigenvalues);
+		}
+		basis_storage = storage;
+		if (storage == PcaBasisStorage::RescaledOnly) {
+			orthonormal_pca_basis.resize(0, 0);
+		}
+		else if (storage == PcaBasisStorage::OrthonormalOnly) {
+			rescaled_pca_basis.resize(0, 0);
+		}
+	};
+
+	/**
+	 * Returns which of the two PCA bases the model keeps in memory.
+	 *
+	 * @return The storage policy of the PCA bases.
+	 */
+	PcaBasisStorage get_basis_storage() const
+	{
+		return basis_storage;
+	};
+
 	/**
 	 * Returns the number of principal components in the model.
 	 *
@@ -82,8 +188,8 @@ public:
 	 */
 	int get_num_principal_components() const
 	{
-		// Note: we could assert(rescaled_pca_basis.cols==orthonormal_pca_basis.cols)
-		return rescaled_pca_basis.cols();
+		// Note: Only one of the bases might be stored, but the eigenvalues always are.
+		return has_external_storage() ? external_num_principal_components : static_cast<int>(eigenvalues.size());
 	};
 
 	/**
@@ -96,8 +202,7 @@ public:
 	 */
 	int get_data_dimension() const
 	{
-		// Note: we could assert(rescaled_pca_basis.rows==orthonormal_pca_basis.rows)
-		return rescaled_pca_basis.rows();
+		return has_external_storage() ? external_data_dimension : static_cast<int>(mean.size());
 	};
 
 	/**
@@ -105,7 +210,7 @@ public:
 	 *
 	 * @return The list of triangles to build a mesh.
 	 */
-	std::vector<std::array<int, 3>> get_triangle_list() const
+	const std::vector<std::array<int, 3>>& get_triangle_list() const
 	{
 		return triangle_list;
 	};
@@ -115,9 +220,12 @@ public:
 	 *
 	 * @return The mean of the model.
 	 */
-	const Eigen::VectorXf& get_mean() const
+	Eigen::Map<const Eigen::VectorXf> get_mean() const
 	{
-		return mean;
+		if (has_external_storage()) {
+			return Eigen::Map<const Eigen::VectorXf>(external_mean, external_data_dimension);
+		}
+		return Eigen::Map<const Eigen::VectorXf>(mean.data(), mean.size());
 	};
 
 	/**
@@ -130,7 +238,7 @@ public:
 	{
 		vertex_index *= 3;
 		// Note: We could maybe also return a const& to mean.block(...).
-		return Eigen::Vector3f(mean(vertex_index), mean(vertex_index + 1), mean(vertex_index + 2));
+		return get_mean().segment<3>(vertex_index);
 	};
 
 	/**
@@ -165,13 +273,15 @@ public:
 	 */
 	Eigen::VectorXf draw_sample(std::vector<float> coefficients) const
 	{
-		// Fill the rest with zeros if not all coefficients are given:
-		if (coefficients.size() < get_num_principal_components()) {
-			coefficients.resize(get_num_principal_components());
-		}
-		Eigen::Map<Eigen::VectorXf> alphas(coefficients.data(), coefficients.size());
+		// If not all coefficients are given, the rest is zero, so we only use the first columns of the basis:
+		const int num_coefficients = std::min(static_cast<int>(coefficients.size()), get_num_principal_components());
+		Eigen::Map<Eigen::VectorXf> alphas(coefficients.data(), num_coefficients);
 
-		Eigen::VectorXf model_sample = mean + rescaled_pca_basis * alphas;
+		if (!has_external_storage() && basis_storage == PcaBasisStorage::OrthonormalOnly) {
+			// Rescale the coefficients instead of the basis:
+			return get_mean() + orthonormal_pca_basis.leftCols(num_coefficients) * (alphas.array() * eigenvalues.head(num_coefficients).array().sqrt()).matrix();
+		}
+		Eigen::VectorXf model_sample = get_mean() + get_rescaled_pca_basis().leftCols(num_coefficients) * alphas;
 
 		return model_sample;
 	};
@@ -186,6 +296,109 @@ public:
 		return draw_sample(coeffs_float);
 	};
 
+	/**
+	 * Computes many samples of the model at once, one per column of \p coefficients.
+	 *
+	 * This computes all samples with one matrix-matrix product, which is much faster
+	 * than calling draw_sample() for each of them. The coefficients should follow a
+	 * standard normal distribution. If \p coefficients has fewer rows than the model
+	 * has principal components, the missing coefficients are zero.
+	 *
+	 * If \p thread_pool is given, the samples are split into one block per thread.
+	 * \p samples is only reallocated if its size changes, so it can be reused for
+	 * the next batch.
+	 *
+	 * @param[in] coefficients A K x M matrix with the coefficients of M samples.
+	 * @param[out] samples A 3V x M matrix with the samples, each column in the format [x_1 y_1 z_1 x_2 ...].
+	 * @param[in] thread_pool An optional pool to compute the samples in parallel.
+	 */
+	void draw_samples(const Eigen::Ref<const Eigen::MatrixXf>& coefficients, Eigen::MatrixXf& samples, core::ThreadPool* thread_pool = nullptr) const
+	{
+		assert(coefficients.rows() <= get_num_principal_components());
+		const auto num_coefficients = coefficients.rows();
+		const auto num_samples = coefficients.cols();
+		const auto mean = get_mean();
+		samples.resize(get_data_dimension(), num_samples);
+
+		const bool rescale_coefficients = !has_external_storage() && basis_storage == PcaBasisStorage::OrthonormalOnly;
+		Eigen::MatrixXf rescaled_coefficients;
+		if (rescale_coefficients) { // Rescale the (small) coefficients matrix instead of the basis
+			rescaled_coefficients = eigenvalues.head(num_coefficients).cwiseSqrt().asDiagonal() * coefficients;
+		}
+		const auto basis = rescale_coefficients ? get_orthonormal_pca_basis().leftCols(num_coefficients) : get_rescaled_pca_basis().leftCols(num_coefficients);
+
+		const auto draw_block = [&](Eigen::Index first_sample, Eigen::Index num_block_samples) {
+			auto block = samples.middleCols(first_sample, num_block_samples);
+			if (rescale_coefficients) {
+				block.noalias() = basis * rescaled_coefficients.middleCols(first_sample, num_block_samples);
+			}
+			else {
+				block.noalias() = basis * coefficients.middleCols(first_sample, num_block_samples);
+			}
+			block.colwise() += mean;
+		};
+		if (!thread_pool || thread_pool->get_num_threads() == 1 || num_samples < 2) {
+			draw_block(0, num_samples);
+			return;
+		}
+		const int num_blocks = static_cast<int>(std::min<Eigen::Index>(thread_pool->get_num_threads(), num_samples));
+		thread_pool->parallel_for(0, num_blocks, [&](int b, int /* thread_index */) {
+			const Eigen::Index first_sample = num_samples * b / num_blocks;
+			draw_block(first_sample, num_samples * (b + 1) / num_blocks - first_sample);
+		});
+	};
+
+	/**
+	 * Computes many samples of the model at once, one per column of \p coefficients.
+	 * See draw_samples(const Eigen::Ref<const Eigen::MatrixXf>&, Eigen::MatrixXf&, core::ThreadPool*) const.
+	 *
+	 * @param[in] coefficients A K x M matrix with the coefficients of M samples.
+	 * @return A 3V x M matrix with the samples.
+	 */
+	Eigen::MatrixXf draw_samples(const Eigen::Ref<const Eigen::MatrixXf>& coefficients) const
+	{
+		Eigen::MatrixXf samples;
+		draw_samples(coefficients, samples);
+		return samples;
+	};
+
+	/**
+	 * Computes a sample of the model with the given PCA coefficients, but only at the
+	 * given vertices, and writes it into \p result, in the format [x_1 y_1 z_1 x_2 ...].
+	 *
+	 * The cost is proportional to the number of vertices given, not to the size of the
+	 * model. Missing coefficients are assumed to be zero, like in draw_sample(). Nothing
+	 * is allocated, unless only the orthonormal basis is stored (see PcaBasisStorage).
+	 * To reconstruct the same vertices many times, fitting::LandmarkSubspace gathers
+	 * their rows once and is faster.
+	 *
+	 * @param[in] vertex_ids The vertices to compute.
+	 * @param[in] coefficients The PCA coefficients used to generate the sample.
+	 * @param[out] result A vector of size 3 * vertex_ids.size() for the result.
+	 */
+	void draw_sample_at_points(const std::vector<int>& vertex_ids, const std::vector<float>& coefficients, Eigen::Ref<Eigen::VectorXf> result) const
+	{
+		assert(result.size() == 3 * static_cast<Eigen::Index>(vertex_ids.size()));
+		const int num_coefficients = std::min(static_cast<int>(coefficients.size()), get_num_principal_components());
+		const auto mean = get_mean();
+		Eigen::Map<const Eigen::VectorXf> alphas(coefficients.data(), num_coefficients);
+		if (!has_external_storage() && basis_storage == PcaBasisStorage::OrthonormalOnly)
+		{
+			// Rescale the coefficients instead of the basis:
+			const Eigen::VectorXf rescaled_alphas = alphas.cwiseProduct(eigenvalues.head(num_coefficients).cwiseSqrt());
+			for (std::size_t i = 0; i < vertex_ids.size(); ++i) {
+				result.segment<3>(3 * i) = mean.segment<3>(3 * vertex_ids[i]) + orthonormal_pca_basis.block(3 * vertex_ids[i], 0, 3, num_coefficients) * rescaled_alphas;
+			}
+			return;
+		}
+		const auto basis = get_rescaled_pca_basis();
+		for (std::size_t i = 0; i < vertex_ids.size(); ++i)
+		{
+			assert(3 * vertex_ids[i] < get_data_dimension());
+			result.segment<3>(3 * i) = mean.segment<3>(3 * vertex_ids[i]) + basis.block(3 * vertex_ids[i], 0, 3, num_coefficients) * alphas;
+		}
+	};
+
 	/**
 	 * Returns the PCA basis matrix, i.e. the eigenvectors.
 	 * Each column of the matrix is an eigenvector.
@@ -194,9 +407,16 @@ public:
 	 *
 	 * @return Returns the rescaled PCA basis matrix.
 	 */
-	const Eigen::MatrixXf& get_rescaled_pca_basis() const
+	Eigen::Map<const Eigen::MatrixXf> get_rescaled_pca_basis() const
 	{
-		return rescaled_pca_basis;
+		if (has_external_storage()) {
+			return Eigen::Map<const Eigen::MatrixXf>(external_rescaled_pca_basis, external_data_dimension, external_num_principal_components);
+		}
+		if (basis_storage == PcaBasisStorage::OrthonormalOnly) {
+			const auto& basis = get_derived_basis();
+			return Eigen::Map<const Eigen::MatrixXf>(basis.data(), basis.rows(), basis.cols());
+		}
+		return Eigen::Map<const Eigen::MatrixXf>(rescaled_pca_basis.data(), rescaled_pca_basis.rows(), rescaled_pca_basis.cols());
 	};
 
 	/**
@@ -214,7 +434,10 @@ public:
 	{
 		vertex_id *= 3; // the basis is stored in the format [x y z x y z ...]
 		assert(vertex_id < get_data_dimension()); // Make sure the given vertex index isn't larger than the number of model vertices.
-		return rescaled_pca_basis.block(vertex_id, 0, 3, rescaled_pca_basis.cols());
+		if (!has_external_storage() && basis_storage == PcaBasisStorage::OrthonormalOnly) {
+			return orthonormal_pca_basis.block(vertex_id, 0, 3, get_num_principal_components()) * eigenvalues.array().sqrt().matrix().asDiagonal();
+		}
+		return get_rescaled_pca_basis().block(vertex_id, 0, 3, get_num_principal_components());
 	};
 
 	/**
@@ -225,9 +448,16 @@ public:
 	 *
 	 * @return Returns the orthonormal PCA basis matrix.
 	 */
-	const Eigen::MatrixXf& get_orthonormal_pca_basis() const
+	Eigen::Map<const Eigen::MatrixXf> get_orthonormal_pca_basis() const
 	{
-		return orthonormal_pca_basis;
+		if (has_external_storage()) {
+			return Eigen::Map<const Eigen::MatrixXf>(external_orthonormal_pca_basis, external_data_dimension, external_num_principal_components);
+		}
+		if (basis_storage == PcaBasisStorage::RescaledOnly) {
+			const auto& basis = get_derived_basis();
+			return Eigen::Map<const Eigen::MatrixXf>(basis.data(), basis.rows(), basis.cols());
+		}
+		return Eigen::Map<const Eigen::MatrixXf>(orthonormal_pca_basis.data(), orthonormal_pca_basis.rows(), orthonormal_pca_basis.cols());
 	};
 
 	/**
@@ -243,7 +473,10 @@ public:
 	{
 		vertex_id *= 3; // the basis is stored in the format [x y z x y z ...]
 		assert(vertex_id < get_data_dimension()); // Make sure the given vertex index isn't larger than the number of model vertices.
-		return orthonormal_pca_basis.block(vertex_id, 0, 3, orthonormal_pca_basis.cols());
+		if (!has_external_storage() && basis_storage == PcaBasisStorage::RescaledOnly) {
+			return rescaled_pca_basis.block(vertex_id, 0, 3, get_num_principal_components()) * eigenvalues.array().sqrt().inverse().matrix().asDiagonal();
+		}
+		return get_orthonormal_pca_basis().block(vertex_id, 0, 3, get_num_principal_components());
 	};
 
 	/**
@@ -251,9 +484,12 @@ public:
 	 *
 	 * @return The eigenvalues.
 	 */
-	const Eigen::VectorXf& get_eigenvalues() const
+	Eigen::Map<const Eigen::VectorXf> get_eigenvalues() const
 	{
-		return eigenvalues;
+		if (has_external_storage()) {
+			return Eigen::Map<const Eigen::VectorXf>(external_eigenvalues, external_num_principal_components);
+		}
+		return Eigen::Map<const Eigen::VectorXf>(eigenvalues.data(), eigenvalues.size());
 	};
 
 	/**
@@ -265,7 +501,7 @@ public:
 	float get_eigenvalue(int index) const
 	{
 		// no assert - Eigen checks access with an assert in debug builds
-		return eigenvalues(index);
+		return get_eigenvalues()(index);
 	};
 
 private:
@@ -276,6 +512,36 @@ private:
 
 	std::vector<std::array<int, 3>> triangle_list; ///< List of triangles that make up the mesh of the model.
 
+	PcaBasisStorage basis_storage = PcaBasisStorage::Both; ///< Which of the two bases above is stored. The other one is empty.
+	mutable std::shared_ptr<const Eigen::MatrixXf> derived_basis; ///< The basis that isn't stored, computed on first request, see get_derived_basis().
+
+	// Returns the basis that isn't stored, computing it if it hasn't been requested yet.
+	// Thread-safe: If several threads compute it at the same time, all use the first result.
+	const Eigen::MatrixXf& get_derived_basis() const
+	{
+		assert(basis_storage != PcaBasisStorage::Both);
+		auto current = std::atomic_load(&derived_basis);
+		if (current) {
+			return *current;
+		}
+		current = std::make_shared<const Eigen::MatrixXf>(basis_storage == PcaBasisStorage::RescaledOnly ? normalise_pca_basis(rescaled_pca_basis, eigenvalues) : rescale_pca_basis(orthonormal_pca_basis, eigenvalues));
+		std::shared_ptr<const Eigen::MatrixXf> expected;
+		if (!std::atomic_compare_exchange_strong(&derived_basis, &expected, current)) {
+			current = expected; // Another thread was faster, use its basis.
+		}
+		return *current;
+	};
+
+	// If the model references external data (e.g. a memory-mapped file), the four matrices
+	// above are empty, and the getters return maps of these pointers instead:
+	std::shared_ptr<const void> external_storage; ///< Keeps the external data alive.
+	const float* external_mean = nullptr;
+	const float* external_orthonormal_pca_basis = nullptr;
+	const float* external_rescaled_pca_basis = nullptr;
+	const float* external_eigenvalues = nullptr;
+	int external_data_dimension = 0;
+	int external_num_principal_components = 0;
+
 	friend class cereal::access;
 	/**
 	 * Serialises this class using cereal.
@@ -285,11 +551,36 @@ private:
 	template <class Archive>
 	void serialize(Archive& archive)
 	{
+		if (Archive::is_saving::value && (has_external_storage() || basis_storage == PcaBasisStorage::RescaledOnly))
+		{
+			// Save copies of the external data, or of the derived orthonormal basis, in the same format:
+			Eigen::VectorXf mean = get_mean();
+			Eigen::MatrixXf orthonormal_pca_basis = has_external_storage() ? Eigen::MatrixXf(get_orthonormal_pca_basis()) : normalise_pca_basis(rescaled_pca_basis, this->eigenvalues);
+			Eigen::VectorXf eigenvalues = get_eigenvalues();
+			archive(CEREAL_NVP(mean), CEREAL_NVP(orthonormal_pca_basis), CEREAL_NVP(eigenvalues), CEREAL_NVP(triangle_list));
+			return;
+		}
 		archive(CEREAL_NVP(mean), CEREAL_NVP(orthonormal_pca_basis), CEREAL_NVP(eigenvalues), CEREAL_NVP(triangle_list));
-		// If we're loading, we have to recompute the rescaled basis, so that it's available (we don't store it anymore):
+		// If we're loading, we have to recompute the rescaled basis, so that it's available (we don't store it anymore).
+		// The storage policy of the model that is loaded into is kept:
 		if (Archive::is_loading::value)
 		{
-			rescaled_pca_basis = rescale_pca_basis(orthonormal_pca_basis, eigenvalues);
+			external_storage.reset();
+			std::atomic_store(&derived_basis, std::shared_ptr<const Eigen::MatrixXf>());
+			if (basis_storage == PcaBasisStorage::Both) {
+				rescaled_pca_basis = rescale_pca_basis(orthonormal_pca_basis, eigenvalues);
+			}
+			else if (basis_storage == PcaBasisStorage::RescaledOnly) {
+				// Rescale in place, so we never hold both bases:
+				rescaled_pca_basis.swap(orthonormal_pca_basis);
+				orthonormal_pca_basis.resize(0, 0);
+				for (int basis = 0; basis < rescaled_pca_basis.cols(); ++basis) {
+					rescaled_pca_basis.col(basis) *= std::sqrt(eigenvalues(basis));
+				}
+			}
+			else {
+				rescaled_pca_basis.resize(0, 0);
+			}
 		}
 	};
 };
@@ -303,12 +594,14 @@ private:
  * load a PCA model.
  *
  * @param[in] filename Filename to a model.
+ * @param[in] basis_storage Which of the PCA bases to keep in memory.
  * @return The loaded PCA model.
  * @throw std::runtime_error When the file given in \c filename fails to be opened (most likely because the file doesn't exist).
  */
-inline PcaModel load_pca_model(std::string filename)
+inline PcaModel load_pca_model(std::string filename, PcaBasisStorage basis_storage = PcaBasisStorage::Both)
 {
 	PcaModel model;
+	model.set_basis_storage(basis_storage); // applied while loading, to avoid holding both bases
 
 	std::ifstream file(filename, std::ios::binary);
 	if (file.fail()) {
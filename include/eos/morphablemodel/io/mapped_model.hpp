@@ -0,0 +1,395 @@
+/*
+ * eos - A 3D Morphable Model fitting library written in modern C++11/14.
+ *
+ * File: include/eos/morphablemodel/io/mapped_model.hpp
+ *
+ * Copyright 2016 Patrik Huber
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#ifndef IO_MAPPED_MODEL_HPP_
+#define IO_MAPPED_MODEL_HPP_
+
+#include "eos/morphablemodel/MorphableModel.hpp"
+#include "eos/morphablemodel/PcaModel.hpp"
+#include "eos/morphablemodel/Blendshape.hpp"
+
+#include "Eigen/Core"
+
+#include "boost/interprocess/file_mapping.hpp"
+#include "boost/interprocess/mapped_region.hpp"
+
+#include <string>
+#include <vector>
+#include <array>
+#include <memory>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <algorithm>
+#include <fstream>
+#include <stdexcept>
+#include <cassert>
+
+namespace eos {
+	namespace morphablemodel {
+
+/**
+ * @brief Layout of the memory-mappable model format.
+ *
+ * A file consists of a 64 byte header, a table of contents with one 64 byte entry per
+ * array, and the arrays themselves, each starting at a multiple of 64 bytes. All values
+ * are stored in the byte order of the machine that wrote the file; a marker in the
+ * header lets the loader refuse files with a different byte order.
+ *
+ * Matrices are stored column-major, like Eigen's default, so that they can be used
+ * in place with an Eigen::Map. Triangle lists are stored as rows of 3 ints.
+ */
+		namespace mapped_format {
+
+const char magic[8] = { 'E', 'O', 'S', 'M', 'M', 'A', 'P', '\0' };
+const std::uint32_t version = 1;
+const std::uint32_t byte_order_mark = 0x01020304;
+const std::size_t alignment = 64;
+
+enum class ElementType : std::uint32_t {
+	Float32 = 0,
+	Int32 = 1,
+	Float64 = 2,
+	Char = 3
+};
+
+struct Header
+{
+	char magic[8];
+	std::uint32_t version;
+	std::uint32_t byte_order_mark;
+	std::uint64_t num_arrays;
+	std::uint64_t table_offset;
+	char reserved[32];
+};
+static_assert(sizeof(Header) == 64, "mapped_format::Header must be 64 bytes.");
+
+struct ArrayEntry
+{
+	char name[32]; ///< Zero-terminated.
+	std::uint32_t element_type; ///< An ElementType.
+	std::uint32_t reserved;
+	std::uint64_t rows;
+	std::uint64_t cols;
+	std::uint64_t offset; ///< From the start of the file.
+};
+static_assert(sizeof(ArrayEntry) == 64, "mapped_format::ArrayEntry must be 64 bytes.");
+
+		} /* namespace mapped_format */
+
+		namespace detail {
+
+// An array to be written by save_mapped_model(). The data is not owned.
+struct MappedArrayToWrite
+{
+	std::string name;
+	mapped_format::ElementType element_type;
+	std::uint64_t rows;
+	std::uint64_t cols;
+	const void* data;
+	std::size_t element_size;
+};
+
+inline std::uint64_t align_offset(std::uint64_t offset)
+{
+	return (offset + mapped_format::alignment - 1) / mapped_format::alignment * mapped_format::alignment;
+};
+
+inline void add_pca_model_arrays(const std::string& prefix, const PcaModel& model, std::vector<MappedArrayToWrite>& arrays)
+{
+	using mapped_format::ElementType;
+	const auto rows = static_cast<std::uint64_t>(model.get_data_dimension());
+	const auto cols = static_cast<std::uint64_t>(model.get_num_principal_components());
+	arrays.push_back({ prefix + ".mean", ElementType::Float32, rows, 1, model.get_mean().data(), sizeof(float) });
+	arrays.push_back({ prefix + ".orthonormal_pca_basis", ElementType::Float32, rows, cols, model.get_orthonormal_pca_basis().data(), sizeof(float) });
+	arrays.push_back({ prefix + ".rescaled_pca_basis", ElementType::Float32, rows, cols, model.get_rescaled_pca_basis().data(), sizeof(float) });
+	arrays.push_back({ prefix + ".eigenvalues", ElementType::Float32, cols, 1, model.get_eigenvalues().data(), sizeof(float) });
+	arrays.push_back({ prefix + ".triangle_list", ElementType::Int32, model.get_triangle_list().size(), 3, model.get_triangle_list().data(), sizeof(int) });
+};
+
+// For find_mapped_array(): The array can have any number of columns (e.g. one per blendshape).
+const std::uint64_t any_number_of_cols = std::numeric_limits<std::uint64_t>::max();
+
+// Looks up an array in a mapped file and checks its type, its number of columns (unless
+// any_number_of_cols is given) and that it lies inside the file.
+inline const mapped_format::ArrayEntry* find_mapped_array(const char* base, std::size_t file_size, const std::string& name, mapped_format::ElementType element_type, std::uint64_t cols)
+{
+	const auto& header = *reinterpret_cast<const mapped_format::Header*>(base);
+	const auto* table = reinterpret_cast<const mapped_format::ArrayEntry*>(base + header.table_offset);
+	for (std::uint64_t i = 0; i < header.num_arrays; ++i)
+	{
+		const auto& entry = table[i];
+		if (std::strncmp(entry.name, name.c_str(), sizeof(entry.name)) != 0) {
+			continue;
+		}
+		if (entry.element_type != static_cast<std::uint32_t>(element_type)) {
+			throw std::runtime_error("Array '" + name + "' in the mapped model file has an unexpected element type.");
+		}
+		if (cols != any_number_of_cols && entry.cols != cols) {
+			throw std::runtime_error("Array '" + name + "' in the mapped model file has " + std::to_string(entry.cols) + " columns, but should have " + std::to_string(cols) + ".");
+		}
+		const std::size_t element_size = (element_type == mapped_format::ElementType::Float64) ? 8 : (element_type == mapped_format::ElementType::Char ? 1 : 4);
+		// rows * cols * element_size <= file_size - offset, written so that none of the (untrusted) sizes can
+		// overflow. An array without columns is checked as if it had one:
+		const bool out_of_bounds = entry.offset > file_size || entry.rows > (file_size - entry.offset) / element_size / std::max<std::uint64_t>(entry.cols, 1);
+		if (entry.offset % mapped_format::alignment != 0 || out_of_bounds) {
+			throw std::runtime_error("Array '" + name + "' in the mapped model file is out of bounds. The file is probably truncated.");
+		}
+		return &entry;
+	}
+	return nullptr;
+};
+
+inline const mapped_format::ArrayEntry& get_mapped_array(const char* base, std::size_t file_size, const std::string& name, mapped_format::ElementType element_type, std::uint64_t cols)
+{
+	const auto* entry = find_mapped_array(base, file_size, name, element_type, cols);
+	if (!entry) {
+		throw std::runtime_error("The mapped model file doesn't contain the array '" + name + "'.");
+	}
+	return *entry;
+};
+
+// Creates a PcaModel whose mean, bases and eigenvalues point into the mapped region.
+inline PcaModel map_pca_model(const std::shared_ptr<const boost::interprocess::mapped_region>& region, const std::string& prefix)
+{
+	using mapped_format::ElementType;
+	const char* base = static_cast<const char*>(region->get_address());
+	const std::size_t file_size = region->get_size();
+	const auto& mean = get_mapped_array(base, file_size, prefix + ".mean", ElementType::Float32, 1);
+	const auto& eigenvalues = get_mapped_array(base, file_size, prefix + ".eigenvalues", ElementType::Float32, 1);
+	const auto& orthonormal_basis = get_mapped_array(base, file_size, prefix + ".orthonormal_pca_basis", ElementType::Float32, eigenvalues.rows); // one column per eigenvalue
+	const auto& rescaled_basis = get_mapped_array(base, file_size, prefix + ".rescaled_pca_basis", ElementType::Float32, eigenvalues.rows);
+	const auto& triangles = get_mapped_array(base, file_size, prefix + ".triangle_list", ElementType::Int32, 3);
+
+	if (mean.rows == 0) {
+		return PcaModel(); // e.g. the colour model of a shape-only model
+	}
+	if (orthonormal_basis.rows != mean.rows || rescaled_basis.rows != mean.rows || orthonormal_basis.cols != rescaled_basis.cols || eigenvalues.rows != rescaled_basis.cols || triangles.cols != 3) {
+		throw std::runtime_error("The arrays of the PCA model '" + prefix + "' in the mapped model file have inconsistent sizes.");
+	}
+
+	// The triangle list is small and a std::vector in the PcaModel, so it is copied:
+	const auto* triangle_data = reinterpret_cast<const std::array<int, 3>*>(base + triangles.offset);
+	std::vector<std::array<int, 3>> triangle_list(triangle_data, triangle_data + triangles.rows);
+
+	const auto floats = [base](const mapped_format::ArrayEntry& entry) { return reinterpret_cast<const float*>(base + entry.offset); };
+	const auto rows = static_cast<Eigen::Index>(mean.rows);
+	const auto cols = static_cast<Eigen::Index>(rescaled_basis.cols);
+	return PcaModel(Eigen::Map<const Eigen::VectorXf>(floats(mean), rows), Eigen::Map<const Eigen::MatrixXf>(floats(orthonormal_basis), rows, cols), Eigen::Map<const Eigen::MatrixXf>(floats(rescaled_basis), rows, cols), Eigen::Map<const Eigen::VectorXf>(floats(eigenvalues), cols), triangle_list, region);
+};
+
+// Maps the whole file read-only and checks its header.
+inline std::shared_ptr<const boost::interprocess::mapped_region> map_model_file(const std::string& filename)
+{
+	using namespace boost::interprocess;
+	std::shared_ptr<const mapped_region> region;
+	try {
+		const file_mapping file(filename.c_str(), read_only);
+		region = std::make_shared<const mapped_region>(file, read_only); // The mapping stays valid after the file_mapping is closed.
+	}
+	catch (const interprocess_exception& e) {
+		throw std::runtime_error("Error memory-mapping the given file: " + filename + " (" + e.what() + ")");
+	}
+	if (region->get_size() < sizeof(mapped_format::Header)) {
+		throw std::runtime_error("The given file is too small to be a mapped model file: " + filename);
+	}
+	const auto& header = *static_cast<const mapped_format::Header*>(region->get_address());
+	if (std::memcmp(header.magic, mapped_format::magic, sizeof(header.magic)) != 0) {
+		throw std::runtime_error("The given file is not a mapped model file: " + filename);
+	}
+	if (header.byte_order_mark != mapped_format::byte_order_mark) {
+		throw std::runtime_error("The given mapped model file was written on a machine with a different byte order: " + filename);
+	}
+	if (header.version != mapped_format::version) {
+		throw std::runtime_error("The given mapped model file has version " + std::to_string(header.version) + ", but only version " + std::to_string(mapped_format::version) + " is supported: " + filename);
+	}
+	if (header.table_offset > region->get_size() || header.num_arrays > (region->get_size() - header.table_offset) / sizeof(mapped_format::ArrayEntry)) {
+		throw std::runtime_error("The mapped model file is truncated: " + filename);
+	}
+	if (header.table_offset % alignof(mapped_format::ArrayEntry) != 0) {
+		throw std::runtime_error("The array table of the mapped model file is misaligned. The file is probably corrupt: " + filename);
+	}
+	return region;
+};
+
+// Creates a MorphableModel whose PCA models point into the mapped region.
+inline MorphableModel map_morphable_model(const std::shared_ptr<const boost::interprocess::mapped_region>& region)
+{
+	const char* base = static_cast<const char*>(region->get_address());
+	const auto& texcoords = get_mapped_array(base, region->get_size(), "texture_coordinates", mapped_format::ElementType::Float64, 2);
+	const auto* texcoord_data = reinterpret_cast<const std::array<double, 2>*>(base + texcoords.offset);
+	return MorphableModel(map_pca_model(region, "shape"), map_pca_model(region, "color"), std::vector<std::array<double, 2>>(texcoord_data, texcoord_data + texcoords.rows));
+};
+
+// Copies the blendshapes out of the mapped region. The filename is only used in error messages.
+inline std::vector<Blendshape> map_blendshapes(const std::shared_ptr<const boost::interprocess::mapped_region>& region, const std::string& filename)
+{
+	using mapped_format::ElementType;
+	const char* base = static_cast<const char*>(region->get_address());
+	const auto& deformations = get_mapped_array(base, region->get_size(), "blendshapes", ElementType::Float32, any_number_of_cols); // one column per blendshape
+	const auto& names = get_mapped_array(base, region->get_size(), "blendshape_names", ElementType::Char, 1);
+
+	const Eigen::Map<const Eigen::MatrixXf> blendshapes_as_basis(reinterpret_cast<const float*>(base + deformations.offset), deformations.rows, deformations.cols);
+	const char* name = base + names.offset;
+	const char* names_end = name + names.rows;
+	std::vector<Blendshape> blendshapes(deformations.cols);
+	for (std::size_t i = 0; i < blendshapes.size(); ++i)
+	{
+		if (name >= names_end) {
+			throw std::runtime_error("The mapped model file has fewer blendshape names than blendshapes: " + filename);
+		}
+		const std::size_t name_length = strnlen(name, names_end - name);
+		if (name_length == static_cast<std::size_t>(names_end - name)) {
+			throw std::runtime_error("A blendshape name in the mapped model file is not terminated. The file is probably corrupt: " + filename);
+		}
+		blendshapes[i].name = std::string(name, name_length);
+		name += name_length + 1;
+		blendshapes[i].deformation = blendshapes_as_basis.col(i);
+	}
+	return blendshapes;
+};
+
+// Adds the arrays of a model and its blendshapes. The blendshapes are converted into
+// the given matrix and string, which have to stay alive until the file is written.
+inline void add_morphable_model_arrays(const MorphableModel& model, const std::vector<Blendshape>& blendshapes, Eigen::MatrixXf& blendshapes_as_basis, std::string& blendshape_names, std::vector<MappedArrayToWrite>& arrays)
+{
+	using mapped_format::ElementType;
+	add_pca_model_arrays("shape", model.get_shape_model(), arrays);
+	add_pca_model_arrays("color", model.get_color_model(), arrays);
+	const auto& texture_coordinates = model.get_texture_coordinates();
+	arrays.push_back({ "texture_coordinates", ElementType::Float64, texture_coordinates.size(), 2, texture_coordinates.data(), sizeof(double) });
+
+	if (!blendshapes.empty())
+	{
+		blendshapes_as_basis = to_matrix(blendshapes);
+		for (const auto& blendshape : blendshapes) {
+			blendshape_names += blendshape.name + '\0';
+		}
+	}
+	arrays.push_back({ "blendshapes", ElementType::Float32, static_cast<std::uint64_t>(blendshapes_as_basis.rows()), static_cast<std::uint64_t>(blendshapes_as_basis.cols()), blendshapes_as_basis.data(), sizeof(float) });
+	arrays.push_back({ "blendshape_names", ElementType::Char, blendshape_names.size(), 1, blendshape_names.data(), 1 });
+};
+
+// Writes a file in the mapped format with the given arrays.
+inline void write_mapped_file(const std::string& filename, const std::vector<MappedArrayToWrite>& arrays)
+{
+	// Lay out the file:
+	mapped_format::Header header = {};
+	std::memcpy(header.magic, mapped_format::magic, sizeof(header.magic));
+	header.version = mapped_format::version;
+	header.byte_order_mark = mapped_format::byte_order_mark;
+	header.num_arrays = arrays.size();
+	header.table_offset = sizeof(mapped_format::Header);
+	std::vector<mapped_format::ArrayEntry> table(arrays.size());
+	std::uint64_t offset = align_offset(header.table_offset + arrays.size() * sizeof(mapped_format::ArrayEntry));
+	for (std::size_t i = 0; i < arrays.size(); ++i)
+	{
+		assert(arrays[i].name.size() < sizeof(table[i].name));
+		std::memset(&table[i], 0, sizeof(table[i]));
+		std::strncpy(table[i].name, arrays[i].name.c_str(), sizeof(table[i].name) - 1);
+		table[i].element_type = static_cast<std::uint32_t>(arrays[i].element_type);
+		table[i].rows = arrays[i].rows;
+		table[i].cols = arrays[i].cols;
+		table[i].offset = offset;
+		offset = align_offset(offset + arrays[i].rows * arrays[i].cols * arrays[i].element_size);
+	}
+
+	std::ofstream file(filename, std::ios::binary);
+	if (file.fail()) {
+		throw std::runtime_error("Error opening given file for writing: " + filename);
+	}
+	const char padding[mapped_format::alignment] = {};
+	file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	file.write(reinterpret_cast<const char*>(table.data()), table.size() * sizeof(mapped_format::ArrayEntry));
+	std::uint64_t position = header.table_offset + table.size() * sizeof(mapped_format::ArrayEntry);
+	for (std::size_t i = 0; i < arrays.size(); ++i)
+	{
+		file.write(padding, table[i].offset - position);
+		const auto num_bytes = arrays[i].rows * arrays[i].cols * arrays[i].element_size;
+		file.write(static_cast<const char*>(arrays[i].data), num_bytes);
+		position = table[i].offset + num_bytes;
+	}
+	if (file.fail()) {
+		throw std::runtime_error("Error writing the mapped model file: " + filename);
+	}
+};
+
+		} /* namespace detail */
+
+/**
+ * @brief Saves a Morphable Model, and optionally blendshapes, in the memory-mappable
+ * format that load_mapped_model() reads.
+ *
+ * In contrast to save_model(), the rescaled PCA bases are stored as well, so that
+ * nothing has to be computed when loading.
+ *
+ * @param[in] model The model to be saved.
+ * @param[in] filename Filename for the model.
+ * @param[in] blendshapes Optional blendshapes to be stored in the same file.
+ * @throw std::runtime_error When the file can't be written.
+ */
+inline void save_mapped_model(const MorphableModel& model, std::string filename, const std::vector<Blendshape>& blendshapes = std::vector<Blendshape>())
+{
+	std::vector<detail::MappedArrayToWrite> arrays;
+	Eigen::MatrixXf blendshapes_as_basis;
+	std::string blendshape_names;
+	detail::add_morphable_model_arrays(model, blendshapes, blendshapes_as_basis, blendshape_names, arrays);
+	detail::write_mapped_file(filename, arrays);
+};
+
+/**
+ * @brief Loads a Morphable Model from a file written by save_mapped_model(), by
+ * memory-mapping it.
+ *
+ * The means, PCA bases and eigenvalues of the returned model point directly into the
+ * mapped file, nothing is copied or computed (apart from the small triangle lists and
+ * texture coordinates). The file is mapped read-only, so all processes on a machine
+ * that load the same file share one copy of it in the page cache. The mapping is
+ * released when the model and all copies of it have been destroyed.
+ *
+ * @param[in] filename Filename to a mapped model file.
+ * @return The loaded Morphable Model.
+ * @throw std::runtime_error When the file can't be mapped or is not a valid mapped model file.
+ */
+inline MorphableModel load_mapped_model(std::string filename)
+{
+	return detail::map_morphable_model(detail::map_model_file(filename));
+};
+
+/**
+ * @brief Loads the blendshapes from a file written by save_mapped_model().
+ *
+ * Blendshapes own their deformation vectors, so they are copied out of the mapped
+ * file. They are small compared to the PCA bases.
+ *
+ * @param[in] filename Filename to a mapped model file.
+ * @return The blendshapes stored in the file (which might be none).
+ * @throw std::runtime_error When the file can't be mapped or is not a valid mapped model file.
+ */
+inline std::vector<Blendshape> load_mapped_blendshapes(std::string filename)
+{
+	return detail::map_blendshapes(detail::map_model_file(filename), filename);
+};
+
+	} /* namespace morphablemodel */
+} /* namespace eos */
+
+#endif /* IO_MAPPED_MODEL_HPP_ */
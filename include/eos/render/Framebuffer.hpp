@@ -0,0 +1,366 @@
+/*
+ * eos - A 3D Morphable Model fitting library written in modern C++11/14.
+ *
+ * File: include/eos/render/Framebuffer.hpp
+ *
+ * Copyright 2017 Patrik Huber
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#ifndef FRAMEBUFFER_HPP_
+#define FRAMEBUFFER_HPP_
+
+#include "opencv2/core/core.hpp"
+
+#include <limits>
+#include <cstdint>
+#include <cassert>
+
+namespace eos {
+	namespace render {
+
+/**
+ * @brief A colour and a depth buffer that the renderers draw into.
+ *
+ * The colour buffer stores packed BGRA pixels (4 bytes, CV_8UC4), and the depth
+ * buffer stores one float per pixel (CV_32FC1). Both are contiguous, and the
+ * rasterisers access them through raw row pointers instead of cv::Mat::at<>().
+ *
+ * A framebuffer can be reused for many renderings: resize() only reallocates if
+ * the size changes, and clear() resets the pixels in place. get_colourbuffer() and
+ * get_depthbuffer() return cv::Mat headers that share the memory of the framebuffer,
+ * so they are overwritten by the next rendering. Use .clone() to keep a copy.
+ *
+ * For depth-only rendering, the framebuffer can be created without a colour buffer.
+ *
+ * A framebuffer can also cover only a region of the viewport, e.g. the bounding box
+ * of the projected face (see get_screen_bounding_box()). Then, only that region is
+ * allocated, cleared and drawn, while the triangles are still projected into the full
+ * viewport, so the pixel coordinates stay those of the full image. The rasterisers
+ * use get_region() to map a pixel (x, y) of the viewport to the pixel
+ * (x - region.x, y - region.y) of the buffers.
+ */
+class Framebuffer
+{
+public:
+	Framebuffer() = default;
+
+	/**
+	 * Creates a cleared framebuffer of the given size.
+	 *
+	 * @param[in] width The width in pixels.
+	 * @param[in] height The height in pixels.
+	 * @param[in] with_colour Whether to allocate a colour buffer, or only a depth buffer.
+	 */
+	Framebuffer(int width, int height, bool with_colour = true)
+	{
+		resize(width, height, with_colour);
+		clear();
+	};
+
+	/**
+	 * Creates a cleared framebuffer that covers only the given region of a viewport.
+	 *
+	 * @param[in] viewport_width The width of the full viewport in pixels.
+	 * @param[in] viewport_height The height of the full viewport in pixels.
+	 * @param[in] region The region of the viewport to allocate. It is clipped to the viewport.
+	 * @param[in] with_colour Whether to allocate a colour buffer, or only a depth buffer.
+	 */
+	Framebuffer(int viewport_width, int viewport_height, const cv::Rect& region, bool with_colour = true)
+	{
+		resize(viewport_width, viewport_height, region, with_colour);
+		clear();
+	};
+
+	/**
+	 * Changes the size of the framebuffer. Does nothing if the size stays the same.
+	 * Otherwise, the contents are undefined and clear() should be called.
+	 *
+	 * @param[in] width The width in pixels.
+	 * @param[in] height The height in pixels.
+	 * @param[in] with_colour Whether to allocate a colour buffer, or only a depth buffer.
+	 */
+	void resize(int width, int height, bool with_colour = true)
+	{
+		resize(width, height, cv::Rect(0, 0, width, height), with_colour);
+	};
+
+	/**
+	 * Changes the size of the framebuffer to the given region of a viewport. Only
+	 * reallocates if the size of the region changes, i.e. the region can move over
+	 * the viewport from one frame to the next without allocating memory. The contents
+	 * are undefined afterwards and clear() should be called.
+	 *
+	 * An empty region (e.g. one that lies outside of the viewport) gives empty buffers,
+	 * into which nothing is drawn.
+	 *
+	 * @param[in] viewport_width The width of the full viewport in pixels.
+	 * @param[in] viewport_height The height of the full viewport in pixels.
+	 * @param[in] region The region of the viewport to allocate. It is clipped to the viewport.
+	 * @param[in] with_colour Whether to allocate a colour buffer, or only a depth buffer.
+	 */
+	void resize(int viewport_width, int viewport_height, const cv::Rect& region, bool with_colour = true)
+	{
+		this->viewport_size = cv::Size(viewport_width, viewport_height);
+		this->region = region & cv::Rect(0, 0, viewport_width, viewport_height);
+		if (with_colour) {
+			colourbuffer.create(this->region.height, this->region.width, CV_8UC4);
+		}
+		else {
+			colourbuffer.release();
+		}
+		depthbuffer.create(this->region.height, this->region.width, CV_32FC1);
+	};
+
+	/**
+	 * Returns whether the framebuffer has a colour buffer.
+	 *
+	 * @return Whether there is a colour buffer.
+	 */
+	bool has_colour() const
+	{
+		return !colourbuffer.empty();
+	};
+
+	/**
+	 * Sets all pixels to the given colour and depth.
+	 *
+	 * @param[in] colour The colour to clear the colour buffer to, in BGRA.
+	 * @param[in] depth The depth to clear the depth buffer to. The default is "infinitely far away".
+	 */
+	void clear(const cv::Scalar& colour = cv::Scalar::all(0), float depth = std::numeric_limits<float>::max())
+	{
+		colourbuffer.setTo(colour);
+		depthbuffer.setTo(cv::Scalar(depth));
+	};
+
+	/**
+	 * Returns the width of the buffers, i.e. of the region.
+	 */
+	int width() const
+	{
+		return depthbuffer.cols;
+	};
+
+	/**
+	 * Returns the height of the buffers, i.e. of the region.
+	 */
+	int height() const
+	{
+		return depthbuffer.rows;
+	};
+
+	/**
+	 * Returns the width of the full viewport that the triangles are projected to. It
+	 * is the same as width() unless the framebuffer covers only a region.
+	 */
+	int viewport_width() const
+	{
+		return viewport_size.width;
+	};
+
+	int viewport_height() const
+	{
+		return viewport_size.height;
+	};
+
+	/**
+	 * Returns the region of the viewport that the buffers cover, in viewport pixels.
+	 * Its size is always width() x height().
+	 *
+	 * @return The region of the viewport.
+	 */
+	const cv::Rect& get_region() const
+	{
+		return region;
+	};
+
+	/**
+	 * Returns a pointer to the first pixel in row \p y of the colour buffer.
+	 * Each pixel is 4 bytes, in the order blue, green, red, alpha. The row and the
+	 * pixels are relative to get_region().
+	 *
+	 * @param[in] y A row index.
+	 * @return A pointer to the row.
+	 */
+	std::uint8_t* colour_row(int y)
+	{
+		assert(y >= 0 && y < colourbuffer.rows);
+		return colourbuffer.ptr<std::uint8_t>(y);
+	};
+
+	const std::uint8_t* colour_row(int y) const
+	{
+		assert(y >= 0 && y < colourbuffer.rows);
+		return colourbuffer.ptr<std::uint8_t>(y);
+	};
+
+	/**
+	 * Returns a pointer to the first pixel in row \p y of the depth buffer. The row
+	 * and the pixels are relative to get_region().
+	 *
+	 * @param[in] y A row index.
+	 * @return A pointer to the row.
+	 */
+	float* depth_row(int y)
+	{
+		assert(y >= 0 && y < depthbuffer.rows);
+		return depthbuffer.ptr<float>(y);
+	};
+
+	const float* depth_row(int y) const
+	{
+		assert(y >= 0 && y < depthbuffer.rows);
+		return depthbuffer.ptr<float>(y);
+	};
+
+	/**
+	 * Returns the colour buffer as CV_8UC4 (BGRA) image that shares the memory of
+	 * the framebuffer. It is empty if the framebuffer was created without colour.
+	 *
+	 * @return The colour buffer.
+	 */
+	const cv::Mat& get_colourbuffer() const
+	{
+		return colourbuffer;
+	};
+
+	/**
+	 * Returns the depth buffer as CV_32FC1 image that shares the memory of the
+	 * framebuffer. Pixels without a surface contain the depth given to clear().
+	 *
+	 * @return The depth buffer.
+	 */
+	const cv::Mat& get_depthbuffer() const
+	{
+		return depthbuffer;
+	};
+
+private:
+	cv::Mat colourbuffer;
+	cv::Mat depthbuffer;
+	cv::Size viewport_size;
+	cv::Rect region;
+};
+
+/**
+ * @brief A buffer with the index of the triangle that is visible at each pixel,
+ * and the barycentric coordinates of the pixel in that triangle.
+ *
+ * This can be rendered along with a depth buffer, for visibility tests and to find
+ * the correspondence between pixels and points on the mesh surface, without shading
+ * any colours.
+ */
+class TriangleIdBuffer
+{
+public:
+	TriangleIdBuffer() = default;
+
+	/**
+	 * Creates a cleared buffer of the given size.
+	 *
+	 * @param[in] width The width in pixels.
+	 * @param[in] height The height in pixels.
+	 */
+	TriangleIdBuffer(int width, int height)
+	{
+		resize(width, height);
+		clear();
+	};
+
+	/**
+	 * Changes the size of the buffer. Does nothing if the size stays the same.
+	 * When rendering into a Framebuffer that covers a region of the viewport, this
+	 * has to be the size of the region, and its pixels are relative to the region, too.
+	 *
+	 * @param[in] width The width in pixels.
+	 * @param[in] height The height in pixels.
+	 */
+	void resize(int width, int height)
+	{
+		triangle_ids.create(height, width, CV_32SC1);
+		barycentrics.create(height, width, CV_32FC3);
+	};
+
+	/**
+	 * Sets all triangle indices to -1, which means that no triangle is visible.
+	 */
+	void clear()
+	{
+		triangle_ids.setTo(cv::Scalar(-1));
+		barycentrics.setTo(cv::Scalar::all(0));
+	};
+
+	int width() const
+	{
+		return triangle_ids.cols;
+	};
+
+	int height() const
+	{
+		return triangle_ids.rows;
+	};
+
+	std::int32_t* triangle_id_row(int y)
+	{
+		assert(y >= 0 && y < triangle_ids.rows);
+		return triangle_ids.ptr<std::int32_t>(y);
+	};
+
+	/**
+	 * Returns a pointer to the first pixel in row \p y of the barycentric coordinates.
+	 * Each pixel has 3 floats, the weights of the 3 vertices of the triangle.
+	 *
+	 * @param[in] y A row index.
+	 * @return A pointer to the row.
+	 */
+	float* barycentric_row(int y)
+	{
+		assert(y >= 0 && y < barycentrics.rows);
+		return barycentrics.ptr<float>(y);
+	};
+
+	/**
+	 * Returns the triangle indices as CV_32SC1 image. The indices refer to the triangle
+	 * list of the rendered mesh, -1 means no triangle.
+	 *
+	 * @return The triangle indices.
+	 */
+	const cv::Mat& get_triangle_ids() const
+	{
+		return triangle_ids;
+	};
+
+	/**
+	 * Returns the barycentric coordinates as CV_32FC3 image. With a perspective
+	 * projection, they are perspective-correct, i.e. they interpolate points on the
+	 * surface of the mesh.
+	 *
+	 * @return The barycentric coordinates.
+	 */
+	const cv::Mat& get_barycentrics() const
+	{
+		return barycentrics;
+	};
+
+private:
+	cv::Mat triangle_ids;
+	cv::Mat barycentrics;
+};
+
+	} /* namespace render */
+} /* namespace eos */
+
+#endif /* FRAMEBUFFER_HPP_ */
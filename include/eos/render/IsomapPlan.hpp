@@ -0,0 +1,362 @@
+/*
+ * eos - A 3D Morphable Model fitting library written in modern C++11/14.
+ *
+ * File: include/eos/render/IsomapPlan.hpp
+ *
+ * Copyright 2017 Patrik Huber
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#ifndef ISOMAPPLAN_HPP_
+#define ISOMAPPLAN_HPP_
+
+#include "eos/core/Mesh.hpp"
+#include "eos/core/ThreadPool.hpp"
+#include "eos/render/texture_extraction.hpp"
+#include "eos/render/render_affine.hpp"
+#include "eos/render/detail/render_affine_detail.hpp"
+#include "eos/render/detail/texture_extraction_detail.hpp"
+
+#include "cereal/cereal.hpp"
+#include "cereal/access.hpp"
+#include "cereal/types/vector.hpp"
+#include "cereal/archives/binary.hpp"
+
+#include "glm/vec4.hpp"
+
+#include "opencv2/core/core.hpp"
+
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cstddef>
+#include <fstream>
+#include <stdexcept>
+#include <algorithm>
+#include <iterator>
+#include <cassert>
+
+namespace eos {
+	namespace render {
+
+/**
+ * @brief The rasterisation of a mesh's texture coordinates into an isomap of a given
+ * resolution, for repeated texture extraction with the same model.
+ *
+ * For every isomap texel that is covered by a triangle, the plan stores the index of
+ * the triangle and the barycentric coordinates of the texel in it. Since the texture
+ * coordinates of a model don't change, extract_texture(const IsomapPlan&, ...) then
+ * only needs to gather the colours from the image, instead of rasterising all
+ * triangles in the isomap again for every image.
+ *
+ * Texels on an edge shared by two triangles belong to the later one in mesh.tvi,
+ * independent of the visibility of the triangles. extract_texture() only writes the
+ * visible triangles, so where the later triangle is occluded and the earlier one
+ * isn't, extract_texture() colours the edge texel and the plan leaves it empty.
+ *
+ * Create the plan with create_isomap_plan(). It can be stored with save_isomap_plan().
+ */
+struct IsomapPlan
+{
+	int resolution = 0; ///< Width and height of the isomap
+	std::size_t num_vertices = 0; ///< The number of vertices of the mesh the plan was created for
+	std::size_t num_triangles = 0; ///< The number of triangles of the mesh the plan was created for
+	std::vector<std::int32_t> texels; ///< Index (y * resolution + x) of each covered texel, in increasing order
+	std::vector<std::int32_t> triangles; ///< For each texel, the index of its triangle in mesh.tvi
+	std::vector<float> barycentrics; ///< For each texel, the barycentric coordinates of its triangle's 2nd and 3rd vertex. The 1st one's is 1 minus their sum.
+
+	friend class cereal::access;
+	/**
+	 * Serialises this class using cereal.
+	 *
+	 * @param[in] archive The archive to serialise to (or to serialise from).
+	 * @param[in] version Version number of the archive.
+	 * @throw std::runtime_error When the archive doesn't have the most recent version (=1).
+	 */
+	template <class Archive>
+	void serialize(Archive& archive, const std::uint32_t version)
+	{
+		if (version != 1)
+		{
+			throw std::runtime_error("The isomap plan you are trying to load is in an unknown format.");
+		}
+		archive(CEREAL_NVP(resolution), CEREAL_NVP(num_vertices), CEREAL_NVP(num_triangles), CEREAL_NVP(texels), CEREAL_NVP(triangles), CEREAL_NVP(barycentrics));
+	};
+};
+
+		namespace detail {
+
+/**
+ * Checks that all the indices in the plan are valid for an isomap of the plan's
+ * resolution and a mesh with \p num_triangles triangles, so that a stale or corrupt
+ * plan gives an error instead of out-of-bounds accesses.
+ *
+ * @param[in] plan The plan to check.
+ * @param[in] num_triangles The number of triangles of the mesh the plan is used with.
+ * @throw std::runtime_error If the plan is inconsistent.
+ */
+inline void check_isomap_plan(const IsomapPlan& plan, std::size_t num_triangles)
+{
+	if (plan.resolution <= 0 || plan.triangles.size() != plan.texels.size() || plan.barycentrics.size() != 2 * plan.texels.size()) {
+		throw std::runtime_error("The isomap plan is inconsistent: Its texels, triangles and barycentric coordinates differ in size.");
+	}
+	const std::int64_t num_texels = static_cast<std::int64_t>(plan.resolution) * plan.resolution;
+	for (std::size_t k = 0; k < plan.texels.size(); ++k)
+	{
+		if (plan.texels[k] < 0 || plan.texels[k] >= num_texels) {
+			throw std::runtime_error("The isomap plan is inconsistent: A texel index is outside of the isomap.");
+		}
+		if (plan.triangles[k] < 0 || static_cast<std::size_t>(plan.triangles[k]) >= num_triangles) {
+			throw std::runtime_error("The isomap plan is inconsistent: A triangle index is outside of the mesh.");
+		}
+	}
+};
+
+		} /* namespace detail */
+
+/**
+ * Rasterises the texture coordinates of the given mesh into an isomap, for use with
+ * extract_texture(const IsomapPlan&, ...).
+ *
+ * @param[in] mesh A mesh with texture coordinates.
+ * @param[in] isomap_resolution The resolution of the isomap.
+ * @return The plan.
+ */
+inline IsomapPlan create_isomap_plan(const core::Mesh& mesh, int isomap_resolution = 512)
+{
+	assert(mesh.vertices.size() == mesh.texcoords.size());
+
+	const int num_texels = isomap_resolution * isomap_resolution;
+	// The last triangle that covers a texel wins, regardless of its visibility in an image:
+	std::vector<std::int32_t> texel_triangles(num_texels, -1);
+	std::vector<float> texel_barycentrics(2 * num_texels);
+	for (std::size_t triangle_index = 0; triangle_index < mesh.tvi.size(); ++triangle_index)
+	{
+		cv::Point2f dst_tri[3];
+		const cv::Rect bounding_box = detail::get_isomap_triangle(mesh, mesh.tvi[triangle_index], isomap_resolution, isomap_resolution, dst_tri);
+		for (int y = bounding_box.y; y <= bounding_box.y + bounding_box.height; ++y) {
+			for (int x = bounding_box.x; x <= bounding_box.x + bounding_box.width; ++x) {
+				float u, v;
+				if (detail::is_point_in_triangle(cv::Point2f(x, y), dst_tri[0], dst_tri[1], dst_tri[2], u, v)) {
+					const int texel = y * isomap_resolution + x;
+					texel_triangles[texel] = static_cast<std::int32_t>(triangle_index);
+					texel_barycentrics[2 * texel] = v; // weight of dst_tri[1]
+					texel_barycentrics[2 * texel + 1] = u; // weight of dst_tri[2]
+				}
+			}
+		}
+	}
+
+	IsomapPlan plan;
+	plan.resolution = isomap_resolution;
+	plan.num_vertices = mesh.vertices.size();
+	plan.num_triangles = mesh.tvi.size();
+	const auto num_covered_texels = num_texels - std::count(std::begin(texel_triangles), std::end(texel_triangles), -1);
+	plan.texels.reserve(num_covered_texels);
+	plan.triangles.reserve(num_covered_texels);
+	plan.barycentrics.reserve(2 * num_covered_texels);
+	for (int texel = 0; texel < num_texels; ++texel)
+	{
+		if (texel_triangles[texel] >= 0) {
+			plan.texels.push_back(texel);
+			plan.triangles.push_back(texel_triangles[texel]);
+			plan.barycentrics.push_back(texel_barycentrics[2 * texel]);
+			plan.barycentrics.push_back(texel_barycentrics[2 * texel + 1]);
+		}
+	}
+	return plan;
+};
+
+/**
+ * Extracts the texture of the face from the given image and stores it as isomap,
+ * using a precomputed IsomapPlan. This is like extract_texture() with
+ * TextureInterpolation::NearestNeighbour, but after the visibility test per triangle,
+ * each texel only needs a lookup in the image. The result differs only on the edges
+ * between a visible and an occluded triangle: a texel there stays empty if the plan
+ * assigned it to the occluded one (see IsomapPlan).
+ *
+ * @param[in] plan A plan created with create_isomap_plan() for the mesh's model.
+ * @param[in] mesh A mesh with the same triangles and texture coordinates as the plan's.
+ * @param[in] affine_camera_matrix An estimated 3x4 affine camera matrix.
+ * @param[in] image The image to extract the texture from, CV_8UC3.
+ * @param[in] depthbuffer A pre-calculated depthbuffer image, as returned by render_affine_depth().
+ * @param[in] depthbuffer_region The region of the image that the depthbuffer covers, i.e. the region given to render_affine_depth().
+ * @param[in] compute_view_angle A flag whether the view angle of each triangle should be encoded into the alpha channel, see extract_texture().
+ * @param[in] thread_pool An optional thread pool to test the triangles and gather the texels in parallel. The result is the same as without.
+ * @return The extracted texture as isomap (texture map), CV_8UC4.
+ * @throw std::runtime_error If the plan was created for a mesh with a different number of vertices or triangles, or is inconsistent.
+ */
+inline cv::Mat extract_texture(const IsomapPlan& plan, const core::Mesh& mesh, cv::Mat affine_camera_matrix, cv::Mat image, cv::Mat depthbuffer, const cv::Rect& depthbuffer_region, bool compute_view_angle = false, core::ThreadPool* thread_pool = nullptr)
+{
+	assert(image.type() == CV_8UC3); // the other cases are not yet supported
+	if (plan.num_vertices != mesh.vertices.size() || plan.num_triangles != mesh.tvi.size()) {
+		throw std::runtime_error("The isomap plan was created for a different mesh.");
+	}
+	detail::check_isomap_plan(plan, mesh.tvi.size());
+
+	const cv::Mat affine_cam_4x4 = detail::calculate_affine_z_direction(affine_camera_matrix);
+	std::vector<glm::tvec4<float>> projected_vertices;
+	detail::project_affine(mesh.vertices, affine_cam_4x4, projected_vertices);
+
+	// Alpha value of each triangle, or a negative value if the triangle is not visible:
+	const int num_triangles = static_cast<int>(mesh.tvi.size());
+	std::vector<float> triangle_alpha_values(num_triangles);
+	const auto setup_triangles = [&](int begin, int end) {
+		for (int i = begin; i < end; ++i) {
+			const auto& triangle_indices = mesh.tvi[i];
+			if (detail::is_triangle_visible(projected_vertices[triangle_indices[0]], projected_vertices[triangle_indices[1]], projected_vertices[triangle_indices[2]], depthbuffer, depthbuffer_region)) {
+				triangle_alpha_values[i] = detail::calculate_alpha_value(mesh.vertices[triangle_indices[0]], mesh.vertices[triangle_indices[1]], mesh.vertices[triangle_indices[2]], affine_cam_4x4, compute_view_angle);
+			}
+			else {
+				triangle_alpha_values[i] = -1.0f;
+			}
+		}
+	};
+
+	cv::Mat isomap = cv::Mat::zeros(plan.resolution, plan.resolution, CV_8UC4);
+	const int num_texels = static_cast<int>(plan.texels.size());
+	const auto gather_texels = [&](int begin, int end) {
+		for (int k = begin; k < end; ++k) {
+			const auto& triangle_indices = mesh.tvi[plan.triangles[k]];
+			const float alpha_value = triangle_alpha_values[plan.triangles[k]];
+			if (alpha_value < 0.0f) {
+				continue;
+			}
+			const float b1 = plan.barycentrics[2 * k];
+			const float b2 = plan.barycentrics[2 * k + 1];
+			const float b0 = 1.0f - b1 - b2;
+			const auto& v0 = projected_vertices[triangle_indices[0]];
+			const auto& v1 = projected_vertices[triangle_indices[1]];
+			const auto& v2 = projected_vertices[triangle_indices[2]];
+			const int src_x = cvRound(b0 * v0.x + b1 * v1.x + b2 * v2.x);
+			const int src_y = cvRound(b0 * v0.y + b1 * v1.y + b2 * v2.y);
+			if (src_y < image.rows && src_x < image.cols && src_x > 0 && src_y > 0)
+			{
+				const std::uint8_t* const src_pixel = image.ptr<std::uint8_t>(src_y) + 3 * src_x;
+				std::uint8_t* const isomap_pixel = isomap.ptr<std::uint8_t>(plan.texels[k] / plan.resolution) + 4 * (plan.texels[k] % plan.resolution);
+				isomap_pixel[0] = src_pixel[0];
+				isomap_pixel[1] = src_pixel[1];
+				isomap_pixel[2] = src_pixel[2];
+				isomap_pixel[3] = static_cast<std::uint8_t>(alpha_value); // pixel is visible
+			}
+		}
+	};
+
+	if (thread_pool && thread_pool->get_num_threads() > 1)
+	{
+		// Each texel is only in the plan once, so the chunks write to different pixels:
+		const int triangle_chunk_size = 256;
+		const int texel_chunk_size = 16384;
+		thread_pool->parallel_for(0, (num_triangles + triangle_chunk_size - 1) / triangle_chunk_size, [&setup_triangles, num_triangles](int chunk, int /* thread_index */) {
+			setup_triangles(chunk * triangle_chunk_size, std::min((chunk + 1) * triangle_chunk_size, num_triangles));
+		});
+		thread_pool->parallel_for(0, (num_texels + texel_chunk_size - 1) / texel_chunk_size, [&gather_texels, num_texels](int chunk, int /* thread_index */) {
+			gather_texels(chunk * texel_chunk_size, std::min((chunk + 1) * texel_chunk_size, num_texels));
+		});
+	}
+	else
+	{
+		setup_triangles(0, num_triangles);
+		gather_texels(0, num_texels);
+	}
+
+	// Workaround for the black line in the isomap (see GitHub issue #4):
+	if (mesh.texcoords.size() <= 3448)
+	{
+		isomap = detail::interpolate_black_line(isomap);
+	}
+
+	return isomap;
+};
+
+/**
+ * Extracts the texture of the face from the given image using a precomputed
+ * IsomapPlan, with a depthbuffer of the whole image. See the overload above.
+ *
+ * @param[in] plan A plan created with create_isomap_plan() for the mesh's model.
+ * @param[in] mesh A mesh with the same triangles and texture coordinates as the plan's.
+ * @param[in] affine_camera_matrix An estimated 3x4 affine camera matrix.
+ * @param[in] image The image to extract the texture from, CV_8UC3.
+ * @param[in] depthbuffer A pre-calculated depthbuffer image of the size of \p image, as returned by render_affine_depth().
+ * @param[in] compute_view_angle A flag whether the view angle of each triangle should be encoded into the alpha channel, see extract_texture().
+ * @param[in] thread_pool An optional thread pool to test the triangles and gather the texels in parallel.
+ * @return The extracted texture as isomap (texture map), CV_8UC4.
+ * @throw std::runtime_error If the plan was created for a mesh with a different number of vertices or triangles.
+ */
+inline cv::Mat extract_texture(const IsomapPlan& plan, const core::Mesh& mesh, cv::Mat affine_camera_matrix, cv::Mat image, cv::Mat depthbuffer, bool compute_view_angle = false, core::ThreadPool* thread_pool = nullptr)
+{
+	return extract_texture(plan, mesh, affine_camera_matrix, image, depthbuffer, cv::Rect(0, 0, depthbuffer.cols, depthbuffer.rows), compute_view_angle, thread_pool);
+};
+
+/**
+ * Extracts the texture of the face from the given image using a precomputed
+ * IsomapPlan, and renders the depth buffer for the visibility test first.
+ * The depth is only rendered in the region of the image that the mesh covers.
+ * See extract_texture(const IsomapPlan&, const core::Mesh&, cv::Mat, cv::Mat, cv::Mat, const cv::Rect&, bool, core::ThreadPool*).
+ *
+ * @param[in] plan A plan created with create_isomap_plan() for the mesh's model.
+ * @param[in] mesh A mesh with the same triangles and texture coordinates as the plan's.
+ * @param[in] affine_camera_matrix An estimated 3x4 affine camera matrix.
+ * @param[in] image The image to extract the texture from, CV_8UC3.
+ * @param[in] compute_view_angle A flag whether the view angle of each triangle should be encoded into the alpha channel.
+ * @param[in] thread_pool An optional thread pool to run the extraction on.
+ * @return The extracted texture as isomap (texture map), CV_8UC4.
+ */
+inline cv::Mat extract_texture(const IsomapPlan& plan, const core::Mesh& mesh, cv::Mat affine_camera_matrix, cv::Mat image, bool compute_view_angle = false, core::ThreadPool* thread_pool = nullptr)
+{
+	const cv::Rect region = render::get_screen_bounding_box(mesh, affine_camera_matrix, image.cols, image.rows);
+	const cv::Mat depthbuffer = render::render_affine_depth(mesh, affine_camera_matrix, image.cols, image.rows, true, nullptr, region);
+	return extract_texture(plan, mesh, affine_camera_matrix, image, depthbuffer, region, compute_view_angle, thread_pool);
+};
+
+/**
+ * Loads an isomap plan that was stored with save_isomap_plan().
+ *
+ * @param[in] filename The file to load.
+ * @return The plan.
+ * @throw std::runtime_error When the file fails to be opened, or the plan in it is inconsistent.
+ */
+inline IsomapPlan load_isomap_plan(std::string filename)
+{
+	std::ifstream file(filename, std::ios::binary);
+	if (file.fail()) {
+		throw std::runtime_error("Error opening given file: " + filename);
+	}
+	IsomapPlan plan;
+	cereal::BinaryInputArchive input_archive(file);
+	input_archive(plan);
+	detail::check_isomap_plan(plan, plan.num_triangles);
+	return plan;
+};
+
+/**
+ * Saves an isomap plan to the hard drive as cereal::BinaryOutputArchive.
+ *
+ * @param[in] plan The plan to be saved.
+ * @param[in] filename Filename for the plan.
+ */
+inline void save_isomap_plan(const IsomapPlan& plan, std::string filename)
+{
+	std::ofstream file(filename, std::ios::binary);
+	cereal::BinaryOutputArchive output_archive(file);
+	output_archive(plan);
+};
+
+	} /* namespace render */
+} /* namespace eos */
+
+CEREAL_CLASS_VERSION(eos::render::IsomapPlan, 1);
+
+#endif /* ISOMAPPLAN_HPP_ */
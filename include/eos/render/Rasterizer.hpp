@@ -22,6 +22,7 @@
 #ifndef RASTERIZER_HPP_
 #define RASTERIZER_HPP_
 
+#include "eos/render/Framebuffer.hpp"
 #include "eos/render/detail/Vertex.hpp"
 #include "eos/render/utils.hpp" // for Texture
 
@@ -30,15 +31,72 @@
 #include "boost/optional.hpp"
 
 #include <limits>
+#include <algorithm>
+#include <cstdint>
+#include <cassert>
+#include <utility>
 
 namespace eos {
 namespace render {
 
+/**
+ * @brief The per-pixel options of the Rasterizer, as compile-time constants.
+ *
+ * Rasterizer::raster_triangle_with() is instantiated once per policy, so that the
+ * inner pixel loop contains no branches on these options.
+ *
+ * @tparam DepthTest Whether fragments are depth-tested against, and written to, the depth buffer.
+ * @tparam FarClipping Whether fragments with z_ndc > 1 are discarded. Only used with the depth test.
+ * @tparam PerspectiveCorrect Whether the barycentric weights passed to the fragment shader are
+ *                            perspective-corrected. Texture extraction needs the affine ones.
+ * @tparam Textured Whether a texture is given, i.e. whether the texture derivatives are computed.
+ */
+template <bool DepthTest, bool FarClipping, bool PerspectiveCorrect, bool Textured>
+struct RasterPolicy
+{
+    static constexpr bool depth_test = DepthTest;
+    static constexpr bool far_clipping = FarClipping;
+    static constexpr bool perspective_correct = PerspectiveCorrect;
+    static constexpr bool textured = Textured;
+};
+
+namespace detail {
+
+template <bool... Flags, typename Function>
+void dispatch_raster_policy(Function&& function)
+{
+    function(RasterPolicy<Flags...>{});
+};
+
+/**
+ * Calls \p function with the RasterPolicy that corresponds to the given runtime flags,
+ * i.e. converts the flags to template parameters once, outside of any loop.
+ * The flags are, in order, the parameters of RasterPolicy.
+ */
+template <bool... Flags, typename Function, typename... Bools>
+void dispatch_raster_policy(Function&& function, bool flag, Bools... flags)
+{
+    if (flag)
+    {
+        dispatch_raster_policy<Flags..., true>(std::forward<Function>(function), flags...);
+    } else
+    {
+        dispatch_raster_policy<Flags..., false>(std::forward<Function>(function), flags...);
+    }
+};
+
+} /* namespace detail */
+
 /**
  * @brief Todo.
  *
  * X.
  *
+ * raster_triangle() checks the runtime flags (enable_depth_test, enable_far_clipping,
+ * extracting_tex and whether there is a texture) once per triangle. Callers that
+ * know the configuration at compile time, or that raster many triangles, should
+ * use raster_triangle_with() and a RasterPolicy instead.
+ *
  * @tparam FragmentShaderType X.
  */
 template <typename FragmentShaderType>
@@ -48,9 +106,23 @@ public:
     Rasterizer(int viewport_width, int viewport_height)
         : viewport_width(viewport_width), viewport_height(viewport_height)
     {
-        colorbuffer = cv::Mat(viewport_height, viewport_width, CV_8UC4, cv::Scalar::all(255));
-        depthbuffer =
-            std::numeric_limits<double>::max() * cv::Mat::ones(viewport_height, viewport_width, CV_64FC1);
+        framebuffer.resize(viewport_width, viewport_height);
+        framebuffer.clear(cv::Scalar::all(255));
+    };
+
+    /**
+      * @brief Creates a rasteriser whose framebuffer only covers the given region
+      * of the viewport, see Framebuffer. Pixels outside of it are not drawn.
+      *
+      * @param[in] viewport_width Screen width.
+      * @param[in] viewport_height Screen height.
+      * @param[in] region The region of the viewport to allocate and draw.
+      */
+    Rasterizer(int viewport_width, int viewport_height, const cv::Rect& region)
+        : viewport_width(viewport_width), viewport_height(viewport_height)
+    {
+        framebuffer.resize(viewport_width, viewport_height, region);
+        framebuffer.clear(cv::Scalar::all(255));
     };
 
     /**
@@ -58,22 +130,61 @@ public:
       *
       * X
       *
+      * If \p region is given, only the pixels inside it are drawn. This is used to
+      * rasterise the tiles of the screen in parallel.
+      *
       * @param[in] vertex X.
+      * @param[in] region An optional region of the screen to restrict the drawing to.
       * @ return X.
       */
     template <typename T, glm::precision P = glm::defaultp>
     void raster_triangle(const detail::Vertex<T, P>& point_a, const detail::Vertex<T, P>& point_b,
-                         const detail::Vertex<T, P>& point_c, const boost::optional<Texture>& texture)
+                         const detail::Vertex<T, P>& point_c, const boost::optional<Texture>& texture,
+                         const boost::optional<cv::Rect>& region = boost::none)
     {
+        detail::dispatch_raster_policy(
+            [&](auto policy) {
+                this->template raster_triangle_with<decltype(policy)>(point_a, point_b, point_c, texture,
+                                                                      region);
+            },
+            enable_depth_test, enable_far_clipping, !extracting_tex, texture.is_initialized());
+    };
+
+    /**
+      * @brief Rasterises a triangle with the options given by \p Policy, a RasterPolicy,
+      * instead of the runtime flags of the rasteriser.
+      *
+      * @param[in] region An optional region of the screen to restrict the drawing to.
+      * @tparam Policy A RasterPolicy. If Policy::textured, \p texture must be set.
+      */
+    template <typename Policy, typename T, glm::precision P = glm::defaultp>
+    void raster_triangle_with(const detail::Vertex<T, P>& point_a, const detail::Vertex<T, P>& point_b,
+                              const detail::Vertex<T, P>& point_c, const boost::optional<Texture>& texture,
+                              const boost::optional<cv::Rect>& region = boost::none)
+    {
+        assert(!Policy::textured || texture);
         // We already calculated this in the culling/clipping stage. Maybe we should save/cache it after all.
         cv::Rect boundingBox = detail::calculate_clipped_bounding_box(
             glm::tvec2<T, P>(point_a.position.x, point_a.position.y),
             glm::tvec2<T, P>(point_b.position.x, point_b.position.y),
             glm::tvec2<T, P>(point_c.position.x, point_c.position.y), viewport_width, viewport_height);
-        const auto min_x = boundingBox.x;
-        const auto max_x = boundingBox.x + boundingBox.width;
-        const auto min_y = boundingBox.y;
-        const auto max_y = boundingBox.y + boundingBox.height;
+        auto min_x = boundingBox.x;
+        auto max_x = boundingBox.x + boundingBox.width;
+        auto min_y = boundingBox.y;
+        auto max_y = boundingBox.y + boundingBox.height;
+        if (region)
+        {
+            min_x = std::max(min_x, region->x);
+            max_x = std::min(max_x, region->x + region->width - 1);
+            min_y = std::max(min_y, region->y);
+            max_y = std::min(max_y, region->y + region->height - 1);
+        }
+        // The framebuffer may only cover a region of the viewport:
+        const cv::Rect& framebuffer_region = framebuffer.get_region();
+        min_x = std::max(min_x, framebuffer_region.x);
+        max_x = std::min(max_x, framebuffer_region.x + framebuffer_region.width - 1);
+        min_y = std::max(min_y, framebuffer_region.y);
+        max_y = std::min(max_y, framebuffer_region.y + framebuffer_region.height - 1);
 
         // These are triangle-specific, i.e. calculate once per triangle.
         // These ones are needed for perspective correct lambdas! (as well as mipmapping)
@@ -106,8 +217,19 @@ public:
         const auto beta_ffy = -beta_plane.b * one_over_beta_c;
         const auto gamma_ffy = -gamma_plane.b * one_over_gamma_c;
 
+        // These will be used for barycentric weights computation (once per triangle, too):
+        using detail::implicit_line;
+        const double one_over_v0ToLine12 =
+            1.0 / implicit_line(point_a.position[0], point_a.position[1], point_b.position, point_c.position);
+        const double one_over_v1ToLine20 =
+            1.0 / implicit_line(point_b.position[0], point_b.position[1], point_c.position, point_a.position);
+        const double one_over_v2ToLine01 =
+            1.0 / implicit_line(point_c.position[0], point_c.position[1], point_a.position, point_b.position);
+
         for (int yi = min_y; yi <= max_y; ++yi)
         {
+            std::uint8_t* const colour_row = framebuffer.colour_row(yi - framebuffer_region.y);
+            float* const depth_row = framebuffer.depth_row(yi - framebuffer_region.y);
             for (int xi = min_x; xi <= max_x; ++xi)
             {
                 // we want centers of pixels to be used in computations. Todo: Do we? Do we pass it with or
@@ -115,17 +237,6 @@ public:
                 const float x = static_cast<float>(xi) + 0.5f; // double? T?
                 const float y = static_cast<float>(yi) + 0.5f;
 
-                // These will be used for barycentric weights computation
-                using detail::implicit_line;
-                const double one_over_v0ToLine12 =
-                    1.0 / implicit_line(point_a.position[0], point_a.position[1], point_b.position,
-                                        point_c.position);
-                const double one_over_v1ToLine20 =
-                    1.0 / implicit_line(point_b.position[0], point_b.position[1], point_c.position,
-                                        point_a.position);
-                const double one_over_v2ToLine01 =
-                    1.0 / implicit_line(point_c.position[0], point_c.position[1], point_a.position,
-                                        point_b.position);
                 // Affine barycentric weights:
                 double alpha = implicit_line(x, y, point_b.position, point_c.position) * one_over_v0ToLine12;
                 double beta = implicit_line(x, y, point_c.position, point_a.position) * one_over_v1ToLine20;
@@ -134,46 +245,31 @@ public:
                 // if pixel (x, y) is inside the triangle or on one of its edges
                 if (alpha >= 0 && beta >= 0 && gamma >= 0)
                 {
-                    const int pixel_index_row = yi;
-                    const int pixel_index_col = xi;
-
                     // TODO: Check this one. What about perspective?
                     const double z_affine = alpha * static_cast<double>(point_a.position[2]) +
                                             beta * static_cast<double>(point_b.position[2]) +
                                             gamma * static_cast<double>(point_c.position[2]);
 
-                    bool draw = true;
-                    if (enable_far_clipping)
+                    // Without the depth test, we avoid accessing the depthbuffer at all - it might be
+                    // empty or have other dimensions. The far-plane is only clipped against together with
+                    // the depth test; we clip against the near-plane earlier.
+                    // What to do in ortho case without n/f "squashing"? should we always squash? or a flag?
+                    if (Policy::depth_test)
                     {
-                        if (z_affine > 1.0)
+                        if ((Policy::far_clipping && z_affine > 1.0) ||
+                            !(static_cast<float>(z_affine) < depth_row[xi - framebuffer_region.x]))
                         {
-                            draw = false;
+                            continue;
                         }
                     }
-
-                    bool passes_depth_test = false;
-                    if (enable_depth_test)
-                    {
-                        // If enable_depth_test=false, avoid accessing the depthbuffer at all - it might be
-                        // empty or have other dimensions.
-                        passes_depth_test =
-                            (z_affine < depthbuffer.at<double>(pixel_index_row, pixel_index_col));
-                    }
-                    // The '<= 1.0' clips against the far-plane in NDC. We clip against the near-plane
-                    // earlier.
-                    // if (z_affine < depthbuffer.at<double>(pixelIndexRow, pixelIndexCol)/* && z_affine <=
-                    // 1.0*/) // what to do in ortho case without n/f "squashing"? should we always squash? or
-                    // a flag?
-                    if ((passes_depth_test && draw) || enable_depth_test == false)
-                    {
-                        // perspective-correct barycentric weights
-                        // Todo: Check this in the original/older implementation, i.e. if all is still
-                        // perspective-correct. I think so. Also compare 1:1 with OpenGL.
-                        double d = alpha * one_over_w0 + beta * one_over_w1 + gamma * one_over_w2;
-                        d = 1.0 / d;
-                        if (!extracting_tex) // Pass the uncorrected lambda if we're extracting tex... hack...
-                                             // do properly!
+                    { // The fragment is visible, shade it:
+                        if (Policy::perspective_correct) // Texture extraction needs the uncorrected lambda
                         {
+                            // perspective-correct barycentric weights
+                            // Todo: Check this in the original/older implementation, i.e. if all is still
+                            // perspective-correct. I think so. Also compare 1:1 with OpenGL.
+                            double d = alpha * one_over_w0 + beta * one_over_w1 + gamma * one_over_w2;
+                            d = 1.0 / d;
                             alpha *= d * one_over_w0; // In case of affine cam matrix, everything is 1 and
                                                       // a/b/g don't get changed.
                             beta *= d * one_over_w1;
@@ -182,7 +278,7 @@ public:
                         glm::tvec3<T, P> lambda(alpha, beta, gamma);
 
                         glm::tvec4<T, P> pixel_color;
-                        if (texture)
+                        if (Policy::textured)
                         {
                             // check if texture != NULL?
                             // partial derivatives (for mip-mapping, not needed for texturing otherwise!)
@@ -236,14 +332,14 @@ public:
                             static_cast<unsigned char>(255.0f * std::min(pixel_color[3], T(1)));
 
                         // update buffers
-                        colorbuffer.at<cv::Vec4b>(pixel_index_row, pixel_index_col)[0] = blue;
-                        colorbuffer.at<cv::Vec4b>(pixel_index_row, pixel_index_col)[1] = green;
-                        colorbuffer.at<cv::Vec4b>(pixel_index_row, pixel_index_col)[2] = red;
-                        colorbuffer.at<cv::Vec4b>(pixel_index_row, pixel_index_col)[3] = alpha;
-                        if (enable_depth_test) // TODO: A better name for this might be enable_zbuffer? or
-                                               // enable_zbuffer_test?
+                        std::uint8_t* const pixel = colour_row + 4 * (xi - framebuffer_region.x);
+                        pixel[0] = blue;
+                        pixel[1] = green;
+                        pixel[2] = red;
+                        pixel[3] = alpha;
+                        if (Policy::depth_test)
                         {
-                            depthbuffer.at<double>(pixel_index_row, pixel_index_col) = z_affine;
+                            depth_row[xi - framebuffer_region.x] = static_cast<float>(z_affine);
                         }
                     }
                 }
@@ -255,15 +351,15 @@ private:
     FragmentShaderType fragment_shader;
 
 public:                            // will eventually go private
+    // These select the RasterPolicy that raster_triangle() uses:
     bool enable_depth_test = true; // maybe get rid of this again, it was just as a hack.
-    bool extracting_tex = false;
+    bool extracting_tex = false;   // pass affine instead of perspective-correct barycentrics
     bool enable_far_clipping = true;
 
     int viewport_width;
     int viewport_height;
 
-    cv::Mat colorbuffer;
-    cv::Mat depthbuffer;
+    Framebuffer framebuffer; // BGRA colour and float depth, see get_colourbuffer() and get_depthbuffer()
 };
 
 } /* namespace render */
@@ -0,0 +1,313 @@
+/*
+ * eos - A 3D Morphable Model fitting library written in modern C++11/14.
+ *
+ * File: include/eos/render/RenderContext.hpp
+ *
+ * Copyright 2017 Patrik Huber
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#ifndef RENDERCONTEXT_HPP_
+#define RENDERCONTEXT_HPP_
+
+#include "eos/core/Mesh.hpp"
+#include "eos/core/ThreadPool.hpp"
+#include "eos/core/Trace.hpp"
+#include "eos/render/Framebuffer.hpp"
+#include "eos/render/transform_vertices.hpp"
+#include "eos/render/detail/render_detail.hpp"
+#include "eos/render/utils.hpp"
+
+#include "glm/mat4x4.hpp"
+#include "glm/vec2.hpp"
+#include "glm/vec3.hpp"
+#include "glm/vec4.hpp"
+
+#include "boost/optional.hpp"
+
+#include <vector>
+#include <cstddef>
+#include <cassert>
+
+namespace eos {
+	namespace render {
+
+/**
+ * @brief Renders meshes with the pipeline of render(), but keeps all the memory
+ * that it needs from one call to the next.
+ *
+ * A context owns a framebuffer, as well as the vectors for the transformed vertices,
+ * the triangles and the clipped polygons. render() only clears them, so after the
+ * first frames, rendering meshes of a similar size at a fixed resolution does not
+ * allocate any memory. The mesh is taken by const reference, and the model-view and
+ * projection matrices are multiplied once per call instead of once per vertex.
+ *
+ * Use one context per thread, e.g. per video stream:
+ * \code
+ * render::RenderContext context(frame.cols, frame.rows);
+ * for (...) {
+ *     context.render(mesh, model_view, projection);
+ *     const cv::Mat& rendering = context.get_framebuffer().get_colourbuffer();
+ * }
+ * \endcode
+ *
+ * To only render the face in a large frame, restrict the framebuffer to the face's
+ * region before each call, e.g. with
+ * context.get_framebuffer().resize(frame.cols, frame.rows, get_screen_bounding_box(...)).
+ * The rendering is the same as the one of the full viewport, in that region.
+ */
+class RenderContext
+{
+public:
+	RenderContext() = default;
+
+	/**
+	 * Creates a context with a framebuffer of the given size.
+	 *
+	 * @param[in] viewport_width Screen width.
+	 * @param[in] viewport_height Screen height.
+	 */
+	RenderContext(int viewport_width, int viewport_height) : framebuffer(viewport_width, viewport_height)
+	{
+	};
+
+	/**
+	 * Renders the given mesh into the framebuffer of this context, which is cleared first.
+	 * See render() for the details.
+	 *
+	 * @param[in] mesh A 3D mesh.
+	 * @param[in] model_view_matrix A 4x4 OpenGL model-view matrix.
+	 * @param[in] projection_matrix A 4x4 orthographic or perspective OpenGL projection matrix.
+	 * @param[in] texture An optional texture map. If not given, vertex-colouring is used.
+	 * @param[in] enable_backface_culling Whether the renderer should perform backface culling. If true, only draw triangles with vertices ordered CCW in screen-space.
+	 * @param[in] enable_near_clipping Whether vertices should be clipped against the near plane.
+	 * @param[in] enable_far_clipping Whether vertices should be clipped against the far plane.
+	 * @param[in] thread_pool If given, the screen is divided into tiles that are rasterised in parallel on this pool.
+	 * @param[in] trace_sink If given, receives the time of the triangle setup and the rasterisation, and the number of triangles rasterised.
+	 */
+	void render(const core::Mesh& mesh, const glm::tmat4x4<float>& model_view_matrix, const glm::tmat4x4<float>& projection_matrix, const boost::optional<Texture>& texture = boost::none, bool enable_backface_culling = false, bool enable_near_clipping = true, bool enable_far_clipping = true, core::ThreadPool* thread_pool = nullptr, core::TraceSink* trace_sink = nullptr)
+	{
+		render(mesh, model_view_matrix, projection_matrix, framebuffer, texture, enable_backface_culling, enable_near_clipping, enable_far_clipping, thread_pool, trace_sink);
+	};
+
+	/**
+	 * Renders the given mesh into the given framebuffer, which is cleared first, using
+	 * the memory of this context for everything else.
+	 *
+	 * @param[in] mesh A 3D mesh.
+	 * @param[in] model_view_matrix A 4x4 OpenGL model-view matrix.
+	 * @param[in] projection_matrix A 4x4 orthographic or perspective OpenGL projection matrix.
+	 * @param[in,out] framebuffer The framebuffer to render into. Its viewport size is the size of the viewport, and only its region is drawn.
+	 * @param[in] texture An optional texture map. If not given, vertex-colouring is used.
+	 * @param[in] enable_backface_culling Whether the renderer should perform backface culling. If true, only draw triangles with vertices ordered CCW in screen-space.
+	 * @param[in] enable_near_clipping Whether vertices should be clipped against the near plane.
+	 * @param[in] enable_far_clipping Whether vertices should be clipped against the far plane.
+	 * @param[in] thread_pool If given, the screen is divided into tiles that are rasterised in parallel on this pool.
+	 * @param[in] trace_sink If given, receives the time of the triangle setup and the rasterisation, and the number of triangles rasterised.
+	 */
+	void render(const core::Mesh& mesh, const glm::tmat4x4<float>& model_view_matrix, const glm::tmat4x4<float>& projection_matrix, Framebuffer& framebuffer, const boost::optional<Texture>& texture = boost::none, bool enable_backface_culling = false, bool enable_near_clipping = true, bool enable_far_clipping = true, core::ThreadPool* thread_pool = nullptr, core::TraceSink* trace_sink = nullptr)
+	{
+		// Some internal documentation / old todos or notes:
+		// maybe change and pass depthBuffer as an optional arg (&?), because usually we never need it outside the renderer. Or maybe even a getDepthBuffer().
+		// modelViewMatrix goes to eye-space (camera space), projection does ortho or perspective proj.
+		// bool enable_texturing = false; Maybe re-add later, not sure
+		// take a cv::Mat texture instead and convert to Texture internally? no, we don't want to recreate mipmap levels on each render() call.
+
+		assert(mesh.vertices.size() == mesh.colors.size() || mesh.colors.empty()); // The number of vertices has to be equal for both shape and colour, or, alternatively, it has to be a shape-only model.
+		assert(mesh.vertices.size() == mesh.texcoords.size() || mesh.texcoords.empty()); // same for the texcoords
+		assert(framebuffer.viewport_width() > 0 && framebuffer.viewport_height() > 0);
+		// another assert: If cv::Mat texture != empty, then we need texcoords?
+
+		{
+			core::ScopedTrace trace(trace_sink, "render_setup");
+			framebuffer.clear();
+			setup_triangles(mesh, model_view_matrix, projection_matrix, framebuffer.viewport_width(), framebuffer.viewport_height(), framebuffer.get_region(), enable_backface_culling, enable_near_clipping, enable_far_clipping);
+		}
+		core::trace_counter(trace_sink, "triangles_rasterised", static_cast<std::int64_t>(triangles_to_raster.size()));
+
+		// Fragment/pixel shader: Colour the pixel values
+		core::ScopedTrace trace(trace_sink, "rasterise");
+		if (thread_pool && thread_pool->get_num_threads() > 1) {
+			detail::raster_triangles_tiled(triangles_to_raster, framebuffer, texture, enable_far_clipping, *thread_pool, 64, tiled_raster_scratch);
+		}
+		else {
+			for (const auto& tri : triangles_to_raster) {
+				detail::raster_triangle_simd(tri, framebuffer, texture, enable_far_clipping);
+			}
+		}
+	};
+
+	/**
+	 * Renders only the depth of the given mesh, and optionally the index of the visible
+	 * triangle and the barycentric coordinates at each pixel. No colours are computed.
+	 *
+	 * This is much cheaper than render(), e.g. for a visibility pre-pass. The depth values
+	 * are the same as the ones of the reference rasteriser, detail::raster_triangle().
+	 *
+	 * @param[in] mesh A 3D mesh.
+	 * @param[in] model_view_matrix A 4x4 OpenGL model-view matrix.
+	 * @param[in] projection_matrix A 4x4 orthographic or perspective OpenGL projection matrix.
+	 * @param[in,out] framebuffer The framebuffer whose depth buffer is rendered into, e.g. created without colour. Its viewport size is the size of the viewport, and only its region is drawn.
+	 * @param[in,out] id_buffer If given, the triangle indices (into mesh.tvi) and the perspective-correct barycentric coordinates are written into it. Must have the same size as \p framebuffer, and covers the same region. For triangles that are clipped against the near plane, the coordinates refer to the clipped triangle.
+	 * @param[in] enable_backface_culling Whether the renderer should perform backface culling.
+	 * @param[in] enable_near_clipping Whether vertices should be clipped against the near plane.
+	 * @param[in] enable_far_clipping Whether vertices should be clipped against the far plane.
+	 */
+	void render_depth(const core::Mesh& mesh, const glm::tmat4x4<float>& model_view_matrix, const glm::tmat4x4<float>& projection_matrix, Framebuffer& framebuffer, TriangleIdBuffer* id_buffer = nullptr, bool enable_backface_culling = false, bool enable_near_clipping = true, bool enable_far_clipping = true)
+	{
+		assert(!id_buffer || (id_buffer->width() == framebuffer.width() && id_buffer->height() == framebuffer.height()));
+		framebuffer.clear();
+		if (id_buffer) {
+			id_buffer->clear();
+		}
+		setup_triangles(mesh, model_view_matrix, projection_matrix, framebuffer.viewport_width(), framebuffer.viewport_height(), framebuffer.get_region(), enable_backface_culling, enable_near_clipping, enable_far_clipping);
+		for (std::size_t i = 0; i < triangles_to_raster.size(); ++i) {
+			detail::raster_triangle_depth(triangles_to_raster[i], framebuffer, enable_far_clipping, true, source_triangles[i], id_buffer);
+		}
+	};
+
+	/**
+	 * Returns the framebuffer of this context, with the result of the last render() call.
+	 *
+	 * @return The framebuffer.
+	 */
+	Framebuffer& get_framebuffer()
+	{
+		return framebuffer;
+	};
+
+	const Framebuffer& get_framebuffer() const
+	{
+		return framebuffer;
+	};
+
+private:
+	Framebuffer framebuffer;
+	std::vector<glm::vec4> clipspace_positions;
+	std::vector<detail::Vertex<float>> clipspace_vertices;
+	std::vector<detail::TriangleToRasterize> triangles_to_raster;
+	std::vector<int> source_triangles; // for each triangle to raster, the index of the mesh triangle it comes from
+	std::vector<detail::Vertex<float>> polygon; // a triangle that is clipped against the near plane
+	std::vector<detail::Vertex<float>> clipped_polygon;
+	detail::TiledRasterScratch tiled_raster_scratch;
+
+	// Transforms the vertices to clip space, and clips and culls the triangles. Fills
+	// triangles_to_raster with the triangles in screen space that overlap the given
+	// region of the viewport, and source_triangles.
+	void setup_triangles(const core::Mesh& mesh, const glm::tmat4x4<float>& model_view_matrix, const glm::tmat4x4<float>& projection_matrix, int viewport_width, int viewport_height, const cv::Rect& region, bool enable_backface_culling, bool enable_near_clipping, bool enable_far_clipping)
+	{
+		// Vertex shader:
+		//processedVertex = shade(Vertex); // processedVertex : pos, col, tex, texweight
+		// Assemble the vertices, project to clip space, and store as detail::Vertex (the internal representation):
+		const glm::tmat4x4<float> mvp_matrix = projection_matrix * model_view_matrix; // once, instead of for every vertex
+		transform_vertices(core::VertexView(mesh.vertices), mvp_matrix, clipspace_positions); // in blocks, with SIMD if available
+		clipspace_vertices.clear();
+		clipspace_vertices.reserve(mesh.vertices.size());
+		for (int i = 0; i < mesh.vertices.size(); ++i) { // "previously": mesh.vertex
+			const glm::tvec4<float>& clipspace_coords = clipspace_positions[i];
+			glm::tvec3<float> vertex_colour;
+			if (mesh.colors.empty()) {
+				vertex_colour = glm::tvec3<float>(0.5f, 0.5f, 0.5f);
+			}
+			else {
+				vertex_colour = mesh.colors[i];
+			}
+			const glm::tvec2<float> texcoords = mesh.texcoords.empty() ? glm::tvec2<float>(0.0f, 0.0f) : mesh.texcoords[i];
+			clipspace_vertices.push_back(detail::Vertex<float>{clipspace_coords, vertex_colour, texcoords});
+		}
+
+		// All vertices are in clip-space now.
+		// Prepare the rasterisation stage.
+		// For every vertex/tri:
+		triangles_to_raster.clear();
+		source_triangles.clear();
+		for (std::size_t triangle_index = 0; triangle_index < mesh.tvi.size(); ++triangle_index) {
+			const auto& tri_indices = mesh.tvi[triangle_index];
+			// Todo: Split this whole stuff up. Make a "clip" function, ... rename "processProspective..".. what is "process"... get rid of "continue;"-stuff by moving stuff inside process...
+			// classify vertices visibility with respect to the planes of the view frustum
+			// we're in clip-coords (NDC), so just check if outside [-1, 1] x ...
+			// Actually we're in clip-coords and it's not the same as NDC. We're only in NDC after the division by w.
+			// We should do the clipping in clip-coords though. See http://www.songho.ca/opengl/gl_projectionmatrix.html for more details.
+			// However, when comparing against w_c below, we might run into the trouble of the sign again in the affine case.
+			// 'w' is always positive, as it is -z_camspace, and all z_camspace are negative.
+			unsigned char visibility_bits[3];
+			for (unsigned char k = 0; k < 3; k++)
+			{
+				visibility_bits[k] = 0;
+				float x_cc = clipspace_vertices[tri_indices[k]].position[0];
+				float y_cc = clipspace_vertices[tri_indices[k]].position[1];
+				float z_cc = clipspace_vertices[tri_indices[k]].position[2];
+				float w_cc = clipspace_vertices[tri_indices[k]].position[3];
+				if (x_cc < -w_cc)			// true if outside of view frustum. False if on or inside the plane.
+					visibility_bits[k] |= 1;	// set bit if outside of frustum
+				if (x_cc > w_cc)
+					visibility_bits[k] |= 2;
+				if (y_cc < -w_cc)
+					visibility_bits[k] |= 4;
+				if (y_cc > w_cc)
+					visibility_bits[k] |= 8;
+				if (enable_near_clipping && z_cc < -w_cc) // near plane frustum clipping
+					visibility_bits[k] |= 16;
+				if (enable_far_clipping && z_cc > w_cc) // far plane frustum clipping
+					visibility_bits[k] |= 32;
+			} // if all bits are 0, then it's inside the frustum
+			// all vertices are not visible - reject the triangle.
+			if ((visibility_bits[0] & visibility_bits[1] & visibility_bits[2]) > 0)
+			{
+				continue;
+			}
+			// all vertices are visible - pass the whole triangle to the rasterizer. = All bits of all 3 triangles are 0.
+			if ((visibility_bits[0] | visibility_bits[1] | visibility_bits[2]) == 0)
+			{
+				boost::optional<detail::TriangleToRasterize> t = detail::process_prospective_tri(clipspace_vertices[tri_indices[0]], clipspace_vertices[tri_indices[1]], clipspace_vertices[tri_indices[2]], viewport_width, viewport_height, enable_backface_culling);
+				if (t && detail::clip_to_region(*t, region)) {
+					triangles_to_raster.push_back(*t);
+					source_triangles.push_back(static_cast<int>(triangle_index));
+				}
+				continue;
+			}
+			// at this moment the triangle is known to be intersecting one of the view frustum's planes
+			auto& vertices = polygon;
+			vertices.clear();
+			vertices.push_back(clipspace_vertices[tri_indices[0]]);
+			vertices.push_back(clipspace_vertices[tri_indices[1]]);
+			vertices.push_back(clipspace_vertices[tri_indices[2]]);
+			// split the triangle if it intersects the near plane:
+			if (enable_near_clipping)
+			{
+				detail::clip_polygon_to_plane_in_4d(vertices, glm::tvec4<float>(0.0f, 0.0f, -1.0f, -1.0f), clipped_polygon); // "Normal" (or "4D hyperplane") of the near-plane. I tested it and it works like this but I'm a little bit unsure because Songho says the normal of the near-plane is (0,0,-1,1) (maybe I have to switch around the < 0 checks in the function?)
+				vertices.swap(clipped_polygon);
+			}
+
+			// triangulation of the polygon formed of vertices array
+			if (vertices.size() >= 3)
+			{
+				for (unsigned char k = 0; k < vertices.size() - 2; k++)
+				{
+					boost::optional<detail::TriangleToRasterize> t = detail::process_prospective_tri(vertices[0], vertices[1 + k], vertices[2 + k], viewport_width, viewport_height, enable_backface_culling);
+					if (t && detail::clip_to_region(*t, region)) {
+						triangles_to_raster.push_back(*t);
+						source_triangles.push_back(static_cast<int>(triangle_index));
+					}
+				}
+			}
+		}
+	};
+};
+
+	} /* namespace render */
+} /* namespace eos */
+
+#endif /* RENDERCONTEXT_HPP_ */
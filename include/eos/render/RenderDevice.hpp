@@ -0,0 +1,242 @@
+/*
+ * eos - A 3D Morphable Model fitting library written in modern C++11/14.
+ *
+ * File: include/eos/render/RenderDevice.hpp
+ *
+ * Copyright 2017 Patrik Huber
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#ifndef RENDERDEVICE_HPP_
+#define RENDERDEVICE_HPP_
+
+#include "eos/core/Mesh.hpp"
+#include "eos/core/BoundedQueue.hpp"
+#include "eos/core/ThreadPool.hpp"
+#include "eos/render/Framebuffer.hpp"
+#include "eos/render/RenderContext.hpp"
+#include "eos/render/IsomapPlan.hpp"
+#include "eos/render/render_affine.hpp"
+#include "eos/render/utils.hpp"
+
+#include "glm/mat4x4.hpp"
+#include "glm/vec3.hpp"
+#include "glm/vec4.hpp"
+
+#include "opencv2/core/core.hpp"
+
+#include "boost/optional.hpp"
+
+#include <vector>
+#include <memory>
+#include <future>
+#include <thread>
+#include <functional>
+#include <utility>
+#include <cstddef>
+#include <stdexcept>
+#include <cassert>
+
+namespace eos {
+	namespace render {
+
+/**
+ * @brief Renders and extracts textures of one model for many frames, with the
+ * interface of a GPU command queue.
+ *
+ * The topology (triangles and texture coordinates) is given once, when the device is
+ * created. Per frame, only the vertex positions are updated with update_vertices().
+ * render(), render_depth() and extract_texture() then enqueue a command and return
+ * immediately, with a std::future for the result. The commands are executed one after
+ * another, in the order they were submitted, on the device's own thread, and each one
+ * uses the vertices that were current when it was submitted. So the calling thread can
+ * go on with the fitting of the next frame while the previous one is being rendered.
+ *
+ * The commands are executed with the software renderer: RenderContext::render(),
+ * render_affine_depth() and extract_texture() with an IsomapPlan, so the results are
+ * exactly the same as those of the free functions, which stay the reference. The
+ * device is the place for a hardware backend: An OpenGL or Vulkan implementation would
+ * upload the topology in the constructor, the vertices in update_vertices(), and read
+ * the buffers back in the place of the futures, without changing the interface.
+ *
+ * All member functions must be called from the same thread.
+ */
+class RenderDevice
+{
+public:
+	/**
+	 * Creates a device for meshes with the given topology, and starts its thread.
+	 *
+	 * @param[in] topology The triangle lists and texture coordinates of the meshes to render, e.g. from MorphableModel::get_topology().
+	 * @param[in] isomap_resolution The resolution of the isomaps created by extract_texture().
+	 * @param[in] thread_pool An optional thread pool that the commands rasterise and extract on.
+	 * @param[in] max_pending_commands The number of commands that can be waiting. Submitting more blocks until one has finished.
+	 */
+	RenderDevice(std::shared_ptr<const core::MeshTopology> topology, int isomap_resolution = 512, core::ThreadPool* thread_pool = nullptr, std::size_t max_pending_commands = 8) : thread_pool(thread_pool), commands(max_pending_commands)
+	{
+		if (!topology) {
+			throw std::runtime_error("RenderDevice: No topology given.");
+		}
+		// "Upload" the topology. The vertices are replaced by every command.
+		mesh.texcoords = topology->texcoords;
+		mesh.tvi = topology->tvi;
+		mesh.tci = topology->tci;
+		if (!mesh.texcoords.empty()) {
+			mesh.vertices.resize(mesh.texcoords.size()); // for create_isomap_plan(), which only needs their number
+			isomap_plan = create_isomap_plan(mesh, isomap_resolution);
+		}
+		worker = std::thread([this]() {
+			while (auto command = commands.pop()) {
+				(*command)();
+			}
+		});
+	};
+
+	RenderDevice(const RenderDevice&) = delete;
+	RenderDevice& operator=(const RenderDevice&) = delete;
+
+	/**
+	 * Executes the commands that are still waiting, and stops the device's thread.
+	 */
+	~RenderDevice()
+	{
+		commands.close();
+		worker.join();
+	};
+
+	/**
+	 * Sets the vertex positions and colours that the following commands use.
+	 * The previously submitted commands still use the previous ones.
+	 *
+	 * @param[in] vertices The vertex positions, one for each vertex of the topology.
+	 * @param[in] colors Optional vertex colours, in RGB order. If empty, vertices are gray.
+	 */
+	void update_vertices(std::vector<glm::vec4> vertices, std::vector<glm::vec3> colors = {})
+	{
+		assert(colors.empty() || colors.size() == vertices.size());
+		assert(mesh.texcoords.empty() || mesh.texcoords.size() == vertices.size());
+		auto new_vertices = std::make_shared<Vertices>();
+		new_vertices->positions = std::move(vertices);
+		new_vertices->colors = std::move(colors);
+		current_vertices = std::move(new_vertices);
+	};
+
+	/**
+	 * Enqueues the rendering of the current vertices, like render().
+	 *
+	 * @param[in] model_view_matrix A 4x4 OpenGL model-view matrix.
+	 * @param[in] projection_matrix A 4x4 orthographic or perspective OpenGL projection matrix.
+	 * @param[in] viewport_width Screen width.
+	 * @param[in] viewport_height Screen height.
+	 * @param[in] texture An optional texture map. If not given, vertex-colouring is used.
+	 * @param[in] enable_backface_culling Whether the renderer should perform backface culling.
+	 * @return The colourbuffer (CV_8UC4) and depthbuffer (CV_32FC1), when the command has finished.
+	 */
+	std::future<std::pair<cv::Mat, cv::Mat>> render(const glm::tmat4x4<float>& model_view_matrix, const glm::tmat4x4<float>& projection_matrix, int viewport_width, int viewport_height, boost::optional<Texture> texture = boost::none, bool enable_backface_culling = false)
+	{
+		return submit<std::pair<cv::Mat, cv::Mat>>([=](core::Mesh& mesh) {
+			Framebuffer framebuffer(viewport_width, viewport_height);
+			context.render(mesh, model_view_matrix, projection_matrix, framebuffer, texture, enable_backface_culling, true, true, thread_pool);
+			return std::make_pair(framebuffer.get_colourbuffer(), framebuffer.get_depthbuffer());
+		});
+	};
+
+	/**
+	 * Enqueues a depth-only rendering of the current vertices, like render_depth().
+	 *
+	 * @param[in] model_view_matrix A 4x4 OpenGL model-view matrix.
+	 * @param[in] projection_matrix A 4x4 orthographic or perspective OpenGL projection matrix.
+	 * @param[in] viewport_width Screen width.
+	 * @param[in] viewport_height Screen height.
+	 * @param[in] enable_backface_culling Whether the renderer should perform backface culling.
+	 * @return The depthbuffer (CV_32FC1), when the command has finished.
+	 */
+	std::future<cv::Mat> render_depth(const glm::tmat4x4<float>& model_view_matrix, const glm::tmat4x4<float>& projection_matrix, int viewport_width, int viewport_height, bool enable_backface_culling = false)
+	{
+		return submit<cv::Mat>([=](core::Mesh& mesh) {
+			Framebuffer framebuffer(viewport_width, viewport_height, false);
+			context.render_depth(mesh, model_view_matrix, projection_matrix, framebuffer, nullptr, enable_backface_culling);
+			return framebuffer.get_depthbuffer();
+		});
+	};
+
+	/**
+	 * Enqueues the extraction of the texture of the current vertices from the given
+	 * image, like extract_texture() with an IsomapPlan. The depth buffer for the
+	 * visibility test is rendered by the command as well.
+	 *
+	 * @param[in] affine_camera_matrix An estimated 3x4 affine camera matrix.
+	 * @param[in] image The image to extract the texture from, CV_8UC3. It must not be modified until the command has finished.
+	 * @param[in] compute_view_angle A flag whether the view angle of each triangle should be encoded into the alpha channel.
+	 * @return The isomap (CV_8UC4), when the command has finished.
+	 * @throw std::runtime_error If the topology has no texture coordinates.
+	 */
+	std::future<cv::Mat> extract_texture(cv::Mat affine_camera_matrix, cv::Mat image, bool compute_view_angle = false)
+	{
+		if (mesh.texcoords.empty()) {
+			throw std::runtime_error("RenderDevice: The topology has no texture coordinates.");
+		}
+		return submit<cv::Mat>([=](core::Mesh& mesh) {
+			return render::extract_texture(isomap_plan, mesh, affine_camera_matrix, image, compute_view_angle, thread_pool);
+		});
+	};
+
+	/**
+	 * Waits until all submitted commands have finished.
+	 */
+	void finish()
+	{
+		submit<bool>([](core::Mesh&) { return true; }).wait();
+	};
+
+private:
+	struct Vertices
+	{
+		std::vector<glm::vec4> positions;
+		std::vector<glm::vec3> colors;
+	};
+
+	// Enqueues a command, that is called with the mesh, with the vertices that are current now.
+	template <typename Result, typename Command>
+	std::future<Result> submit(Command command)
+	{
+		if (!current_vertices) {
+			throw std::runtime_error("RenderDevice: update_vertices() has to be called before the first command.");
+		}
+		// std::function needs a copyable function, so the (move-only) task is shared:
+		auto task = std::make_shared<std::packaged_task<Result()>>([this, command, vertices = current_vertices]() {
+			// Only the device's thread accesses the mesh. Assigning the vectors reuses their memory.
+			mesh.vertices = vertices->positions;
+			mesh.colors = vertices->colors;
+			return command(mesh);
+		});
+		std::future<Result> result = task->get_future();
+		commands.push([task]() { (*task)(); });
+		return result;
+	};
+
+	core::ThreadPool* thread_pool;
+	std::shared_ptr<const Vertices> current_vertices; // shared with the commands that use them
+	core::Mesh mesh; // the topology, and the vertices of the executing command. Only the device's thread changes it after construction.
+	IsomapPlan isomap_plan;
+	RenderContext context; // only used by the device's thread
+	core::BoundedQueue<std::function<void()>> commands;
+	std::thread worker; // declared last, so that it starts after, and stops before, the members above are destroyed
+};
+
+	} /* namespace render */
+} /* namespace eos */
+
+#endif /* RENDERDEVICE_HPP_ */
@@ -23,6 +23,7 @@
 #define SOFTWARERENDERER_HPP_
 
 #include "eos/core/Mesh.hpp"
+#include "eos/core/ThreadPool.hpp"
 #include "eos/render/Rasterizer.hpp"
 #include "eos/render/detail/Vertex.hpp"
 #include "eos/render/detail/render_detail.hpp"
@@ -104,6 +105,29 @@ public:
     cv::Mat render(const core::Mesh& mesh, const glm::tmat4x4<T, P>& model_view_matrix,
                    const glm::tmat4x4<T, P>& projection_matrix,
                    const boost::optional<Texture>& texture = boost::none)
+    {
+        cv::Mat colourbuffer;
+        detail::dispatch_raster_policy(
+            [&](auto policy) {
+                colourbuffer = this->template render_with<decltype(policy)>(mesh, model_view_matrix,
+                                                                            projection_matrix, texture);
+            },
+            rasterizer->enable_depth_test, rasterizer->enable_far_clipping, !rasterizer->extracting_tex,
+            texture.is_initialized());
+        return colourbuffer;
+    };
+
+    /**
+     * @brief Like render(), but with the per-pixel options given by \p Policy, a RasterPolicy,
+     * instead of the flags of the rasteriser. The pipeline is compiled for that
+     * configuration, without branches on these options in the pixel loop.
+     *
+     * @tparam Policy A RasterPolicy. If Policy::textured, \p texture must be set.
+     */
+    template <typename Policy, typename T, glm::precision P = glm::defaultp>
+    cv::Mat render_with(const core::Mesh& mesh, const glm::tmat4x4<T, P>& model_view_matrix,
+                        const glm::tmat4x4<T, P>& projection_matrix,
+                        const boost::optional<Texture>& texture = boost::none)
     {
         assert(mesh.vertices.size() == mesh.colors.size() ||
                mesh.colors.empty()); // The number of vertices has to be equal for both shape and colour, or,
@@ -151,7 +175,7 @@ public:
                     visibility_bits[k] |= 8;
                 if (enable_near_clipping && z_cc < -w_cc) // near plane frustum clipping
                     visibility_bits[k] |= 16;
-                if (rasterizer->enable_far_clipping && z_cc > w_cc) // far plane frustum clipping
+                if (Policy::far_clipping && z_cc > w_cc) // far plane frustum clipping
                     visibility_bits[k] |= 32;
             } // if all bits are 0, then it's inside the frustum
             // all vertices are not visible - reject the triangle.
@@ -323,17 +347,41 @@ public:
         // We may have more triangles than in the original mesh.
 
         // Raster each triangle and apply the fragment shader on each pixel:
-        for (const auto& tri : triangles_to_raster)
+        if (thread_pool && thread_pool->get_num_threads() > 1)
         {
-            rasterizer->raster_triangle(tri[0], tri[1], tri[2], texture);
+            // Rasterise tiles of the screen in parallel (the fragment shaders are stateless):
+            std::vector<cv::Rect> bounding_boxes;
+            bounding_boxes.reserve(triangles_to_raster.size());
+            for (const auto& tri : triangles_to_raster)
+            {
+                bounding_boxes.push_back(detail::calculate_clipped_bounding_box(
+                    glm::tvec2<T, P>(tri[0].position.x, tri[0].position.y),
+                    glm::tvec2<T, P>(tri[1].position.x, tri[1].position.y),
+                    glm::tvec2<T, P>(tri[2].position.x, tri[2].position.y), rasterizer->viewport_width,
+                    rasterizer->viewport_height));
+            }
+            detail::raster_tiled(bounding_boxes, rasterizer->viewport_width, rasterizer->viewport_height,
+                                 tile_size, *thread_pool, [&](int i, const cv::Rect& tile) {
+                                     const auto& tri = triangles_to_raster[i];
+                                     rasterizer->template raster_triangle_with<Policy>(tri[0], tri[1], tri[2],
+                                                                                       texture, tile);
+                                 });
+        } else
+        {
+            for (const auto& tri : triangles_to_raster)
+            {
+                rasterizer->template raster_triangle_with<Policy>(tri[0], tri[1], tri[2], texture);
+            }
         }
-        return rasterizer->colorbuffer;
+        return rasterizer->framebuffer.get_colourbuffer();
     };
 
 public: // Todo: these should go private in the final implementation
     boost::optional<Texture> texture = boost::none;
     bool enable_backface_culling = false;
     bool enable_near_clipping = true;
+    core::ThreadPool* thread_pool = nullptr; ///< If set, tiles of the screen are rasterised in parallel on this pool.
+    int tile_size = 64; ///< Width and height of the tiles, if a thread_pool is set.
 
     std::unique_ptr<Rasterizer<FragmentShaderType>> rasterizer; // Rasterizer is not default-constructible
 private:
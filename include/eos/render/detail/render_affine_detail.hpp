@@ -22,12 +22,21 @@
 #ifndef RENDER_AFFINE_DETAIL_HPP_
 #define RENDER_AFFINE_DETAIL_HPP_
 
+#include "eos/core/Mesh.hpp"
+#include "eos/core/VertexView.hpp"
+#include "eos/render/transform_vertices.hpp"
 #include "eos/render/detail/render_detail.hpp"
 
+#include "glm/mat4x4.hpp"
 #include "glm/vec3.hpp"
+#include "glm/vec4.hpp"
 
 #include "opencv2/core/core.hpp"
 
+#include <vector>
+#include <cstddef>
+#include <cassert>
+
 /**
  * Implementations of internal functions, not part of the
  * API we expose and not meant to be used by a user.
@@ -73,6 +82,28 @@ inline cv::Mat calculate_affine_z_direction(cv::Mat affine_camera_matrix)
 	return affine_cam_4x4;
 };
 
+/**
+ * Projects the given vertices with a 4x4 affine camera matrix, as returned by
+ * calculate_affine_z_direction(). The matrix is read once, instead of doing a
+ * cv::Mat multiplication for every vertex, and the vertices are transformed in
+ * blocks by render::transform_vertices().
+ *
+ * @param[in] vertices The vertices to project. Their w coordinate is 1.
+ * @param[in] affine_cam_4x4 A 4x4 affine camera matrix, CV_32FC1.
+ * @param[out] projected_vertices The projected vertices, in the same order. Resized if necessary.
+ */
+inline void project_affine(const std::vector<glm::tvec4<float>>& vertices, const cv::Mat& affine_cam_4x4, std::vector<glm::tvec4<float>>& projected_vertices)
+{
+	assert(affine_cam_4x4.rows == 4 && affine_cam_4x4.cols == 4 && affine_cam_4x4.type() == CV_32FC1);
+	glm::tmat4x4<float> m; // glm is column-major
+	for (int row = 0; row < 4; ++row) {
+		for (int col = 0; col < 4; ++col) {
+			m[col][row] = affine_cam_4x4.at<float>(row, col);
+		}
+	}
+	transform_vertices(core::VertexView(vertices), m, projected_vertices);
+};
+
 /**
  * Rasters a triangle into the given colour and depth buffer.
  *
@@ -89,14 +120,16 @@ inline cv::Mat calculate_affine_z_direction(cv::Mat affine_camera_matrix)
  * Note/Todo: See where and how this is used, and how similar it is to
  * the "normal" raster_triangle. Maybe rename to raster_triangle_vertexcolour?
  *
- * @param[in] triangle A triangle.
- * @param[in] colourbuffer The colour buffer to draw into.
- * @param[in] depthbuffer The depth buffer to draw into and use for the depth test.
+ * @param[in] triangle A triangle, with its bounding box clipped to the framebuffer.
+ * @param[in,out] framebuffer The framebuffer to draw into and use for the depth test.
  */
-inline void raster_triangle_affine(TriangleToRasterize triangle, cv::Mat colourbuffer, cv::Mat depthbuffer)
+inline void raster_triangle_affine(TriangleToRasterize triangle, Framebuffer& framebuffer)
 {
+	const cv::Point offset = framebuffer.get_region().tl(); // the buffers only cover this region of the viewport
 	for (int yi = triangle.min_y; yi <= triangle.max_y; ++yi)
 	{
+		std::uint8_t* const colour_row = framebuffer.colour_row(yi - offset.y);
+		float* const depth_row = framebuffer.depth_row(yi - offset.y);
 		for (int xi = triangle.min_x; xi <= triangle.max_x; ++xi)
 		{
 			// we want centers of pixels to be used in computations. Todo: Do we?
@@ -115,11 +148,9 @@ inline void raster_triangle_affine(TriangleToRasterize triangle, cv::Mat colourb
 			// if pixel (x, y) is inside the triangle or on one of its edges
 			if (alpha >= 0 && beta >= 0 && gamma >= 0)
 			{
-				const int pixel_index_row = yi;
-				const int pixel_index_col = xi;
-
 				const double z_affine = alpha*static_cast<double>(triangle.v0.position[2]) + beta*static_cast<double>(triangle.v1.position[2]) + gamma*static_cast<double>(triangle.v2.position[2]);
-				if (z_affine < depthbuffer.at<double>(pixel_index_row, pixel_index_col))
+				const float depth = static_cast<float>(z_affine); // the depth buffer is float, so compare with the value that we store
+				if (depth < depth_row[xi - offset.x])
 				{
 					// attributes interpolation
 					// pixel_color is in RGB, v.color are RGB
@@ -131,17 +162,89 @@ inline void raster_triangle_affine(TriangleToRasterize triangle, cv::Mat colourb
 					const unsigned char blue = static_cast<unsigned char>(255.0f * std::min(pixel_color[2], 1.0f));
 
 					// update buffers
-					colourbuffer.at<cv::Vec4b>(pixel_index_row, pixel_index_col)[0] = blue;
-					colourbuffer.at<cv::Vec4b>(pixel_index_row, pixel_index_col)[1] = green;
-					colourbuffer.at<cv::Vec4b>(pixel_index_row, pixel_index_col)[2] = red;
-					colourbuffer.at<cv::Vec4b>(pixel_index_row, pixel_index_col)[3] = 255; // alpha channel
-					depthbuffer.at<double>(pixel_index_row, pixel_index_col) = z_affine;
+					std::uint8_t* const pixel = colour_row + 4 * (xi - offset.x);
+					pixel[0] = blue;
+					pixel[1] = green;
+					pixel[2] = red;
+					pixel[3] = 255; // alpha channel
+					depth_row[xi - offset.x] = depth;
 				}
 			}
 		}
 	}
 };
 
+/**
+ * Projects the vertices of the mesh with the given affine camera matrix, and sets
+ * up the triangles to raster for the affine renderer, with optional backface culling.
+ *
+ * @param[in] mesh A 3D mesh.
+ * @param[in] affine_camera_matrix 3x4 affine camera matrix.
+ * @param[in] viewport_width Screen width.
+ * @param[in] viewport_height Screen height.
+ * @param[in] do_backface_culling Whether to drop the triangles that face away from the camera.
+ * @param[out] source_triangles If given, the index in mesh.tvi of each returned triangle is appended to it.
+ * @return The triangles in screen space, with their bounding boxes.
+ */
+inline std::vector<TriangleToRasterize> setup_affine_triangles(const core::Mesh& mesh, cv::Mat affine_camera_matrix, int viewport_width, int viewport_height, bool do_backface_culling, std::vector<int>* source_triangles = nullptr)
+{
+	using std::vector;
+
+	vector<glm::tvec4<float>> screen_coords;
+	project_affine(mesh.vertices, calculate_affine_z_direction(affine_camera_matrix), screen_coords);
+
+	vector<Vertex<float>> projected_vertices;
+	projected_vertices.reserve(mesh.vertices.size());
+	for (int i = 0; i < mesh.vertices.size(); ++i) {
+		const glm::tvec4<float>& vertex_screen_coords_glm = screen_coords[i];
+		glm::tvec3<float> vertex_colour;
+		if (mesh.colors.empty()) {
+			vertex_colour = glm::tvec3<float>(0.5f, 0.5f, 0.5f);
+		}
+		else {
+			vertex_colour = mesh.colors[i];
+		}
+		const glm::tvec2<float> texcoords = mesh.texcoords.empty() ? glm::tvec2<float>(0.0f, 0.0f) : mesh.texcoords[i];
+		projected_vertices.push_back(Vertex<float>{vertex_screen_coords_glm, vertex_colour, texcoords});
+	}
+
+	// All vertices are screen-coordinates now
+	vector<TriangleToRasterize> triangles_to_raster;
+	for (std::size_t triangle_index = 0; triangle_index < mesh.tvi.size(); ++triangle_index) {
+		const auto& tri_indices = mesh.tvi[triangle_index];
+		if (do_backface_culling) {
+			if (!are_vertices_ccw_in_screen_space(glm::tvec2<float>(projected_vertices[tri_indices[0]].position), glm::tvec2<float>(projected_vertices[tri_indices[1]].position), glm::tvec2<float>(projected_vertices[tri_indices[2]].position)))
+				continue; // don't render this triangle
+		}
+
+		// Get the bounding box of the triangle:
+		// take care: What do we do if all 3 vertices are not visible. Seems to work on a test case.
+		cv::Rect bounding_box = calculate_clipped_bounding_box(glm::tvec2<float>(projected_vertices[tri_indices[0]].position), glm::tvec2<float>(projected_vertices[tri_indices[1]].position), glm::tvec2<float>(projected_vertices[tri_indices[2]].position), viewport_width, viewport_height);
+		auto min_x = bounding_box.x;
+		auto max_x = bounding_box.x + bounding_box.width;
+		auto min_y = bounding_box.y;
+		auto max_y = bounding_box.y + bounding_box.height;
+
+		if (max_x <= min_x || max_y <= min_y) // Note: Can the width/height of the bbox be negative? Maybe we only need to check for equality here?
+			continue;
+
+		TriangleToRasterize t;
+		t.min_x = min_x;
+		t.max_x = max_x;
+		t.min_y = min_y;
+		t.max_y = max_y;
+		t.v0 = projected_vertices[tri_indices[0]];
+		t.v1 = projected_vertices[tri_indices[1]];
+		t.v2 = projected_vertices[tri_indices[2]];
+
+		triangles_to_raster.push_back(t);
+		if (source_triangles) {
+			source_triangles->push_back(static_cast<int>(triangle_index));
+		}
+	}
+	return triangles_to_raster;
+};
+
 		} /* namespace detail */
 	} /* namespace render */
 } /* namespace eos */
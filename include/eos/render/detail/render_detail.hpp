@@ -22,8 +22,11 @@
 #ifndef RENDER_DETAIL_HPP_
 #define RENDER_DETAIL_HPP_
 
+#include "eos/core/ThreadPool.hpp"
+#include "eos/render/Framebuffer.hpp"
 #include "eos/render/utils.hpp"
 #include "eos/render/detail/Vertex.hpp"
+#include "eos/render/detail/simd.hpp"
 
 #include "glm/glm.hpp" // tvec2, glm::precision, tvec3, tvec4, normalize, dot, cross
 
@@ -31,6 +34,12 @@
 
 #include "boost/optional.hpp"
 
+#include <array>
+#include <limits>
+#include <cstdint>
+#include <algorithm>
+#include <cmath>
+
 /**
  * Implementations of internal functions, not part of the
  * API we expose and not meant to be used by a user.
@@ -188,6 +197,35 @@ cv::Rect calculate_clipped_bounding_box(const glm::tvec2<T, P>& v0, const glm::t
 	return cv::Rect(minX, minY, maxX - minX, maxY - minY);
 };
 
+/**
+ * Returns the pixels that the rasterisers can draw for a mesh with the given
+ * bounds in screen space, i.e. the union of the bounding boxes of its triangles
+ * as calculated by calculate_clipped_bounding_box(), grown by \p margin pixels
+ * and clipped to the viewport.
+ *
+ * @param[in] min_x The smallest x coordinate of the vertices, in screen space.
+ * @param[in] min_y The smallest y coordinate of the vertices, in screen space.
+ * @param[in] max_x The largest x coordinate of the vertices, in screen space.
+ * @param[in] max_y The largest y coordinate of the vertices, in screen space.
+ * @param[in] viewport_width Screen width.
+ * @param[in] viewport_height Screen height.
+ * @param[in] margin The number of pixels to add on each side.
+ * @return The region of the viewport, empty if it lies outside of the viewport.
+ */
+inline cv::Rect get_pixel_region(float min_x, float min_y, float max_x, float max_y, int viewport_width, int viewport_height, int margin)
+{
+	// Clamp first, so that vertices far outside of the screen don't overflow the conversion to int:
+	const auto clamp_to = [](float value, int size) { return std::min(std::max(value, -1.0f), static_cast<float>(size) + 1.0f); };
+	const int x0 = static_cast<int>(std::floor(clamp_to(min_x, viewport_width))) - margin;
+	const int y0 = static_cast<int>(std::floor(clamp_to(min_y, viewport_height))) - margin;
+	const int x1 = static_cast<int>(std::ceil(clamp_to(max_x, viewport_width))) + margin;
+	const int y1 = static_cast<int>(std::ceil(clamp_to(max_y, viewport_height))) + margin;
+	if (x1 < x0 || y1 < y0) {
+		return cv::Rect();
+	}
+	return cv::Rect(x0, y0, x1 - x0 + 1, y1 - y0 + 1) & cv::Rect(0, 0, viewport_width, viewport_height);
+};
+
 /**
  * Computes whether the triangle formed out of the given three vertices is
  * counter-clockwise in screen space. Assumes the origin of the screen is on
@@ -215,9 +253,17 @@ double implicit_line(float x, float y, const glm::tvec4<T, P>& v1, const glm::tv
 	return ((double)v1[1] - (double)v2[1])*(double)x + ((double)v2[0] - (double)v1[0])*(double)y + (double)v1[0] * (double)v2[1] - (double)v2[0] * (double)v1[1];
 };
 
-inline std::vector<Vertex<float>> clip_polygon_to_plane_in_4d(const std::vector<Vertex<float>>& vertices, const glm::tvec4<float>& plane_normal)
+/**
+ * Clips a polygon against a plane in homogeneous coordinates. Writes the clipped
+ * polygon into the given vector, so that its memory can be reused.
+ *
+ * @param[in] vertices The polygon.
+ * @param[in] plane_normal The "normal" of the 4D hyperplane.
+ * @param[out] clippedVertices The clipped polygon. Must not be the same vector as \p vertices.
+ */
+inline void clip_polygon_to_plane_in_4d(const std::vector<Vertex<float>>& vertices, const glm::tvec4<float>& plane_normal, std::vector<Vertex<float>>& clippedVertices)
 {
-	std::vector<Vertex<float>> clippedVertices;
+	clippedVertices.clear();
 
 	// We can have 2 cases:
 	//	* 1 vertex visible: we make 1 new triangle out of the visible vertex plus the 2 intersection points with the near-plane
@@ -259,7 +305,12 @@ inline std::vector<Vertex<float>> clip_polygon_to_plane_in_4d(const std::vector<
 		}
 		// else, both vertices are not visible, nothing to add and draw
 	}
+};
 
+inline std::vector<Vertex<float>> clip_polygon_to_plane_in_4d(const std::vector<Vertex<float>>& vertices, const glm::tvec4<float>& plane_normal)
+{
+	std::vector<Vertex<float>> clippedVertices;
+	clip_polygon_to_plane_in_4d(vertices, plane_normal, clippedVertices);
 	return clippedVertices;
 };
 
@@ -316,76 +367,67 @@ glm::tvec3<T, P> tex2d(const glm::tvec2<T, P>& texcoords, const Texture& texture
 inline cv::Vec3f tex2d_linear_mipmap_linear(const cv::Vec2f& texcoords, const Texture& texture, float dudx, float dudy, float dvdx, float dvdy)
 {
 	using cv::Vec2f;
-	float px = std::sqrt(std::pow(dudx, 2) + std::pow(dvdx, 2));
-	float py = std::sqrt(std::pow(dudy, 2) + std::pow(dvdy, 2));
-	float lambda = std::log(std::max(px, py)) / CV_LOG2;
-	unsigned char mipmapIndex1 = detail::clamp((int)lambda, 0.0f, std::max(texture.widthLog, texture.heightLog) - 1);
-	unsigned char mipmapIndex2 = mipmapIndex1 + 1;
-
-	Vec2f imageTexCoord = detail::texcoord_wrap(texcoords);
+	const float px = std::sqrt(dudx * dudx + dvdx * dvdx);
+	const float py = std::sqrt(dudy * dudy + dvdy * dvdy);
+	const float lambda = std::log(std::max(px, py)) / CV_LOG2;
+	const int max_mipmap_index = static_cast<int>(texture.mipmaps.size()) - 1;
+	const unsigned char mipmapIndex1 = detail::clamp((int)lambda, 0.0f, std::max(max_mipmap_index - 1, 0));
+	const unsigned char mipmapIndex2 = std::min(mipmapIndex1 + 1, max_mipmap_index);
+
+	const Vec2f imageTexCoord = detail::texcoord_wrap(texcoords);
 	Vec2f imageTexCoord1 = imageTexCoord;
 	imageTexCoord1[0] *= texture.mipmaps[mipmapIndex1].cols;
 	imageTexCoord1[1] *= texture.mipmaps[mipmapIndex1].rows;
+	const cv::Vec3f color1 = tex2d_linear(imageTexCoord1, mipmapIndex1, texture);
+	if (mipmapIndex2 == mipmapIndex1) {
+		return color1;
+	}
 	Vec2f imageTexCoord2 = imageTexCoord;
 	imageTexCoord2[0] *= texture.mipmaps[mipmapIndex2].cols;
 	imageTexCoord2[1] *= texture.mipmaps[mipmapIndex2].rows;
+	const cv::Vec3f color2 = tex2d_linear(imageTexCoord2, mipmapIndex2, texture);
 
-	cv::Vec3f color, color1, color2;
-	color1 = tex2d_linear(imageTexCoord1, mipmapIndex1, texture);
-	color2 = tex2d_linear(imageTexCoord2, mipmapIndex2, texture);
 	float lambdaFrac = std::max(lambda, 0.0f);
 	lambdaFrac = lambdaFrac - (int)lambdaFrac;
-	color = (1.0f - lambdaFrac)*color1 + lambdaFrac*color2;
-
-	return color;
+	return (1.0f - lambdaFrac)*color1 + lambdaFrac*color2;
 };
 
+/**
+ * Samples the given mip level of a texture bilinearly, wrapping around at the
+ * borders. The four texels are read directly from the level's rows, and all
+ * colour channels are weighted together. Works with 3- and 4-channel levels.
+ *
+ * @param[in] imageTexCoord The texture coordinates, in pixels of the mip level.
+ * @param[in] mipmap_index The mip level to sample.
+ * @param[in] texture The texture.
+ * @return The first three channels of the sampled colour (BGR), in [0, 255].
+ */
 inline cv::Vec3f tex2d_linear(const cv::Vec2f& imageTexCoord, unsigned char mipmap_index, const Texture& texture)
 {
-	int x = (int)imageTexCoord[0];
-	int y = (int)imageTexCoord[1];
-	float alpha = imageTexCoord[0] - x;
-	float beta = imageTexCoord[1] - y;
-	float oneMinusAlpha = 1.0f - alpha;
-	float oneMinusBeta = 1.0f - beta;
-	float a = oneMinusAlpha * oneMinusBeta;
-	float b = alpha * oneMinusBeta;
-	float c = oneMinusAlpha * beta;
-	float d = alpha * beta;
-	cv::Vec3f color;
-
-	using cv::Vec4b;
-	//int pixelIndex;
-	//pixelIndex = getPixelIndex_wrap(x, y, texture->mipmaps[mipmapIndex].cols, texture->mipmaps[mipmapIndex].rows);
-	int pixelIndexCol = x; if (pixelIndexCol == texture.mipmaps[mipmap_index].cols) { pixelIndexCol = 0; }
-	int pixelIndexRow = y; if (pixelIndexRow == texture.mipmaps[mipmap_index].rows) { pixelIndexRow = 0; }
-	//std::cout << texture.mipmaps[mipmapIndex].cols << " " << texture.mipmaps[mipmapIndex].rows << " " << texture.mipmaps[mipmapIndex].channels() << std::endl;
-	//cv::imwrite("mm.png", texture.mipmaps[mipmapIndex]);
-	color[0] = a * texture.mipmaps[mipmap_index].at<Vec4b>(pixelIndexRow, pixelIndexCol)[0];
-	color[1] = a * texture.mipmaps[mipmap_index].at<Vec4b>(pixelIndexRow, pixelIndexCol)[1];
-	color[2] = a * texture.mipmaps[mipmap_index].at<Vec4b>(pixelIndexRow, pixelIndexCol)[2];
-
-	//pixelIndex = getPixelIndex_wrap(x + 1, y, texture.mipmaps[mipmapIndex].cols, texture.mipmaps[mipmapIndex].rows);
-	pixelIndexCol = x + 1; if (pixelIndexCol == texture.mipmaps[mipmap_index].cols) { pixelIndexCol = 0; }
-	pixelIndexRow = y; if (pixelIndexRow == texture.mipmaps[mipmap_index].rows) { pixelIndexRow = 0; }
-	color[0] += b * texture.mipmaps[mipmap_index].at<Vec4b>(pixelIndexRow, pixelIndexCol)[0];
-	color[1] += b * texture.mipmaps[mipmap_index].at<Vec4b>(pixelIndexRow, pixelIndexCol)[1];
-	color[2] += b * texture.mipmaps[mipmap_index].at<Vec4b>(pixelIndexRow, pixelIndexCol)[2];
-
-	//pixelIndex = getPixelIndex_wrap(x, y + 1, texture.mipmaps[mipmapIndex].cols, texture.mipmaps[mipmapIndex].rows);
-	pixelIndexCol = x; if (pixelIndexCol == texture.mipmaps[mipmap_index].cols) { pixelIndexCol = 0; }
-	pixelIndexRow = y + 1; if (pixelIndexRow == texture.mipmaps[mipmap_index].rows) { pixelIndexRow = 0; }
-	color[0] += c * texture.mipmaps[mipmap_index].at<Vec4b>(pixelIndexRow, pixelIndexCol)[0];
-	color[1] += c * texture.mipmaps[mipmap_index].at<Vec4b>(pixelIndexRow, pixelIndexCol)[1];
-	color[2] += c * texture.mipmaps[mipmap_index].at<Vec4b>(pixelIndexRow, pixelIndexCol)[2];
-
-	//pixelIndex = getPixelIndex_wrap(x + 1, y + 1, texture.mipmaps[mipmapIndex].cols, texture.mipmaps[mipmapIndex].rows);
-	pixelIndexCol = x + 1; if (pixelIndexCol == texture.mipmaps[mipmap_index].cols) { pixelIndexCol = 0; }
-	pixelIndexRow = y + 1; if (pixelIndexRow == texture.mipmaps[mipmap_index].rows) { pixelIndexRow = 0; }
-	color[0] += d * texture.mipmaps[mipmap_index].at<Vec4b>(pixelIndexRow, pixelIndexCol)[0];
-	color[1] += d * texture.mipmaps[mipmap_index].at<Vec4b>(pixelIndexRow, pixelIndexCol)[1];
-	color[2] += d * texture.mipmaps[mipmap_index].at<Vec4b>(pixelIndexRow, pixelIndexCol)[2];
-
+	const cv::Mat& mipmap = texture.mipmaps[mipmap_index];
+	const int x = (int)imageTexCoord[0];
+	const int y = (int)imageTexCoord[1];
+	const float alpha = imageTexCoord[0] - x;
+	const float beta = imageTexCoord[1] - y;
+	const float oneMinusAlpha = 1.0f - alpha;
+	const float oneMinusBeta = 1.0f - beta;
+	const float weights[4] = { oneMinusAlpha * oneMinusBeta, alpha * oneMinusBeta, oneMinusAlpha * beta, alpha * beta };
+
+	const int num_channels = mipmap.channels();
+	const int x0 = (x == mipmap.cols) ? 0 : x;
+	const int x1 = (x + 1 >= mipmap.cols) ? 0 : x + 1;
+	const int y0 = (y == mipmap.rows) ? 0 : y;
+	const int y1 = (y + 1 >= mipmap.rows) ? 0 : y + 1;
+	const uchar* const row0 = mipmap.ptr<uchar>(y0);
+	const uchar* const row1 = mipmap.ptr<uchar>(y1);
+	const uchar* const texels[4] = { row0 + num_channels * x0, row0 + num_channels * x1, row1 + num_channels * x0, row1 + num_channels * x1 };
+
+	cv::Vec3f color(0.0f, 0.0f, 0.0f);
+	for (int i = 0; i < 4; ++i) {
+		color[0] += weights[i] * texels[i][0];
+		color[1] += weights[i] * texels[i][1];
+		color[2] += weights[i] * texels[i][2];
+	}
 	return color;
 };
 
@@ -469,22 +511,107 @@ inline boost::optional<TriangleToRasterize> process_prospective_tri(Vertex<float
 	return boost::optional<TriangleToRasterize>(t);
 };
 
-inline void raster_triangle(TriangleToRasterize triangle, cv::Mat colourbuffer, cv::Mat depthbuffer, boost::optional<Texture> texture, bool enable_far_clipping)
+/**
+ * Computes the colour of a textured fragment of a triangle, at the pixel (x, y), with
+ * a mipmap level that is chosen from the partial derivatives of the texture coordinates.
+ *
+ * @param[in] triangle The triangle that the fragment belongs to.
+ * @param[in] x X coordinate of the pixel centre.
+ * @param[in] y Y coordinate of the pixel centre.
+ * @param[in] texcoords_persp The perspective-correct interpolated texture coordinates.
+ * @param[in] texture The texture map.
+ * @return The colour of the fragment, in RGB.
+ */
+inline glm::tvec3<float> shade_textured_fragment(const TriangleToRasterize& triangle, float x, float y, const glm::tvec2<float>& texcoords_persp, const Texture& texture)
 {
-	using cv::Vec2f;
-	using cv::Vec3f;
+	// partial derivatives (for mip-mapping)
+	const float u_over_z = -(triangle.alphaPlane.a*x + triangle.alphaPlane.b*y + triangle.alphaPlane.d) * triangle.one_over_alpha_c;
+	const float v_over_z = -(triangle.betaPlane.a*x + triangle.betaPlane.b*y + triangle.betaPlane.d) * triangle.one_over_beta_c;
+	const float one_over_z = -(triangle.gammaPlane.a*x + triangle.gammaPlane.b*y + triangle.gammaPlane.d) * triangle.one_over_gamma_c;
+	const float one_over_squared_one_over_z = 1.0f / std::pow(one_over_z, 2);
+
+	// partial derivatives of U/V coordinates with respect to X/Y pixel's screen coordinates
+	float dudx = one_over_squared_one_over_z * (triangle.alpha_ffx * one_over_z - u_over_z * triangle.gamma_ffx);
+	float dudy = one_over_squared_one_over_z * (triangle.beta_ffx * one_over_z - v_over_z * triangle.gamma_ffx);
+	float dvdx = one_over_squared_one_over_z * (triangle.alpha_ffy * one_over_z - u_over_z * triangle.gamma_ffy);
+	float dvdy = one_over_squared_one_over_z * (triangle.beta_ffy * one_over_z - v_over_z * triangle.gamma_ffy);
+
+	dudx *= texture.mipmaps[0].cols;
+	dudy *= texture.mipmaps[0].cols;
+	dvdx *= texture.mipmaps[0].rows;
+	dvdy *= texture.mipmaps[0].rows;
+
+	// The Texture is in BGR, thus tex2D returns BGR
+	glm::tvec3<float> texture_color = detail::tex2d(texcoords_persp, texture, dudx, dudy, dvdx, dvdy); // uses the current texture
+	return glm::tvec3<float>(texture_color[2], texture_color[1], texture_color[0]);
+	// other: color.mul(tex2D(texture, texCoord));
+	// Old note: for texturing, we load the texture as BGRA, so the colors get the wrong way in the next few lines...
+};
+
+/**
+ * Writes an RGB colour in [0, 1] into a BGRA pixel of the colour buffer, with full alpha.
+ *
+ * @param[in] pixel_color The colour, in RGB.
+ * @param[out] pixel The pixel to write (4 bytes).
+ */
+inline void write_fragment_colour(const glm::tvec3<float>& pixel_color, std::uint8_t* pixel)
+{
+	// clamp bytes to 255
+	const unsigned char red = static_cast<unsigned char>(255.0f * std::min(pixel_color[0], 1.0f)); // Todo: Proper casting (rounding?)
+	const unsigned char green = static_cast<unsigned char>(255.0f * std::min(pixel_color[1], 1.0f));
+	const unsigned char blue = static_cast<unsigned char>(255.0f * std::min(pixel_color[2], 1.0f));
+
+	pixel[0] = blue;
+	pixel[1] = green;
+	pixel[2] = red;
+	pixel[3] = 255; // alpha channel
+};
+
+/**
+ * Clips the bounding box of a triangle to a region of the viewport, usually the
+ * one that a Framebuffer covers (Framebuffer::get_region()). The rasterisers
+ * require the bounding boxes to lie inside the region of their framebuffer.
+ *
+ * @param[in,out] triangle A triangle, whose bounding box is clipped.
+ * @param[in] region The region of the viewport, in pixels.
+ * @return Whether any of the bounding box lies inside the region, i.e. whether the triangle needs to be rastered.
+ */
+inline bool clip_to_region(TriangleToRasterize& triangle, const cv::Rect& region)
+{
+	triangle.min_x = std::max(triangle.min_x, region.x);
+	triangle.max_x = std::min(triangle.max_x, region.x + region.width - 1);
+	triangle.min_y = std::max(triangle.min_y, region.y);
+	triangle.max_y = std::min(triangle.max_y, region.y + region.height - 1);
+	return triangle.min_x <= triangle.max_x && triangle.min_y <= triangle.max_y;
+};
+
+/**
+ * Rasters a triangle into the given framebuffer, one pixel at a time, in double
+ * precision. This is the reference implementation, raster_triangle_simd() is faster.
+ *
+ * @param[in] triangle A triangle, with its bounding box clipped to the framebuffer.
+ * @param[in,out] framebuffer The framebuffer to draw into and use for the depth test.
+ * @param[in] texture An optional texture map. If not given, vertex-colouring is used.
+ * @param[in] enable_far_clipping Whether the pixels should be clipped against the far plane.
+ */
+inline void raster_triangle(TriangleToRasterize triangle, Framebuffer& framebuffer, const boost::optional<Texture>& texture, bool enable_far_clipping)
+{
+	// these will be used for barycentric weights computation
+	const double one_over_v0ToLine12 = 1.0 / implicit_line(triangle.v0.position[0], triangle.v0.position[1], triangle.v1.position, triangle.v2.position);
+	const double one_over_v1ToLine20 = 1.0 / implicit_line(triangle.v1.position[0], triangle.v1.position[1], triangle.v2.position, triangle.v0.position);
+	const double one_over_v2ToLine01 = 1.0 / implicit_line(triangle.v2.position[0], triangle.v2.position[1], triangle.v0.position, triangle.v1.position);
+
+	const cv::Point offset = framebuffer.get_region().tl(); // the buffers only cover this region of the viewport
 	for (int yi = triangle.min_y; yi <= triangle.max_y; ++yi)
 	{
+		std::uint8_t* const colour_row = framebuffer.colour_row(yi - offset.y);
+		float* const depth_row = framebuffer.depth_row(yi - offset.y);
 		for (int xi = triangle.min_x; xi <= triangle.max_x; ++xi)
 		{
 			// we want centers of pixels to be used in computations. Todo: Do we?
 			const float x = static_cast<float>(xi) + 0.5f;
 			const float y = static_cast<float>(yi) + 0.5f;
 
-			// these will be used for barycentric weights computation
-			const double one_over_v0ToLine12 = 1.0 / implicit_line(triangle.v0.position[0], triangle.v0.position[1], triangle.v1.position, triangle.v2.position);
-			const double one_over_v1ToLine20 = 1.0 / implicit_line(triangle.v1.position[0], triangle.v1.position[1], triangle.v2.position, triangle.v0.position);
-			const double one_over_v2ToLine01 = 1.0 / implicit_line(triangle.v2.position[0], triangle.v2.position[1], triangle.v0.position, triangle.v1.position);
 			// affine barycentric weights
 			double alpha = implicit_line(x, y, triangle.v1.position, triangle.v2.position) * one_over_v0ToLine12;
 			double beta = implicit_line(x, y, triangle.v2.position, triangle.v0.position) * one_over_v1ToLine20;
@@ -493,10 +620,8 @@ inline void raster_triangle(TriangleToRasterize triangle, cv::Mat colourbuffer,
 			// if pixel (x, y) is inside the triangle or on one of its edges
 			if (alpha >= 0 && beta >= 0 && gamma >= 0)
 			{
-				const int pixel_index_row = yi;
-				const int pixel_index_col = xi;
-
 				const double z_affine = alpha*static_cast<double>(triangle.v0.position[2]) + beta*static_cast<double>(triangle.v1.position[2]) + gamma*static_cast<double>(triangle.v2.position[2]);
+				const float depth = static_cast<float>(z_affine); // the depth buffer is float, so compare with the value that we store
 				
 				bool draw = true;
 				if (enable_far_clipping)
@@ -508,7 +633,7 @@ inline void raster_triangle(TriangleToRasterize triangle, cv::Mat colourbuffer,
 				}
 				// The '<= 1.0' clips against the far-plane in NDC. We clip against the near-plane earlier.
 				//if (z_affine < depthbuffer.at<double>(pixelIndexRow, pixelIndexCol)/* && z_affine <= 1.0*/) // what to do in ortho case without n/f "squashing"? should we always squash? or a flag?
-				if (z_affine < depthbuffer.at<double>(pixel_index_row, pixel_index_col) && draw)
+				if (depth < depth_row[xi - offset.x] && draw)
 				{
 					// perspective-correct barycentric weights
 					double d = alpha*triangle.one_over_z0 + beta*triangle.one_over_z1 + gamma*triangle.one_over_z2;
@@ -518,56 +643,334 @@ inline void raster_triangle(TriangleToRasterize triangle, cv::Mat colourbuffer,
 					gamma *= d*triangle.one_over_z2;
 
 					// attributes interpolation
-					glm::tvec3<float> color_persp = static_cast<float>(alpha)*triangle.v0.color + static_cast<float>(beta)*triangle.v1.color + static_cast<float>(gamma)*triangle.v2.color; // Note: color might be empty if we use texturing and the shape-only model - but it works nonetheless? I think I set the vertex-colour to 127 in the shape-only model.
-					glm::tvec2<float> texcoords_persp = static_cast<float>(alpha)*triangle.v0.texcoords + static_cast<float>(beta)*triangle.v1.texcoords + static_cast<float>(gamma)*triangle.v2.texcoords;
-
 					glm::tvec3<float> pixel_color;
 					// Pixel Shader:
 					if (texture) { // We use texturing
-						// check if texture != NULL?
-						// partial derivatives (for mip-mapping)
-						const float u_over_z = -(triangle.alphaPlane.a*x + triangle.alphaPlane.b*y + triangle.alphaPlane.d) * triangle.one_over_alpha_c;
-						const float v_over_z = -(triangle.betaPlane.a*x + triangle.betaPlane.b*y + triangle.betaPlane.d) * triangle.one_over_beta_c;
-						const float one_over_z = -(triangle.gammaPlane.a*x + triangle.gammaPlane.b*y + triangle.gammaPlane.d) * triangle.one_over_gamma_c;
-						const float one_over_squared_one_over_z = 1.0f / std::pow(one_over_z, 2);
-
-						// partial derivatives of U/V coordinates with respect to X/Y pixel's screen coordinates
-						float dudx = one_over_squared_one_over_z * (triangle.alpha_ffx * one_over_z - u_over_z * triangle.gamma_ffx);
-						float dudy = one_over_squared_one_over_z * (triangle.beta_ffx * one_over_z - v_over_z * triangle.gamma_ffx);
-						float dvdx = one_over_squared_one_over_z * (triangle.alpha_ffy * one_over_z - u_over_z * triangle.gamma_ffy);
-						float dvdy = one_over_squared_one_over_z * (triangle.beta_ffy * one_over_z - v_over_z * triangle.gamma_ffy);
-
-						dudx *= texture.get().mipmaps[0].cols;
-						dudy *= texture.get().mipmaps[0].cols;
-						dvdx *= texture.get().mipmaps[0].rows;
-						dvdy *= texture.get().mipmaps[0].rows;
-
-						// The Texture is in BGR, thus tex2D returns BGR
-						glm::tvec3<float> texture_color = detail::tex2d(texcoords_persp, texture.get(), dudx, dudy, dvdx, dvdy); // uses the current texture
-						pixel_color = glm::tvec3<float>(texture_color[2], texture_color[1], texture_color[0]);
-						// other: color.mul(tex2D(texture, texCoord));
-						// Old note: for texturing, we load the texture as BGRA, so the colors get the wrong way in the next few lines...
+						const glm::tvec2<float> texcoords_persp = static_cast<float>(alpha)*triangle.v0.texcoords + static_cast<float>(beta)*triangle.v1.texcoords + static_cast<float>(gamma)*triangle.v2.texcoords;
+						pixel_color = shade_textured_fragment(triangle, x, y, texcoords_persp, texture.get());
 					}
 					else { // We use vertex-coloring
 						// color_persp is in RGB
-						pixel_color = color_persp;
+						// Note: color might be empty if we use texturing and the shape-only model - but it works nonetheless? I think I set the vertex-colour to 127 in the shape-only model.
+						pixel_color = static_cast<float>(alpha)*triangle.v0.color + static_cast<float>(beta)*triangle.v1.color + static_cast<float>(gamma)*triangle.v2.color;
 					}
 
-					// clamp bytes to 255
-					const unsigned char red = static_cast<unsigned char>(255.0f * std::min(pixel_color[0], 1.0f)); // Todo: Proper casting (rounding?)
-					const unsigned char green = static_cast<unsigned char>(255.0f * std::min(pixel_color[1], 1.0f));
-					const unsigned char blue = static_cast<unsigned char>(255.0f * std::min(pixel_color[2], 1.0f));
-
 					// update buffers
-					colourbuffer.at<cv::Vec4b>(pixel_index_row, pixel_index_col)[0] = blue;
-					colourbuffer.at<cv::Vec4b>(pixel_index_row, pixel_index_col)[1] = green;
-					colourbuffer.at<cv::Vec4b>(pixel_index_row, pixel_index_col)[2] = red;
-					colourbuffer.at<cv::Vec4b>(pixel_index_row, pixel_index_col)[3] = 255; // alpha channel
-					depthbuffer.at<double>(pixel_index_row, pixel_index_col) = z_affine;
+					write_fragment_colour(pixel_color, colour_row + 4 * (xi - offset.x));
+					depth_row[xi - offset.x] = depth;
+				}
+			}
+		}
+	}
+};
+
+/**
+ * Rasters a triangle into the given framebuffer, like raster_triangle(), but
+ * processes a block of 8 (AVX2) or 4 (SSE2, NEON) pixels of a row at a time.
+ *
+ * The barycentric weights are linear in the pixel position. They are set up once
+ * per triangle, evaluated at the start of each block, and stepped across the lanes of
+ * the block. Blocks that are completely outside of the triangle, or that fail the depth
+ * test, are rejected with one test. The depth, the perspective-correct weights and the
+ * vertex colours or texture coordinates are interpolated in float lanes. Only the
+ * texture lookups and the final writes are done per pixel.
+ *
+ * Since the weights are evaluated in float instead of double, pixels whose centre lies
+ * exactly on an edge of the triangle may be assigned to the neighbouring triangle, compared
+ * to raster_triangle(). Otherwise the result is the same.
+ *
+ * The instruction set is chosen at compile time, see simd.hpp. Without one, this
+ * calls raster_triangle().
+ *
+ * @param[in] triangle A triangle, with its bounding box clipped to the framebuffer.
+ * @param[in,out] framebuffer The framebuffer to draw into and use for the depth test.
+ * @param[in] texture An optional texture map. If not given, vertex-colouring is used.
+ * @param[in] enable_far_clipping Whether the pixels should be clipped against the far plane.
+ */
+inline void raster_triangle_simd(const TriangleToRasterize& triangle, Framebuffer& framebuffer, const boost::optional<Texture>& texture, bool enable_far_clipping)
+{
+#if defined(EOS_RENDER_SIMD)
+	using simd::Floats;
+	constexpr int width = simd::width;
+	const auto& p0 = triangle.v0.position;
+	const auto& p1 = triangle.v1.position;
+	const auto& p2 = triangle.v2.position;
+
+	// The coefficients of the weight w(x, y) = a * x + b * y + c that the edge function of the
+	// edge (v1, v2) divided by its value at the opposite vertex gives, see implicit_line():
+	const auto weight_equation = [](const glm::tvec4<float>& opposite, const glm::tvec4<float>& v1, const glm::tvec4<float>& v2) {
+		const double one_over_opposite_to_line = 1.0 / implicit_line(opposite[0], opposite[1], v1, v2);
+		return std::array<double, 3>{ ((double)v1[1] - (double)v2[1]) * one_over_opposite_to_line, ((double)v2[0] - (double)v1[0]) * one_over_opposite_to_line, ((double)v1[0] * (double)v2[1] - (double)v2[0] * (double)v1[1]) * one_over_opposite_to_line };
+	};
+	const std::array<std::array<double, 3>, 3> weights = { weight_equation(p0, p1, p2), weight_equation(p1, p2, p0), weight_equation(p2, p0, p1) };
+
+	const Floats lane_offsets = simd::lane_offsets();
+	const Floats zero = simd::set1(0.0f);
+	const Floats one = simd::set1(1.0f);
+	Floats weight_steps[3]; // the increment of each weight from one lane to the next
+	for (int k = 0; k < 3; ++k) {
+		weight_steps[k] = simd::mul(simd::set1(static_cast<float>(weights[k][0])), lane_offsets);
+	}
+	const Floats z[3] = { simd::set1(p0[2]), simd::set1(p1[2]), simd::set1(p2[2]) };
+	const Floats one_over_z[3] = { simd::set1(static_cast<float>(triangle.one_over_z0)), simd::set1(static_cast<float>(triangle.one_over_z1)), simd::set1(static_cast<float>(triangle.one_over_z2)) };
+	const Vertex<float>* const vertices[3] = { &triangle.v0, &triangle.v1, &triangle.v2 };
+
+	alignas(32) float block_depth[width];
+	alignas(32) float block_attributes[3][width]; // r, g, b or u, v
+	alignas(32) float padded_depth[width];
+
+	const cv::Point offset = framebuffer.get_region().tl(); // the buffers only cover this region of the viewport
+	for (int yi = triangle.min_y; yi <= triangle.max_y; ++yi)
+	{
+		std::uint8_t* const colour_row = framebuffer.colour_row(yi - offset.y);
+		float* const depth_row = framebuffer.depth_row(yi - offset.y);
+		const double y = static_cast<double>(yi) + 0.5;
+		for (int block_x = triangle.min_x; block_x <= triangle.max_x; block_x += width)
+		{
+			const double x = static_cast<double>(block_x) + 0.5;
+			// Affine barycentric weights of the pixels of the block:
+			Floats w[3];
+			for (int k = 0; k < 3; ++k) {
+				w[k] = simd::add(simd::set1(static_cast<float>(weights[k][0] * x + weights[k][1] * y + weights[k][2])), weight_steps[k]);
+			}
+			// If pixel (x, y) is inside the triangle or on one of its edges:
+			Floats mask = simd::bitwise_and(simd::bitwise_and(simd::greater_equal(w[0], zero), simd::greater_equal(w[1], zero)), simd::greater_equal(w[2], zero));
+			if (simd::movemask(mask) == 0) {
+				continue;
+			}
+
+			// The last block of a row may reach past the bounding box. Its depth is read from a copy
+			// instead, in which the lanes outside of the box fail the depth test:
+			const int num_valid_lanes = std::min(width, triangle.max_x - block_x + 1);
+			const float* depth_source = depth_row + (block_x - offset.x);
+			if (num_valid_lanes < width)
+			{
+				for (int i = 0; i < width; ++i) {
+					padded_depth[i] = i < num_valid_lanes ? depth_row[block_x - offset.x + i] : -std::numeric_limits<float>::max();
+				}
+				depth_source = padded_depth;
+			}
+			const Floats z_affine = simd::add(simd::add(simd::mul(w[0], z[0]), simd::mul(w[1], z[1])), simd::mul(w[2], z[2]));
+			mask = simd::bitwise_and(mask, simd::less(z_affine, simd::load(depth_source)));
+			if (enable_far_clipping) {
+				mask = simd::bitwise_and(mask, simd::less_equal(z_affine, one));
+			}
+			const int visible_lanes = simd::movemask(mask);
+			if (visible_lanes == 0) {
+				continue;
+			}
+
+			// Perspective-correct barycentric weights, and attribute interpolation:
+			const Floats d = simd::div(one, simd::add(simd::add(simd::mul(w[0], one_over_z[0]), simd::mul(w[1], one_over_z[1])), simd::mul(w[2], one_over_z[2])));
+			for (int k = 0; k < 3; ++k) {
+				w[k] = simd::mul(w[k], simd::mul(d, one_over_z[k]));
+			}
+			const int num_attributes = texture ? 2 : 3;
+			for (int c = 0; c < num_attributes; ++c)
+			{
+				Floats attribute = zero;
+				for (int k = 0; k < 3; ++k) {
+					attribute = simd::add(attribute, simd::mul(w[k], simd::set1(texture ? vertices[k]->texcoords[c] : vertices[k]->color[c])));
+				}
+				simd::store(block_attributes[c], attribute);
+			}
+			simd::store(block_depth, z_affine);
+
+			for (int i = 0; i < width; ++i)
+			{
+				if ((visible_lanes & (1 << i)) == 0) {
+					continue;
+				}
+				const int xi = block_x + i;
+				glm::tvec3<float> pixel_color;
+				if (texture) {
+					pixel_color = shade_textured_fragment(triangle, static_cast<float>(xi) + 0.5f, static_cast<float>(yi) + 0.5f, glm::tvec2<float>(block_attributes[0][i], block_attributes[1][i]), texture.get());
 				}
+				else {
+					pixel_color = glm::tvec3<float>(block_attributes[0][i], block_attributes[1][i], block_attributes[2][i]);
+				}
+				write_fragment_colour(pixel_color, colour_row + 4 * (xi - offset.x));
+				depth_row[xi - offset.x] = block_depth[i];
 			}
 		}
 	}
+#else
+	raster_triangle(triangle, framebuffer, texture, enable_far_clipping);
+#endif
+};
+
+/**
+ * Rasters only the depth of a triangle, and optionally its index and the barycentric
+ * coordinates of each pixel, without computing any colours or texture lookups.
+ *
+ * The depth of each pixel is computed exactly like in raster_triangle() and
+ * raster_triangle_affine(), so a depth buffer from this function can be used
+ * in their place, e.g. for is_triangle_visible().
+ *
+ * @param[in] triangle A triangle, with its bounding box clipped to the framebuffer.
+ * @param[in,out] framebuffer The framebuffer whose depth buffer to draw into. The colour buffer is not used.
+ * @param[in] enable_far_clipping Whether the pixels should be clipped against the far plane.
+ * @param[in] perspective_correct Whether to write perspective-correct barycentric coordinates. Requires triangle.one_over_z*, so use false for triangles of the affine renderer.
+ * @param[in] triangle_id The index to write into \p id_buffer.
+ * @param[in,out] id_buffer An optional buffer for the triangle index and barycentric coordinates of each pixel. It covers the same region as \p framebuffer.
+ */
+inline void raster_triangle_depth(const TriangleToRasterize& triangle, Framebuffer& framebuffer, bool enable_far_clipping, bool perspective_correct = true, int triangle_id = -1, TriangleIdBuffer* id_buffer = nullptr)
+{
+	const double one_over_v0ToLine12 = 1.0 / implicit_line(triangle.v0.position[0], triangle.v0.position[1], triangle.v1.position, triangle.v2.position);
+	const double one_over_v1ToLine20 = 1.0 / implicit_line(triangle.v1.position[0], triangle.v1.position[1], triangle.v2.position, triangle.v0.position);
+	const double one_over_v2ToLine01 = 1.0 / implicit_line(triangle.v2.position[0], triangle.v2.position[1], triangle.v0.position, triangle.v1.position);
+
+	const cv::Point offset = framebuffer.get_region().tl(); // the buffers only cover this region of the viewport
+	for (int yi = triangle.min_y; yi <= triangle.max_y; ++yi)
+	{
+		float* const depth_row = framebuffer.depth_row(yi - offset.y);
+		std::int32_t* const id_row = id_buffer ? id_buffer->triangle_id_row(yi - offset.y) : nullptr;
+		float* const barycentric_row = id_buffer ? id_buffer->barycentric_row(yi - offset.y) : nullptr;
+		for (int xi = triangle.min_x; xi <= triangle.max_x; ++xi)
+		{
+			const float x = static_cast<float>(xi) + 0.5f;
+			const float y = static_cast<float>(yi) + 0.5f;
+
+			double alpha = implicit_line(x, y, triangle.v1.position, triangle.v2.position) * one_over_v0ToLine12;
+			double beta = implicit_line(x, y, triangle.v2.position, triangle.v0.position) * one_over_v1ToLine20;
+			double gamma = implicit_line(x, y, triangle.v0.position, triangle.v1.position) * one_over_v2ToLine01;
+			if (alpha < 0 || beta < 0 || gamma < 0) {
+				continue;
+			}
+			const double z_affine = alpha*static_cast<double>(triangle.v0.position[2]) + beta*static_cast<double>(triangle.v1.position[2]) + gamma*static_cast<double>(triangle.v2.position[2]);
+			const float depth = static_cast<float>(z_affine);
+			const int local_x = xi - offset.x;
+			if ((enable_far_clipping && z_affine > 1.0) || !(depth < depth_row[local_x])) {
+				continue;
+			}
+			depth_row[local_x] = depth;
+			if (id_buffer)
+			{
+				if (perspective_correct)
+				{
+					const double d = 1.0 / (alpha*triangle.one_over_z0 + beta*triangle.one_over_z1 + gamma*triangle.one_over_z2);
+					alpha *= d*triangle.one_over_z0;
+					beta *= d*triangle.one_over_z1;
+					gamma *= d*triangle.one_over_z2;
+				}
+				id_row[local_x] = triangle_id;
+				barycentric_row[3 * local_x] = static_cast<float>(alpha);
+				barycentric_row[3 * local_x + 1] = static_cast<float>(beta);
+				barycentric_row[3 * local_x + 2] = static_cast<float>(gamma);
+			}
+		}
+	}
+};
+
+/**
+ * Calls raster_tile(triangle_index, tile) for every triangle and every screen tile
+ * that its bounding box overlaps, in parallel over the tiles.
+ *
+ * The viewport is divided into square tiles of \p tile_size pixels. Each tile is
+ * rasterised by one thread only, and within a tile, the triangles are processed in
+ * their original order. So as long as raster_tile only draws the pixels inside the
+ * given tile, no locking is needed, and the result is the same as when rasterising
+ * all triangles serially.
+ *
+ * @param[in] bounding_boxes The bounding box of each triangle, in pixels. x + width and y + height are inclusive.
+ * @param[in] viewport_width Screen width.
+ * @param[in] viewport_height Screen height.
+ * @param[in] tile_size The width and height of the tiles.
+ * @param[in] thread_pool The threads to rasterise the tiles on.
+ * @param[in] raster_tile A function void(int triangle_index, const cv::Rect& tile), where the tile's x + width and y + height are exclusive.
+ * @param[in] bins Storage for the triangle indices of each tile, which can be reused for the next call.
+ */
+template <typename RasterTileFunction>
+void raster_tiled(const std::vector<cv::Rect>& bounding_boxes, int viewport_width, int viewport_height, int tile_size, core::ThreadPool& thread_pool, RasterTileFunction raster_tile, std::vector<std::vector<int>>& bins)
+{
+	const int num_tiles_x = (viewport_width + tile_size - 1) / tile_size;
+	const int num_tiles_y = (viewport_height + tile_size - 1) / tile_size;
+	if (num_tiles_x <= 0 || num_tiles_y <= 0) {
+		return;
+	}
+	// Sort the triangles into the tiles that they overlap:
+	bins.resize(num_tiles_x * num_tiles_y);
+	for (auto& bin : bins) {
+		bin.clear(); // keeps the memory
+	}
+	for (std::size_t i = 0; i < bounding_boxes.size(); ++i)
+	{
+		const auto& box = bounding_boxes[i];
+		const int first_tile_x = std::max(box.x / tile_size, 0);
+		const int last_tile_x = std::min((box.x + box.width) / tile_size, num_tiles_x - 1);
+		const int first_tile_y = std::max(box.y / tile_size, 0);
+		const int last_tile_y = std::min((box.y + box.height) / tile_size, num_tiles_y - 1);
+		for (int ty = first_tile_y; ty <= last_tile_y; ++ty) {
+			for (int tx = first_tile_x; tx <= last_tile_x; ++tx) {
+				bins[ty * num_tiles_x + tx].push_back(static_cast<int>(i));
+			}
+		}
+	}
+
+	const auto raster_bin = [&](int tile_index) {
+		const int tile_x = (tile_index % num_tiles_x) * tile_size;
+		const int tile_y = (tile_index / num_tiles_x) * tile_size;
+		const cv::Rect tile(tile_x, tile_y, std::min(tile_size, viewport_width - tile_x), std::min(tile_size, viewport_height - tile_y));
+		for (const int triangle_index : bins[tile_index]) {
+			raster_tile(triangle_index, tile);
+		}
+	};
+	// Captures a single reference, so that the std::function of parallel_for() doesn't allocate:
+	thread_pool.parallel_for(0, static_cast<int>(bins.size()), [&raster_bin](int tile_index, int /* thread_index */) { raster_bin(tile_index); });
+};
+
+template <typename RasterTileFunction>
+void raster_tiled(const std::vector<cv::Rect>& bounding_boxes, int viewport_width, int viewport_height, int tile_size, core::ThreadPool& thread_pool, RasterTileFunction raster_tile)
+{
+	std::vector<std::vector<int>> bins;
+	raster_tiled(bounding_boxes, viewport_width, viewport_height, tile_size, thread_pool, raster_tile, bins);
+};
+
+/**
+ * Memory for raster_triangles_tiled() that can be reused from one call to the next.
+ */
+struct TiledRasterScratch
+{
+	std::vector<cv::Rect> bounding_boxes;
+	std::vector<std::vector<int>> bins;
+};
+
+/**
+ * Rasterises the given triangles with raster_triangle_simd(), with the screen divided
+ * into tiles that are rasterised in parallel. The result is exactly the same
+ * as when calling raster_triangle_simd() for every triangle. See raster_tiled().
+ *
+ * @param[in] triangles The triangles to rasterise.
+ * @param[in,out] framebuffer The framebuffer to draw into.
+ * @param[in] texture An optional texture map.
+ * @param[in] enable_far_clipping Whether the pixels should be clipped against the far plane.
+ * @param[in] thread_pool The threads to rasterise the tiles on.
+ * @param[in] tile_size The width and height of the tiles.
+ * @param[in] scratch Memory to reuse for the bounding boxes and tiles.
+ */
+inline void raster_triangles_tiled(const std::vector<TriangleToRasterize>& triangles, Framebuffer& framebuffer, const boost::optional<Texture>& texture, bool enable_far_clipping, core::ThreadPool& thread_pool, int tile_size, TiledRasterScratch& scratch)
+{
+	// The tiles cover the region of the framebuffer, so they are relative to its offset:
+	const cv::Point offset = framebuffer.get_region().tl();
+	auto& bounding_boxes = scratch.bounding_boxes;
+	bounding_boxes.clear();
+	for (const auto& triangle : triangles) {
+		bounding_boxes.emplace_back(triangle.min_x - offset.x, triangle.min_y - offset.y, triangle.max_x - triangle.min_x, triangle.max_y - triangle.min_y);
+	}
+	raster_tiled(bounding_boxes, framebuffer.width(), framebuffer.height(), tile_size, thread_pool, [&](int triangle_index, const cv::Rect& tile) {
+		TriangleToRasterize triangle = triangles[triangle_index];
+		triangle.min_x = std::max(triangle.min_x, tile.x + offset.x);
+		triangle.max_x = std::min(triangle.max_x, tile.x + offset.x + tile.width - 1);
+		triangle.min_y = std::max(triangle.min_y, tile.y + offset.y);
+		triangle.max_y = std::min(triangle.max_y, tile.y + offset.y + tile.height - 1);
+		raster_triangle_simd(triangle, framebuffer, texture, enable_far_clipping);
+	}, scratch.bins);
+};
+
+inline void raster_triangles_tiled(const std::vector<TriangleToRasterize>& triangles, Framebuffer& framebuffer, const boost::optional<Texture>& texture, bool enable_far_clipping, core::ThreadPool& thread_pool, int tile_size = 64)
+{
+	TiledRasterScratch scratch;
+	raster_triangles_tiled(triangles, framebuffer, texture, enable_far_clipping, thread_pool, tile_size, scratch);
 };
 
 		} /* namespace detail */
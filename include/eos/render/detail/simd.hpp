@@ -0,0 +1,123 @@
+/*
+ * eos - A 3D Morphable Model fitting library written in modern C++11/14.
+ *
+ * File: include/eos/render/detail/simd.hpp
+ *
+ * Copyright 2017 Patrik Huber
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#ifndef RENDER_DETAIL_SIMD_HPP_
+#define RENDER_DETAIL_SIMD_HPP_
+
+/**
+ * A minimal wrapper around the float SIMD instructions that the rasteriser needs,
+ * so that it can be written once for AVX2 (8 lanes), SSE2 and NEON (4 lanes).
+ *
+ * The instruction set is chosen at compile time, from the flags the compiler was
+ * called with (e.g. -mavx2). If one is available, EOS_RENDER_SIMD is defined. Define
+ * EOS_RENDER_NO_SIMD to always use the scalar code.
+ */
+#if !defined(EOS_RENDER_NO_SIMD)
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define EOS_RENDER_SIMD
+#define EOS_RENDER_SIMD_AVX2
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define EOS_RENDER_SIMD
+#define EOS_RENDER_SIMD_SSE2
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define EOS_RENDER_SIMD
+#define EOS_RENDER_SIMD_NEON
+#endif
+#endif
+
+#if defined(EOS_RENDER_SIMD)
+
+namespace eos {
+	namespace render {
+		namespace detail {
+			namespace simd {
+
+#if defined(EOS_RENDER_SIMD_AVX2)
+
+constexpr int width = 8;
+using Floats = __m256;
+
+inline Floats set1(float a) { return _mm256_set1_ps(a); };
+inline Floats lane_offsets() { return _mm256_setr_ps(0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f); };
+inline Floats load(const float* p) { return _mm256_loadu_ps(p); };
+inline void store(float* p, Floats a) { _mm256_storeu_ps(p, a); };
+inline Floats add(Floats a, Floats b) { return _mm256_add_ps(a, b); };
+inline Floats mul(Floats a, Floats b) { return _mm256_mul_ps(a, b); };
+inline Floats div(Floats a, Floats b) { return _mm256_div_ps(a, b); };
+inline Floats less(Floats a, Floats b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); };
+inline Floats less_equal(Floats a, Floats b) { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); };
+inline Floats greater_equal(Floats a, Floats b) { return _mm256_cmp_ps(a, b, _CMP_GE_OQ); };
+inline Floats bitwise_and(Floats a, Floats b) { return _mm256_and_ps(a, b); };
+inline int movemask(Floats a) { return _mm256_movemask_ps(a); }; // bit i is set if lane i is true
+
+#elif defined(EOS_RENDER_SIMD_SSE2)
+
+constexpr int width = 4;
+using Floats = __m128;
+
+inline Floats set1(float a) { return _mm_set1_ps(a); };
+inline Floats lane_offsets() { return _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f); };
+inline Floats load(const float* p) { return _mm_loadu_ps(p); };
+inline void store(float* p, Floats a) { _mm_storeu_ps(p, a); };
+inline Floats add(Floats a, Floats b) { return _mm_add_ps(a, b); };
+inline Floats mul(Floats a, Floats b) { return _mm_mul_ps(a, b); };
+inline Floats div(Floats a, Floats b) { return _mm_div_ps(a, b); };
+inline Floats less(Floats a, Floats b) { return _mm_cmplt_ps(a, b); };
+inline Floats less_equal(Floats a, Floats b) { return _mm_cmple_ps(a, b); };
+inline Floats greater_equal(Floats a, Floats b) { return _mm_cmpge_ps(a, b); };
+inline Floats bitwise_and(Floats a, Floats b) { return _mm_and_ps(a, b); };
+inline int movemask(Floats a) { return _mm_movemask_ps(a); };
+
+#elif defined(EOS_RENDER_SIMD_NEON)
+
+constexpr int width = 4;
+using Floats = float32x4_t;
+
+inline Floats set1(float a) { return vdupq_n_f32(a); };
+inline Floats lane_offsets() { const float offsets[4] = { 0.0f, 1.0f, 2.0f, 3.0f }; return vld1q_f32(offsets); };
+inline Floats load(const float* p) { return vld1q_f32(p); };
+inline void store(float* p, Floats a) { vst1q_f32(p, a); };
+inline Floats add(Floats a, Floats b) { return vaddq_f32(a, b); };
+inline Floats mul(Floats a, Floats b) { return vmulq_f32(a, b); };
+inline Floats div(Floats a, Floats b) { return vdivq_f32(a, b); };
+inline Floats less(Floats a, Floats b) { return vreinterpretq_f32_u32(vcltq_f32(a, b)); };
+inline Floats less_equal(Floats a, Floats b) { return vreinterpretq_f32_u32(vcleq_f32(a, b)); };
+inline Floats greater_equal(Floats a, Floats b) { return vreinterpretq_f32_u32(vcgeq_f32(a, b)); };
+inline Floats bitwise_and(Floats a, Floats b) { return vreinterpretq_f32_u32(vandq_u32(vreinterpretq_u32_f32(a), vreinterpretq_u32_f32(b))); };
+inline int movemask(Floats a)
+{
+	const uint32x4_t sign_bits = vshrq_n_u32(vreinterpretq_u32_f32(a), 31);
+	return static_cast<int>(vgetq_lane_u32(sign_bits, 0) | (vgetq_lane_u32(sign_bits, 1) << 1) | (vgetq_lane_u32(sign_bits, 2) << 2) | (vgetq_lane_u32(sign_bits, 3) << 3));
+};
+
+#endif
+
+			} /* namespace simd */
+		} /* namespace detail */
+	} /* namespace render */
+} /* namespace eos */
+
+#endif /* EOS_RENDER_SIMD */
+
+#endif /* RENDER_DETAIL_SIMD_HPP_ */
@@ -29,6 +29,9 @@
 
 #include "opencv2/core/core.hpp"
 
+#include <algorithm>
+#include <cassert>
+
 /**
  * Implementations of internal functions, not part of the
  * API we expose and not meant to be used by a user.
@@ -39,15 +42,17 @@ namespace eos {
 
 /**
  * Computes whether the given point is inside (or on the border of) the triangle
- * formed out of the given three vertices.
+ * formed out of the given three vertices, and its barycentric coordinates.
  *
  * @param[in] point The point to check.
  * @param[in] triV0 First vertex.
  * @param[in] triV1 Second vertex.
  * @param[in] triV2 Third vertex.
+ * @param[out] u The barycentric coordinate of the point w.r.t. triV2. The one of triV0 is 1 - u - v.
+ * @param[out] v The barycentric coordinate of the point w.r.t. triV1.
  * @return Whether the point is inside the triangle.
  */
-inline bool is_point_in_triangle(cv::Point2f point, cv::Point2f triV0, cv::Point2f triV1, cv::Point2f triV2) {
+inline bool is_point_in_triangle(cv::Point2f point, cv::Point2f triV0, cv::Point2f triV1, cv::Point2f triV2, float& u, float& v) {
 	// See http://www.blackpawn.com/texts/pointinpoly/
 	// Compute vectors
 	cv::Point2f v0 = triV2 - triV0;
@@ -63,13 +68,28 @@ inline bool is_point_in_triangle(cv::Point2f point, cv::Point2f triV0, cv::Point
 
 	// Compute barycentric coordinates
 	float invDenom = 1 / (dot00 * dot11 - dot01 * dot01);
-	float u = (dot11 * dot02 - dot01 * dot12) * invDenom;
-	float v = (dot00 * dot12 - dot01 * dot02) * invDenom;
+	u = (dot11 * dot02 - dot01 * dot12) * invDenom;
+	v = (dot00 * dot12 - dot01 * dot02) * invDenom;
 
 	// Check if point is in triangle
 	return (u >= 0) && (v >= 0) && (u + v < 1);
 };
 
+/**
+ * Computes whether the given point is inside (or on the border of) the triangle
+ * formed out of the given three vertices.
+ *
+ * @param[in] point The point to check.
+ * @param[in] triV0 First vertex.
+ * @param[in] triV1 Second vertex.
+ * @param[in] triV2 Third vertex.
+ * @return Whether the point is inside the triangle.
+ */
+inline bool is_point_in_triangle(cv::Point2f point, cv::Point2f triV0, cv::Point2f triV1, cv::Point2f triV2) {
+	float u, v;
+	return is_point_in_triangle(point, triV0, triV1, triV2, u, v);
+};
+
 /**
  * Checks whether all pixels in the given triangle are visible and
  * returns true if and only if the whole triangle is visible.
@@ -85,15 +105,18 @@ inline bool is_point_in_triangle(cv::Point2f point, cv::Point2f triV0, cv::Point
  * @param[in] v0 First vertex, in screen coordinates (but still with their z-value).
  * @param[in] v1 Second vertex.
  * @param[in] v2 Third vertex.
- * @param[in] depthbuffer Pre-calculated depthbuffer.
+ * @param[in] depthbuffer Pre-calculated depthbuffer, CV_32FC1 as returned by render_affine(), or CV_64FC1.
+ * @param[in] depthbuffer_region The region of the viewport that the depthbuffer covers, e.g. the one given to render_affine_depth(). Its size is the size of the depthbuffer.
  * @return True if the whole triangle is visible in the image.
  */
-inline bool is_triangle_visible(const glm::tvec4<float>& v0, const glm::tvec4<float>& v1, const glm::tvec4<float>& v2, cv::Mat depthbuffer)
+inline bool is_triangle_visible(const glm::tvec4<float>& v0, const glm::tvec4<float>& v1, const glm::tvec4<float>& v2, const cv::Mat& depthbuffer, const cv::Rect& depthbuffer_region)
 {
 	// #Todo: Actually, only check the 3 vertex points, don't loop over the pixels - this should be enough.
+	assert(depthbuffer.cols == depthbuffer_region.width && depthbuffer.rows == depthbuffer_region.height);
 
-	auto viewport_width = depthbuffer.cols;
-	auto viewport_height = depthbuffer.rows;
+	// Pixels right of and below the region are clipped like the ones outside of the viewport:
+	auto viewport_width = depthbuffer_region.x + depthbuffer_region.width;
+	auto viewport_height = depthbuffer_region.y + depthbuffer_region.height;
 
 	// Well, in in principle, we'd have to do the whole stuff as in render(), like
 	// clipping against the frustums etc.
@@ -103,14 +126,17 @@ inline bool is_triangle_visible(const glm::tvec4<float>& v0, const glm::tvec4<fl
 		return false;
 
 	cv::Rect bbox = detail::calculate_clipped_bounding_box(glm::tvec2<float>(v0), glm::tvec2<float>(v1), glm::tvec2<float>(v2), viewport_width, viewport_height);
-	int minX = bbox.x;
+	int minX = std::max(bbox.x, depthbuffer_region.x);
 	int maxX = bbox.x + bbox.width;
-	int minY = bbox.y;
+	int minY = std::max(bbox.y, depthbuffer_region.y);
 	int maxY = bbox.y + bbox.height;
 
 	//if (t.maxX <= t.minX || t.maxY <= t.minY) 	// Note: Can the width/height of the bbox be negative? Maybe we only need to check for equality here?
 	//	continue;									// Also, I'm not entirely sure why I commented this out
 
+	// The renderers store float depth values. Compare in float then, so that the pixels of the triangle
+	// itself, which have exactly the same depth, compare equal:
+	const bool is_float_depth = depthbuffer.depth() == CV_32F;
 	bool whole_triangle_is_visible = true;
 	for (int yi = minY; yi <= maxY; yi++)
 	{
@@ -132,7 +158,10 @@ inline bool is_triangle_visible(const glm::tvec4<float>& v0, const glm::tvec4<fl
 			if (alpha >= 0 && beta >= 0 && gamma >= 0)
 			{
 				const double z_affine = alpha*static_cast<double>(v0[2]) + beta*static_cast<double>(v1[2]) + gamma*static_cast<double>(v2[2]);
-				if (z_affine < depthbuffer.at<double>(yi, xi)) {
+				const int row = yi - depthbuffer_region.y;
+				const int col = xi - depthbuffer_region.x;
+				const bool is_in_front = is_float_depth ? static_cast<float>(z_affine) < depthbuffer.ptr<float>(row)[col] : z_affine < depthbuffer.ptr<double>(row)[col];
+				if (is_in_front) {
 					whole_triangle_is_visible = false;
 					break;
 				}
@@ -149,6 +178,21 @@ inline bool is_triangle_visible(const glm::tvec4<float>& v0, const glm::tvec4<fl
 	return true;
 };
 
+/**
+ * Checks whether all pixels in the given triangle are visible, with a depthbuffer
+ * that covers the whole viewport. See the overload above.
+ *
+ * @param[in] v0 First vertex, in screen coordinates (but still with their z-value).
+ * @param[in] v1 Second vertex.
+ * @param[in] v2 Third vertex.
+ * @param[in] depthbuffer Pre-calculated depthbuffer, CV_32FC1 as returned by render_affine(), or CV_64FC1.
+ * @return True if the whole triangle is visible in the image.
+ */
+inline bool is_triangle_visible(const glm::tvec4<float>& v0, const glm::tvec4<float>& v1, const glm::tvec4<float>& v2, cv::Mat depthbuffer)
+{
+	return is_triangle_visible(v0, v1, v2, depthbuffer, cv::Rect(0, 0, depthbuffer.cols, depthbuffer.rows));
+};
+
 		} /* namespace detail */
 	} /* namespace render */
 } /* namespace eos */
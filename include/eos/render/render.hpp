@@ -23,7 +23,11 @@
 #define RENDER_HPP_
 
 #include "eos/core/Mesh.hpp"
+#include "eos/core/ThreadPool.hpp"
+#include "eos/core/Trace.hpp"
 
+#include "eos/render/Framebuffer.hpp"
+#include "eos/render/RenderContext.hpp"
 #include "eos/render/detail/render_detail.hpp"
 #include "eos/render/utils.hpp"
 
@@ -34,6 +38,9 @@
 #include <array>
 #include <vector>
 #include <memory>
+#include <utility>
+#include <limits>
+#include <algorithm>
 
 namespace eos {
 	namespace render {
@@ -109,10 +116,40 @@ namespace eos {
  * Note: In both the ortho and persp case, points at z=-n end up at -1, z=-f at +1. In case of persp proj., this happens only after the divide by w.
  */
 
+/**
+ * Renders the given mesh into the given framebuffer using 4x4 model-view and
+ * projection matrices. Conforms to OpenGL conventions.
+ *
+ * The framebuffer is cleared first, and its viewport size is the size of the viewport.
+ * It can be reused for many calls, e.g. one per frame of a video, to avoid allocating
+ * new buffers each time. To also reuse the memory for the vertices and triangles,
+ * use a RenderContext. If the framebuffer only covers a region of the viewport,
+ * e.g. the one from get_screen_bounding_box(), only that region is rendered.
+ *
+ * @param[in] mesh A 3D mesh.
+ * @param[in] model_view_matrix A 4x4 OpenGL model-view matrix.
+ * @param[in] projection_matrix A 4x4 orthographic or perspective OpenGL projection matrix.
+ * @param[in,out] framebuffer The framebuffer to render into.
+ * @param[in] texture An optional texture map. If not given, vertex-colouring is used.
+ * @param[in] enable_backface_culling Whether the renderer should perform backface culling. If true, only draw triangles with vertices ordered CCW in screen-space.
+ * @param[in] enable_near_clipping Whether vertices should be clipped against the near plane.
+ * @param[in] enable_far_clipping Whether vertices should be clipped against the far plane.
+ * @param[in] thread_pool If given, the screen is divided into tiles that are rasterised in parallel on this pool. The result is the same.
+ * @param[in] trace_sink If given, receives the time of the triangle setup and the rasterisation, and the number of triangles rasterised.
+ */
+inline void render(const core::Mesh& mesh, glm::tmat4x4<float> model_view_matrix, glm::tmat4x4<float> projection_matrix, Framebuffer& framebuffer, const boost::optional<Texture>& texture = boost::none, bool enable_backface_culling = false, bool enable_near_clipping = true, bool enable_far_clipping = true, core::ThreadPool* thread_pool = nullptr, core::TraceSink* trace_sink = nullptr)
+{
+	RenderContext context;
+	context.render(mesh, model_view_matrix, projection_matrix, framebuffer, texture, enable_backface_culling, enable_near_clipping, enable_far_clipping, thread_pool, trace_sink);
+};
+
 /**
  * Renders the given mesh onto a 2D image using 4x4 model-view and
  * projection matrices. Conforms to OpenGL conventions.
  *
+ * Allocates a new framebuffer on each call. To render many images of the same
+ * size, use a RenderContext, or the overload that takes a Framebuffer.
+ *
  * @param[in] mesh A 3D mesh.
  * @param[in] model_view_matrix A 4x4 OpenGL model-view matrix.
  * @param[in] projection_matrix A 4x4 orthographic or perspective OpenGL projection matrix.
@@ -122,119 +159,81 @@ namespace eos {
  * @param[in] enable_backface_culling Whether the renderer should perform backface culling. If true, only draw triangles with vertices ordered CCW in screen-space.
  * @param[in] enable_near_clipping Whether vertices should be clipped against the near plane.
  * @param[in] enable_far_clipping Whether vertices should be clipped against the far plane.
- * @return A pair with the colourbuffer as its first element and the depthbuffer as the second element.
+ * @param[in] thread_pool If given, the screen is divided into tiles that are rasterised in parallel on this pool. The result is the same.
+ * @param[in] trace_sink If given, receives the time of the triangle setup and the rasterisation, and the number of triangles rasterised.
+ * @return A pair with the colourbuffer (CV_8UC4) as its first element and the depthbuffer (CV_32FC1) as the second element.
  */
-inline std::pair<cv::Mat, cv::Mat> render(core::Mesh mesh, glm::tmat4x4<float> model_view_matrix, glm::tmat4x4<float> projection_matrix, int viewport_width, int viewport_height, const boost::optional<Texture>& texture = boost::none, bool enable_backface_culling = false, bool enable_near_clipping = true, bool enable_far_clipping = true)
+inline std::pair<cv::Mat, cv::Mat> render(const core::Mesh& mesh, glm::tmat4x4<float> model_view_matrix, glm::tmat4x4<float> projection_matrix, int viewport_width, int viewport_height, const boost::optional<Texture>& texture = boost::none, bool enable_backface_culling = false, bool enable_near_clipping = true, bool enable_far_clipping = true, core::ThreadPool* thread_pool = nullptr, core::TraceSink* trace_sink = nullptr)
 {
-	// Some internal documentation / old todos or notes:
-	// maybe change and pass depthBuffer as an optional arg (&?), because usually we never need it outside the renderer. Or maybe even a getDepthBuffer().
-	// modelViewMatrix goes to eye-space (camera space), projection does ortho or perspective proj.
-	// bool enable_texturing = false; Maybe re-add later, not sure
-	// take a cv::Mat texture instead and convert to Texture internally? no, we don't want to recreate mipmap levels on each render() call.
-
-	assert(mesh.vertices.size() == mesh.colors.size() || mesh.colors.empty()); // The number of vertices has to be equal for both shape and colour, or, alternatively, it has to be a shape-only model.
-	assert(mesh.vertices.size() == mesh.texcoords.size() || mesh.texcoords.empty()); // same for the texcoords
-	// another assert: If cv::Mat texture != empty, then we need texcoords?
-
-	using cv::Mat;
-	using std::vector;
-
-	Mat colourbuffer = Mat::zeros(viewport_height, viewport_width, CV_8UC4); // make sure it's CV_8UC4?
-	Mat depthbuffer = std::numeric_limits<float>::max() * Mat::ones(viewport_height, viewport_width, CV_64FC1);
-
-	// Vertex shader:
-	//processedVertex = shade(Vertex); // processedVertex : pos, col, tex, texweight
-	// Assemble the vertices, project to clip space, and store as detail::Vertex (the internal representation):
-	vector<detail::Vertex<float>> clipspace_vertices;
-	clipspace_vertices.reserve(mesh.vertices.size());
-	for (int i = 0; i < mesh.vertices.size(); ++i) { // "previously": mesh.vertex
-		glm::tvec4<float> clipspace_coords = projection_matrix * model_view_matrix * mesh.vertices[i];
-		glm::tvec3<float> vertex_colour;
-		if (mesh.colors.empty()) {
-			vertex_colour = glm::tvec3<float>(0.5f, 0.5f, 0.5f);
-		}
-		else {
-			vertex_colour = mesh.colors[i];
-		}
-		clipspace_vertices.push_back(detail::Vertex<float>{clipspace_coords, vertex_colour, mesh.texcoords[i]});
-	}
-
-	// All vertices are in clip-space now.
-	// Prepare the rasterisation stage.
-	// For every vertex/tri:
-	vector<detail::TriangleToRasterize> triangles_to_raster;
-	for (const auto& tri_indices : mesh.tvi) {
-		// Todo: Split this whole stuff up. Make a "clip" function, ... rename "processProspective..".. what is "process"... get rid of "continue;"-stuff by moving stuff inside process...
-		// classify vertices visibility with respect to the planes of the view frustum
-		// we're in clip-coords (NDC), so just check if outside [-1, 1] x ...
-		// Actually we're in clip-coords and it's not the same as NDC. We're only in NDC after the division by w.
-		// We should do the clipping in clip-coords though. See http://www.songho.ca/opengl/gl_projectionmatrix.html for more details.
-		// However, when comparing against w_c below, we might run into the trouble of the sign again in the affine case.
-		// 'w' is always positive, as it is -z_camspace, and all z_camspace are negative.
-		unsigned char visibility_bits[3];
-		for (unsigned char k = 0; k < 3; k++)
-		{
-			visibility_bits[k] = 0;
-			float x_cc = clipspace_vertices[tri_indices[k]].position[0];
-			float y_cc = clipspace_vertices[tri_indices[k]].position[1];
-			float z_cc = clipspace_vertices[tri_indices[k]].position[2];
-			float w_cc = clipspace_vertices[tri_indices[k]].position[3];
-			if (x_cc < -w_cc)			// true if outside of view frustum. False if on or inside the plane.
-				visibility_bits[k] |= 1;	// set bit if outside of frustum
-			if (x_cc > w_cc)
-				visibility_bits[k] |= 2;
-			if (y_cc < -w_cc)
-				visibility_bits[k] |= 4;
-			if (y_cc > w_cc)
-				visibility_bits[k] |= 8;
-			if (enable_near_clipping && z_cc < -w_cc) // near plane frustum clipping
-				visibility_bits[k] |= 16;
-			if (enable_far_clipping && z_cc > w_cc) // far plane frustum clipping
-				visibility_bits[k] |= 32;
-		} // if all bits are 0, then it's inside the frustum
-		// all vertices are not visible - reject the triangle.
-		if ((visibility_bits[0] & visibility_bits[1] & visibility_bits[2]) > 0)
-		{
-			continue;
-		}
-		// all vertices are visible - pass the whole triangle to the rasterizer. = All bits of all 3 triangles are 0.
-		if ((visibility_bits[0] | visibility_bits[1] | visibility_bits[2]) == 0)
-		{
-			boost::optional<detail::TriangleToRasterize> t = detail::process_prospective_tri(clipspace_vertices[tri_indices[0]], clipspace_vertices[tri_indices[1]], clipspace_vertices[tri_indices[2]], viewport_width, viewport_height, enable_backface_culling);
-			if (t) {
-				triangles_to_raster.push_back(*t);
-			}
-			continue;
-		}
-		// at this moment the triangle is known to be intersecting one of the view frustum's planes
-		std::vector<detail::Vertex<float>> vertices;
-		vertices.push_back(clipspace_vertices[tri_indices[0]]);
-		vertices.push_back(clipspace_vertices[tri_indices[1]]);
-		vertices.push_back(clipspace_vertices[tri_indices[2]]);
-		// split the triangle if it intersects the near plane:
-		if (enable_near_clipping)
-		{
-			vertices = detail::clip_polygon_to_plane_in_4d(vertices, glm::tvec4<float>(0.0f, 0.0f, -1.0f, -1.0f)); // "Normal" (or "4D hyperplane") of the near-plane. I tested it and it works like this but I'm a little bit unsure because Songho says the normal of the near-plane is (0,0,-1,1) (maybe I have to switch around the < 0 checks in the function?)
-		}
+	RenderContext context(viewport_width, viewport_height);
+	context.render(mesh, model_view_matrix, projection_matrix, texture, enable_backface_culling, enable_near_clipping, enable_far_clipping, thread_pool, trace_sink);
+	return std::make_pair(context.get_framebuffer().get_colourbuffer(), context.get_framebuffer().get_depthbuffer());
+};
 
-		// triangulation of the polygon formed of vertices array
-		if (vertices.size() >= 3)
-		{
-			for (unsigned char k = 0; k < vertices.size() - 2; k++)
-			{
-				boost::optional<detail::TriangleToRasterize> t = detail::process_prospective_tri(vertices[0], vertices[1 + k], vertices[2 + k], viewport_width, viewport_height, enable_backface_culling);
-				if (t) {
-					triangles_to_raster.push_back(*t);
-				}
-			}
+/**
+ * Returns the region of the viewport that render() draws the given mesh into, grown
+ * by \p margin pixels. A Framebuffer that only covers this region gives the same
+ * rendering as one of the full viewport, at a fraction of the memory and clearing
+ * cost when the mesh covers a small part of a large image.
+ *
+ * If a vertex lies behind the camera, the clipped triangles can reach anywhere, and
+ * the whole viewport is returned.
+ *
+ * @param[in] mesh A 3D mesh.
+ * @param[in] model_view_matrix A 4x4 OpenGL model-view matrix.
+ * @param[in] projection_matrix A 4x4 orthographic or perspective OpenGL projection matrix.
+ * @param[in] viewport_width Screen width.
+ * @param[in] viewport_height Screen height.
+ * @param[in] margin The number of pixels to add on each side, e.g. to reuse the region for a few frames.
+ * @return The region in pixels, clipped to the viewport. Empty if the mesh is outside of the viewport.
+ */
+inline cv::Rect get_screen_bounding_box(const core::Mesh& mesh, const glm::tmat4x4<float>& model_view_matrix, const glm::tmat4x4<float>& projection_matrix, int viewport_width, int viewport_height, int margin = 0)
+{
+	const glm::tmat4x4<float> mvp_matrix = projection_matrix * model_view_matrix;
+	float min_x = std::numeric_limits<float>::max();
+	float min_y = std::numeric_limits<float>::max();
+	float max_x = std::numeric_limits<float>::lowest();
+	float max_y = std::numeric_limits<float>::lowest();
+	for (const auto& vertex : mesh.vertices) {
+		const glm::tvec4<float> clipspace_coords = mvp_matrix * vertex;
+		if (clipspace_coords[3] <= 0.0f) {
+			return cv::Rect(0, 0, viewport_width, viewport_height);
 		}
+		// Same as in detail::process_prospective_tri():
+		const cv::Vec2f screen_coords = clip_to_screen_space(cv::Vec2f(clipspace_coords[0] / clipspace_coords[3], clipspace_coords[1] / clipspace_coords[3]), viewport_width, viewport_height);
+		min_x = std::min(min_x, screen_coords[0]);
+		min_y = std::min(min_y, screen_coords[1]);
+		max_x = std::max(max_x, screen_coords[0]);
+		max_y = std::max(max_y, screen_coords[1]);
 	}
+	return detail::get_pixel_region(min_x, min_y, max_x, max_y, viewport_width, viewport_height, margin);
+};
 
-	// Fragment/pixel shader: Colour the pixel values
-	for (const auto& tri : triangles_to_raster) {
-		detail::raster_triangle(tri, colourbuffer, depthbuffer, texture, enable_far_clipping);
+/**
+ * Renders only the depth of the given mesh, and optionally the index of the visible
+ * triangle and the barycentric coordinates at each pixel. No colours are computed.
+ * See RenderContext::render_depth(), which can also reuse the buffers between calls.
+ *
+ * @param[in] mesh A 3D mesh.
+ * @param[in] model_view_matrix A 4x4 OpenGL model-view matrix.
+ * @param[in] projection_matrix A 4x4 orthographic or perspective OpenGL projection matrix.
+ * @param[in] viewport_width Screen width.
+ * @param[in] viewport_height Screen height.
+ * @param[out] id_buffer If given, it is resized to the viewport and receives the triangle indices (into mesh.tvi) and barycentric coordinates.
+ * @param[in] enable_backface_culling Whether the renderer should perform backface culling.
+ * @param[in] enable_near_clipping Whether vertices should be clipped against the near plane.
+ * @param[in] enable_far_clipping Whether vertices should be clipped against the far plane.
+ * @return The depthbuffer (CV_32FC1).
+ */
+inline cv::Mat render_depth(const core::Mesh& mesh, glm::tmat4x4<float> model_view_matrix, glm::tmat4x4<float> projection_matrix, int viewport_width, int viewport_height, TriangleIdBuffer* id_buffer = nullptr, bool enable_backface_culling = false, bool enable_near_clipping = true, bool enable_far_clipping = true)
+{
+	Framebuffer framebuffer(viewport_width, viewport_height, false);
+	if (id_buffer) {
+		id_buffer->resize(viewport_width, viewport_height);
 	}
-	return std::make_pair(colourbuffer, depthbuffer);
+	RenderContext context;
+	context.render_depth(mesh, model_view_matrix, projection_matrix, framebuffer, id_buffer, enable_backface_culling, enable_near_clipping, enable_far_clipping);
+	return framebuffer.get_depthbuffer();
 };
 
 	} /* namespace render */
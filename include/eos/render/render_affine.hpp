@@ -23,6 +23,7 @@
 #define RENDER_AFFINE_HPP_
 
 #include "eos/core/Mesh.hpp"
+#include "eos/render/Framebuffer.hpp"
 #include "eos/render/detail/render_detail.hpp"
 #include "eos/render/detail/render_affine_detail.hpp"
 
@@ -32,11 +33,46 @@
 
 #include "opencv2/core/core.hpp"
 
+#include "boost/optional.hpp"
+
+#include <vector>
 #include <utility>
+#include <cstddef>
+#include <limits>
+#include <algorithm>
 
 namespace eos {
 	namespace render {
 
+/**
+ * Returns the region of the viewport that render_affine() and render_affine_depth()
+ * draw the given mesh into, grown by \p margin pixels. See the overload for
+ * render() in render.hpp.
+ *
+ * @param[in] mesh A 3D mesh.
+ * @param[in] affine_camera_matrix 3x4 affine camera matrix.
+ * @param[in] viewport_width Screen width.
+ * @param[in] viewport_height Screen height.
+ * @param[in] margin The number of pixels to add on each side.
+ * @return The region in pixels, clipped to the viewport. Empty if the mesh is outside of the viewport.
+ */
+inline cv::Rect get_screen_bounding_box(const core::Mesh& mesh, cv::Mat affine_camera_matrix, int viewport_width, int viewport_height, int margin = 0)
+{
+	std::vector<glm::tvec4<float>> screen_coords;
+	detail::project_affine(mesh.vertices, detail::calculate_affine_z_direction(affine_camera_matrix), screen_coords);
+	float min_x = std::numeric_limits<float>::max();
+	float min_y = std::numeric_limits<float>::max();
+	float max_x = std::numeric_limits<float>::lowest();
+	float max_y = std::numeric_limits<float>::lowest();
+	for (const auto& coords : screen_coords) {
+		min_x = std::min(min_x, coords[0]);
+		min_y = std::min(min_y, coords[1]);
+		max_x = std::max(max_x, coords[0]);
+		max_y = std::max(max_y, coords[1]);
+	}
+	return detail::get_pixel_region(min_x, min_y, max_x, max_y, viewport_width, viewport_height, margin);
+};
+
 /**
  * Renders the mesh using the given affine camera matrix and returns the colour and depth buffer images.
  * The camera matrix should be one estimated with fitting::estimate_affine_camera (Hartley & Zisserman algorithm).
@@ -46,77 +82,71 @@ namespace eos {
  * #Todo: May consider an overload where we pass in an image, use that as colourbuffer and draw over it.
  * #Todo: Add texture rendering to this. Then, create an additional function in extract_texure that is fully optimised for only the extraction.
  *
+ * If a \p region is given, e.g. from get_screen_bounding_box(), the buffers only
+ * cover that region of the viewport: pixel (x, y) of the viewport is pixel
+ * (x - region.x, y - region.y) of the buffers.
+ *
  * @param[in] mesh A 3D mesh.
  * @param[in] affine_camera_matrix 3x4 affine camera matrix.
  * @param[in] viewport_width Screen width.
  * @param[in] viewport_height Screen height.
  * @param[in] do_backface_culling Whether the renderer should perform backface culling.
- * @return A pair with the colourbuffer as its first element and the depthbuffer as the second element.
+ * @param[in] region An optional region of the viewport to render, instead of the whole viewport.
+ * @return A pair with the colourbuffer (CV_8UC4) as its first element and the depthbuffer (CV_32FC1) as the second element.
  */
-inline std::pair<cv::Mat, cv::Mat> render_affine(const core::Mesh& mesh, cv::Mat affine_camera_matrix, int viewport_width, int viewport_height, bool do_backface_culling = true)
+inline std::pair<cv::Mat, cv::Mat> render_affine(const core::Mesh& mesh, cv::Mat affine_camera_matrix, int viewport_width, int viewport_height, bool do_backface_culling = true, const boost::optional<cv::Rect>& region = boost::none)
 {
 	assert(mesh.vertices.size() == mesh.colors.size() || mesh.colors.empty()); // The number of vertices has to be equal for both shape and colour, or, alternatively, it has to be a shape-only model.
 	//assert(mesh.vertices.size() == mesh.texcoords.size() || mesh.texcoords.empty()); // same for the texcoords
 
-	using cv::Mat;
 	using std::vector;
 
-	Mat colourbuffer = Mat::zeros(viewport_height, viewport_width, CV_8UC4);
-	Mat depthbuffer = std::numeric_limits<float>::max() * Mat::ones(viewport_height, viewport_width, CV_64FC1);
+	Framebuffer framebuffer(viewport_width, viewport_height, region.get_value_or(cv::Rect(0, 0, viewport_width, viewport_height)));
 
-	Mat affine_with_z = detail::calculate_affine_z_direction(affine_camera_matrix);
+	vector<detail::TriangleToRasterize> triangles_to_raster = detail::setup_affine_triangles(mesh, affine_camera_matrix, viewport_width, viewport_height, do_backface_culling);
 
-	vector<detail::Vertex<float>> projected_vertices;
-	projected_vertices.reserve(mesh.vertices.size());
-	for (int i = 0; i < mesh.vertices.size(); ++i) {
-		Mat vertex_screen_coords = affine_with_z * Mat(cv::Vec4f(mesh.vertices[i].x, mesh.vertices[i].y, mesh.vertices[i].z, mesh.vertices[i].w));
-		glm::tvec4<float> vertex_screen_coords_glm(vertex_screen_coords.at<float>(0), vertex_screen_coords.at<float>(1), vertex_screen_coords.at<float>(2), vertex_screen_coords.at<float>(3));
-		glm::tvec3<float> vertex_colour;
-		if (mesh.colors.empty()) {
-			vertex_colour = glm::tvec3<float>(0.5f, 0.5f, 0.5f);
-		}
-		else {
-			vertex_colour = mesh.colors[i];
+	// Raster all triangles, i.e. colour the pixel values and write the z-buffer
+	for (auto&& triangle : triangles_to_raster) {
+		if (detail::clip_to_region(triangle, framebuffer.get_region())) {
+			detail::raster_triangle_affine(triangle, framebuffer);
 		}
-		projected_vertices.push_back(detail::Vertex<float>{vertex_screen_coords_glm, vertex_colour, mesh.texcoords[i]});
 	}
+	return std::make_pair(framebuffer.get_colourbuffer(), framebuffer.get_depthbuffer());
+};
 
-	// All vertices are screen-coordinates now
-	vector<detail::TriangleToRasterize> triangles_to_raster;
-	for (const auto& tri_indices : mesh.tvi) {
-		if (do_backface_culling) {
-			if (!detail::are_vertices_ccw_in_screen_space(glm::tvec2<float>(projected_vertices[tri_indices[0]].position), glm::tvec2<float>(projected_vertices[tri_indices[1]].position), glm::tvec2<float>(projected_vertices[tri_indices[2]].position)))
-				continue; // don't render this triangle
-		}
+/**
+ * Renders only the depth of the mesh using the given affine camera matrix, and
+ * optionally the index of the visible triangle and the barycentric coordinates at
+ * each pixel. No colours are computed.
+ *
+ * The depth buffer is the same as the one of render_affine(), at a fraction of the
+ * cost, so this can be used as visibility pre-pass for the texture extraction.
+ *
+ * @param[in] mesh A 3D mesh.
+ * @param[in] affine_camera_matrix 3x4 affine camera matrix.
+ * @param[in] viewport_width Screen width.
+ * @param[in] viewport_height Screen height.
+ * @param[in] do_backface_culling Whether the renderer should perform backface culling.
+ * @param[out] id_buffer If given, it is resized to the viewport (or the region) and receives the triangle indices (into mesh.tvi) and barycentric coordinates.
+ * @param[in] region An optional region of the viewport to render, as in render_affine().
+ * @return The depthbuffer (CV_32FC1).
+ */
+inline cv::Mat render_affine_depth(const core::Mesh& mesh, cv::Mat affine_camera_matrix, int viewport_width, int viewport_height, bool do_backface_culling = true, TriangleIdBuffer* id_buffer = nullptr, const boost::optional<cv::Rect>& region = boost::none)
+{
+	std::vector<int> source_triangles;
+	std::vector<detail::TriangleToRasterize> triangles_to_raster = detail::setup_affine_triangles(mesh, affine_camera_matrix, viewport_width, viewport_height, do_backface_culling, &source_triangles);
 
-		// Get the bounding box of the triangle:
-		// take care: What do we do if all 3 vertices are not visible. Seems to work on a test case.
-		cv::Rect bounding_box = detail::calculate_clipped_bounding_box(glm::tvec2<float>(projected_vertices[tri_indices[0]].position), glm::tvec2<float>(projected_vertices[tri_indices[1]].position), glm::tvec2<float>(projected_vertices[tri_indices[2]].position), viewport_width, viewport_height);
-		auto min_x = bounding_box.x;
-		auto max_x = bounding_box.x + bounding_box.width;
-		auto min_y = bounding_box.y;
-		auto max_y = bounding_box.y + bounding_box.height;
-
-		if (max_x <= min_x || max_y <= min_y) // Note: Can the width/height of the bbox be negative? Maybe we only need to check for equality here?
-			continue;
-
-		detail::TriangleToRasterize t;
-		t.min_x = min_x;
-		t.max_x = max_x;
-		t.min_y = min_y;
-		t.max_y = max_y;
-		t.v0 = projected_vertices[tri_indices[0]];
-		t.v1 = projected_vertices[tri_indices[1]];
-		t.v2 = projected_vertices[tri_indices[2]];
-
-		triangles_to_raster.push_back(t);
+	Framebuffer framebuffer(viewport_width, viewport_height, region.get_value_or(cv::Rect(0, 0, viewport_width, viewport_height)), false);
+	if (id_buffer) {
+		id_buffer->resize(framebuffer.width(), framebuffer.height());
+		id_buffer->clear();
 	}
-
-	// Raster all triangles, i.e. colour the pixel values and write the z-buffer
-	for (auto&& triangle : triangles_to_raster) {
-		detail::raster_triangle_affine(triangle, colourbuffer, depthbuffer);
+	for (std::size_t i = 0; i < triangles_to_raster.size(); ++i) {
+		if (detail::clip_to_region(triangles_to_raster[i], framebuffer.get_region())) {
+			detail::raster_triangle_depth(triangles_to_raster[i], framebuffer, false, false, source_triangles[i], id_buffer);
+		}
 	}
-	return std::make_pair(colourbuffer, depthbuffer);
+	return framebuffer.get_depthbuffer();
 };
 
 
@@ -23,13 +23,15 @@
 #define TEXTURE_EXTRACTION_HPP_
 
 #include "eos/core/Mesh.hpp"
+#include "eos/core/ThreadPool.hpp"
+#include "eos/core/Trace.hpp"
 #include "eos/render/detail/texture_extraction_detail.hpp"
 #include "eos/render/render_affine.hpp"
 #include "eos/render/detail/render_detail.hpp"
 #include "eos/render/utils.hpp" // for clip_to_screen_space()
 #include "eos/render/Rasterizer.hpp"
 #include "eos/render/FragmentShader.hpp"
-#include "eos/fitting/closest_edge_fitting.hpp" // for ray_triangle_intersect()
+#include "eos/render/vertex_visibility.hpp"
 
 #include "glm/mat4x4.hpp"
 #include "glm/vec2.hpp"
@@ -41,8 +43,9 @@
 
 #include <tuple>
 #include <cassert>
-#include <future>
 #include <vector>
+#include <array>
+#include <cmath>
 
 namespace eos {
 	namespace render {
@@ -58,22 +61,247 @@ enum class TextureInterpolation {
 };
 
 // Forward declarations:
-cv::Mat extract_texture(core::Mesh mesh, cv::Mat affine_camera_matrix, cv::Mat image, cv::Mat depthbuffer, bool compute_view_angle, TextureInterpolation mapping_type, int isomap_resolution);
+cv::Mat extract_texture(const core::Mesh& mesh, cv::Mat affine_camera_matrix, cv::Mat image, cv::Mat depthbuffer, bool compute_view_angle, TextureInterpolation mapping_type, int isomap_resolution, core::ThreadPool* thread_pool);
 namespace detail { cv::Mat interpolate_black_line(cv::Mat isomap); }
 
+namespace detail {
+
+/**
+ * A triangle of the mesh, set up for extract_texture(): its position in the isomap,
+ * and the affine transformation from isomap pixels to image pixels.
+ */
+struct TextureExtractionTriangle
+{
+	cv::Point2f dst_tri[3]; // the vertices in the isomap
+	float warp[6]; // 2x3 affine transformation, row-major, from the isomap (dst) to the image (src)
+	float alpha_value; // the value of the alpha channel of the extracted pixels
+	cv::Rect bounding_box; // the pixels of the isomap to visit, x + width and y + height are inclusive
+};
+
+/**
+ * Computes the position of a triangle of the mesh in the isomap, from its texture
+ * coordinates, and the pixels of the isomap that belong to its bounding box.
+ *
+ * @param[in] mesh A mesh with texture coordinates.
+ * @param[in] triangle_indices The vertex indices of the triangle.
+ * @param[in] isomap_width The width of the isomap.
+ * @param[in] isomap_height The height of the isomap.
+ * @param[out] dst_tri The vertices of the triangle in the isomap.
+ * @return The bounding box, clipped to the isomap. x + width and y + height are inclusive, and the width or height is negative if the box is empty.
+ */
+inline cv::Rect get_isomap_triangle(const core::Mesh& mesh, const std::array<int, 3>& triangle_indices, int isomap_width, int isomap_height, cv::Point2f (&dst_tri)[3])
+{
+	using std::min;
+	using std::max;
+	for (int i = 0; i < 3; ++i) {
+		const auto& texcoords = mesh.texcoords[triangle_indices[i]];
+		dst_tri[i] = cv::Point2f(isomap_width * texcoords[0], isomap_height * texcoords[1] - 1.0f);
+	}
+	// The pixels with x and y in [min, max):
+	const int min_x = max(static_cast<int>(min(dst_tri[0].x, min(dst_tri[1].x, dst_tri[2].x))), 0);
+	const int max_x = min(static_cast<int>(std::ceil(max(dst_tri[0].x, max(dst_tri[1].x, dst_tri[2].x)))) - 1, isomap_width - 1);
+	const int min_y = max(static_cast<int>(min(dst_tri[0].y, min(dst_tri[1].y, dst_tri[2].y))), 0);
+	const int max_y = min(static_cast<int>(std::ceil(max(dst_tri[0].y, max(dst_tri[1].y, dst_tri[2].y)))) - 1, isomap_height - 1);
+	return cv::Rect(min_x, min_y, max_x - min_x, max_y - min_y);
+};
+
+/**
+ * Computes the value of the alpha channel of the pixels that extract_texture()
+ * extracts from a visible triangle: 255 if \p compute_view_angle is false, and
+ * otherwise the view angle, from 0 (90 or more) to 255 (front-facing).
+ *
+ * @param[in] v0 First vertex of the triangle, in model space.
+ * @param[in] v1 Second vertex.
+ * @param[in] v2 Third vertex.
+ * @param[in] affine_cam_4x4 The 4x4 affine camera matrix, as returned by calculate_affine_z_direction().
+ * @param[in] compute_view_angle Whether to compute the view angle.
+ * @return The alpha value, in [0, 255].
+ */
+inline float calculate_alpha_value(const glm::tvec4<float>& v0, const glm::tvec4<float>& v1, const glm::tvec4<float>& v2, const cv::Mat& affine_cam_4x4, bool compute_view_angle)
+{
+	if (!compute_view_angle) {
+		// no visibility angle computation - if the triangle/pixel is visible, set the alpha chan to 255 (fully visible pixel).
+		return 255.0f;
+	}
+	// Calculate how well visible the current triangle is:
+	// (in essence, the dot product of the viewing direction (0, 0, 1) and the face normal)
+	const cv::Vec3f face_normal = calculate_face_normal(cv::Vec3f(v0.x, v0.y, v0.z), cv::Vec3f(v1.x, v1.y, v1.z), cv::Vec3f(v2.x, v2.y, v2.z));
+	// Transform the normal to "screen" (kind of "eye") space using the upper 3x3 part of the affine camera matrix (=the translation can be ignored):
+	cv::Vec3f face_normal_transformed;
+	for (int row = 0; row < 3; ++row) {
+		face_normal_transformed[row] = affine_cam_4x4.at<float>(row, 0) * face_normal[0] + affine_cam_4x4.at<float>(row, 1) * face_normal[1] + affine_cam_4x4.at<float>(row, 2) * face_normal[2];
+	}
+	face_normal_transformed /= cv::norm(face_normal_transformed, cv::NORM_L2); // normalise to unit length
+	// Implementation notes regarding the affine camera matrix and the sign:
+	// If the matrix given were the model_view matrix, the sign would be correct.
+	// However, affine_camera_matrix includes glm::ortho, which includes a z-flip.
+	// So we need to flip one of the two signs.
+	// * viewing_direction(0.0f, 0.0f, 1.0f) is correct if affine_camera_matrix were only a model_view matrix
+	// * affine_camera_matrix includes glm::ortho, which flips z, so we flip the sign of viewing_direction.
+	// We don't need the dot product since viewing_direction.xy are 0 and .z is 1:
+	const float angle = -face_normal_transformed[2]; // flip sign, see above
+	assert(angle >= -1.f && angle <= 1.f);
+	// angle is [-1, 1].
+	//  * +1 means   0 (same direction)
+	//  *  0 means  90
+	//  * -1 means 180 (facing opposite directions)
+	// It's a linear relation, so +0.5 is 45 etc.
+	// An angle larger than 90 means the vertex won't be rendered anyway (because it's back-facing) so we encode 0 to 90.
+	return angle < 0.0f ? 0.0f : angle * 255.0f;
+};
+
+/**
+ * Maps the pixels of the isomap inside the given triangle to the image, and copies
+ * the colour from the image, using the given interpolation type. Only the pixels
+ * inside \p region are written.
+ *
+ * @param[in] triangle The triangle to extract.
+ * @param[in] region The region of the isomap to restrict the writing to, x + width and y + height are exclusive.
+ * @param[in] image The image to extract the texture from, CV_8UC3.
+ * @param[in] mapping_type The interpolation type to be used for the extraction.
+ * @param[in,out] isomap The isomap to write into, CV_8UC4.
+ */
+inline void extract_texture_triangle(const TextureExtractionTriangle& triangle, const cv::Rect& region, const cv::Mat& image, TextureInterpolation mapping_type, cv::Mat& isomap)
+{
+	using cv::Vec2f;
+	using cv::Vec3b;
+	using std::min;
+	using std::max;
+	using std::floor;
+	using std::ceil;
+
+	const auto& dst_tri = triangle.dst_tri;
+	const auto& warp = triangle.warp;
+	// calculate corresponding position of an isomap (dst) point in the image (src)
+	const auto warp_to_image = [&warp](float x, float y) {
+		return Vec2f(warp[0] * x + warp[1] * y + warp[2], warp[3] * x + warp[4] * y + warp[5]);
+	};
+
+	const int min_x = max(triangle.bounding_box.x, region.x);
+	const int max_x = min(triangle.bounding_box.x + triangle.bounding_box.width, region.x + region.width - 1);
+	const int min_y = max(triangle.bounding_box.y, region.y);
+	const int max_y = min(triangle.bounding_box.y + triangle.bounding_box.height, region.y + region.height - 1);
+
+	// We loop over all pixels in the triangle and select, depending on the mapping type, the corresponding texel(s) in the source image
+	for (int y = min_y; y <= max_y; ++y) {
+		for (int x = min_x; x <= max_x; ++x) {
+			if (detail::is_point_in_triangle(cv::Point2f(x, y), dst_tri[0], dst_tri[1], dst_tri[2])) {
+
+				// As the coordinates of the transformed pixel in the image will most likely not lie on a texel, we have to choose how to
+				// calculate the pixel colors depending on the next texels
+				// there are three different texture interpolation methods: area, bilinear and nearest neighbour
+
+				// Area mapping: calculate mean color of texels in transformed pixel area
+				if (mapping_type == TextureInterpolation::Area) {
+
+					// calculate positions of 4 corners of pixel in image (src)
+					const Vec2f src_texel_upper_left = warp_to_image(x - 0.5f, y - 0.5f);
+					const Vec2f src_texel_upper_right = warp_to_image(x + 0.5f, y - 0.5f);
+					const Vec2f src_texel_lower_left = warp_to_image(x - 0.5f, y + 0.5f);
+					const Vec2f src_texel_lower_right = warp_to_image(x + 0.5f, y + 0.5f);
+
+					float min_a = min(min(src_texel_upper_left[0], src_texel_upper_right[0]), min(src_texel_lower_left[0], src_texel_lower_right[0]));
+					float max_a = max(max(src_texel_upper_left[0], src_texel_upper_right[0]), max(src_texel_lower_left[0], src_texel_lower_right[0]));
+					float min_b = min(min(src_texel_upper_left[1], src_texel_upper_right[1]), min(src_texel_lower_left[1], src_texel_lower_right[1]));
+					float max_b = max(max(src_texel_upper_left[1], src_texel_upper_right[1]), max(src_texel_lower_left[1], src_texel_lower_right[1]));
+
+					cv::Vec3i color;
+					int num_texels = 0;
+
+					// loop over square in which quadrangle out of the four corners of pixel is
+					for (int a = ceil(min_a); a <= floor(max_a); ++a)
+					{
+						for (int b = ceil(min_b); b <= floor(max_b); ++b)
+						{
+							// check if texel is in quadrangle
+							if (detail::is_point_in_triangle(cv::Point2f(a, b), src_texel_upper_left, src_texel_lower_left, src_texel_upper_right) || detail::is_point_in_triangle(cv::Point2f(a, b), src_texel_lower_left, src_texel_upper_right, src_texel_lower_right)) {
+								if (a < image.cols && b < image.rows) { // check if texel is in image
+									num_texels++;
+									color += image.at<Vec3b>(b, a);
+								}
+							}
+						}
+					}
+					bool has_color = num_texels > 0;
+					if (num_texels > 0)
+						color = color / num_texels;
+					else { // if no corresponding texel found, nearest neighbour interpolation
+						const Vec2f src_texel = warp_to_image(x, y);
+
+						if ((cvRound(src_texel[1]) < image.rows) && cvRound(src_texel[0]) < image.cols) {
+							color = image.at<Vec3b>(cvRound(src_texel[1]), cvRound(src_texel[0]));
+							has_color = true;
+						}
+					}
+					if (has_color) { // like NearestNeighbour, texels without a colour stay invisible
+						isomap.at<cv::Vec4b>(y, x) = cv::Vec4b(static_cast<uchar>(color[0]), static_cast<uchar>(color[1]), static_cast<uchar>(color[2]), static_cast<uchar>(triangle.alpha_value));
+					}
+				}
+				// Bilinear mapping: calculate pixel color depending on the four neighbouring texels
+				else if (mapping_type == TextureInterpolation::Bilinear) {
+
+					const Vec2f src_texel = warp_to_image(x, y);
+
+					// calculate euclidean distances to next 4 texels
+					using std::sqrt;
+					using std::pow;
+					float distance_upper_left = sqrt(pow(src_texel[0] - floor(src_texel[0]), 2) + pow(src_texel[1] - floor(src_texel[1]), 2));
+					float distance_upper_right = sqrt(pow(src_texel[0] - floor(src_texel[0]), 2) + pow(src_texel[1] - ceil(src_texel[1]), 2));
+					float distance_lower_left = sqrt(pow(src_texel[0] - ceil(src_texel[0]), 2) + pow(src_texel[1] - floor(src_texel[1]), 2));
+					float distance_lower_right = sqrt(pow(src_texel[0] - ceil(src_texel[0]), 2) + pow(src_texel[1] - ceil(src_texel[1]), 2));
+
+					// normalise distances that the sum of all distances is 1
+					float sum_distances = distance_lower_left + distance_lower_right + distance_upper_left + distance_upper_right;
+					distance_lower_left /= sum_distances;
+					distance_lower_right /= sum_distances;
+					distance_upper_left /= sum_distances;
+					distance_upper_right /= sum_distances;
+
+					// set color depending on distance from next 4 texels
+					cv::Vec4b& isomap_pixel = isomap.at<cv::Vec4b>(y, x);
+					for (int color = 0; color < 3; ++color) {
+						float color_upper_left = image.at<Vec3b>(floor(src_texel[1]), floor(src_texel[0]))[color] * distance_upper_left;
+						float color_upper_right = image.at<Vec3b>(floor(src_texel[1]), ceil(src_texel[0]))[color] * distance_upper_right;
+						float color_lower_left = image.at<Vec3b>(ceil(src_texel[1]), floor(src_texel[0]))[color] * distance_lower_left;
+						float color_lower_right = image.at<Vec3b>(ceil(src_texel[1]), ceil(src_texel[0]))[color] * distance_lower_right;
+
+						isomap_pixel[color] = static_cast<uchar>(color_upper_left + color_upper_right + color_lower_left + color_lower_right);
+					}
+					isomap_pixel[3] = static_cast<uchar>(triangle.alpha_value); // pixel is visible
+				}
+				// NearestNeighbour mapping: set color of pixel to color of nearest texel
+				else if (mapping_type == TextureInterpolation::NearestNeighbour) {
+
+					const Vec2f src_texel = warp_to_image(x, y);
+
+					if ((cvRound(src_texel[1]) < image.rows) && (cvRound(src_texel[0]) < image.cols) && cvRound(src_texel[0]) > 0 && cvRound(src_texel[1]) > 0)
+					{
+						isomap.at<cv::Vec4b>(y, x)[0] = image.at<Vec3b>(cvRound(src_texel[1]), cvRound(src_texel[0]))[0];
+						isomap.at<cv::Vec4b>(y, x)[1] = image.at<Vec3b>(cvRound(src_texel[1]), cvRound(src_texel[0]))[1];
+						isomap.at<cv::Vec4b>(y, x)[2] = image.at<Vec3b>(cvRound(src_texel[1]), cvRound(src_texel[0]))[2];
+						isomap.at<cv::Vec4b>(y, x)[3] = static_cast<uchar>(triangle.alpha_value); // pixel is visible
+					}
+				}
+			}
+		}
+	}
+
+};
+
+} /* namespace detail */
+
 /**
  * Extracts the texture of the face from the given image
  * and stores it as isomap (a rectangular texture map).
  *
- * Note/Todo: Only use TextureInterpolation::NearestNeighbour
- * for the moment, the other methods don't have correct handling of
- * the alpha channel (and will most likely throw an exception).
+ * Note/Todo: TextureInterpolation::Bilinear doesn't check whether the
+ * four texels it samples lie inside the image.
  *
  * Todo: These should be renamed to extract_texture_affine? Can we combine both cases somehow?
  * Or an overload with RenderingParameters?
  *
- * For TextureInterpolation::NearestNeighbour, returns a 4-channel isomap
- * with the visibility in the 4th channel (0=invis, 255=visible).
+ * Returns a 4-channel isomap with the visibility in the 4th channel
+ * (0=invis, 255=visible), for all interpolation types.
  *
  * @param[in] mesh A mesh with texture coordinates.
  * @param[in] affine_camera_matrix An estimated 3x4 affine camera matrix.
@@ -81,17 +309,24 @@ namespace detail { cv::Mat interpolate_black_line(cv::Mat isomap); }
  * @param[in] compute_view_angle A flag whether the view angle of each vertex should be computed and returned. If set to true, the angle will be encoded into the alpha channel (0 meaning occluded or facing away 90, 127 meaning facing a 45 angle and 255 meaning front-facing, and all values in between). If set to false, the alpha channel will only contain 0 for occluded vertices and 255 for visible vertices.
  * @param[in] mapping_type The interpolation type to be used for the extraction.
  * @param[in] isomap_resolution The resolution of the generated isomap. Defaults to 512x512.
+ * @param[in] thread_pool An optional thread pool to set up the triangles and fill the tiles of the isomap in parallel. The result is the same as without.
+ * @param[in] trace_sink If given, receives the time of the visibility pass, the triangle setup and the extraction, and the number of visible triangles.
  * @return The extracted texture as isomap (texture map).
  */
-inline cv::Mat extract_texture(const core::Mesh& mesh, cv::Mat affine_camera_matrix, cv::Mat image, bool compute_view_angle = false, TextureInterpolation mapping_type = TextureInterpolation::NearestNeighbour, int isomap_resolution = 512)
+inline cv::Mat extract_texture(const core::Mesh& mesh, cv::Mat affine_camera_matrix, cv::Mat image, bool compute_view_angle = false, TextureInterpolation mapping_type = TextureInterpolation::NearestNeighbour, int isomap_resolution = 512, core::ThreadPool* thread_pool = nullptr, core::TraceSink* trace_sink = nullptr)
 {
-	// Render the model to get a depth buffer:
+	// Render the depth of the model (no colours needed) to get a depth buffer. Only the region of
+	// the image that the mesh covers is needed for the visibility test:
 	cv::Mat depthbuffer;
-	std::tie(std::ignore, depthbuffer) = render::render_affine(mesh, affine_camera_matrix, image.cols, image.rows);
-	// Note: There's potential for optimisation here - we don't need to do everything that is done in render_affine to just get the depthbuffer.
+	cv::Rect depthbuffer_region;
+	{
+		core::ScopedTrace trace(trace_sink, "texture_visibility");
+		depthbuffer_region = render::get_screen_bounding_box(mesh, affine_camera_matrix, image.cols, image.rows);
+		depthbuffer = render::render_affine_depth(mesh, affine_camera_matrix, image.cols, image.rows, true, nullptr, depthbuffer_region);
+	}
 
 	// Now forward the call to the actual texture extraction function:
-	return extract_texture(mesh, affine_camera_matrix, image, depthbuffer, compute_view_angle, mapping_type, isomap_resolution);
+	return extract_texture(mesh, affine_camera_matrix, image, depthbuffer, depthbuffer_region, compute_view_angle, mapping_type, isomap_resolution, thread_pool, trace_sink);
 };
 
 /**
@@ -112,236 +347,152 @@ inline cv::Mat extract_texture(const core::Mesh& mesh, cv::Mat affine_camera_mat
  * @param[in] compute_view_angle A flag whether the view angle of each vertex should be computed and returned. If set to true, the angle will be encoded into the alpha channel (0 meaning occluded or facing away 90, 127 meaning facing a 45 angle and 255 meaning front-facing, and all values in between). If set to false, the alpha channel will only contain 0 for occluded vertices and 255 for visible vertices.
  * @param[in] mapping_type The interpolation type to be used for the extraction.
  * @param[in] isomap_resolution The resolution of the generated isomap. Defaults to 512x512.
+ * @param[in] thread_pool An optional thread pool to set up the triangles and fill the tiles of the isomap in parallel. The result is the same as without.
+ * @param[in] trace_sink If given, receives the time of the visibility pass, the triangle setup and the extraction, and the number of visible triangles.
+ * @return The extracted texture as isomap (texture map).
+ */
+inline cv::Mat extract_texture(const core::Mesh& mesh, cv::Mat affine_camera_matrix, cv::Mat image, cv::Mat depthbuffer, bool compute_view_angle = false, TextureInterpolation mapping_type = TextureInterpolation::NearestNeighbour, int isomap_resolution = 512, core::ThreadPool* thread_pool = nullptr, core::TraceSink* trace_sink = nullptr)
+{
+	return extract_texture(mesh, affine_camera_matrix, image, depthbuffer, cv::Rect(0, 0, depthbuffer.cols, depthbuffer.rows), compute_view_angle, mapping_type, isomap_resolution, thread_pool, trace_sink);
+};
+
+/**
+ * Extracts the texture of the face from the given image and stores it as isomap,
+ * with a depthbuffer that only covers a region of the image, e.g. one rendered
+ * with render_affine_depth() and the region from get_screen_bounding_box().
+ * Otherwise the same as the overload above.
+ *
+ * @param[in] mesh A mesh with texture coordinates.
+ * @param[in] affine_camera_matrix An estimated 3x4 affine camera matrix.
+ * @param[in] image The image to extract the texture from.
+ * @param[in] depthbuffer A pre-calculated depthbuffer image of the region.
+ * @param[in] depthbuffer_region The region of the image that the depthbuffer covers.
+ * @param[in] compute_view_angle A flag whether the view angle of each vertex should be computed and returned, see the overload above.
+ * @param[in] mapping_type The interpolation type to be used for the extraction.
+ * @param[in] isomap_resolution The resolution of the generated isomap. Defaults to 512x512.
+ * @param[in] thread_pool An optional thread pool to set up the triangles and fill the tiles of the isomap in parallel. The result is the same as without.
+ * @param[in] trace_sink If given, receives the time of the triangle setup and the extraction, and the number of visible triangles.
  * @return The extracted texture as isomap (texture map).
  */
-inline cv::Mat extract_texture(core::Mesh mesh, cv::Mat affine_camera_matrix, cv::Mat image, cv::Mat depthbuffer, bool compute_view_angle = false, TextureInterpolation mapping_type = TextureInterpolation::NearestNeighbour, int isomap_resolution = 512)
+inline cv::Mat extract_texture(const core::Mesh& mesh, cv::Mat affine_camera_matrix, cv::Mat image, cv::Mat depthbuffer, const cv::Rect& depthbuffer_region, bool compute_view_angle = false, TextureInterpolation mapping_type = TextureInterpolation::NearestNeighbour, int isomap_resolution = 512, core::ThreadPool* thread_pool = nullptr, core::TraceSink* trace_sink = nullptr)
 {
 	assert(mesh.vertices.size() == mesh.texcoords.size());
 	assert(image.type() == CV_8UC3); // the other cases are not yet supported
 
 	using cv::Mat;
-	using cv::Vec2f;
-	using cv::Vec3f;
-	using cv::Vec4f;
-	using cv::Vec3b;
-	using std::min;
-	using std::max;
-	using std::floor;
-	using std::ceil;
 
-	affine_camera_matrix = detail::calculate_affine_z_direction(affine_camera_matrix);
+	const cv::Mat affine_cam_4x4 = detail::calculate_affine_z_direction(affine_camera_matrix);
 
 	Mat isomap = Mat::zeros(isomap_resolution, isomap_resolution, CV_8UC4);
 	// #Todo: We should handle gray images, but output a 4-channel isomap nevertheless I think.
 
-	std::vector<std::future<void>> results;
-	for (const auto& triangle_indices : mesh.tvi) {
+	core::ScopedTrace trace_setup(trace_sink, "texture_setup");
+	// Project all vertices to screen coordinates once:
+	std::vector<glm::tvec4<float>> projected_vertices;
+	detail::project_affine(mesh.vertices, affine_cam_4x4, projected_vertices);
+
+	// Set up each triangle: Find out if it is visible, and compute the mapping from the isomap to the image.
+	// The visible triangles are compacted afterwards, so each triangle only writes to its own element here.
+	std::vector<detail::TextureExtractionTriangle> triangles(mesh.tvi.size());
+	std::vector<unsigned char> is_visible(mesh.tvi.size(), 0);
+	const auto setup_triangle = [&](int triangle_index) {
+		const auto& triangle_indices = mesh.tvi[triangle_index];
+		const glm::tvec4<float>& v0 = projected_vertices[triangle_indices[0]];
+		const glm::tvec4<float>& v1 = projected_vertices[triangle_indices[1]];
+		const glm::tvec4<float>& v2 = projected_vertices[triangle_indices[2]];
+
+		// Find out if the current triangle is visible:
+		// We do a second rendering-pass here. We use the depth-buffer of the final image, and then, here,
+		// check if each pixel in a triangle is visible. If the whole triangle is visible, we use it to extract
+		// the texture.
+		// Possible improvement: - If only part of the triangle is visible, split it
+		if (!detail::is_triangle_visible(v0, v1, v2, depthbuffer, depthbuffer_region))
+		{
+			return;
+		}
 
-		// Note: If there's a performance problem, there's no need to capture the whole mesh - we could capture only the three required vertices with their texcoords.
-		auto extract_triangle = [&mesh, &affine_camera_matrix, &triangle_indices, &depthbuffer, &isomap, &mapping_type, &image, &compute_view_angle]() {
+		auto& triangle = triangles[triangle_index];
+		triangle.alpha_value = detail::calculate_alpha_value(mesh.vertices[triangle_indices[0]], mesh.vertices[triangle_indices[1]], mesh.vertices[triangle_indices[2]], affine_cam_4x4, compute_view_angle);
 
-			// Find out if the current triangle is visible:
-			// We do a second rendering-pass here. We use the depth-buffer of the final image, and then, here,
-			// check if each pixel in a triangle is visible. If the whole triangle is visible, we use it to extract
-			// the texture.
-			// Possible improvement: - If only part of the triangle is visible, split it
+		// The source triangle in the image:
+		cv::Point2f src_tri[3];
+		src_tri[0] = cv::Point2f(v0.x, v0.y);
+		src_tri[1] = cv::Point2f(v1.x, v1.y);
+		src_tri[2] = cv::Point2f(v2.x, v2.y);
 
-			// This could be optimized in 2 ways though:
-			// - Use render(), or as in render(...), transfer the vertices once, not in a loop over all triangles (vertices are getting transformed multiple times)
-			// - We transform them later (below) a second time. Only do it once.
+		// The destination triangle in the isomap:
+		auto& dst_tri = triangle.dst_tri;
+		triangle.bounding_box = detail::get_isomap_triangle(mesh, triangle_indices, isomap.cols, isomap.rows, dst_tri);
+		if (triangle.bounding_box.width < 0 || triangle.bounding_box.height < 0) {
+			return;
+		}
 
-			cv::Vec4f v0_as_Vec4f(mesh.vertices[triangle_indices[0]].x, mesh.vertices[triangle_indices[0]].y, mesh.vertices[triangle_indices[0]].z, mesh.vertices[triangle_indices[0]].w);
-			cv::Vec4f v1_as_Vec4f(mesh.vertices[triangle_indices[1]].x, mesh.vertices[triangle_indices[1]].y, mesh.vertices[triangle_indices[1]].z, mesh.vertices[triangle_indices[1]].w);
-			cv::Vec4f v2_as_Vec4f(mesh.vertices[triangle_indices[2]].x, mesh.vertices[triangle_indices[2]].y, mesh.vertices[triangle_indices[2]].z, mesh.vertices[triangle_indices[2]].w);
+		// We now have the source triangles in the image and the source triangle in the isomap
+		// We use the inverse/ backward mapping approach, so we want to find the corresponding texel (texture-pixel) for each pixel in the isomap
 
-			// Project the triangle vertices to screen coordinates, and use the depthbuffer to check whether the triangle is visible:
-			const Vec4f v0 = Mat(affine_camera_matrix * Mat(v0_as_Vec4f));
-			const Vec4f v1 = Mat(affine_camera_matrix * Mat(v1_as_Vec4f));
-			const Vec4f v2 = Mat(affine_camera_matrix * Mat(v2_as_Vec4f));
+		// Get the inverse Affine Transform from original image: from dst (pixel in isomap) to src (in image)
+		const Mat warp_mat_org_inv = cv::getAffineTransform(dst_tri, src_tri); // CV_64FC1
+		for (int i = 0; i < 6; ++i) {
+			triangle.warp[i] = static_cast<float>(warp_mat_org_inv.at<double>(i / 3, i % 3));
+		}
 
-			if (!detail::is_triangle_visible(glm::tvec4<float>(v0[0], v0[1], v0[2], v0[3]), glm::tvec4<float>(v1[0], v1[1], v1[2], v1[3]), glm::tvec4<float>(v2[0], v2[1], v2[2], v2[3]), depthbuffer))
-			{
-				//continue;
-				return;
-			}
+		is_visible[triangle_index] = 1;
+	};
 
-			float alpha_value;
-			if (compute_view_angle)
-			{
-				// Calculate how well visible the current triangle is:
-				// (in essence, the dot product of the viewing direction (0, 0, 1) and the face normal)
-				const Vec3f face_normal = calculate_face_normal(Vec3f(Mat(v0_as_Vec4f).rowRange(0, 3)), Vec3f(Mat(v1_as_Vec4f).rowRange(0, 3)), Vec3f(Mat(v2_as_Vec4f).rowRange(0, 3)));
-				// Transform the normal to "screen" (kind of "eye") space using the upper 3x3 part of the affine camera matrix (=the translation can be ignored):
-				Vec3f face_normal_transformed = Mat(affine_camera_matrix.rowRange(0, 3).colRange(0, 3) * Mat(face_normal));
-				face_normal_transformed /= cv::norm(face_normal_transformed, cv::NORM_L2); // normalise to unit length
-				// Implementation notes regarding the affine camera matrix and the sign:
-				// If the matrix given were the model_view matrix, the sign would be correct.
-				// However, affine_camera_matrix includes glm::ortho, which includes a z-flip.
-				// So we need to flip one of the two signs.
-				// * viewing_direction(0.0f, 0.0f, 1.0f) is correct if affine_camera_matrix were only a model_view matrix
-				// * affine_camera_matrix includes glm::ortho, which flips z, so we flip the sign of viewing_direction.
-				// We don't need the dot product since viewing_direction.xy are 0 and .z is 1:
-				const float angle = -face_normal_transformed[2]; // flip sign, see above
-				assert(angle >= -1.f && angle <= 1.f);
-				// angle is [-1, 1].
-				//  * +1 means   0 (same direction)
-				//  *  0 means  90
-				//  * -1 means 180 (facing opposite directions)
-				// It's a linear relation, so +0.5 is 45 etc.
-				// An angle larger than 90 means the vertex won't be rendered anyway (because it's back-facing) so we encode 0 to 90.
-				if (angle < 0.0f) {
-					alpha_value = 0.0f;
-				} else {
-					alpha_value = angle * 255.0f;
-				}
-			}
-			else {
-				// no visibility angle computation - if the triangle/pixel is visible, set the alpha chan to 255 (fully visible pixel).
-				alpha_value = 255.0f;
+	const int num_triangles = static_cast<int>(mesh.tvi.size());
+	if (thread_pool && thread_pool->get_num_threads() > 1)
+	{
+		// The visibility test is the expensive part of the setup. Distribute chunks of triangles, so that
+		// the scheduling overhead stays small compared to the work:
+		const int chunk_size = 256;
+		const int num_chunks = (num_triangles + chunk_size - 1) / chunk_size;
+		thread_pool->parallel_for(0, num_chunks, [&setup_triangle, num_triangles](int chunk, int /* thread_index */) {
+			const int end = std::min((chunk + 1) * chunk_size, num_triangles);
+			for (int i = chunk * chunk_size; i < end; ++i) {
+				setup_triangle(i);
 			}
+		});
+	}
+	else
+	{
+		for (int i = 0; i < num_triangles; ++i) {
+			setup_triangle(i);
+		}
+	}
 
-			// Todo: Documentation
-			cv::Point2f src_tri[3];
-			cv::Point2f dst_tri[3];
-
-			Vec4f vec(mesh.vertices[triangle_indices[0]][0], mesh.vertices[triangle_indices[0]][1], mesh.vertices[triangle_indices[0]][2], 1.0f);
-			Vec4f res = Mat(affine_camera_matrix * Mat(vec));
-			src_tri[0] = Vec2f(res[0], res[1]);
-
-			vec = Vec4f(mesh.vertices[triangle_indices[1]][0], mesh.vertices[triangle_indices[1]][1], mesh.vertices[triangle_indices[1]][2], 1.0f);
-			res = Mat(affine_camera_matrix * Mat(vec));
-			src_tri[1] = Vec2f(res[0], res[1]);
-
-			vec = Vec4f(mesh.vertices[triangle_indices[2]][0], mesh.vertices[triangle_indices[2]][1], mesh.vertices[triangle_indices[2]][2], 1.0f);
-			res = Mat(affine_camera_matrix * Mat(vec));
-			src_tri[2] = Vec2f(res[0], res[1]);
-
-			dst_tri[0] = cv::Point2f(isomap.cols*mesh.texcoords[triangle_indices[0]][0], isomap.rows*mesh.texcoords[triangle_indices[0]][1] - 1.0f);
-			dst_tri[1] = cv::Point2f(isomap.cols*mesh.texcoords[triangle_indices[1]][0], isomap.rows*mesh.texcoords[triangle_indices[1]][1] - 1.0f);
-			dst_tri[2] = cv::Point2f(isomap.cols*mesh.texcoords[triangle_indices[2]][0], isomap.rows*mesh.texcoords[triangle_indices[2]][1] - 1.0f);
-
-			// We now have the source triangles in the image and the source triangle in the isomap
-			// We use the inverse/ backward mapping approach, so we want to find the corresponding texel (texture-pixel) for each pixel in the isomap
-
-			// Get the inverse Affine Transform from original image: from dst (pixel in isomap) to src (in image)
-			Mat warp_mat_org_inv = cv::getAffineTransform(dst_tri, src_tri);
-			warp_mat_org_inv.convertTo(warp_mat_org_inv, CV_32FC1);
-
-			// We now loop over all pixels in the triangle and select, depending on the mapping type, the corresponding texel(s) in the source image
-			for (int x = min(dst_tri[0].x, min(dst_tri[1].x, dst_tri[2].x)); x < max(dst_tri[0].x, max(dst_tri[1].x, dst_tri[2].x)); ++x) {
-				for (int y = min(dst_tri[0].y, min(dst_tri[1].y, dst_tri[2].y)); y < max(dst_tri[0].y, max(dst_tri[1].y, dst_tri[2].y)); ++y) {
-					if (detail::is_point_in_triangle(cv::Point2f(x, y), dst_tri[0], dst_tri[1], dst_tri[2])) {
-
-						// As the coordinates of the transformed pixel in the image will most likely not lie on a texel, we have to choose how to
-						// calculate the pixel colors depending on the next texels
-						// there are three different texture interpolation methods: area, bilinear and nearest neighbour
-
-						// Area mapping: calculate mean color of texels in transformed pixel area
-						if (mapping_type == TextureInterpolation::Area) {
-
-							// calculate positions of 4 corners of pixel in image (src)
-							Vec3f homogenous_dst_upper_left(x - 0.5f, y - 0.5f, 1.0f);
-							Vec3f homogenous_dst_upper_right(x + 0.5f, y - 0.5f, 1.0f);
-							Vec3f homogenous_dst_lower_left(x - 0.5f, y + 0.5f, 1.0f);
-							Vec3f homogenous_dst_lower_right(x + 0.5f, y + 0.5f, 1.0f);
-
-							Vec2f src_texel_upper_left = Mat(warp_mat_org_inv * Mat(homogenous_dst_upper_left));
-							Vec2f src_texel_upper_right = Mat(warp_mat_org_inv * Mat(homogenous_dst_upper_right));
-							Vec2f src_texel_lower_left = Mat(warp_mat_org_inv * Mat(homogenous_dst_lower_left));
-							Vec2f src_texel_lower_right = Mat(warp_mat_org_inv * Mat(homogenous_dst_lower_right));
-
-							float min_a = min(min(src_texel_upper_left[0], src_texel_upper_right[0]), min(src_texel_lower_left[0], src_texel_lower_right[0]));
-							float max_a = max(max(src_texel_upper_left[0], src_texel_upper_right[0]), max(src_texel_lower_left[0], src_texel_lower_right[0]));
-							float min_b = min(min(src_texel_upper_left[1], src_texel_upper_right[1]), min(src_texel_lower_left[1], src_texel_lower_right[1]));
-							float max_b = max(max(src_texel_upper_left[1], src_texel_upper_right[1]), max(src_texel_lower_left[1], src_texel_lower_right[1]));
-
-							cv::Vec3i color;
-							int num_texels = 0;
-
-							// loop over square in which quadrangle out of the four corners of pixel is
-							for (int a = ceil(min_a); a <= floor(max_a); ++a)
-							{
-								for (int b = ceil(min_b); b <= floor(max_b); ++b)
-								{
-									// check if texel is in quadrangle
-									if (detail::is_point_in_triangle(cv::Point2f(a, b), src_texel_upper_left, src_texel_lower_left, src_texel_upper_right) || detail::is_point_in_triangle(cv::Point2f(a, b), src_texel_lower_left, src_texel_upper_right, src_texel_lower_right)) {
-										if (a < image.cols && b < image.rows) { // check if texel is in image
-											num_texels++;
-											color += image.at<Vec3b>(b, a);
-										}
-									}
-								}
-							}
-							if (num_texels > 0)
-								color = color / num_texels;
-							else { // if no corresponding texel found, nearest neighbour interpolation
-								// calculate corresponding position of dst_coord pixel center in image (src)
-								Vec3f homogenous_dst_coord = Vec3f(x, y, 1.0f);
-								Vec2f src_texel = Mat(warp_mat_org_inv * Mat(homogenous_dst_coord));
-
-								if ((cvRound(src_texel[1]) < image.rows) && cvRound(src_texel[0]) < image.cols) {
-									color = image.at<Vec3b>(cvRound(src_texel[1]), cvRound(src_texel[0]));
-								}
-							}
-							isomap.at<Vec3b>(y, x) = color;
-						}
-						// Bilinear mapping: calculate pixel color depending on the four neighbouring texels
-						else if (mapping_type == TextureInterpolation::Bilinear) {
-
-							// calculate corresponding position of dst_coord pixel center in image (src)
-							Vec3f homogenous_dst_coord(x, y, 1.0f);
-							Vec2f src_texel = Mat(warp_mat_org_inv * Mat(homogenous_dst_coord));
-
-							// calculate euclidean distances to next 4 texels
-							using std::sqrt;
-							using std::pow;
-							float distance_upper_left = sqrt(pow(src_texel[0] - floor(src_texel[0]), 2) + pow(src_texel[1] - floor(src_texel[1]), 2));
-							float distance_upper_right = sqrt(pow(src_texel[0] - floor(src_texel[0]), 2) + pow(src_texel[1] - ceil(src_texel[1]), 2));
-							float distance_lower_left = sqrt(pow(src_texel[0] - ceil(src_texel[0]), 2) + pow(src_texel[1] - floor(src_texel[1]), 2));
-							float distance_lower_right = sqrt(pow(src_texel[0] - ceil(src_texel[0]), 2) + pow(src_texel[1] - ceil(src_texel[1]), 2));
-
-							// normalise distances that the sum of all distances is 1
-							float sum_distances = distance_lower_left + distance_lower_right + distance_upper_left + distance_upper_right;
-							distance_lower_left /= sum_distances;
-							distance_lower_right /= sum_distances;
-							distance_upper_left /= sum_distances;
-							distance_upper_right /= sum_distances;
-
-							// set color depending on distance from next 4 texels
-							for (int color = 0; color < 3; ++color) {
-								float color_upper_left = image.at<Vec3b>(floor(src_texel[1]), floor(src_texel[0]))[color] * distance_upper_left;
-								float color_upper_right = image.at<Vec3b>(floor(src_texel[1]), ceil(src_texel[0]))[color] * distance_upper_right;
-								float color_lower_left = image.at<Vec3b>(ceil(src_texel[1]), floor(src_texel[0]))[color] * distance_lower_left;
-								float color_lower_right = image.at<Vec3b>(ceil(src_texel[1]), ceil(src_texel[0]))[color] * distance_lower_right;
-
-								isomap.at<Vec3b>(y, x)[color] = color_upper_left + color_upper_right + color_lower_left + color_lower_right;
-							}
-						}
-						// NearestNeighbour mapping: set color of pixel to color of nearest texel
-						else if (mapping_type == TextureInterpolation::NearestNeighbour) {
-
-							// calculate corresponding position of dst_coord pixel center in image (src)
-							const Mat homogenous_dst_coord(Vec3f(x, y, 1.0f));
-							const Vec2f src_texel = Mat(warp_mat_org_inv * homogenous_dst_coord);
-
-							if ((cvRound(src_texel[1]) < image.rows) && (cvRound(src_texel[0]) < image.cols) && cvRound(src_texel[0]) > 0 && cvRound(src_texel[1]) > 0)
-							{
-								cv::Vec4b isomap_pixel;
-								isomap.at<cv::Vec4b>(y, x)[0] = image.at<Vec3b>(cvRound(src_texel[1]), cvRound(src_texel[0]))[0];
-								isomap.at<cv::Vec4b>(y, x)[1] = image.at<Vec3b>(cvRound(src_texel[1]), cvRound(src_texel[0]))[1];
-								isomap.at<cv::Vec4b>(y, x)[2] = image.at<Vec3b>(cvRound(src_texel[1]), cvRound(src_texel[0]))[2];
-								isomap.at<cv::Vec4b>(y, x)[3] = static_cast<uchar>(alpha_value); // pixel is visible
-							}
-						}
-					}
-				}
-			}
-		}; // end lambda auto extract_triangle();
-		results.emplace_back(std::async(extract_triangle));
-	} // end for all mesh.tvi
-	// Collect all the launched tasks:
-	for (auto&& r : results) {
-		r.get();
+	// Keep the visible triangles, in their original order:
+	std::vector<detail::TextureExtractionTriangle> visible_triangles;
+	visible_triangles.reserve(triangles.size());
+	for (int i = 0; i < num_triangles; ++i) {
+		if (is_visible[i]) {
+			visible_triangles.push_back(triangles[i]);
+		}
+	}
+	trace_setup.end();
+	core::trace_counter(trace_sink, "visible_triangles", static_cast<std::int64_t>(visible_triangles.size()));
+	core::ScopedTrace trace_extraction(trace_sink, "texture_extraction");
+
+	// Extract the triangles into the isomap. Neighbouring triangles share the pixels of their common edge,
+	// so they can't be written from different threads, but each tile of the isomap is only written by one
+	// thread, in the original order of the triangles. So the result is the same as with the serial loop.
+	const cv::Rect whole_isomap(0, 0, isomap.cols, isomap.rows);
+	if (thread_pool && thread_pool->get_num_threads() > 1)
+	{
+		std::vector<cv::Rect> bounding_boxes;
+		bounding_boxes.reserve(visible_triangles.size());
+		for (const auto& triangle : visible_triangles) {
+			bounding_boxes.push_back(triangle.bounding_box);
+		}
+		const int tile_size = 64;
+		detail::raster_tiled(bounding_boxes, isomap.cols, isomap.rows, tile_size, *thread_pool, [&](int triangle_index, const cv::Rect& tile) {
+			detail::extract_texture_triangle(visible_triangles[triangle_index], tile, image, mapping_type, isomap);
+		});
+	}
+	else
+	{
+		for (const auto& triangle : visible_triangles) {
+			detail::extract_texture_triangle(triangle, whole_isomap, image, mapping_type, isomap);
+		}
 	}
 
 	// Workaround for the black line in the isomap (see GitHub issue #4):
@@ -368,14 +519,16 @@ namespace v2 {
  * @param[in] view_model_matrix Todo.
  * @param[in] projection_matrix Todo.
  * @param[in] viewport Not needed at the moment. Might be, if we change clip_to_screen_space() to take a viewport.
- * @param[in] image The image to extract the texture from. Todo: Does it have to be 8UC3 or something, or does it not matter?
+ * @param[in] image The image to extract the texture from, CV_8UC3 or CV_8UC4. It is sampled in place, without a copy.
  * @param[in] compute_view_angle Unused at the moment.
  * @param[in] isomap_resolution The resolution of the generated isomap. Defaults to 512x512.
+ * @param[in] visibility_method Whether the vertex visibility is computed with exact ray casting or a depth buffer approximation.
  * @return The extracted texture as isomap (texture map).
  */
-cv::Mat extract_texture(core::Mesh mesh, glm::mat4x4 view_model_matrix, glm::mat4x4 projection_matrix,
+inline cv::Mat extract_texture(core::Mesh mesh, glm::mat4x4 view_model_matrix, glm::mat4x4 projection_matrix,
                         glm::vec4 /*viewport, not needed at the moment */, cv::Mat image,
-                        bool /* compute_view_angle, unused atm */, int isomap_resolution = 512)
+                        bool /* compute_view_angle, unused atm */, int isomap_resolution = 512,
+                        VisibilityMethod visibility_method = VisibilityMethod::RayCasting)
 {
     using detail::divide_by_w;
     using glm::vec2;
@@ -383,52 +536,15 @@ cv::Mat extract_texture(core::Mesh mesh, glm::mat4x4 view_model_matrix, glm::mat
     using glm::vec4;
     using std::vector;
     // actually we only need a rasteriser for this!
+    // No depth test, and the fragment shader needs the affine barycentric weights:
+    using ExtractionPolicy = RasterPolicy<false, false, false, true>;
     Rasterizer<ExtractionFragmentShader> extraction_rasterizer(isomap_resolution, isomap_resolution);
-    Texture image_to_extract_from_as_tex = create_mipmapped_texture(image, 1);
-    extraction_rasterizer.enable_depth_test = false;
-    extraction_rasterizer.extracting_tex = true;
+    const boost::optional<Texture> image_to_extract_from_as_tex = wrap_texture(image); // level 0 only, no copy
 
-    vector<bool> visibility_ray;
-    vector<vec4> rotated_vertices;
     // In perspective case... does the perspective projection matrix not change visibility? Do we not need to
     // apply it?
     // (If so, then we can change the two input matrices to this function to one (mvp_matrix)).
-    std::for_each(std::begin(mesh.vertices), std::end(mesh.vertices),
-                  [&rotated_vertices, &view_model_matrix](auto&& v) {
-                      rotated_vertices.push_back(view_model_matrix * v);
-                  });
-    // This code is duplicated from the edge-fitting. I think I can put this into a function in the library.
-    for (const auto& vertex : rotated_vertices)
-    {
-        bool visible = true;
-        // For every tri of the rotated mesh:
-        for (auto&& tri : mesh.tvi)
-        {
-            auto& v0 = rotated_vertices[tri[0]]; // const?
-            auto& v1 = rotated_vertices[tri[1]];
-            auto& v2 = rotated_vertices[tri[2]];
-
-            vec3 ray_origin(vertex);
-            vec3 ray_direction(0.0f, 0.0f, 1.0f); // we shoot the ray from the vertex towards the camera
-            auto intersect = fitting::ray_triangle_intersect(ray_origin, ray_direction, vec3(v0), vec3(v1),
-                                                             vec3(v2), false);
-            // first is bool intersect, second is the distance t
-            if (intersect.first == true)
-            {
-                // We've hit a triangle. Ray hit its own triangle. If it's behind the ray origin, ignore the
-                // intersection:
-                // Check if in front or behind?
-                if (intersect.second.get() <= 1e-4)
-                {
-                    continue; // the intersection is behind the vertex, we don't care about it
-                }
-                // Otherwise, we've hit a genuine triangle, and the vertex is not visible:
-                visible = false;
-                break;
-            }
-        }
-        visibility_ray.push_back(visible);
-    }
+    const vector<bool> visibility_ray = compute_vertex_visibility(mesh, view_model_matrix, visibility_method);
 
     vector<vec4> wnd_coords; // will contain [x_wnd, y_wnd, z_ndc, 1/w_clip]
     for (auto&& vtx : mesh.vertices)
@@ -480,11 +596,11 @@ cv::Mat extract_texture(core::Mesh mesh, glm::mat4x4 view_model_matrix, glm::mat
                     /* maybe 1 - ... ? */ wnd_coords[tvi[2]].y /
                         image
                             .rows /* wndcoords of the projected/rendered model triangle (in the input img). Normalised to 0,1. */)};
-            extraction_rasterizer.raster_triangle(pa, pb, pc, image_to_extract_from_as_tex);
+            extraction_rasterizer.raster_triangle_with<ExtractionPolicy>(pa, pb, pc, image_to_extract_from_as_tex);
         }
     }
 
-    return extraction_rasterizer.colorbuffer;
+    return extraction_rasterizer.framebuffer.get_colourbuffer();
 };
 
 } /* namespace v2 */
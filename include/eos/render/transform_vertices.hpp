@@ -0,0 +1,152 @@
+/*
+ * eos - A 3D Morphable Model fitting library written in modern C++11/14.
+ *
+ * File: include/eos/render/transform_vertices.hpp
+ *
+ * Copyright 2016 Patrik Huber
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#ifndef TRANSFORM_VERTICES_HPP_
+#define TRANSFORM_VERTICES_HPP_
+
+#include "eos/core/VertexView.hpp"
+#include "eos/render/detail/simd.hpp"
+
+#include "glm/mat4x4.hpp"
+#include "glm/vec4.hpp"
+
+#include <vector>
+#include <algorithm>
+
+namespace eos {
+	namespace render {
+		namespace detail {
+
+constexpr int transform_block_size = 8; // a multiple of every simd::width
+
+/**
+ * Transforms vertices with a 4x4 matrix, in blocks of transform_block_size vertices.
+ *
+ * The coordinates of a block are gathered into one array per coordinate (structure
+ * of arrays), and each row of the matrix is applied to the whole block at once, with
+ * SIMD instructions if they are available (see simd.hpp). The products are summed in
+ * the same order as in glm's matrix-vector product, so the results are the same as
+ * those of matrix * vertices[i].
+ *
+ * @param[in] vertices The vertices. Their w coordinate is 1.
+ * @param[in] num_vertices The number of vertices to transform.
+ * @param[in] vertex_index A function int(int i) that returns the index into \p vertices of the i-th vertex to transform.
+ * @param[in] matrix A 4x4 matrix.
+ * @param[in] write_block A function void(int first, int count, const float (&transformed)[4][transform_block_size]) that receives the transformed x, y, z and w coordinates of the vertices [first, first + count).
+ */
+template <typename VertexIndexFunction, typename WriteBlockFunction>
+void transform_vertices_in_blocks(const core::VertexView& vertices, int num_vertices, VertexIndexFunction vertex_index, const glm::mat4x4& matrix, WriteBlockFunction write_block)
+{
+	alignas(32) float coordinates[3][transform_block_size];
+	alignas(32) float transformed[4][transform_block_size];
+#if defined(EOS_RENDER_SIMD)
+	simd::Floats m[4][4]; // each element of the matrix in all lanes, m[column][row] like glm
+	for (int column = 0; column < 4; ++column) {
+		for (int row = 0; row < 4; ++row) {
+			m[column][row] = simd::set1(matrix[column][row]);
+		}
+	}
+#endif
+	for (int first = 0; first < num_vertices; first += transform_block_size)
+	{
+		const int count = std::min(transform_block_size, num_vertices - first);
+		for (int i = 0; i < count; ++i) {
+			const glm::vec4 v = vertices[vertex_index(first + i)];
+			coordinates[0][i] = v.x;
+			coordinates[1][i] = v.y;
+			coordinates[2][i] = v.z;
+		}
+		for (int i = count; i < transform_block_size; ++i) {
+			coordinates[0][i] = coordinates[1][i] = coordinates[2][i] = 0.0f; // the unused lanes of the last block
+		}
+#if defined(EOS_RENDER_SIMD)
+		for (int i = 0; i < transform_block_size; i += simd::width)
+		{
+			const simd::Floats x = simd::load(coordinates[0] + i);
+			const simd::Floats y = simd::load(coordinates[1] + i);
+			const simd::Floats z = simd::load(coordinates[2] + i);
+			for (int row = 0; row < 4; ++row) {
+				simd::store(transformed[row] + i, simd::add(simd::add(simd::mul(m[0][row], x), simd::mul(m[1][row], y)), simd::add(simd::mul(m[2][row], z), m[3][row])));
+			}
+		}
+#else
+		for (int row = 0; row < 4; ++row) {
+			for (int i = 0; i < count; ++i) {
+				transformed[row][i] = (matrix[0][row] * coordinates[0][i] + matrix[1][row] * coordinates[1][i]) + (matrix[2][row] * coordinates[2][i] + matrix[3][row]);
+			}
+		}
+#endif
+		write_block(first, count, transformed);
+	}
+};
+
+		} /* namespace detail */
+
+/**
+ * Transforms all vertices with a 4x4 matrix, e.g. a rotation or a model-view-projection
+ * matrix, and stores them in homogeneous coordinates. The result is the same as
+ * computing matrix * vertices[i] for each vertex, but the vertices are processed in
+ * blocks, with SIMD instructions if available.
+ *
+ * The vertices can be those of a core::Mesh or, through a core::VertexView, the
+ * packed [x_1 y_1 z_1 x_2 ...] shape vector of a model instance, without building a
+ * Mesh first.
+ *
+ * @param[in] vertices The vertices to transform. Their w coordinate is 1.
+ * @param[in] matrix A 4x4 matrix.
+ * @param[out] transformed The transformed vertices, in the same order. Resized if necessary.
+ */
+inline void transform_vertices(const core::VertexView& vertices, const glm::mat4x4& matrix, std::vector<glm::vec4>& transformed)
+{
+	transformed.resize(vertices.size());
+	detail::transform_vertices_in_blocks(vertices, vertices.size(), [](int i) { return i; }, matrix, [&transformed](int first, int count, const float (&block)[4][detail::transform_block_size]) {
+		for (int i = 0; i < count; ++i) {
+			transformed[first + i] = glm::vec4(block[0][i], block[1][i], block[2][i], block[3][i]);
+		}
+	});
+};
+
+/**
+ * Projects the given vertices to screen space, like glm::project(), and stores their
+ * x and y coordinates in two separate arrays. This is the batch version of the
+ * per-vertex projection that the contour and landmark correspondence searches need.
+ *
+ * @param[in] vertices The vertices of the mesh. Their w coordinate is 1.
+ * @param[in] vertex_indices The indices of the vertices to project.
+ * @param[in] matrix The projection times the model-view matrix.
+ * @param[in] viewport The viewport, as (x, y, width, height).
+ * @param[out] x The screen-space x coordinate of each vertex, vertex_indices.size() elements.
+ * @param[out] y The screen-space y coordinate of each vertex, vertex_indices.size() elements.
+ */
+inline void project_vertices(const core::VertexView& vertices, const std::vector<int>& vertex_indices, const glm::mat4x4& matrix, const glm::vec4& viewport, float* x, float* y)
+{
+	detail::transform_vertices_in_blocks(vertices, static_cast<int>(vertex_indices.size()), [&vertex_indices](int i) { return vertex_indices[i]; }, matrix, [&](int first, int count, const float (&block)[4][detail::transform_block_size]) {
+		for (int i = 0; i < count; ++i) {
+			x[first + i] = (block[0][i] / block[3][i] * 0.5f + 0.5f) * viewport[2] + viewport[0];
+			y[first + i] = (block[1][i] / block[3][i] * 0.5f + 0.5f) * viewport[3] + viewport[1];
+		}
+	});
+};
+
+	} /* namespace render */
+} /* namespace eos */
+
+#endif /* TRANSFORM_VERTICES_HPP_ */
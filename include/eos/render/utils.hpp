@@ -30,6 +30,12 @@
 #include "opencv2/core/core.hpp"
 #include "opencv2/imgproc/imgproc.hpp"
 
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cassert>
+
 namespace eos {
 	namespace render {
 
@@ -180,6 +186,8 @@ inline bool is_power_of_two(int x)
  * @brief Represents a texture for rendering.
  * 
  * Represents a texture and mipmap levels for use in the renderer.
+ * The levels are CV_8UC4 (BGRA) if the texture was created with create_mipmapped_texture(),
+ * or the CV_8UC3 or CV_8UC4 image itself if it was created with wrap_texture().
  * Todo: This whole class needs a major overhaul and documentation.
  */
 class Texture
@@ -191,60 +199,92 @@ public:
 //private:
 	//std::string filename;
 	unsigned int mipmaps_num;
+	cv::Mat storage; // The memory of all mip levels, if they are owned by the texture. The levels in mipmaps are ROIs of it and share its reference count.
 };
 
-// throws: ocv exc,  runtime_ex
+/**
+ * Creates a texture with the given number of mip levels from an image.
+ *
+ * The image can have any size. Each level is half the size of the previous one
+ * (rounded down, but at least 1), and is computed from it by area averaging.
+ * All levels are stored in one allocation, one after another, with each row
+ * padded to a multiple of 16 bytes.
+ *
+ * @param[in] image The image, CV_8UC3 (BGR) or CV_8UC4 (BGRA).
+ * @param[in] mipmapsNum The number of levels. 0 creates all of them, down to 1x1.
+ * @return The texture, with BGRA levels.
+ */
 inline Texture create_mipmapped_texture(cv::Mat image, unsigned int mipmapsNum = 0)
 {
 	assert(image.type() == CV_8UC3 || image.type() == CV_8UC4);
 
 	Texture texture;
 
-	texture.mipmaps_num = (mipmapsNum == 0 ? get_max_possible_mipmaps_num(image.cols, image.rows) : mipmapsNum);
-	/*if (mipmapsNum == 0)
-	{
-	uchar mmn = render::utils::MatrixUtils::getMaxPossibleMipmapsNum(image.cols, image.rows);
-	this->mipmapsNum = mmn;
-	} else
-	{
-	this->mipmapsNum = mipmapsNum;
-	}*/
+	const unsigned int max_mipmaps_num = get_max_possible_mipmaps_num(image.cols, image.rows);
+	texture.mipmaps_num = (mipmapsNum == 0 ? max_mipmaps_num : std::min(mipmapsNum, max_mipmaps_num));
 
-	if (texture.mipmaps_num > 1)
-	{
-		if (!is_power_of_two(image.cols) || !is_power_of_two(image.rows))
-		{
-			throw std::runtime_error("Error: Couldn't generate mipmaps, width or height not power of two.");
-		}
-	}
-	if (image.type() == CV_8UC3)
+	// Compute the size of each level, and allocate all of them at once:
+	std::vector<cv::Size> sizes;
+	std::vector<std::size_t> steps;
+	std::size_t total_bytes = 0;
+	int currWidth = image.cols;
+	int currHeight = image.rows;
+	for (unsigned int i = 0; i < texture.mipmaps_num; ++i)
 	{
-		image.convertTo(image, CV_8UC4); // Most often, the input img is CV_8UC3. Img is BGR. Add an alpha channel
-		cv::cvtColor(image, image, CV_BGR2BGRA);
+		const std::size_t step = (static_cast<std::size_t>(currWidth) * 4 + 15) & ~static_cast<std::size_t>(15);
+		sizes.push_back(cv::Size(currWidth, currHeight));
+		steps.push_back(step);
+		total_bytes += step * currHeight;
+		currWidth = std::max(currWidth >> 1, 1);
+		currHeight = std::max(currHeight >> 1, 1);
 	}
+	texture.storage = cv::Mat(1, static_cast<int>(total_bytes), CV_8UC1);
 
-	int currWidth = image.cols;
-	int currHeight = image.rows;
-	std::vector<cv::Mat> mipmaps;
-	for (int i = 0; i < texture.mipmaps_num; i++)
+	std::size_t offset = 0;
+	for (unsigned int i = 0; i < texture.mipmaps_num; ++i)
 	{
+		// An ROI of the storage, so that the level shares its reference count and stays valid when copied out of the texture:
+		const std::size_t level_bytes = steps[i] * sizes[i].height;
+		cv::Mat level = texture.storage.colRange(static_cast<int>(offset), static_cast<int>(offset + level_bytes)).reshape(4, sizes[i].height).colRange(0, sizes[i].width);
+		offset += level_bytes;
+		// The destinations have the right size and type already, so the functions below write into the storage:
 		if (i == 0) {
-			mipmaps.push_back(image);
+			if (image.type() == CV_8UC3) {
+				cv::cvtColor(image, level, cv::COLOR_BGR2BGRA); // Most often, the input img is CV_8UC3. Img is BGR. Add an alpha channel
+			}
+			else {
+				image.copyTo(level);
+			}
 		}
 		else {
-			cv::Mat currMipMap(currHeight, currWidth, CV_8UC4);
-			cv::resize(mipmaps[i - 1], currMipMap, currMipMap.size());
-			mipmaps.push_back(currMipMap);
+			cv::resize(texture.mipmaps[i - 1], level, level.size(), 0, 0, cv::INTER_AREA);
 		}
-
-		if (currWidth > 1)
-			currWidth >>= 1;
-		if (currHeight > 1)
-			currHeight >>= 1;
+		texture.mipmaps.push_back(level);
 	}
-	texture.mipmaps = mipmaps;
-	texture.widthLog = (uchar)(std::log(mipmaps[0].cols) / CV_LOG2 + 0.0001f); // std::epsilon or something? or why 0.0001f here?
-	texture.heightLog = (uchar)(std::log(mipmaps[0].rows) / CV_LOG2 + 0.0001f); // Changed std::logf to std::log because it doesnt compile in linux (gcc 4.8). CHECK THAT
+	texture.widthLog = (uchar)(std::log(texture.mipmaps[0].cols) / CV_LOG2 + 0.0001f); // std::epsilon or something? or why 0.0001f here?
+	texture.heightLog = (uchar)(std::log(texture.mipmaps[0].rows) / CV_LOG2 + 0.0001f); // Changed std::logf to std::log because it doesnt compile in linux (gcc 4.8). CHECK THAT
+	return texture;
+};
+
+/**
+ * Creates a texture with only one level, that refers to the memory of the
+ * given image instead of copying it. This is enough for texture extraction,
+ * which samples from level 0 only, e.g. from every frame of a video.
+ *
+ * The image must stay alive, and not be modified, while the texture is used.
+ *
+ * @param[in] image The image, CV_8UC3 (BGR) or CV_8UC4 (BGRA).
+ * @return A texture with the image as its only level.
+ */
+inline Texture wrap_texture(cv::Mat image)
+{
+	assert(image.type() == CV_8UC3 || image.type() == CV_8UC4);
+
+	Texture texture;
+	texture.mipmaps_num = 1;
+	texture.mipmaps.push_back(image);
+	texture.widthLog = (uchar)(std::log(image.cols) / CV_LOG2 + 0.0001f);
+	texture.heightLog = (uchar)(std::log(image.rows) / CV_LOG2 + 0.0001f);
 	return texture;
 };
 
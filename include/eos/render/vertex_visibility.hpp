@@ -0,0 +1,535 @@
+/*
+ * eos - A 3D Morphable Model fitting library written in modern C++11/14.
+ *
+ * File: include/eos/render/vertex_visibility.hpp
+ *
+ * Copyright 2016, 2017 Patrik Huber
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#ifndef VERTEXVISIBILITY_HPP_
+#define VERTEXVISIBILITY_HPP_
+
+#include "eos/core/Mesh.hpp"
+#include "eos/render/detail/render_detail.hpp"
+#include "eos/render/detail/Vertex.hpp"
+#include "eos/render/Rasterizer.hpp"
+#include "eos/render/FragmentShader.hpp"
+
+#include "glm/common.hpp"
+#include "glm/geometric.hpp"
+#include "glm/vec3.hpp"
+#include "glm/vec4.hpp"
+#include "glm/mat4x4.hpp"
+
+#include "opencv2/core/core.hpp"
+
+#include "boost/optional.hpp"
+
+#include <array>
+#include <vector>
+#include <cmath>
+#include <limits>
+#include <utility>
+#include <algorithm>
+
+namespace eos {
+	namespace render {
+
+/**
+ * The methods that can be used to determine whether a vertex is self-occluded.
+ *
+ * RayCasting is exact (up to floating point precision). DepthBuffer rasterises
+ * the mesh once into a low-resolution depth buffer and compares each vertex'
+ * depth against it - it's an approximation, but considerably cheaper for
+ * large numbers of vertices.
+ */
+enum class VisibilityMethod {
+	RayCasting,
+	DepthBuffer
+};
+
+/**
+ * @brief Computes the intersection of the given ray with the given triangle.
+ *
+ * Uses the M�ller-Trumbore algorithm algorithm "Fast Minimum Storage
+ * Ray/Triangle Intersection". Independent implementation, inspired by:
+ * http://www.scratchapixel.com/lessons/3d-basic-rendering/ray-tracing-rendering-a-triangle/moller-trumbore-ray-triangle-intersection
+ * The default eps (1e-6f) is from the paper.
+ * When culling is on, rays intersecting triangles from the back will be discarded -
+ * otherwise, the triangles normal direction w.r.t. the ray direction is just ignored.
+ *
+ * Note: The use of optional might turn out as a performance problem, as this
+ * function is called loads of time - how costly is it to construct a boost::none optional?
+ *
+ * @param[in] ray_origin Ray origin.
+ * @param[in] ray_direction Ray direction.
+ * @param[in] v0 First vertex of a triangle.
+ * @param[in] v1 Second vertex of a triangle.
+ * @param[in] v2 Third vertex of a triangle.
+ * @param[in] enable_backculling When culling is on, rays intersecting triangles from the back will be discarded.
+ * @return Whether the ray intersects the triangle, and if yes, including the distance.
+ */
+inline std::pair<bool, boost::optional<float>> ray_triangle_intersect(const glm::vec3& ray_origin, const glm::vec3& ray_direction, const glm::vec3& v0, const glm::vec3& v1, const glm::vec3& v2, bool enable_backculling)
+{
+	using glm::vec3;
+	const float epsilon = 1e-6f;
+
+	const vec3 v0v1 = v1 - v0;
+	const vec3 v0v2 = v2 - v0;
+
+	const vec3 pvec = glm::cross(ray_direction, v0v2);
+
+	const float det = glm::dot(v0v1, pvec);
+	if (enable_backculling)
+	{
+		// If det is negative, the triangle is back-facing.
+		// If det is close to 0, the ray misses the triangle.
+		if (det < epsilon)
+			return { false, boost::none };
+	}
+	else {
+		// If det is close to 0, the ray and triangle are parallel.
+		if (std::abs(det) < epsilon)
+			return { false, boost::none };
+	}
+	const float inv_det = 1 / det;
+
+	const vec3 tvec = ray_origin - v0;
+	const auto u = glm::dot(tvec, pvec) * inv_det;
+	if (u < 0 || u > 1)
+		return { false, boost::none };
+
+	const vec3 qvec = glm::cross(tvec, v0v1);
+	const auto v = glm::dot(ray_direction, qvec) * inv_det;
+	if (v < 0 || u + v > 1)
+		return { false, boost::none };
+
+	const auto t = glm::dot(v0v2, qvec) * inv_det;
+
+	return { true, t };
+};
+
+/**
+ * @brief A uniform grid over the x-y footprint of a posed (e.g. rotated) mesh,
+ * used to answer self-occlusion queries along the viewing direction.
+ *
+ * All of our visibility tests shoot a ray from a vertex towards the camera,
+ * i.e. along +z in the posed (camera) space. Such a ray can only hit triangles
+ * whose x-y bounding box contains the ray origin, so we bin every triangle
+ * into the grid cells its x-y bounding box overlaps, and then only test the
+ * triangles of the single cell the query point falls into. Building the grid
+ * is O(T), and a query touches only a handful of triangles instead of all T.
+ *
+ * The grid has to be rebuilt whenever the pose or the shape changes. build()
+ * can be called repeatedly on the same object, in which case the internal
+ * buffers are reused.
+ *
+ * The results are the same as testing every triangle with ray_triangle_intersect()
+ * (intersections closer than 1e-4 to the ray origin, e.g. the vertex' own
+ * triangles, are ignored).
+ */
+class VertexVisibilityGrid
+{
+public:
+	VertexVisibilityGrid() = default;
+
+	/**
+	 * @brief Builds the grid over the given, already posed vertices.
+	 *
+	 * @param[in] vertices The mesh vertices, transformed into a space where the camera looks along -z (e.g. rotated or model-view transformed).
+	 * @param[in] triangles The triangle list (e.g. Mesh::tvi).
+	 * @param[in] cells_per_dimension Number of cells in x and y. If 0, a value is chosen so that there's about one triangle per cell.
+	 */
+	VertexVisibilityGrid(const std::vector<glm::vec4>& vertices, const std::vector<std::array<int, 3>>& triangles, int cells_per_dimension = 0)
+	{
+		build(vertices, triangles, cells_per_dimension);
+	};
+
+	/**
+	 * @brief (Re-)builds the grid over the given, already posed vertices.
+	 *
+	 * See the constructor for a description of the parameters.
+	 */
+	void build(const std::vector<glm::vec4>& vertices, const std::vector<std::array<int, 3>>& triangles, int cells_per_dimension = 0)
+	{
+		this->vertices.resize(vertices.size());
+		for (std::size_t i = 0; i < vertices.size(); ++i) {
+			this->vertices[i] = glm::vec3(vertices[i]);
+		}
+		this->triangles = triangles;
+
+		const int num_triangles = static_cast<int>(triangles.size());
+		if (cells_per_dimension <= 0) {
+			cells_per_dimension = std::max(1, static_cast<int>(std::ceil(std::sqrt(static_cast<float>(num_triangles)))));
+		}
+		num_cells_x = cells_per_dimension;
+		num_cells_y = cells_per_dimension;
+
+		// Bounding box of the footprint:
+		min_x = std::numeric_limits<float>::max();
+		min_y = std::numeric_limits<float>::max();
+		float max_x = std::numeric_limits<float>::lowest();
+		float max_y = std::numeric_limits<float>::lowest();
+		for (const auto& v : this->vertices) {
+			min_x = std::min(min_x, v.x);
+			min_y = std::min(min_y, v.y);
+			max_x = std::max(max_x, v.x);
+			max_y = std::max(max_y, v.y);
+		}
+		// Guard against a degenerate (zero-width) extent:
+		const float extent_x = std::max(max_x - min_x, 1e-6f);
+		const float extent_y = std::max(max_y - min_y, 1e-6f);
+		one_over_cell_width = num_cells_x / extent_x;
+		one_over_cell_height = num_cells_y / extent_y;
+
+		// Count the triangles per cell, then fill them in (a compressed row storage of the cell contents):
+		triangle_max_z.resize(num_triangles);
+		cell_offsets.assign(num_cells_x * num_cells_y + 1, 0);
+		std::vector<std::array<int, 4>> triangle_cell_ranges(num_triangles); // [x_begin, x_end, y_begin, y_end], inclusive
+		for (int t = 0; t < num_triangles; ++t)
+		{
+			const auto& v0 = this->vertices[triangles[t][0]];
+			const auto& v1 = this->vertices[triangles[t][1]];
+			const auto& v2 = this->vertices[triangles[t][2]];
+			triangle_max_z[t] = std::max(v0.z, std::max(v1.z, v2.z));
+			auto& range = triangle_cell_ranges[t];
+			range[0] = cell_index_x(std::min(v0.x, std::min(v1.x, v2.x)));
+			range[1] = cell_index_x(std::max(v0.x, std::max(v1.x, v2.x)));
+			range[2] = cell_index_y(std::min(v0.y, std::min(v1.y, v2.y)));
+			range[3] = cell_index_y(std::max(v0.y, std::max(v1.y, v2.y)));
+			for (int y = range[2]; y <= range[3]; ++y) {
+				for (int x = range[0]; x <= range[1]; ++x) {
+					++cell_offsets[y * num_cells_x + x + 1];
+				}
+			}
+		}
+		for (std::size_t c = 1; c < cell_offsets.size(); ++c) {
+			cell_offsets[c] += cell_offsets[c - 1];
+		}
+		cell_triangles.resize(cell_offsets.back());
+		std::vector<int> fill_position(begin(cell_offsets), end(cell_offsets) - 1);
+		for (int t = 0; t < num_triangles; ++t)
+		{
+			const auto& range = triangle_cell_ranges[t];
+			for (int y = range[2]; y <= range[3]; ++y) {
+				for (int x = range[0]; x <= range[1]; ++x) {
+					cell_triangles[fill_position[y * num_cells_x + x]++] = t;
+				}
+			}
+		}
+	};
+
+	/**
+	 * @brief Tests whether the given point is occluded by any triangle of the mesh,
+	 * i.e. whether a ray from the point towards the camera (+z) hits a triangle.
+	 *
+	 * @param[in] point A point in the same (posed) space as the vertices the grid was built from.
+	 * @return Whether the point is occluded.
+	 */
+	bool is_occluded(const glm::vec3& point) const
+	{
+		if (cell_offsets.empty()) {
+			return false;
+		}
+		const int x = static_cast<int>(std::floor((point.x - min_x) * one_over_cell_width));
+		const int y = static_cast<int>(std::floor((point.y - min_y) * one_over_cell_height));
+		if (x < 0 || x > num_cells_x || y < 0 || y > num_cells_y) {
+			return false; // outside the footprint of the mesh, nothing can occlude the point
+		}
+		const int cell = std::min(y, num_cells_y - 1) * num_cells_x + std::min(x, num_cells_x - 1);
+		const glm::vec3 ray_direction(0.0f, 0.0f, 1.0f); // we shoot the ray from the vertex towards the camera
+		for (int i = cell_offsets[cell]; i < cell_offsets[cell + 1]; ++i)
+		{
+			const int t = cell_triangles[i];
+			// A triangle that lies entirely behind the point can't be hit in front of it:
+			if (triangle_max_z[t] - point.z <= 1e-4f) {
+				continue;
+			}
+			const auto& tri = triangles[t];
+			const auto intersect = ray_triangle_intersect(point, ray_direction, vertices[tri[0]], vertices[tri[1]], vertices[tri[2]], false);
+			// first is bool intersect, second is the distance t. Intersections behind (or at) the ray origin are ignored:
+			if (intersect.first == true && intersect.second.get() > 1e-4f)
+			{
+				return true;
+			}
+		}
+		return false;
+	};
+
+	/**
+	 * @brief Returns whether the vertex with the given index is visible, i.e. not self-occluded.
+	 *
+	 * @param[in] vertex_id Index of a vertex the grid was built from.
+	 * @return Whether the vertex is visible.
+	 */
+	bool is_vertex_visible(int vertex_id) const
+	{
+		return !is_occluded(vertices[vertex_id]);
+	};
+
+	/**
+	 * @brief Batched visibility query for a subset of the vertices.
+	 *
+	 * @param[in] vertex_ids Indices of the vertices to test.
+	 * @return A vector of the same size as \p vertex_ids, with true for each visible vertex.
+	 */
+	std::vector<bool> compute_visibility(const std::vector<int>& vertex_ids) const
+	{
+		std::vector<bool> visibility(vertex_ids.size());
+		for (std::size_t i = 0; i < vertex_ids.size(); ++i) {
+			visibility[i] = is_vertex_visible(vertex_ids[i]);
+		}
+		return visibility;
+	};
+
+	/**
+	 * @brief Batched visibility query for all the vertices the grid was built from.
+	 *
+	 * @return A vector with one entry per vertex, true if the vertex is visible.
+	 */
+	std::vector<bool> compute_visibility() const
+	{
+		std::vector<bool> visibility(vertices.size());
+		for (std::size_t i = 0; i < vertices.size(); ++i) {
+			visibility[i] = !is_occluded(vertices[i]);
+		}
+		return visibility;
+	};
+
+private:
+	std::vector<glm::vec3> vertices; // the posed vertices
+	std::vector<std::array<int, 3>> triangles;
+	std::vector<float> triangle_max_z; // largest z of each triangle, for early rejection
+	std::vector<int> cell_offsets; // num_cells + 1 entries, the triangles of cell c are cell_triangles[cell_offsets[c]..cell_offsets[c+1])
+	std::vector<int> cell_triangles;
+	int num_cells_x = 0;
+	int num_cells_y = 0;
+	float min_x = 0.0f;
+	float min_y = 0.0f;
+	float one_over_cell_width = 0.0f;
+	float one_over_cell_height = 0.0f;
+
+	int cell_index_x(float x) const
+	{
+		return glm::clamp(static_cast<int>(std::floor((x - min_x) * one_over_cell_width)), 0, num_cells_x - 1);
+	};
+
+	int cell_index_y(float y) const
+	{
+		return glm::clamp(static_cast<int>(std::floor((y - min_y) * one_over_cell_height)), 0, num_cells_y - 1);
+	};
+};
+
+/**
+ * @brief Approximate self-occlusion queries using a z-buffer of the posed mesh.
+ *
+ * The posed mesh is rendered once, with an orthographic projection along z, into a
+ * depth buffer of size \c resolution x \c resolution that covers the x-y footprint
+ * of the mesh. A point counts as occluded if the depth buffer at its location holds
+ * a surface that is more than \c depth_tolerance in front of it.
+ *
+ * This has the same interface as VertexVisibilityGrid, so the two can be used
+ * interchangeably. Since it's an approximation, results can differ from the exact
+ * ray casting for vertices very close to the occluding contour. The tolerance is
+ * given as a fraction of the depth (z) extent of the mesh, which makes it independent
+ * of the units of the mesh. It should be increased if the resolution is decreased,
+ * as a single pixel then covers more of the (possibly steep) surface.
+ */
+class VertexVisibilityDepthBuffer
+{
+public:
+	VertexVisibilityDepthBuffer() = default;
+
+	/**
+	 * @brief Renders the depth buffer of the given, already posed vertices.
+	 *
+	 * @param[in] vertices The mesh vertices, transformed into a space where the camera looks along -z (e.g. rotated or model-view transformed).
+	 * @param[in] triangles The triangle list (e.g. Mesh::tvi).
+	 * @param[in] resolution Width and height of the depth buffer, in pixels.
+	 * @param[in] depth_tolerance Tolerance of the depth comparison, as a fraction of the depth extent of the mesh.
+	 */
+	VertexVisibilityDepthBuffer(const std::vector<glm::vec4>& vertices, const std::vector<std::array<int, 3>>& triangles, int resolution = 256, float depth_tolerance = 0.01f)
+	{
+		build(vertices, triangles, resolution, depth_tolerance);
+	};
+
+	/**
+	 * @brief (Re-)renders the depth buffer of the given, already posed vertices.
+	 *
+	 * See the constructor for a description of the parameters.
+	 */
+	void build(const std::vector<glm::vec4>& vertices, const std::vector<std::array<int, 3>>& triangles, int resolution = 256, float depth_tolerance = 0.01f)
+	{
+		this->vertices.resize(vertices.size());
+		for (std::size_t i = 0; i < vertices.size(); ++i) {
+			this->vertices[i] = glm::vec3(vertices[i]);
+		}
+
+		min_x = std::numeric_limits<float>::max();
+		min_y = std::numeric_limits<float>::max();
+		float max_x = std::numeric_limits<float>::lowest();
+		float max_y = std::numeric_limits<float>::lowest();
+		float min_z = std::numeric_limits<float>::max();
+		float max_z = std::numeric_limits<float>::lowest();
+		for (const auto& v : this->vertices) {
+			min_x = std::min(min_x, v.x);
+			min_y = std::min(min_y, v.y);
+			min_z = std::min(min_z, v.z);
+			max_x = std::max(max_x, v.x);
+			max_y = std::max(max_y, v.y);
+			max_z = std::max(max_z, v.z);
+		}
+		// One uniform scale for x and y, so that the pixels are square:
+		const float extent = std::max(std::max(max_x - min_x, max_y - min_y), 1e-6f);
+		pixels_per_unit = (resolution - 1) / extent;
+		absolute_depth_tolerance = depth_tolerance * (max_z - min_z);
+
+		// The rasteriser keeps the fragment with the smallest depth, and the camera looks
+		// along -z, so the depth of a point is -z:
+		// No far clipping, our depth values are not in NDC:
+		using DepthPolicy = RasterPolicy<true, false, true, false>;
+		Rasterizer<VertexColoringFragmentShader> depth_rasterizer(resolution, resolution);
+		for (const auto& tri : triangles)
+		{
+			const auto to_raster_vertex = [this](int vertex_id) {
+				const auto& v = this->vertices[vertex_id];
+				return detail::Vertex<float>{ glm::vec4((v.x - min_x) * pixels_per_unit, (v.y - min_y) * pixels_per_unit, -v.z, 1.0f), glm::vec3(0.0f), glm::vec2(0.0f) };
+			};
+			depth_rasterizer.raster_triangle_with<DepthPolicy>(to_raster_vertex(tri[0]), to_raster_vertex(tri[1]), to_raster_vertex(tri[2]), boost::none);
+		}
+		depthbuffer = depth_rasterizer.framebuffer.get_depthbuffer();
+	};
+
+	/**
+	 * @brief Tests whether the given point is occluded, i.e. whether there is a surface
+	 * in the depth buffer at the point's location that is in front of it.
+	 *
+	 * @param[in] point A point in the same (posed) space as the vertices the depth buffer was built from.
+	 * @return Whether the point is occluded.
+	 */
+	bool is_occluded(const glm::vec3& point) const
+	{
+		if (depthbuffer.empty()) {
+			return false;
+		}
+		const int x = static_cast<int>(std::floor((point.x - min_x) * pixels_per_unit));
+		const int y = static_cast<int>(std::floor((point.y - min_y) * pixels_per_unit));
+		if (x < 0 || x >= depthbuffer.cols || y < 0 || y >= depthbuffer.rows) {
+			return false;
+		}
+		return depthbuffer.ptr<float>(y)[x] < -point.z - absolute_depth_tolerance;
+	};
+
+	/**
+	 * @brief Returns whether the vertex with the given index is visible, i.e. not self-occluded.
+	 *
+	 * @param[in] vertex_id Index of a vertex the depth buffer was built from.
+	 * @return Whether the vertex is visible.
+	 */
+	bool is_vertex_visible(int vertex_id) const
+	{
+		return !is_occluded(vertices[vertex_id]);
+	};
+
+	/**
+	 * @brief Batched visibility query for a subset of the vertices.
+	 *
+	 * @param[in] vertex_ids Indices of the vertices to test.
+	 * @return A vector of the same size as \p vertex_ids, with true for each visible vertex.
+	 */
+	std::vector<bool> compute_visibility(const std::vector<int>& vertex_ids) const
+	{
+		std::vector<bool> visibility(vertex_ids.size());
+		for (std::size_t i = 0; i < vertex_ids.size(); ++i) {
+			visibility[i] = is_vertex_visible(vertex_ids[i]);
+		}
+		return visibility;
+	};
+
+	/**
+	 * @brief Batched visibility query for all the vertices the depth buffer was built from.
+	 *
+	 * @return A vector with one entry per vertex, true if the vertex is visible.
+	 */
+	std::vector<bool> compute_visibility() const
+	{
+		std::vector<bool> visibility(vertices.size());
+		for (std::size_t i = 0; i < vertices.size(); ++i) {
+			visibility[i] = !is_occluded(vertices[i]);
+		}
+		return visibility;
+	};
+
+private:
+	std::vector<glm::vec3> vertices; // the posed vertices
+	cv::Mat depthbuffer; // CV_32FC1, contains -z of the closest surface, or max() where there's no surface
+	float min_x = 0.0f;
+	float min_y = 0.0f;
+	float pixels_per_unit = 0.0f;
+	float absolute_depth_tolerance = 0.0f;
+};
+
+/**
+ * @brief Computes which of the given vertices are visible (not self-occluded).
+ *
+ * @param[in] posed_vertices The mesh vertices, transformed into a space where the camera looks along -z.
+ * @param[in] triangles The triangle list (e.g. Mesh::tvi).
+ * @param[in] vertex_ids Indices of the vertices to test.
+ * @param[in] method Whether to use exact ray casting or the depth buffer approximation.
+ * @return A vector of the same size as \p vertex_ids, with true for each visible vertex.
+ */
+inline std::vector<bool> compute_vertex_visibility(const std::vector<glm::vec4>& posed_vertices, const std::vector<std::array<int, 3>>& triangles, const std::vector<int>& vertex_ids, VisibilityMethod method = VisibilityMethod::RayCasting)
+{
+	if (method == VisibilityMethod::DepthBuffer)
+	{
+		return VertexVisibilityDepthBuffer(posed_vertices, triangles).compute_visibility(vertex_ids);
+	}
+	return VertexVisibilityGrid(posed_vertices, triangles).compute_visibility(vertex_ids);
+};
+
+/**
+ * @brief Computes which vertices of the given mesh are visible (not self-occluded)
+ * under the given pose.
+ *
+ * The mesh is transformed with \p view_model_matrix (e.g. a rotation matrix R, or the
+ * full model-view matrix) and a ray is cast from each vertex towards the camera.
+ * Uses a VertexVisibilityGrid, so it's much faster than testing each vertex against
+ * all triangles. Alternatively, the visibility can be approximated with a depth buffer
+ * (VertexVisibilityDepthBuffer).
+ *
+ * @param[in] mesh The mesh.
+ * @param[in] view_model_matrix The pose under which the visibility is computed.
+ * @param[in] method Whether to use exact ray casting or the depth buffer approximation.
+ * @return A vector with one entry per vertex, true if the vertex is visible.
+ */
+inline std::vector<bool> compute_vertex_visibility(const core::Mesh& mesh, const glm::mat4x4& view_model_matrix, VisibilityMethod method = VisibilityMethod::RayCasting)
+{
+	std::vector<glm::vec4> posed_vertices;
+	posed_vertices.reserve(mesh.vertices.size());
+	for (const auto& v : mesh.vertices) {
+		posed_vertices.push_back(view_model_matrix * v);
+	}
+	if (method == VisibilityMethod::DepthBuffer)
+	{
+		return VertexVisibilityDepthBuffer(posed_vertices, mesh.tvi).compute_visibility();
+	}
+	return VertexVisibilityGrid(posed_vertices, mesh.tvi).compute_visibility();
+};
+
+	} /* namespace render */
+} /* namespace eos */
+
+#endif /* VERTEXVISIBILITY_HPP_ */
@@ -22,12 +22,26 @@
 #ifndef KEYFRAME_HPP_
 #define KEYFRAME_HPP_
 
+#include "eos/core/ThreadPool.hpp"
 #include "eos/fitting/FittingResult.hpp"
 #include "eos/fitting/RenderingParameters.hpp"
 #include "eos/morphablemodel/Blendshape.hpp"
 #include "eos/morphablemodel/MorphableModel.hpp"
+#include "eos/render/IsomapPlan.hpp"
+#include "eos/render/texture_extraction.hpp"
+
+#include "Eigen/Core"
 
 #include "opencv2/core/core.hpp"
+#include "opencv2/imgproc/imgproc.hpp"
+
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <iterator>
+#include <cstdint>
+#include <cstddef>
+#include <cassert>
 
 namespace eos {
 namespace video {
@@ -36,12 +50,20 @@ namespace video {
  * @brief A keyframe selected by the fitting algorithm.
  *
  * Contains the original frame, all necessary fitting parameters, and a score.
+ *
+ * The frame can also be a crop of the original image (e.g. of the face region, see
+ * KeyframeStore). Then \c image_size is the size of the original image and
+ * \c roi_offset the position of the crop in it, so that the fitting result, which
+ * refers to the original image, can still be used with the crop.
  */
 struct Keyframe
 {
     float score; // = 0.0f?
     cv::Mat frame;
     fitting::FittingResult fitting_result;
+    std::size_t id = 0; ///< Assigned by PoseBinningKeyframeSelector::try_add(), unique within a selector.
+    cv::Size image_size; ///< Size of the original image, if \c frame is a crop of it. Empty if \c frame is the whole image.
+    cv::Point roi_offset; ///< Top-left corner of \c frame in the original image, if \c frame is a crop.
 };
 
 /**
@@ -80,7 +102,7 @@ public:
             return false;
         }
         // Add the keyframe:
-        bins[idx].push_back(video::Keyframe{frame_score, image, fitting_result});
+        bins[idx].push_back(video::Keyframe{frame_score, image, fitting_result, next_id++});
         if (bins[idx].size() > frames_per_bin)
         {
             // need to remove the lowest one:
@@ -110,6 +132,7 @@ private:
     std::vector<BinContent> bins;
     const int num_yaw_bins = 9;
     int frames_per_bin;
+    std::size_t next_id = 0; // the id of the next keyframe that is added
 
     // Converts a given yaw angle to an index in the internal bins vector.
     // Assumes 9 bins and 20 intervals.
@@ -136,94 +159,249 @@ private:
 };
 
 /**
- * @brief Extracts texture from each keyframe and merges them using a weighted mean.
+ * @brief Merges the textures of a changing set of keyframes with a weighted mean,
+ * incrementally.
  *
- * Uses the view angle as weighting.
+ * The texture of each keyframe is extracted once, when it is added, and is added to
+ * running sums of the weighted colours and of the weights. Removing a keyframe
+ * subtracts its contribution again, so the merged texture can be queried at any time
+ * with O(isomap) work, without extracting the textures of all keyframes again.
  *
- * Note 1: Would be nice to eventually return a 4-channel texture map, with a sensible weight in the 4th
- * channel (i.e. the max of all weights for a given pixel).
+ * The weight of each pixel is the view angle, as encoded in the alpha channel by
+ * render::extract_texture(). The sums are integers, so removing a keyframe restores
+ * the sums exactly, no matter how many keyframes were added and removed before.
  *
- * Note 2: On each call to this, it generates all isomaps. This is quite time-consuming (and we could compute
- * the weighted mean incrementally). But caching them is not trivial (maybe with a hashing or comparing the
- * cv::Mat frame data* member?).
- * On the other hand, for the more complex merging techniques (super-res, involving ceres, or a median
- * cost-func?), there might be no caching possible anyway and we will recompute the merged isomap from scratch
- * each time anyway, but not by first extracting all isomaps - instead we would just do a lookup of the
- * required pixel value(s) in the original image.
+ * Use update() with the keyframes of a PoseBinningKeyframeSelector after each call to
+ * its try_add(): It adds the new keyframes and removes the evicted ones.
+ *
+ * Note: Would be nice to eventually return a 4-channel texture map, with a sensible weight in the 4th
+ * channel (i.e. the max of all weights for a given pixel).
+ * Also, we should use the keyframe's score for the weighting as well, plus the area of the source triangle.
+ */
+class KeyframeMerger
+{
+public:
+    /**
+     * Creates a merger for keyframes fitted with the given model and blendshapes.
+     * The model is referenced, not copied, and must outlive the merger.
+     *
+     * @param[in] morphable_model The Morphable Model with which the keyframes are fitted. Needs texture coordinates.
+     * @param[in] blendshapes The blendshapes with which the keyframes are fitted.
+     * @param[in] isomap_resolution The resolution of the extracted and merged isomaps.
+     * @param[in] thread_pool An optional thread pool to extract the textures on.
+     */
+    KeyframeMerger(const morphablemodel::MorphableModel& morphable_model,
+                   const std::vector<morphablemodel::Blendshape>& blendshapes, int isomap_resolution = 1024,
+                   core::ThreadPool* thread_pool = nullptr)
+        : morphable_model(morphable_model), thread_pool(thread_pool)
+    {
+        isomap_plan = render::create_isomap_plan(morphable_model.get_mean(), isomap_resolution);
+        if (!blendshapes.empty())
+        {
+            blendshapes_as_basis = morphablemodel::to_matrix(blendshapes);
+        }
+        const int num_pixels = isomap_resolution * isomap_resolution;
+        weighted_colour_sums.assign(3 * num_pixels, 0);
+        weight_sums.assign(num_pixels, 0);
+    };
+
+    /**
+     * Extracts the texture of the given keyframe and adds it to the merged texture.
+     * Does nothing if a keyframe with the same id has already been added.
+     *
+     * @param[in] keyframe The keyframe to add.
+     */
+    void add(const Keyframe& keyframe)
+    {
+        add(keyframe, keyframe.id);
+    };
+
+    /**
+     * Extracts the texture of the given keyframe and adds it to the merged texture,
+     * under the given key instead of the keyframe's id. Use this for keyframes whose
+     * ids have not been assigned, e.g. by keying them by their position in a list.
+     * Does nothing if a keyframe with the same key has already been added.
+     *
+     * @param[in] keyframe The keyframe to add.
+     * @param[in] key The key under which the keyframe can be removed again with remove().
+     */
+    void add(const Keyframe& keyframe, std::size_t key)
+    {
+        if (isomaps.count(key) > 0)
+        {
+            return;
+        }
+        const cv::Mat isomap = extract_isomap(keyframe);
+        accumulate(isomap, +1);
+        isomaps.emplace(key, isomap);
+    };
+
+    /**
+     * Removes the contribution of the keyframe with the given id from the merged texture.
+     * Does nothing if there is no such keyframe.
+     *
+     * @param[in] keyframe_id The id of a keyframe that was added.
+     */
+    void remove(std::size_t keyframe_id)
+    {
+        const auto isomap = isomaps.find(keyframe_id);
+        if (isomap == std::end(isomaps))
+        {
+            return;
+        }
+        accumulate(isomap->second, -1);
+        isomaps.erase(isomap);
+    };
+
+    /**
+     * Makes the merged texture consist of exactly the given keyframes: Adds the ones
+     * that haven't been added yet, and removes the ones that are not in \p keyframes
+     * anymore, e.g. because a PoseBinningKeyframeSelector replaced them.
+     *
+     * @param[in] keyframes The current keyframes, e.g. from PoseBinningKeyframeSelector::get_keyframes().
+     */
+    void update(const std::vector<Keyframe>& keyframes)
+    {
+        std::vector<std::size_t> removed_ids;
+        for (const auto& isomap : isomaps)
+        {
+            const bool is_current = std::any_of(std::begin(keyframes), std::end(keyframes),
+                                                [&isomap](const Keyframe& k) { return k.id == isomap.first; });
+            if (!is_current)
+            {
+                removed_ids.push_back(isomap.first);
+            }
+        }
+        for (const auto id : removed_ids)
+        {
+            remove(id);
+        }
+        for (const auto& keyframe : keyframes)
+        {
+            add(keyframe);
+        }
+    };
+
+    /**
+     * Returns the weighted mean of the textures of all keyframes that are currently added.
+     * Pixels that are not visible in any keyframe are black.
+     *
+     * @return Merged texture map (isomap), 3-channel uchar.
+     */
+    cv::Mat get_merged_isomap() const
+    {
+        const int resolution = isomap_plan.resolution;
+        cv::Mat merged_isomap(resolution, resolution, CV_8UC3);
+        for (int y = 0; y < resolution; ++y)
+        {
+            std::uint8_t* const row = merged_isomap.ptr<std::uint8_t>(y);
+            for (int x = 0; x < resolution; ++x)
+            {
+                const int pixel = y * resolution + x;
+                const std::int32_t weight = weight_sums[pixel];
+                for (int c = 0; c < 3; ++c)
+                {
+                    // The weighted mean, rounded to the nearest integer, is in [0, 255]:
+                    row[3 * x + c] = weight > 0 ? static_cast<std::uint8_t>(
+                                                      (weighted_colour_sums[3 * pixel + c] + weight / 2) / weight)
+                                                : 0;
+                }
+            }
+        }
+        return merged_isomap;
+    };
+
+    /**
+     * Returns the number of keyframes that are currently merged.
+     *
+     * @return The number of keyframes.
+     */
+    std::size_t get_num_keyframes() const
+    {
+        return isomaps.size();
+    };
+
+private:
+    const morphablemodel::MorphableModel& morphable_model;
+    core::ThreadPool* thread_pool;
+    Eigen::MatrixXf blendshapes_as_basis; // see morphablemodel::to_matrix()
+    render::IsomapPlan isomap_plan; // the texture coordinates don't change between keyframes
+    std::unordered_map<std::size_t, cv::Mat> isomaps; // the extracted isomap of each added keyframe, by id
+    std::vector<std::int32_t> weighted_colour_sums; // sum of colour * weight per pixel and channel (BGR)
+    std::vector<std::int32_t> weight_sums; // sum of the weights (view angles, [0, 255]) per pixel
+
+    cv::Mat extract_isomap(const Keyframe& keyframe) const
+    {
+        const auto& result = keyframe.fitting_result;
+        Eigen::VectorXf shape = morphable_model.get_shape_model().draw_sample(result.pca_shape_coefficients);
+        if (blendshapes_as_basis.size() > 0 && !result.blendshape_coefficients.empty())
+        {
+            shape += blendshapes_as_basis *
+                     Eigen::Map<const Eigen::VectorXf>(result.blendshape_coefficients.data(),
+                                                       result.blendshape_coefficients.size());
+        }
+        const auto mesh = morphablemodel::sample_to_mesh(shape, Eigen::VectorXf(),
+                                                         morphable_model.get_shape_model().get_triangle_list(),
+                                                         {}, morphable_model.get_texture_coordinates());
+        // The camera refers to the original image. If the frame is a crop, shift it to the crop:
+        const cv::Size image_size = keyframe.image_size.area() > 0 ? keyframe.image_size : keyframe.frame.size();
+        cv::Mat affine_camera_matrix = fitting::get_3x4_affine_camera_matrix(
+            result.rendering_parameters, image_size.width, image_size.height);
+        affine_camera_matrix.at<float>(0, 3) -= keyframe.roi_offset.x;
+        affine_camera_matrix.at<float>(1, 3) -= keyframe.roi_offset.y;
+        return render::extract_texture(isomap_plan, mesh, affine_camera_matrix, keyframe.frame, true, thread_pool);
+    };
+
+    // Adds (sign = +1) or subtracts (sign = -1) the weighted colours and the weights of the given isomap.
+    void accumulate(const cv::Mat& isomap, int sign)
+    {
+        assert(isomap.type() == CV_8UC4 && isomap.rows == isomap_plan.resolution);
+        for (int y = 0; y < isomap.rows; ++y)
+        {
+            const std::uint8_t* const row = isomap.ptr<std::uint8_t>(y);
+            for (int x = 0; x < isomap.cols; ++x)
+            {
+                const std::int32_t weight = row[4 * x + 3];
+                if (weight == 0)
+                {
+                    continue;
+                }
+                const int pixel = y * isomap.cols + x;
+                for (int c = 0; c < 3; ++c)
+                {
+                    weighted_colour_sums[3 * pixel + c] += sign * row[4 * x + c] * weight;
+                }
+                weight_sums[pixel] += sign * weight;
+            }
+        }
+    };
+};
+
+/**
+ * @brief Extracts texture from each keyframe and merges them using a weighted mean.
  *
- * // struct KeyframeMerger {};
+ * Uses the view angle as weighting. This extracts the textures of all keyframes on
+ * every call. To merge the keyframes of a video, where the keyframes change a few at a
+ * time, use a KeyframeMerger instead.
  *
  * @param[in] keyframes The keyframes that will be merged.
  * @param[in] morphable_model The Morphable Model with which the keyframes have been fitted.
  * @param[in] blendshapes The blendshapes with which the keyframes have been fitted.
  * @return Merged texture map (isomap), 3-channel uchar.
  */
-cv::Mat merge_weighted_mean(const std::vector<Keyframe>& keyframes,
-                            const morphablemodel::MorphableModel& morphable_model,
-                            const std::vector<morphablemodel::Blendshape>& blendshapes)
+inline cv::Mat merge_weighted_mean(const std::vector<Keyframe>& keyframes,
+                                   const morphablemodel::MorphableModel& morphable_model,
+                                   const std::vector<morphablemodel::Blendshape>& blendshapes)
 {
     assert(keyframes.size() >= 1);
 
-    using cv::Mat;
-    using std::vector;
-
-    vector<Mat> isomaps;
-    for (const auto& frame_data : keyframes)
-    {
-        const Mat shape =
-            morphable_model.get_shape_model().draw_sample(frame_data.fitting_result.pca_shape_coefficients) +
-            morphablemodel::to_matrix(blendshapes) * Mat(frame_data.fitting_result.blendshape_coefficients);
-        const auto mesh =
-            morphablemodel::sample_to_mesh(shape, {}, morphable_model.get_shape_model().get_triangle_list(),
-                                           {}, morphable_model.get_texture_coordinates());
-        const Mat affine_camera_matrix = fitting::get_3x4_affine_camera_matrix(
-            frame_data.fitting_result.rendering_parameters, frame_data.frame.cols, frame_data.frame.rows);
-        const Mat isomap = render::extract_texture(mesh, affine_camera_matrix, frame_data.frame, true,
-                                                   render::TextureInterpolation::NearestNeighbour, 1024);
-        isomaps.push_back(isomap);
-    }
-
-    // Now do the actual merging:
-    Mat r = Mat::zeros(isomaps[0].rows, isomaps[0].cols, CV_32FC1);
-    Mat g = Mat::zeros(isomaps[0].rows, isomaps[0].cols, CV_32FC1);
-    Mat b = Mat::zeros(isomaps[0].rows, isomaps[0].cols, CV_32FC1);
-    Mat accumulated_weight = Mat::zeros(isomaps[0].rows, isomaps[0].cols, CV_32FC1);
-    // Currently, this just uses the weights in the alpha channel for weighting - they contain only the
-    // view-angle. We should use the keyframe's score as well. Plus the area of the source triangle.
-    for (auto&& isomap : isomaps)
+    KeyframeMerger merger(morphable_model, blendshapes, 1024);
+    // The keyframes' ids are not necessarily assigned (they default to 0), so key them by position:
+    for (std::size_t i = 0; i < keyframes.size(); ++i)
     {
-        vector<Mat> channels;
-        cv::split(isomap, channels);
-        // channels[0].convertTo(channels[0], CV_32FC1);
-        // We could avoid this explicit temporary, but then we'd have to convert both matrices
-        // to CV_32FC1 first - and manually multiply with 1/255. Not sure which one is faster.
-        // If we do it like this, the add just becomes '+=' - so I think it's fine like this.
-        // The final formula is:
-        // b += chan_0 * alpha * 1/255; (and the same for g and r respectively)
-        Mat weighted_b, weighted_g, weighted_r;
-        // // we scale the weights from [0, 255] to [0, 1]:
-        cv::multiply(channels[0], channels[3], weighted_b, 1 / 255.0, CV_32FC1);
-        cv::multiply(channels[1], channels[3], weighted_g, 1 / 255.0, CV_32FC1);
-        cv::multiply(channels[2], channels[3], weighted_r, 1 / 255.0, CV_32FC1);
-        b += weighted_b;
-        g += weighted_g;
-        r += weighted_r;
-        channels[3].convertTo(channels[3], CV_32FC1); // needed for the '/ 255.0f' below to work
-        cv::add(accumulated_weight, channels[3] / 255.0f, accumulated_weight, cv::noArray(), CV_32FC1);
+        merger.add(keyframes[i], i);
     }
-    b = b.mul(1.0 / (accumulated_weight)); // divide by number of frames used too?
-    g = g.mul(1.0 / (accumulated_weight));
-    r = r.mul(1.0 / (accumulated_weight));
-
-    // Let's return accumulated_weight too: Normalise by num_isomaps * 255 (=maximum weight)
-    // This sets the returned weight to the average from all the isomaps. Maybe the maximum would make more
-    // sense? => Not returning anything for now.
-    // accumulated_weight = (accumulated_weight / isomaps.size()) * 255;
-
-    Mat merged_isomap;
-    cv::merge({b, g, r}, merged_isomap);
-    merged_isomap.convertTo(merged_isomap, CV_8UC3);
-    return merged_isomap;
+    return merger.get_merged_isomap();
 };
 
 /**
@@ -236,7 +414,7 @@ cv::Mat merge_weighted_mean(const std::vector<Keyframe>& keyframes,
  * @param[in] image Input image or patch.
  * @return The computed variance of laplacian score.
  */
-double variance_of_laplacian(const cv::Mat& image)
+inline double variance_of_laplacian(const cv::Mat& image)
 {
     cv::Mat laplacian;
     cv::Laplacian(image, laplacian, CV_64F);
@@ -0,0 +1,316 @@
+/*
+ * eos - A 3D Morphable Model fitting library written in modern C++11/14.
+ *
+ * File: include/eos/video/KeyframeStore.hpp
+ *
+ * Copyright 2017 Patrik Huber
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#ifndef KEYFRAMESTORE_HPP_
+#define KEYFRAMESTORE_HPP_
+
+#include "eos/fitting/FittingResult.hpp"
+#include "eos/video/Keyframe.hpp"
+
+#include "glm/gtc/quaternion.hpp"
+
+#include "opencv2/core/core.hpp"
+
+#include <vector>
+#include <mutex>
+#include <functional>
+#include <algorithm>
+#include <iterator>
+#include <limits>
+#include <cmath>
+#include <cstdint>
+#include <cstddef>
+
+namespace eos {
+namespace video {
+
+/**
+ * @brief An optional compression of the images in a KeyframeStore.
+ *
+ * eos only depends on OpenCV's core and imgproc, so no codec is built in. With
+ * OpenCV's imgcodecs, for example:
+ * \code
+ * KeyframeCodec jpeg;
+ * jpeg.encode = [](const cv::Mat& image) { std::vector<std::uint8_t> buffer; cv::imencode(".jpg", image, buffer); return buffer; };
+ * jpeg.decode = [](const std::vector<std::uint8_t>& buffer) { return cv::imdecode(buffer, cv::IMREAD_COLOR); };
+ * \endcode
+ */
+struct KeyframeCodec
+{
+    std::function<std::vector<std::uint8_t>(const cv::Mat&)> encode;
+    std::function<cv::Mat(const std::vector<std::uint8_t>&)> decode;
+};
+
+/**
+ * @brief Settings of a KeyframeStore.
+ */
+struct KeyframeStoreSettings
+{
+    /**
+     * The upper edges, in degrees, of all but the last yaw bin. The default gives the
+     * 9 bins of 20 degrees of PoseBinningKeyframeSelector.
+     */
+    std::vector<float> yaw_bin_edges = {-70.0f, -50.0f, -30.0f, -10.0f, 10.0f, 30.0f, 50.0f, 70.0f};
+    std::vector<float> pitch_bin_edges; ///< The same for the pitch. Empty for a single pitch bin.
+    int frames_per_bin = 2; ///< The number of keyframes kept per pose bin.
+    std::size_t memory_budget = 64 * 1024 * 1024; ///< Maximum number of bytes of all stored images together.
+    float roi_margin = 0.25f; ///< Margin around the bounding box of the fitted points, relative to its size.
+    KeyframeCodec codec; ///< If set, the crops are stored encoded.
+};
+
+/**
+ * @brief Selects and keeps keyframes by yaw and pitch angle and sharpness, like
+ * PoseBinningKeyframeSelector, but only keeps the region of the face, within a
+ * memory budget, and can be used by several threads at once.
+ *
+ * try_add() crops the face region out of the frame (the bounding box of the points
+ * the fitting used, plus a margin), and scores its sharpness with variance_of_laplacian()
+ * on this region only. The crop is a copy, so the full frame isn't kept alive. If a
+ * codec is given, the crop is stored encoded.
+ *
+ * The keyframes of each pose bin are kept sorted by score, so deciding whether a frame
+ * is accepted is one comparison with the bin's worst keyframe. When the stored images
+ * exceed the memory budget, keyframes are evicted, by lowest score first from the bins
+ * with more than one keyframe, so that the pose coverage is kept as long as possible.
+ *
+ * The expensive steps of try_add() (scoring, cropping, encoding) run without holding
+ * the lock, so concurrent calls from several fitting workers only wait for each other
+ * for the bin update.
+ */
+class KeyframeStore
+{
+public:
+    explicit KeyframeStore(KeyframeStoreSettings settings = KeyframeStoreSettings()) : settings(std::move(settings))
+    {
+        const std::size_t num_bins =
+            (this->settings.yaw_bin_edges.size() + 1) * (this->settings.pitch_bin_edges.size() + 1);
+        bins.resize(num_bins);
+    };
+
+    /**
+     * @brief Adds the frame as a keyframe, if it's sharper than the worst keyframe of
+     * its pose bin (or the bin isn't full).
+     *
+     * @param[in] image The full frame.
+     * @param[in] fitting_result The fitting of the frame. Its fitted_image_points give the face region.
+     * @return Whether the frame was added.
+     */
+    bool try_add(const cv::Mat& image, const fitting::FittingResult& fitting_result)
+    {
+        const cv::Rect roi = get_face_roi(fitting_result.fitted_image_points, image.size());
+        if (roi.area() == 0)
+        {
+            return false;
+        }
+        const std::size_t bin = get_bin(fitting_result.rendering_parameters.get_rotation());
+        const cv::Mat face = image(roi);
+        const float score = static_cast<float>(variance_of_laplacian(face));
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!is_accepted(bins[bin], score))
+            {
+                return false;
+            }
+        }
+
+        StoredKeyframe keyframe;
+        keyframe.score = score;
+        keyframe.fitting_result = fitting_result;
+        keyframe.image_size = image.size();
+        keyframe.roi_offset = roi.tl();
+        if (settings.codec.encode)
+        {
+            keyframe.encoded = settings.codec.encode(face);
+            keyframe.num_bytes = keyframe.encoded.size();
+        } else
+        {
+            keyframe.crop = face.clone();
+            keyframe.num_bytes = keyframe.crop.total() * keyframe.crop.elemSize();
+        }
+        if (keyframe.num_bytes > settings.memory_budget)
+        {
+            return false;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        auto& entries = bins[bin];
+        if (!is_accepted(entries, score)) // another thread may have filled the bin in the meantime
+        {
+            return false;
+        }
+        keyframe.id = next_id++;
+        num_bytes += keyframe.num_bytes;
+        const auto position = std::upper_bound(
+            std::begin(entries), std::end(entries), score,
+            [](float value, const StoredKeyframe& element) { return value > element.score; });
+        entries.insert(position, std::move(keyframe));
+        if (entries.size() > static_cast<std::size_t>(settings.frames_per_bin))
+        {
+            num_bytes -= entries.back().num_bytes;
+            entries.pop_back();
+        }
+        while (num_bytes > settings.memory_budget)
+        {
+            evict_one();
+        }
+        return true;
+    };
+
+    /**
+     * @brief Returns the current keyframes, with the crops as frames (decoded, if
+     * they're stored encoded). See Keyframe for how to use a crop with the fitting result.
+     *
+     * @return The keyframes, e.g. for KeyframeMerger::update().
+     */
+    std::vector<Keyframe> get_keyframes() const
+    {
+        std::vector<StoredKeyframe> stored;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (const auto& entries : bins)
+            {
+                stored.insert(std::end(stored), std::begin(entries), std::end(entries));
+            }
+        }
+        // Decoding is slow, so it's done after releasing the lock (the crops and buffers are shared, not copied):
+        std::vector<Keyframe> keyframes;
+        keyframes.reserve(stored.size());
+        for (const auto& keyframe : stored)
+        {
+            Keyframe result{keyframe.score, keyframe.crop, keyframe.fitting_result, keyframe.id,
+                            keyframe.image_size, keyframe.roi_offset};
+            if (keyframe.crop.empty() && settings.codec.decode)
+            {
+                result.frame = settings.codec.decode(keyframe.encoded);
+            }
+            keyframes.push_back(std::move(result));
+        }
+        return keyframes;
+    };
+
+    /**
+     * Returns the number of bytes used by the stored images.
+     */
+    std::size_t get_num_bytes() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return num_bytes;
+    };
+
+    /**
+     * Returns the number of stored keyframes.
+     */
+    std::size_t get_num_keyframes() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::size_t num_keyframes = 0;
+        for (const auto& entries : bins)
+        {
+            num_keyframes += entries.size();
+        }
+        return num_keyframes;
+    };
+
+private:
+    struct StoredKeyframe
+    {
+        std::size_t id = 0;
+        float score = 0.0f;
+        fitting::FittingResult fitting_result;
+        cv::Size image_size;
+        cv::Point roi_offset;
+        cv::Mat crop; // empty if stored encoded
+        std::vector<std::uint8_t> encoded;
+        std::size_t num_bytes = 0;
+    };
+
+    KeyframeStoreSettings settings;
+    mutable std::mutex mutex; // protects everything below
+    std::vector<std::vector<StoredKeyframe>> bins; // each sorted by descending score
+    std::size_t num_bytes = 0;
+    std::size_t next_id = 0;
+
+    bool is_accepted(const std::vector<StoredKeyframe>& entries, float score) const
+    {
+        return entries.size() < static_cast<std::size_t>(settings.frames_per_bin) || score > entries.back().score;
+    };
+
+    // Removes the worst keyframe of the bins with more than one keyframe, or of all bins if there's none.
+    void evict_one()
+    {
+        std::vector<StoredKeyframe>* worst_bin = nullptr;
+        bool worst_is_shared = false; // whether the worst bin has more than one keyframe
+        for (auto&& entries : bins)
+        {
+            if (entries.empty())
+            {
+                continue;
+            }
+            const bool is_shared = entries.size() > 1;
+            if (!worst_bin || (is_shared && !worst_is_shared) ||
+                (is_shared == worst_is_shared && entries.back().score < worst_bin->back().score))
+            {
+                worst_bin = &entries;
+                worst_is_shared = is_shared;
+            }
+        }
+        num_bytes -= worst_bin->back().num_bytes;
+        worst_bin->pop_back();
+    };
+
+    std::size_t get_bin(const glm::quat& rotation) const
+    {
+        const auto to_index = [](const std::vector<float>& edges, float angle) {
+            return static_cast<std::size_t>(std::distance(
+                std::begin(edges), std::lower_bound(std::begin(edges), std::end(edges), angle)));
+        };
+        const std::size_t yaw_index = to_index(settings.yaw_bin_edges, glm::degrees(glm::yaw(rotation)));
+        const std::size_t pitch_index = to_index(settings.pitch_bin_edges, glm::degrees(glm::pitch(rotation)));
+        return pitch_index * (settings.yaw_bin_edges.size() + 1) + yaw_index;
+    };
+
+    cv::Rect get_face_roi(const std::vector<cv::Vec2f>& points, cv::Size image_size) const
+    {
+        if (points.empty())
+        {
+            return cv::Rect();
+        }
+        float min_x = std::numeric_limits<float>::max(), min_y = min_x;
+        float max_x = std::numeric_limits<float>::lowest(), max_y = max_x;
+        for (const auto& point : points)
+        {
+            min_x = std::min(min_x, point[0]);
+            min_y = std::min(min_y, point[1]);
+            max_x = std::max(max_x, point[0]);
+            max_y = std::max(max_y, point[1]);
+        }
+        const float margin_x = settings.roi_margin * (max_x - min_x);
+        const float margin_y = settings.roi_margin * (max_y - min_y);
+        const cv::Rect roi(cv::Point(static_cast<int>(std::floor(min_x - margin_x)), static_cast<int>(std::floor(min_y - margin_y))),
+                           cv::Point(static_cast<int>(std::ceil(max_x + margin_x)), static_cast<int>(std::ceil(max_y + margin_y))));
+        return roi & cv::Rect(cv::Point(0, 0), image_size);
+    };
+};
+
+} /* namespace video */
+} /* namespace eos */
+
+#endif /* KEYFRAMESTORE_HPP_ */
@@ -0,0 +1,414 @@
+/*
+ * eos - A 3D Morphable Model fitting library written in modern C++11/14.
+ *
+ * File: include/eos/video/VideoPipeline.hpp
+ *
+ * Copyright 2017 Patrik Huber
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#ifndef VIDEOPIPELINE_HPP_
+#define VIDEOPIPELINE_HPP_
+
+#include "eos/core/Landmark.hpp"
+#include "eos/core/LandmarkMapper.hpp"
+#include "eos/core/SpscQueue.hpp"
+#include "eos/core/WorkerPool.hpp"
+#include "eos/fitting/FaceTracker.hpp"
+#include "eos/fitting/FittingResult.hpp"
+#include "eos/fitting/contour_correspondence.hpp"
+#include "eos/morphablemodel/Blendshape.hpp"
+#include "eos/morphablemodel/EdgeTopology.hpp"
+#include "eos/morphablemodel/MorphableModel.hpp"
+#include "eos/video/Keyframe.hpp"
+
+#include "opencv2/core/core.hpp"
+
+#include "boost/optional.hpp"
+
+#include <vector>
+#include <memory>
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <exception>
+#include <stdexcept>
+#include <cstddef>
+
+namespace eos {
+namespace video {
+
+/**
+ * @brief A frame of a video stream, as it passes through the stages of a VideoPipeline.
+ *
+ * Each stage fills in its part: The ingest writes the image and the landmarks (if they
+ * are not given to VideoPipeline::submit() already), the fitting the fitting_result,
+ * the keyframe selection is_keyframe and keyframes, and the texture merging the
+ * merged_isomap.
+ */
+struct VideoFrame
+{
+    std::size_t index = 0; ///< Position in the stream, assigned by VideoPipeline::submit().
+    cv::Mat image; ///< The frame. Or the encoded frame, for the ingest stage to decode.
+    core::LandmarkCollection<cv::Vec2f> landmarks; ///< The 2D landmarks of the face. Empty if no face was found.
+    boost::optional<fitting::FittingResult> fitting_result; ///< boost::none if there was no face to fit.
+    float score = 0.0f; ///< Sharpness of the frame, see variance_of_laplacian().
+    bool is_keyframe = false; ///< Whether the frame was added to the stream's keyframes.
+    std::shared_ptr<const std::vector<Keyframe>> keyframes; ///< The stream's keyframes after this frame, if they changed, nullptr otherwise.
+    cv::Mat merged_isomap; ///< The merged texture of the keyframes, if they changed. Empty otherwise.
+    std::exception_ptr error; ///< If a stage threw, the exception. The following stages skip the frame.
+};
+
+/**
+ * @brief Settings of one stream of a VideoPipeline.
+ */
+struct StreamSettings
+{
+    std::size_t queue_capacity = 4; ///< Maximum number of frames waiting in front of each stage.
+    std::function<void(VideoFrame&)> ingest; ///< Run on each frame before the fitting, e.g. to decode the image and detect the landmarks. Can be empty.
+    fitting::TrackingSettings tracking; ///< The settings of the stream's FaceTracker.
+    int frames_per_bin = 2; ///< See PoseBinningKeyframeSelector.
+    bool merge_textures = true; ///< Whether to merge the textures of the keyframes, whenever they change.
+    int isomap_resolution = 512; ///< The resolution of the merged texture.
+};
+
+/**
+ * @brief Runs the fitting, keyframe selection and texture merging of many video
+ * streams, on one shared worker pool.
+ *
+ * Each frame passes through four stages: The ingest (StreamSettings::ingest, e.g.
+ * decoding and landmark detection), the fitting (with a fitting::FaceTracker per
+ * stream), the keyframe scoring and selection (with a PoseBinningKeyframeSelector),
+ * and the texture merging (with a KeyframeMerger). The stages of a stream are
+ * connected by lock-free, bounded core::SpscQueue's.
+ *
+ * Each stage of each stream runs on at most one worker at a time, so the frames of a
+ * stream go through every stage in order, and the trackers and selectors need no
+ * locks. But the stages of a stream run concurrently (frame 2 can be fitted while
+ * frame 1's texture is merged), and all streams run in parallel. A stage only
+ * processes one frame and then queues itself again behind the other streams' work,
+ * so a busy stream can't starve the others. If a stage's output queue is full, it
+ * waits (without blocking a worker) until the next stage has caught up, and in the
+ * end submit() fails: For live camera feeds, the caller can then drop the frame.
+ *
+ * The results are given to the stream's callback, in order, on a worker thread. The
+ * model and the other fitting data are referenced, not copied, and must outlive the
+ * pipeline.
+ */
+class VideoPipeline
+{
+public:
+    /**
+     * Callback that receives each frame of a stream when it has passed through all stages.
+     */
+    using FrameCallback = std::function<void(std::size_t stream_id, VideoFrame& frame)>;
+
+    /**
+     * @brief Creates a pipeline without streams.
+     *
+     * @param[in] worker_pool The pool that runs all stages of all streams. Can be shared with other work.
+     * @param[in] morphable_model The 3D Morphable Model used for the fitting.
+     * @param[in] blendshapes The blendshapes used for the fitting.
+     * @param[in] landmark_mapper Mapping info from the 2D landmark points to 3D vertex indices.
+     * @param[in] edge_topology Precomputed edge topology of the 3D model.
+     * @param[in] contour_landmarks 2D image contour ids of left or right side.
+     * @param[in] model_contour The model contour indices.
+     */
+    VideoPipeline(core::WorkerPool& worker_pool, const morphablemodel::MorphableModel& morphable_model,
+                  const std::vector<morphablemodel::Blendshape>& blendshapes,
+                  const core::LandmarkMapper& landmark_mapper, const morphablemodel::EdgeTopology& edge_topology,
+                  const fitting::ContourLandmarks& contour_landmarks, const fitting::ModelContour& model_contour)
+        : worker_pool(worker_pool), morphable_model(morphable_model), blendshapes(blendshapes),
+          landmark_mapper(landmark_mapper), edge_topology(edge_topology), contour_landmarks(contour_landmarks),
+          model_contour(model_contour)
+    {
+    };
+
+    VideoPipeline(const VideoPipeline&) = delete;
+    VideoPipeline& operator=(const VideoPipeline&) = delete;
+
+    /**
+     * @brief Waits until all submitted frames have been processed.
+     */
+    ~VideoPipeline()
+    {
+        flush();
+    };
+
+    /**
+     * @brief Adds a stream.
+     *
+     * @param[in] settings The settings of the stream.
+     * @param[in] callback Receives the stream's frames when they are done, in order.
+     * @return The id of the stream, to submit() its frames.
+     */
+    std::size_t add_stream(StreamSettings settings, FrameCallback callback)
+    {
+        std::lock_guard<std::mutex> lock(streams_mutex);
+        streams.push_back(std::make_unique<Stream>(*this, streams.size(), std::move(settings), std::move(callback)));
+        return streams.size() - 1;
+    };
+
+    /**
+     * @brief Queues the next frame of a stream.
+     *
+     * Only one thread may submit frames to a given stream (e.g. its capture thread).
+     * Different streams can be fed from different threads.
+     *
+     * @param[in] stream_id The stream, as returned by add_stream().
+     * @param[in] image The frame (or the encoded frame, if the ingest decodes it).
+     * @param[in] landmarks The landmarks, if they are known already. Otherwise the ingest has to add them.
+     * @return False if the stream's first queue is full. The frame is dropped then.
+     */
+    bool submit(std::size_t stream_id, cv::Mat image, core::LandmarkCollection<cv::Vec2f> landmarks = {})
+    {
+        Stream& stream = get_stream(stream_id);
+        VideoFrame frame;
+        frame.index = stream.next_frame_index;
+        frame.image = image;
+        frame.landmarks = std::move(landmarks);
+        ++frames_in_flight;
+        if (!stream.queues[0]->try_push(std::move(frame)))
+        {
+            finish_frame();
+            return false;
+        }
+        ++stream.next_frame_index;
+        try_schedule(stream, 0);
+        return true;
+    };
+
+    /**
+     * @brief Blocks until all frames that have been submitted so far have been
+     * given to their callbacks.
+     */
+    void flush()
+    {
+        std::unique_lock<std::mutex> lock(idle_mutex);
+        idle.wait(lock, [this]() { return frames_in_flight == 0 && active_tasks == 0; });
+    };
+
+    /**
+     * @brief Forgets the tracked face of a stream, e.g. after a scene cut. Takes effect
+     * with the next frame that is fitted.
+     *
+     * @param[in] stream_id The stream to reset.
+     */
+    void reset_stream(std::size_t stream_id)
+    {
+        get_stream(stream_id).reset_requested = true;
+    };
+
+private:
+    static constexpr int num_stages = 4; // ingest, fitting, keyframes, texture merging
+
+    struct Stream
+    {
+        Stream(VideoPipeline& pipeline, std::size_t id, StreamSettings settings, FrameCallback callback)
+            : id(id), settings(std::move(settings)), callback(std::move(callback)),
+              tracker(pipeline.morphable_model, pipeline.blendshapes, pipeline.landmark_mapper,
+                      pipeline.edge_topology, pipeline.contour_landmarks, pipeline.model_contour,
+                      this->settings.tracking),
+              keyframe_selector(this->settings.frames_per_bin)
+        {
+            for (auto&& queue : queues)
+            {
+                queue = std::make_unique<core::SpscQueue<VideoFrame>>(this->settings.queue_capacity);
+            }
+            if (this->settings.merge_textures)
+            {
+                merger = std::make_unique<KeyframeMerger>(pipeline.morphable_model, pipeline.blendshapes,
+                                                          this->settings.isomap_resolution);
+            }
+            for (auto&& flag : scheduled)
+            {
+                flag = false;
+            }
+        };
+
+        std::size_t id;
+        StreamSettings settings;
+        FrameCallback callback;
+        std::size_t next_frame_index = 0; // only used by the submitting thread
+
+        // The state of the stages. Each is only used by the stage's current run:
+        fitting::FaceTracker tracker;
+        std::atomic<bool> reset_requested{false};
+        PoseBinningKeyframeSelector keyframe_selector;
+        std::unique_ptr<KeyframeMerger> merger;
+
+        std::array<std::unique_ptr<core::SpscQueue<VideoFrame>>, num_stages> queues; // the input queue of each stage
+        std::array<std::atomic<bool>, num_stages> scheduled; // whether the stage is queued on or running on a worker
+    };
+
+    Stream& get_stream(std::size_t stream_id)
+    {
+        std::lock_guard<std::mutex> lock(streams_mutex);
+        if (stream_id >= streams.size())
+        {
+            throw std::out_of_range("VideoPipeline: No stream with the given id.");
+        }
+        return *streams[stream_id];
+    };
+
+    // Queues a run of the stage on the pool, unless it's queued or running already, or has nothing to do.
+    void try_schedule(Stream& stream, int stage)
+    {
+        if (stage < 0 || stage >= num_stages || stream.queues[stage]->empty() ||
+            (stage + 1 < num_stages && stream.queues[stage + 1]->full()))
+        {
+            return;
+        }
+        bool expected = false;
+        if (!stream.scheduled[stage].compare_exchange_strong(expected, true))
+        {
+            return; // the current run will check again when it's finished
+        }
+        {
+            std::lock_guard<std::mutex> lock(idle_mutex);
+            ++active_tasks;
+        }
+        worker_pool.post([this, &stream, stage]() { run_stage(stream, stage); });
+    };
+
+    // Processes one frame of the stage, if the next stage has room for it.
+    void run_stage(Stream& stream, int stage)
+    {
+        const bool is_last_stage = stage + 1 == num_stages;
+        if (is_last_stage || !stream.queues[stage + 1]->full())
+        {
+            auto frame = stream.queues[stage]->try_pop();
+            if (frame)
+            {
+                if (!frame->error)
+                {
+                    try
+                    {
+                        process(stream, stage, frame.get());
+                    } catch (...)
+                    {
+                        frame->error = std::current_exception();
+                    }
+                }
+                if (is_last_stage)
+                {
+                    deliver(stream, frame.get());
+                } else
+                {
+                    stream.queues[stage + 1]->try_push(std::move(frame.get())); // can't fail, we're its only producer
+                    try_schedule(stream, stage + 1);
+                }
+            }
+        }
+        stream.scheduled[stage] = false;
+        // Frames may have arrived, or room may have become free, while we were running:
+        try_schedule(stream, stage);
+        try_schedule(stream, stage - 1); // we made room in our queue
+        std::lock_guard<std::mutex> lock(idle_mutex);
+        --active_tasks;
+        idle.notify_all();
+    };
+
+    void process(Stream& stream, int stage, VideoFrame& frame)
+    {
+        switch (stage)
+        {
+        case 0: // ingest
+            if (stream.settings.ingest)
+            {
+                stream.settings.ingest(frame);
+            }
+            break;
+        case 1: // fitting
+            if (stream.reset_requested.exchange(false))
+            {
+                stream.tracker.reset();
+            }
+            if (frame.landmarks.empty())
+            {
+                stream.tracker.reset(); // the face is lost, don't start the next face from this one's pose
+            } else
+            {
+                frame.fitting_result = stream.tracker.track(frame.landmarks, frame.image.cols, frame.image.rows);
+            }
+            break;
+        case 2: // keyframe scoring and selection
+            if (frame.fitting_result)
+            {
+                frame.score = static_cast<float>(variance_of_laplacian(frame.image));
+                frame.is_keyframe =
+                    stream.keyframe_selector.try_add(frame.score, frame.image, frame.fitting_result.get());
+                if (frame.is_keyframe)
+                {
+                    frame.keyframes = std::make_shared<const std::vector<Keyframe>>(
+                        stream.keyframe_selector.get_keyframes());
+                }
+            }
+            break;
+        case 3: // texture merging
+            if (stream.merger && frame.keyframes)
+            {
+                stream.merger->update(*frame.keyframes);
+                frame.merged_isomap = stream.merger->get_merged_isomap();
+            }
+            break;
+        }
+    };
+
+    void deliver(Stream& stream, VideoFrame& frame)
+    {
+        if (stream.callback)
+        {
+            try
+            {
+                stream.callback(stream.id, frame);
+            } catch (...)
+            {
+                // The callback's errors are the caller's business, but they must not stop the stream.
+            }
+        }
+        finish_frame();
+    };
+
+    void finish_frame()
+    {
+        std::lock_guard<std::mutex> lock(idle_mutex);
+        --frames_in_flight;
+        idle.notify_all();
+    };
+
+    core::WorkerPool& worker_pool;
+    const morphablemodel::MorphableModel& morphable_model;
+    const std::vector<morphablemodel::Blendshape>& blendshapes;
+    const core::LandmarkMapper& landmark_mapper;
+    const morphablemodel::EdgeTopology& edge_topology;
+    const fitting::ContourLandmarks& contour_landmarks;
+    const fitting::ModelContour& model_contour;
+
+    std::mutex streams_mutex; // protects the vector, not the streams
+    std::vector<std::unique_ptr<Stream>> streams;
+
+    std::mutex idle_mutex; // protects the counters, for flush()
+    std::condition_variable idle;
+    std::atomic<int> frames_in_flight{0}; // submitted, but not delivered yet
+    int active_tasks = 0; // stage runs that are queued on or running on the pool
+};
+
+} /* namespace video */
+} /* namespace eos */
+
+#endif /* VIDEOPIPELINE_HPP_ */
@@ -15,6 +15,11 @@ function [mesh, rendering_parameters] = fit_shape_and_pose(morphable_model, ...
 %   landmarks must be a 68 x 2 matrix with ibug landmarks, in the order
 %   from 1 to 68.
 %
+%   To fit many faces at once, landmarks can also be a cell array of such
+%   68 x 2 matrices (all from images of the given size). The faces are fitted
+%   independently of each other, in parallel, and mesh and
+%   rendering_parameters are then cell arrays with one entry per face.
+%
 %   Default values for some of the parameters: num_iterations = 5,
 %   num_shape_coefficients_to_fit = all (-1), and lambda = 30.0.
 %
@@ -25,8 +30,10 @@ function [mesh, rendering_parameters] = fit_shape_and_pose(morphable_model, ...
 %   morphable_model, blendshapes, landmark_mapper, edge_topology,
 %   contour_landmarks and model_contour as *filenames* to the respective
 %   files in the eos/share/ directory, and not the objects directly.
+%   The loaded files are kept in memory across calls, and only loaded again
+%   when they change on disk. Use "clear fitting" to free them.
 
-if(~isa(landmarks,'double'))
+if(~isa(landmarks,'double') && ~(iscell(landmarks) && all(cellfun(@(x) isa(x,'double'), landmarks))))
     error('Please specify the landmarks as type double.');
 end
 
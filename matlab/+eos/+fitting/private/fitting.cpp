@@ -19,6 +19,7 @@
  */
 #include "eos/core/LandmarkMapper.hpp"
 #include "eos/core/Mesh.hpp"
+#include "eos/core/ThreadPool.hpp"
 #include "eos/morphablemodel/MorphableModel.hpp"
 #include "eos/morphablemodel/Blendshape.hpp"
 #include "eos/morphablemodel/EdgeTopology.hpp"
@@ -26,6 +27,7 @@
 #include "eos/fitting/fitting.hpp"
 #include "eos/fitting/RenderingParameters.hpp"
 
+#include "asset_cache.hpp"
 #include "mexplus_eigen.hpp"
 #include "mexplus_eos_types.hpp"
 
@@ -39,10 +41,40 @@
 //#include "matrix.h"
 
 #include <string>
+#include <vector>
+#include <memory>
+#include <utility>
 
 using namespace eos;
 using namespace mexplus;
 
+namespace {
+
+// The assets are kept loaded across calls, so that e.g. fitting many images in a
+// Matlab loop only loads the model once. "clear fitting" (or "clear mex") frees them.
+matlab::AssetCache<morphablemodel::MorphableModel> morphable_models;
+matlab::AssetCache<std::vector<morphablemodel::Blendshape>> blendshapes_cache;
+matlab::AssetCache<core::LandmarkMapper> landmark_mappers;
+matlab::AssetCache<morphablemodel::EdgeTopology> edge_topologies;
+matlab::AssetCache<fitting::ContourLandmarks> contour_landmarks_cache;
+matlab::AssetCache<fitting::ModelContour> model_contours;
+
+// Converts the landmarks (given as 68 x 2 matrix in Matlab) to a LandmarkCollection:
+core::LandmarkCollection<cv::Vec2f> to_landmark_collection(const Eigen::MatrixXd& landmarks_in)
+{
+	if (landmarks_in.rows() != 68 || landmarks_in.cols() != 2) {
+		mexErrMsgIdAndTxt("eos:fitting:argin", "Given landmarks must be a 68 x 2 vector with ibug landmarks, in the order from 1 to 68.");
+	}
+	core::LandmarkCollection<cv::Vec2f> landmarks;
+	for (int i = 0; i < 68; ++i)
+	{
+		landmarks.push_back(core::Landmark<cv::Vec2f>{ std::to_string(i + 1), cv::Vec2f(landmarks_in(i, 0), landmarks_in(i, 1)) });
+	}
+	return landmarks;
+};
+
+} /* unnamed namespace */
+
 void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
 {
 	using std::string;
@@ -57,7 +89,7 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
 	InputArguments input(nrhs, prhs, 12);
 	const auto morphablemodel_file = input.get<string>(0);
 	const auto blendshapes_file = input.get<string>(1);
-	const auto landmarks_in = input.get<Eigen::MatrixXd>(2);
+	const bool is_batch = mxIsCell(prhs[2]);
 	const auto mapper_file = input.get<string>(3);
 	const auto image_width = input.get<int>(4);
 	const auto image_height = input.get<int>(5);
@@ -68,32 +100,62 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
 	const auto num_shape_coeffs = input.get<int>(10);
 	const auto lambda = input.get<double>(11);
 
-	if (landmarks_in.rows() != 68) {
-		mexErrMsgIdAndTxt("eos:fitting:argin", "Given landmarks must be a 68 x 2 vector with ibug landmarks, in the order from 1 to 68.");
-	}
-	// Convert the landmarks (given as matrix in Matlab) to a LandmarkCollection:
-	core::LandmarkCollection<cv::Vec2f> landmarks;
-	for (int i = 0; i < 68; ++i)
-	{
-		landmarks.push_back(core::Landmark<cv::Vec2f>{ std::to_string(i + 1), cv::Vec2f(landmarks_in(i, 0), landmarks_in(i, 1)) });
+	// The landmarks are either one 68 x 2 matrix, or a cell array of them, to fit many faces at once:
+	std::vector<core::LandmarkCollection<cv::Vec2f>> landmark_collections;
+	if (is_batch) {
+		const auto landmarks_in = input.get<std::vector<Eigen::MatrixXd>>(2);
+		for (const auto& landmarks : landmarks_in) {
+			landmark_collections.push_back(to_landmark_collection(landmarks));
+		}
+	} else {
+		landmark_collections.push_back(to_landmark_collection(input.get<Eigen::MatrixXd>(2)));
 	}
 
-	// Load everything:
-	const auto morphable_model = morphablemodel::load_model(morphablemodel_file);
-	const auto blendshapes = morphablemodel::load_blendshapes(blendshapes_file);
-	const core::LandmarkMapper landmark_mapper(mapper_file);
-	const auto edge_topology = morphablemodel::load_edge_topology(edgetopo_file);
-	const auto contour_landmarks = fitting::ContourLandmarks::load(contour_lms_file);
-	const auto model_contour = fitting::ModelContour::load(model_cnt_file);
+	// Load everything (or get it from the cache, if it's been loaded in a previous call):
+	std::shared_ptr<const morphablemodel::MorphableModel> morphable_model;
+	std::shared_ptr<const std::vector<morphablemodel::Blendshape>> blendshapes;
+	std::shared_ptr<const core::LandmarkMapper> landmark_mapper;
+	std::shared_ptr<const morphablemodel::EdgeTopology> edge_topology;
+	std::shared_ptr<const fitting::ContourLandmarks> contour_landmarks;
+	std::shared_ptr<const fitting::ModelContour> model_contour;
+	try {
+		morphable_model = morphable_models.get(morphablemodel_file, [](const string& filename) { return morphablemodel::load_model(filename); });
+		blendshapes = blendshapes_cache.get(blendshapes_file, [](const string& filename) { return morphablemodel::load_blendshapes(filename); });
+		landmark_mapper = landmark_mappers.get(mapper_file, [](const string& filename) { return core::LandmarkMapper(filename); });
+		edge_topology = edge_topologies.get(edgetopo_file, [](const string& filename) { return morphablemodel::load_edge_topology(filename); });
+		contour_landmarks = contour_landmarks_cache.get(contour_lms_file, [](const string& filename) { return fitting::ContourLandmarks::load(filename); });
+		model_contour = model_contours.get(model_cnt_file, [](const string& filename) { return fitting::ModelContour::load(filename); });
+	}
+	catch (const std::exception& e) {
+		mexErrMsgIdAndTxt("eos:fitting:load", "Error loading the model files: %s", e.what());
+	}
 	const boost::optional<int> num_shape_coefficients_to_fit = num_shape_coeffs == -1 ? boost::none : boost::optional<int>(num_shape_coeffs);
 
-	// Now do the actual fitting:
-	core::Mesh mesh;
-	fitting::RenderingParameters rendering_parameters;
-	std::tie(mesh, rendering_parameters) = fitting::fit_shape_and_pose(morphable_model, blendshapes, landmarks, landmark_mapper, image_width, image_height, edge_topology, contour_landmarks, model_contour, num_iterations, num_shape_coefficients_to_fit, lambda);
+	// Now do the actual fitting. The faces of a batch are independent, and fitted in parallel.
+	// Note: The Matlab API must not be used from the worker threads, so all conversions happen outside.
+	const int num_faces = static_cast<int>(landmark_collections.size());
+	std::vector<core::Mesh> meshes(num_faces);
+	std::vector<fitting::RenderingParameters> rendering_parameters(num_faces);
+	{
+		core::ThreadPool thread_pool(num_faces > 1 ? 0 : 1);
+		thread_pool.parallel_for(0, num_faces, [&](int i, int /* thread_index */) {
+			std::tie(meshes[i], rendering_parameters[i]) = fitting::fit_shape_and_pose(*morphable_model, *blendshapes, landmark_collections[i], *landmark_mapper, image_width, image_height, *edge_topology, *contour_landmarks, *model_contour, num_iterations, num_shape_coefficients_to_fit, lambda);
+		});
+	}
 
-	// Return the mesh and the rendering_parameters:
+	// Return the mesh and the rendering_parameters (or cell arrays of them, for a batch):
 	OutputArguments output(nlhs, plhs, 2);
-	output.set(0, mesh);
-	output.set(1, rendering_parameters);
+	if (is_batch) {
+		MxArray mesh_cells(MxArray::Cell(1, num_faces));
+		MxArray rendering_parameters_cells(MxArray::Cell(1, num_faces));
+		for (int i = 0; i < num_faces; ++i) {
+			mesh_cells.set(i, meshes[i]);
+			rendering_parameters_cells.set(i, rendering_parameters[i]);
+		}
+		plhs[0] = mesh_cells.release();
+		plhs[1] = rendering_parameters_cells.release();
+	} else {
+		output.set(0, meshes[0]);
+		output.set(1, rendering_parameters[0]);
+	}
 };
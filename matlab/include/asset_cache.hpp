@@ -0,0 +1,94 @@
+/*
+ * eos - A 3D Morphable Model fitting library written in modern C++11/14.
+ *
+ * File: matlab/include/asset_cache.hpp
+ *
+ * Copyright 2017 Patrik Huber
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#ifndef ASSET_CACHE_HPP_
+#define ASSET_CACHE_HPP_
+
+#include "boost/filesystem.hpp"
+
+#include <string>
+#include <map>
+#include <memory>
+#include <ctime>
+#include <utility>
+
+/**
+ * @file
+ * @brief A cache that keeps loaded files (models, blendshapes, mappers, ...)
+ * in memory across calls of a mex function.
+ *
+ * A mex file stays loaded between calls (until "clear mex" or "clear functions"),
+ * and so do its static variables. The cache uses that to avoid loading the same
+ * model files from disk on every call.
+ */
+
+namespace eos {
+	namespace matlab {
+
+/**
+ * @brief Caches objects loaded from files, by filename and the file's last
+ * modification time.
+ *
+ * If the file changes on disk, it is loaded again on the next get().
+ *
+ * @tparam T The type of the loaded objects.
+ */
+template <class T>
+class AssetCache
+{
+public:
+	/**
+	 * Returns the object loaded from the given file, loading it with
+	 * \p load if it isn't in the cache or the file has changed.
+	 *
+	 * @param[in] filename The file to load.
+	 * @param[in] load A function T(const std::string&) that loads the file.
+	 * @return The loaded object. Stays valid even if the cache is cleared.
+	 */
+	template <class Loader>
+	std::shared_ptr<const T> get(const std::string& filename, Loader load)
+	{
+		const std::time_t modification_time = boost::filesystem::last_write_time(filename);
+		const auto entry = entries.find(filename);
+		if (entry != std::end(entries) && entry->second.first == modification_time) {
+			return entry->second.second;
+		}
+		auto asset = std::make_shared<const T>(load(filename));
+		entries[filename] = std::make_pair(modification_time, asset);
+		return asset;
+	};
+
+	/**
+	 * Removes all objects from the cache.
+	 */
+	void clear()
+	{
+		entries.clear();
+	};
+
+private:
+	std::map<std::string, std::pair<std::time_t, std::shared_ptr<const T>>> entries;
+};
+
+	} /* namespace matlab */
+} /* namespace eos */
+
+#endif /* ASSET_CACHE_HPP_ */
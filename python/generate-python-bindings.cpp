@@ -18,6 +18,7 @@
  * limitations under the License.
  */
 #include "eos/core/LandmarkMapper.hpp"
+#include "eos/core/ThreadPool.hpp"
 #include "eos/core/Mesh.hpp"
 #include "eos/morphablemodel/PcaModel.hpp"
 #include "eos/morphablemodel/MorphableModel.hpp"
@@ -33,6 +34,7 @@
 
 #include "pybind11/pybind11.h"
 #include "pybind11/stl.h"
+#include "pybind11/numpy.h"
 #include "pybind11/eigen.h"
 #include "pybind11_glm.hpp"
 #include "pybind11_opencv.hpp"
@@ -41,11 +43,74 @@
 #include <stdexcept>
 #include <string>
 #include <algorithm>
+#include <vector>
+#include <tuple>
+#include <cstddef>
 #include <cassert>
 
 namespace py = pybind11;
 using namespace eos;
 
+namespace {
+
+/**
+ * Returns a read-only NumPy array that points to the given float data, instead of
+ * copying it. The array keeps \p owner (the Python object that owns the data) alive.
+ */
+py::array make_readonly_view(const float* data, std::vector<std::size_t> shape, std::vector<std::size_t> strides, py::handle owner)
+{
+	py::array view(py::dtype::of<float>(), shape, strides, data, owner);
+	py::detail::array_proxy(view.ptr())->flags &= ~py::detail::npy_api::NPY_ARRAY_WRITEABLE_;
+	return view;
+};
+
+// A view of an Eigen column-major matrix, as rows x cols array:
+py::array make_readonly_view(Eigen::Map<const Eigen::MatrixXf> matrix, py::handle owner)
+{
+	return make_readonly_view(matrix.data(), { static_cast<std::size_t>(matrix.rows()), static_cast<std::size_t>(matrix.cols()) }, { sizeof(float), static_cast<std::size_t>(matrix.rows()) * sizeof(float) }, owner);
+};
+
+py::array make_readonly_view(Eigen::Map<const Eigen::VectorXf> vector, py::handle owner)
+{
+	return make_readonly_view(vector.data(), { static_cast<std::size_t>(vector.size()) }, { sizeof(float) }, owner);
+};
+
+// A copy of a vector of glm vectors (e.g. Mesh::vertices), as num_vectors x N array. Used instead of
+// a view for the Mesh's members, since they can be re-assigned from Python at any time:
+template<typename GlmVector>
+py::array make_array_copy(const std::vector<GlmVector>& vectors)
+{
+	constexpr std::size_t num_elements = sizeof(GlmVector) / sizeof(float);
+	return py::array(py::dtype::of<float>(), { vectors.size(), num_elements }, { sizeof(GlmVector), sizeof(float) }, vectors.empty() ? nullptr : &vectors[0][0]); // no base, so the data is copied
+};
+
+// A copy of an Eigen column-major matrix, as rows x cols array:
+py::array make_array_copy(Eigen::Map<const Eigen::MatrixXf> matrix)
+{
+	return py::array(py::dtype::of<float>(), { static_cast<std::size_t>(matrix.rows()), static_cast<std::size_t>(matrix.cols()) }, { sizeof(float), static_cast<std::size_t>(matrix.rows()) * sizeof(float) }, matrix.data()); // no base, so the data is copied
+};
+
+// Whether the model computes the requested basis from the other one, because it only stores the
+// other one (\p storage_without_it). That basis is cached in a buffer that the model frees when its
+// storage policy changes, so it must be copied instead of viewed:
+bool is_derived_basis(const morphablemodel::PcaModel& model, morphablemodel::PcaBasisStorage storage_without_it)
+{
+	return !model.has_external_storage() && model.get_basis_storage() == storage_without_it;
+};
+
+core::LandmarkCollection<cv::Vec2f> to_landmark_collection(const std::vector<glm::vec2>& landmarks, const std::vector<std::string>& landmark_ids)
+{
+	assert(landmarks.size() == landmark_ids.size());
+	core::LandmarkCollection<cv::Vec2f> landmark_collection;
+	for (std::size_t i = 0; i < landmarks.size(); ++i)
+	{
+		landmark_collection.push_back(core::Landmark<cv::Vec2f>{ landmark_ids[i], cv::Vec2f(landmarks[i].x, landmarks[i].y) });
+	}
+	return landmark_collection;
+};
+
+} /* unnamed namespace */
+
 /**
  * Generate python bindings for the eos library using pybind11.
  */
@@ -56,7 +121,7 @@ PYBIND11_PLUGIN(eos) {
 	 * Bindings for the eos::core namespace:
 	 *  - LandmarkMapper
 	 *  - Mesh
-	 *  - write_obj()
+	 *  - write_obj(), write_ply()
 	 */
 	py::module core_module = eos_module.def_submodule("core", "Essential functions and classes to work with 3D face models and landmarks.");
 	py::class_<core::LandmarkMapper>(core_module, "LandmarkMapper", "Represents a mapping from one kind of landmarks to a different format(e.g.model vertices).")
@@ -75,6 +140,9 @@ PYBIND11_PLUGIN(eos) {
 		.def_readwrite("colors", &core::Mesh::colors, "Colour data")
 		.def_readwrite("tci", &core::Mesh::tci, "Triangle colour indices (usually the same as tvi)")
 		.def_readwrite("texcoords", &core::Mesh::texcoords, "Texture coordinates")
+		.def_property_readonly("vertex_array", [](const core::Mesh& mesh) { return make_array_copy(mesh.vertices); }, "A copy of the vertices, as N x 4 array.")
+		.def_property_readonly("color_array", [](const core::Mesh& mesh) { return make_array_copy(mesh.colors); }, "A copy of the colours, as N x 3 array.")
+		.def_property_readonly("texcoord_array", [](const core::Mesh& mesh) { return make_array_copy(mesh.texcoords); }, "A copy of the texture coordinates, as N x 2 array.")
 		.def("__getstate__", [](const core::Mesh &p) {
 			/* Return a tuple that fully encodes the state of the object */
 			return py::make_tuple(p.vertices, p.colors, p.texcoords, p.tvi, p.tci);
@@ -94,6 +162,7 @@ PYBIND11_PLUGIN(eos) {
 		});
 
 	core_module.def("write_obj", &core::write_obj, "Writes the given Mesh to an obj file.", py::arg("mesh"), py::arg("filename"));
+	core_module.def("write_ply", &core::write_ply, "Writes the given Mesh to a binary ply file.", py::arg("mesh"), py::arg("filename"));
 
 	/**
 	 * Bindings for the eos::morphablemodel namespace:
@@ -110,27 +179,34 @@ PYBIND11_PLUGIN(eos) {
 		.def("get_num_principal_components", &morphablemodel::PcaModel::get_num_principal_components, "Returns the number of principal components in the model.")
 		.def("get_data_dimension", &morphablemodel::PcaModel::get_data_dimension, "Returns the dimension of the data, i.e. the number of shape dimensions.")
 		.def("get_triangle_list", &morphablemodel::PcaModel::get_triangle_list, "Returns a list of triangles on how to assemble the vertices into a mesh.")
-		.def("get_mean", &morphablemodel::PcaModel::get_mean, "Returns the mean of the model.")
+		.def("get_mean", [](py::object self) { return make_readonly_view(self.cast<const morphablemodel::PcaModel&>().get_mean(), self); }, "Returns the mean of the model, as read-only view of the model's data.")
 		.def("get_mean_at_point", &morphablemodel::PcaModel::get_mean_at_point, "Return the value of the mean at a given vertex index.", py::arg("vertex_index"))
-		.def("get_orthonormal_pca_basis", [](const morphablemodel::PcaModel& m) { return m.get_orthonormal_pca_basis(); }, "Returns the orthonormal PCA basis matrix, i.e. the eigenvectors. Each column of the matrix is an eigenvector.") // use py::overload in VS2017
-		.def("get_rescaled_pca_basis", [](const morphablemodel::PcaModel& m) { return m.get_rescaled_pca_basis(); }, "Returns the rescaled PCA basis matrix, i.e. the eigenvectors. Each column of the matrix is an eigenvector, and each eigenvector has been rescaled by multiplying it with the square root of its eigenvalue.") // use py::overload in VS2017
-		.def("get_eigenvalues", &morphablemodel::PcaModel::get_eigenvalues, "Returns the models eigenvalues.")
+		.def("get_orthonormal_pca_basis", [](py::object self) {
+				const auto& model = self.cast<const morphablemodel::PcaModel&>();
+				return is_derived_basis(model, morphablemodel::PcaBasisStorage::RescaledOnly) ? make_array_copy(model.get_orthonormal_pca_basis()) : make_readonly_view(model.get_orthonormal_pca_basis(), self);
+			}, "Returns the orthonormal PCA basis matrix, i.e. the eigenvectors, as read-only view of the model's data (or as a copy, if the model only stores the rescaled basis). Each column of the matrix is an eigenvector.")
+		.def("get_rescaled_pca_basis", [](py::object self) {
+				const auto& model = self.cast<const morphablemodel::PcaModel&>();
+				return is_derived_basis(model, morphablemodel::PcaBasisStorage::OrthonormalOnly) ? make_array_copy(model.get_rescaled_pca_basis()) : make_readonly_view(model.get_rescaled_pca_basis(), self);
+			}, "Returns the rescaled PCA basis matrix, i.e. the eigenvectors, as read-only view of the model's data (or as a copy, if the model only stores the orthonormal basis). Each column of the matrix is an eigenvector, and each eigenvector has been rescaled by multiplying it with the square root of its eigenvalue.")
+		.def("get_eigenvalues", [](py::object self) { return make_readonly_view(self.cast<const morphablemodel::PcaModel&>().get_eigenvalues(), self); }, "Returns the models eigenvalues, as read-only view of the model's data.")
 		.def("draw_sample", (Eigen::VectorXf(morphablemodel::PcaModel::*)(std::vector<float>) const)&morphablemodel::PcaModel::draw_sample, "Returns a sample from the model with the given PCA coefficients. The given coefficients should follow a standard normal distribution, i.e. not be scaled with their eigenvalues/variances.", py::arg("coefficients"))
+		.def("draw_samples", [](const morphablemodel::PcaModel& m, const Eigen::MatrixXf& coefficients) { return m.draw_samples(coefficients); }, "Returns many samples from the model at once, one per column of the given K x M coefficients matrix, as 3V x M matrix.", py::arg("coefficients"))
 		;
 
 	py::class_<morphablemodel::MorphableModel>(morphablemodel_module, "MorphableModel", "A class representing a 3D Morphable Model, consisting of a shape- and colour (albedo) PCA model, as well as texture (uv) coordinates.")
 		.def(py::init<morphablemodel::PcaModel, morphablemodel::PcaModel, std::vector<std::array<double, 2>>>(), "Create a Morphable Model from a shape and a colour PCA model, and optional texture coordinates.", py::arg("shape_model"), py::arg("color_model"), py::arg("texture_coordinates") = std::vector<std::array<double, 2>>())
-		.def("get_shape_model", [](const morphablemodel::MorphableModel& m) { return m.get_shape_model(); }, "Returns the PCA shape model of this Morphable Model.") // Not sure if that'll really be const in Python? I think Python does a copy each time this gets called?
-		.def("get_color_model", [](const morphablemodel::MorphableModel& m) { return m.get_color_model(); }, "Returns the PCA colour (albedo) model of this Morphable Model.") // (continued from above:) We may want to use py::overload, but in any case, we need to tell pybind11 if it should use the const or non-const overload.
+		.def("get_shape_model", &morphablemodel::MorphableModel::get_shape_model, py::return_value_policy::reference_internal, "Returns the PCA shape model of this Morphable Model. It is a reference to the model's PCA model (not a copy), and keeps the Morphable Model alive.")
+		.def("get_color_model", &morphablemodel::MorphableModel::get_color_model, py::return_value_policy::reference_internal, "Returns the PCA colour (albedo) model of this Morphable Model. It is a reference to the model's PCA model (not a copy), and keeps the Morphable Model alive.")
 		.def("get_mean", &morphablemodel::MorphableModel::get_mean, "Returns the mean of the shape- and colour model as a Mesh.")
 		.def("draw_sample", (core::Mesh(morphablemodel::MorphableModel::*)(std::vector<float>, std::vector<float>) const)&morphablemodel::MorphableModel::draw_sample, "Returns a sample from the model with the given shape- and colour PCA coefficients.", py::arg("shape_coefficients"), py::arg("color_coefficients"))
 		.def("has_color_model", &morphablemodel::MorphableModel::has_color_model, "Returns true if this Morphable Model contains a colour model, and false if it is a shape-only model.")
 		.def("get_texture_coordinates", &morphablemodel::MorphableModel::get_texture_coordinates, "Returns the texture coordinates for all the vertices in the model.")
 		;
 
-	morphablemodel_module.def("load_model", &morphablemodel::load_model, "Load a Morphable Model from a cereal::BinaryInputArchive (.bin) from the harddisk.", py::arg("filename"));
+	morphablemodel_module.def("load_model", [](std::string filename) { return morphablemodel::load_model(filename); }, "Load a Morphable Model from a cereal::BinaryInputArchive (.bin) from the harddisk.", py::arg("filename"));
 	morphablemodel_module.def("save_model", &morphablemodel::save_model, "Save a Morphable Model as cereal::BinaryOutputArchive.", py::arg("model"), py::arg("filename"));
-	morphablemodel_module.def("load_pca_model", &morphablemodel::load_pca_model, "Load a PCA model from a cereal::BinaryInputArchive (.bin) from the harddisk.", py::arg("filename"));
+	morphablemodel_module.def("load_pca_model", [](std::string filename) { return morphablemodel::load_pca_model(filename); }, "Load a PCA model from a cereal::BinaryInputArchive (.bin) from the harddisk.", py::arg("filename"));
 	morphablemodel_module.def("save_pca_model", &morphablemodel::save_pca_model, "Save a PCA model as cereal::BinaryOutputArchive.", py::arg("model"), py::arg("filename"));
 
 	/**
@@ -166,10 +242,12 @@ PYBIND11_PLUGIN(eos) {
 	/**
 	 *  - EdgeTopology
 	 *  - load_edge_topology()
+	 *  - create_edge_topology()
 	 */
 	py::class_<morphablemodel::EdgeTopology>(morphablemodel_module, "EdgeTopology", "A struct containing a 3D shape model's edge topology.");
 
 	morphablemodel_module.def("load_edge_topology", &morphablemodel::load_edge_topology, "Load a 3DMM edge topology file from a json file.", py::arg("filename"));
+	morphablemodel_module.def("create_edge_topology", &morphablemodel::create_edge_topology, "Computes the edge topology of a mesh from its triangle list, e.g. PcaModel.get_triangle_list().", py::arg("triangle_list"));
 
 	/**
 	 * Bindings for the eos::fitting namespace:
@@ -179,6 +257,8 @@ PYBIND11_PLUGIN(eos) {
 	 *  - ContourLandmarks
 	 *  - ModelContour
 	 *  - fit_shape_and_pose()
+	 *  - fit_shape_and_pose_batch()
+	 *  - fit_pose()
 	 */
 	py::module fitting_module = eos_module.def_submodule("fitting", "Pose and shape fitting of a 3D Morphable Model.");
 
@@ -251,28 +331,46 @@ PYBIND11_PLUGIN(eos) {
 		// We can change this to std::optional as soon as we switch to VS2017 and pybind supports std::optional
 		const boost::optional<int> num_shape_coefficients_opt = num_shape_coefficients_to_fit == -1 ? boost::none : boost::optional<int>(num_shape_coefficients_to_fit);
 		std::vector<core::LandmarkCollection<cv::Vec2f>> landmark_collections;
-		for (int j = 0; j < landmarkss.size(); ++j) {
-			core::LandmarkCollection<cv::Vec2f > landmark_collection;
-			for (int i = 0; i < landmarkss[j].size(); ++i)
-			{
-				landmark_collection.push_back(core::Landmark<cv::Vec2f>{ landmark_ids[i], cv::Vec2f(landmarkss[j][i].x, landmarkss[j][i].y) });
-			}
-			landmark_collections.push_back(landmark_collection);
+		for (const auto& landmarks : landmarkss) {
+			landmark_collections.push_back(to_landmark_collection(landmarks, landmark_ids));
 		}
 
+		py::gil_scoped_release release; // the fitting doesn't touch any Python objects
 		auto result = fitting::fit_shape_and_pose_multi(morphable_model, blendshapes, landmark_collections, landmark_mapper, image_widths, image_heights, edge_topology, contour_landmarks, model_contour, num_iterations, num_shape_coefficients_opt, lambda, boost::none, pca_shape_coefficients, blendshape_coefficients, fitted_image_points);
 		return std::make_tuple(result.first, result.second, pca_shape_coefficients, blendshape_coefficients);
 	}, "Fit the pose (camera), shape model, and expression blendshapes to landmarks, in an iterative way. Returns a tuple (mesh, rendering_parameters, shape_coefficients, blendshape_coefficients).", py::arg("morphable_model"), py::arg("blendshapes"), py::arg("landmarks"), py::arg("landmark_ids"), py::arg("landmark_mapper"), py::arg("image_width"), py::arg("image_height"), py::arg("edge_topology"), py::arg("contour_landmarks"), py::arg("model_contour"), py::arg("num_iterations") = 5, py::arg("num_shape_coefficients_to_fit") = -1, py::arg("lambda") = 30.0f, py::arg("pca_shape_coefficients") = std::vector<float>(), py::arg("blendshape_coefficients") = std::vector<std::vector<float>>())
 		;
-	fitting_module.def("fit_pose", [](const morphablemodel::MorphableModel& morphable_model, std::vector<glm::vec2>& landmarks, const std::vector<std::string>& landmark_ids, const core::LandmarkMapper& landmark_mapper, int image_width, int image_height, std::vector<float> pca_shape_coefficients, const std::vector<morphablemodel::Blendshape>& blendshapes, std::vector<float> blendshape_coefficients) {
-		assert(landmarks.size() == landmark_ids.size());
-		
-		core::LandmarkCollection<cv::Vec2f > landmark_collection;
-		for (int i = 0; i < landmarks.size(); ++i)
+	fitting_module.def("fit_shape_and_pose_batch", [](const morphablemodel::MorphableModel& morphable_model, const std::vector<morphablemodel::Blendshape>& blendshapes, const std::vector<std::vector<glm::vec2>>& landmarkss, const std::vector<std::string>& landmark_ids, const core::LandmarkMapper& landmark_mapper, std::vector<int> image_widths, std::vector<int> image_heights, const morphablemodel::EdgeTopology& edge_topology, const fitting::ContourLandmarks& contour_landmarks, const fitting::ModelContour& model_contour, int num_iterations, int num_shape_coefficients_to_fit, float lambda, int num_threads) {
+		if (image_widths.size() != landmarkss.size() || image_heights.size() != landmarkss.size()) {
+			throw std::runtime_error("fit_shape_and_pose_batch: Expected one image width and height per face.");
+		}
+		const boost::optional<int> num_shape_coefficients_opt = num_shape_coefficients_to_fit == -1 ? boost::none : boost::optional<int>(num_shape_coefficients_to_fit);
+		const int num_faces = static_cast<int>(landmarkss.size());
+		std::vector<core::LandmarkCollection<cv::Vec2f>> landmark_collections;
+		for (const auto& landmarks : landmarkss) {
+			landmark_collections.push_back(to_landmark_collection(landmarks, landmark_ids));
+		}
+
+		using Result = std::tuple<core::Mesh, fitting::RenderingParameters, std::vector<float>, std::vector<float>>;
+		std::vector<Result> results(num_faces);
 		{
-			landmark_collection.push_back(core::Landmark<cv::Vec2f>{ landmark_ids[i], cv::Vec2f(landmarks[i].x, landmarks[i].y) });
+			py::gil_scoped_release release;
+			core::ThreadPool thread_pool(num_threads);
+			thread_pool.parallel_for(0, num_faces, [&](int i, int /* thread_index */) {
+				std::vector<float> pca_shape_coefficients;
+				std::vector<float> blendshape_coefficients;
+				std::vector<cv::Vec2f> fitted_image_points;
+				auto result = fitting::fit_shape_and_pose(morphable_model, blendshapes, landmark_collections[i], landmark_mapper, image_widths[i], image_heights[i], edge_topology, contour_landmarks, model_contour, num_iterations, num_shape_coefficients_opt, lambda, boost::none, pca_shape_coefficients, blendshape_coefficients, fitted_image_points);
+				results[i] = Result(std::move(result.first), result.second, std::move(pca_shape_coefficients), std::move(blendshape_coefficients));
+			});
 		}
+		return results;
+	}, "Fits the pose, shape and expression of many faces independently of each other (each face is a different person), in parallel. Returns a list with a tuple (mesh, rendering_parameters, shape_coefficients, blendshape_coefficients) per face.", py::arg("morphable_model"), py::arg("blendshapes"), py::arg("landmarks"), py::arg("landmark_ids"), py::arg("landmark_mapper"), py::arg("image_widths"), py::arg("image_heights"), py::arg("edge_topology"), py::arg("contour_landmarks"), py::arg("model_contour"), py::arg("num_iterations") = 5, py::arg("num_shape_coefficients_to_fit") = -1, py::arg("lambda") = 30.0f, py::arg("num_threads") = 0)
+		;
+	fitting_module.def("fit_pose", [](const morphablemodel::MorphableModel& morphable_model, std::vector<glm::vec2>& landmarks, const std::vector<std::string>& landmark_ids, const core::LandmarkMapper& landmark_mapper, int image_width, int image_height, std::vector<float> pca_shape_coefficients, const std::vector<morphablemodel::Blendshape>& blendshapes, std::vector<float> blendshape_coefficients) {
+		const auto landmark_collection = to_landmark_collection(landmarks, landmark_ids);
 
+		py::gil_scoped_release release;
 		auto result = fitting::fit_pose(morphable_model, blendshapes, landmark_collection, landmark_mapper, image_width, image_height, pca_shape_coefficients, blendshape_coefficients);
 		return result;
 	}, "Fit the pose (camera) to landmarks. Returns the rendering_parameters.", py::arg("morphable_model"), py::arg("landmarks"), py::arg("landmark_ids"), py::arg("landmark_mapper"), py::arg("image_width"), py::arg("image_height"), py::arg("pca_shape_coefficients"), py::arg("blendshapes") = std::vector<morphablemodel::Blendshape>(), py::arg("blendshape_coefficients") = std::vector<float>())
@@ -285,6 +383,7 @@ PYBIND11_PLUGIN(eos) {
 	py::module render_module = eos_module.def_submodule("render", "3D mesh and texture extraction functionality.");
         
 	render_module.def("extract_texture", [](const core::Mesh& mesh, const fitting::RenderingParameters& rendering_params, cv::Mat image, bool compute_view_angle, int isomap_resolution) {
+		py::gil_scoped_release release; // image points into the NumPy array, which the argument keeps alive
 		cv::Mat affine_from_ortho = fitting::get_3x4_affine_camera_matrix(rendering_params, image.cols, image.rows);
 		return render::extract_texture(mesh, affine_from_ortho, image, compute_view_angle, render::TextureInterpolation::NearestNeighbour, isomap_resolution);
 	}, "Extracts the texture of the face from the given image and stores it as isomap (a rectangular texture map).", py::arg("mesh"), py::arg("rendering_params"), py::arg("image"), py::arg("compute_view_angle") = false, py::arg("isomap_resolution") = 512);
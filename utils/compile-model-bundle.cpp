@@ -0,0 +1,116 @@
+/*
+ * eos - A 3D Morphable Model fitting library written in modern C++11/14.
+ *
+ * File: utils/compile-model-bundle.cpp
+ *
+ * Copyright 2015 Patrik Huber
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "eos/core/LandmarkMapper.hpp"
+#include "eos/morphablemodel/MorphableModel.hpp"
+#include "eos/morphablemodel/Blendshape.hpp"
+#include "eos/morphablemodel/EdgeTopology.hpp"
+#include "eos/fitting/contour_correspondence.hpp"
+#include "eos/fitting/model_bundle.hpp"
+#include "eos/render/IsomapPlan.hpp"
+
+#include "boost/program_options.hpp"
+#include "boost/filesystem.hpp"
+
+#include <vector>
+#include <iostream>
+#include <stdexcept>
+
+using namespace eos;
+namespace po = boost::program_options;
+namespace fs = boost::filesystem;
+using std::cout;
+using std::endl;
+
+/**
+ * Compiles a Morphable Model, blendshapes, landmark mappings, edge topology and
+ * contour definitions into one memory-mappable model bundle, which can be loaded
+ * with fitting::load_model_bundle().
+ */
+int main(int argc, char *argv[])
+{
+	fs::path modelfile, blendshapesfile, mappingsfile, edgetopologyfile, contourfile, outputfile;
+	int isomap_resolution;
+	try {
+		po::options_description desc("Allowed options");
+		desc.add_options()
+			("help,h",
+				"display the help message")
+			("model,m", po::value<fs::path>(&modelfile)->required()->default_value("../share/sfm_shape_3448.bin"),
+				"a Morphable Model stored as cereal BinaryArchive")
+			("blendshapes,b", po::value<fs::path>(&blendshapesfile)->required()->default_value("../share/expression_blendshapes_3448.bin"),
+				"file with blendshapes")
+			("mapping,p", po::value<fs::path>(&mappingsfile)->required()->default_value("../share/ibug_to_sfm.txt"),
+				"landmark identifier to model vertex number mapping, which also contains the contour landmarks")
+			("model-contour,c", po::value<fs::path>(&contourfile)->required()->default_value("../share/model_contours.json"),
+				"file with model contour indices")
+			("edge-topology,e", po::value<fs::path>(&edgetopologyfile),
+				"optional file with model's precomputed edge topology. If not given, it is computed from the model's triangle list")
+			("isomap-resolution,r", po::value<int>(&isomap_resolution)->default_value(0),
+				"if > 0, an isomap plan with this resolution is computed and stored in the bundle as well")
+			("output,o", po::value<fs::path>(&outputfile)->required()->default_value("model_bundle.bin"),
+				"output filename for the model bundle")
+			;
+		po::variables_map vm;
+		po::store(po::command_line_parser(argc, argv).options(desc).run(), vm);
+		if (vm.count("help")) {
+			cout << "Usage: compile-model-bundle [options]" << endl;
+			cout << desc;
+			return EXIT_SUCCESS;
+		}
+		po::notify(vm);
+	}
+	catch (const po::error& e) {
+		cout << "Error while parsing command-line arguments: " << e.what() << endl;
+		cout << "Use --help to display a list of options." << endl;
+		return EXIT_FAILURE;
+	}
+
+	fitting::ModelBundle bundle;
+	try {
+		bundle.morphable_model = morphablemodel::load_model(modelfile.string());
+		bundle.blendshapes = morphablemodel::load_blendshapes(blendshapesfile.string());
+		bundle.landmark_mapper = core::LandmarkMapper(mappingsfile);
+		if (edgetopologyfile.empty()) {
+			bundle.edge_topology = morphablemodel::create_edge_topology(bundle.morphable_model.get_shape_model().get_triangle_list());
+		}
+		else {
+			bundle.edge_topology = morphablemodel::load_edge_topology(edgetopologyfile.string());
+		}
+		bundle.contour_landmarks = fitting::ContourLandmarks::load(mappingsfile.string());
+		bundle.model_contour = fitting::ModelContour::load(contourfile.string());
+	}
+	catch (const std::runtime_error& e) {
+		cout << "Error loading the input files: " << e.what() << endl;
+		return EXIT_FAILURE;
+	}
+	if (isomap_resolution > 0)
+	{
+		if (bundle.morphable_model.get_texture_coordinates().empty()) {
+			cout << "The model has no texture coordinates, cannot compute an isomap plan." << endl;
+			return EXIT_FAILURE;
+		}
+		bundle.isomap_plan = render::create_isomap_plan(bundle.morphable_model.get_mean(), isomap_resolution);
+	}
+
+	fitting::save_model_bundle(bundle, outputfile.string());
+
+	cout << "Saved the model bundle as " << outputfile.string() << "." << endl;
+	return EXIT_SUCCESS;
+}